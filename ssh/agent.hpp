@@ -69,7 +69,31 @@ public:
             m_agent->agent_ptr(), m_agent->session_ptr(), user_name.c_str(),
             m_identity);
     }
-        
+
+    /**
+     * The identity's public key as a raw binary blob.
+     *
+     * The blob is the same as the server sees when authenticating with this
+     * identity so it uniquely identifies the key across agent sessions
+     * (unlike the identity's position in the agent).
+     */
+    std::string public_key() const
+    {
+        return std::string(
+            reinterpret_cast<const char*>(m_identity->blob),
+            m_identity->blob_len);
+    }
+
+    /**
+     * Comment the agent stored with this identity.  Usually the key's
+     * filename.
+     */
+    std::string comment() const
+    {
+        return (m_identity->comment) ?
+            std::string(m_identity->comment) : std::string();
+    }
+
 private:
 
     boost::shared_ptr<detail::agent_state> m_agent;
@@ -0,0 +1,290 @@
+/**
+    @file
+
+    Limiting how fast transfers use the network.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_BANDWIDTH_HPP
+#define SSH_BANDWIDTH_HPP
+
+#include <boost/cstdint.hpp> // int64_t, uintmax_t
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+                                             // microsec_clock, time_duration
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp> // sleep
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // min
+#include <stdexcept> // invalid_argument
+#include <vector>
+
+namespace ssh {
+
+/**
+ * Transfer rate that can vary with the time of day.
+ *
+ * Rates are in bytes per second, with 0 meaning unlimited.
+ */
+class bandwidth_schedule
+{
+public:
+
+    /**
+     * @param rate  Rate at times not covered by any period.
+     */
+    explicit bandwidth_schedule(boost::uintmax_t rate=0)
+        : m_default_rate(rate) {}
+
+    /**
+     * Use a different rate from `start` until `end` every day.
+     *
+     * An `end` earlier than `start` makes a period spanning midnight.
+     * Where periods overlap, the one added last wins.
+     */
+    bandwidth_schedule& between(
+        boost::posix_time::time_duration start,
+        boost::posix_time::time_duration end, boost::uintmax_t rate)
+    {
+        if (!is_time_of_day(start) || !is_time_of_day(end))
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Period must be within one day"));
+
+        if (start == end)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Period must not be empty"));
+
+        m_periods.push_back(period(start, end, rate));
+        return *this;
+    }
+
+    boost::uintmax_t rate_at(
+        boost::posix_time::time_duration time_of_day) const
+    {
+        for (std::vector<period>::const_reverse_iterator it =
+                m_periods.rbegin(); it != m_periods.rend(); ++it)
+        {
+            if (it->covers(time_of_day))
+                return it->rate;
+        }
+
+        return m_default_rate;
+    }
+
+private:
+
+    struct period
+    {
+        period(
+            boost::posix_time::time_duration start,
+            boost::posix_time::time_duration end, boost::uintmax_t rate)
+            : start(start), end(end), rate(rate) {}
+
+        bool covers(boost::posix_time::time_duration time_of_day) const
+        {
+            if (start < end)
+                return start <= time_of_day && time_of_day < end;
+            else
+                return start <= time_of_day || time_of_day < end;
+        }
+
+        boost::posix_time::time_duration start;
+        boost::posix_time::time_duration end;
+        boost::uintmax_t rate;
+    };
+
+    static bool is_time_of_day(boost::posix_time::time_duration time)
+    {
+        return !time.is_negative() && time < boost::posix_time::hours(24);
+    }
+
+    boost::uintmax_t m_default_rate;
+    std::vector<period> m_periods;
+};
+
+namespace detail {
+
+/**
+ * The bookkeeping of bandwidth_limiter, told the time rather than reading
+ * the clock, so it can be tested without waiting.
+ */
+class token_bucket
+{
+public:
+
+    explicit token_bucket(boost::posix_time::ptime now)
+        : m_tokens(0), m_last_refill(now) {}
+
+    /**
+     * Account for `bytes` transferred at time `now` under `rate`.
+     *
+     * @returns  How long the transfer must wait to get back within the rate.
+     */
+    boost::posix_time::time_duration consume(
+        boost::uintmax_t bytes, boost::uintmax_t rate,
+        boost::posix_time::ptime now)
+    {
+        double elapsed = (now - m_last_refill).total_microseconds() / 1e6;
+        m_last_refill = now;
+
+        if (rate == 0)
+        {
+            // Start from empty if a limit comes back
+            m_tokens = 0;
+            return boost::posix_time::time_duration();
+        }
+
+        double burst = rate / 4.0;
+        m_tokens = (std::min)(burst, m_tokens + elapsed * rate);
+
+        // Going into debt lets a transfer larger than the burst through,
+        // after which it waits to pay the debt back.  Later transfers find
+        // the debt and wait behind it.
+        m_tokens -= static_cast<double>(bytes);
+        if (m_tokens < 0)
+        {
+            return boost::posix_time::microseconds(
+                static_cast<boost::int64_t>(-m_tokens / rate * 1e6));
+        }
+        else
+        {
+            return boost::posix_time::time_duration();
+        }
+    }
+
+private:
+
+    /// Bytes that may go without waiting; negative when in debt
+    double m_tokens;
+    boost::posix_time::ptime m_last_refill;
+};
+
+}
+
+/**
+ * Token bucket holding transfers to a scheduled rate.
+ *
+ * Transfers report what they have moved and are made to wait long enough
+ * to bring their average back down to the rate.  After a quiet spell, up to
+ * a quarter of a second's worth may go through without waiting.
+ *
+ * A limiter with a parent holds transfers to both rates, so one limiter
+ * per host can share a parent that limits every host together.
+ *
+ * The schedule can be changed at any time, from any thread.
+ */
+class bandwidth_limiter : private boost::noncopyable
+{
+public:
+
+    explicit bandwidth_limiter(
+        const bandwidth_schedule& schedule=bandwidth_schedule(),
+        boost::shared_ptr<bandwidth_limiter> parent=
+            boost::shared_ptr<bandwidth_limiter>())
+        :
+        m_schedule(schedule), m_parent(parent),
+        m_bucket(boost::posix_time::microsec_clock::universal_time())
+    {}
+
+    void set_schedule(const bandwidth_schedule& schedule)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        m_schedule = schedule;
+    }
+
+    /**
+     * Use the same rate all day.
+     */
+    void set_rate(boost::uintmax_t rate)
+    {
+        set_schedule(bandwidth_schedule(rate));
+    }
+
+    /**
+     * Rate the schedule sets for now, not counting any parent.
+     */
+    boost::uintmax_t current_rate() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        return scheduled_rate();
+    }
+
+    /**
+     * Account for `bytes` just transferred, waiting if they took the
+     * transfer over the rate.
+     *
+     * Don't call while holding anything other transfers need.
+     */
+    void consume(boost::uintmax_t bytes)
+    {
+        boost::posix_time::time_duration wait;
+
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            wait = m_bucket.consume(
+                bytes, scheduled_rate(),
+                boost::posix_time::microsec_clock::universal_time());
+        }
+
+        if (wait > boost::posix_time::time_duration())
+        {
+            boost::this_thread::sleep(wait);
+        }
+
+        if (m_parent)
+        {
+            m_parent->consume(bytes);
+        }
+    }
+
+private:
+
+    boost::uintmax_t scheduled_rate() const
+    {
+        return m_schedule.rate_at(
+            boost::posix_time::microsec_clock::local_time().time_of_day());
+    }
+
+    mutable boost::mutex m_mutex;
+    bandwidth_schedule m_schedule;
+    boost::shared_ptr<bandwidth_limiter> m_parent;
+    detail::token_bucket m_bucket;
+};
+
+} // namespace ssh
+
+#endif
@@ -0,0 +1,401 @@
+/**
+    @file
+
+    Recently seen file attributes, kept to save asking the server again.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_ATTRIBUTE_CACHE_HPP
+#define SSH_DETAIL_ATTRIBUTE_CACHE_HPP
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm> // max
+#include <cstddef> // size_t
+#include <map>
+#include <string>
+
+#include <libssh2_sftp.h> // LIBSSH2_SFTP_ATTRIBUTES
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Don't bother sweeping expired entries out of the cache until it has at
+ * least this many.
+ */
+const std::size_t ATTRIBUTE_CACHE_MIN_SWEEP = 1024;
+
+/**
+ * File attributes, and the absence of files, recently reported by the
+ * server.
+ *
+ * Entries are only trusted for a limited time as anything else using the
+ * server can change the files.  Changes made through the same filesystem
+ * must be reported with `invalidate`.
+ *
+ * Two kinds of entry are kept: the attributes of the path itself (lstat,
+ * which is also what directory listings report) and the attributes of
+ * whatever a path leads to (stat).  The first also answers the second for
+ * anything that isn't a link.
+ *
+ * Starts disabled, in which case it remembers nothing.
+ */
+class attribute_cache : private boost::noncopyable
+{
+public:
+
+    enum lookup_result
+    {
+        miss,
+        found,
+        missing ///< Server recently said there was no such file
+    };
+
+    attribute_cache()
+        :
+        m_max_staleness(boost::posix_time::seconds(0)),
+        m_negative_lifetime(boost::posix_time::seconds(0)),
+        m_hits(0U), m_misses(0U), m_next_sweep(ATTRIBUTE_CACHE_MIN_SWEEP) {}
+
+    /**
+     * Start caching, or stop if `max_staleness` is zero.
+     *
+     * Anything already cached is forgotten.
+     */
+    void configure(
+        const boost::posix_time::time_duration& max_staleness,
+        const boost::posix_time::time_duration& negative_lifetime)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        m_max_staleness = max_staleness;
+        m_negative_lifetime = negative_lifetime;
+        m_entries.clear();
+        m_followed.clear();
+        m_next_sweep = ATTRIBUTE_CACHE_MIN_SWEEP;
+    }
+
+    bool enabled() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        return is_enabled();
+    }
+
+    /**
+     * Look for the attributes of `path`, or of what it leads to if
+     * `follow_links`.
+     *
+     * @param attributes  Set to the cached attributes if `found`.
+     * @param ec          Set to why there is no such file if `missing`.
+     * @param message     Set alongside `ec`.
+     */
+    lookup_result find(
+        const std::string& path, bool follow_links,
+        LIBSSH2_SFTP_ATTRIBUTES& attributes, boost::system::error_code& ec,
+        std::string& message)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        if (!is_enabled())
+            return miss;
+
+        std::string key = key_for(path);
+        boost::posix_time::ptime time = now();
+
+        const entry* cached = NULL;
+        if (follow_links)
+        {
+            cached = fresh(m_followed, key, time);
+        }
+
+        if (!cached)
+        {
+            cached = fresh(m_entries, key, time);
+
+            // What a link leads to can't be had from the link itself
+            if (cached && follow_links && cached->exists &&
+                is_link(cached->attributes))
+            {
+                cached = NULL;
+            }
+        }
+
+        if (!cached)
+        {
+            ++m_misses;
+            return miss;
+        }
+
+        ++m_hits;
+
+        if (cached->exists)
+        {
+            attributes = cached->attributes;
+            return found;
+        }
+        else
+        {
+            ec = cached->error;
+            message = cached->message;
+            return missing;
+        }
+    }
+
+    void store(
+        const std::string& path, bool follow_links,
+        const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+    {
+        // Without the permissions we can't tell the file type, which is
+        // mostly what we're asked for
+        if (!(attributes.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS))
+            return;
+
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        if (!is_enabled())
+            return;
+
+        entry& cached = entry_for(path, follow_links);
+        cached.exists = true;
+        cached.attributes = attributes;
+        cached.error.clear();
+        cached.message.clear();
+        cached.expires = now() + m_max_staleness;
+    }
+
+    /**
+     * Remember that the server said there is no such file.
+     */
+    void store_missing(
+        const std::string& path, bool follow_links,
+        const boost::system::error_code& ec, const std::string& message)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        if (!is_enabled() ||
+            m_negative_lifetime <= boost::posix_time::seconds(0))
+            return;
+
+        entry& cached = entry_for(path, follow_links);
+        cached.exists = false;
+        cached.error = ec;
+        cached.message = message;
+        cached.expires = now() + m_negative_lifetime;
+    }
+
+    /**
+     * Forget what we know about a path that is being changed.
+     *
+     * Also forgets everything below it, in case it's a directory being
+     * removed or renamed, and the directories above it, which may be created
+     * along with it and whose modification times change with their
+     * contents.  As links anywhere might lead to the path, everything known
+     * about link targets is forgotten too.
+     */
+    void invalidate(const std::string& path)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        if (!is_enabled())
+            return;
+
+        std::string key = key_for(path);
+
+        m_followed.clear();
+
+        for (std::string ancestor = key; !ancestor.empty();
+            ancestor = parent_of(ancestor))
+        {
+            m_entries.erase(ancestor);
+
+            if (ancestor == "/")
+                break;
+        }
+        m_entries.erase(std::string()); // the default directory
+
+        std::string prefix = (key == "/") ? key : key + "/";
+        entry_map::iterator it = m_entries.lower_bound(prefix);
+        while (it != m_entries.end() &&
+            it->first.compare(0, prefix.size(), prefix) == 0)
+        {
+            m_entries.erase(it++);
+        }
+    }
+
+    /**
+     * Number of lookups answered without asking the server.
+     */
+    boost::uintmax_t hits() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        return m_hits;
+    }
+
+    /**
+     * Number of lookups the server had to answer.
+     */
+    boost::uintmax_t misses() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        return m_misses;
+    }
+
+private:
+
+    struct entry
+    {
+        entry() : exists(false), attributes(LIBSSH2_SFTP_ATTRIBUTES()) {}
+
+        bool exists;
+        LIBSSH2_SFTP_ATTRIBUTES attributes;
+        boost::system::error_code error;
+        std::string message;
+        boost::posix_time::ptime expires;
+    };
+
+    // Ordered so that everything below a directory can be found together
+    typedef std::map<std::string, entry> entry_map;
+
+    bool is_enabled() const
+    {
+        return m_max_staleness > boost::posix_time::seconds(0);
+    }
+
+    static boost::posix_time::ptime now()
+    {
+        return boost::posix_time::microsec_clock::universal_time();
+    }
+
+    static bool is_link(const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+    {
+        return (attributes.permissions & LIBSSH2_SFTP_S_IFMT) ==
+            LIBSSH2_SFTP_S_IFLNK;
+    }
+
+    static std::string key_for(const std::string& path)
+    {
+        if (path.size() > 1 && path[path.size() - 1] == '/')
+        {
+            return path.substr(0, path.size() - 1);
+        }
+        else
+        {
+            return path;
+        }
+    }
+
+    static std::string parent_of(const std::string& key)
+    {
+        std::string::size_type slash = key.rfind('/');
+        if (slash == std::string::npos)
+            return std::string(); // relative to the default directory
+        else if (slash == 0)
+            return "/";
+        else
+            return key.substr(0, slash);
+    }
+
+    /**
+     * The unexpired entry for `key`, if any.
+     *
+     * Expired entries are dropped on the way.
+     */
+    static const entry* fresh(
+        entry_map& entries, const std::string& key,
+        const boost::posix_time::ptime& time)
+    {
+        entry_map::iterator it = entries.find(key);
+        if (it == entries.end())
+            return NULL;
+
+        if (it->second.expires <= time)
+        {
+            entries.erase(it);
+            return NULL;
+        }
+
+        return &it->second;
+    }
+
+    entry& entry_for(const std::string& path, bool follow_links)
+    {
+        entry_map& entries = (follow_links) ? m_followed : m_entries;
+
+        if (entries.size() >= m_next_sweep)
+        {
+            sweep(entries);
+            m_next_sweep =
+                (std::max)(ATTRIBUTE_CACHE_MIN_SWEEP, 2 * entries.size());
+        }
+
+        return entries[key_for(path)];
+    }
+
+    /**
+     * Drop expired entries, so a long session that lists lots of
+     * directories doesn't keep all of them.
+     */
+    void sweep(entry_map& entries)
+    {
+        boost::posix_time::ptime time = now();
+
+        entry_map::iterator it = entries.begin();
+        while (it != entries.end())
+        {
+            if (it->second.expires <= time)
+                entries.erase(it++);
+            else
+                ++it;
+        }
+    }
+
+    mutable boost::mutex m_mutex;
+    boost::posix_time::time_duration m_max_staleness;
+    boost::posix_time::time_duration m_negative_lifetime;
+    entry_map m_entries; ///< Attributes of paths themselves
+    entry_map m_followed; ///< Attributes of what paths lead to
+    boost::uintmax_t m_hits;
+    boost::uintmax_t m_misses;
+    std::size_t m_next_sweep; ///< Size at which to sweep next
+};
+
+}} // namespace ssh::detail
+
+#endif
@@ -0,0 +1,133 @@
+/**
+    @file
+
+    Exec channel state.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_EXEC_CHANNEL_STATE_HPP
+#define SSH_DETAIL_EXEC_CHANNEL_STATE_HPP
+
+#include <ssh/bandwidth.hpp> // bandwidth_limiter
+#include <ssh/detail/libssh2/channel.hpp> // open_session, exec
+#include <ssh/detail/session_state.hpp>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+
+#include <libssh2.h> // LIBSSH2_CHANNEL
+
+namespace ssh {
+namespace detail {
+
+inline LIBSSH2_CHANNEL* do_exec(
+    session_state& session, const std::string& command)
+{
+    session_state::scoped_lock lock = session.aquire_lock();
+
+    LIBSSH2_CHANNEL* channel =
+        libssh2::channel::open_session(session.session_ptr());
+
+    try
+    {
+        libssh2::channel::exec(
+            session.session_ptr(), channel, command.c_str());
+    }
+    catch (...)
+    {
+        // The state's destructor won't be called so free the channel here
+        ::libssh2_channel_free(channel);
+        throw;
+    }
+
+    return channel;
+}
+
+/**
+ * RAII object managing a channel running a command.
+ *
+ * Starts the command and frees the channel, in a thread-safe manner, when
+ * it goes out of scope.
+ */
+class exec_channel_state : private boost::noncopyable
+{
+public:
+
+    typedef session_state::scoped_lock scoped_lock;
+
+    exec_channel_state(session_state& session, const std::string& command)
+        : m_session(session), m_channel(do_exec(session, command)) {}
+
+    ~exec_channel_state() throw()
+    {
+        session_state::scoped_lock lock = m_session.aquire_lock();
+
+        ::libssh2_channel_free(m_channel);
+    }
+
+    scoped_lock aquire_lock(
+        request_priority::value priority=request_priority::interactive)
+    {
+        return m_session.aquire_lock(priority);
+    }
+
+    LIBSSH2_SESSION* session_ptr()
+    {
+        return m_session.session_ptr();
+    }
+
+    LIBSSH2_CHANNEL* channel_ptr()
+    {
+        return m_channel;
+    }
+
+    int socket() const
+    {
+        return m_session.socket();
+    }
+
+    boost::shared_ptr<bandwidth_limiter> limiter()
+    {
+        return m_session.limiter();
+    }
+
+private:
+
+    session_state& m_session;
+    LIBSSH2_CHANNEL* m_channel;
+};
+
+}} // namespace ssh::detail
+
+#endif
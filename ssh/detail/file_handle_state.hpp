@@ -37,28 +37,168 @@
 #ifndef SSH_DETAIL_FILE_HANDLE_STATE_HPP
 #define SSH_DETAIL_FILE_HANDLE_STATE_HPP
 
-#include <ssh/detail/libssh2/sftp.hpp> // open
+#include <ssh/bandwidth.hpp> // bandwidth_limiter
+#include <ssh/detail/non_blocking.hpp> // non_blocking_scope, wait_for_socket
+#include <ssh/detail/request_scheduler.hpp> // request_priority
+#include <ssh/detail/session_state.hpp>
 #include <ssh/detail/sftp_channel_state.hpp>
+#include <ssh/sftp_error.hpp> // last_sftp_error_code
+#include <ssh/ssh_error.hpp> // SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH
 
+#include <boost/bind.hpp> // bind
 #include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
 
+#include <exception>
 #include <string>
 
+#include <libssh2.h> // libssh2_session_*, LIBSSH2_ERROR_EAGAIN
 #include <libssh2_sftp.h> // LIBSSH2_SFTP_HANDLE
 
 namespace ssh {
 namespace detail {
 
+/**
+ * Make a libssh2 SFTP call, returning what it returns.
+ *
+ * The call is made with the session locked.  On a channel that is ours
+ * alone, it is made in non-blocking mode, returning `LIBSSH2_ERROR_EAGAIN`
+ * until it has finished, and we unlock the session while waiting for the
+ * reply, so that requests on other channels overlap ours rather than
+ * queueing behind it.  A channel that others use stays blocking, as
+ * nothing else may be sent on it while our request is outstanding.
+ *
+ * @param ec, message  Set if the call fails.
+ * @param limiter      If not NULL, set to the session's bandwidth limiter,
+ *                     which can only be read with the session locked.
+ */
+template<typename Call>
+inline ssize_t sftp_call(
+    sftp_channel_state& sftp, bool exclusive,
+    request_priority::value priority, Call call,
+    boost::system::error_code& ec, std::string& message,
+    boost::shared_ptr<bandwidth_limiter>* limiter=NULL)
+{
+    session_state& session = sftp.session_ref();
+
+    for (;;)
+    {
+        unsigned long releases = 0;
+        {
+            session_state::scoped_lock lock = session.aquire_lock(priority);
+
+            ssize_t rc;
+            if (exclusive)
+            {
+                non_blocking_scope non_blocking(session.session_ptr());
+
+                for (;;)
+                {
+                    rc = call();
+                    if (rc != LIBSSH2_ERROR_EAGAIN)
+                        break;
+
+                    int directions = ::libssh2_session_block_directions(
+                        session.session_ptr());
+
+                    // A request that is only partly sent has to be finished
+                    // before anyone else sends anything, so keep the
+                    // session until it's gone
+                    if ((directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) == 0)
+                        break;
+
+                    wait_for_socket(
+                        session.socket(), directions,
+                        REQUEST_WAIT_MILLISECONDS);
+                }
+            }
+            else
+            {
+                rc = call();
+            }
+
+            if (rc != LIBSSH2_ERROR_EAGAIN)
+            {
+                if (rc < 0)
+                {
+                    ec = ::ssh::filesystem::detail::last_sftp_error_code(
+                        sftp.session_ptr(), sftp.sftp_ptr(), message);
+                }
+                else if (limiter)
+                {
+                    *limiter = session.limiter();
+                }
+
+                return rc;
+            }
+
+            // Counting the unlock we're about to make
+            releases = session.releases() + 1;
+        }
+
+        session.wait_for_reply(releases);
+    }
+}
+
+/**
+ * `libssh2_sftp_open_ex` as a call for `sftp_call`.
+ */
+class open_call
+{
+public:
+
+    open_call(
+        sftp_channel_state& sftp, const char* filename,
+        unsigned int filename_len, unsigned long flags, long mode,
+        int open_type, LIBSSH2_SFTP_HANDLE*& handle)
+        :
+        m_sftp(&sftp), m_filename(filename), m_filename_len(filename_len),
+        m_flags(flags), m_mode(mode), m_open_type(open_type),
+        m_handle(&handle) {}
+
+    ssize_t operator()() const
+    {
+        *m_handle = ::libssh2_sftp_open_ex(
+            m_sftp->sftp_ptr(), m_filename, m_filename_len, m_flags, m_mode,
+            m_open_type);
+
+        return (*m_handle) ?
+            0 : ::libssh2_session_last_errno(m_sftp->session_ptr());
+    }
+
+private:
+    sftp_channel_state* m_sftp;
+    const char* m_filename;
+    unsigned int m_filename_len;
+    unsigned long m_flags;
+    long m_mode;
+    int m_open_type;
+    LIBSSH2_SFTP_HANDLE** m_handle;
+};
+
 inline LIBSSH2_SFTP_HANDLE* do_open(
     sftp_channel_state& sftp,
     const char* filename, unsigned int filename_len, unsigned long flags,
-    long mode, int open_type)
+    long mode, int open_type, bool exclusive)
 {
-    session_state::scoped_lock lock = sftp.aquire_lock();
+    LIBSSH2_SFTP_HANDLE* handle = NULL;
+    boost::system::error_code ec;
+    std::string message;
+
+    sftp_call(
+        sftp, exclusive, request_priority::interactive,
+        open_call(
+            sftp, filename, filename_len, flags, mode, open_type, handle),
+        ec, message);
 
-    return libssh2::sftp::open(
-        sftp.session_ptr(), sftp.sftp_ptr(), filename, filename_len, flags,
-        mode, open_type);
+    if (ec)
+    {
+        SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+            ec, message, "libssh2_sftp_open_ex", filename, filename_len);
+    }
+
+    return handle;
 }
 
 /**
@@ -84,26 +224,58 @@ public:
     /**
      * Creates a new file handle that closes itself in a thread-safe manner
      * when it goes out of scope.
+     *
+     * @param exclusive  Whether the channel is ours alone, so that our
+     *                   requests can wait for their replies with the
+     *                   session unlocked.  See `sftp_call`.
      */
     file_handle_state(
         sftp_channel_state& sftp,
         const char* filename, unsigned int filename_len, unsigned long flags,
-        long mode, int open_type)
+        long mode, int open_type, bool exclusive=false)
         :
     m_sftp(sftp),
+    m_exclusive(exclusive),
     m_handle(
-        do_open(sftp_ref(), filename, filename_len, flags, mode, open_type)) {}
+        do_open(
+            sftp_ref(), filename, filename_len, flags, mode, open_type,
+            exclusive)) {}
 
     ~file_handle_state() throw()
     {
-        sftp_channel_state::scoped_lock lock = sftp_ref().aquire_lock();
+        try
+        {
+            // Nothing we can do if closing fails
+            boost::system::error_code ec;
+            std::string message;
 
-        ::libssh2_sftp_close_handle(m_handle);
+            call(
+                boost::bind(&::libssh2_sftp_close_handle, m_handle),
+                request_priority::interactive, ec, message);
+        }
+        catch (const std::exception&)
+        {}
     }
 
-    scoped_lock aquire_lock()
+    /**
+     * Make a libssh2 call on the file's channel.
+     *
+     * See `sftp_call`.
+     */
+    template<typename Call>
+    ssize_t call(
+        Call call, request_priority::value priority,
+        boost::system::error_code& ec, std::string& message,
+        boost::shared_ptr<bandwidth_limiter>* limiter=NULL)
     {
-        return sftp_ref().aquire_lock();
+        return sftp_call(
+            sftp_ref(), m_exclusive, priority, call, ec, message, limiter);
+    }
+
+    scoped_lock aquire_lock(
+        request_priority::value priority=request_priority::interactive)
+    {
+        return sftp_ref().aquire_lock(priority);
     }
 
     LIBSSH2_SESSION* session_ptr()
@@ -121,6 +293,11 @@ public:
         return m_handle;
     }
 
+    boost::shared_ptr<bandwidth_limiter> limiter()
+    {
+        return sftp_ref().session_ref().limiter();
+    }
+
 private:
 
     sftp_channel_state& sftp_ref()
@@ -129,6 +306,7 @@ private:
     }
 
     sftp_channel_state& m_sftp;
+    bool m_exclusive;
     LIBSSH2_SFTP_HANDLE* m_handle;
 };
 
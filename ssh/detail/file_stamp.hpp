@@ -0,0 +1,82 @@
+/**
+    @file
+
+    Size and modification time of a local file.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_FILE_STAMP_HPP
+#define SSH_DETAIL_FILE_STAMP_HPP
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/filesystem.hpp> // exists, file_size, last_write_time
+
+#include <ctime> // time_t
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Size and modification time of a file, to notice it being replaced.
+ *
+ * A missing file never matches anything, including another missing file.
+ */
+class file_stamp
+{
+public:
+    template<typename Path>
+    explicit file_stamp(const Path& file)
+        : m_exists(boost::filesystem::exists(file)), m_size(0),
+          m_modified(0)
+    {
+        if (m_exists)
+        {
+            m_size = boost::filesystem::file_size(file);
+            m_modified = boost::filesystem::last_write_time(file);
+        }
+    }
+
+    bool matches(const file_stamp& other) const
+    {
+        return m_exists && other.m_exists && m_size == other.m_size &&
+            m_modified == other.m_modified;
+    }
+
+private:
+    bool m_exists;
+    boost::uintmax_t m_size;
+    std::time_t m_modified;
+};
+
+}} // namespace ssh::detail
+
+#endif
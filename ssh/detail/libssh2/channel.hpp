@@ -0,0 +1,276 @@
+/**
+    @file
+
+    Exception wrapper round raw libssh2 channel functions.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_LIBSSH2_CHANNEL_HPP
+#define SSH_DETAIL_LIBSSH2_CHANNEL_HPP
+
+#include <ssh/ssh_error.hpp> // last_error_code, SSH_DETAIL_THROW_API_ERROR_CODE
+
+#include <boost/optional/optional.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <cstddef> // size_t
+#include <cstring> // strlen
+#include <string>
+
+#include <libssh2.h> // LIBSSH2_SESSION, LIBSSH2_CHANNEL, libssh2_channel_*
+
+// See ssh/detail/libssh2/libssh2.hpp for rules governing functions in this
+// namespace
+
+namespace ssh {
+namespace detail {
+namespace libssh2 {
+namespace channel {
+
+/**
+ * Error-fetching wrapper around libssh2_channel_open_session.
+ */
+inline LIBSSH2_CHANNEL* open_session(
+    LIBSSH2_SESSION* session, boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    LIBSSH2_CHANNEL* channel = ::libssh2_channel_open_session(session);
+    if (!channel)
+    {
+        ec = ssh::detail::last_error_code(session, e_msg);
+    }
+
+    return channel;
+}
+
+/**
+ * Exception wrapper around libssh2_channel_open_session.
+ */
+inline LIBSSH2_CHANNEL* open_session(LIBSSH2_SESSION* session)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    LIBSSH2_CHANNEL* channel = open_session(session, ec, message);
+    if (ec)
+        SSH_DETAIL_THROW_API_ERROR_CODE(
+            ec, message, "libssh2_channel_open_session");
+
+    return channel;
+}
+
+/**
+ * Error-fetching wrapper around libssh2_channel_exec.
+ */
+inline void exec(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel, const char* command,
+    boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    int rc = ::libssh2_channel_process_startup(
+        channel, "exec", sizeof("exec") - 1, command,
+        static_cast<unsigned int>(std::strlen(command)));
+    if (rc != 0)
+    {
+        ec = ssh::detail::last_error_code(session, e_msg);
+    }
+}
+
+/**
+ * Exception wrapper around libssh2_channel_exec.
+ */
+inline void exec(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel, const char* command)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    exec(session, channel, command, ec, message);
+    if (ec)
+        SSH_DETAIL_THROW_API_ERROR_CODE(ec, message, "libssh2_channel_exec");
+}
+
+/**
+ * Error-fetching wrapper around libssh2_channel_write_ex.
+ *
+ * @returns  Number of bytes written, which may be fewer than `size`.
+ */
+inline std::size_t write(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel, int stream_id,
+    const char* data, std::size_t size, boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    ssize_t rc = ::libssh2_channel_write_ex(channel, stream_id, data, size);
+    if (rc < 0)
+    {
+        ec = ssh::detail::last_error_code(session, e_msg);
+        return 0;
+    }
+
+    return static_cast<std::size_t>(rc);
+}
+
+/**
+ * Exception wrapper around libssh2_channel_write_ex.
+ */
+inline std::size_t write(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel, int stream_id,
+    const char* data, std::size_t size)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    std::size_t count = write(
+        session, channel, stream_id, data, size, ec, message);
+    if (ec)
+        SSH_DETAIL_THROW_API_ERROR_CODE(
+            ec, message, "libssh2_channel_write_ex");
+
+    return count;
+}
+
+/**
+ * Error-fetching wrapper around libssh2_channel_read_ex.
+ *
+ * @returns  Number of bytes read, zero if the stream has ended.
+ */
+inline std::size_t read(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel, int stream_id,
+    char* buffer, std::size_t size, boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    ssize_t rc = ::libssh2_channel_read_ex(channel, stream_id, buffer, size);
+    if (rc < 0)
+    {
+        ec = ssh::detail::last_error_code(session, e_msg);
+        return 0;
+    }
+
+    return static_cast<std::size_t>(rc);
+}
+
+/**
+ * Exception wrapper around libssh2_channel_read_ex.
+ */
+inline std::size_t read(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel, int stream_id,
+    char* buffer, std::size_t size)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    std::size_t count = read(
+        session, channel, stream_id, buffer, size, ec, message);
+    if (ec)
+        SSH_DETAIL_THROW_API_ERROR_CODE(
+            ec, message, "libssh2_channel_read_ex");
+
+    return count;
+}
+
+/**
+ * Error-fetching wrapper around libssh2_channel_send_eof.
+ */
+inline void send_eof(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel,
+    boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    int rc = ::libssh2_channel_send_eof(channel);
+    if (rc != 0)
+    {
+        ec = ssh::detail::last_error_code(session, e_msg);
+    }
+}
+
+/**
+ * Exception wrapper around libssh2_channel_send_eof.
+ */
+inline void send_eof(LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    send_eof(session, channel, ec, message);
+    if (ec)
+        SSH_DETAIL_THROW_API_ERROR_CODE(
+            ec, message, "libssh2_channel_send_eof");
+}
+
+/**
+ * Error-fetching wrapper around libssh2_channel_close.
+ */
+inline void close(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel,
+    boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    int rc = ::libssh2_channel_close(channel);
+    if (rc != 0)
+    {
+        ec = ssh::detail::last_error_code(session, e_msg);
+    }
+}
+
+/**
+ * Error-fetching wrapper around libssh2_channel_wait_closed.
+ */
+inline void wait_closed(
+    LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel,
+    boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    int rc = ::libssh2_channel_wait_closed(channel);
+    if (rc != 0)
+    {
+        ec = ssh::detail::last_error_code(session, e_msg);
+    }
+}
+
+/**
+ * Exception wrapper around libssh2_channel_wait_closed.
+ */
+inline void wait_closed(LIBSSH2_SESSION* session, LIBSSH2_CHANNEL* channel)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    wait_closed(session, channel, ec, message);
+    if (ec)
+        SSH_DETAIL_THROW_API_ERROR_CODE(
+            ec, message, "libssh2_channel_wait_closed");
+}
+
+}}}} // namespace ssh::detail::libssh2::channel
+
+#endif
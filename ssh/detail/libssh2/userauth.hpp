@@ -221,6 +221,49 @@ inline void public_key_from_file(
     }
 }
 
+/**
+ * Error-fetching wrapper around libssh2_userauth_publickey_frommemory.
+ */
+inline void public_key_from_memory(
+    LIBSSH2_SESSION* session, const char* username, size_t username_len,
+    const char* public_key_data, size_t public_key_data_len,
+    const char* private_key_data, size_t private_key_data_len,
+    const char* passphrase, boost::system::error_code& ec,
+    boost::optional<std::string&> e_msg=boost::optional<std::string&>())
+{
+    int rc = libssh2_userauth_publickey_frommemory(
+        session, username, username_len, public_key_data, public_key_data_len,
+        private_key_data, private_key_data_len, passphrase);
+
+    if (rc != 0)
+    {
+        ec = ssh::detail::last_error_code(session, e_msg);
+    }
+}
+
+/**
+ * Exception wrapper around libssh2_userauth_publickey_frommemory.
+ */
+inline void public_key_from_memory(
+    LIBSSH2_SESSION* session, const char* username, size_t username_len,
+    const char* public_key_data, size_t public_key_data_len,
+    const char* private_key_data, size_t private_key_data_len,
+    const char* passphrase)
+{
+    boost::system::error_code ec;
+    std::string message;
+
+    public_key_from_memory(
+        session, username, username_len, public_key_data, public_key_data_len,
+        private_key_data, private_key_data_len, passphrase, ec, message);
+
+    if (ec)
+    {
+        SSH_DETAIL_THROW_API_ERROR_CODE(
+            ec, message, "libssh2_userauth_publickey_frommemory");
+    }
+}
+
 }}}} // namespace ssh::detail::libssh2::userauth
 
 #endif
@@ -0,0 +1,118 @@
+/**
+    @file
+
+    Using a session without blocking while other threads share it.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_NON_BLOCKING_HPP
+#define SSH_DETAIL_NON_BLOCKING_HPP
+
+#include <boost/noncopyable.hpp>
+
+#include <cassert> // assert
+
+#include <libssh2.h> // libssh2_session_*, LIBSSH2_SESSION_BLOCK_*
+
+#ifdef _WIN32
+#include <winsock2.h> // select
+#else
+#include <sys/select.h> // select
+#endif
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Puts a session in non-blocking mode for the lifetime of the object.
+ *
+ * The session lock must be held for at least as long.
+ */
+class non_blocking_scope : private boost::noncopyable
+{
+public:
+
+    explicit non_blocking_scope(LIBSSH2_SESSION* session)
+        : m_session(session),
+          m_was_blocking(::libssh2_session_get_blocking(session) != 0)
+    {
+        ::libssh2_session_set_blocking(m_session, 0);
+    }
+
+    ~non_blocking_scope() throw()
+    {
+        ::libssh2_session_set_blocking(m_session, m_was_blocking);
+    }
+
+private:
+    LIBSSH2_SESSION* m_session;
+    bool m_was_blocking;
+};
+
+/**
+ * Longest to wait on the socket before pushing non-blocking requests
+ * again anyway.
+ */
+const long REQUEST_WAIT_MILLISECONDS = 50;
+
+/**
+ * Wait until the socket is ready in the directions the session is
+ * waiting on, or until the timeout passes.
+ */
+inline void wait_for_socket(
+    int socket, int directions, long timeout_milliseconds)
+{
+    assert(socket != -1);
+
+    fd_set read_set;
+    fd_set write_set;
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+
+    // With nothing in particular to wait for, wait for a reply
+    if (directions == 0 || (directions & LIBSSH2_SESSION_BLOCK_INBOUND))
+        FD_SET(socket, &read_set);
+    if (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+        FD_SET(socket, &write_set);
+
+    timeval timeout;
+    timeout.tv_sec = timeout_milliseconds / 1000;
+    timeout.tv_usec = (timeout_milliseconds % 1000) * 1000;
+
+    // Errors and timeouts both just send us back to libssh2, which will
+    // report anything that's really wrong
+    ::select(socket + 1, &read_set, &write_set, NULL, &timeout);
+}
+
+}} // namespace ssh::detail
+
+#endif
@@ -0,0 +1,276 @@
+/**
+    @file
+
+    Ordering requests that share a session by how urgent they are.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_REQUEST_SCHEDULER_HPP
+#define SSH_DETAIL_REQUEST_SCHEDULER_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp> // disable_interruption
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <cassert> // assert
+#include <cstddef> // size_t
+#include <stdexcept> // invalid_argument
+
+namespace ssh {
+namespace detail {
+
+/**
+ * How urgently a request needs the session.
+ */
+struct request_priority
+{
+    enum value
+    {
+        /**
+         * Someone is waiting to see the answer: listings, stats and the
+         * like.
+         */
+        interactive,
+
+        /**
+         * One block of a long-running transfer.
+         */
+        bulk
+    };
+};
+
+/**
+ * Lock handing a session to one request at a time, most urgent first.
+ *
+ * A request that finds the session busy queues behind the others of its
+ * priority.  When the session comes free, a queued interactive request
+ * goes before any queued bulk one, so a listing waits for at most the
+ * one block of a transfer already in progress, rather than for every
+ * block queued ahead of it.  So that a stream of interactive requests
+ * can't hold transfers up forever, a bulk request goes next once this
+ * many interactive requests have overtaken it in a row.
+ *
+ * Meets the Lockable requirements; plain `lock()` is interactive.
+ *
+ * It also counts how often it has been released, for requests that wait
+ * for their replies without holding the session: libssh2 reads every
+ * channel's replies off the one socket, so whoever has the session next
+ * may read a reply meant for a request waiting on another channel.
+ */
+class request_scheduler : private boost::noncopyable
+{
+public:
+
+    static const std::size_t DEFAULT_INTERACTIVE_BURST = 8;
+
+    explicit request_scheduler(
+        std::size_t interactive_burst=DEFAULT_INTERACTIVE_BURST)
+        :
+        m_interactive_burst(interactive_burst), m_busy(false),
+        m_overtaken(0), m_releases(0), m_watching(false)
+    {
+        if (interactive_burst < 1)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument(
+                    "Bulk requests can't go before interactive ones"));
+
+        for (std::size_t i = 0; i < PRIORITY_COUNT; ++i)
+        {
+            m_next_ticket[i] = 0;
+            m_now_serving[i] = 0;
+        }
+    }
+
+    void lock()
+    {
+        lock(request_priority::interactive);
+    }
+
+    void lock(request_priority::value priority)
+    {
+        // Abandoning a ticket would stall everyone queued behind it.  A
+        // plain mutex isn't an interruption point either.
+        boost::this_thread::disable_interruption no_interruption;
+
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        unsigned long ticket = m_next_ticket[priority]++;
+
+        while (m_busy || ticket != m_now_serving[priority] ||
+            !is_turn_of(priority))
+        {
+            m_changed.wait(lock);
+        }
+
+        ++m_now_serving[priority];
+        m_busy = true;
+
+        if (priority == request_priority::bulk)
+        {
+            m_overtaken = 0;
+        }
+        else if (waiting(request_priority::bulk) > 0)
+        {
+            ++m_overtaken;
+        }
+        else
+        {
+            m_overtaken = 0;
+        }
+    }
+
+    bool try_lock()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        if (m_busy || waiting(request_priority::interactive) > 0 ||
+            waiting(request_priority::bulk) > 0)
+        {
+            return false;
+        }
+
+        m_busy = true;
+        m_overtaken = 0;
+        return true;
+    }
+
+    void unlock()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        assert(m_busy);
+        m_busy = false;
+        ++m_releases;
+        m_changed.notify_all();
+    }
+
+    /**
+     * Number of times the lock has been released.
+     */
+    unsigned long releases() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        return m_releases;
+    }
+
+    /**
+     * Wait, without the lock, until it has been released more than
+     * `releases` times, or until whatever `watch` waits for.
+     *
+     * `watch` waits, for a bounded time, on something else that can end
+     * the wait, such as the session's socket.  Only one waiter at a time
+     * calls it; the rest wait for the lock to be released or for the
+     * watcher to finish.  It must not throw.
+     */
+    template<typename Watch>
+    void wait_for_release(unsigned long releases, Watch watch)
+    {
+        // As for lock(), abandoning the wait part way would leave the
+        // other waiters without a watcher
+        boost::this_thread::disable_interruption no_interruption;
+
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        if (m_releases != releases)
+            return;
+
+        if (!m_watching)
+        {
+            m_watching = true;
+            lock.unlock();
+
+            watch();
+
+            lock.lock();
+            m_watching = false;
+            m_changed.notify_all();
+        }
+        else
+        {
+            while (m_releases == releases && m_watching)
+            {
+                m_changed.wait(lock);
+            }
+        }
+    }
+
+private:
+
+    static const std::size_t PRIORITY_COUNT = 2;
+
+    std::size_t waiting(request_priority::value priority) const
+    {
+        return m_next_ticket[priority] - m_now_serving[priority];
+    }
+
+    bool is_turn_of(request_priority::value priority) const
+    {
+        bool bulk_starved = m_overtaken >= m_interactive_burst;
+
+        if (priority == request_priority::interactive)
+        {
+            return waiting(request_priority::bulk) == 0 || !bulk_starved;
+        }
+        else
+        {
+            return waiting(request_priority::interactive) == 0 ||
+                bulk_starved;
+        }
+    }
+
+    const std::size_t m_interactive_burst;
+
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_changed;
+    bool m_busy;
+
+    /// Interactive requests granted in a row while bulk ones waited
+    std::size_t m_overtaken;
+
+    unsigned long m_releases;
+
+    /// Someone is waiting on the watch for everyone waiting for a release
+    bool m_watching;
+
+    /// @name Queues, one per priority, served in ticket order
+    // @{
+    unsigned long m_next_ticket[PRIORITY_COUNT];
+    unsigned long m_now_serving[PRIORITY_COUNT];
+    // @}
+};
+
+}} // namespace ssh::detail
+
+#endif
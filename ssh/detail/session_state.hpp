@@ -37,13 +37,18 @@
 #ifndef SSH_DETAIL_SESSION_STATE_HPP
 #define SSH_DETAIL_SESSION_STATE_HPP
 
+#include <ssh/bandwidth.hpp> // bandwidth_limiter
 #include <ssh/detail/libssh2/session.hpp> // init
+#include <ssh/detail/non_blocking.hpp> // wait_for_socket
+#include <ssh/detail/request_scheduler.hpp>
 
+#include <boost/bind.hpp> // bind
 #include <boost/noncopyable.hpp>
 #include <boost/optional/optional.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/system/system_error.hpp>
-#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp> // unique_lock, adopt_lock
 #include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
 
 #include <string>
@@ -77,18 +82,19 @@ class session_state : private boost::noncopyable
 
 public:
 
-    typedef boost::mutex::scoped_lock scoped_lock;
+    typedef boost::unique_lock<request_scheduler> scoped_lock;
 
     /**
      * Creates a session that is not (and never will be) connected to a host.
      */
-    session_state() : m_session(::ssh::detail::libssh2::session::init()) {}
+    session_state()
+        : m_session(::ssh::detail::libssh2::session::init()), m_socket(-1) {}
 
     /**
      * Creates a session connected to a host over the given socket.
      */
     session_state(int socket, const std::string& disconnection_message)
-        : m_session(libssh2::session::init())
+        : m_session(libssh2::session::init()), m_socket(socket)
     {
         // Session is 'alive' from this point onwards.  All paths must
         // eventually free it.
@@ -128,9 +134,18 @@ public:
         ::libssh2_session_free(m_session);
     }
 
-    scoped_lock aquire_lock()
+    /**
+     * Take the session for one request, waiting for more urgent requests
+     * to have it first.
+     *
+     * Requests that move a block of a long transfer should say they are
+     * bulk so that listings and the like can get in between them.
+     */
+    scoped_lock aquire_lock(
+        request_priority::value priority=request_priority::interactive)
     {
-        return scoped_lock(m_mutex);
+        m_scheduler.lock(priority);
+        return scoped_lock(m_scheduler, boost::adopt_lock);
     }
 
     LIBSSH2_SESSION* session_ptr()
@@ -138,12 +153,72 @@ public:
         return m_session;
     }
 
+    /**
+     * Number of times the session has been unlocked.
+     *
+     * A non-blocking request notes this before unlocking the session to
+     * wait for its reply, counting its own unlock, and passes it to
+     * `wait_for_reply`.
+     */
+    unsigned long releases() const
+    {
+        return m_scheduler.releases();
+    }
+
+    /**
+     * Wait, with the session unlocked, for the reply to a non-blocking
+     * request to arrive.
+     *
+     * Returns when there is something to read on the socket or when anyone
+     * else has had the session since it had been unlocked `releases`
+     * times, as they may have read the reply on the way to their own.
+     * Also returns after a short while anyway.
+     */
+    void wait_for_reply(unsigned long releases)
+    {
+        m_scheduler.wait_for_release(
+            releases,
+            boost::bind(
+                &wait_for_socket, m_socket, LIBSSH2_SESSION_BLOCK_INBOUND,
+                REQUEST_WAIT_MILLISECONDS));
+    }
+
+    /**
+     * Socket the session runs over or -1 if it was never connected.
+     *
+     * For waiting on the socket when using the session in non-blocking mode.
+     */
+    int socket() const
+    {
+        return m_socket;
+    }
+
+    /**
+     * Limiter that transfers over the session report to, if any.
+     *
+     * Only use while holding the lock.
+     */
+    boost::shared_ptr<bandwidth_limiter> limiter()
+    {
+        return m_limiter;
+    }
+
+    /**
+     * Only use while holding the lock.
+     */
+    void set_limiter(boost::shared_ptr<bandwidth_limiter> limiter)
+    {
+        m_limiter = limiter;
+    }
+
 private:
 
-    mutable boost::mutex m_mutex;
+    request_scheduler m_scheduler;
     ///< Coordinates multiple-threads using of non-thread-safe LIBSSH2_SESSION.
 
     LIBSSH2_SESSION* m_session;
+    int m_socket;
+    boost::shared_ptr<bandwidth_limiter> m_limiter;
 
     // Overloading this to hold both the message and flag whether disconnection
     // is necessary.
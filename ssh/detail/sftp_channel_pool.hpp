@@ -0,0 +1,188 @@
+/**
+    @file
+
+    Pool of spare SFTP channels for keeping several requests in flight.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_DETAIL_SFTP_CHANNEL_POOL_HPP
+#define SSH_DETAIL_SFTP_CHANNEL_POOL_HPP
+
+#include <ssh/detail/session_state.hpp>
+#include <ssh/detail/sftp_channel_state.hpp>
+
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstddef> // size_t
+#include <vector>
+
+namespace ssh {
+namespace detail {
+
+/**
+ * Spare SFTP channels over one session, kept for reuse.
+ *
+ * libssh2 only lets each SFTP channel have one request outstanding, so code
+ * that wants several requests in flight needs several channels.  Opening a
+ * channel costs a few round trips, so rather than each batch operation
+ * opening its own, they borrow channels from here and give them back when
+ * they're done.
+ */
+class sftp_channel_pool : private boost::noncopyable
+{
+public:
+
+    typedef boost::shared_ptr<sftp_channel_state> channel_ptr;
+
+    explicit sftp_channel_pool(session_state& session)
+        : m_session(session), m_lent(0), m_limit(0) {}
+
+    session_state& session_ref()
+    {
+        return m_session;
+    }
+
+    /**
+     * Borrow up to `count` channels, opening more if there aren't enough
+     * spare.
+     *
+     * Servers limit the channels per connection so fewer may be returned,
+     * but never none.
+     *
+     * @throws `boost::system::system_error` if not even one channel could
+     *         be opened.
+     */
+    std::vector<channel_ptr> borrow(std::size_t count)
+    {
+        std::vector<channel_ptr> channels;
+        std::size_t to_open = 0;
+
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            while (channels.size() < count && !m_spare.empty())
+            {
+                channels.push_back(m_spare.back());
+                m_spare.pop_back();
+            }
+
+            to_open = count - channels.size();
+
+            // Don't keep asking for channels the server has refused before,
+            // unless we'd otherwise have none at all
+            if (m_limit != 0)
+            {
+                std::size_t open = m_lent + channels.size();
+                std::size_t allowed = (open < m_limit) ? m_limit - open : 0;
+
+                if (to_open > allowed)
+                {
+                    to_open = (channels.empty() && allowed == 0) ? 1 : allowed;
+                }
+            }
+
+            m_lent += channels.size();
+        }
+
+        // Opened without our lock held as opening takes the session lock
+        for (std::size_t i = 0; i < to_open; ++i)
+        {
+            try
+            {
+                channels.push_back(
+                    boost::make_shared<sftp_channel_state>(
+                        boost::ref(m_session)));
+            }
+            catch (const boost::system::system_error&)
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                // m_lent already includes what we're about to hand over
+                m_limit = m_lent + m_spare.size();
+
+                if (channels.empty())
+                    throw;
+                else
+                    break;
+            }
+
+            boost::mutex::scoped_lock lock(m_mutex);
+            ++m_lent;
+        }
+
+        return channels;
+    }
+
+    /**
+     * Return a borrowed channel.
+     *
+     * Only give back channels with no request in flight, or the next
+     * borrower will be confused by the replies.  Anything else should just
+     * be dropped, which closes it.
+     */
+    void give_back(channel_ptr channel)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        m_spare.push_back(channel);
+        if (m_lent > 0)
+            --m_lent;
+    }
+
+    /**
+     * Account for a borrowed channel that was dropped rather than given
+     * back.
+     */
+    void discard()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        if (m_lent > 0)
+            --m_lent;
+    }
+
+private:
+
+    boost::mutex m_mutex;
+    session_state& m_session;
+    std::vector<channel_ptr> m_spare;
+    std::size_t m_lent; ///< Channels borrowed and not yet returned
+    std::size_t m_limit; ///< Most channels the server allowed, or 0
+};
+
+}} // namespace ssh::detail
+
+#endif
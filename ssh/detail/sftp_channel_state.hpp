@@ -88,9 +88,10 @@ public:
         ::libssh2_sftp_shutdown(m_sftp);
     }
 
-    scoped_lock aquire_lock()
+    scoped_lock aquire_lock(
+        request_priority::value priority=request_priority::interactive)
     {
-        return session_ref().aquire_lock();
+        return session_ref().aquire_lock(priority);
     }
 
     LIBSSH2_SESSION* session_ptr()
@@ -103,13 +104,13 @@ public:
         return m_sftp;
     }
 
-private:
-
     session_state& session_ref()
     {
         return m_session;
     }
 
+private:
+
     session_state& m_session;
     LIBSSH2_SFTP* m_sftp;
 };
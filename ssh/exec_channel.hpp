@@ -0,0 +1,304 @@
+/**
+    @file
+
+    Running commands on the server over exec channels.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_EXEC_CHANNEL_HPP
+#define SSH_EXEC_CHANNEL_HPP
+
+#include <ssh/bandwidth.hpp> // bandwidth_limiter
+#include <ssh/detail/exec_channel_state.hpp>
+#include <ssh/detail/non_blocking.hpp> // non_blocking_scope, wait_for_socket
+#include <ssh/detail/request_scheduler.hpp> // request_priority
+#include <ssh/detail/session_state.hpp>
+#include <ssh/ssh_error.hpp> // last_error_code
+
+#include <boost/bind.hpp> // bind
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <cstddef> // size_t
+#include <string>
+
+#include <libssh2.h> // libssh2_channel_*, SSH_EXTENDED_DATA_STDERR
+
+namespace ssh {
+
+/**
+ * Command running on the server.
+ *
+ * Whatever is written is the command's standard input.  Its standard output
+ * can be read as it arrives or, like its standard error, is collected when
+ * waiting for it to exit, which is also when its exit status becomes known.
+ *
+ * A command can keep us waiting a long time, unpacking an archive say, so
+ * the session is only locked while there is something to send or receive.
+ * Other users of the session get their turn while we wait on the command.
+ *
+ * Copies refer to the same command.
+ */
+class exec_channel
+{
+public:
+
+    exec_channel(detail::session_state& session, const std::string& command)
+        :
+    m_channel(
+        boost::make_shared<detail::exec_channel_state>(
+            boost::ref(session), command)),
+    m_input_closed(false), m_exit_status(0), m_finished(false)
+    {}
+
+    /**
+     * Write all of `data` to the command's standard input.
+     */
+    void write(const char* data, std::size_t size)
+    {
+        while (size > 0)
+        {
+            boost::shared_ptr<bandwidth_limiter> limiter;
+            std::size_t count = call_without_blocking(
+                boost::bind(
+                    &::libssh2_channel_write_ex, m_channel->channel_ptr(), 0,
+                    data, size),
+                "libssh2_channel_write_ex", limiter);
+
+            data += count;
+            size -= count;
+
+            if (limiter)
+                limiter->consume(count);
+        }
+    }
+
+    /**
+     * Read what the command writes to its standard output, as it arrives.
+     *
+     * Whatever is read this way is not also collected for `output()`.
+     *
+     * @returns  Bytes read; 0 once the command has closed its output.
+     */
+    std::size_t read(char* buffer, std::size_t size)
+    {
+        boost::shared_ptr<bandwidth_limiter> limiter;
+        std::size_t count = read_stream(0, buffer, size, limiter);
+
+        if (limiter)
+            limiter->consume(count);
+
+        return count;
+    }
+
+    /**
+     * Tell the command there is no more input.
+     */
+    void close_input()
+    {
+        if (m_input_closed)
+            return;
+
+        boost::shared_ptr<bandwidth_limiter> unused;
+        call_without_blocking(
+            boost::bind(&::libssh2_channel_send_eof, m_channel->channel_ptr()),
+            "libssh2_channel_send_eof", unused);
+
+        m_input_closed = true;
+    }
+
+    /**
+     * Close the command's input and wait for it to finish.
+     *
+     * @returns  The command's exit status.
+     */
+    int wait_for_exit()
+    {
+        if (m_finished)
+            return m_exit_status;
+
+        close_input();
+
+        read_to_end(0, m_output);
+        read_to_end(SSH_EXTENDED_DATA_STDERR, m_error_output);
+
+        boost::shared_ptr<bandwidth_limiter> unused;
+        call_without_blocking(
+            boost::bind(
+                &::libssh2_channel_wait_closed, m_channel->channel_ptr()),
+            "libssh2_channel_wait_closed", unused);
+
+        {
+            detail::exec_channel_state::scoped_lock lock =
+                m_channel->aquire_lock();
+
+            m_exit_status =
+                ::libssh2_channel_get_exit_status(m_channel->channel_ptr());
+        }
+
+        m_finished = true;
+
+        return m_exit_status;
+    }
+
+    /**
+     * What the command wrote to its standard output.
+     *
+     * Only available once it has exited.
+     */
+    const std::string& output() const
+    {
+        return m_output;
+    }
+
+    /**
+     * What the command wrote to its standard error.
+     *
+     * Only available once it has exited.
+     */
+    const std::string& error_output() const
+    {
+        return m_error_output;
+    }
+
+private:
+
+    /**
+     * Make a libssh2 call on the channel, waiting with the session unlocked
+     * whenever the call would block.
+     *
+     * `call` is made with the session locked and in non-blocking mode, and
+     * returns what the libssh2 function returns.
+     *
+     * @param limiter  Set to the session's bandwidth limiter, if any, which
+     *                 can only be read with the session locked.
+     */
+    template<typename Call>
+    std::size_t call_without_blocking(
+        Call call, const char* api_function,
+        boost::shared_ptr<bandwidth_limiter>& limiter)
+    {
+        for (;;)
+        {
+            int directions = 0;
+            {
+                // Bulk, as commands are run to transfer files, or to do
+                // work as slow as transferring them
+                detail::exec_channel_state::scoped_lock lock =
+                    m_channel->aquire_lock(detail::request_priority::bulk);
+                detail::non_blocking_scope non_blocking(
+                    m_channel->session_ptr());
+
+                for (;;)
+                {
+                    ssize_t rc = call();
+                    if (rc != LIBSSH2_ERROR_EAGAIN)
+                    {
+                        if (rc < 0)
+                            throw_last_error(api_function);
+
+                        limiter = m_channel->limiter();
+                        return static_cast<std::size_t>(rc);
+                    }
+
+                    directions = ::libssh2_session_block_directions(
+                        m_channel->session_ptr());
+
+                    // A packet that is only partly sent has to be finished
+                    // before anyone else sends anything, so keep the
+                    // session to ourselves until it's gone
+                    if ((directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) == 0)
+                        break;
+
+                    detail::wait_for_socket(
+                        m_channel->socket(), directions,
+                        detail::REQUEST_WAIT_MILLISECONDS);
+                }
+            }
+
+            detail::wait_for_socket(
+                m_channel->socket(), directions,
+                detail::REQUEST_WAIT_MILLISECONDS);
+        }
+    }
+
+    /**
+     * Must hold the lock.
+     */
+    void throw_last_error(const char* api_function)
+    {
+        std::string message;
+        boost::system::error_code ec = detail::last_error_code(
+            m_channel->session_ptr(), message);
+
+        SSH_DETAIL_THROW_API_ERROR_CODE(ec, message, api_function);
+    }
+
+    std::size_t read_stream(
+        int stream_id, char* buffer, std::size_t size,
+        boost::shared_ptr<bandwidth_limiter>& limiter)
+    {
+        return call_without_blocking(
+            boost::bind(
+                &::libssh2_channel_read_ex, m_channel->channel_ptr(),
+                stream_id, buffer, size),
+            "libssh2_channel_read_ex", limiter);
+    }
+
+    void read_to_end(int stream_id, std::string& out)
+    {
+        boost::shared_ptr<bandwidth_limiter> unused;
+
+        char buffer[4096];
+        for (;;)
+        {
+            std::size_t count = read_stream(
+                stream_id, buffer, sizeof(buffer), unused);
+            if (count == 0)
+                break;
+
+            out.append(buffer, count);
+        }
+    }
+
+    boost::shared_ptr<detail::exec_channel_state> m_channel;
+    bool m_input_closed;
+    int m_exit_status;
+    bool m_finished;
+    std::string m_output;
+    std::string m_error_output;
+};
+
+} // namespace ssh
+
+#endif
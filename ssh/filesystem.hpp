@@ -37,14 +37,22 @@
 #ifndef SSH_SFTP_HPP
 #define SSH_SFTP_HPP
 
+#include <ssh/detail/attribute_cache.hpp>
 #include <ssh/detail/file_handle_state.hpp>
+#include <ssh/detail/non_blocking.hpp> // non_blocking_scope
+#include <ssh/detail/sftp_channel_pool.hpp>
 #include <ssh/detail/sftp_channel_state.hpp>
 #include <ssh/detail/libssh2/sftp.hpp>
 
+#include <boost/algorithm/string/predicate.hpp> // equals
 #include <boost/cstdint.hpp> // uint64_t, uintmax_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
 #include <boost/exception/info.hpp> // errinfo_api_function
+#include <boost/exception_ptr.hpp> // exception_ptr, current_exception
 #include <boost/filesystem/path.hpp> // path
+#include <boost/function.hpp>
 #include <boost/iterator/iterator_facade.hpp> // iterator_facade
+#include <boost/range/iterator_range.hpp>
 #include <boost/optional/optional.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/move/move.hpp> // BOOST_RV_REF, BOOST_MOVABLE_BUT_NOT_COPYABLE
@@ -56,7 +64,11 @@
 
 #include <algorithm> // min
 #include <cassert> // assert
+#include <cstddef> // size_t
+#include <cstring> // memcpy, strlen
+#include <deque>
 #include <exception> // bad_alloc
+#include <map>
 #include <stdexcept> // invalid_argument
 #include <string>
 #include <vector>
@@ -71,6 +83,12 @@ class session;
 
 namespace filesystem {
 
+namespace detail {
+    class pipelined_remover;
+    class pipelined_directory_creator;
+    class pipelined_stat;
+}
+
 class file_attributes
 {
 public:
@@ -198,6 +216,9 @@ public:
 private:
     friend class sftp_file;
     friend class sftp_filesystem; // to construct in attributes method
+    friend class detail::pipelined_remover; // to classify listed entries
+    friend class detail::pipelined_directory_creator;
+    friend class detail::pipelined_stat;
 
     explicit file_attributes(const LIBSSH2_SFTP_ATTRIBUTES& raw_attributes) :
        m_attributes(raw_attributes) {}
@@ -210,18 +231,225 @@ private:
     LIBSSH2_SFTP_ATTRIBUTES m_attributes;
 };
 
+/**
+ * Attributes of one of a batch of files, or why they couldn't be had.
+ *
+ * Exactly one of `attributes` and `error` is set.
+ */
+struct attributes_result
+{
+    boost::optional<file_attributes> attributes;
+    boost::system::error_code error;
+};
+
+/**
+ * How long `sftp_filesystem` may trust attributes it has already seen
+ * rather than asking the server again.
+ */
+struct attribute_cache_options
+{
+    attribute_cache_options()
+        : max_staleness(boost::posix_time::seconds(5)),
+          negative_lifetime(boost::posix_time::seconds(1)) {}
+
+    /**
+     * Longest to trust attributes before asking the server again.
+     *
+     * Anything else using the server can change the files behind our back,
+     * so this is how out of date answers may be.  Zero turns the cache off.
+     */
+    boost::posix_time::time_duration max_staleness;
+
+    /**
+     * Longest to trust the server saying there is no such file.
+     *
+     * Usually shorter than `max_staleness` as we often check for a file
+     * because something is about to create it.  Zero stops missing files
+     * being remembered at all.
+     */
+    boost::posix_time::time_duration negative_lifetime;
+};
+
+struct attribute_cache_statistics
+{
+    boost::uintmax_t hits; ///< Stats saved by the cache
+    boost::uintmax_t misses; ///< Stats the server had to answer
+};
+
+namespace detail {
+
+    class directory_listing;
+    class prefetched_listing;
+
+    /**
+     * Storage for the names and long entries of one directory listing.
+     *
+     * Entries are copied end-to-end into large chunks, rather than each
+     * getting strings of their own, so listing a directory costs one
+     * allocation per chunk, not several per entry.  When nothing is viewing
+     * the entries any more, the listing rewinds the arena and reuses the
+     * same chunks so a plain pass over a directory allocates next to
+     * nothing.
+     */
+    class listing_arena : private boost::noncopyable
+    {
+    public:
+
+        static const std::size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+        /**
+         * @param chunk_size
+         *     Size of the chunks the arena allocates.  Listings that are
+         *     kept around, rather than iterated once, should use smaller
+         *     chunks than the default so small directories stay small.
+         */
+        explicit listing_arena(
+            const boost::filesystem::path& directory,
+            std::size_t chunk_size=DEFAULT_CHUNK_SIZE)
+            :
+            m_directory(directory), m_chunk_size(chunk_size), m_chunk(0),
+            m_used(0), m_reserved(0), m_allocations(0) {}
+
+        /**
+         * Directory whose entries these are.
+         */
+        const boost::filesystem::path& directory() const
+        {
+            return m_directory;
+        }
+
+        /**
+         * Copy data into the arena, NUL-terminated.
+         *
+         * The copy is valid until the arena is rewound or destroyed.
+         */
+        const char* store(const char* data, std::size_t size)
+        {
+            std::size_t needed = size + 1;
+
+            if (m_chunks.empty() || m_used + needed > m_chunks[m_chunk].size())
+            {
+                next_chunk(needed);
+            }
+
+            char* destination = &m_chunks[m_chunk][m_used];
+            std::memcpy(destination, data, size);
+            destination[size] = '\0';
+
+            m_used += needed;
+
+            return destination;
+        }
+
+        /**
+         * Reuse the storage from the beginning.
+         *
+         * Only safe once nothing refers to anything stored.
+         */
+        void rewind()
+        {
+            m_chunk = 0;
+            m_used = 0;
+        }
+
+        /**
+         * Bytes of memory the chunks take up.
+         */
+        std::size_t memory_used() const
+        {
+            return m_reserved;
+        }
+
+        /**
+         * Number of times the arena has had to allocate a chunk.
+         *
+         * Stays flat across a listing that reuses its storage.
+         */
+        std::size_t allocations() const
+        {
+            return m_allocations;
+        }
+
+    private:
+
+        void next_chunk(std::size_t needed)
+        {
+            // Move on to chunks kept from before a rewind, if big enough
+            while (m_chunk + 1 < m_chunks.size())
+            {
+                ++m_chunk;
+                m_used = 0;
+
+                if (m_chunks[m_chunk].size() >= needed)
+                    return;
+            }
+
+            // deque, because pushing onto it doesn't move the other chunks
+            m_chunks.push_back(std::vector<char>());
+            m_chunks.back().resize((std::max)(m_chunk_size, needed));
+            m_reserved += m_chunks.back().size();
+            ++m_allocations;
+
+            m_chunk = m_chunks.size() - 1;
+            m_used = 0;
+        }
+
+        boost::filesystem::path m_directory;
+        std::size_t m_chunk_size;
+        std::deque<std::vector<char> > m_chunks;
+        std::size_t m_chunk; ///< Chunk currently being filled
+        std::size_t m_used; ///< Bytes used of the current chunk
+        std::size_t m_reserved; ///< Bytes allocated in all chunks
+        std::size_t m_allocations; ///< Chunks allocated, ever
+    };
+
+}
+
+/**
+ * A file or directory found by listing a directory.
+ *
+ * This is a lightweight view of the entry as stored by the listing.  Copying
+ * it copies no strings.  The full path is only built if asked for.
+ */
 class sftp_file
 {
 public:
-    sftp_file(
-        const boost::filesystem::path& file, const std::string& long_entry,
-        const LIBSSH2_SFTP_ATTRIBUTES& attributes)
-        :
-        m_file(file), m_long_entry(long_entry), m_attributes(attributes) {}
 
-    std::string name() const { return m_file.filename(); }
-    const boost::filesystem::path& path() const { return m_file; }
-    const std::string& long_entry() const { return m_long_entry; }
+    typedef boost::iterator_range<const char*> char_range;
+
+    std::string name() const
+    {
+        return std::string(m_name.begin(), m_name.end());
+    }
+
+    /**
+     * The file's name, without copying it.
+     *
+     * Valid for as long as this object, or a copy of it, exists.
+     */
+    char_range name_view() const { return m_name; }
+
+    /**
+     * Full path of the file.
+     *
+     * Built on each call, so prefer `name_view` when only the name is needed.
+     */
+    boost::filesystem::path path() const
+    {
+        return m_storage->directory() / name();
+    }
+
+    std::string long_entry() const
+    {
+        return std::string(m_long_entry.begin(), m_long_entry.end());
+    }
+
+    /**
+     * The file's `ls -l`-style long entry, without copying it.
+     *
+     * Valid for as long as this object, or a copy of it, exists.
+     */
+    char_range long_entry_view() const { return m_long_entry; }
 
     const file_attributes& attributes() const
     {
@@ -229,8 +457,21 @@ public:
     }
 
 private:
-    boost::filesystem::path m_file;
-    std::string m_long_entry;
+    friend class detail::directory_listing;
+    friend class detail::prefetched_listing;
+
+    sftp_file(
+        boost::shared_ptr<const detail::listing_arena> storage,
+        char_range name, char_range long_entry,
+        const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+        :
+        m_storage(storage), m_name(name), m_long_entry(long_entry),
+        m_attributes(attributes) {}
+
+    /// Keeps the listing's storage alive as long as we point into it.
+    boost::shared_ptr<const detail::listing_arena> m_storage;
+    char_range m_name;
+    char_range m_long_entry;
     file_attributes m_attributes;
 };
 
@@ -250,6 +491,126 @@ namespace detail {
             LIBSSH2_SFTP_OPENDIR);
     }
 
+    /**
+     * State of a directory listing in progress, shared by all copies of
+     * its iterator.
+     */
+    class directory_listing : private boost::noncopyable
+    {
+    public:
+
+        directory_listing(
+            ::ssh::detail::sftp_channel_state& channel,
+            ::ssh::detail::attribute_cache& cache,
+            const boost::filesystem::path& path)
+            :
+            m_cache(cache),
+            m_handle(open_directory(channel, path)),
+            m_storage(boost::make_shared<listing_arena>(path)),
+            // yuk! hardcoded buffer sizes. unfortunately, libssh2 doesn't
+            // give us a choice.  At least we only allocate them once per
+            // listing, not once per file
+            m_filename_buffer(1024), m_longentry_buffer(1024),
+            m_attributes(LIBSSH2_SFTP_ATTRIBUTES())
+        {}
+
+        bool at_end() const
+        {
+            return m_handle == NULL;
+        }
+
+        sftp_file current() const
+        {
+            return sftp_file(m_storage, m_name, m_long_entry, m_attributes);
+        }
+
+        const listing_arena& storage() const
+        {
+            return *m_storage;
+        }
+
+        void next()
+        {
+            LIBSSH2_SFTP_ATTRIBUTES attrs = LIBSSH2_SFTP_ATTRIBUTES();
+
+            int rc;
+            {
+                ::ssh::detail::file_handle_state::scoped_lock lock =
+                    m_handle->aquire_lock();
+
+                rc = ::ssh::detail::libssh2::sftp::readdir_ex(
+                    m_handle->session_ptr(), m_handle->sftp_ptr(),
+                    m_handle->file_handle(), &m_filename_buffer[0],
+                    m_filename_buffer.size(), &m_longentry_buffer[0],
+                    m_longentry_buffer.size(), &attrs);
+
+                // IMPORTANT: must unlock before possible handle reset below
+                // which would lock the session again to close the file handle
+            }
+
+            if (rc == 0) // end of files
+            {
+                m_handle.reset();
+                return;
+            }
+
+            assert(rc > 0);
+
+            // If no sftp_file still views earlier entries, reuse their
+            // storage
+            if (m_storage.unique())
+            {
+                m_storage->rewind();
+            }
+
+            m_attributes = attrs;
+
+            // we don't assume that the filename is null-terminated but rc
+            // holds the number of bytes written to the buffer
+            std::size_t name_size =
+                (std::min)(static_cast<size_t>(rc), m_filename_buffer.size());
+
+            // the long entry must be usable in an ls -l listing according to
+            // the standard so I'm interpreting this to mean it can't contain
+            // embedded NULLs so we force NULL-termination and take the
+            // NULL-terminated size
+            m_longentry_buffer[m_longentry_buffer.size() - 1] = '\0';
+            std::size_t long_entry_size = std::strlen(&m_longentry_buffer[0]);
+
+            const char* name =
+                m_storage->store(&m_filename_buffer[0], name_size);
+            m_name = sftp_file::char_range(name, name + name_size);
+
+            const char* long_entry =
+                m_storage->store(&m_longentry_buffer[0], long_entry_size);
+            m_long_entry = sftp_file::char_range(
+                long_entry, long_entry + long_entry_size);
+
+            // The listing tells us the attributes of each entry, so save
+            // asking for them again
+            if (m_cache.enabled() && !boost::equals(m_name, ".") &&
+                !boost::equals(m_name, ".."))
+            {
+                m_cache.store(current().path().string(), false, attrs);
+            }
+        }
+
+    private:
+
+        ::ssh::detail::attribute_cache& m_cache;
+        boost::shared_ptr<::ssh::detail::file_handle_state> m_handle;
+        boost::shared_ptr<listing_arena> m_storage;
+        std::vector<char> m_filename_buffer;
+        std::vector<char> m_longentry_buffer;
+
+        /// @name Properties of last successfully listed file.
+        // @{
+        sftp_file::char_range m_name;
+        sftp_file::char_range m_long_entry;
+        LIBSSH2_SFTP_ATTRIBUTES m_attributes;
+        // @}
+    };
+
 }
 
 /**
@@ -291,9 +652,10 @@ public:
 
         directory_iterator operator()(
             ::ssh::detail::sftp_channel_state& channel,
+            ::ssh::detail::attribute_cache& cache,
             const boost::filesystem::path& path)
         {
-            return directory_iterator(channel, path);
+            return directory_iterator(channel, cache, path);
         }
 
         directory_iterator operator()()
@@ -303,122 +665,1400 @@ public:
     };
     /// @endcond
 
+    /**
+     * Number of allocations made to store the entries listed so far.
+     *
+     * Listing should cost a handful of allocations however many entries
+     * the directory has.  The end-of-directory marker reports zero.
+     */
+    std::size_t storage_allocations() const
+    {
+        return (m_listing) ? m_listing->storage().allocations() : 0;
+    }
+
 private:
 
     directory_iterator(
         ::ssh::detail::sftp_channel_state& sftp_channel,
+        ::ssh::detail::attribute_cache& cache,
         const boost::filesystem::path& path)
         :
-        m_directory(path),
-        m_handle(detail::open_directory(sftp_channel, path)),
-        m_attributes(LIBSSH2_SFTP_ATTRIBUTES())
+        m_listing(
+            boost::make_shared<detail::directory_listing>(
+                boost::ref(sftp_channel), boost::ref(cache), path))
     {
-        next_file();
+        m_listing->next();
     }
 
     friend class boost::iterator_core_access;
 
     void increment()
     {
-        if (m_handle == NULL)
+        if (at_end())
             BOOST_THROW_EXCEPTION(std::range_error("No more files"));
-        next_file();
+        m_listing->next();
     }
 
     bool equal(directory_iterator const& other) const
     {
-        return this->m_handle == other.m_handle;
+        if (at_end() || other.at_end())
+        {
+            return at_end() && other.at_end();
+        }
+        else
+        {
+            return m_listing == other.m_listing;
+        }
+    }
+
+    bool at_end() const
+    {
+        return m_listing == NULL || m_listing->at_end();
     }
 
-    void next_file()
-    {    
-        // yuk! hardcoded buffer sizes. unfortunately, libssh2 doesn't
-        // give us a choice so we allocate massive buffers here and then
-        // take measures later to reduce the footprint
+    sftp_file dereference() const
+    {
+        if (at_end())
+            BOOST_THROW_EXCEPTION(
+                std::logic_error("Can't dereference the end of a collection"));
+
+        return m_listing->current();
+    }
+
+    // The listing is shared between all copies of the iterator because
+    // iterators must be copyable
+    boost::shared_ptr<detail::directory_listing> m_listing;
+};
+
+namespace detail {
+
+    BOOST_SCOPED_ENUM_START(path_status)
+    {
+        non_existent,
+            non_directory,
+            directory
+    };
+    BOOST_SCOPED_ENUM_END;
+
+
+    /**
+     * Whether a path is a directory, something else or nothing.
+     *
+     * Links are only followed if `follow_links` is `true`.
+     */
+    inline BOOST_SCOPED_ENUM(path_status) check_status(
+        sftp_filesystem& filesystem, const boost::filesystem::path& path,
+        bool follow_links=false);
+
+}
+
+/**
+ * Callback told about each item as `remove_all` removes it.
+ *
+ * Returning `false` cancels the removal.
+ */
+typedef boost::function<bool (const boost::filesystem::path& removed)>
+    removal_progress;
+
+namespace detail {
 
-        std::vector<char> filename_buffer(1024, '\0');
-        std::vector<char> longentry_buffer(1024, '\0');
-        LIBSSH2_SFTP_ATTRIBUTES attrs = LIBSSH2_SFTP_ATTRIBUTES();
+    using ::ssh::detail::non_blocking_scope;
+    using ::ssh::detail::REQUEST_WAIT_MILLISECONDS;
+    using ::ssh::detail::wait_for_socket;
 
-        int rc;
+    /**
+     * Push a driver's non-blocking requests on as far as they will go.
+     *
+     * `Driver` provides `bool advance_all()`, which moves each of its
+     * requests on until it would block and says whether anything happened,
+     * and `bool finished() const`, which says when to stop pushing early.
+     *
+     * Returns with the session unlocked and blocking again so that the
+     * caller can wait for replies while other users of the session get a
+     * turn.
+     */
+    template<typename Driver>
+    inline void drive_requests(
+        ::ssh::detail::session_state& session, Driver& driver)
+    {
+        LIBSSH2_SESSION* session_ptr = session.session_ptr();
+
+        ::ssh::detail::session_state::scoped_lock lock =
+            session.aquire_lock();
+        non_blocking_scope non_blocking(session_ptr);
+
+        for (;;)
         {
-            ::ssh::detail::file_handle_state::scoped_lock lock =
-                m_handle->aquire_lock();
+            while (driver.advance_all() && !driver.finished())
+            {}
+
+            int directions = ::libssh2_session_block_directions(session_ptr);
 
-            rc = ::ssh::detail::libssh2::sftp::readdir_ex(
-                m_handle->session_ptr(), m_handle->sftp_ptr(),
-                m_handle->file_handle(), &filename_buffer[0],
-                filename_buffer.size(), &longentry_buffer[0],
-                longentry_buffer.size(), &attrs);
+            // A request that is only partly sent has to be finished before
+            // anyone else sends anything, or they get LIBSSH2_ERROR_BAD_USE,
+            // so keep the session to ourselves until it's gone
+            if ((directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) == 0)
+                return;
 
-            // IMPORTANT: must unlock before possible handle reset below
-            // which would lock the session again to close the file handle
+            wait_for_socket(
+                session.socket(), directions, REQUEST_WAIT_MILLISECONDS);
         }
+    }
+
+    /**
+     * Wait, with the session unlocked, for replies to requests in flight.
+     */
+    inline void wait_for_replies(::ssh::detail::session_state& session)
+    {
+        wait_for_socket(
+            session.socket(), LIBSSH2_SESSION_BLOCK_INBOUND,
+            REQUEST_WAIT_MILLISECONDS);
+    }
+
+    /**
+     * Borrow channels from the pool, each wrapped in a driver's `Channel`.
+     *
+     * `Channel` is constructed from the borrowed `sftp_channel_state`.
+     */
+    template<typename Channel>
+    inline void borrow_channels(
+        ::ssh::detail::sftp_channel_pool& pool, std::size_t count,
+        std::vector<boost::shared_ptr<Channel> >& channels)
+    {
+        std::vector< ::ssh::detail::sftp_channel_pool::channel_ptr> borrowed =
+            pool.borrow(count);
 
-        if (rc == 0) // end of files
+        for (std::size_t i = 0; i < borrowed.size(); ++i)
         {
-            m_handle.reset();
+            channels.push_back(boost::make_shared<Channel>(borrowed[i]));
         }
-        else
+    }
+
+    /**
+     * Give a driver's channels back to the pool.
+     *
+     * Channels still waiting on a request, which only happens if the driver
+     * was interrupted by an exception, are dropped instead.
+     */
+    template<typename Channel>
+    inline void return_channels(
+        ::ssh::detail::sftp_channel_pool& pool,
+        const std::vector<boost::shared_ptr<Channel> >& channels) throw()
+    {
+        for (std::size_t i = 0; i < channels.size(); ++i)
         {
-            assert(rc > 0);
+            try
+            {
+                if (channels[i]->busy())
+                {
+                    pool.discard();
+                }
+                else
+                {
+                    pool.give_back(channels[i]->sftp);
+                }
+            }
+            catch (const std::exception&)
+            {
+                // Dropping the channel closes it, which is all we'd lose
+            }
+        }
+    }
+
+    /**
+     * Removes a directory tree keeping many SFTP requests in flight at once.
+     *
+     * libssh2 only lets each SFTP channel have one request outstanding, so
+     * removing one item at a time spends nearly all its time waiting for
+     * round trips.  This opens several channels over the same session and
+     * drives them all in non-blocking mode: listing directories, unlinking
+     * the files the listings find and removing each directory once
+     * everything in it is gone.
+     *
+     * Entries are classified by the attributes that come back with the
+     * listing so, like `sftp_filesystem::remove_directory`, nothing below the
+     * root is statted and symlinks are removed, never followed.
+     */
+    class pipelined_remover : private boost::noncopyable
+    {
+    public:
+
+        /**
+         * @param pool
+         *     Where to borrow the channels from.
+         * @param depth
+         *     Most requests to have in flight at once.  Fewer channels are
+         *     used if the server refuses to open this many.
+         * @param progress
+         *     Told about each item as it is removed.  Called with the session
+         *     locked so it must not use the session itself.
+         */
+        pipelined_remover(
+            ::ssh::detail::sftp_channel_pool& pool, std::size_t depth,
+            const removal_progress& progress)
+            :
+            m_pool(pool), m_session(pool.session_ref()), m_progress(progress),
+            // yuk! hardcoded buffer size, as for directory_listing
+            m_filename_buffer(1024),
+            m_count(0U), m_progressed(false), m_done(false),
+            m_stopping(false)
+        {
+            assert(depth > 0);
+
+            borrow_channels(m_pool, depth, m_channels);
+        }
+
+        ~pipelined_remover() throw()
+        {
+            return_channels(m_pool, m_channels);
+        }
+
+        /**
+         * Remove the directory at `root` and everything in it.
+         *
+         * @returns the number of items removed.
+         */
+        boost::uintmax_t remove_directory(const std::string& root)
+        {
+            m_directories.push_back(directory_node(root, NULL));
+            m_unlisted.push_back(&m_directories.back());
+
+            while (!finished())
+            {
+                drive_requests(m_session, *this);
+
+                if (!finished())
+                {
+                    wait_for_replies(m_session);
+                }
+            }
+
+            if (m_error)
+            {
+                boost::rethrow_exception(m_error);
+            }
+
+            return m_count;
+        }
+
+    private:
+
+        template<typename Driver>
+        friend void drive_requests(
+            ::ssh::detail::session_state& session, Driver& driver);
+
+        /**
+         * A directory being emptied.
+         */
+        struct directory_node
+        {
+            directory_node(const std::string& path, directory_node* parent)
+                : path(path), parent(parent), pending(0U), listed(false) {}
+
+            std::string path;
+            directory_node* parent; ///< NULL for the root
+            std::size_t pending; ///< Entries found but not yet removed
+            bool listed; ///< Listing finished so `pending` is complete
+        };
+
+        /**
+         * An item ready to be removed.
+         */
+        struct removal
+        {
+            removal() : parent(NULL), is_directory(false) {}
+
+            removal(
+                const std::string& path, directory_node* parent,
+                bool is_directory)
+                : path(path), parent(parent), is_directory(is_directory) {}
+
+            std::string path;
+            directory_node* parent;
+            bool is_directory;
+        };
+
+        enum operation
+        {
+            idle,
+            opening,
+            reading,
+            closing,
+            unlinking,
+            removing_directory
+        };
+
+        /**
+         * An SFTP channel and the one request it has in flight.
+         */
+        struct channel : private boost::noncopyable
+        {
+            explicit channel(
+                ::ssh::detail::sftp_channel_pool::channel_ptr sftp)
+                :
+                sftp(sftp), current(idle), handle(NULL), directory(NULL) {}
+
+            bool busy() const
+            {
+                return current != idle;
+            }
+
+            ::ssh::detail::sftp_channel_pool::channel_ptr sftp;
+            operation current;
+            LIBSSH2_SFTP_HANDLE* handle;
+            directory_node* directory; ///< Being listed
+            removal target; ///< Being removed
+        };
+
+        bool finished() const
+        {
+            if (!m_done && !m_stopping)
+                return false;
+
+            for (std::size_t i = 0; i < m_channels.size(); ++i)
+            {
+                if (m_channels[i]->current != idle)
+                    return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Push every channel as far as it will go without blocking.
+         *
+         * @returns whether anything happened.
+         */
+        bool advance_all()
+        {
+            m_progressed = false;
+
+            for (std::size_t i = 0; i < m_channels.size(); ++i)
+            {
+                channel& c = *m_channels[i];
+
+                for (;;)
+                {
+                    if (c.current == idle && !start_next(c))
+                        break;
+
+                    if (!perform(c))
+                        break;
+                }
+            }
+
+            return m_progressed;
+        }
+
+        /**
+         * Give an idle channel something to do.
+         *
+         * Removals come before listings so the queues stay short and
+         * directories are removed as soon as they can be.
+         */
+        bool start_next(channel& c)
+        {
+            if (m_stopping)
+                return false;
+
+            if (!m_removals.empty())
+            {
+                c.target = m_removals.front();
+                m_removals.pop_front();
+
+                c.current = (c.target.is_directory) ?
+                    removing_directory : unlinking;
+            }
+            else if (!m_unlisted.empty())
+            {
+                // Newest first, so the listing goes deep before wide and
+                // finishes directories, rather than starting them, early on
+                c.directory = m_unlisted.back();
+                m_unlisted.pop_back();
+
+                c.current = opening;
+            }
+            else
+            {
+                return false;
+            }
+
+            m_progressed = true;
+            return true;
+        }
+
+        /**
+         * Move the channel's operation on.
+         *
+         * @returns false if it can't go any further without blocking.
+         */
+        bool perform(channel& c)
+        {
+            switch (c.current)
+            {
+            case opening:
+                return open(c);
+            case reading:
+                return read(c);
+            case closing:
+                return close(c);
+            case unlinking:
+            case removing_directory:
+                return remove(c);
+            default:
+                assert(false);
+                BOOST_THROW_EXCEPTION(
+                    std::logic_error("Unknown removal operation"));
+                return false;
+            }
+        }
+
+        bool open(channel& c)
+        {
+            const std::string& path = c.directory->path;
+
+            LIBSSH2_SFTP_HANDLE* handle = ::libssh2_sftp_open_ex(
+                c.sftp->sftp_ptr(), path.data(),
+                static_cast<unsigned int>(path.size()), 0, 0,
+                LIBSSH2_SFTP_OPENDIR);
+
+            if (!handle && would_block())
+                return false;
+
+            m_progressed = true;
+
+            if (handle)
+            {
+                c.handle = handle;
+                c.current = (m_stopping) ?
+                    closing : reading;
+            }
+            else
+            {
+                c.current = idle;
+
+                std::string message;
+                boost::system::error_code ec = last_sftp_error_code(
+                    c.sftp->session_ptr(), c.sftp->sftp_ptr(), message);
+
+                if (ec == boost::system::errc::no_such_file_or_directory)
+                {
+                    // Something else deleted the directory before we could
+                    finished_with(c.directory->parent);
+                }
+                else
+                {
+                    fail(ec, message, "libssh2_sftp_open_ex", path);
+                }
+            }
+
+            return true;
+        }
+
+        bool read(channel& c)
+        {
+            while (!m_stopping)
+            {
+                LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+
+                int rc = ::libssh2_sftp_readdir_ex(
+                    c.handle, &m_filename_buffer[0], m_filename_buffer.size(),
+                    NULL, 0, &attributes);
+
+                if (rc == LIBSSH2_ERROR_EAGAIN)
+                    return false;
+
+                m_progressed = true;
+
+                if (rc == 0) // end of files
+                {
+                    break;
+                }
+                else if (rc < 0)
+                {
+                    std::string message;
+                    boost::system::error_code ec = last_sftp_error_code(
+                        c.sftp->session_ptr(), c.sftp->sftp_ptr(), message);
+
+                    fail(
+                        ec, message, "libssh2_sftp_readdir_ex",
+                        c.directory->path);
+                }
+                else
+                {
+                    // rc holds the number of bytes written to the buffer
+                    std::size_t name_size = (std::min)(
+                        static_cast<std::size_t>(rc), m_filename_buffer.size());
+
+                    found(
+                        *c.directory, &m_filename_buffer[0], name_size,
+                        file_attributes(attributes));
+                }
+            }
+
+            c.current = closing;
+            return true;
+        }
+
+        bool close(channel& c)
+        {
+            int rc = ::libssh2_sftp_close_handle(c.handle);
+            if (rc == LIBSSH2_ERROR_EAGAIN)
+                return false;
+
+            m_progressed = true;
+
+            // libssh2 frees the handle whether closing succeeds or not
+            c.handle = NULL;
+            c.current = idle;
+
+            // A failure to close doesn't stop us removing the directory, so
+            // it isn't worth reporting
+
+            if (!m_stopping)
+            {
+                c.directory->listed = true;
+                check_empty(*c.directory);
+            }
+
+            return true;
+        }
+
+        bool remove(channel& c)
+        {
+            const std::string& path = c.target.path;
+            bool is_directory = c.current == removing_directory;
+
+            int rc;
+            if (is_directory)
+            {
+                rc = ::libssh2_sftp_rmdir_ex(
+                    c.sftp->sftp_ptr(), path.data(),
+                    static_cast<unsigned int>(path.size()));
+            }
+            else
+            {
+                rc = ::libssh2_sftp_unlink_ex(
+                    c.sftp->sftp_ptr(), path.data(),
+                    static_cast<unsigned int>(path.size()));
+            }
+
+            if (rc == LIBSSH2_ERROR_EAGAIN)
+                return false;
+
+            m_progressed = true;
+            c.current = idle;
+
+            if (rc < 0)
+            {
+                std::string message;
+                boost::system::error_code ec = last_sftp_error_code(
+                    c.sftp->session_ptr(), c.sftp->sftp_ptr(), message);
+
+                if (ec != boost::system::errc::no_such_file_or_directory)
+                {
+                    fail(
+                        ec, message,
+                        (is_directory) ?
+                            "libssh2_sftp_rmdir_ex" : "libssh2_sftp_unlink_ex",
+                        path);
+                    return true;
+                }
+
+                // Something else deleted the item before we could
+            }
+            else
+            {
+                removed(path);
+            }
+
+            finished_with(c.target.parent);
+            return true;
+        }
+
+        /**
+         * Queue an entry the listing of `directory` turned up.
+         */
+        void found(
+            directory_node& directory, const char* name,
+            std::size_t name_size, const file_attributes& attributes)
+        {
+            if ((name_size == 1 && name[0] == '.') ||
+                (name_size == 2 && name[0] == '.' && name[1] == '.'))
+            {
+                return;
+            }
+
+            std::string path = directory.path;
+            if (!path.empty() && path[path.size() - 1] != '/')
+            {
+                path += '/';
+            }
+            path.append(name, name_size);
+
+            ++directory.pending;
+
+            if (attributes.type() == file_attributes::directory)
+            {
+                // deque, because pushing onto it doesn't move the other
+                // nodes, which point at their parents
+                m_directories.push_back(directory_node(path, &directory));
+                m_unlisted.push_back(&m_directories.back());
+            }
+            else
+            {
+                // This includes 'unknown' file type.  What's the alternative?
+                m_removals.push_back(removal(path, &directory, false));
+            }
+        }
+
+        /**
+         * Account for one of `parent`'s entries having gone.
+         */
+        void finished_with(directory_node* parent)
+        {
+            if (parent == NULL)
+            {
+                // That was the root
+                m_done = true;
+            }
+            else
+            {
+                assert(parent->pending > 0);
+                --parent->pending;
+                check_empty(*parent);
+            }
+        }
+
+        /**
+         * Queue a directory for removal once it's known to be empty.
+         */
+        void check_empty(directory_node& directory)
+        {
+            if (directory.listed && directory.pending == 0 && !m_stopping)
+            {
+                // At the front, as removing it may let its parent go too
+                m_removals.push_front(
+                    removal(directory.path, directory.parent, true));
+            }
+        }
+
+        void removed(const std::string& path)
+        {
+            ++m_count;
+
+            // Once stopping, the caller has already heard all it wants to
+            if (m_progress && !m_stopping)
+            {
+                try
+                {
+                    if (!m_progress(boost::filesystem::path(path)))
+                    {
+                        BOOST_THROW_EXCEPTION(
+                            boost::system::system_error(
+                                boost::system::errc::make_error_code(
+                                    boost::system::errc::operation_canceled),
+                                "Removal cancelled"));
+                    }
+                }
+                catch (...)
+                {
+                    // Can't let the exception out until the requests in
+                    // flight are finished
+                    stop(boost::current_exception());
+                }
+            }
+        }
+
+        void fail(
+            const boost::system::error_code& ec, const std::string& message,
+            const char* api_function, const std::string& path)
+        {
+            try
+            {
+                SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                    ec, message, api_function, path.data(), path.size());
+            }
+            catch (...)
+            {
+                stop(boost::current_exception());
+            }
+        }
+
+        /**
+         * Stop starting requests and report `error` once the requests in
+         * flight are done.
+         *
+         * Only the first error is kept.
+         */
+        void stop(boost::exception_ptr error)
+        {
+            if (!m_error)
+            {
+                m_error = error;
+            }
+
+            m_stopping = true;
+        }
+
+        bool would_block()
+        {
+            return ::libssh2_session_last_errno(m_session.session_ptr()) ==
+                LIBSSH2_ERROR_EAGAIN;
+        }
+
+        ::ssh::detail::sftp_channel_pool& m_pool;
+        ::ssh::detail::session_state& m_session;
+        std::vector<boost::shared_ptr<channel> > m_channels;
+        removal_progress m_progress;
+        std::vector<char> m_filename_buffer;
+
+        /// Every directory found so far.  Nodes are kept, even once removed,
+        /// so the tree costs memory per directory but not per file.
+        std::deque<directory_node> m_directories;
+        std::vector<directory_node*> m_unlisted;
+        std::deque<removal> m_removals;
+
+        boost::uintmax_t m_count;
+        bool m_progressed; ///< Something happened during this advance
+        bool m_done; ///< Root removed
+        bool m_stopping; ///< Cancelled or failed; just finishing what's in flight
+        boost::exception_ptr m_error;
+    };
+
+    /**
+     * Permissions for new directories.
+     *
+     * 0755 rather than Boost.Filesystem's 0777.  See `create_directory`.
+     */
+    const long NEW_DIRECTORY_MODE =
+        LIBSSH2_SFTP_S_IRWXU |
+        LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IXGRP |
+        LIBSSH2_SFTP_S_IROTH | LIBSSH2_SFTP_S_IXOTH;
+
+    /**
+     * Parent of a path in the form the server uses.
+     *
+     * @returns an empty string if the path has no parent we could create.
+     */
+    inline std::string remote_parent(const std::string& path)
+    {
+        std::string::size_type slash = path.find_last_of('/');
+
+        if (slash == std::string::npos || path == "/")
+            return std::string();
+        else if (slash == 0)
+            return "/";
+        else
+            return path.substr(0, slash);
+    }
+
+    /**
+     * Creates many directories, and any missing parents, keeping several
+     * requests in flight at once.
+     *
+     * Each directory is created as soon as its parent is known to exist.
+     * Directories whose parents aren't among those requested are assumed to
+     * have parents already, so the top of every branch is sent at once.
+     * Only where that assumption fails do we walk upwards, creating the
+     * missing parent first and trying again.
+     */
+    class pipelined_directory_creator : private boost::noncopyable
+    {
+    public:
+
+        /**
+         * @param pool
+         *     Where to borrow the channels from.
+         * @param depth
+         *     Most requests to have in flight at once.  Fewer channels are
+         *     used if the server refuses to open this many.
+         */
+        pipelined_directory_creator(
+            ::ssh::detail::sftp_channel_pool& pool, std::size_t depth)
+            :
+            m_pool(pool), m_session(pool.session_ref()), m_depth(depth),
+            m_count(0U), m_progressed(false), m_stopping(false)
+        {
+            assert(depth > 0);
+        }
+
+        ~pipelined_directory_creator() throw()
+        {
+            return_channels(m_pool, m_channels);
+        }
+
+        /**
+         * Create the directories and any missing parents.
+         *
+         * @returns the number of directories created, including parents.
+         */
+        boost::uintmax_t create(
+            const std::vector<boost::filesystem::path>& directories)
+        {
+            for (std::size_t i = 0; i < directories.size(); ++i)
+            {
+                node_for(directories[i].string());
+            }
+
+            // Link up parents only once all the nodes exist, so that we
+            // don't depend on the order they were given in
+            for (node_map::iterator it = m_nodes.begin();
+                it != m_nodes.end(); ++it)
+            {
+                node_map::iterator parent =
+                    m_nodes.find(remote_parent(it->first));
+
+                if (parent == m_nodes.end())
+                {
+                    m_ready.push_back(&it->second);
+                }
+                else
+                {
+                    it->second.parent = &parent->second;
+                    parent->second.waiting.push_back(&it->second);
+                }
+            }
+
+            if (!m_nodes.empty())
+            {
+                borrow_channels(
+                    m_pool, (std::min)(m_depth, m_nodes.size()), m_channels);
+            }
+
+            while (!finished())
+            {
+                drive_requests(m_session, *this);
+
+                if (!finished())
+                {
+                    wait_for_replies(m_session);
+                }
+            }
+
+            if (m_error)
+            {
+                boost::rethrow_exception(m_error);
+            }
+
+            return m_count;
+        }
+
+    private:
+
+        template<typename Driver>
+        friend void drive_requests(
+            ::ssh::detail::session_state& session, Driver& driver);
+
+        /**
+         * A directory to create.
+         */
+        struct directory_node
+        {
+            explicit directory_node(const std::string& path)
+                : path(path), parent(NULL), exists(false) {}
+
+            std::string path;
+            directory_node* parent; ///< NULL if assumed to exist
+            std::vector<directory_node*> waiting; ///< Children waiting on us
+            bool exists; ///< Created by us or found already there
+        };
+
+        // map, because inserting into it doesn't move the other nodes, which
+        // point at each other
+        typedef std::map<std::string, directory_node> node_map;
+
+        enum operation
+        {
+            idle,
+            making,
+            checking
+        };
+
+        /**
+         * An SFTP channel and the one request it has in flight.
+         */
+        struct channel : private boost::noncopyable
+        {
+            explicit channel(
+                ::ssh::detail::sftp_channel_pool::channel_ptr sftp)
+                : sftp(sftp), current(idle), directory(NULL) {}
+
+            bool busy() const
+            {
+                return current != idle;
+            }
+
+            ::ssh::detail::sftp_channel_pool::channel_ptr sftp;
+            operation current;
+            directory_node* directory;
+
+            /// @name Why mkdir failed, while we check why.
+            // @{
+            boost::system::error_code error;
+            std::string message;
+            // @}
+        };
+
+        directory_node& node_for(std::string path)
+        {
+            if (path.size() > 1 && path[path.size() - 1] == '/')
+            {
+                path.erase(path.size() - 1);
+            }
+
+            return m_nodes.insert(
+                std::make_pair(path, directory_node(path))).first->second;
+        }
+
+        bool finished() const
+        {
+            if (!m_stopping && !m_ready.empty())
+                return false;
+
+            for (std::size_t i = 0; i < m_channels.size(); ++i)
+            {
+                if (m_channels[i]->current != idle)
+                    return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Push every channel as far as it will go without blocking.
+         *
+         * @returns whether anything happened.
+         */
+        bool advance_all()
+        {
+            m_progressed = false;
+
+            for (std::size_t i = 0; i < m_channels.size(); ++i)
+            {
+                channel& c = *m_channels[i];
+
+                for (;;)
+                {
+                    if (c.current == idle && !start_next(c))
+                        break;
+
+                    if (!perform(c))
+                        break;
+                }
+            }
+
+            return m_progressed;
+        }
+
+        bool start_next(channel& c)
+        {
+            if (m_stopping || m_ready.empty())
+                return false;
+
+            c.directory = m_ready.front();
+            m_ready.pop_front();
+            c.current = making;
+
+            m_progressed = true;
+            return true;
+        }
+
+        /**
+         * Move the channel's operation on.
+         *
+         * @returns false if it can't go any further without blocking.
+         */
+        bool perform(channel& c)
+        {
+            switch (c.current)
+            {
+            case making:
+                return make(c);
+            case checking:
+                return check(c);
+            default:
+                assert(false);
+                BOOST_THROW_EXCEPTION(
+                    std::logic_error("Unknown creation operation"));
+                return false;
+            }
+        }
+
+        bool make(channel& c)
+        {
+            const std::string& path = c.directory->path;
+
+            int rc = ::libssh2_sftp_mkdir_ex(
+                c.sftp->sftp_ptr(), path.data(),
+                static_cast<unsigned int>(path.size()), NEW_DIRECTORY_MODE);
+
+            if (rc == LIBSSH2_ERROR_EAGAIN)
+                return false;
+
+            m_progressed = true;
+
+            if (rc == 0)
+            {
+                ++m_count;
+                c.current = idle;
+                made(*c.directory);
+                return true;
+            }
+
+            c.error = last_sftp_error_code(
+                c.sftp->session_ptr(), c.sftp->sftp_ptr(), c.message);
+
+            if (c.error == boost::system::errc::no_such_file_or_directory)
+            {
+                c.current = idle;
+                missing_parent(c);
+            }
+            else
+            {
+                // OpenSSH just returns FX_FAILURE when the directory is
+                // already there, which could have many causes.  The only way
+                // to be sure is to check explicitly.
+                c.current = checking;
+            }
+
+            return true;
+        }
+
+        bool check(channel& c)
+        {
+            const std::string& path = c.directory->path;
+            LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+
+            // Following links, as a link to a directory is as good as one
+            int rc = ::libssh2_sftp_stat_ex(
+                c.sftp->sftp_ptr(), path.data(),
+                static_cast<unsigned int>(path.size()), LIBSSH2_SFTP_STAT,
+                &attributes);
+
+            if (rc == LIBSSH2_ERROR_EAGAIN)
+                return false;
+
+            m_progressed = true;
+            c.current = idle;
+
+            if (rc == 0)
+            {
+                if (file_attributes(attributes).type() ==
+                    file_attributes::directory)
+                {
+                    made(*c.directory);
+                }
+                else
+                {
+                    fail(c.error, c.message, path);
+                }
+            }
+            else if (last_sftp_error_code(
+                c.sftp->session_ptr(), c.sftp->sftp_ptr()) ==
+                boost::system::errc::no_such_file_or_directory)
+            {
+                // The server didn't say so but the parent must be missing
+                missing_parent(c);
+            }
+            else
+            {
+                fail(c.error, c.message, path);
+            }
+
+            return true;
+        }
+
+        /**
+         * The directory now exists so its children can go.
+         */
+        void made(directory_node& directory)
+        {
+            directory.exists = true;
+
+            m_ready.insert(
+                m_ready.end(), directory.waiting.begin(),
+                directory.waiting.end());
+            directory.waiting.clear();
+        }
+
+        /**
+         * Create the parent of the channel's directory before trying the
+         * directory again.
+         */
+        void missing_parent(channel& c)
+        {
+            directory_node& directory = *c.directory;
+
+            std::string parent_path = remote_parent(directory.path);
+
+            // If we'd already made sure the parent existed, something else
+            // must have removed it.  Don't fight it.
+            if (directory.parent != NULL || parent_path.empty())
+            {
+                fail(c.error, c.message, directory.path);
+                return;
+            }
+
+            // Siblings may have found the parent missing before us
+            bool new_parent = m_nodes.find(parent_path) == m_nodes.end();
+
+            directory_node& parent = node_for(parent_path);
+            directory.parent = &parent;
+
+            if (parent.exists)
+            {
+                m_ready.push_back(&directory);
+                return;
+            }
+
+            parent.waiting.push_back(&directory);
+
+            if (new_parent)
+            {
+                node_map::iterator grandparent =
+                    m_nodes.find(remote_parent(parent_path));
+
+                if (grandparent != m_nodes.end() &&
+                    !grandparent->second.exists)
+                {
+                    parent.parent = &grandparent->second;
+                    grandparent->second.waiting.push_back(&parent);
+                }
+                else
+                {
+                    // Parents at the front: everything under them is
+                    // waiting for them
+                    m_ready.push_front(&parent);
+                }
+            }
+        }
+
+        void fail(
+            const boost::system::error_code& ec, const std::string& message,
+            const std::string& path)
+        {
+            try
+            {
+                SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                    ec, message, "libssh2_sftp_mkdir_ex", path.data(),
+                    path.size());
+            }
+            catch (...)
+            {
+                if (!m_error)
+                {
+                    m_error = boost::current_exception();
+                }
+
+                m_stopping = true;
+            }
+        }
+
+        ::ssh::detail::sftp_channel_pool& m_pool;
+        ::ssh::detail::session_state& m_session;
+        std::size_t m_depth;
+        std::vector<boost::shared_ptr<channel> > m_channels;
+        node_map m_nodes;
+        std::deque<directory_node*> m_ready; ///< Parents known or assumed made
+        boost::uintmax_t m_count;
+        bool m_progressed; ///< Something happened during this advance
+        bool m_stopping; ///< Failed; just finishing what's in flight
+        boost::exception_ptr m_error;
+    };
+
+    /**
+     * Fetches the attributes of many files, several requests at a time.
+     *
+     * Each channel has one stat in flight; as soon as its reply arrives it
+     * sends the next.  Unlike the other pipelines, a file failing is not
+     * fatal: its error is recorded in its result and the rest carry on.
+     */
+    class pipelined_stat : private boost::noncopyable
+    {
+    public:
+
+        /**
+         * @param pool
+         *     Where to borrow the channels from.
+         * @param window
+         *     Most requests to have in flight at once.  Fewer channels are
+         *     used if the server refuses to open this many.
+         */
+        pipelined_stat(
+            ::ssh::detail::sftp_channel_pool& pool, std::size_t window)
+            :
+            m_pool(pool), m_session(pool.session_ref()), m_window(window),
+            m_files(NULL), m_results(NULL), m_next(0U), m_follow_links(false),
+            m_progressed(false)
+        {
+            assert(window > 0);
+        }
+
+        ~pipelined_stat() throw()
+        {
+            return_channels(m_pool, m_channels);
+        }
+
+        std::vector<attributes_result> stat(
+            const std::vector<boost::filesystem::path>& files,
+            bool follow_links)
+        {
+            std::vector<attributes_result> results(files.size());
+            if (files.empty())
+                return results;
+
+            m_files = &files;
+            m_results = &results;
+            m_next = 0U;
+            m_follow_links = follow_links;
+
+            if (m_channels.empty())
+            {
+                borrow_channels(
+                    m_pool, (std::min)(m_window, files.size()), m_channels);
+            }
+
+            while (!finished())
+            {
+                drive_requests(m_session, *this);
+
+                if (!finished())
+                {
+                    wait_for_replies(m_session);
+                }
+            }
+
+            m_files = NULL;
+            m_results = NULL;
+
+            return results;
+        }
+
+    private:
+
+        template<typename Driver>
+        friend void drive_requests(
+            ::ssh::detail::session_state& session, Driver& driver);
+
+        /**
+         * An SFTP channel and the file it is asking about, if any.
+         */
+        struct channel : private boost::noncopyable
+        {
+            explicit channel(
+                ::ssh::detail::sftp_channel_pool::channel_ptr sftp)
+                : sftp(sftp), in_flight(false), file(0U) {}
+
+            bool busy() const
+            {
+                return in_flight;
+            }
+
+            ::ssh::detail::sftp_channel_pool::channel_ptr sftp;
+            bool in_flight;
+            std::size_t file; ///< Index of the file being queried
+            std::string path; ///< Kept alive for the request's duration
+        };
+
+        bool finished() const
+        {
+            if (m_next < m_files->size())
+                return false;
+
+            for (std::size_t i = 0; i < m_channels.size(); ++i)
+            {
+                if (m_channels[i]->busy())
+                    return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Push every channel as far as it will go without blocking.
+         *
+         * @returns whether anything happened.
+         */
+        bool advance_all()
+        {
+            m_progressed = false;
+
+            for (std::size_t i = 0; i < m_channels.size(); ++i)
+            {
+                channel& c = *m_channels[i];
 
-            // copy attributes to member one we know we're overwriting the
-            // last-retrieved file's properties
-            m_attributes = attrs;
+                for (;;)
+                {
+                    if (!c.busy() && !start_next(c))
+                        break;
 
-            // we don't assume that the filename is null-terminated but rc
-            // holds the number of bytes written to the buffer so we can shrink
-            // the filename string to that size
-            m_file_name = std::string(
-                &filename_buffer[0],
-                (std::min)(static_cast<size_t>(rc), filename_buffer.size()));
+                    if (!perform(c))
+                        break;
+                }
+            }
 
-            // the long entry must be usable in an ls -l listing according to
-            // the standard so I'm interpreting this to mean it can't contain
-            // embedded NULLs so we force NULL-termination and then allocate
-            // the string to be the NULL-terminated size which will likely be
-            // much smaller than the buffer
-            longentry_buffer[longentry_buffer.size() - 1] = '\0';
-            m_long_entry = std::string(&longentry_buffer[0]);
+            return m_progressed;
         }
-    }
 
-    sftp_file dereference() const
-    {
-        if (m_handle == NULL)
-            BOOST_THROW_EXCEPTION(
-                std::logic_error("Can't dereference the end of a collection"));
+        bool start_next(channel& c)
+        {
+            if (m_next >= m_files->size())
+                return false;
 
-        return sftp_file(m_directory / m_file_name, m_long_entry, m_attributes);
-    }
+            c.file = m_next++;
+            c.path = (*m_files)[c.file].string();
+            c.in_flight = true;
 
-    // The file handle is shared between all copies of the iterator because
-    // iterators must be copyable
-    boost::shared_ptr<::ssh::detail::file_handle_state> m_handle;
-    boost::filesystem::path m_directory;
+            m_progressed = true;
+            return true;
+        }
 
-    /// @name Properties of last successfully listed file.
-    // @{
-    std::string m_file_name;
-    std::string m_long_entry;
-    LIBSSH2_SFTP_ATTRIBUTES m_attributes;
-    // @}
-};
+        /**
+         * Move the channel's stat on.
+         *
+         * @returns false if it can't go any further without blocking.
+         */
+        bool perform(channel& c)
+        {
+            LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
 
-namespace detail {
+            int rc = ::libssh2_sftp_stat_ex(
+                c.sftp->sftp_ptr(), c.path.data(),
+                static_cast<unsigned int>(c.path.size()),
+                (m_follow_links) ? LIBSSH2_SFTP_STAT : LIBSSH2_SFTP_LSTAT,
+                &attributes);
 
-    BOOST_SCOPED_ENUM_START(path_status)
-    {
-        non_existent,
-            non_directory,
-            directory
-    };
-    BOOST_SCOPED_ENUM_END;
+            if (rc == LIBSSH2_ERROR_EAGAIN)
+                return false;
 
+            m_progressed = true;
+            c.in_flight = false;
 
-    inline BOOST_SCOPED_ENUM(path_status) check_status(
-        sftp_filesystem& filesystem, const boost::filesystem::path& path);
+            attributes_result& result = (*m_results)[c.file];
+            if (rc == 0)
+            {
+                result.attributes = file_attributes(attributes);
+            }
+            else
+            {
+                result.error = last_sftp_error_code(
+                    c.sftp->session_ptr(), c.sftp->sftp_ptr());
+            }
+
+            return true;
+        }
+
+        ::ssh::detail::sftp_channel_pool& m_pool;
+        ::ssh::detail::session_state& m_session;
+        std::size_t m_window;
+        std::vector<boost::shared_ptr<channel> > m_channels;
+        const std::vector<boost::filesystem::path>* m_files;
+        std::vector<attributes_result>* m_results;
+        std::size_t m_next; ///< Index of the next file to send a stat for
+        bool m_follow_links;
+        bool m_progressed; ///< Something happened during this advance
+    };
 
 }
 
@@ -454,6 +2094,64 @@ BOOST_SCOPED_ENUM_END
 class sftp_input_device;
 class sftp_output_device;
 class sftp_io_device;
+class recursive_directory_iterator;
+class sftp_filesystem;
+
+/**
+ * One of a filesystem's spare SFTP channels, lent out until destroyed.
+ *
+ * Streams opened on a borrowed channel have it to themselves so, while
+ * their requests wait for replies, they leave the session free for
+ * requests on other channels.  Streams on separate borrowed channels
+ * therefore overlap their round trips instead of taking turns.
+ *
+ * A channel carries one request at a time, so only use the streams on a
+ * channel from one thread at a time and close them before the channel is
+ * destroyed.  The filesystem must outlive the channel.
+ */
+class borrowed_channel : private boost::noncopyable
+{
+public:
+
+    ~borrowed_channel() throw()
+    {
+        try
+        {
+            m_pool.give_back(m_sftp);
+        }
+        catch (const std::exception&)
+        {
+            // Dropping the channel closes it, which is all we'd lose
+        }
+    }
+
+private:
+
+    friend class sftp_filesystem; // to construct in borrow_channels method
+    friend class sftp_input_device;
+    friend class sftp_output_device;
+    friend class sftp_io_device;
+
+    borrowed_channel(
+        ::ssh::detail::sftp_channel_pool& pool,
+        ::ssh::detail::sftp_channel_pool::channel_ptr sftp,
+        ::ssh::detail::attribute_cache& cache)
+        : m_pool(pool), m_sftp(sftp), m_cache(cache) {}
+
+    ::ssh::detail::sftp_channel_state& sftp_ref()
+    {
+        return *m_sftp;
+    }
+
+    ::ssh::detail::attribute_cache& cache_ref()
+    {
+        return m_cache;
+    }
+
+    ::ssh::detail::sftp_channel_pool& m_pool;
+    ::ssh::detail::sftp_channel_pool::channel_ptr m_sftp;
+    ::ssh::detail::attribute_cache& m_cache;
+};
 
 /**
  * Connection to the filesystem on a remote server via an SSH/SFTP connection.
@@ -471,7 +2169,10 @@ public:
      * Move constructor.
      */
     sftp_filesystem(BOOST_RV_REF(sftp_filesystem) other)
-        : m_sftp(boost::move(other.m_sftp))
+        :
+        m_sftp(boost::move(other.m_sftp)),
+        m_pool(boost::move(other.m_pool)),
+        m_cache(boost::move(other.m_cache))
     {}
 
     /**
@@ -480,6 +2181,8 @@ public:
     sftp_filesystem& operator=(BOOST_RV_REF(sftp_filesystem) other)
     {
         m_sftp = boost::move(other.m_sftp);
+        m_pool = boost::move(other.m_pool);
+        m_cache = boost::move(other.m_cache);
         return *this;
     }
 
@@ -496,7 +2199,7 @@ public:
     directory_iterator directory_iterator(const boost::filesystem::path& path)
     {
         return ssh::filesystem::directory_iterator::factory_attorney()(
-            sftp_ref(), path);
+            sftp_ref(), cache_ref(), path);
     }
 
     /**
@@ -521,6 +2224,23 @@ public:
     {
         std::string file_path = file.string();
         LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+        boost::system::error_code ec;
+        std::string message;
+
+        switch (cache_ref().find(
+            file_path, follow_links, attributes, ec, message))
+        {
+        case ::ssh::detail::attribute_cache::found:
+            return file_attributes(attributes);
+
+        case ::ssh::detail::attribute_cache::missing:
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, message, "libssh2_sftp_stat_ex", file_path.data(),
+                file_path.size());
+
+        default:
+            break;
+        }
 
         {
             ::ssh::detail::sftp_channel_state::scoped_lock lock =
@@ -530,12 +2250,145 @@ public:
                 sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
                 file_path.data(), file_path.size(),
                 (follow_links) ? LIBSSH2_SFTP_STAT : LIBSSH2_SFTP_LSTAT,
-                &attributes);
+                &attributes, ec, message);
+        }
+
+        if (ec)
+        {
+            if (ec == boost::system::errc::no_such_file_or_directory)
+            {
+                cache_ref().store_missing(
+                    file_path, follow_links, ec, message);
+            }
+
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, message, "libssh2_sftp_stat_ex", file_path.data(),
+                file_path.size());
         }
 
+        cache_ref().store(file_path, follow_links, attributes);
+
         return file_attributes(attributes);
     }
 
+    /**
+     * Query the attributes of many files at once.
+     *
+     * Rather than waiting for each reply before asking about the next file,
+     * up to @a window requests are in flight at a time, so the whole batch
+     * costs roughly `files.size() / window` round trips instead of one per
+     * file.
+     *
+     * If @a follow_links is @c true, the file that is queried is the target of
+     * any chain of links.  Otherwise, it is the link itself.
+     *
+     * @param files
+     *     Files to query, which needn't exist.
+     * @param window
+     *     Most requests to have in flight.  Servers limit the channels they
+     *     allow per connection so fewer may be used.
+     *
+     * @returns a result for each file, in the same order.  A file that
+     *          couldn't be queried, for instance because it doesn't exist,
+     *          has its error set rather than failing the whole batch.
+     */
+    std::vector<attributes_result> attributes(
+        const std::vector<boost::filesystem::path>& files, bool follow_links,
+        std::size_t window=8)
+    {
+        if (window == 0)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Window must be at least one"));
+
+        std::vector<attributes_result> results(files.size());
+
+        // Only ask the server about what the cache can't answer
+        std::vector<boost::filesystem::path> uncached;
+        std::vector<std::size_t> uncached_positions;
+        for (std::size_t i = 0; i < files.size(); ++i)
+        {
+            LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+            std::string message;
+
+            switch (cache_ref().find(
+                files[i].string(), follow_links, attributes, results[i].error,
+                message))
+            {
+            case ::ssh::detail::attribute_cache::found:
+                results[i].attributes = file_attributes(attributes);
+                break;
+
+            case ::ssh::detail::attribute_cache::missing:
+                break;
+
+            default:
+                uncached.push_back(files[i]);
+                uncached_positions.push_back(i);
+                break;
+            }
+        }
+
+        if (uncached.empty())
+            return results;
+
+        detail::pipelined_stat stat(pool_ref(), window);
+        std::vector<attributes_result> fetched =
+            stat.stat(uncached, follow_links);
+
+        for (std::size_t i = 0; i < fetched.size(); ++i)
+        {
+            std::string path = uncached[i].string();
+
+            if (fetched[i].attributes)
+            {
+                cache_ref().store(
+                    path, follow_links, fetched[i].attributes->m_attributes);
+            }
+            else if (fetched[i].error ==
+                boost::system::errc::no_such_file_or_directory)
+            {
+                cache_ref().store_missing(
+                    path, follow_links, fetched[i].error,
+                    fetched[i].error.message());
+            }
+
+            results[uncached_positions[i]] = fetched[i];
+        }
+
+        return results;
+    }
+
+    /**
+     * Remember attributes, including that files don't exist, for a short
+     * while to save asking the server about them again.
+     *
+     * Once enabled, directory listings fill the cache as a side effect, so
+     * checking the type or existence of something just listed is free.
+     * Changes made through this filesystem object update the cache but
+     * changes made any other way are only noticed once the cached answer
+     * expires.
+     *
+     * Off until this is called.  Passing a zero `max_staleness` turns it
+     * off again.  Either way, anything already cached is forgotten.
+     */
+    void cache_attributes(
+        const attribute_cache_options& options=attribute_cache_options())
+    {
+        cache_ref().configure(
+            options.max_staleness, options.negative_lifetime);
+    }
+
+    /**
+     * How often the attribute cache saved asking the server.
+     */
+    attribute_cache_statistics cache_statistics() const
+    {
+        attribute_cache_statistics statistics;
+        statistics.hits = m_cache->hits();
+        statistics.misses = m_cache->misses();
+        return statistics;
+    }
+
     boost::filesystem::path resolve_link_target(
         const boost::filesystem::path& link)
     {
@@ -573,6 +2426,8 @@ public:
         std::string link_string = link.string();
         std::string target_string = target.string();
 
+        cache_ref().invalidate(link_string);
+
         ::ssh::detail::sftp_channel_state::scoped_lock lock =
             sftp_ref().aquire_lock();
 
@@ -649,6 +2504,9 @@ public:
                 std::invalid_argument("Unrecognised overwrite behaviour"));
         }
 
+        cache_ref().invalidate(source_string);
+        cache_ref().invalidate(destination_string);
+
         ::ssh::detail::sftp_channel_state::scoped_lock lock =
             sftp_ref().aquire_lock();
 
@@ -757,6 +2615,83 @@ public:
         }
     }
 
+    /**
+     * Remove a file and anything below it in the hierarchy, keeping several
+     * requests to the server in flight at once.
+     *
+     * Behaves like the single-argument `remove_all` but, rather than waiting
+     * for each unlink before sending the next, lists directories and removes
+     * their contents over up to `pipeline_depth` SFTP channels at the same
+     * time.  On a high-latency connection this is many times faster for
+     * large trees.  Directories are removed bottom-up as soon as they are
+     * empty.
+     *
+     * @param target
+     *     File or directory to remove.  If `target` is a symlink, only the
+     *     link is removed.
+     * @param pipeline_depth
+     *     Most requests to have in flight.  Servers limit the channels they
+     *     allow per connection so fewer may be used.
+     * @param progress
+     *     Optional callback told about each item as it is removed.  Returning
+     *     `false` cancels the removal, leaving anything not yet removed in
+     *     place.  It is called with the session locked so must not use the
+     *     session itself.
+     *
+     * @returns the number of files removed.
+     *
+     * @throws `boost::system::system_error` with `errc::operation_canceled`
+     *         if `progress` cancelled the removal, or the first error the
+     *         server reported.  Either way, requests already sent are allowed
+     *         to finish before the function returns.
+     */
+    boost::uintmax_t remove_all(
+        const boost::filesystem::path& target, std::size_t pipeline_depth,
+        const removal_progress& progress=removal_progress())
+    {
+        if (pipeline_depth == 0)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Pipeline depth must be at least one"));
+
+        // Stat the root, even though listing it would tell us if it were a
+        // directory, because listing would follow a symlink and we must only
+        // remove the link
+        switch (detail::check_status(*this, target))
+        {
+        case detail::path_status::non_existent:
+            return 0U;
+
+        case detail::path_status::directory:
+            {
+                cache_ref().invalidate(target.string());
+
+                detail::pipelined_remover remover(
+                    pool_ref(), pipeline_depth, progress);
+
+                return remover.remove_directory(target.string());
+            }
+
+        case detail::path_status::non_directory:
+            if (remove_one_file(target))
+            {
+                // Nothing left to cancel, whatever it says
+                if (progress)
+                    progress(target);
+
+                return 1U;
+            }
+            else
+            {
+                return 0U;
+            }
+
+        default:
+            assert(false);
+            BOOST_THROW_EXCEPTION(std::logic_error("Unknown path status"));
+            return 0U;
+        }
+    }
+
     /**
      * Make a directory accessible from the given path.
      *
@@ -773,6 +2708,8 @@ public:
     {
         std::string new_directory_string = new_directory.string();
 
+        cache_ref().invalidate(new_directory_string);
+
         try
         {
             ::ssh::detail::sftp_channel_state::scoped_lock lock =
@@ -782,9 +2719,7 @@ public:
                 sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
                 new_directory_string.data(),
                 new_directory_string.size(),
-                LIBSSH2_SFTP_S_IRWXU |
-                LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IXGRP |
-                LIBSSH2_SFTP_S_IROTH | LIBSSH2_SFTP_S_IXOTH);
+                detail::NEW_DIRECTORY_MODE);
 
             return true;
         }
@@ -816,6 +2751,155 @@ public:
         }
     }
 
+    /**
+     * Make a directory accessible from the given path, creating any
+     * missing parents too.
+     *
+     * @returns `true` if a new directory was created at `new_directory`
+     *          `false` if a directory already existed on that path.
+     *
+     * This function mirrors Boost.Filesystem `create_directories` except
+     * that, as with `create_directory`, directories are created with 0755
+     * permissions.
+     *
+     * The deepest directory is tried first, on the assumption that its
+     * parent usually exists, and we only walk upwards if that fails.  So
+     * when the parent exists this costs a single round trip to the server,
+     * rather than one or two per level of the path.
+     */
+    bool create_directories(const boost::filesystem::path& new_directory)
+    {
+        std::string new_directory_string = new_directory.string();
+        boost::system::error_code ec;
+        std::string message;
+
+        cache_ref().invalidate(new_directory_string);
+
+        {
+            ::ssh::detail::sftp_channel_state::scoped_lock lock =
+                sftp_ref().aquire_lock();
+
+            ::ssh::detail::libssh2::sftp::mkdir_ex(
+                sftp_ref().session_ptr(), sftp_ref().sftp_ptr(),
+                new_directory_string.data(), new_directory_string.size(),
+                detail::NEW_DIRECTORY_MODE, ec, message);
+        }
+
+        if (!ec)
+            return true;
+
+        // OpenSSH reports a missing parent as no_such_file_or_directory, so
+        // we can go straight up.  Anything else might mean the directory
+        // already exists, or, on other servers, be a missing parent
+        // reported less helpfully, so we have to check.
+        if (ec != boost::system::errc::no_such_file_or_directory)
+        {
+            // Following links, as a link to a directory is as good as one
+            switch (detail::check_status(*this, new_directory, true))
+            {
+            case detail::path_status::directory:
+                return false;
+
+            case detail::path_status::non_directory:
+                SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                    ec, message, "libssh2_sftp_mkdir_ex",
+                    new_directory_string.data(), new_directory_string.size());
+
+            case detail::path_status::non_existent:
+                break;
+
+            default:
+                assert(false);
+                BOOST_THROW_EXCEPTION(std::logic_error("Unknown path status"));
+                return false;
+            }
+        }
+
+        boost::filesystem::path parent = new_directory.parent_path();
+        if (parent.empty())
+        {
+            SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                ec, message, "libssh2_sftp_mkdir_ex",
+                new_directory_string.data(), new_directory_string.size());
+        }
+
+        create_directories(parent);
+
+        return create_directory(new_directory);
+    }
+
+    /**
+     * Make many directories, and any missing parents, keeping several
+     * requests to the server in flight at once.
+     *
+     * Meant for creating a whole tree, such as the destination of a copy,
+     * in one go.  Each directory is created as soon as its parent is known
+     * to exist.  Directories whose parents are not in `new_directories` are
+     * assumed to have parents already so all the branches start at once;
+     * only where that is wrong are the missing parents created first.
+     *
+     * Directories that already exist are not an error.
+     *
+     * @param new_directories
+     *     Directories to create, in any order.
+     * @param pipeline_depth
+     *     Most requests to have in flight.  Servers limit the channels they
+     *     allow per connection so fewer may be used.
+     *
+     * @returns the number of directories created, including parents.
+     *
+     * @throws `boost::system::system_error` for the first directory that
+     *         could not be created.  Requests already sent are allowed to
+     *         finish first so some of the others may have been created.
+     */
+    boost::uintmax_t create_directories(
+        const std::vector<boost::filesystem::path>& new_directories,
+        std::size_t pipeline_depth)
+    {
+        if (pipeline_depth == 0)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Pipeline depth must be at least one"));
+
+        for (std::size_t i = 0; i < new_directories.size(); ++i)
+        {
+            cache_ref().invalidate(new_directories[i].string());
+        }
+
+        detail::pipelined_directory_creator creator(
+            pool_ref(), pipeline_depth);
+
+        return creator.create(new_directories);
+    }
+
+    /**
+     * Borrow up to `count` SFTP channels for streams that should run
+     * alongside each other.
+     *
+     * Servers limit the channels per connection, and batch operations
+     * borrow from the same spares, so fewer may be lent, but never none.
+     *
+     * @throws `boost::system::system_error` if not even one channel could
+     *         be opened.
+     */
+    std::vector<boost::shared_ptr<borrowed_channel> > borrow_channels(
+        std::size_t count)
+    {
+        std::vector< ::ssh::detail::sftp_channel_pool::channel_ptr> borrowed =
+            pool_ref().borrow(count);
+
+        std::vector<boost::shared_ptr<borrowed_channel> > channels;
+        channels.reserve(borrowed.size());
+        for (std::size_t i = 0; i < borrowed.size(); ++i)
+        {
+            channels.push_back(
+                boost::shared_ptr<borrowed_channel>(
+                    new borrowed_channel(
+                        pool_ref(), borrowed[i], cache_ref())));
+        }
+
+        return channels;
+    }
+
     /// @cond INTERNAL
     /**
      * Defines the single permitted factory of `sftp_filesystem` instances.
@@ -839,12 +2923,16 @@ private:
     friend class factory_attorney;
 
     explicit sftp_filesystem(::ssh::detail::session_state& session_state)
-        : m_sftp(new ::ssh::detail::sftp_channel_state(session_state))
+        :
+        m_sftp(new ::ssh::detail::sftp_channel_state(session_state)),
+        m_pool(new ::ssh::detail::sftp_channel_pool(session_state)),
+        m_cache(new ::ssh::detail::attribute_cache())
     {}
 
     friend class sftp_input_device;
     friend class sftp_output_device;
     friend class sftp_io_device;
+    friend class recursive_directory_iterator;
 
     bool remove_one_file(const boost::filesystem::path& file)
     {
@@ -863,6 +2951,8 @@ private:
     {
         std::string target_string = target.string();
 
+        cache_ref().invalidate(target_string);
+
         try
         {
             ::ssh::detail::sftp_channel_state::scoped_lock lock =
@@ -927,6 +3017,19 @@ private:
         return *m_sftp;
     }
 
+    /**
+     * Extra channels, for operations that keep several requests in flight.
+     */
+    ::ssh::detail::sftp_channel_pool& pool_ref()
+    {
+        return *m_pool;
+    }
+
+    ::ssh::detail::attribute_cache& cache_ref()
+    {
+        return *m_cache;
+    }
+
     // Using an auto_ptr (eventually unique_ptr) so that the other objects
     // that reference this state continue to reference a valid object even if
     // this sftp_filesystem object is moved.  The moved filesystem will only
@@ -938,6 +3041,12 @@ private:
     // file streams.
     // See http://stackoverflow.com/a/20493410/67013.
     std::auto_ptr<::ssh::detail::sftp_channel_state> m_sftp;
+
+    // Held the same way, as operations using the pool hold on to it
+    std::auto_ptr<::ssh::detail::sftp_channel_pool> m_pool;
+
+    // And again, as directory iterators fill it
+    std::auto_ptr<::ssh::detail::attribute_cache> m_cache;
 };
 
 // Only needed for C++03 support with Boost move-emulation because C++11
@@ -952,11 +3061,12 @@ inline void swap(sftp_filesystem& lhs, sftp_filesystem& rhs)
 namespace detail {
 
     inline BOOST_SCOPED_ENUM(path_status) check_status(
-        sftp_filesystem& filesystem, const boost::filesystem::path& path)
+        sftp_filesystem& filesystem, const boost::filesystem::path& path,
+        bool follow_links)
     {
         try
         {
-            file_attributes attrs = filesystem.attributes(path, false);
+            file_attributes attrs = filesystem.attributes(path, follow_links);
 
             if (attrs.type() == file_attributes::directory)
             {
@@ -1036,7 +3146,8 @@ inline boost::uintmax_t sftp_filesystem::remove_directory(
     {
         const sftp_file& file = *directory;
 
-        if (file.name() == "." || file.name() == "..")
+        if (boost::equals(file.name_view(), ".") ||
+            boost::equals(file.name_view(), ".."))
         {
             continue;
         }
@@ -0,0 +1,1151 @@
+/**
+    @file
+
+    Indexed known-hosts store for large known_hosts files.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_INDEXED_KNOWNHOST_HPP
+#define SSH_INDEXED_KNOWNHOST_HPP
+
+#include <ssh/detail/file_stamp.hpp> // file_stamp
+#include <ssh/host_key.hpp>
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/exception/errinfo_file_name.hpp> // errinfo_file_name
+#include <boost/exception/info.hpp> // errinfo
+#include <boost/filesystem.hpp> // path, file_size, exists
+#include <boost/filesystem/fstream.hpp> // path-enabled fstream
+#include <boost/foreach.hpp> // BOOST_FOREACH
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+#include <boost/unordered_map.hpp>
+
+#include <algorithm> // transform
+#include <cassert> // assert
+#include <cctype> // tolower
+#include <map>
+#include <sstream> // ostringstream
+#include <stdexcept> // runtime_error, invalid_argument
+#include <string>
+#include <utility> // make_pair
+#include <vector>
+
+#include <openssl/evp.h> // EVP_EncodeBlock, EVP_DecodeBlock, EVP_sha1
+#include <openssl/hmac.h> // HMAC
+
+namespace ssh {
+
+namespace detail {
+
+    inline std::string base64_encode(const std::string& data)
+    {
+        if (data.empty())
+            return std::string();
+
+        std::vector<unsigned char> buffer(((data.size() + 2) / 3) * 4 + 1);
+        int len = ::EVP_EncodeBlock(
+            &buffer[0], reinterpret_cast<const unsigned char*>(data.data()),
+            static_cast<int>(data.size()));
+
+        return std::string(buffer.begin(), buffer.begin() + len);
+    }
+
+    /**
+     * Decode base64 data.
+     *
+     * @returns nothing if the input is not valid base64.
+     */
+    inline boost::optional<std::string> base64_decode(const std::string& text)
+    {
+        if (text.empty() || text.size() % 4 != 0)
+            return boost::optional<std::string>();
+
+        std::vector<unsigned char> buffer((text.size() / 4) * 3 + 1);
+        int len = ::EVP_DecodeBlock(
+            &buffer[0], reinterpret_cast<const unsigned char*>(text.data()),
+            static_cast<int>(text.size()));
+        if (len < 0)
+            return boost::optional<std::string>();
+
+        // EVP_DecodeBlock includes the bytes represented by padding in its
+        // count
+        std::string::size_type padding = text.find_last_not_of('=');
+        len -= static_cast<int>(text.size() - 1 - padding);
+
+        return std::string(buffer.begin(), buffer.begin() + len);
+    }
+
+    /**
+     * Hash of the host as it appears in a hashed known_hosts entry.
+     */
+    inline std::string hash_host(
+        const std::string& salt, const std::string& host)
+    {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len = 0;
+
+        ::HMAC(
+            ::EVP_sha1(), salt.data(), static_cast<int>(salt.size()),
+            reinterpret_cast<const unsigned char*>(host.data()), host.size(),
+            digest, &digest_len);
+
+        return std::string(reinterpret_cast<char*>(digest), digest_len);
+    }
+
+    inline std::string to_lower(std::string text)
+    {
+        std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+        return text;
+    }
+
+    /**
+     * Algorithm name embedded at the start of an SSH public-key blob.
+     */
+    inline std::string key_blob_algorithm(const std::string& blob)
+    {
+        if (blob.size() < 4)
+            return std::string();
+
+        boost::uint32_t len =
+            (static_cast<unsigned char>(blob[0]) << 24) |
+            (static_cast<unsigned char>(blob[1]) << 16) |
+            (static_cast<unsigned char>(blob[2]) << 8) |
+            static_cast<unsigned char>(blob[3]);
+
+        if (len > blob.size() - 4)
+            return std::string();
+
+        return blob.substr(4, len);
+    }
+
+    /**
+     * OpenSSH-style host-pattern match with `*` and `?` wildcards.
+     */
+    inline bool wildcard_match(const char* pattern, const char* text)
+    {
+        for (;;)
+        {
+            if (*pattern == '\0')
+                return *text == '\0';
+
+            if (*pattern == '*')
+            {
+                // Collapse runs of stars and try every suffix of the text
+                while (*pattern == '*')
+                    ++pattern;
+                if (*pattern == '\0')
+                    return true;
+
+                for (; *text != '\0'; ++text)
+                {
+                    if (wildcard_match(pattern, text))
+                        return true;
+                }
+                return false;
+            }
+
+            if (*text == '\0')
+                return false;
+
+            if (*pattern != '?' && *pattern != *text)
+                return false;
+
+            ++pattern;
+            ++text;
+        }
+    }
+
+    inline bool is_wildcard_pattern(const std::string& pattern)
+    {
+        return pattern.find_first_of("*?!") != std::string::npos;
+    }
+
+    /**
+     * Split line into whitespace-separated fields, the last taking the rest.
+     */
+    inline std::vector<std::string> split_fields(
+        const std::string& line, std::vector<std::string>::size_type count)
+    {
+        std::vector<std::string> fields;
+        std::string::size_type pos = line.find_first_not_of(" \t");
+
+        while (pos != std::string::npos && fields.size() < count)
+        {
+            if (fields.size() == count - 1)
+            {
+                std::string::size_type last = line.find_last_not_of(" \t\r");
+                fields.push_back(line.substr(pos, last - pos + 1));
+                break;
+            }
+
+            std::string::size_type end = line.find_first_of(" \t", pos);
+            fields.push_back(line.substr(pos, end - pos));
+            pos = (end == std::string::npos) ?
+                end : line.find_first_not_of(" \t", end);
+        }
+
+        return fields;
+    }
+}
+
+/**
+ * Single line of a known_hosts file.
+ *
+ * Lines that are not host entries (comments, blank lines, marked lines and
+ * anything we can't parse) are kept so that they are written back
+ * untouched.
+ */
+class indexed_knownhost
+{
+public:
+
+    explicit indexed_knownhost(const std::string& line)
+        : m_line(line), m_is_entry(false), m_is_hashed(false)
+    {
+        parse();
+    }
+
+    /**
+     * The line exactly as it appears in the file.
+     */
+    const std::string& line() const { return m_line; }
+
+    /**
+     * Is this line a host entry (as opposed to a comment, say)?
+     */
+    bool is_entry() const { return m_is_entry; }
+
+    /**
+     * Is the host name hashed?
+     */
+    bool is_name_hashed() const { return m_is_hashed; }
+
+    /**
+     * Comma-separated host patterns, or the hashed host field as it appears
+     * in the file if hashed.
+     */
+    const std::string& hosts() const { return m_hosts; }
+
+    /**
+     * Key algorithm name, e.g. ssh-rsa.
+     */
+    const std::string& key_algo() const { return m_key_algo; }
+
+    /**
+     * Base64-encoded key.
+     */
+    const std::string& key() const { return m_key; }
+
+    const std::string& comment() const { return m_comment; }
+
+    /** @name Parsed hashed host.  Only meaningful if is_name_hashed(). */
+    // @{
+    const std::string& salt() const { return m_salt; }
+    const std::string& hash() const { return m_hash; }
+    // @}
+
+    /**
+     * Lower-cased plain-text host patterns.  Empty if hashed.
+     */
+    const std::vector<std::string>& patterns() const { return m_patterns; }
+
+private:
+
+    void parse()
+    {
+        std::string::size_type start = m_line.find_first_not_of(" \t");
+        if (start == std::string::npos || m_line[start] == '#' ||
+            m_line[start] == '@')
+        {
+            // Blank, comment or marker (@revoked, @cert-authority) lines are
+            // not plain host entries.  Leave them alone.
+            return;
+        }
+
+        std::vector<std::string> fields = detail::split_fields(m_line, 4);
+        if (fields.size() < 3)
+            return;
+
+        // SSH1 RSA entries start with the bit count.  Not useful to an SSH2
+        // client
+        if (fields[1].find_first_not_of("0123456789") == std::string::npos)
+            return;
+
+        m_hosts = fields[0];
+        m_key_algo = fields[1];
+        m_key = fields[2];
+        if (fields.size() > 3)
+            m_comment = fields[3];
+
+        if (m_hosts.compare(0, 3, "|1|") == 0)
+        {
+            std::string::size_type separator = m_hosts.find('|', 3);
+            if (separator == std::string::npos)
+                return;
+
+            boost::optional<std::string> salt = detail::base64_decode(
+                m_hosts.substr(3, separator - 3));
+            boost::optional<std::string> hash = detail::base64_decode(
+                m_hosts.substr(separator + 1));
+            if (!salt || !hash)
+                return;
+
+            m_salt = *salt;
+            m_hash = *hash;
+            m_is_hashed = true;
+        }
+        else
+        {
+            std::string::size_type pos = 0;
+            while (pos <= m_hosts.size())
+            {
+                std::string::size_type comma = m_hosts.find(',', pos);
+                if (comma == std::string::npos)
+                    comma = m_hosts.size();
+
+                if (comma > pos)
+                {
+                    m_patterns.push_back(
+                        detail::to_lower(m_hosts.substr(pos, comma - pos)));
+                }
+
+                pos = comma + 1;
+            }
+        }
+
+        m_is_entry = true;
+    }
+
+    std::string m_line;
+    bool m_is_entry;
+    bool m_is_hashed;
+    std::string m_hosts;
+    std::string m_key_algo;
+    std::string m_key;
+    std::string m_comment;
+    std::string m_salt;
+    std::string m_hash;
+    std::vector<std::string> m_patterns;
+};
+
+/**
+ * Result returned by indexed_knownhost_collection::find().
+ */
+class indexed_knownhost_search_result
+{
+public:
+
+    indexed_knownhost_search_result() : m_match(false) {}
+
+    indexed_knownhost_search_result(
+        const std::vector<std::size_t>& hosts, bool match)
+        : m_hosts(hosts), m_match(match)
+    {
+        assert(!match || !m_hosts.empty());
+    }
+
+    bool mismatch() const { return !m_match && !m_hosts.empty(); }
+    bool match() const { return m_match && !m_hosts.empty(); }
+    bool not_found() const { return m_hosts.empty(); }
+
+    /**
+     * Positions of the entries found in the collection.
+     *
+     * If the search found a match, this is the matching entry alone.
+     * Otherwise, it is every entry for the host with the same key algorithm,
+     * none of which match the key.
+     */
+    const std::vector<std::size_t>& hosts() const { return m_hosts; }
+
+private:
+    std::vector<std::size_t> m_hosts;
+    bool m_match;
+};
+
+/**
+ * Collection of known-host entries stored in OpenSSH known_hosts format,
+ * indexed for fast lookup.
+ *
+ * This is an alternative to `openssh_knownhost_collection` for known_hosts
+ * files too large to search linearly:
+ *  - plain-text entries are indexed by host name;
+ *  - loading the file doesn't need a libssh2 session;
+ *  - saving after only adding entries appends the new entries to the file
+ *    rather than rewriting it.
+ *
+ * Hashed entries can't be indexed by host name, as that is what the hash
+ * hides.  Looking a host up hashes it once for each distinct salt.
+ * OpenSSH gives every hashed line its own salt, so for files it hashed
+ * that is one HMAC per hashed entry, so finding a host in a hashed file
+ * is still O(n).  The hashes are remembered, so finding the same host again
+ * in the same collection costs no HMACs.  `indexed_knownhost_cache` keeps
+ * collections, and so the hashes, from one connection to the next.
+ *
+ * Because even `find` remembers hashes, a collection must not be used from
+ * more than one thread at a time.
+ *
+ * Lines are written back exactly as they were read, including comments and
+ * entries this class doesn't understand.
+ *
+ * Unlike libssh2, a host entry only conflicts with a key of the same
+ * algorithm.  An entry with a different algorithm for the same host is
+ * neither a match nor a mismatch, mirroring OpenSSH.
+ */
+class indexed_knownhost_collection
+{
+public:
+
+    /** Initialise collection from a range of OpenSSH known_hosts lines. */
+    template<typename InputIt>
+    indexed_knownhost_collection(InputIt begin, InputIt end)
+        : m_erased_count(0), m_loaded_size(0), m_missing_final_newline(false),
+          m_needs_rewrite(true)
+    {
+        for (; begin != end; ++begin)
+        {
+            load_line(*begin);
+        }
+    }
+
+    /** Initialise collection from an OpenSSH known_hosts file. */
+    explicit indexed_knownhost_collection(const boost::filesystem::path& filename)
+        : m_erased_count(0), m_loaded_size(0), m_missing_final_newline(false),
+          m_needs_rewrite(false)
+    {
+        boost::filesystem::ifstream file(filename, std::ios::binary);
+        if (!file)
+            BOOST_THROW_EXCEPTION(
+                boost::enable_error_info(
+                    std::runtime_error(
+                        "Could not read from known-hosts file")) <<
+                boost::errinfo_file_name(filename.external_file_string()));
+
+        load(file);
+        m_source = filename.string();
+    }
+
+    /**
+     * Initialise collection from an OpenSSH known_hosts file.
+     *
+     * @TODO  Make errinfo work with wide paths.
+     */
+    explicit indexed_knownhost_collection(
+        const boost::filesystem::wpath& filename)
+        : m_erased_count(0), m_loaded_size(0), m_missing_final_newline(false),
+          m_needs_rewrite(false)
+    {
+        boost::filesystem::ifstream file(filename, std::ios::binary);
+        if (!file)
+            BOOST_THROW_EXCEPTION(
+                boost::enable_error_info(
+                    std::runtime_error(
+                        "Could not read from known-hosts file")));
+
+        load(file);
+        m_wide_source = filename.string();
+    }
+
+    /**
+     * Number of lines, including non-entry lines.
+     */
+    std::size_t size() const
+    {
+        return m_lines.size() - m_erased_count;
+    }
+
+    /**
+     * Line at the given position (as returned in a search result).
+     */
+    const indexed_knownhost& at(std::size_t position) const
+    {
+        return m_lines.at(position);
+    }
+
+    indexed_knownhost_search_result find(
+        const std::string& host, const std::string& key, bool base64_key)
+    const
+    {
+        std::string encoded_key = (base64_key) ? key : detail::base64_encode(key);
+        boost::optional<std::string> raw_key =
+            (base64_key) ? detail::base64_decode(key) : key;
+        std::string algorithm = (raw_key) ?
+            detail::key_blob_algorithm(*raw_key) : std::string();
+
+        std::vector<std::size_t> mismatches;
+
+        BOOST_FOREACH(std::size_t position, candidates(detail::to_lower(host)))
+        {
+            const indexed_knownhost& entry = m_lines[position];
+
+            if (!algorithm.empty() && entry.key_algo() != algorithm)
+                continue;
+
+            if (entry.key() == encoded_key)
+            {
+                return indexed_knownhost_search_result(
+                    std::vector<std::size_t>(1, position), true);
+            }
+
+            mismatches.push_back(position);
+        }
+
+        return indexed_knownhost_search_result(mismatches, false);
+    }
+
+    indexed_knownhost_search_result find(
+        const std::string& host, const ssh::host_key& key) const
+    {
+        return find(host, key.key(), key.is_base64());
+    }
+
+    void add(
+        const std::string& host_or_ip, const std::string& key,
+        bool base64_key)
+    {
+        std::string raw_key = key;
+        if (base64_key)
+        {
+            boost::optional<std::string> decoded = detail::base64_decode(key);
+            if (!decoded)
+                BOOST_THROW_EXCEPTION(std::invalid_argument("Invalid key"));
+            raw_key = *decoded;
+        }
+
+        add_line(
+            host_or_ip + " " + algorithm_or_throw(raw_key) + " " +
+            detail::base64_encode(raw_key));
+    }
+
+    void add(const std::string& host_or_ip, const ssh::host_key& key)
+    {
+        add(host_or_ip, key.key(), key.is_base64());
+    }
+
+    /**
+     * Add an entry with a hashed host name.
+     *
+     * @param host_or_ip  The plain-text host name; it is hashed with the salt.
+     * @param salt        Raw (not base64-encoded) salt.
+     */
+    void add_hashed(
+        const std::string& host_or_ip, const std::string& salt,
+        const std::string& key, bool base64_key)
+    {
+        std::string raw_key = key;
+        if (base64_key)
+        {
+            boost::optional<std::string> decoded = detail::base64_decode(key);
+            if (!decoded)
+                BOOST_THROW_EXCEPTION(std::invalid_argument("Invalid key"));
+            raw_key = *decoded;
+        }
+
+        std::string hashed_host = "|1|" + detail::base64_encode(salt) + "|" +
+            detail::base64_encode(
+                detail::hash_host(salt, detail::to_lower(host_or_ip)));
+
+        add_line(
+            hashed_host + " " + algorithm_or_throw(raw_key) + " " +
+            detail::base64_encode(raw_key));
+    }
+
+    /**
+     * Remove the entries in the search result from the collection.
+     *
+     * Positions of other entries are unaffected.
+     */
+    void erase(const indexed_knownhost_search_result& result)
+    {
+        BOOST_FOREACH(std::size_t position, result.hosts())
+        {
+            if (m_erased[position])
+                continue;
+
+            m_erased[position] = true;
+            ++m_erased_count;
+            unindex(position);
+        }
+
+        // Removal can't be done by appending
+        m_needs_rewrite = true;
+    }
+
+    /**
+     * Save all entries to an OpenSSH known_hosts file.
+     *
+     * If the file is the one the collection was loaded from, it hasn't
+     * changed since, and entries were only added, the new entries are
+     * appended.  Otherwise the whole file is rewritten.
+     */
+    void save(const boost::filesystem::path& filename)
+    {
+        bool same_file = !m_source.empty() && filename.string() == m_source;
+        save_to(filename, same_file);
+    }
+
+    /**
+     * Save all entries to an OpenSSH known_hosts file.
+     *
+     * @see save(const boost::filesystem::path&)
+     */
+    void save(const boost::filesystem::wpath& filename)
+    {
+        bool same_file =
+            !m_wide_source.empty() && filename.string() == m_wide_source;
+        save_to(filename, same_file);
+    }
+
+private:
+
+    typedef boost::unordered_map<std::string, std::vector<std::size_t> >
+        host_index;
+
+    template<typename Path>
+    void save_to(const Path& filename, bool same_file)
+    {
+        if (same_file && !m_needs_rewrite &&
+            boost::filesystem::exists(filename) &&
+            boost::filesystem::file_size(filename) == m_loaded_size)
+        {
+            append_to(filename);
+        }
+        else
+        {
+            rewrite(filename);
+        }
+    }
+
+    template<typename Path>
+    void append_to(const Path& filename)
+    {
+        if (m_pending.empty())
+            return;
+
+        boost::filesystem::ofstream file(
+            filename, std::ios::out | std::ios::app | std::ios::binary);
+        if (!file)
+            BOOST_THROW_EXCEPTION(
+                std::runtime_error("Could not write to known-hosts file"));
+
+        if (m_missing_final_newline)
+        {
+            file << '\n';
+            ++m_loaded_size;
+            m_missing_final_newline = false;
+        }
+
+        BOOST_FOREACH(std::size_t position, m_pending)
+        {
+            if (m_erased[position])
+                continue;
+
+            file << m_lines[position].line() << '\n';
+            m_loaded_size += m_lines[position].line().size() + 1;
+        }
+
+        file.flush();
+        if (!file)
+            BOOST_THROW_EXCEPTION(
+                std::runtime_error("Could not write to known-hosts file"));
+
+        m_pending.clear();
+    }
+
+    template<typename Path>
+    void rewrite(const Path& filename)
+    {
+        boost::filesystem::ofstream file(
+            filename, std::ios::out | std::ios::trunc | std::ios::binary);
+        if (!file)
+            BOOST_THROW_EXCEPTION(
+                std::runtime_error("Could not write to known-hosts file"));
+
+        boost::uintmax_t written = 0;
+        for (std::size_t i = 0; i < m_lines.size(); ++i)
+        {
+            if (m_erased[i])
+                continue;
+
+            file << m_lines[i].line() << '\n';
+            written += m_lines[i].line().size() + 1;
+        }
+
+        file.flush();
+        if (!file)
+            BOOST_THROW_EXCEPTION(
+                std::runtime_error("Could not write to known-hosts file"));
+
+        // The file now matches the collection exactly so later saves to
+        // the same file can append again
+        m_pending.clear();
+        m_loaded_size = written;
+        m_missing_final_newline = false;
+        m_needs_rewrite = false;
+    }
+
+    void load(std::istream& file)
+    {
+        m_missing_final_newline = false;
+
+        std::string line;
+        while (std::getline(file, line))
+        {
+            m_loaded_size += line.size();
+
+            if (file.eof())
+            {
+                m_missing_final_newline = true;
+            }
+            else
+            {
+                ++m_loaded_size; // newline
+            }
+
+            // We write lines back with plain '\n' so drop any '\r' here to
+            // keep the rest of the line as it was
+            if (!line.empty() && line[line.size() - 1] == '\r')
+            {
+                line.erase(line.size() - 1);
+                m_needs_rewrite = true;
+            }
+
+            load_line(line);
+        }
+    }
+
+    template<typename Line>
+    void load_line(const Line& line)
+    {
+        std::ostringstream stream;
+        stream << line;
+        push_line(stream.str());
+    }
+
+    void load_line(const std::string& line)
+    {
+        push_line(line);
+    }
+
+    std::size_t push_line(const std::string& line)
+    {
+        m_lines.push_back(indexed_knownhost(line));
+        m_erased.push_back(false);
+
+        std::size_t position = m_lines.size() - 1;
+        index(position);
+
+        return position;
+    }
+
+    void add_line(const std::string& line)
+    {
+        m_pending.push_back(push_line(line));
+    }
+
+    std::string algorithm_or_throw(const std::string& raw_key) const
+    {
+        std::string algorithm = detail::key_blob_algorithm(raw_key);
+        if (algorithm.empty())
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Unrecognised key format"));
+        return algorithm;
+    }
+
+    void index(std::size_t position)
+    {
+        const indexed_knownhost& entry = m_lines[position];
+        if (!entry.is_entry())
+            return;
+
+        if (entry.is_name_hashed())
+        {
+            m_hashed_by_salt[entry.salt()].entries[entry.hash()].push_back(
+                position);
+        }
+        else if (has_wildcards(entry))
+        {
+            m_wildcard_entries.push_back(position);
+        }
+        else
+        {
+            BOOST_FOREACH(const std::string& pattern, entry.patterns())
+            {
+                m_plain_by_host[pattern].push_back(position);
+            }
+        }
+    }
+
+    void unindex(std::size_t position)
+    {
+        const indexed_knownhost& entry = m_lines[position];
+        if (!entry.is_entry())
+            return;
+
+        if (entry.is_name_hashed())
+        {
+            remove_position(
+                m_hashed_by_salt[entry.salt()].entries[entry.hash()],
+                position);
+        }
+        else if (has_wildcards(entry))
+        {
+            remove_position(m_wildcard_entries, position);
+        }
+        else
+        {
+            BOOST_FOREACH(const std::string& pattern, entry.patterns())
+            {
+                remove_position(m_plain_by_host[pattern], position);
+            }
+        }
+    }
+
+    static void remove_position(
+        std::vector<std::size_t>& positions, std::size_t position)
+    {
+        positions.erase(
+            std::remove(positions.begin(), positions.end(), position),
+            positions.end());
+    }
+
+    static bool has_wildcards(const indexed_knownhost& entry)
+    {
+        BOOST_FOREACH(const std::string& pattern, entry.patterns())
+        {
+            if (detail::is_wildcard_pattern(pattern))
+                return true;
+        }
+
+        return false;
+    }
+
+    static bool wildcard_entry_matches(
+        const indexed_knownhost& entry, const std::string& host)
+    {
+        bool matched = false;
+
+        BOOST_FOREACH(const std::string& pattern, entry.patterns())
+        {
+            if (!pattern.empty() && pattern[0] == '!')
+            {
+                // Negated patterns veto the whole entry
+                if (detail::wildcard_match(pattern.c_str() + 1, host.c_str()))
+                    return false;
+            }
+            else if (detail::wildcard_match(pattern.c_str(), host.c_str()))
+            {
+                matched = true;
+            }
+        }
+
+        return matched;
+    }
+
+    /**
+     * Positions of all entries for the host, in file order.
+     */
+    std::vector<std::size_t> candidates(const std::string& host) const
+    {
+        std::vector<std::size_t> positions;
+
+        host_index::const_iterator plain = m_plain_by_host.find(host);
+        if (plain != m_plain_by_host.end())
+        {
+            positions.insert(
+                positions.end(), plain->second.begin(), plain->second.end());
+        }
+
+        // One hash per salt.  Only entries we added with a common salt
+        // share one; OpenSSH salts each line separately.
+        BOOST_FOREACH(const salt_index::value_type& group, m_hashed_by_salt)
+        {
+            const host_index& entries = group.second.entries;
+            host_index::const_iterator hashed =
+                entries.find(group.second.hash_of(group.first, host));
+            if (hashed != entries.end())
+            {
+                positions.insert(
+                    positions.end(), hashed->second.begin(),
+                    hashed->second.end());
+            }
+        }
+
+        BOOST_FOREACH(std::size_t position, m_wildcard_entries)
+        {
+            if (wildcard_entry_matches(m_lines[position], host))
+                positions.push_back(position);
+        }
+
+        std::sort(positions.begin(), positions.end());
+        return positions;
+    }
+
+    /**
+     * Hashed entries sharing a salt, indexed by hash.
+     */
+    struct salt_group
+    {
+        host_index entries;
+
+        /**
+         * Hash of the host under this salt, worked out on first use.
+         */
+        const std::string& hash_of(
+            const std::string& salt, const std::string& host) const
+        {
+            boost::unordered_map<std::string, std::string>::iterator hash =
+                host_hashes.find(host);
+            if (hash == host_hashes.end())
+            {
+                hash = host_hashes.insert(
+                    std::make_pair(host, detail::hash_host(salt, host))).first;
+            }
+
+            return hash->second;
+        }
+
+        /// Hashes of the hosts looked up so far, by host
+        mutable boost::unordered_map<std::string, std::string> host_hashes;
+    };
+
+    typedef std::map<std::string, salt_group> salt_index;
+
+    std::vector<indexed_knownhost> m_lines;
+    std::vector<bool> m_erased;
+    std::size_t m_erased_count;
+
+    host_index m_plain_by_host;
+    salt_index m_hashed_by_salt;
+    std::vector<std::size_t> m_wildcard_entries;
+
+    /// @name State needed to save by appending.
+    // @{
+    std::string m_source;
+    std::wstring m_wide_source;
+    boost::uintmax_t m_loaded_size;
+    bool m_missing_final_newline;
+    bool m_needs_rewrite;
+    std::vector<std::size_t> m_pending; ///< Lines added since last save
+    // @}
+};
+
+inline void add(
+    indexed_knownhost_collection& hosts, const std::string& host_or_ip,
+    const ssh::host_key& key)
+{
+    hosts.add(host_or_ip, key);
+}
+
+/**
+ * Replace the entries found for a host with one for the new key.
+ */
+inline void update(
+    indexed_knownhost_collection& hosts, const std::string& host_or_ip,
+    const ssh::host_key& key, const indexed_knownhost_search_result& entry)
+{
+    hosts.erase(entry);
+    hosts.add(host_or_ip, key);
+}
+
+/**
+ * Known-hosts files kept parsed from one connection to the next.
+ *
+ * Checking a host key would otherwise read and index the whole file on
+ * every connection and, for hashed entries, hash the host once per salt.
+ * Like `private_key_cache` with keys, the cache keeps each file's
+ * collection, along with the host hashes it has worked out, for as long as
+ * the file keeps the size and modification time it had when read.  Changes
+ * made through the cache are saved straight away and don't make the file
+ * look changed.
+ *
+ * Instances are thread-safe.
+ */
+template<typename Path=boost::filesystem::path>
+class indexed_knownhost_cache : private boost::noncopyable
+{
+public:
+
+    indexed_knownhost_search_result find(
+        const Path& file, const std::string& host, const std::string& key,
+        bool base64_key)
+    {
+        boost::mutex::scoped_lock lock(m_guard);
+        return collection(file).find(host, key, base64_key);
+    }
+
+    indexed_knownhost_search_result find(
+        const Path& file, const std::string& host,
+        const ssh::host_key& key)
+    {
+        return find(file, host, key.key(), key.is_base64());
+    }
+
+    /**
+     * Add an entry for the host to the file and save it.
+     */
+    void add(
+        const Path& file, const std::string& host_or_ip,
+        const std::string& key, bool base64_key)
+    {
+        boost::mutex::scoped_lock lock(m_guard);
+
+        indexed_knownhost_collection& hosts = collection(file);
+        hosts.add(host_or_ip, key, base64_key);
+        save(file, hosts);
+    }
+
+    void add(
+        const Path& file, const std::string& host_or_ip,
+        const ssh::host_key& key)
+    {
+        add(file, host_or_ip, key.key(), key.is_base64());
+    }
+
+    /**
+     * Replace the file's entries for the host with one for the key and save
+     * it.
+     *
+     * The entries replaced are those for the host as the file is now, which
+     * may not be the ones an earlier `find` returned if the file has
+     * changed since.
+     */
+    void update(
+        const Path& file, const std::string& host_or_ip,
+        const std::string& key, bool base64_key)
+    {
+        boost::mutex::scoped_lock lock(m_guard);
+
+        indexed_knownhost_collection& hosts = collection(file);
+        hosts.erase(hosts.find(host_or_ip, key, base64_key));
+        hosts.add(host_or_ip, key, base64_key);
+        save(file, hosts);
+    }
+
+    void update(
+        const Path& file, const std::string& host_or_ip,
+        const ssh::host_key& key)
+    {
+        update(file, host_or_ip, key.key(), key.is_base64());
+    }
+
+    /**
+     * Forget all the files, so each is read again when next used.
+     */
+    void purge()
+    {
+        boost::mutex::scoped_lock lock(m_guard);
+        m_files.clear();
+    }
+
+private:
+
+    struct cached_file
+    {
+        cached_file(
+            const detail::file_stamp& stamp,
+            boost::shared_ptr<indexed_knownhost_collection> hosts)
+            : stamp(stamp), hosts(hosts) {}
+
+        detail::file_stamp stamp;
+        boost::shared_ptr<indexed_knownhost_collection> hosts;
+    };
+
+    typedef std::map<typename Path::string_type, cached_file> file_mapping;
+
+    /**
+     * The file's collection, reading it if not cached or changed since.
+     *
+     * Must be called with the lock held.
+     */
+    indexed_knownhost_collection& collection(const Path& file)
+    {
+        // Stamped before reading, so a file replaced while we read it fails
+        // to match next time instead of leaving stale entries cached
+        detail::file_stamp stamp(file);
+
+        typename file_mapping::iterator cached = m_files.find(file.string());
+        if (cached != m_files.end())
+        {
+            if (cached->second.stamp.matches(stamp))
+            {
+                return *cached->second.hosts;
+            }
+
+            m_files.erase(cached);
+        }
+
+        boost::shared_ptr<indexed_knownhost_collection> hosts =
+            boost::make_shared<indexed_knownhost_collection>(file);
+
+        m_files.insert(
+            std::make_pair(file.string(), cached_file(stamp, hosts)));
+
+        return *hosts;
+    }
+
+    /**
+     * Must be called with the lock held.
+     */
+    void save(const Path& file, indexed_knownhost_collection& hosts)
+    {
+        try
+        {
+            hosts.save(file);
+        }
+        catch (...)
+        {
+            // Whatever made it onto disk, the file no longer matches the
+            // collection
+            m_files.erase(file.string());
+            throw;
+        }
+
+        // Our own change shouldn't count as the file changing under us
+        typename file_mapping::iterator cached = m_files.find(file.string());
+        if (cached != m_files.end())
+        {
+            cached->second.stamp = detail::file_stamp(file);
+        }
+    }
+
+    boost::mutex m_guard;
+    file_mapping m_files;
+};
+
+} // namespace ssh
+
+#endif
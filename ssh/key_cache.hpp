@@ -0,0 +1,443 @@
+/**
+    @file
+
+    In-memory cache of decrypted private keys.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_KEY_CACHE_HPP
+#define SSH_KEY_CACHE_HPP
+
+#include <ssh/detail/file_stamp.hpp> // file_stamp
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // ptime, minutes
+#include <boost/filesystem/fstream.hpp> // ifstream
+#include <boost/filesystem/path.hpp> // path
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp> // errc
+#include <boost/system/system_error.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // max
+#include <cstring> // memcpy
+#include <iterator> // istreambuf_iterator
+#include <map>
+#include <new> // bad_alloc
+#include <string>
+
+#include <libssh2.h>
+
+#include <openssl/bio.h>
+#include <openssl/buffer.h> // BUF_MEM
+#include <openssl/crypto.h> // OPENSSL_cleanse
+#include <openssl/evp.h> // EVP_PKEY
+#include <openssl/pem.h> // PEM_read_bio_PrivateKey, PEM_write_bio_PrivateKey
+
+#ifdef _WIN32
+#include <Windows.h> // VirtualAlloc, VirtualLock
+#else
+#include <sys/mman.h> // mlock
+#endif
+
+namespace ssh {
+
+class session;
+
+namespace detail {
+
+/**
+ * Fixed-size buffer for secrets.
+ *
+ * The memory is locked into RAM, as far as the OS allows, so the secret is
+ * not written to the pagefile, and wiped before it is released.
+ */
+class locked_buffer : private boost::noncopyable
+{
+public:
+
+    explicit locked_buffer(size_t size) : m_size(size)
+    {
+#ifdef _WIN32
+        m_data = static_cast<char*>(
+            ::VirtualAlloc(
+                NULL, (std::max)(m_size, size_t(1)), MEM_COMMIT | MEM_RESERVE,
+                PAGE_READWRITE));
+        if (!m_data)
+            BOOST_THROW_EXCEPTION(std::bad_alloc());
+
+        // Locking is best-effort.  It fails if the process's working-set
+        // quota is exhausted but an unlocked secret is still better than
+        // no cache at all.
+        ::VirtualLock(m_data, m_size);
+#else
+        m_data = new char[(std::max)(m_size, size_t(1))];
+        ::mlock(m_data, m_size);
+#endif
+    }
+
+    ~locked_buffer() throw()
+    {
+        ::OPENSSL_cleanse(m_data, m_size);
+
+#ifdef _WIN32
+        ::VirtualUnlock(m_data, m_size);
+        ::VirtualFree(m_data, 0, MEM_RELEASE);
+#else
+        ::munlock(m_data, m_size);
+        delete[] m_data;
+#endif
+    }
+
+    char* data() { return m_data; }
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    char* m_data;
+    size_t m_size;
+};
+
+inline std::string read_key_file(const boost::filesystem::path& key_file)
+{
+    boost::filesystem::ifstream file(key_file, std::ios::in | std::ios::binary);
+    if (!file)
+    {
+        BOOST_THROW_EXCEPTION(
+            boost::system::system_error(
+                boost::system::errc::make_error_code(
+                    boost::system::errc::no_such_file_or_directory),
+                "Unable to read key file " + key_file.string()));
+    }
+
+    return std::string(
+        (std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+}
+
+inline void wipe_and_free_memory_bio(BIO* bio)
+{
+    BUF_MEM* memory = NULL;
+    ::BIO_get_mem_ptr(bio, &memory);
+    if (memory && memory->data)
+    {
+        ::OPENSSL_cleanse(memory->data, memory->max);
+    }
+
+    ::BIO_free(bio);
+}
+
+/**
+ * Decode a PEM private key, decrypting it with the passphrase if necessary,
+ * and re-encode it unencrypted into locked memory.
+ *
+ * This is where the passphrase key-derivation cost is paid; once only per
+ * cached key.
+ */
+inline boost::shared_ptr<locked_buffer> decrypt_private_key(
+    const std::string& pem_key, const std::string& passphrase)
+{
+    boost::shared_ptr<BIO> encrypted(
+        ::BIO_new_mem_buf(
+            const_cast<char*>(pem_key.data()), static_cast<int>(pem_key.size())),
+        ::BIO_free);
+    if (!encrypted)
+        BOOST_THROW_EXCEPTION(std::bad_alloc());
+
+    // With no callback, OpenSSL takes the last argument as the passphrase
+    boost::shared_ptr<EVP_PKEY> key(
+        ::PEM_read_bio_PrivateKey(
+            encrypted.get(), NULL, NULL,
+            const_cast<char*>(passphrase.c_str())),
+        ::EVP_PKEY_free);
+    if (!key)
+    {
+        BOOST_THROW_EXCEPTION(
+            boost::system::system_error(
+                boost::system::errc::make_error_code(
+                    boost::system::errc::invalid_argument),
+                "Unable to decode private key; wrong passphrase?"));
+    }
+
+    boost::shared_ptr<BIO> decrypted(
+        ::BIO_new(::BIO_s_mem()), wipe_and_free_memory_bio);
+    if (!decrypted)
+        BOOST_THROW_EXCEPTION(std::bad_alloc());
+
+    if (!::PEM_write_bio_PrivateKey(
+        decrypted.get(), key.get(), NULL, NULL, 0, NULL, NULL))
+    {
+        BOOST_THROW_EXCEPTION(
+            boost::system::system_error(
+                boost::system::errc::make_error_code(
+                    boost::system::errc::invalid_argument),
+                "Unable to re-encode private key"));
+    }
+
+    BUF_MEM* memory = NULL;
+    ::BIO_get_mem_ptr(decrypted.get(), &memory);
+
+    boost::shared_ptr<locked_buffer> buffer =
+        boost::make_shared<locked_buffer>(memory->length);
+    std::memcpy(buffer->data(), memory->data, memory->length);
+
+    return buffer;
+}
+
+/**
+ * A key pair as held by the cache.
+ */
+class cached_key_pair
+{
+public:
+    cached_key_pair(
+        const std::string& public_key,
+        boost::shared_ptr<locked_buffer> private_key,
+        boost::posix_time::ptime expiry,
+        const file_stamp& public_key_stamp,
+        const file_stamp& private_key_stamp)
+        :
+    m_public_key(public_key), m_private_key(private_key), m_expiry(expiry),
+    m_public_key_stamp(public_key_stamp),
+    m_private_key_stamp(private_key_stamp) {}
+
+    const std::string& public_key() const { return m_public_key; }
+    const locked_buffer& private_key() const { return *m_private_key; }
+    boost::posix_time::ptime expiry() const { return m_expiry; }
+
+    /**
+     * Whether the pair was loaded from the files as they are now.
+     */
+    bool loaded_from(
+        const file_stamp& public_key_stamp,
+        const file_stamp& private_key_stamp) const
+    {
+        return m_public_key_stamp.matches(public_key_stamp) &&
+            m_private_key_stamp.matches(private_key_stamp);
+    }
+
+private:
+    std::string m_public_key;
+    boost::shared_ptr<locked_buffer> m_private_key;
+    boost::posix_time::ptime m_expiry;
+    file_stamp m_public_key_stamp;
+    file_stamp m_private_key_stamp;
+};
+
+}
+
+/**
+ * Cache of decrypted private keys for repeated key-file authentication.
+ *
+ * Authenticating with `session::authenticate_by_key_files` reads the key
+ * files and decrypts the private key on every call.  For passphrase-protected
+ * keys the decryption runs a deliberately slow key-derivation function.
+ * Passing a cache to that method instead does this once per key and reuses
+ * the result for every session authenticated with the same key until the
+ * key's lifetime runs out.
+ *
+ * Decrypted keys are held in memory locked out of the pagefile and wiped when
+ * they are purged.  Expired keys are purged the next time the cache is used;
+ * call `purge` to be sure they are gone at a particular moment.
+ *
+ * A cached key is only reused while both its files have the size and
+ * modification time they had when it was loaded.  Replacing either file
+ * loads the key again, which asks for the new file's passphrase.  The
+ * modification time is only as fine as the filesystem records it, so a key
+ * swapped for one of the same size within that resolution can go unnoticed;
+ * purge the key to be sure.
+ *
+ * The passphrase is only consulted when a key is first loaded.  Like an
+ * agent, once the key is in the cache it is unlocked for anyone who can use
+ * the cache.
+ *
+ * Instances are thread-safe.
+ */
+class private_key_cache : private boost::noncopyable
+{
+public:
+
+    /**
+     * @param lifetime
+     *     How long a decrypted key remains usable after it was loaded.
+     */
+    explicit private_key_cache(
+        boost::posix_time::time_duration lifetime=
+            boost::posix_time::minutes(10))
+        : m_lifetime(lifetime) {}
+
+    /**
+     * How long keys loaded from now on remain usable after loading.
+     */
+    boost::posix_time::time_duration lifetime() const
+    {
+        boost::mutex::scoped_lock lock(m_guard);
+        return m_lifetime;
+    }
+
+    /**
+     * Change how long keys remain usable after loading.
+     *
+     * Only affects keys loaded after the change.  Purge the cache to apply a
+     * shorter lifetime to keys already loaded.
+     */
+    void lifetime(boost::posix_time::time_duration new_lifetime)
+    {
+        boost::mutex::scoped_lock lock(m_guard);
+        m_lifetime = new_lifetime;
+    }
+
+    /**
+     * Wipe all keys from the cache.
+     */
+    void purge()
+    {
+        boost::mutex::scoped_lock lock(m_guard);
+        m_keys.clear();
+    }
+
+    /**
+     * Wipe the key loaded from the given private key file from the cache.
+     */
+    void purge(const boost::filesystem::path& private_key)
+    {
+        boost::mutex::scoped_lock lock(m_guard);
+        m_keys.erase(private_key.string());
+    }
+
+    /**
+     * Number of unexpired keys in the cache.
+     */
+    size_t size()
+    {
+        boost::mutex::scoped_lock lock(m_guard);
+        purge_expired();
+        return m_keys.size();
+    }
+
+private:
+
+    friend class session;
+
+    typedef std::map<
+        std::string, boost::shared_ptr<detail::cached_key_pair> > key_mapping;
+
+    /**
+     * Key pair for the given files, loading and decrypting it if not cached.
+     *
+     * The returned pair stays valid even if purged from the cache while the
+     * caller is still using it.
+     */
+    boost::shared_ptr<detail::cached_key_pair> key_pair(
+        const boost::filesystem::path& public_key,
+        const boost::filesystem::path& private_key,
+        const std::string& passphrase)
+    {
+        // Stamped before reading, so a file replaced while we read it fails
+        // to match next time instead of leaving a stale key cached
+        detail::file_stamp public_key_stamp(public_key);
+        detail::file_stamp private_key_stamp(private_key);
+
+        {
+            boost::mutex::scoped_lock lock(m_guard);
+
+            purge_expired();
+
+            key_mapping::iterator cached = m_keys.find(private_key.string());
+            if (cached != m_keys.end())
+            {
+                if (cached->second->loaded_from(
+                    public_key_stamp, private_key_stamp))
+                {
+                    return cached->second;
+                }
+
+                m_keys.erase(cached);
+            }
+        }
+
+        // Decrypt without holding the lock so slow key derivation for one
+        // key doesn't stall authentication with other, cached, keys.  If two
+        // threads race to load the same key, the last one in wins, which is
+        // harmless.
+
+        std::string public_key_data = detail::read_key_file(public_key);
+        std::string encrypted_private_key = detail::read_key_file(private_key);
+
+        boost::shared_ptr<detail::locked_buffer> decrypted =
+            detail::decrypt_private_key(encrypted_private_key, passphrase);
+
+        boost::mutex::scoped_lock lock(m_guard);
+
+        boost::shared_ptr<detail::cached_key_pair> pair =
+            boost::make_shared<detail::cached_key_pair>(
+                public_key_data, decrypted, now() + m_lifetime,
+                public_key_stamp, private_key_stamp);
+
+        m_keys[private_key.string()] = pair;
+
+        return pair;
+    }
+
+    static boost::posix_time::ptime now()
+    {
+        return boost::posix_time::microsec_clock::universal_time();
+    }
+
+    void purge_expired()
+    {
+        boost::posix_time::ptime current_time = now();
+
+        key_mapping::iterator it = m_keys.begin();
+        while (it != m_keys.end())
+        {
+            if (it->second->expiry() <= current_time)
+            {
+                m_keys.erase(it++);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    mutable boost::mutex m_guard;
+    boost::posix_time::time_duration m_lifetime;
+    key_mapping m_keys;
+};
+
+} // namespace ssh
+
+#endif
@@ -0,0 +1,1136 @@
+/**
+    @file
+
+    Recursive SFTP directory iteration with concurrent listing prefetch.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SSH_RECURSIVE_DIRECTORY_ITERATOR_HPP
+#define SSH_RECURSIVE_DIRECTORY_ITERATOR_HPP
+
+#include <ssh/detail/session_state.hpp>
+#include <ssh/detail/sftp_channel_pool.hpp>
+#include <ssh/filesystem.hpp>
+#include <ssh/sftp_error.hpp> // last_sftp_error_code
+#include <ssh/ssh_error.hpp> // SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH
+
+#include <boost/exception_ptr.hpp> // exception_ptr, current_exception
+#include <boost/filesystem/path.hpp> // path
+#include <boost/iterator/iterator_facade.hpp> // iterator_facade
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // find, min
+#include <cassert> // assert
+#include <cstddef> // size_t
+#include <cstring> // strlen
+#include <deque>
+#include <stdexcept> // invalid_argument, logic_error, range_error
+#include <string>
+#include <utility> // pair
+#include <vector>
+
+#include <libssh2_sftp.h>
+
+namespace ssh {
+namespace filesystem {
+
+/**
+ * How a `recursive_directory_iterator` walks the tree.
+ */
+struct recursion_options
+{
+    recursion_options()
+        : follow_symlinks(false), concurrency(4),
+          memory_budget(4 * 1024 * 1024) {}
+
+    /**
+     * Descend into directories reached through symlinks.
+     *
+     * Links that lead back to a directory the walk is already inside are
+     * not followed, so cycles don't make the walk endless.
+     */
+    bool follow_symlinks;
+
+    /**
+     * Most directories to list at the same time.
+     *
+     * Each listing needs its own SFTP channel as libssh2 only allows one
+     * request per channel to be outstanding.
+     */
+    std::size_t concurrency;
+
+    /**
+     * Roughly how many bytes of listings to fetch ahead of the walk.
+     *
+     * The listing the walk needs next is always fetched, whatever the
+     * budget says.
+     */
+    std::size_t memory_budget;
+};
+
+namespace detail {
+
+    /**
+     * A whole directory listing, filled in over time by
+     * `listing_prefetcher`.
+     *
+     * The `.` and `..` entries are left out.
+     */
+    class prefetched_listing : private boost::noncopyable
+    {
+    public:
+
+        explicit prefetched_listing(const boost::filesystem::path& directory)
+            :
+            m_storage(
+                boost::make_shared<listing_arena>(directory, CHUNK_SIZE)),
+            m_complete(false), m_abandoned(false) {}
+
+        const boost::filesystem::path& directory() const
+        {
+            return m_storage->directory();
+        }
+
+        bool complete() const
+        {
+            return m_complete;
+        }
+
+        /**
+         * Throws the error that stopped the listing, if any.
+         */
+        void check_error() const
+        {
+            if (m_error)
+            {
+                boost::rethrow_exception(m_error);
+            }
+        }
+
+        bool empty() const
+        {
+            return m_entries.empty();
+        }
+
+        std::size_t size() const
+        {
+            return m_entries.size();
+        }
+
+        sftp_file operator[](std::size_t index) const
+        {
+            const entry& e = m_entries[index];
+            return sftp_file(m_storage, e.name, e.long_entry, e.attributes);
+        }
+
+        /**
+         * Bytes of memory the listing takes up.
+         */
+        std::size_t memory_used() const
+        {
+            return m_storage->memory_used() +
+                m_entries.capacity() * sizeof(entry);
+        }
+
+        /// @name Used by the prefetcher.
+        // @{
+
+        void add(
+            const char* name, std::size_t name_size, const char* long_entry,
+            std::size_t long_entry_size,
+            const LIBSSH2_SFTP_ATTRIBUTES& attributes)
+        {
+            entry e;
+
+            const char* stored_name = m_storage->store(name, name_size);
+            e.name = sftp_file::char_range(
+                stored_name, stored_name + name_size);
+
+            const char* stored_long_entry =
+                m_storage->store(long_entry, long_entry_size);
+            e.long_entry = sftp_file::char_range(
+                stored_long_entry, stored_long_entry + long_entry_size);
+
+            e.attributes = attributes;
+
+            m_entries.push_back(e);
+        }
+
+        void finish()
+        {
+            m_complete = true;
+        }
+
+        void fail(boost::exception_ptr error)
+        {
+            m_error = error;
+            m_complete = true;
+        }
+
+        /**
+         * The walk no longer wants this listing.
+         */
+        void abandon()
+        {
+            m_abandoned = true;
+        }
+
+        bool abandoned() const
+        {
+            return m_abandoned;
+        }
+
+        // @}
+
+    private:
+
+        static const std::size_t CHUNK_SIZE = 4 * 1024;
+
+        struct entry
+        {
+            sftp_file::char_range name;
+            sftp_file::char_range long_entry;
+            LIBSSH2_SFTP_ATTRIBUTES attributes;
+        };
+
+        boost::shared_ptr<listing_arena> m_storage;
+        std::vector<entry> m_entries;
+        bool m_complete;
+        bool m_abandoned;
+        boost::exception_ptr m_error;
+    };
+
+    /**
+     * Lists several directories at once, over several SFTP channels.
+     *
+     * Directories are queued with `prefetch` and listed in queue order, as
+     * many at a time as the concurrency allows and only while the listings
+     * not yet claimed fit the memory budget.  Nothing happens in the
+     * background: listings only progress while `wait_for` or `poll` pump
+     * the channels, but while one pumps they all do.
+     */
+    class listing_prefetcher : private boost::noncopyable
+    {
+    public:
+
+        listing_prefetcher(
+            ::ssh::detail::sftp_channel_pool& pool, std::size_t concurrency,
+            std::size_t memory_budget)
+            :
+            m_pool(pool), m_session(pool.session_ref()),
+            m_concurrency(concurrency),
+            m_memory_budget(memory_budget), m_buffered(0U), m_needed(NULL),
+            m_progressed(false),
+            // yuk! hardcoded buffer sizes, as for directory_listing
+            m_filename_buffer(1024), m_longentry_buffer(1024)
+        {
+            if (m_concurrency == 0)
+                BOOST_THROW_EXCEPTION(
+                    std::invalid_argument("Concurrency must be at least one"));
+        }
+
+        ~listing_prefetcher() throw()
+        {
+            // Listings abandoned part way through still have handles open.
+            // Closing them blocks but that's no worse than shutting the
+            // channels down, which blocks too.
+            for (std::size_t i = 0; i < m_channels.size(); ++i)
+            {
+                channel& c = *m_channels[i];
+                if (c.handle)
+                {
+                    ::ssh::detail::session_state::scoped_lock lock =
+                        m_session.aquire_lock();
+
+                    ::libssh2_sftp_close_handle(c.handle);
+                }
+            }
+
+            return_channels(m_pool, m_channels);
+        }
+
+        /**
+         * Queue directories to be listed ahead of everything already queued.
+         *
+         * Put at the front because the walk visits the newest directories
+         * first.
+         */
+        void prefetch(
+            const std::vector<boost::shared_ptr<prefetched_listing> >&
+                listings)
+        {
+            m_queue.insert(m_queue.begin(), listings.begin(), listings.end());
+        }
+
+        /**
+         * Finish a listing, queueing it first if need be, and hand it over.
+         *
+         * Once claimed, a listing no longer counts against the budget.
+         */
+        void wait_for(const boost::shared_ptr<prefetched_listing>& listing)
+        {
+            if (!listing->complete())
+            {
+                // Jump the queue, or join it if it wasn't fetched ahead
+                unqueue(listing);
+                if (!in_flight(*listing))
+                {
+                    m_queue.push_front(listing);
+                }
+
+                m_needed = listing.get();
+
+                while (!listing->complete())
+                {
+                    pump(true);
+                }
+
+                m_needed = NULL;
+            }
+
+            release(*listing);
+        }
+
+        /**
+         * Move the listings along as far as they go without waiting.
+         */
+        void poll()
+        {
+            pump(false);
+        }
+
+        /**
+         * Stop wanting a listing that was queued.
+         */
+        void abandon(const boost::shared_ptr<prefetched_listing>& listing)
+        {
+            listing->abandon();
+
+            // If a channel is still listing it, it's released once the
+            // channel is done.  If it never started, there's nothing to
+            // release.
+            if (!unqueue(listing) && !in_flight(*listing))
+            {
+                release(*listing);
+            }
+        }
+
+    private:
+
+        template<typename Driver>
+        friend void drive_requests(
+            ::ssh::detail::session_state& session, Driver& driver);
+
+        enum operation
+        {
+            idle,
+            opening,
+            reading,
+            closing
+        };
+
+        /**
+         * An SFTP channel and the listing it is working on.
+         */
+        struct channel : private boost::noncopyable
+        {
+            explicit channel(
+                ::ssh::detail::sftp_channel_pool::channel_ptr sftp)
+                : sftp(sftp), current(idle), handle(NULL) {}
+
+            bool busy() const
+            {
+                return current != idle;
+            }
+
+            ::ssh::detail::sftp_channel_pool::channel_ptr sftp;
+            operation current;
+            LIBSSH2_SFTP_HANDLE* handle;
+            boost::shared_ptr<prefetched_listing> listing;
+        };
+
+        /**
+         * Take a listing out of the queue.
+         *
+         * @returns whether it was queued.
+         */
+        bool unqueue(const boost::shared_ptr<prefetched_listing>& listing)
+        {
+            std::deque<boost::shared_ptr<prefetched_listing> >::iterator
+                queued = std::find(m_queue.begin(), m_queue.end(), listing);
+            if (queued == m_queue.end())
+                return false;
+
+            m_queue.erase(queued);
+            return true;
+        }
+
+        bool in_flight(const prefetched_listing& listing) const
+        {
+            for (std::size_t i = 0; i < m_channels.size(); ++i)
+            {
+                if (m_channels[i]->listing.get() == &listing)
+                    return true;
+            }
+
+            return false;
+        }
+
+        /**
+         * Stop counting a listing's memory as fetched-ahead.
+         */
+        void release(const prefetched_listing& listing)
+        {
+            m_buffered -= (std::min)(m_buffered, listing.memory_used());
+        }
+
+        bool within_budget(const prefetched_listing& listing) const
+        {
+            return &listing == m_needed || m_buffered < m_memory_budget;
+        }
+
+        /**
+         * Borrow channels for queued listings that no channel is free for.
+         *
+         * Done without the session locked, as opening a channel locks it.
+         */
+        void open_channels()
+        {
+            std::size_t idle_channels = 0;
+            for (std::size_t i = 0; i < m_channels.size(); ++i)
+            {
+                if (m_channels[i]->current == idle)
+                    ++idle_channels;
+            }
+
+            while (m_channels.size() < m_concurrency &&
+                m_queue.size() > idle_channels &&
+                within_budget(*m_queue[idle_channels]))
+            {
+                try
+                {
+                    borrow_channels(m_pool, 1U, m_channels);
+                    ++idle_channels;
+                }
+                catch (const boost::system::system_error&)
+                {
+                    // Servers limit the channels per connection.  As long
+                    // as we have one we can carry on, just more slowly
+                    if (m_channels.empty())
+                        throw;
+
+                    m_concurrency = m_channels.size();
+                }
+            }
+        }
+
+        /**
+         * Drive the channels.
+         *
+         * @param wait  Wait for replies if nothing can move without them.
+         */
+        void pump(bool wait)
+        {
+            open_channels();
+
+            drive_requests(m_session, *this);
+
+            if (wait && m_needed && !m_needed->complete())
+            {
+                wait_for_replies(m_session);
+            }
+        }
+
+        /**
+         * Whether `wait_for` can stop pumping.
+         *
+         * Without anything needed, `poll` pumps until nothing moves.
+         */
+        bool finished() const
+        {
+            return m_needed != NULL && m_needed->complete();
+        }
+
+        /**
+         * Push every channel as far as it will go without blocking.
+         *
+         * @returns whether anything happened.
+         */
+        bool advance_all()
+        {
+            m_progressed = false;
+
+            for (std::size_t i = 0; i < m_channels.size(); ++i)
+            {
+                channel& c = *m_channels[i];
+
+                for (;;)
+                {
+                    if (c.current == idle && !start_next(c))
+                        break;
+
+                    if (!perform(c))
+                        break;
+                }
+            }
+
+            return m_progressed;
+        }
+
+        bool start_next(channel& c)
+        {
+            if (m_queue.empty() || !within_budget(*m_queue.front()))
+                return false;
+
+            c.listing = m_queue.front();
+            m_queue.pop_front();
+            c.current = opening;
+
+            m_progressed = true;
+            return true;
+        }
+
+        /**
+         * Move the channel's listing on.
+         *
+         * @returns false if it can't go any further without blocking.
+         */
+        bool perform(channel& c)
+        {
+            switch (c.current)
+            {
+            case opening:
+                return open(c);
+            case reading:
+                return read(c);
+            case closing:
+                return close(c);
+            default:
+                assert(false);
+                BOOST_THROW_EXCEPTION(
+                    std::logic_error("Unknown listing operation"));
+                return false;
+            }
+        }
+
+        bool open(channel& c)
+        {
+            std::string path = c.listing->directory().string();
+
+            LIBSSH2_SFTP_HANDLE* handle = ::libssh2_sftp_open_ex(
+                c.sftp->sftp_ptr(), path.data(),
+                static_cast<unsigned int>(path.size()), 0, 0,
+                LIBSSH2_SFTP_OPENDIR);
+
+            if (!handle &&
+                ::libssh2_session_last_errno(c.sftp->session_ptr()) ==
+                LIBSSH2_ERROR_EAGAIN)
+            {
+                return false;
+            }
+
+            m_progressed = true;
+
+            if (handle)
+            {
+                c.handle = handle;
+                c.current = (c.listing->abandoned()) ? closing : reading;
+            }
+            else
+            {
+                fail(c, "libssh2_sftp_open_ex");
+                finished(c);
+            }
+
+            return true;
+        }
+
+        bool read(channel& c)
+        {
+            while (!c.listing->abandoned())
+            {
+                LIBSSH2_SFTP_ATTRIBUTES attributes = LIBSSH2_SFTP_ATTRIBUTES();
+
+                int rc = ::libssh2_sftp_readdir_ex(
+                    c.handle, &m_filename_buffer[0], m_filename_buffer.size(),
+                    &m_longentry_buffer[0], m_longentry_buffer.size(),
+                    &attributes);
+
+                if (rc == LIBSSH2_ERROR_EAGAIN)
+                    return false;
+
+                m_progressed = true;
+
+                if (rc == 0) // end of files
+                {
+                    break;
+                }
+                else if (rc < 0)
+                {
+                    fail(c, "libssh2_sftp_readdir_ex");
+                    break;
+                }
+
+                // rc holds the number of bytes written to the buffer
+                std::size_t name_size = (std::min)(
+                    static_cast<std::size_t>(rc), m_filename_buffer.size());
+
+                if ((name_size == 1 && m_filename_buffer[0] == '.') ||
+                    (name_size == 2 && m_filename_buffer[0] == '.' &&
+                     m_filename_buffer[1] == '.'))
+                {
+                    continue;
+                }
+
+                // Same treatment of the long entry as directory_listing
+                m_longentry_buffer[m_longentry_buffer.size() - 1] = '\0';
+                std::size_t long_entry_size =
+                    std::strlen(&m_longentry_buffer[0]);
+
+                std::size_t memory_before = c.listing->memory_used();
+
+                c.listing->add(
+                    &m_filename_buffer[0], name_size, &m_longentry_buffer[0],
+                    long_entry_size, attributes);
+
+                m_buffered += c.listing->memory_used() - memory_before;
+            }
+
+            c.current = closing;
+            return true;
+        }
+
+        bool close(channel& c)
+        {
+            int rc = ::libssh2_sftp_close_handle(c.handle);
+            if (rc == LIBSSH2_ERROR_EAGAIN)
+                return false;
+
+            m_progressed = true;
+
+            // libssh2 frees the handle whether closing succeeds or not and
+            // a failure to close doesn't make the listing any less complete
+            c.handle = NULL;
+            finished(c);
+
+            return true;
+        }
+
+        void finished(channel& c)
+        {
+            if (!c.listing->complete())
+            {
+                c.listing->finish();
+            }
+
+            // Nobody will claim an abandoned listing, so stop counting it
+            // here
+            if (c.listing->abandoned())
+            {
+                release(*c.listing);
+            }
+
+            c.listing.reset();
+            c.current = idle;
+        }
+
+        void fail(channel& c, const char* api_function)
+        {
+            std::string message;
+            boost::system::error_code ec = last_sftp_error_code(
+                c.sftp->session_ptr(), c.sftp->sftp_ptr(), message);
+
+            std::string path = c.listing->directory().string();
+
+            try
+            {
+                SSH_DETAIL_THROW_API_ERROR_CODE_WITH_PATH(
+                    ec, message, api_function, path.data(), path.size());
+            }
+            catch (...)
+            {
+                // Thrown when the walk gets to this directory, not now
+                c.listing->fail(boost::current_exception());
+            }
+        }
+
+        ::ssh::detail::sftp_channel_pool& m_pool;
+        ::ssh::detail::session_state& m_session;
+        std::size_t m_concurrency;
+        std::size_t m_memory_budget;
+        std::size_t m_buffered; ///< Bytes listed but not yet claimed
+        const prefetched_listing* m_needed; ///< What `wait_for` waits for
+        bool m_progressed; ///< Something happened during this advance
+        std::vector<boost::shared_ptr<channel> > m_channels;
+        std::deque<boost::shared_ptr<prefetched_listing> > m_queue;
+        std::vector<char> m_filename_buffer;
+        std::vector<char> m_longentry_buffer;
+    };
+
+    /**
+     * State of a recursive walk, shared by all copies of its iterator.
+     */
+    class recursive_walk : private boost::noncopyable
+    {
+    public:
+
+        recursive_walk(
+            sftp_filesystem& filesystem,
+            ::ssh::detail::sftp_channel_pool& pool,
+            const boost::filesystem::path& root,
+            const recursion_options& options)
+            :
+            m_filesystem(filesystem),
+            m_prefetcher(pool, options.concurrency, options.memory_budget),
+            m_follow_symlinks(options.follow_symlinks),
+            m_recursion_pending(true)
+        {
+            boost::shared_ptr<prefetched_listing> listing =
+                boost::make_shared<prefetched_listing>(root);
+
+            m_prefetcher.wait_for(listing);
+            listing->check_error();
+
+            if (!listing->empty())
+            {
+                std::string canonical;
+                if (m_follow_symlinks)
+                {
+                    canonical = m_filesystem.canonical_path(root).string();
+                }
+
+                push(listing, canonical);
+            }
+        }
+
+        bool at_end() const
+        {
+            return m_stack.empty();
+        }
+
+        sftp_file current() const
+        {
+            const level& top = m_stack.back();
+            return (*top.listing)[top.position];
+        }
+
+        int depth() const
+        {
+            return static_cast<int>(m_stack.size()) - 1;
+        }
+
+        bool recursion_pending() const
+        {
+            return m_recursion_pending;
+        }
+
+        void no_push(bool value)
+        {
+            m_recursion_pending = !value;
+        }
+
+        void increment()
+        {
+            if (m_recursion_pending)
+            {
+                // Don't try again if listing the directory throws
+                m_recursion_pending = false;
+
+                std::string canonical;
+                if (should_descend(current(), canonical))
+                {
+                    boost::shared_ptr<prefetched_listing> listing =
+                        take_child_listing();
+
+                    m_prefetcher.wait_for(listing);
+                    listing->check_error();
+
+                    if (!listing->empty())
+                    {
+                        push(listing, canonical);
+                        return;
+                    }
+                }
+            }
+
+            next_entry();
+        }
+
+        void pop()
+        {
+            pop_level();
+
+            if (!at_end())
+            {
+                next_entry();
+            }
+        }
+
+    private:
+
+        /**
+         * One directory on the way down to the current entry.
+         */
+        struct level
+        {
+            boost::shared_ptr<prefetched_listing> listing;
+            std::size_t position;
+
+            /// Listings fetched ahead for the subdirectories, in order
+            std::deque<
+                std::pair<std::size_t, boost::shared_ptr<prefetched_listing> >
+            > children;
+
+            /// Real path of the directory, when following links
+            std::string canonical;
+        };
+
+        void push(
+            boost::shared_ptr<prefetched_listing> listing,
+            const std::string& canonical)
+        {
+            assert(!listing->empty());
+
+            m_stack.push_back(level());
+
+            level& top = m_stack.back();
+            top.listing = listing;
+            top.position = 0;
+            top.canonical = canonical;
+
+            // Links aren't fetched ahead as we can't know, without a stat,
+            // whether they lead anywhere worth listing
+            std::vector<boost::shared_ptr<prefetched_listing> > ahead;
+            for (std::size_t i = 0; i < listing->size(); ++i)
+            {
+                sftp_file file = (*listing)[i];
+                if (file.attributes().type() == file_attributes::directory)
+                {
+                    ahead.push_back(
+                        boost::make_shared<prefetched_listing>(file.path()));
+                    top.children.push_back(std::make_pair(i, ahead.back()));
+                }
+            }
+
+            m_prefetcher.prefetch(ahead);
+            m_prefetcher.poll();
+
+            m_recursion_pending = true;
+        }
+
+        void pop_level()
+        {
+            level& top = m_stack.back();
+            for (std::size_t i = 0; i < top.children.size(); ++i)
+            {
+                m_prefetcher.abandon(top.children[i].second);
+            }
+
+            m_stack.pop_back();
+        }
+
+        /**
+         * Move to the next entry, climbing out of finished directories.
+         */
+        void next_entry()
+        {
+            while (!m_stack.empty())
+            {
+                level& top = m_stack.back();
+
+                if (++top.position < top.listing->size())
+                {
+                    m_recursion_pending = true;
+                    return;
+                }
+
+                pop_level();
+
+                if (!m_stack.empty())
+                {
+                    m_prefetcher.poll();
+                }
+            }
+        }
+
+        /**
+         * The listing of the current entry, from those fetched ahead if it
+         * is one of them.
+         *
+         * Listings fetched ahead for entries we've passed over, because the
+         * caller said not to recurse into them, are abandoned.
+         */
+        boost::shared_ptr<prefetched_listing> take_child_listing()
+        {
+            level& top = m_stack.back();
+
+            while (!top.children.empty() &&
+                top.children.front().first < top.position)
+            {
+                m_prefetcher.abandon(top.children.front().second);
+                top.children.pop_front();
+            }
+
+            if (!top.children.empty() &&
+                top.children.front().first == top.position)
+            {
+                boost::shared_ptr<prefetched_listing> listing =
+                    top.children.front().second;
+                top.children.pop_front();
+                return listing;
+            }
+            else
+            {
+                return boost::make_shared<prefetched_listing>(
+                    current().path());
+            }
+        }
+
+        /**
+         * Whether to recurse into the entry.
+         *
+         * @param[out] canonical
+         *     Real path of the directory, if following links.
+         */
+        bool should_descend(const sftp_file& file, std::string& canonical)
+        {
+            file_attributes::file_type type = file.attributes().type();
+
+            if (!m_follow_symlinks)
+            {
+                return type == file_attributes::directory;
+            }
+
+            if (type == file_attributes::directory)
+            {
+                canonical = m_stack.back().canonical;
+                if (canonical.empty() || canonical[canonical.size() - 1] != '/')
+                {
+                    canonical += '/';
+                }
+                canonical += file.name();
+
+                return true;
+            }
+            else if (type == file_attributes::symbolic_link)
+            {
+                try
+                {
+                    if (m_filesystem.attributes(file.path(), true).type() !=
+                        file_attributes::directory)
+                    {
+                        return false;
+                    }
+
+                    canonical =
+                        m_filesystem.canonical_path(file.path()).string();
+                }
+                catch (const boost::system::system_error&)
+                {
+                    // Broken link.  Like Boost.Filesystem, we just don't
+                    // recurse
+                    return false;
+                }
+
+                // A link back to somewhere we already are would walk forever
+                for (std::size_t i = 0; i < m_stack.size(); ++i)
+                {
+                    if (m_stack[i].canonical == canonical)
+                        return false;
+                }
+
+                return true;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        sftp_filesystem& m_filesystem;
+        listing_prefetcher m_prefetcher;
+        bool m_follow_symlinks;
+        std::vector<level> m_stack;
+        bool m_recursion_pending;
+    };
+
+}
+
+/**
+ * Walk a directory and everything below it.
+ *
+ * Mirrors Boost.Filesystem's `recursive_directory_iterator`.  Entries are
+ * visited depth-first, each directory before its contents, and
+ * incrementing past a directory descends into it unless `no_push` or `pop`
+ * say otherwise.
+ *
+ * While the walk works through one directory, the listings of the
+ * subdirectories it will visit next are fetched concurrently over several
+ * SFTP channels, so a walk doesn't wait a round trip for every step of
+ * every listing.  `recursion_options` limits how far ahead it gets.
+ *
+ * Like `directory_iterator`, all copies of the iterator are linked so that
+ * incrementing one increments all the copies.  The `sftp_filesystem`
+ * (and, transitively, the `session`) must outlive all non-end copies of
+ * the iterator.
+ */
+class recursive_directory_iterator : public boost::iterator_facade<
+    recursive_directory_iterator, const sftp_file, boost::forward_traversal_tag,
+    sftp_file>
+{
+public:
+
+    /**
+     * End-of-walk marker.
+     */
+    recursive_directory_iterator() {}
+
+    /**
+     * Start walking the tree below `root`.
+     *
+     * The first entry of `root` is the first visited; `root` itself isn't.
+     *
+     * @throws `boost::system::system_error` if `root` can't be listed.
+     */
+    recursive_directory_iterator(
+        sftp_filesystem& filesystem, const boost::filesystem::path& root,
+        const recursion_options& options=recursion_options())
+    {
+        boost::shared_ptr<detail::recursive_walk> walk =
+            boost::make_shared<detail::recursive_walk>(
+                boost::ref(filesystem), boost::ref(filesystem.pool_ref()),
+                root, options);
+
+        // An empty root is the end straight away
+        if (!walk->at_end())
+        {
+            m_walk = walk;
+        }
+    }
+
+    /**
+     * How many directories below the root the current entry is.
+     *
+     * Entries in the root itself are at depth 0.
+     */
+    int depth() const
+    {
+        check_not_end();
+        return m_walk->depth();
+    }
+
+    /**
+     * Whether incrementing will descend into the current entry, if it is a
+     * directory.
+     */
+    bool recursion_pending() const
+    {
+        check_not_end();
+        return m_walk->recursion_pending();
+    }
+
+    /**
+     * Don't descend into the current directory when next incremented.
+     *
+     * Any listing already fetched ahead for it is thrown away.
+     */
+    void no_push(bool value=true)
+    {
+        check_not_end();
+        m_walk->no_push(value);
+    }
+
+    /**
+     * Leave the current directory, moving to the entry after it in its
+     * parent.
+     *
+     * Popping the root ends the walk.
+     */
+    void pop()
+    {
+        check_not_end();
+        m_walk->pop();
+    }
+
+private:
+
+    friend class boost::iterator_core_access;
+
+    void increment()
+    {
+        if (at_end())
+            BOOST_THROW_EXCEPTION(std::range_error("No more files"));
+        m_walk->increment();
+    }
+
+    bool equal(recursive_directory_iterator const& other) const
+    {
+        if (at_end() || other.at_end())
+        {
+            return at_end() && other.at_end();
+        }
+        else
+        {
+            return m_walk == other.m_walk;
+        }
+    }
+
+    bool at_end() const
+    {
+        return m_walk == NULL || m_walk->at_end();
+    }
+
+    void check_not_end() const
+    {
+        if (at_end())
+            BOOST_THROW_EXCEPTION(
+                std::logic_error("Operation not valid at the end of a walk"));
+    }
+
+    sftp_file dereference() const
+    {
+        check_not_end();
+        return m_walk->current();
+    }
+
+    // The walk is shared between all copies of the iterator because
+    // iterators must be copyable
+    boost::shared_ptr<detail::recursive_walk> m_walk;
+};
+
+}} // namespace ssh::filesystem
+
+#endif
@@ -38,9 +38,12 @@
 #define SSH_SESSION_HPP
 
 #include <ssh/agent.hpp>
+#include <ssh/bandwidth.hpp> // bandwidth_limiter
 #include <ssh/detail/libssh2/session.hpp> // ssh::detail::libssh2::session
 #include <ssh/detail/libssh2/userauth.hpp> // ssh::detail::libssh2::userauth
+#include <ssh/exec_channel.hpp>
 #include <ssh/host_key.hpp>
+#include <ssh/key_cache.hpp> // private_key_cache
 #include <ssh/filesystem.hpp> // sftp_filesystem
 
 #include <boost/algorithm/string/classification.hpp> // is_any_of
@@ -605,6 +608,34 @@ public:
             private_key.external_file_string().c_str(), passphrase.c_str());
     }
 
+    /**
+     * Public-key authentication using a cache of decrypted keys.
+     *
+     * Behaves like the overload without a cache except that the key files
+     * are only read, and the private key only decrypted, if the `cache`
+     * doesn't already hold the key.  Authentication itself is done from the
+     * cached copy in memory.
+     *
+     * @see private_key_cache
+     */
+    void authenticate_by_key_files(
+        const std::string& username, const boost::filesystem::path& public_key,
+        const boost::filesystem::path& private_key,
+        const std::string& passphrase, private_key_cache& cache)
+    {
+        boost::shared_ptr<detail::cached_key_pair> key_pair =
+            cache.key_pair(public_key, private_key, passphrase);
+
+        detail::session_state::scoped_lock lock = session_ref().aquire_lock();
+
+        // The cached private key is not encrypted so no passphrase needed
+        detail::libssh2::userauth::public_key_from_memory(
+            session_ref().session_ptr(), username.data(), username.size(),
+            key_pair->public_key().data(), key_pair->public_key().size(),
+            key_pair->private_key().data(), key_pair->private_key().size(),
+            NULL);
+    }
+
     /**
      * Connect to any agent running on the system and return object to
      * authenticate using its identities.
@@ -614,6 +645,31 @@ public:
         return ::ssh::agent_identities(session_ref());
     }
 
+    /**
+     * Run a command on the server.
+     *
+     * @warning As with the filesystem, the caller must make sure the command
+     *          is finished with before the session is disconnected.
+     */
+    exec_channel execute(const std::string& command)
+    {
+        return exec_channel(session_ref(), command);
+    }
+
+    /**
+     * Hold file transfers and command input and output over this session
+     * to the limiter's rate.
+     *
+     * Applies to transfers already under way, from their next block.
+     * Pass null to stop limiting.
+     */
+    void limit_bandwidth(boost::shared_ptr<bandwidth_limiter> limiter)
+    {
+        detail::session_state::scoped_lock lock = session_ref().aquire_lock();
+
+        session_ref().set_limiter(limiter);
+    }
+
     /**
      * Create a new connection to the remote filesystem over this SSH session.
      *
@@ -37,17 +37,23 @@
 #ifndef SSH_STREAM_HPP
 #define SSH_STREAM_HPP
 
+#include <ssh/bandwidth.hpp> // bandwidth_limiter
+#include <ssh/detail/attribute_cache.hpp>
 #include <ssh/detail/file_handle_state.hpp>
+#include <ssh/detail/request_scheduler.hpp> // request_priority
 #include <ssh/detail/session_state.hpp>
-#include <ssh/detail/libssh2/sftp.hpp>
 #include <ssh/session.hpp>
+#include <ssh/ssh_error.hpp> // SSH_DETAIL_THROW_API_ERROR_CODE
 #include <ssh/filesystem.hpp>
 
+#include <boost/bind.hpp> // bind
 #include <boost/filesystem/path.hpp> // path
 #include <boost/iostreams/categories.hpp>
                                // seekable, input_seekable, output_seekable
 #include <boost/iostreams/stream.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp> // error_code
 #include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
 
 #include <cassert> // assert
@@ -292,10 +298,14 @@ namespace detail {
         return flags;
     }
 
+    /**
+     * @param exclusive  Whether the channel is ours alone, as a borrowed
+     *                   channel is.
+     */
     inline boost::shared_ptr<::ssh::detail::file_handle_state> open_file(
         ::ssh::detail::sftp_channel_state& sftp,
         const boost::filesystem::path& open_path, 
-        openmode::value opening_mode)
+        openmode::value opening_mode, bool exclusive=false)
     {
         std::string path_string = open_path.string();
 
@@ -306,31 +316,33 @@ namespace detail {
             openmode_to_libssh2_flags(opening_mode),
             LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR |
             LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IROTH,
-            LIBSSH2_SFTP_OPENFILE);
+            LIBSSH2_SFTP_OPENFILE, exclusive);
     }
 
     inline boost::shared_ptr<::ssh::detail::file_handle_state> open_input_file(
         ::ssh::detail::sftp_channel_state& sftp,
         const boost::filesystem::path& open_path, 
-        openmode::value opening_mode)
+        openmode::value opening_mode, bool exclusive=false)
     {
         // For input streams open files for input even if not given in open
         // flags.  Matches standard library ifstream.
 
-        return open_file(sftp, open_path, opening_mode | openmode::in);
+        return open_file(
+            sftp, open_path, opening_mode | openmode::in, exclusive);
     }
 
     inline boost::shared_ptr<::ssh::detail::file_handle_state> open_output_file(
        ::ssh::detail::sftp_channel_state& sftp,
         const boost::filesystem::path& open_path, 
-        openmode::value opening_mode)
+        openmode::value opening_mode, bool exclusive=false)
     {
         // For output streams open files for output even if not given in open
         // flags.  Matches standard library ofstream.
 
         return open_file(
             sftp, open_path,
-            static_cast<openmode::value>(opening_mode | openmode::out));
+            static_cast<openmode::value>(opening_mode | openmode::out),
+            exclusive);
     }
 
     inline boost::iostreams::stream_offset seek(
@@ -359,12 +371,21 @@ namespace detail {
 
                 try
                 {
-                    ::ssh::detail::file_handle_state::scoped_lock lock =
-                        handle.aquire_lock();
+                    boost::system::error_code ec;
+                    std::string message;
 
-                    ::ssh::detail::libssh2::sftp::fstat(
-                        handle.session_ptr(), handle.sftp_ptr(),
-                        handle.file_handle(), &attributes, LIBSSH2_SFTP_STAT);
+                    handle.call(
+                        boost::bind(
+                            &::libssh2_sftp_fstat_ex, handle.file_handle(),
+                            &attributes, LIBSSH2_SFTP_STAT),
+                        ::ssh::detail::request_priority::interactive,
+                        ec, message);
+
+                    if (ec)
+                    {
+                        SSH_DETAIL_THROW_API_ERROR_CODE(
+                            ec, message, "libssh2_sftp_fstat_ex");
+                    }
                 }
                 catch (boost::exception& e)
                 {
@@ -410,16 +431,34 @@ namespace detail {
             ssize_t count = 0;
             do
             {
-                ::ssh::detail::file_handle_state::scoped_lock lock =
-                    handle.aquire_lock();
+                boost::system::error_code ec;
+                std::string message;
+                boost::shared_ptr< ::ssh::bandwidth_limiter> limiter;
+
+                // Bulk, so that listings needn't wait for the rest of the
+                // file
+                ssize_t rc = handle.call(
+                    boost::bind(
+                        &::libssh2_sftp_read, handle.file_handle(),
+                        buffer + count, buffer_size - count),
+                    ::ssh::detail::request_priority::bulk, ec, message,
+                    &limiter);
+
+                if (ec)
+                {
+                    SSH_DETAIL_THROW_API_ERROR_CODE(
+                        ec, message, "libssh2_sftp_read");
+                }
 
-                ssize_t rc = ::ssh::detail::libssh2::sftp::read(
-                    handle.session_ptr(), handle.sftp_ptr(),
-                    handle.file_handle(), buffer + count, buffer_size - count);
                 if (rc == 0)
                     break; // EOF
 
                 count += rc;
+
+                // Held back without the session locked so that other
+                // requests can carry on meanwhile
+                if (limiter)
+                    limiter->consume(rc);
             }
             while (count < buffer_size);
 
@@ -450,12 +489,27 @@ namespace detail {
             ssize_t count = 0;
             do
             {
-                ::ssh::detail::file_handle_state::scoped_lock lock =
-                    handle.aquire_lock();
+                boost::system::error_code ec;
+                std::string message;
+                boost::shared_ptr< ::ssh::bandwidth_limiter> limiter;
+
+                ssize_t rc = handle.call(
+                    boost::bind(
+                        &::libssh2_sftp_write, handle.file_handle(),
+                        data + count, data_size - count),
+                    ::ssh::detail::request_priority::bulk, ec, message,
+                    &limiter);
+
+                if (ec)
+                {
+                    SSH_DETAIL_THROW_API_ERROR_CODE(
+                        ec, message, "libssh2_sftp_write");
+                }
+
+                count += rc;
 
-                count += ::ssh::detail::libssh2::sftp::write(
-                    handle.session_ptr(), handle.sftp_ptr(),
-                    handle.file_handle(), data + count, data_size - count);
+                if (limiter)
+                    limiter->consume(rc);
             }
             while (count < data_size);
 
@@ -484,6 +538,20 @@ namespace detail {
         boost::iostreams::seekable,
         boost::iostreams::optimally_buffered_tag {};
 
+    inline bool is_exclusive(const sftp_filesystem&)
+    {
+        return false;
+    }
+
+    /**
+     * Borrowed channels serve only the streams opened on them, so requests on
+     * them can wait for replies without holding the session.
+     */
+    inline bool is_exclusive(const borrowed_channel&)
+    {
+        return true;
+    }
+
     /**
      * Allows setting buffer size on boost::iostreams::stream based streams.
      *
@@ -499,35 +567,40 @@ namespace detail {
         // Using separate constructors rather than default arguments so they
         // pick up the defaults from the devices
 
+        template<typename Channel>
         sftp_stream(
-            sftp_filesystem& channel, const boost::filesystem::path& open_path)
+            Channel& channel, const boost::filesystem::path& open_path)
         {
             open(Device(channel, open_path));
         }
 
+        template<typename Channel>
         sftp_stream(
-            sftp_filesystem& channel, const boost::filesystem::path& open_path, 
+            Channel& channel, const boost::filesystem::path& open_path, 
             openmode::value opening_mode)
         {
             open(Device(channel, open_path, opening_mode));
         }
 
+        template<typename Channel>
         sftp_stream(
-            sftp_filesystem& channel, const boost::filesystem::path& open_path, 
+            Channel& channel, const boost::filesystem::path& open_path, 
             openmode::value opening_mode, std::streamsize buffer_size)
         {
             open(Device(channel, open_path, opening_mode), buffer_size);
         }
 
+        template<typename Channel>
         sftp_stream(
-            sftp_filesystem& channel, const boost::filesystem::path& open_path, 
+            Channel& channel, const boost::filesystem::path& open_path, 
             std::ios_base::openmode opening_mode)
         {
             open(Device(channel, open_path, opening_mode));
         }
 
+        template<typename Channel>
         sftp_stream(
-            sftp_filesystem& channel, const boost::filesystem::path& open_path, 
+            Channel& channel, const boost::filesystem::path& open_path, 
             std::ios_base::openmode opening_mode, std::streamsize buffer_size)
         {
             open(Device(channel, open_path, opening_mode), buffer_size);
@@ -554,25 +627,29 @@ class sftp_input_device :
 {
 public:
 
+    template<typename Channel>
     sftp_input_device(
-        sftp_filesystem& channel, const boost::filesystem::path& open_path, 
+        Channel& channel, const boost::filesystem::path& open_path, 
         openmode::value opening_mode=openmode::in)
         :
     m_open_path(open_path),
     m_handle(
         detail::open_input_file(
-            channel.sftp_ref(), m_open_path, opening_mode))
+            channel.sftp_ref(), m_open_path, opening_mode,
+            detail::is_exclusive(channel)))
     {}
 
+    template<typename Channel>
     sftp_input_device(
-        sftp_filesystem& channel, const boost::filesystem::path& open_path, 
+        Channel& channel, const boost::filesystem::path& open_path, 
         std::ios_base::openmode opening_mode)
         :
      m_open_path(open_path),
      m_handle(
          detail::open_input_file(
              channel.sftp_ref(), m_open_path,
-             detail::translate_flags(opening_mode)))
+             detail::translate_flags(opening_mode),
+             detail::is_exclusive(channel)))
     {}
 
     std::streamsize optimal_buffer_size() const
@@ -612,25 +689,36 @@ class sftp_output_device :
 {
 public:
 
+    template<typename Channel>
     sftp_output_device(
-        sftp_filesystem& channel, const boost::filesystem::path& open_path, 
+        Channel& channel, const boost::filesystem::path& open_path, 
         openmode::value opening_mode=openmode::out)
         :
     m_open_path(open_path),
     m_handle(
-        detail::open_output_file(channel.sftp_ref(), m_open_path, opening_mode))
-    {}
+        detail::open_output_file(
+            channel.sftp_ref(), m_open_path, opening_mode,
+            detail::is_exclusive(channel))),
+    m_cache(&channel.cache_ref())
+    {
+        m_cache->invalidate(m_open_path.string());
+    }
 
+    template<typename Channel>
     sftp_output_device(
-        sftp_filesystem& channel, const boost::filesystem::path& open_path, 
+        Channel& channel, const boost::filesystem::path& open_path, 
         std::ios_base::openmode opening_mode)
         :
     m_open_path(open_path),
     m_handle(
         detail::open_output_file(
             channel.sftp_ref(), m_open_path,
-            detail::translate_flags(opening_mode)))
-    {}
+            detail::translate_flags(opening_mode),
+            detail::is_exclusive(channel))),
+    m_cache(&channel.cache_ref())
+    {
+        m_cache->invalidate(m_open_path.string());
+    }
 
     std::streamsize optimal_buffer_size() const
     {
@@ -639,6 +727,9 @@ public:
 
     std::streamsize write(const char* data, std::streamsize data_size)
     {
+        // Size and modification time are changing
+        m_cache->invalidate(m_open_path.string());
+
         return detail::write(*m_handle, m_open_path, data, data_size);
     }
 
@@ -651,6 +742,7 @@ public:
 private:
     boost::filesystem::path m_open_path;
     boost::shared_ptr<::ssh::detail::file_handle_state> m_handle;
+    ::ssh::detail::attribute_cache* m_cache;
 };
 
 
@@ -671,24 +763,36 @@ class sftp_io_device :
 {
 public:
 
+    template<typename Channel>
     sftp_io_device(
-        sftp_filesystem& channel, const boost::filesystem::path& open_path, 
+        Channel& channel, const boost::filesystem::path& open_path, 
         openmode::value opening_mode=openmode::in | openmode::out)
         :
     m_open_path(open_path),
-    m_handle(detail::open_file(channel.sftp_ref(), m_open_path, opening_mode))
-    {}
+    m_handle(
+        detail::open_file(
+            channel.sftp_ref(), m_open_path, opening_mode,
+            detail::is_exclusive(channel))),
+    m_cache(&channel.cache_ref())
+    {
+        m_cache->invalidate(m_open_path.string());
+    }
 
+    template<typename Channel>
     sftp_io_device(
-        sftp_filesystem& channel, const boost::filesystem::path& open_path, 
+        Channel& channel, const boost::filesystem::path& open_path, 
         std::ios_base::openmode opening_mode)
         :
     m_open_path(open_path),
     m_handle(
         detail::open_file(
             channel.sftp_ref(), m_open_path,
-            detail::translate_flags(opening_mode)))
-    {}
+            detail::translate_flags(opening_mode),
+            detail::is_exclusive(channel))),
+    m_cache(&channel.cache_ref())
+    {
+        m_cache->invalidate(m_open_path.string());
+    }
 
     std::streamsize optimal_buffer_size() const
     {
@@ -702,6 +806,9 @@ public:
 
     std::streamsize write(const char* data, std::streamsize data_size)
     {
+        // Size and modification time are changing
+        m_cache->invalidate(m_open_path.string());
+
         return detail::write(*m_handle, m_open_path, data, data_size);
     }
 
@@ -714,6 +821,7 @@ public:
 private:
     boost::filesystem::path m_open_path;
     boost::shared_ptr<::ssh::detail::file_handle_state> m_handle;
+    ::ssh::detail::attribute_cache* m_cache;
 };
 
 /**
@@ -0,0 +1,648 @@
+/**
+    @file
+
+    Copying between a byte source and sink on two threads, double-buffered.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SWISH_BLOCK_TRANSFER_HPP
+#define SWISH_BLOCK_TRANSFER_HPP
+#pragma once
+
+#include <boost/bind.hpp> // bind
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/exception_ptr.hpp> // current_exception, rethrow_exception
+#include <boost/function.hpp> // function
+#include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // min, max
+#include <cstddef> // size_t
+#include <deque>
+#include <istream>
+#include <ostream>
+#include <stdexcept> // invalid_argument, runtime_error
+#include <vector>
+
+/**
+ * @namespace swish::block_transfer
+ *
+ * Copying from a source of bytes to a sink of bytes with the reading and the
+ * writing overlapped.
+ *
+ * Copying a file by reading a block then writing it, over and over, leaves
+ * the disk idle while the network is busy and the network idle while the
+ * disk is busy.  Here the sink is written on a thread of its own while the
+ * calling thread reads ahead into a small ring of large buffers, so both
+ * are busy at once.
+ *
+ * The size of the blocks adapts to how fast the sink takes them: slow sinks
+ * get smaller blocks so progress stays responsive, fast sinks get bigger
+ * ones so per-block overhead stays negligible.
+ *
+ * Nothing here depends on Windows so it can be tested against local files
+ * and SFTP streams anywhere.
+ */
+
+namespace swish {
+namespace block_transfer {
+
+/**
+ * Where the bytes come from.
+ *
+ * Only ever read on the thread calling transfer_engine::transfer.
+ */
+class byte_source
+{
+public:
+    virtual ~byte_source() {}
+
+    /**
+     * Read up to `size` bytes into `buffer`.
+     *
+     * @returns  Number of bytes read; zero only at the end of the data.
+     */
+    virtual std::size_t read(char* buffer, std::size_t size) = 0;
+};
+
+/**
+ * Where the bytes go.
+ *
+ * Written on a thread of the transfer engine's own.  Errors should be
+ * thrown with BOOST_THROW_EXCEPTION so that they reach the caller intact.
+ */
+class byte_sink
+{
+public:
+    virtual ~byte_sink() {}
+
+    /**
+     * Write all `size` bytes from `data`.
+     */
+    virtual void write(const char* data, std::size_t size) = 0;
+};
+
+/**
+ * Source reading from a standard stream.
+ */
+class istream_source : public byte_source
+{
+public:
+    explicit istream_source(std::istream& stream) : m_stream(stream) {}
+
+    virtual std::size_t read(char* buffer, std::size_t size)
+    {
+        m_stream.read(buffer, size);
+        if (m_stream.bad())
+            BOOST_THROW_EXCEPTION(std::runtime_error("Unable to read data"));
+
+        return static_cast<std::size_t>(m_stream.gcount());
+    }
+
+private:
+    std::istream& m_stream;
+};
+
+/**
+ * Sink writing to a standard stream.
+ */
+class ostream_sink : public byte_sink
+{
+public:
+    explicit ostream_sink(std::ostream& stream) : m_stream(stream) {}
+
+    virtual void write(const char* data, std::size_t size)
+    {
+        m_stream.write(data, size);
+        if (!m_stream)
+            BOOST_THROW_EXCEPTION(std::runtime_error("Unable to write data"));
+    }
+
+private:
+    std::ostream& m_stream;
+};
+
+/**
+ * How a transfer engine buffers and sizes blocks.
+ */
+struct transfer_options
+{
+    transfer_options()
+        :
+        buffer_count(3), initial_block_size(256 * 1024),
+        min_block_size(32 * 1024), max_block_size(4 * 1024 * 1024),
+        target_block_time(boost::posix_time::milliseconds(200)) {}
+
+    /**
+     * Blocks in the ring.
+     *
+     * Two is enough for one block to be read while another is written;
+     * more smooths out a source or sink whose speed varies.
+     */
+    std::size_t buffer_count;
+
+    std::size_t initial_block_size;
+    std::size_t min_block_size;
+    std::size_t max_block_size;
+
+    /**
+     * How long writing a block should take.
+     *
+     * The block size is doubled when a block is written in under half this
+     * time and halved when one takes over twice this time.
+     */
+    boost::posix_time::time_duration target_block_time;
+};
+
+namespace detail {
+
+    /**
+     * Alignment of block buffers.
+     *
+     * Page-aligned buffers let the operating system move data in and out
+     * of them without first copying it to an aligned buffer of its own.
+     */
+    const std::size_t BLOCK_ALIGNMENT = 4096;
+
+    /**
+     * How often, at least, the caller hears about progress.
+     */
+    const long PROGRESS_INTERVAL_MILLISECONDS = 100;
+
+    /**
+     * Aligned block of memory, kept between blocks and between transfers.
+     */
+    class block_buffer : private boost::noncopyable
+    {
+    public:
+
+        block_buffer() : m_data(NULL), m_capacity(0), size(0) {}
+
+        char* data()
+        {
+            return m_data;
+        }
+
+        /**
+         * Make the buffer at least `capacity` bytes, discarding its
+         * contents if it has to grow.
+         */
+        void reserve(std::size_t capacity)
+        {
+            if (capacity <= m_capacity)
+                return;
+
+            // Release the old memory before allocating the new
+            std::vector<char>().swap(m_storage);
+            std::vector<char>(capacity + BLOCK_ALIGNMENT - 1).swap(m_storage);
+
+            std::size_t misalignment =
+                reinterpret_cast<std::size_t>(&m_storage[0]) %
+                BLOCK_ALIGNMENT;
+
+            m_data = &m_storage[0];
+            if (misalignment != 0)
+                m_data += BLOCK_ALIGNMENT - misalignment;
+
+            m_capacity = capacity;
+        }
+
+    private:
+        std::vector<char> m_storage;
+        char* m_data;
+        std::size_t m_capacity;
+
+    public:
+        std::size_t size; ///< Bytes of data in the buffer
+    };
+
+    /**
+     * Read until `size` bytes have been read or the source runs dry.
+     *
+     * Sources may return less than asked for before the end of the data;
+     * passing short blocks to the sink would waste the big buffers.
+     */
+    inline std::size_t read_block(
+        byte_source& source, char* buffer, std::size_t size)
+    {
+        std::size_t total = 0;
+        while (total < size)
+        {
+            std::size_t count = source.read(buffer + total, size - total);
+            if (count == 0)
+                break;
+
+            total += count;
+        }
+
+        return total;
+    }
+}
+
+/**
+ * Copies from a source to a sink, reading and writing at the same time.
+ *
+ * The engine keeps its buffers, and the block size it has learnt, from one
+ * transfer to the next so copying many files with one engine avoids
+ * reallocating and relearning for each.  One transfer at a time.
+ */
+class transfer_engine : private boost::noncopyable
+{
+public:
+
+    /**
+     * Called on the transferring thread with the number of bytes written
+     * so far.  It can throw to abandon the transfer.
+     */
+    typedef boost::function<void (boost::uintmax_t)> progress_callback;
+
+    explicit transfer_engine(
+        const transfer_options& options=transfer_options())
+        :
+        m_options(options), m_block_size(options.initial_block_size),
+        m_end_of_data(false), m_stopping(false), m_writer_finished(false),
+        m_written(0)
+    {
+        if (options.buffer_count < 2)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Transfer needs at least two buffers"));
+
+        if (options.min_block_size == 0 ||
+            options.min_block_size > options.max_block_size ||
+            options.initial_block_size < options.min_block_size ||
+            options.initial_block_size > options.max_block_size)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Inconsistent block sizes"));
+
+        for (std::size_t i = 0; i < options.buffer_count; ++i)
+        {
+            m_buffers.push_back(new detail::block_buffer());
+        }
+    }
+
+    /**
+     * Copy everything from `source` to `sink`.
+     *
+     * The source is read on the calling thread and the sink written on
+     * another.  If either throws, or `progress` does, the transfer stops
+     * and the exception is rethrown here.
+     *
+     * A source that fits in a single block has nothing to overlap, so it is
+     * written on the calling thread without starting another.
+     *
+     * @returns  Number of bytes copied.
+     */
+    boost::uintmax_t transfer(
+        byte_source& source, byte_sink& sink,
+        progress_callback progress=progress_callback())
+    {
+        reset();
+
+        if (read_first_block(source))
+        {
+            detail::block_buffer& only_block = *m_filled.front();
+            if (only_block.size > 0)
+                sink.write(only_block.data(), only_block.size);
+
+            m_written = only_block.size;
+
+            if (progress)
+                progress(m_written);
+
+            return m_written;
+        }
+
+        boost::thread writer(
+            boost::bind(
+                &transfer_engine::write_blocks, this, boost::ref(sink)));
+
+        try
+        {
+            read_blocks(source, progress);
+            wait_for_writer(progress);
+        }
+        catch (...)
+        {
+            stop();
+            writer.join();
+            throw;
+        }
+
+        writer.join();
+
+        if (m_error)
+            boost::rethrow_exception(m_error);
+
+        if (progress)
+            progress(m_written);
+
+        return m_written;
+    }
+
+    /**
+     * Size of the next block, as learnt from previous ones.
+     */
+    std::size_t block_size() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        return m_block_size;
+    }
+
+private:
+
+    void reset()
+    {
+        m_free.clear();
+        m_filled.clear();
+        for (std::size_t i = 0; i < m_buffers.size(); ++i)
+        {
+            m_free.push_back(&m_buffers[i]);
+        }
+
+        m_end_of_data = false;
+        m_stopping = false;
+        m_writer_finished = false;
+        m_written = 0;
+        m_error = boost::exception_ptr();
+    }
+
+    /// @name Reading, on the calling thread
+    // @{
+
+    /**
+     * Read the first block, before there is a writer to hand it to.
+     *
+     * @returns  Whether it holds all the data.
+     */
+    bool read_first_block(byte_source& source)
+    {
+        detail::block_buffer* buffer = m_free.front();
+        m_free.pop_front();
+
+        std::size_t size = block_size();
+        buffer->reserve(size);
+        buffer->size = detail::read_block(source, buffer->data(), size);
+
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        m_filled.push_back(buffer);
+        m_end_of_data = (buffer->size < size);
+
+        return m_end_of_data;
+    }
+
+    void read_blocks(byte_source& source, const progress_callback& progress)
+    {
+        for (;;)
+        {
+            detail::block_buffer* buffer = take_free_buffer(progress);
+            if (!buffer)
+                return; // writer failed
+
+            std::size_t size = block_size();
+            buffer->reserve(size);
+            buffer->size = detail::read_block(source, buffer->data(), size);
+
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            if (buffer->size == 0)
+            {
+                m_free.push_back(buffer);
+            }
+            else
+            {
+                m_filled.push_back(buffer);
+            }
+
+            if (buffer->size < size)
+            {
+                m_end_of_data = true;
+            }
+
+            m_changed.notify_all();
+
+            if (m_end_of_data)
+                return;
+        }
+    }
+
+    /**
+     * Wait for the writer to hand back a buffer, reporting progress
+     * meanwhile.
+     *
+     * @returns  NULL if the transfer has stopped.
+     */
+    detail::block_buffer* take_free_buffer(const progress_callback& progress)
+    {
+        for (;;)
+        {
+            boost::uintmax_t written;
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                if (!m_stopping && m_free.empty())
+                {
+                    m_changed.timed_wait(
+                        lock, boost::posix_time::milliseconds(
+                            detail::PROGRESS_INTERVAL_MILLISECONDS));
+                }
+
+                if (m_stopping)
+                    return NULL;
+
+                if (!m_free.empty())
+                {
+                    detail::block_buffer* buffer = m_free.front();
+                    m_free.pop_front();
+                    written = m_written;
+
+                    lock.unlock();
+
+                    if (progress)
+                        progress(written);
+
+                    return buffer;
+                }
+
+                written = m_written;
+            }
+
+            // Outside the lock as the callback may take a while, or throw
+            if (progress)
+                progress(written);
+        }
+    }
+
+    void wait_for_writer(const progress_callback& progress)
+    {
+        for (;;)
+        {
+            boost::uintmax_t written;
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                if (!m_writer_finished)
+                {
+                    m_changed.timed_wait(
+                        lock, boost::posix_time::milliseconds(
+                            detail::PROGRESS_INTERVAL_MILLISECONDS));
+                }
+
+                if (m_writer_finished)
+                    return;
+
+                written = m_written;
+            }
+
+            if (progress)
+                progress(written);
+        }
+    }
+
+    void stop()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        m_stopping = true;
+        m_changed.notify_all();
+    }
+
+    // @}
+
+    /// @name Writing, on the writer thread
+    // @{
+
+    void write_blocks(byte_sink& sink)
+    {
+        try
+        {
+            for (;;)
+            {
+                detail::block_buffer* buffer = NULL;
+                {
+                    boost::mutex::scoped_lock lock(m_mutex);
+
+                    while (m_filled.empty() && !m_end_of_data && !m_stopping)
+                    {
+                        m_changed.wait(lock);
+                    }
+
+                    if (m_stopping || m_filled.empty())
+                        break;
+
+                    buffer = m_filled.front();
+                    m_filled.pop_front();
+                }
+
+                boost::posix_time::ptime start =
+                    boost::posix_time::microsec_clock::universal_time();
+
+                sink.write(buffer->data(), buffer->size);
+
+                boost::posix_time::time_duration duration =
+                    boost::posix_time::microsec_clock::universal_time() -
+                    start;
+
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                m_written += buffer->size;
+                adapt_block_size(buffer->size, duration);
+
+                m_free.push_back(buffer);
+                m_changed.notify_all();
+            }
+        }
+        catch (...)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            m_error = boost::current_exception();
+            m_stopping = true;
+        }
+
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        m_writer_finished = true;
+        m_changed.notify_all();
+    }
+
+    /**
+     * Size later blocks so each takes about the target time to write.
+     *
+     * Must hold the lock.
+     */
+    void adapt_block_size(
+        std::size_t block, boost::posix_time::time_duration duration)
+    {
+        // Only full blocks say anything about the sink's speed
+        if (block < m_block_size)
+            return;
+
+        if (duration < m_options.target_block_time / 2)
+        {
+            m_block_size = (std::min)(
+                m_block_size * 2, m_options.max_block_size);
+        }
+        else if (duration > m_options.target_block_time * 2)
+        {
+            m_block_size = (std::max)(
+                m_block_size / 2, m_options.min_block_size);
+        }
+    }
+
+    // @}
+
+    const transfer_options m_options;
+    boost::ptr_vector<detail::block_buffer> m_buffers;
+
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_changed;
+
+    std::size_t m_block_size;
+    std::deque<detail::block_buffer*> m_free;
+    std::deque<detail::block_buffer*> m_filled; ///< In the order read
+    bool m_end_of_data;
+    bool m_stopping; ///< Abandoning the transfer
+    bool m_writer_finished;
+    boost::uintmax_t m_written;
+    boost::exception_ptr m_error;
+};
+
+}} // namespace swish::block_transfer
+
+#endif
@@ -0,0 +1,351 @@
+/**
+    @file
+
+    Coalescing frequent updates into a bounded rate of deliveries.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SWISH_COALESCING_HPP
+#define SWISH_COALESCING_HPP
+#pragma once
+
+#include <boost/bind.hpp> // bind
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/function.hpp> // function
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <cstddef> // size_t
+#include <map>
+#include <utility> // pair
+#include <vector>
+
+/**
+ * @namespace swish::coalescing
+ *
+ * Passing on the state of transfers at a rate the user interface can
+ * bear.
+ *
+ * A transfer can report its progress hundreds of times a second, far
+ * faster than anyone can read it, and each report the shell or the progress
+ * dialogue has to handle costs more than moving the bytes it describes.
+ * Here transfers post their latest state as often as they like, paying
+ * only for a brief lock, and a delivery thread passes on the most recent
+ * state of each item, no more often than a fixed interval.
+ */
+
+namespace swish {
+namespace coalescing {
+
+/**
+ * When posted updates are passed on.
+ */
+struct coalescing_options
+{
+    coalescing_options()
+        :
+        interval(boost::posix_time::milliseconds(250)),
+        min_bytes(1024 * 1024),
+        max_delay(boost::posix_time::seconds(1)) {}
+
+    /**
+     * Time between deliveries.
+     *
+     * Caps the rate at which any item's updates are passed on.
+     */
+    boost::posix_time::time_duration interval;
+
+    /**
+     * Progress an item must make before its update is worth passing on.
+     */
+    boost::uintmax_t min_bytes;
+
+    /**
+     * Longest an update waits for its item to make `min_bytes` of progress.
+     *
+     * Slow transfers still appear to move.
+     */
+    boost::posix_time::time_duration max_delay;
+};
+
+/**
+ * Coalesces updates for many items and delivers them on a thread of its
+ * own.
+ *
+ * Only the latest state of each item is kept.  Final updates are always
+ * delivered, at the next delivery, after which the item is forgotten.
+ * Anything still waiting when the coalescer is destroyed is delivered
+ * then.
+ *
+ * @param Key    Identifies an item.  Must be less-than comparable.
+ * @param State  What's delivered about an item.
+ */
+template<typename Key, typename State>
+class update_coalescer : private boost::noncopyable
+{
+public:
+
+    /**
+     * Passes on an item's state.
+     *
+     * Called only on the delivery thread.  Anything it throws is ignored as
+     * failing to tell the user about progress is no reason to stop it.
+     */
+    typedef boost::function<void (const Key&, const State&)> deliverer;
+
+    explicit update_coalescer(
+        deliverer deliver,
+        const coalescing_options& options=coalescing_options())
+        :
+        m_deliver(deliver), m_options(options), m_stopping(false),
+        m_flushes_requested(0), m_flushes_done(0), m_posted(0),
+        m_delivered(0)
+    {
+        m_thread = boost::thread(
+            boost::bind(&update_coalescer::deliver_until_stopped, this));
+    }
+
+    ~update_coalescer()
+    {
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            m_stopping = true;
+            m_changed.notify_all();
+        }
+
+        m_thread.join();
+    }
+
+    /**
+     * Record the latest state of an item.
+     *
+     * Never waits for a delivery.
+     *
+     * @param bytes       How far the item has got.  Decides, along with
+     *                    the time since it was last delivered, whether the
+     *                    update is worth delivering.
+     * @param final_state Whether this is the last update for the item.
+     */
+    void post(
+        const Key& key, const State& state, boost::uintmax_t bytes,
+        bool final_state=false)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        ++m_posted;
+
+        typename item_map::iterator pos = m_items.find(key);
+        if (pos == m_items.end())
+        {
+            pos = m_items.insert(
+                std::make_pair(key, pending_update(state))).first;
+        }
+        else
+        {
+            pos->second.state = state;
+        }
+
+        pending_update& item = pos->second;
+
+        if (!item.waiting)
+        {
+            item.waiting = true;
+            item.waiting_since =
+                boost::posix_time::microsec_clock::universal_time();
+        }
+
+        item.bytes = bytes;
+        item.final_state = item.final_state || final_state;
+    }
+
+    /**
+     * Deliver everything waiting now, and wait until it has been.
+     */
+    void flush()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        unsigned long flush = ++m_flushes_requested;
+        m_changed.notify_all();
+
+        while (m_flushes_done < flush)
+        {
+            m_changed.wait(lock);
+        }
+    }
+
+    /**
+     * Updates posted so far.
+     */
+    unsigned long posted() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        return m_posted;
+    }
+
+    /**
+     * Updates passed on so far.
+     */
+    unsigned long delivered() const
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        return m_delivered;
+    }
+
+private:
+
+    struct pending_update
+    {
+        explicit pending_update(const State& initial_state)
+            :
+            state(initial_state), bytes(0), delivered_bytes(0), waiting(false),
+            final_state(false) {}
+
+        State state;
+        boost::uintmax_t bytes;
+        boost::uintmax_t delivered_bytes;
+        bool waiting; ///< Has an update not yet delivered
+        boost::posix_time::ptime waiting_since;
+        bool final_state;
+    };
+
+    typedef std::map<Key, pending_update> item_map;
+
+    void deliver_until_stopped()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        for (;;)
+        {
+            if (!m_stopping && m_flushes_done == m_flushes_requested)
+            {
+                m_changed.timed_wait(lock, m_options.interval);
+            }
+
+            bool stopping = m_stopping;
+            unsigned long flushes = m_flushes_requested;
+            bool everything = stopping || m_flushes_done < flushes;
+
+            std::vector<std::pair<Key, State> > due;
+            take_due_updates(everything, due);
+
+            // Outside the lock so posting never waits for a delivery
+            lock.unlock();
+
+            for (std::size_t i = 0; i < due.size(); ++i)
+            {
+                try
+                {
+                    m_deliver(due[i].first, due[i].second);
+                }
+                catch (...) {}
+            }
+
+            lock.lock();
+
+            m_delivered += static_cast<unsigned long>(due.size());
+
+            if (m_flushes_done < flushes)
+            {
+                m_flushes_done = flushes;
+                m_changed.notify_all();
+            }
+
+            if (stopping)
+                break;
+        }
+    }
+
+    /**
+     * Take the updates due for delivery.
+     *
+     * Must hold the lock.
+     */
+    void take_due_updates(
+        bool everything, std::vector<std::pair<Key, State> >& due)
+    {
+        boost::posix_time::ptime now =
+            boost::posix_time::microsec_clock::universal_time();
+
+        typename item_map::iterator it = m_items.begin();
+        while (it != m_items.end())
+        {
+            pending_update& item = it->second;
+
+            bool is_due = item.waiting && (
+                everything || item.final_state ||
+                item.bytes - item.delivered_bytes >= m_options.min_bytes ||
+                now - item.waiting_since >= m_options.max_delay);
+
+            if (is_due)
+            {
+                due.push_back(std::make_pair(it->first, item.state));
+                item.delivered_bytes = item.bytes;
+                item.waiting = false;
+            }
+
+            if (is_due && item.final_state)
+            {
+                m_items.erase(it++);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    const deliverer m_deliver;
+    const coalescing_options m_options;
+
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_changed;
+
+    item_map m_items;
+    bool m_stopping;
+    unsigned long m_flushes_requested;
+    unsigned long m_flushes_done;
+    unsigned long m_posted;
+    unsigned long m_delivered;
+
+    boost::thread m_thread;
+};
+
+}} // namespace swish::coalescing
+
+#endif
@@ -36,9 +36,10 @@
 
 #include "authenticated_session.hpp"
 
+#include "swish/connection/authentication_memo.hpp"
 #include "swish/utils.hpp" // WideStringToUtf8String
 
-#include <ssh/knownhost.hpp> // openssh_knownhost_collection
+#include <ssh/indexed_knownhost.hpp> // indexed_knownhost_cache
 #include <ssh/session.hpp>
 #include <ssh/filesystem.hpp> // sftp_filesystem
 
@@ -47,6 +48,7 @@
 #include <comet/bstr.h> // bstr_t
 #include <comet/error.h> // com_error
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp> // wpath
 #include <boost/filesystem/fstream.hpp> // ofstream
 #include <boost/foreach.hpp> // BOOST_FOREACH
@@ -58,6 +60,7 @@
 
 #include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
 
+#include <algorithm> // find, stable_partition
 #include <cassert>
 #include <exception>
 #include <stdexcept> // logic_error
@@ -68,14 +71,16 @@
 #include <libssh2_sftp.h>
 
 using swish::connection::authenticated_session;
+using swish::connection::authentication_memo;
+using swish::connection::remembered_authentication;
 using swish::connection::running_session;
 using swish::utils::WideStringToUtf8String;
 using swish::utils::home_directory;
 
 using ssh::hexify;
 using ssh::host_key;
-using ssh::knownhost_search_result;
-using ssh::openssh_knownhost_collection;
+using ssh::indexed_knownhost_cache;
+using ssh::indexed_knownhost_search_result;
 using ssh::session;
 using ssh::filesystem::sftp_filesystem;
 
@@ -83,6 +88,8 @@ using comet::bstr_t;
 using comet::com_error;
 using comet::com_ptr;
 
+using boost::bind;
+using boost::cref;
 using boost::filesystem::path;
 using boost::filesystem::wpath;
 using boost::filesystem::ofstream;
@@ -90,12 +97,15 @@ using boost::function;
 using boost::move;
 using boost::mutex;
 using boost::optional;
+using boost::ref;
 namespace errc = boost::system::errc;
 using boost::system::system_error;
 
 using std::exception;
 using std::logic_error;
+using std::make_pair;
 using std::pair;
+using std::stable_partition;
 using std::string;
 using std::vector;
 using std::wstring;
@@ -109,6 +119,12 @@ namespace {
 const wpath known_hosts_path =
     home_directory<wpath>() / L".ssh" / L"known_hosts";
 
+/**
+ * Parsed known_hosts, kept for the life of the process so that connecting
+ * only reads the file again once something else has changed it.
+ */
+indexed_knownhost_cache<wpath> known_hosts;
+
 void verify_host_key(
     const wstring& host, running_session& session,
     com_ptr<ISftpConsumer> consumer)
@@ -133,17 +149,18 @@ void verify_host_key(
     create_directories(known_hosts_path.parent_path());
     ofstream(known_hosts_path, std::ios::app);
 
-    openssh_knownhost_collection hosts(known_hosts_path);
-
-    knownhost_search_result result = hosts.find(utf8_host, key);
+    // Indexed rather than libssh2's collection so that connecting stays
+    // quick even with a very large known_hosts file, and cached so that it
+    // isn't parsed, nor the host hashed for each salt, on every connection.
+    indexed_knownhost_search_result result =
+        known_hosts.find(known_hosts_path, utf8_host, key);
     if (result.mismatch())
     {
         HRESULT hr = consumer->OnHostkeyMismatch(
             bstr_t(host).in(), hostkey_hash.in(), hostkey_algorithm.in());
         if (hr == S_OK)
         {
-            update(hosts, utf8_host, key, result); // update known_hosts
-            hosts.save(known_hosts_path);
+            known_hosts.update(known_hosts_path, utf8_host, key);
         }
         else if (hr == S_FALSE)
             return; // continue but don't add
@@ -157,8 +174,7 @@ void verify_host_key(
             bstr_t(host).in(), hostkey_hash.in(), hostkey_algorithm.in());
         if (hr == S_OK)
         {
-            add(hosts, utf8_host, key); // add to known_hosts
-            hosts.save(known_hosts_path);
+            known_hosts.add(known_hosts_path, utf8_host, key);
         }
         else if (hr == S_FALSE)
             return; // continue but don't add
@@ -354,18 +370,59 @@ BOOST_SCOPED_ENUM(authentication_result) public_key_file_based_authentication(
     }
 }
 
+/**
+ * Authenticates using the identities held by any running agent.
+ *
+ * @param remembered_identity
+ *     Public key of the identity that worked last time, if any.  It is tried
+ *     before the others so that, if it still works, authentication takes
+ *     a single attempt however many identities the agent holds.
+ * @param successful_identity
+ *     Receives the public key of the identity that authenticated the session.
+ */
 BOOST_SCOPED_ENUM(authentication_result) public_key_agent_authentication(
     const string& utf8_username, running_session& session,
-    com_ptr<ISftpConsumer> consumer)
+    com_ptr<ISftpConsumer> /*consumer*/,
+    const optional<string>& remembered_identity, string& successful_identity)
 {
     try
     {
-        BOOST_FOREACH(
-            ssh::identity key, session.get_session().agent_identities())
+        ssh::agent_identities identities =
+            session.get_session().agent_identities();
+
+        if (remembered_identity)
+        {
+            BOOST_FOREACH(ssh::identity key, identities)
+            {
+                if (key.public_key() == *remembered_identity)
+                {
+                    try
+                    {
+                        key.authenticate(utf8_username);
+                        successful_identity = key.public_key();
+                        return authentication_result::authenticated;
+                    }
+                    catch (const exception&)
+                    { /* Not accepted any more.  Search the rest. */ }
+
+                    break;
+                }
+            }
+        }
+
+        BOOST_FOREACH(ssh::identity key, identities)
         {
+            if (remembered_identity && key.public_key() == *remembered_identity)
+            {
+                // Already tried above.  Don't waste one of the server's
+                // limited authentication attempts on it again.
+                continue;
+            }
+
             try
             {
                 key.authenticate(utf8_username);
+                successful_identity = key.public_key();
                 return authentication_result::authenticated;
             }
             catch (const exception&)
@@ -379,6 +436,12 @@ BOOST_SCOPED_ENUM(authentication_result) public_key_agent_authentication(
     return authentication_result::try_remaining_methods;
 }
 
+// Names under which methods are stored in the authentication memo
+const string public_key_file_method_name = "publickey-file";
+const string public_key_agent_method_name = "publickey-agent";
+const string keyboard_interactive_method_name = "keyboard-interactive";
+const string password_method_name = "password";
+
 /**
  * Tries to authenticate the user with the remote server.
  *
@@ -386,13 +449,17 @@ BOOST_SCOPED_ENUM(authentication_result) public_key_agent_authentication(
  * and these are tried one at time until one succeeds in the order:
  * public-key, keyboard-interactive, plain password.
  *
+ * If the authentication memo records a method (and, for agents, an
+ * identity) that succeeded with this host before, that is tried first.
+ * The rest are only tried if it no longer works.
+ *
  * @throws com_error if authentication fails:
  * - E_ABORT if user cancelled the operation (via ISftpConsumer)
  * - E_FAIL otherwise
  */
 void authenticate_user(
-    const wstring& user, running_session& session,
-    com_ptr<ISftpConsumer> consumer)
+    const wstring& host, unsigned int port, const wstring& user,
+    running_session& session, com_ptr<ISftpConsumer> consumer)
 {
     assert(!user.empty());
     assert(user[0] != '\0');
@@ -414,12 +481,29 @@ void authenticate_user(
             std::exception("No supported authentication methods found"));
     }
 
+    authentication_memo memo;
+    optional<remembered_authentication> remembered;
+    try
+    {
+        remembered = memo.recall(host, port, user);
+    }
+    catch (const exception&)
+    { /* The memo is only a hint.  Carry on without it. */ }
+
+    optional<string> remembered_identity;
+    if (remembered && remembered->method() == public_key_agent_method_name)
+    {
+        remembered_identity = remembered->identity();
+    }
+
+    string successful_identity;
+
     typedef function<
         BOOST_SCOPED_ENUM(authentication_result)(
             const string&, running_session&, com_ptr<ISftpConsumer>)>
         method;
 
-    vector<method> authentication_methods;
+    vector<pair<string, method>> authentication_methods;
 
     // The order of adding the methods is important; some are preferred over
     // others.  Added in descending order of preference.
@@ -428,28 +512,69 @@ void authenticate_user(
         // This old way is only kept around to support the tests.  Its almost
         // useless for anything else as we don't pass the 'consumer' enough
         // information to identify which key to use.
-        authentication_methods.push_back(public_key_file_based_authentication);
+        authentication_methods.push_back(
+            make_pair(
+                public_key_file_method_name,
+                method(public_key_file_based_authentication)));
 
         // And now the nice new way using agents.
-        authentication_methods.push_back(public_key_agent_authentication);
+        authentication_methods.push_back(
+            make_pair(
+                public_key_agent_method_name,
+                method(
+                    bind(
+                        public_key_agent_authentication, _1, _2, _3,
+                        cref(remembered_identity), ref(successful_identity)))));
     }
 
     if (find(method_names.begin(), method_names.end(), "keyboard-interactive")
         != method_names.end())
     {
-        authentication_methods.push_back(keyboard_interactive_authentication);
+        authentication_methods.push_back(
+            make_pair(
+                keyboard_interactive_method_name,
+                method(keyboard_interactive_authentication)));
     }
 
     if (find(method_names.begin(), method_names.end(), "password") != method_names.end())
     {
-        authentication_methods.push_back(password_authentication);
+        authentication_methods.push_back(
+            make_pair(password_method_name, method(password_authentication)));
+    }
+
+    if (remembered)
+    {
+        // Promote the remembered method to the front, leaving the relative
+        // order of the others alone
+        stable_partition(
+            authentication_methods.begin(), authentication_methods.end(),
+            bind(&pair<string, method>::first, _1) == remembered->method());
     }
 
-    BOOST_FOREACH(method& auth_attempt, authentication_methods)
+    typedef pair<string, method> named_method;
+    BOOST_FOREACH(named_method& auth_attempt, authentication_methods)
     {
-        switch (auth_attempt(utf8_username, session, consumer))
+        switch (auth_attempt.second(utf8_username, session, consumer))
         {
         case authentication_result::authenticated:
+            try
+            {
+                if (auth_attempt.first == public_key_agent_method_name)
+                {
+                    memo.remember(
+                        host, port, user,
+                        remembered_authentication(
+                            auth_attempt.first, successful_identity));
+                }
+                else
+                {
+                    memo.remember(
+                        host, port, user,
+                        remembered_authentication(auth_attempt.first));
+                }
+            }
+            catch (const exception&)
+            { /* Failing to remember only costs speed next time */ }
             return;
 
         case authentication_result::aborted:
@@ -465,6 +590,16 @@ void authenticate_user(
         }
     }
 
+    try
+    {
+        // Nothing worked, including anything remembered, so don't lead the
+        // next attempt astray
+        if (remembered)
+            memo.forget(host, port, user);
+    }
+    catch (const exception&)
+    {}
+
     BOOST_THROW_EXCEPTION(
         com_error("No authentication method succeeded", E_FAIL));
 }
@@ -478,7 +613,7 @@ running_session create_and_authenticate(
     verify_host_key(host, session, consumer);
     // Legal to fail here, e.g. user refused to accept host key
 
-    authenticate_user(user, session, consumer);
+    authenticate_user(host, port, user, session, consumer);
     // Legal to fail here, e.g. wrong password/key
 
     assert(session.get_session().authenticated());
@@ -0,0 +1,246 @@
+/**
+    @file
+
+    Memory of how we last authenticated to each host.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "authentication_memo.hpp"
+
+#include "swish/utils.hpp" // WideStringToUtf8String
+
+#include <ssh/host_key.hpp> // hexify
+
+#include <winapi/shell/shell.hpp> // special_folder_path
+
+#include <boost/filesystem.hpp> // create_directories, exists
+#include <boost/filesystem/fstream.hpp> // ifstream, ofstream
+#include <boost/foreach.hpp> // BOOST_FOREACH
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+#include <sstream> // istringstream
+#include <string>
+#include <utility> // pair
+
+using swish::utils::WideStringToUtf8String;
+
+using ssh::hexify;
+
+using winapi::shell::special_folder_path;
+
+using boost::filesystem::ifstream;
+using boost::filesystem::ofstream;
+using boost::filesystem::wpath;
+using boost::lexical_cast;
+using boost::mutex;
+using boost::optional;
+
+using std::getline;
+using std::istringstream;
+using std::map;
+using std::pair;
+using std::string;
+using std::wstring;
+
+namespace swish {
+namespace connection {
+
+namespace {
+
+    typedef map<string, remembered_authentication> memo_mapping;
+
+    // Shared by all memos as they may well be using the same file
+    mutex memo_file_guard;
+
+    wpath default_memo_file()
+    {
+        return special_folder_path<wchar_t>(CSIDL_APPDATA) /
+            L"Swish" / L"authentication_memo";
+    }
+
+    /**
+     * Key identifying the memo of a user on a host.
+     *
+     * Kept as human-readable as possible because the memo is a plain file
+     * the user may look at (and delete).
+     */
+    string memo_key(
+        const wstring& host, unsigned int port, const wstring& user)
+    {
+        return WideStringToUtf8String(user) + "@" +
+            WideStringToUtf8String(host) + ":" + lexical_cast<string>(port);
+    }
+
+    int hex_digit_value(char digit)
+    {
+        if (digit >= '0' && digit <= '9')
+            return digit - '0';
+        else if (digit >= 'a' && digit <= 'f')
+            return digit - 'a' + 10;
+        else if (digit >= 'A' && digit <= 'F')
+            return digit - 'A' + 10;
+        else
+            return -1;
+    }
+
+    /**
+     * Reverse of `hexify` with no separator.
+     *
+     * Returns nothing if the string is not valid hex, which we treat the
+     * same as a missing memo.
+     */
+    optional<string> unhexify(const string& hex)
+    {
+        if (hex.size() % 2 != 0)
+            return optional<string>();
+
+        string bytes;
+        bytes.reserve(hex.size() / 2);
+
+        for (string::size_type i = 0; i < hex.size(); i += 2)
+        {
+            int high = hex_digit_value(hex[i]);
+            int low = hex_digit_value(hex[i + 1]);
+            if (high < 0 || low < 0)
+                return optional<string>();
+
+            bytes.push_back(static_cast<char>((high << 4) | low));
+        }
+
+        return bytes;
+    }
+
+    /**
+     * Read all memos from the file.
+     *
+     * Lines are tab-separated: key, method, hex-encoded identity.  Lines we
+     * don't understand are skipped.
+     */
+    memo_mapping load_memos(const wpath& memo_file)
+    {
+        memo_mapping memos;
+
+        ifstream file(memo_file);
+        string line;
+        while (getline(file, line))
+        {
+            istringstream fields(line);
+            string key, method, hex_identity;
+
+            if (!getline(fields, key, '\t') || !getline(fields, method, '\t'))
+                continue;
+            getline(fields, hex_identity, '\t');
+
+            optional<string> identity = unhexify(hex_identity);
+            if (key.empty() || method.empty() || !identity)
+                continue;
+
+            memos.insert(
+                memo_mapping::value_type(
+                    key, remembered_authentication(method, *identity)));
+        }
+
+        return memos;
+    }
+
+    void save_memos(const wpath& memo_file, const memo_mapping& memos)
+    {
+        if (!memo_file.parent_path().empty())
+            create_directories(memo_file.parent_path());
+
+        ofstream file(memo_file, std::ios::out | std::ios::trunc);
+
+        BOOST_FOREACH(const memo_mapping::value_type& memo, memos)
+        {
+            file << memo.first << '\t' << memo.second.method() << '\t'
+                << hexify(memo.second.identity(), "") << '\n';
+        }
+    }
+}
+
+authentication_memo::authentication_memo()
+: m_memo_file(default_memo_file()) {}
+
+authentication_memo::authentication_memo(const wpath& memo_file)
+: m_memo_file(memo_file) {}
+
+optional<remembered_authentication> authentication_memo::recall(
+    const wstring& host, unsigned int port, const wstring& user) const
+{
+    mutex::scoped_lock lock(memo_file_guard);
+
+    memo_mapping memos = load_memos(m_memo_file);
+
+    memo_mapping::const_iterator memo =
+        memos.find(memo_key(host, port, user));
+    if (memo != memos.end())
+    {
+        return memo->second;
+    }
+    else
+    {
+        return optional<remembered_authentication>();
+    }
+}
+
+void authentication_memo::remember(
+    const wstring& host, unsigned int port, const wstring& user,
+    const remembered_authentication& authentication)
+{
+    mutex::scoped_lock lock(memo_file_guard);
+
+    memo_mapping memos = load_memos(m_memo_file);
+
+    string key = memo_key(host, port, user);
+    memo_mapping::iterator memo = memos.find(key);
+    if (memo != memos.end())
+    {
+        if (memo->second == authentication)
+        {
+            // Usual case: nothing changed since last time so spare the disk
+            return;
+        }
+
+        memos.erase(memo);
+    }
+
+    memos.insert(memo_mapping::value_type(key, authentication));
+
+    save_memos(m_memo_file, memos);
+}
+
+void authentication_memo::forget(
+    const wstring& host, unsigned int port, const wstring& user)
+{
+    mutex::scoped_lock lock(memo_file_guard);
+
+    memo_mapping memos = load_memos(m_memo_file);
+
+    if (memos.erase(memo_key(host, port, user)) > 0)
+    {
+        save_memos(m_memo_file, memos);
+    }
+}
+
+}} // namespace swish::connection
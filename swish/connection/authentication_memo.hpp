@@ -0,0 +1,134 @@
+/**
+    @file
+
+    Memory of how we last authenticated to each host.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#ifndef SWISH_CONNECTION_AUTHENTICATION_MEMO_HPP
+#define SWISH_CONNECTION_AUTHENTICATION_MEMO_HPP
+#pragma once
+
+#include <boost/filesystem/path.hpp> // wpath
+#include <boost/optional/optional.hpp>
+
+#include <string>
+
+namespace swish {
+namespace connection {
+
+/**
+ * Record of the authentication that last succeeded with a host.
+ */
+class remembered_authentication
+{
+public:
+
+    /**
+     * @param method
+     *     Name of the authentication method that succeeded, e.g.
+     *     `"publickey-agent"` or `"password"`.
+     * @param identity
+     *     Method-specific identity that succeeded.  For agent authentication
+     *     this is the public-key blob of the identity the server accepted.
+     *     Empty if the method has no notion of identity.
+     */
+    remembered_authentication(
+        const std::string& method, const std::string& identity=std::string())
+        : m_method(method), m_identity(identity) {}
+
+    const std::string& method() const { return m_method; }
+    const std::string& identity() const { return m_identity; }
+
+    bool operator==(const remembered_authentication& other) const
+    {
+        return m_method == other.m_method && m_identity == other.m_identity;
+    }
+
+private:
+    std::string m_method;
+    std::string m_identity;
+};
+
+/**
+ * Persistent per-host memo of the authentication that last succeeded.
+ *
+ * Authentication tries each method (and each agent identity) in turn until
+ * one succeeds.  Every rejected attempt costs a round trip and servers that
+ * limit authentication attempts may disconnect us before we reach the
+ * identity that works.  Trying whatever worked last time first avoids both.
+ *
+ * The memo is stored as a small text file, one host per line.  It is only a
+ * hint; a missing, unreadable or corrupt memo just means we search the
+ * methods in the default order.
+ *
+ * All instances share a process-wide lock so concurrent connections don't
+ * interleave their updates.
+ */
+class authentication_memo
+{
+public:
+
+    /**
+     * Memo stored in the default location in the user's application data.
+     */
+    authentication_memo();
+
+    /**
+     * Memo stored in the given file.
+     */
+    explicit authentication_memo(const boost::filesystem::wpath& memo_file);
+
+    /**
+     * The authentication that last succeeded for the user on the host, if
+     * any.
+     */
+    boost::optional<remembered_authentication> recall(
+        const std::wstring& host, unsigned int port,
+        const std::wstring& user) const;
+
+    /**
+     * Remember that authentication succeeded for the user on the host.
+     *
+     * Replaces any previous memo for the same host, port and user.
+     */
+    void remember(
+        const std::wstring& host, unsigned int port, const std::wstring& user,
+        const remembered_authentication& authentication);
+
+    /**
+     * Stop remembering the authentication for the user on the host.
+     *
+     * Used when the remembered authentication no longer works, so we don't
+     * waste the first attempt on it next time as well.
+     */
+    void forget(
+        const std::wstring& host, unsigned int port,
+        const std::wstring& user);
+
+private:
+    boost::filesystem::wpath m_memo_file;
+};
+
+}} // namespace swish::connection
+
+#endif
@@ -0,0 +1,134 @@
+/**
+    @file
+
+    Per-process bandwidth limits for connections.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "bandwidth_limits.hpp"
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp> // call_once
+
+#include <map>
+#include <memory> // auto_ptr
+#include <utility> // make_pair
+
+using ssh::bandwidth_limiter;
+using ssh::bandwidth_schedule;
+
+using boost::call_once;
+using boost::make_shared;
+using boost::mutex;
+using boost::once_flag;
+using boost::shared_ptr;
+
+using std::auto_ptr;
+using std::map;
+
+namespace swish {
+namespace connection {
+
+namespace {
+
+/**
+ * Hides the implementation details from the bandwidth_limits.hpp file.
+ */
+class bandwidth_limits_impl
+{
+    typedef map< connection_spec, shared_ptr<bandwidth_limiter> >
+        limiter_mapping;
+
+public:
+
+    static bandwidth_limits_impl& get()
+    {
+        call_once(m_initialise_once, do_init);
+        return *m_instance;
+    }
+
+    shared_ptr<bandwidth_limiter> global_limiter()
+    {
+        return m_global;
+    }
+
+    shared_ptr<bandwidth_limiter> limiter_for(
+        const connection_spec& specification)
+    {
+        mutex::scoped_lock lock(m_limiters_guard);
+
+        limiter_mapping::iterator limiter = m_limiters.find(specification);
+        if (limiter == m_limiters.end())
+        {
+            limiter = m_limiters.insert(
+                std::make_pair(
+                    specification,
+                    make_shared<bandwidth_limiter>(
+                        bandwidth_schedule(), m_global))).first;
+        }
+
+        return limiter->second;
+    }
+
+private:
+
+    bandwidth_limits_impl() : m_global(make_shared<bandwidth_limiter>()) {}
+
+    static void do_init()
+    {
+        m_instance.reset(new bandwidth_limits_impl);
+    }
+
+    static once_flag m_initialise_once;
+    static auto_ptr<bandwidth_limits_impl> m_instance;
+
+    shared_ptr<bandwidth_limiter> m_global;
+
+    mutex m_limiters_guard;
+    limiter_mapping m_limiters;
+};
+
+once_flag bandwidth_limits_impl::m_initialise_once;
+auto_ptr<bandwidth_limits_impl> bandwidth_limits_impl::m_instance;
+
+}
+
+void bandwidth_limits::limit_globally(const bandwidth_schedule& schedule)
+{
+    bandwidth_limits_impl::get().global_limiter()->set_schedule(schedule);
+}
+
+void bandwidth_limits::limit_connection(
+    const connection_spec& specification, const bandwidth_schedule& schedule)
+{
+    bandwidth_limits_impl::get().limiter_for(specification)->set_schedule(
+        schedule);
+}
+
+shared_ptr<bandwidth_limiter> bandwidth_limits::limiter_for(
+    const connection_spec& specification)
+{
+    return bandwidth_limits_impl::get().limiter_for(specification);
+}
+
+}} // namespace swish::connection
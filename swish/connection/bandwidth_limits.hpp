@@ -0,0 +1,78 @@
+/**
+    @file
+
+    Per-process bandwidth limits for connections.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#ifndef SWISH_CONNECTION_BANDWIDTH_LIMITS_HPP
+#define SWISH_CONNECTION_BANDWIDTH_LIMITS_HPP
+#pragma once
+
+#include "swish/connection/connection_spec.hpp"
+
+#include <ssh/bandwidth.hpp> // bandwidth_limiter, bandwidth_schedule
+
+#include <boost/shared_ptr.hpp>
+
+namespace swish {
+namespace connection {
+
+/**
+ * Per-process bandwidth limits, one for each connection specification and
+ * one for all connections together.
+ *
+ * All instances of this class share the same limits.  Limits start
+ * unlimited and can be changed at any time; running transfers pick up the
+ * change from their next block.  `connection_spec::create_session` sets
+ * them from the registry settings in bandwidth_settings.hpp.
+ */
+class bandwidth_limits
+{
+public:
+
+    /**
+     * Hold all connections together to the schedule.
+     */
+    void limit_globally(const ssh::bandwidth_schedule& schedule);
+
+    /**
+     * Hold connections made with the given specification to the schedule,
+     * as well as to the global limit.
+     */
+    void limit_connection(
+        const connection_spec& specification,
+        const ssh::bandwidth_schedule& schedule);
+
+    /**
+     * Limiter to give sessions made with the given specification.
+     *
+     * Every session made with the same specification gets the same limiter,
+     * so they share its rate.
+     */
+    boost::shared_ptr<ssh::bandwidth_limiter> limiter_for(
+        const connection_spec& specification);
+};
+
+}} // namespace swish::connection
+
+#endif
@@ -0,0 +1,200 @@
+/**
+    @file
+
+    Bandwidth limits stored in the registry.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "bandwidth_settings.hpp"
+
+#include "swish/atl.hpp"
+#include "swish/debug.hpp" // TRACE
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // hours, minutes
+
+#include <cwchar> // swscanf, wcslen
+#include <stdexcept> // invalid_argument
+#include <string>
+#include <vector>
+
+using ssh::bandwidth_schedule;
+
+using ATL::CRegKey;
+
+using boost::posix_time::hours;
+using boost::posix_time::minutes;
+
+using std::invalid_argument;
+using std::swscanf;
+using std::vector;
+using std::wcslen;
+using std::wstring;
+
+namespace swish {
+namespace connection {
+
+namespace {
+
+    const wchar_t* SWISH_REGISTRY_KEY_NAME = L"Software\\Swish";
+    const wstring CONNECTIONS_REGISTRY_KEY_NAME =
+        L"Software\\Swish\\Connections";
+    const wchar_t* HOST_VALUE_NAME = L"Host";
+    const wchar_t* PORT_VALUE_NAME = L"Port";
+    const wchar_t* USER_VALUE_NAME = L"User";
+    const wchar_t* LIMIT_VALUE_NAME = L"BandwidthLimit";
+    const wchar_t* SCHEDULE_VALUE_NAME = L"BandwidthSchedule";
+
+    const ULONG MAX_REGISTRY_LEN = 2048;
+
+    /**
+     * Add a period written `HH:MM-HH:MM rate` to the schedule.
+     *
+     * Periods that can't be read are left out rather than failing the
+     * connection over a typo in a setting.
+     */
+    void add_period(bandwidth_schedule& schedule, const wchar_t* period)
+    {
+        unsigned int start_hour, start_minute, end_hour, end_minute;
+        unsigned long rate;
+        if (swscanf(
+                period, L"%u:%u-%u:%u %lu", &start_hour, &start_minute,
+                &end_hour, &end_minute, &rate) != 5)
+        {
+            TRACE("Unreadable bandwidth period: %ls", period);
+            return;
+        }
+
+        try
+        {
+            schedule.between(
+                hours(start_hour) + minutes(start_minute),
+                hours(end_hour) + minutes(end_minute), rate);
+        }
+        catch (const invalid_argument&)
+        {
+            TRACE("Invalid bandwidth period: %ls", period);
+        }
+    }
+
+    /**
+     * Schedule described by the bandwidth values of an open key.
+     */
+    bandwidth_schedule schedule_from_key(CRegKey& registry)
+    {
+        DWORD rate;
+        if (registry.QueryDWORDValue(LIMIT_VALUE_NAME, rate) != ERROR_SUCCESS)
+        {
+            rate = 0; // Unlimited
+        }
+
+        bandwidth_schedule schedule(rate);
+
+        vector<wchar_t> periods(MAX_REGISTRY_LEN);
+        ULONG cch = MAX_REGISTRY_LEN;
+        if (registry.QueryMultiStringValue(
+                SCHEDULE_VALUE_NAME, &periods[0], &cch) == ERROR_SUCCESS)
+        {
+            // NUL-separated strings ending with an empty one
+            periods.back() = L'\0';
+            for (const wchar_t* period = &periods[0];
+                period < &periods.back() && *period != L'\0';
+                period += wcslen(period) + 1)
+            {
+                add_period(schedule, period);
+            }
+        }
+
+        return schedule;
+    }
+
+    bool query_string(CRegKey& registry, const wchar_t* name, wstring& value)
+    {
+        vector<wchar_t> buffer(MAX_REGISTRY_LEN);
+        ULONG cch = MAX_REGISTRY_LEN;
+        if (registry.QueryStringValue(name, &buffer[0], &cch) != ERROR_SUCCESS)
+            return false;
+
+        buffer.back() = L'\0';
+        value = &buffer[0];
+        return true;
+    }
+
+    bool connection_matches(
+        CRegKey& registry, const connection_spec& specification)
+    {
+        wstring host;
+        wstring user;
+        DWORD port;
+
+        return query_string(registry, HOST_VALUE_NAME, host) &&
+            query_string(registry, USER_VALUE_NAME, user) &&
+            registry.QueryDWORDValue(PORT_VALUE_NAME, port) == ERROR_SUCCESS &&
+            host == specification.host() && user == specification.user() &&
+            static_cast<int>(port) == specification.port();
+    }
+}
+
+bandwidth_schedule global_bandwidth_setting()
+{
+    CRegKey registry;
+    if (registry.Open(HKEY_CURRENT_USER, SWISH_REGISTRY_KEY_NAME, KEY_READ)
+        != ERROR_SUCCESS)
+    {
+        return bandwidth_schedule();
+    }
+
+    return schedule_from_key(registry);
+}
+
+bandwidth_schedule connection_bandwidth_setting(
+    const connection_spec& specification)
+{
+    CRegKey connections;
+    if (connections.Open(
+            HKEY_CURRENT_USER, CONNECTIONS_REGISTRY_KEY_NAME.c_str(),
+            KEY_READ) != ERROR_SUCCESS)
+    {
+        return bandwidth_schedule();
+    }
+
+    for (DWORD index = 0; ; ++index)
+    {
+        wchar_t label[MAX_REGISTRY_LEN];
+        DWORD cch_label = MAX_REGISTRY_LEN;
+        LSTATUS rc = connections.EnumKey(index, label, &cch_label);
+        if (rc == ERROR_NO_MORE_ITEMS)
+            break;
+        if (rc != ERROR_SUCCESS)
+            continue; // Skip corrupt entries, as LoadConnectionsFromRegistry
+
+        CRegKey connection;
+        if (connection.Open(connections, label, KEY_READ) == ERROR_SUCCESS &&
+            connection_matches(connection, specification))
+        {
+            return schedule_from_key(connection);
+        }
+    }
+
+    return bandwidth_schedule();
+}
+
+}} // namespace swish::connection
@@ -0,0 +1,60 @@
+/**
+    @file
+
+    Bandwidth limits stored in the registry.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#ifndef SWISH_CONNECTION_BANDWIDTH_SETTINGS_HPP
+#define SWISH_CONNECTION_BANDWIDTH_SETTINGS_HPP
+#pragma once
+
+#include "swish/connection/connection_spec.hpp"
+
+#include <ssh/bandwidth.hpp> // bandwidth_schedule
+
+namespace swish {
+namespace connection {
+
+/**
+ * Schedule for all connections together, from `HKCU\Software\Swish`.
+ *
+ * The key may hold a `BandwidthLimit` DWORD, the rate in bytes per second,
+ * and a `BandwidthSchedule` multi-string of periods at a different rate,
+ * each written `HH:MM-HH:MM rate`.  Missing values, and periods that can't
+ * be read, leave the rate unlimited.
+ */
+ssh::bandwidth_schedule global_bandwidth_setting();
+
+/**
+ * Schedule for connections made with the given specification.
+ *
+ * Read, as for `global_bandwidth_setting`, from the key under
+ * `HKCU\Software\Swish\Connections` of the stored connection whose host,
+ * user and port match.  Unlimited if no stored connection matches.
+ */
+ssh::bandwidth_schedule connection_bandwidth_setting(
+    const connection_spec& specification);
+
+}} // namespace swish::connection
+
+#endif
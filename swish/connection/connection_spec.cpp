@@ -27,7 +27,12 @@
 #include "connection_spec.hpp"
 
 #include "swish/connection/authenticated_session.hpp"
+#include "swish/connection/bandwidth_limits.hpp"
+#include "swish/connection/bandwidth_settings.hpp"
 
+#include <ssh/session.hpp>
+
+#include <boost/move/move.hpp> // move
 #include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
 #include <boost/tuple/tuple.hpp> // tie
 #include <boost/tuple/tuple_comparison.hpp> // <
@@ -36,6 +41,7 @@
 
 using comet::com_ptr;
 
+using boost::move;
 using boost::tie;
 
 using std::invalid_argument;
@@ -58,7 +64,18 @@ connection_spec::connection_spec(
 authenticated_session connection_spec::create_session(
     com_ptr<ISftpConsumer> consumer) const
 {
-    return authenticated_session(m_host, m_port, m_user, consumer);
+    authenticated_session session(m_host, m_port, m_user, consumer);
+
+    // Re-read the settings for each session so changes apply without
+    // restarting.  Sessions already running pick them up too, as they share
+    // the limiters.
+    bandwidth_limits limits;
+    limits.limit_globally(global_bandwidth_setting());
+    limits.limit_connection(*this, connection_bandwidth_setting(*this));
+
+    session.get_session().limit_bandwidth(limits.limiter_for(*this));
+
+    return move(session);
 }
 
 bool connection_spec::operator<(const connection_spec& other) const
@@ -69,4 +86,19 @@ bool connection_spec::operator<(const connection_spec& other) const
         tie(other.m_host, other.m_user, other.m_port);
 }
 
+const wstring& connection_spec::host() const
+{
+    return m_host;
+}
+
+const wstring& connection_spec::user() const
+{
+    return m_user;
+}
+
+int connection_spec::port() const
+{
+    return m_port;
+}
+
 }} // namespace swish::connection
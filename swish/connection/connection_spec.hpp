@@ -69,6 +69,10 @@ public:
 
     bool operator<(const connection_spec& other) const;
 
+    const std::wstring& host() const;
+    const std::wstring& user() const;
+    int port() const;
+
 private:
     std::wstring m_host;
     std::wstring m_user;
@@ -27,171 +27,335 @@
 #include "session_manager.hpp"
 
 #include "swish/connection/session_pool.hpp"
+#include "swish/module_lock.hpp"
 
 #include <boost/bind.hpp>
-#include <boost/date_time/posix_time/posix_time_duration.hpp> // seconds
-#include <boost/function.hpp>
-#include <boost/range/adaptor/transformed.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/foreach.hpp> // BOOST_FOREACH
+#include <boost/intrusive/list.hpp>
+#include <boost/ptr_container/ptr_map.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/once.hpp> // call_once
-#include <boost/uuid/random_generator.hpp>
+#include <boost/thread/thread.hpp>
 
+#include <algorithm> // sort, min
+#include <exception>
 #include <map>
 #include <memory> // auto_ptr
-#include <list>
+#include <utility> // pair
 #include <vector>
 
 using comet::com_ptr;
 
-using boost::adaptors::transformed;
+using swish::module_lock;
+
+using boost::adopt_lock;
 using boost::bind;
 using boost::call_once;
 using boost::condition_variable;
-using boost::function;
 using boost::mutex;
 using boost::noncopyable;
 using boost::once_flag;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::minutes;
+using boost::posix_time::ptime;
 using boost::posix_time::seconds;
-using boost::uuids::random_generator;
-using boost::uuids::uuid;
+using boost::posix_time::time_duration;
+using boost::thread;
 
 using std::auto_ptr;
-using std::list;
 using std::map;
+using std::pair;
+using std::size_t;
 using std::string;
 using std::vector;
+using std::wstring;
 
 namespace swish {
 namespace connection {
 
 namespace {
 
-class task_registration
+class session_manager_impl;
+class connection_reservations;
+
+typedef boost::intrusive::list_base_hook<
+    boost::intrusive::link_mode<boost::intrusive::auto_unlink> >
+    reservation_hook;
+
+}
+
+// Hides the implementation details from the session_manager.hpp file.
+//
+// The reservation is its own entry in the ledger: it is linked into the list
+// of reservations for its connection.  That makes reserving and unreserving
+// constant-time without needing any kind of ID to find the entry again.
+class session_reservation_impl :
+    public reservation_hook, private boost::noncopyable
 {
 public:
-    // We tag the registration with a UUID because it, and its copies, must
-    // be uniquely identifiable.  The task name is not enough as many tasks
-    // make share a name.  We can't just use the object address, though,
-    // because copies must be equal.
-    task_registration(
-        const string& task_name, const connection_spec& specification)
-        : m_tag(random_generator()()), m_task_name(task_name),
-          m_specification(specification) {}
 
-    // Copies take same tag
+    session_reservation_impl(
+        authenticated_session& session, const string& task_name,
+        session_manager_impl& manager)
+        :
+    m_session(session), m_task_name(task_name), m_manager(manager),
+    m_connection(NULL) {}
+
+    ~session_reservation_impl();
 
-    bool operator==(const task_registration& other) const
+    authenticated_session& session()
     {
-        return m_tag == other.m_tag;
+        return m_session;
     }
 
-    string name() const
+    const string& task_name() const
     {
         return m_task_name;
     }
 
-    // So that unregistering doesn't have to search all unrelated connection's
-    // tasks to find the matching task ID
-    connection_spec specification() const
+    // Ledger entry of the connection this reservation is for, or NULL if
+    // not in the ledger.
+    //
+    // Only changed under the ledger lock by the thread that owns this
+    // reservation, so no other thread ever reads it
+    connection_reservations* connection()
+    {
+        return m_connection;
+    }
+
+    void connection(connection_reservations* connection)
     {
-        return m_specification;
+        m_connection = connection;
     }
 
 private:
-    uuid m_tag;
+
+    authenticated_session& m_session;
     string m_task_name;
-    connection_spec m_specification;
+    session_manager_impl& m_manager;
+    connection_reservations* m_connection;
 };
 
+namespace {
 
+ptime now()
+{
+    return microsec_clock::universal_time();
 }
 
-// Hides the implementation details from the session_manager.hpp file.
-class session_reservation_impl : private boost::noncopyable
+// Not constant-time size so that reservations can unlink themselves
+typedef boost::intrusive::list<
+    session_reservation_impl,
+    boost::intrusive::constant_time_size<false> > reservation_list;
+
+// Ledger entry for one pooled connection
+class connection_reservations : private noncopyable
 {
 public:
 
-    session_reservation_impl(
-        authenticated_session& session, const function<void()>& unreserve)
-        :
-    m_session(session), m_unreserve(unreserve) {}
+    connection_reservations() : m_idle_since(now()) {}
 
-    ~session_reservation_impl()
+    reservation_list& reservations()
     {
-        m_unreserve();
+        return m_reservations;
     }
 
-    authenticated_session& session()
+    const reservation_list& reservations() const
     {
-        return m_session;
+        return m_reservations;
     }
 
-private:
+    // When the last reservation went away.  Meaningless while reserved.
+    ptime idle_since() const
+    {
+        return m_idle_since;
+    }
 
-    authenticated_session& m_session;
-    function<void()> m_unreserve;
-};
+    void idle_since(ptime time)
+    {
+        m_idle_since = time;
+    }
 
-namespace {
+private:
+    reservation_list m_reservations;
+    ptime m_idle_since;
+};
 
 // Purpose: to maintain the book of reservations in an orderly
-// fashion.  This means cleaning out entries for old connection_specs that
-// don't have any more tasks
+// fashion.
+//
+// Reserving and unreserving are very frequent (every thumbnail and property
+// request takes a reservation) so they must be cheap.  The list of task
+// names is only needed when disconnecting, so we only build it then.
+//
+// The ledger has an entry for every session in the pool so it also knows
+// which sessions are idle, and since when, for idle reaping and eviction.
 class reservations_ledger
 {
-    typedef map<connection_spec, list<task_registration>> reservations_mapping;
+    // Using ptr_map because intrusive lists are not copyable
+    typedef boost::ptr_map<connection_spec, connection_reservations>
+        reservations_mapping;
 
 public:
 
-    void new_reservation(
-        const connection_spec& specification, const task_registration& task)
+    typedef pair<ptime, connection_spec> idle_connection;
+
+    // Returns whether this is the first reservation of a connection not
+    // already in the ledger
+    bool new_reservation(
+        connection_spec specification, session_reservation_impl& reservation)
     {
-        m_reservations[specification].push_back(task);
+        bool new_connection = false;
+
+        reservations_mapping::iterator pos =
+            m_reservations.find(specification);
+
+        if (pos == m_reservations.end())
+        {
+            pos = m_reservations.insert(
+                specification, new connection_reservations).first;
+            new_connection = true;
+        }
+
+        pos->second->reservations().push_back(reservation);
+        reservation.connection(pos->second);
+
+        return new_connection;
     }
 
-    vector<task_registration> reservations_for_connection(
-        const connection_spec& specification) const
+    bool has_reservations(const connection_spec& specification) const
     {
         reservations_mapping::const_iterator pos =
             m_reservations.find(specification);
 
-        if (pos == m_reservations.end())
+        return pos != m_reservations.end() &&
+            !pos->second->reservations().empty();
+    }
+
+    vector<string> task_names(const connection_spec& specification) const
+    {
+        vector<string> names;
+
+        reservations_mapping::const_iterator pos =
+            m_reservations.find(specification);
+        if (pos != m_reservations.end())
         {
-            return vector<task_registration>();
+            const reservation_list& reservations = pos->second->reservations();
+            for (reservation_list::const_iterator it = reservations.begin();
+                it != reservations.end(); ++it)
+            {
+                names.push_back(it->task_name());
+            }
         }
-        else
+
+        return names;
+    }
+
+    void unreserve(session_reservation_impl& reservation)
+    {
+        connection_reservations& connection = *reservation.connection();
+
+        reservation.unlink();
+        reservation.connection(NULL);
+
+        if (connection.reservations().empty())
+        {
+            connection.idle_since(now());
+        }
+    }
+
+    // Unreserving leaves the connection's entry in place, while its session
+    // is pooled, so that the next reservation doesn't have to recreate it
+    // and so we know how long it has been idle.  This removes it once the
+    // session goes away.
+    void forget_connection(const connection_spec& specification)
+    {
+        reservations_mapping::iterator pos =
+            m_reservations.find(specification);
+
+        if (pos != m_reservations.end() && pos->second->reservations().empty())
         {
-            return vector<task_registration>(
-                pos->second.begin(), pos->second.end());
+            m_reservations.erase(pos);
         }
     }
 
-    void unreserve(const task_registration& task)
+    size_t connection_count() const
     {
-        list<task_registration>& connection_registrations =
-            m_reservations[task.specification()];
+        return m_reservations.size();
+    }
 
-        connection_registrations.remove(task);
+    // Unreserved connections, least-recently used first
+    vector<idle_connection> idle_connections() const
+    {
+        vector<idle_connection> idle;
 
-        // To stop us building up a map full of empty lists for connections
-        // no longer in use, we remove the connection entry once it has
-        // no more tasks
-        if (connection_registrations.empty())
+        for (reservations_mapping::const_iterator it = m_reservations.begin();
+            it != m_reservations.end(); ++it)
         {
-            m_reservations.erase(m_reservations.find(task.specification()));
+            if (it->second->reservations().empty())
+            {
+                idle.push_back(
+                    idle_connection(it->second->idle_since(), it->first));
+            }
+        }
+
+        std::sort(idle.begin(), idle.end(), least_recently_used);
+
+        return idle;
+    }
+
+    map<wstring, size_t> connections_per_host() const
+    {
+        map<wstring, size_t> counts;
+
+        for (reservations_mapping::const_iterator it = m_reservations.begin();
+            it != m_reservations.end(); ++it)
+        {
+            ++counts[it->first.host()];
+        }
+
+        return counts;
+    }
+
+    void add_metrics(session_pool_metrics& metrics) const
+    {
+        metrics.sessions = m_reservations.size();
+
+        for (reservations_mapping::const_iterator it = m_reservations.begin();
+            it != m_reservations.end(); ++it)
+        {
+            size_t count = it->second->reservations().size();
+
+            if (count > 0)
+                ++metrics.reserved_sessions;
+
+            metrics.reservations += count;
         }
     }
 
 private:
 
+    // connection_spec has no == so we mustn't let sort fall back to
+    // comparing it when times are equal
+    static bool least_recently_used(
+        const idle_connection& a, const idle_connection& b)
+    {
+        return a.first < b.first;
+    }
+
     reservations_mapping m_reservations;
 };
 
-string extract_task_name(const task_registration& task)
-{
-    return task.name();
-}
+// Sessions taken out of the pool, to be closed once the ledger lock is
+// released.  Closing a session waits on its host, which could be dead,
+// and mustn't hold up reservations of every other host meanwhile.
+//
+// Declare before taking the lock, so that it is destroyed after the lock
+// is released.
+typedef boost::ptr_vector<authenticated_session> closing_sessions;
 
 // Hides the implementation details from the session_manager.hpp file.
 class session_manager_impl
@@ -207,7 +371,7 @@ public:
         connection_spec specification, com_ptr<ISftpConsumer> consumer,
         const std::string& task_name)
     {
-        task_registration task_id(task_name, specification);
+        closing_sessions evicted;
 
         // Locking just before getting the session from the pool to make sure
         // another thread can't disconnect it just as we are about to become
@@ -218,14 +382,32 @@ public:
         authenticated_session& session =
             session_pool().pooled_session(specification, consumer);
 
-        m_reservations.new_reservation(specification, task_id);
+        auto_ptr<session_reservation_impl> reservation(
+            new session_reservation_impl(session, task_name, *this));
+
+        bool new_connection =
+            m_reservations.new_reservation(specification, *reservation);
+
+        // Only a new session can take the pool over its limits
+        if (new_connection)
+        {
+            try
+            {
+                enforce_limits(evicted);
+                start_reaper();
+            }
+            catch (...)
+            {
+                // The reservation's destructor would unreserve it by taking
+                // the ledger lock, which we already hold
+                m_reservations.unreserve(*reservation);
+                throw;
+            }
+        }
 
         m_reservations_changed.notify_all();
 
-        return session_reservation(
-            new session_reservation_impl(
-                session,
-                bind(&session_manager_impl::unreserve_session, this, task_id)));
+        return session_reservation(reservation.release());
     }
 
     void disconnect_session(
@@ -233,12 +415,15 @@ public:
         session_manager::progress_callback notification_sink)
     {
         // Lock here so that no new reservations can be made once we've decided
-        // to disconnect this one, until we disconnect it
+        // to disconnect this one, until we take it out of the pool
 
         // Although we lock reservations of ALL sessions, not just this one,
         // it's not a big problem because we quickly unlock them if waiting
-        // for tasks to unreserve this one.  If not waiting for tasks,
-        // disconnecting the session is quick so also not a problem in practice.
+        // for tasks to unreserve this one.  If not waiting for tasks, we
+        // only hold the lock while taking the session out of the pool; it is
+        // closed after the lock is released.
+        closing_sessions disconnected;
+
         mutex::scoped_lock lock(m_reservations_guard);
 
         bool proceed_with_disconnection = wait_for_remaining_uses(
@@ -246,12 +431,195 @@ public:
 
         if (proceed_with_disconnection)
         {
-            session_pool().remove_session(specification);
+            evict(specification, disconnected);
+
+            // The reaper finishes once the pool is empty
+            m_reaper_wake_up.notify_all();
         }
     }
 
+    session_limits limits()
+    {
+        mutex::scoped_lock lock(m_reservations_guard);
+
+        return m_limits;
+    }
+
+    void limits(const session_limits& new_limits)
+    {
+        closing_sessions evicted;
+
+        mutex::scoped_lock lock(m_reservations_guard);
+
+        m_limits = new_limits;
+
+        enforce_limits(evicted);
+
+        // The reaper may be waiting on the old idle timeout
+        m_reaper_wake_up.notify_all();
+    }
+
+    void reap_idle_sessions(ptime as_of)
+    {
+        closing_sessions reaped;
+
+        mutex::scoped_lock lock(m_reservations_guard);
+
+        reap_idle(reaped, as_of);
+    }
+
+    session_pool_metrics metrics()
+    {
+        mutex::scoped_lock lock(m_reservations_guard);
+
+        session_pool_metrics metrics;
+        m_reservations.add_metrics(metrics);
+        metrics.evicted = m_evicted_count;
+        metrics.reaped = m_reaped_count;
+
+        return metrics;
+    }
+
 private:
 
+    // Called with the ledger lock held.  As eviction happens under the same
+    // lock as reservation, a session can't be reserved while it is being
+    // evicted, and a reserved session is never idle so is never evicted.
+    //
+    // The session is only closed when `closing` is destroyed.
+    void evict(
+        const connection_spec& specification, closing_sessions& closing)
+    {
+        auto_ptr<authenticated_session> session =
+            session_pool().release_session(specification);
+        m_reservations.forget_connection(specification);
+
+        if (session.get())
+            closing.push_back(session);
+    }
+
+    // Evict least-recently-used idle sessions until the pool is within
+    // the limits, or only reserved sessions are left
+    void enforce_limits(closing_sessions& evicted)
+    {
+        vector<reservations_ledger::idle_connection> idle =
+            m_reservations.idle_connections();
+
+        map<wstring, size_t> per_host = m_reservations.connections_per_host();
+        size_t total = m_reservations.connection_count();
+
+        BOOST_FOREACH(
+            const reservations_ledger::idle_connection& connection, idle)
+        {
+            size_t& host_count = per_host[connection.second.host()];
+
+            if (total > m_limits.max_sessions ||
+                host_count > m_limits.max_sessions_per_host)
+            {
+                evict(connection.second, evicted);
+                --total;
+                --host_count;
+                ++m_evicted_count;
+            }
+        }
+    }
+
+    void reap_idle(closing_sessions& reaped, ptime as_of)
+    {
+        if (m_limits.idle_timeout.is_pos_infinity())
+            return;
+
+        ptime cutoff = as_of - m_limits.idle_timeout;
+
+        BOOST_FOREACH(
+            const reservations_ledger::idle_connection& connection,
+            m_reservations.idle_connections())
+        {
+            if (connection.first > cutoff)
+                break;
+
+            evict(connection.second, reaped);
+            ++m_reaped_count;
+        }
+    }
+
+    // How long the reaper should sleep before the next session could
+    // become reapable.  Capped so that changes in the clock, and missed
+    // wake-ups, are never fatal.
+    time_duration time_until_next_reap() const
+    {
+        time_duration longest_wait = minutes(1);
+
+        if (m_limits.idle_timeout.is_pos_infinity())
+            return longest_wait;
+
+        vector<reservations_ledger::idle_connection> idle =
+            m_reservations.idle_connections();
+        if (idle.empty())
+            return (std::min)(m_limits.idle_timeout, longest_wait);
+
+        time_duration wait = idle.front().first + m_limits.idle_timeout - now();
+
+        wait = (std::min)(wait, longest_wait);
+        return (std::max)(wait, time_duration(seconds(1)));
+    }
+
+    // Called with the ledger lock held
+    void start_reaper()
+    {
+        if (!m_reaper_running && !m_stopping)
+        {
+            // Any previous reaper has finished, or is just about to, as it
+            // stopped running under the lock we hold
+            if (m_reaper.joinable())
+                m_reaper.join();
+
+            // The reaper keeps the DLL loaded until it finishes
+            module_lock module;
+            m_reaper = thread(bind(&session_manager_impl::run_reaper, this));
+            module.release();
+
+            m_reaper_running = true;
+        }
+    }
+
+    // The reaper only runs while there are sessions in the pool, so it
+    // doesn't hang around once everything is disconnected
+    void run_reaper()
+    {
+        // Taken by start_reaper.  Declared before the ledger lock so that
+        // it is the last thing we let go of.
+        module_lock module(adopt_lock);
+
+        mutex::scoped_lock lock(m_reservations_guard);
+
+        while (!m_stopping && m_reservations.connection_count() > 0)
+        {
+            m_reaper_wake_up.timed_wait(lock, time_until_next_reap());
+
+            closing_sessions reaped;
+
+            try
+            {
+                reap_idle(reaped, now());
+            }
+            catch (const std::exception&)
+            {
+                // Reaping is housekeeping; not worth losing the process over.
+                // We'll try again next time round.
+            }
+
+            if (!reaped.empty())
+            {
+                lock.unlock();
+                reaped.clear();
+                lock.lock();
+            }
+        }
+
+        m_reaper_running = false;
+    }
+
     bool wait_for_remaining_uses(
         const connection_spec& specification,
         session_manager::progress_callback notification_sink,
@@ -259,10 +627,7 @@ private:
     {
         while (true)
         {
-            vector<task_registration> reservations = 
-                m_reservations.reservations_for_connection(specification);
-
-            if (reservations.empty())
+            if (!m_reservations.has_reservations(specification))
             {
                 // We notify the callback that tasks have completed so it can
                 // shut down any progress UI.
@@ -275,7 +640,7 @@ private:
             // The callback controls whether we continue waiting or whether
             // we abort so that the user's UI isn't blocked
             else if (notification_sink(
-                reservations | transformed(extract_task_name)))
+                m_reservations.task_names(specification)))
             {
                 // It is important to use a timed wait because we need to
                 // respond to cancellation promptly.
@@ -308,23 +673,56 @@ private:
         }
     }
 
-    // Used by session_registration to unregister the session when that
+    friend class swish::connection::session_reservation_impl;
+
+    // Used by session_reservation_impl to unregister the session when that
     // ticket object goes out of scope
-    void unreserve_session(const task_registration& task_id)
+    void unreserve_session(session_reservation_impl& reservation)
     {
         mutex::scoped_lock lock(m_reservations_guard);
 
-        m_reservations.unreserve(task_id);
+        m_reservations.unreserve(reservation);
+
+        // Wakes any disconnection waiting for this task to finish
+        m_reservations_changed.notify_all();
     }
 
-    session_manager_impl() {};
+    session_manager_impl()
+        :
+    m_evicted_count(0), m_reaped_count(0), m_reaper_running(false),
+    m_stopping(false) {};
 
     mutex m_reservations_guard;
     reservations_ledger m_reservations;
     condition_variable m_reservations_changed;
 
+    session_limits m_limits;
+    size_t m_evicted_count;
+    size_t m_reaped_count;
+
+    thread m_reaper;
+    bool m_reaper_running;
+    bool m_stopping;
+    condition_variable m_reaper_wake_up;
+
 public:
 
+    ~session_manager_impl()
+    {
+        mutex::scoped_lock lock(m_reservations_guard);
+
+        m_stopping = true;
+        m_reaper_wake_up.notify_all();
+
+        // Not waiting for the reaper to finish.  This runs during static
+        // destruction, while the loader lock stops any thread finishing.
+        // Nor do we need to: a running reaper holds a module lock, so COM
+        // won't unload the DLL under it, and by the time a process exits
+        // Windows has already ended it.
+        if (m_reaper.joinable())
+            m_reaper.detach();
+    }
+
     static session_manager_impl& get()
     {
         call_once(m_initialise_once, do_init);
@@ -346,6 +744,20 @@ auto_ptr<session_manager_impl> session_manager_impl::m_instance;
 
 }
 
+session_reservation_impl::~session_reservation_impl()
+{
+    // Not in the ledger if reserving failed part-way, as the reserving
+    // thread took it out again
+    if (m_connection)
+    {
+        m_manager.unreserve_session(*this);
+    }
+}
+
+session_limits::session_limits()
+    :
+idle_timeout(minutes(15)), max_sessions(16), max_sessions_per_host(4) {}
+
 session_reservation::session_reservation(session_reservation_impl* pimpl)
 :
 m_pimpl(pimpl) {}
@@ -399,4 +811,29 @@ void session_manager::disconnect_session(
         specification, notification_sink);
 }
 
+session_limits session_manager::limits()
+{
+    return session_manager_impl::get().limits();
+}
+
+void session_manager::limits(const session_limits& new_limits)
+{
+    session_manager_impl::get().limits(new_limits);
+}
+
+void session_manager::reap_idle_sessions()
+{
+    session_manager_impl::get().reap_idle_sessions(now());
+}
+
+void session_manager::reap_idle_sessions(ptime as_of)
+{
+    session_manager_impl::get().reap_idle_sessions(as_of);
+}
+
+session_pool_metrics session_manager::metrics()
+{
+    return session_manager_impl::get().metrics();
+}
+
 }}
\ No newline at end of file
@@ -33,11 +33,13 @@
 
 #include <comet/ptr.h>
 
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
 #include <boost/function.hpp>
 #include <boost/move/move.hpp> // BOOST_RV_REF, BOOST_MOVABLE_BUT_NOT_COPYABLE
 #include <boost/noncopyable.hpp>
 #include <boost/range/any_range.hpp>
 
+#include <cstddef> // size_t
 #include <string>
 
 namespace swish {
@@ -89,6 +91,62 @@ private:
     session_reservation_impl* m_pimpl;
 };
 
+/**
+ * Limits on the sessions kept open in the pool.
+ *
+ * Limits only ever close sessions that no task has reserved.  While reserved
+ * sessions prevent it, the pool may hold more sessions than the limits allow.
+ */
+struct session_limits
+{
+    session_limits();
+
+    /**
+     * Unreserved sessions are disconnected after being unused for this long.
+     *
+     * `boost::posix_time::pos_infin` keeps idle sessions forever.
+     */
+    boost::posix_time::time_duration idle_timeout;
+
+    /**
+     * Most sessions kept in the pool, across all hosts.
+     *
+     * When exceeded, the least-recently-used unreserved sessions are
+     * disconnected.
+     */
+    std::size_t max_sessions;
+
+    /**
+     * Most sessions kept to any one host, whatever the user and port.
+     */
+    std::size_t max_sessions_per_host;
+};
+
+/**
+ * Snapshot of the pool's occupancy.
+ */
+struct session_pool_metrics
+{
+    session_pool_metrics()
+        : sessions(0), reserved_sessions(0), reservations(0), evicted(0),
+          reaped(0) {}
+
+    /// Sessions currently open.
+    std::size_t sessions;
+
+    /// Open sessions that at least one task has reserved.
+    std::size_t reserved_sessions;
+
+    /// Outstanding reservations, across all sessions.
+    std::size_t reservations;
+
+    /// Sessions disconnected, so far, to stay within `session_limits`.
+    std::size_t evicted;
+
+    /// Sessions disconnected, so far, for being idle too long.
+    std::size_t reaped;
+};
+
 // ALL Swish sessions (except in unit tests) must be created through this
 // factory to register their interest so that the disconnection code knows
 // which, if any, tasks are preventing disconnection.
@@ -142,6 +200,40 @@ public:
     void disconnect_session(
         const connection_spec& specification,
         progress_callback notification_sink);
+
+    /**
+     * Limits that decide when unused sessions are disconnected.
+     */
+    session_limits limits();
+
+    /**
+     * Change the limits that decide when unused sessions are disconnected.
+     *
+     * Sessions over the new limits are disconnected straight away, if they
+     * are not reserved.
+     */
+    void limits(const session_limits& new_limits);
+
+    /**
+     * Disconnect unreserved sessions that have been idle longer than the idle
+     * timeout.
+     *
+     * This happens periodically in the background anyway.
+     */
+    void reap_idle_sessions();
+
+    /**
+     * Disconnect unreserved sessions that will have been idle longer than
+     * the idle timeout at the given time.
+     *
+     * Lets tests reap without waiting for sessions to become idle.
+     */
+    void reap_idle_sessions(boost::posix_time::ptime as_of);
+
+    /**
+     * Current occupancy of the session pool.
+     */
+    session_pool_metrics metrics();
 };
 
 }}
@@ -117,6 +117,19 @@ public:
         m_sessions.erase(specification);
     }
 
+    auto_ptr<authenticated_session> release_session(
+        const connection_spec& specification)
+    {
+        mutex::scoped_lock lock(m_session_pool_guard);
+
+        pool_mapping::iterator session = m_sessions.find(specification);
+        if (session == m_sessions.end())
+            return auto_ptr<authenticated_session>();
+
+        return auto_ptr<authenticated_session>(
+            m_sessions.release(session).release());
+    }
+
 
 private:
 
@@ -157,4 +170,10 @@ void session_pool::remove_session(const connection_spec& specification)
     return session_pool_impl::get().remove_session(specification);
 }
 
+auto_ptr<authenticated_session> session_pool::release_session(
+    const connection_spec& specification)
+{
+    return session_pool_impl::get().release_session(specification);
+}
+
 }} // namespace swish::connection
@@ -35,6 +35,7 @@
 
 #include <comet/ptr.h> // com_ptr
 
+#include <memory> // auto_ptr
 #include <string>
 
 namespace swish {
@@ -78,6 +79,17 @@ public:
      */
     void remove_session(const connection_spec& specification);
 
+    /**
+     * Take the specified session out of the pool without closing it.
+     *
+     * Closing a session waits on its host, so this lets the caller close it
+     * after letting go of any locks.
+     *
+     * @returns  The session, or NULL if it wasn't in the pool.
+     */
+    std::auto_ptr<authenticated_session> release_session(
+        const connection_spec& specification);
+
 };
 
 }} // namespace swish::connection
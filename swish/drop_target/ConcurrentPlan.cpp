@@ -0,0 +1,781 @@
+/**
+    @file
+
+    Drop operation plan running independent operations concurrently.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "ConcurrentPlan.hpp"
+
+#include "swish/provider/sftp_provider.hpp" // sftp_provider
+#include "swish/drop_target/DropActionCallback.hpp"
+#include "swish/drop_target/Operation.hpp"
+
+#include <boost/bind.hpp> // bind
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // milliseconds
+#include <boost/exception_ptr.hpp> // current_exception, copy_exception
+#include <boost/filesystem/path.hpp> // wpath
+#include <boost/function.hpp> // function
+#include <boost/noncopyable.hpp>
+#include <boost/numeric/conversion/cast.hpp> // numeric_cast
+#include <boost/optional/optional.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp> // thread_group
+#include <boost/throw_exception.hpp>  // BOOST_THROW_EXCEPTION
+
+#include <comet/error.h> // com_error
+#include <comet/util.h> // auto_coinit
+
+#include <algorithm> // min
+#include <cassert> // assert
+#include <memory> // auto_ptr
+#include <stdexcept> // invalid_argument
+#include <vector>
+
+using swish::provider::sftp_provider;
+
+using comet::auto_coinit;
+using comet::com_error;
+
+using boost::bind;
+using boost::condition_variable;
+using boost::copy_exception;
+using boost::current_exception;
+using boost::exception_ptr;
+using boost::filesystem::wpath;
+using boost::function;
+using boost::mutex;
+using boost::noncopyable;
+using boost::numeric_cast;
+using boost::optional;
+using boost::posix_time::milliseconds;
+using boost::ptr_vector;
+using boost::ref;
+using boost::rethrow_exception;
+using boost::shared_ptr;
+using boost::thread_group;
+using boost::uintmax_t;
+
+using std::auto_ptr;
+using std::min;
+using std::size_t;
+using std::vector;
+
+namespace swish {
+namespace drop_target {
+
+namespace {
+
+    const size_t NO_OPERATION = static_cast<size_t>(-1);
+
+    /**
+     * How often the executing thread checks for cancellation and updates
+     * the progress display if nothing else wakes it.
+     */
+    const long POLL_MILLISECONDS = 100;
+
+    /**
+     * Calculate percentage.
+     *
+     * @bug  Throws if using ludicrously large sizes.
+     */
+    uintmax_t percentage(uintmax_t done, uintmax_t total)
+    {
+        if (total == 0)
+            return 100;
+        else
+            return numeric_cast<uintmax_t>((done * 100) / total);
+    }
+
+    /**
+     * What the executing thread needs to know to update the user.
+     */
+    struct Snapshot
+    {
+        Snapshot()
+            :
+            finished(false), planning(false), operation_count(0),
+            percent_done(0), latest_operation(NO_OPERATION) {}
+
+        bool finished;
+        bool planning; ///< More operations may yet be found
+        optional<wpath> overwrite_question;
+        size_t operation_count; ///< Found so far
+        uintmax_t percent_done; ///< Sum of all operations' percentages
+        size_t latest_operation; ///< Most recently started
+    };
+
+    /**
+     * Everything the workers and the thread executing the plan share.
+     *
+     * Only the executing thread touches the user interface.  Workers leave
+     * their progress and their questions for the user here and the
+     * executing thread passes them on.
+     *
+     * If there is a planner, it adds operations here while the workers are
+     * running the ones it added earlier.
+     */
+    class SharedState : private noncopyable
+    {
+    public:
+
+        SharedState(
+            const ptr_vector<Operation>& operations, size_t worker_count,
+            bool planning, size_t lookahead)
+            :
+            m_operations(operations), m_planning(planning),
+            m_lookahead(lookahead), m_next(0), m_running(0),
+            m_completed(0), m_barrier(NO_OPERATION),
+            m_latest(NO_OPERATION), m_stopping(false), m_cancelled(false),
+            m_paused(false), m_worker_progress(worker_count, 0) {}
+
+        /**
+         * Operation at the given index.
+         *
+         * The reference stays valid as the planner adds more.
+         */
+        const Operation& operation(size_t index) const
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            return m_operations[index];
+        }
+
+        /// @name Planner side
+        // @{
+
+        /**
+         * Add an operation, waiting while the planner is too far ahead of
+         * the workers.
+         *
+         * Throws if the plan has stopped, to stop the planner too.
+         */
+        void add_operation(const Operation& operation)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            while (!m_stopping &&
+                m_operations.size() - m_next >= m_lookahead)
+            {
+                m_changed.wait(lock);
+            }
+
+            if (m_stopping)
+                BOOST_THROW_EXCEPTION(com_error(E_ABORT));
+
+            m_operations.push_back(operation.clone());
+            m_changed.notify_all();
+        }
+
+        void planning_finished()
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            m_planning = false;
+            m_changed.notify_all();
+        }
+
+        // @}
+
+        /// @name Worker side
+        // @{
+
+        /**
+         * Claim the next operation, waiting until it may start.
+         *
+         * @returns the operation's index or NO_OPERATION if there is nothing
+         *          left for workers to do.
+         */
+        size_t claim_next()
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            while (!m_stopping && !all_claimed() &&
+                (m_paused || m_barrier != NO_OPERATION ||
+                 m_next >= m_operations.size()))
+            {
+                m_changed.wait(lock);
+            }
+
+            if (m_stopping || m_next >= m_operations.size())
+                return NO_OPERATION;
+
+            size_t index = m_next++;
+
+            if (m_operations[index].is_dependency_barrier())
+            {
+                m_barrier = index;
+            }
+
+            ++m_running;
+            m_latest = index;
+
+            m_changed.notify_all();
+            return index;
+        }
+
+        void operation_finished(size_t worker, size_t index)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            assert(m_running > 0);
+            --m_running;
+            ++m_completed;
+            m_worker_progress[worker] = 0;
+
+            if (index == m_barrier)
+            {
+                m_barrier = NO_OPERATION;
+            }
+
+            m_changed.notify_all();
+        }
+
+        /**
+         * Stop the plan because of an error.
+         *
+         * Only the first error is kept; later ones are often a consequence
+         * of it.
+         */
+        void fail(exception_ptr error)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            if (!m_error)
+            {
+                m_error = error;
+            }
+
+            m_stopping = true;
+            m_changed.notify_all();
+        }
+
+        void update_progress(size_t worker, uintmax_t percent)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            m_worker_progress[worker] = (min)(percent, uintmax_t(100));
+        }
+
+        bool cancelled() const
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            return m_cancelled;
+        }
+
+        /**
+         * Hold the calling worker while the plan is paused.
+         */
+        void wait_while_paused()
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            while (m_paused && !m_stopping)
+            {
+                m_changed.wait(lock);
+            }
+        }
+
+        /**
+         * Ask the executing thread to ask the user, and wait for the answer.
+         *
+         * One question is asked at a time.
+         */
+        bool request_overwrite_permission(const wpath& target)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            while (m_overwrite_question && !m_stopping)
+            {
+                m_changed.wait(lock);
+            }
+
+            if (m_stopping)
+                BOOST_THROW_EXCEPTION(com_error(E_ABORT));
+
+            m_overwrite_question = target;
+            m_overwrite_answer = optional<bool>();
+            m_changed.notify_all();
+
+            while (!m_overwrite_answer && !m_stopping)
+            {
+                m_changed.wait(lock);
+            }
+
+            bool answered = m_overwrite_answer.is_initialized();
+            bool answer = answered && *m_overwrite_answer;
+
+            m_overwrite_question = optional<wpath>();
+            m_overwrite_answer = optional<bool>();
+            m_changed.notify_all();
+
+            if (!answered)
+                BOOST_THROW_EXCEPTION(com_error(E_ABORT));
+
+            return answer;
+        }
+
+        // @}
+
+        /// @name Executing-thread side
+        // @{
+
+        /**
+         * Wait for something to change, but not longer than the poll
+         * interval.
+         */
+        Snapshot wait_for_change()
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            if (!finished() && !unanswered_question())
+            {
+                m_changed.timed_wait(lock, milliseconds(POLL_MILLISECONDS));
+            }
+
+            Snapshot snapshot;
+            snapshot.finished = finished();
+            snapshot.planning = m_planning;
+            snapshot.operation_count = m_operations.size();
+            if (unanswered_question())
+            {
+                snapshot.overwrite_question = m_overwrite_question;
+            }
+
+            snapshot.percent_done = m_completed * 100;
+            for (size_t i = 0; i < m_worker_progress.size(); ++i)
+            {
+                snapshot.percent_done += m_worker_progress[i];
+            }
+
+            snapshot.latest_operation = m_latest;
+
+            return snapshot;
+        }
+
+        void answer_overwrite_question(bool answer)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            m_overwrite_answer = answer;
+            m_changed.notify_all();
+        }
+
+        /**
+         * Stop the plan because the user cancelled it.
+         */
+        void cancel()
+        {
+            try
+            {
+                BOOST_THROW_EXCEPTION(com_error(E_ABORT));
+            }
+            catch (...)
+            {
+                fail(current_exception());
+            }
+
+            mutex::scoped_lock lock(m_mutex);
+
+            m_cancelled = true;
+        }
+
+        /**
+         * Hold, or release, the workers.
+         *
+         * Paused workers stop at their operations' next check for
+         * cancellation and don't start any more operations.
+         */
+        void pause(bool paused)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            if (m_paused != paused)
+            {
+                m_paused = paused;
+                m_changed.notify_all();
+            }
+        }
+
+        /**
+         * Throw the error that stopped the plan, if any.
+         */
+        void rethrow_error() const
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            if (m_error)
+            {
+                rethrow_exception(m_error);
+            }
+        }
+
+        // @}
+
+    private:
+
+        /**
+         * Whether every operation there will ever be has been started.
+         */
+        bool all_claimed() const
+        {
+            return !m_planning && m_next >= m_operations.size();
+        }
+
+        bool finished() const
+        {
+            return m_running == 0 && (m_stopping || all_claimed());
+        }
+
+        bool unanswered_question() const
+        {
+            return m_overwrite_question && !m_overwrite_answer;
+        }
+
+        mutable mutex m_mutex;
+        condition_variable m_changed;
+
+        ptr_vector<Operation> m_operations;
+        bool m_planning; ///< Planner may still add operations
+        size_t m_lookahead; ///< Most unstarted operations planner may add
+        size_t m_next; ///< Index of the next operation to start
+        size_t m_running;
+        size_t m_completed;
+        size_t m_barrier; ///< Barrier still running, if any
+        size_t m_latest; ///< Most recently started operation
+
+        bool m_stopping; ///< Failed or cancelled; finishing what's running
+        bool m_cancelled;
+        bool m_paused;
+        exception_ptr m_error;
+
+        /// Percentage of its current operation each worker has done
+        vector<uintmax_t> m_worker_progress;
+
+        optional<wpath> m_overwrite_question;
+        optional<bool> m_overwrite_answer;
+    };
+
+    /**
+     * How operations running on a worker talk to the user.
+     *
+     * Purpose: like IntraSequenceCallback, to let the operation pretend it
+     * is the only one happening.  Everything goes via the shared state so
+     * only the executing thread touches the user interface.
+     */
+    class WorkerCallback : public OperationCallback
+    {
+    public:
+
+        WorkerCallback(SharedState& state, size_t worker)
+            : m_state(state), m_worker(worker) {}
+
+        virtual void check_if_user_cancelled() const
+        {
+            m_state.wait_while_paused();
+
+            if (m_state.cancelled())
+                BOOST_THROW_EXCEPTION(com_error(E_ABORT));
+        }
+
+        virtual bool request_overwrite_permission(const wpath& target) const
+        {
+            return m_state.request_overwrite_permission(target);
+        }
+
+        virtual void update_progress(uintmax_t so_far, uintmax_t out_of)
+        {
+            m_state.update_progress(m_worker, percentage(so_far, out_of));
+        }
+
+    private:
+        SharedState& m_state;
+        size_t m_worker;
+    };
+
+    /**
+     * Run operations, one after another, until there are none left.
+     */
+    void run_worker(
+        SharedState& state, size_t worker, shared_ptr<sftp_provider> provider)
+    {
+        try
+        {
+            // Operations bind to the source items on this thread
+            auto_coinit com;
+
+            WorkerCallback callback(state, worker);
+
+            for (;;)
+            {
+                size_t index = state.claim_next();
+                if (index == NO_OPERATION)
+                    break;
+
+                try
+                {
+                    callback.check_if_user_cancelled();
+
+                    state.operation(index)(callback, provider);
+                }
+                catch (const com_error& e)
+                {
+                    // Not all com_errors are thrown with BOOST_THROW_EXCEPTION
+                    // so capture it explicitly to keep its HRESULT
+                    state.fail(copy_exception(e));
+                }
+                catch (...)
+                {
+                    state.fail(current_exception());
+                }
+
+                state.operation_finished(worker, index);
+            }
+        }
+        catch (...)
+        {
+            state.fail(current_exception());
+        }
+    }
+
+    /**
+     * Passes the planner's operations to the workers.
+     */
+    class PlannerSink : public OperationSink
+    {
+    public:
+
+        explicit PlannerSink(SharedState& state) : m_state(state) {}
+
+        virtual void add_stage(const Operation& entry)
+        {
+            m_state.add_operation(entry);
+        }
+
+    private:
+        SharedState& m_state;
+    };
+
+    /**
+     * Run the planner and tell the workers when it has found everything.
+     */
+    void run_planner(
+        SharedState& state, function<void (OperationSink&)> planner)
+    {
+        try
+        {
+            // The planner binds to the source items on this thread
+            auto_coinit com;
+
+            PlannerSink sink(state);
+            planner(sink);
+        }
+        catch (const com_error& e)
+        {
+            state.fail(copy_exception(e));
+        }
+        catch (...)
+        {
+            state.fail(current_exception());
+        }
+
+        state.planning_finished();
+    }
+
+    /**
+     * Keeps the user up to date while the workers run.
+     *
+     * Purpose: as OperationExecutor for a sequential plan, to liaise between
+     * the operations and the DropActionCallback, of which the progress
+     * display is only created once for all the operations.
+     */
+    class UserLiaison
+    {
+    public:
+        explicit UserLiaison(DropActionCallback& callback)
+            : m_callback(callback), m_shown_operation(NO_OPERATION) {}
+
+        /**
+         * Keep the user up to date until the workers have finished.
+         */
+        void operator()(SharedState& state)
+        {
+            for (;;)
+            {
+                Snapshot snapshot = state.wait_for_change();
+
+                if (snapshot.overwrite_question)
+                {
+                    state.answer_overwrite_question(
+                        m_callback.can_overwrite(
+                            *snapshot.overwrite_question));
+                }
+
+                if (snapshot.latest_operation != NO_OPERATION &&
+                    snapshot.latest_operation != m_shown_operation)
+                {
+                    const Operation& operation =
+                        state.operation(snapshot.latest_operation);
+                    progress().line_path(1, operation.title());
+                    progress().line_path(2, operation.description());
+
+                    m_shown_operation = snapshot.latest_operation;
+                }
+
+                // While planning, the total is only what's been found so far
+                // and grows as more is found.  Count one more, still to be
+                // found, so the bar never looks finished before it is.
+                uintmax_t total = snapshot.operation_count;
+                if (snapshot.planning)
+                    ++total;
+
+                progress().update(snapshot.percent_done, total * 100);
+
+                if (snapshot.finished)
+                    break;
+
+                if (!state.cancelled() && progress().user_cancelled())
+                {
+                    state.cancel();
+                }
+
+                state.pause(progress().user_paused());
+            }
+        }
+
+    private:
+
+        Progress& progress()
+        {
+            if (!m_progress.get())
+                m_progress = m_callback.progress();
+
+            return *m_progress;
+        }
+
+        DropActionCallback& m_callback;
+        size_t m_shown_operation;
+        auto_ptr<Progress> m_progress;
+    };
+
+}
+
+ConcurrentPlan::ConcurrentPlan(size_t concurrency)
+    : m_concurrency(concurrency), m_lookahead(0)
+{
+    if (concurrency == 0)
+        BOOST_THROW_EXCEPTION(
+            std::invalid_argument("Concurrency must be at least one"));
+}
+
+ConcurrentPlan::ConcurrentPlan(
+    size_t concurrency, function<void (OperationSink&)> planner,
+    size_t lookahead)
+    : m_concurrency(concurrency), m_planner(planner), m_lookahead(lookahead)
+{
+    if (concurrency == 0)
+        BOOST_THROW_EXCEPTION(
+            std::invalid_argument("Concurrency must be at least one"));
+
+    if (lookahead == 0)
+        BOOST_THROW_EXCEPTION(
+            std::invalid_argument("Lookahead must be at least one"));
+
+    if (!planner)
+        BOOST_THROW_EXCEPTION(std::invalid_argument("Planner required"));
+}
+
+void ConcurrentPlan::execute_plan(
+    DropActionCallback& callback, shared_ptr<sftp_provider> provider) const
+{
+    bool planning = !m_planner.empty();
+
+    if (m_copy_list.empty() && !planning)
+        return;
+
+    // Without a planner, there's no point starting more workers than
+    // there are operations
+    size_t worker_count = (planning) ?
+        m_concurrency : (min)(m_concurrency, m_copy_list.size());
+
+    // Workers sharing a channel would only take turns on it, so each gets
+    // one to itself and there are as many workers as the server will give
+    // us channels.  If it won't give us any, one worker uses the provider's
+    // own.
+    vector<shared_ptr<sftp_provider>> providers;
+    if (provider)
+    {
+        providers = provider->borrow_channels(worker_count);
+        if (providers.empty())
+        {
+            providers.push_back(provider);
+        }
+
+        worker_count = providers.size();
+    }
+    else
+    {
+        providers.assign(worker_count, provider);
+    }
+
+    SharedState state(m_copy_list, worker_count, planning, m_lookahead);
+    UserLiaison liaison(callback);
+
+    thread_group threads;
+    try
+    {
+        if (planning)
+        {
+            threads.create_thread(bind(&run_planner, ref(state), m_planner));
+        }
+
+        for (size_t i = 0; i < worker_count; ++i)
+        {
+            threads.create_thread(
+                bind(&run_worker, ref(state), i, providers[i]));
+        }
+
+        liaison(state);
+    }
+    catch (...)
+    {
+        // The workers and planner use the state so must finish before it
+        // goes
+        state.fail(current_exception());
+        threads.join_all();
+        throw;
+    }
+
+    threads.join_all();
+
+    state.rethrow_error();
+}
+
+void ConcurrentPlan::add_stage(const Operation& entry)
+{
+    m_copy_list.push_back(entry.clone());
+}
+
+}}
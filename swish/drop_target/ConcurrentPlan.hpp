@@ -0,0 +1,116 @@
+/**
+    @file
+
+    Drop operation plan running independent operations concurrently.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#ifndef SWISH_DROP_TARGET_CONCURRENTPLAN_HPP
+#define SWISH_DROP_TARGET_CONCURRENTPLAN_HPP
+#pragma once
+
+#include "swish/drop_target/Plan.hpp"
+#include "swish/provider/sftp_provider.hpp"
+
+#include <boost/function.hpp> // function
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <cstddef> // size_t
+
+namespace swish {
+namespace drop_target {
+
+class Operation;
+
+/**
+ * Receives the operations a planner discovers.
+ */
+class OperationSink
+{
+public:
+    virtual void add_stage(const Operation& entry) = 0;
+
+protected:
+    ~OperationSink() {}
+};
+
+/**
+ * Plan made from list of Operation objects, several of which run at once.
+ *
+ * Operations start in the order they are added, on a bounded number of
+ * worker threads, but may finish in any order.  An operation that is a
+ * dependency barrier, such as creating a directory, holds back everything
+ * added after it until it has finished.
+ *
+ * Each worker has an SFTP channel of its own, borrowed from the provider,
+ * so there are only as many workers as the server will open channels.
+ *
+ * The thread executing the plan looks after the user interface: it shows
+ * the combined progress of the workers, notices cancellation and asks the
+ * user the workers' overwrite questions, one at a time.
+ *
+ * Operations can also come from a planner that runs alongside the workers,
+ * so copying starts while the planner is still finding what to copy.
+ */
+class ConcurrentPlan /* final */ : public Plan
+{
+public:
+
+    /**
+     * @param concurrency  Most operations to run at once.
+     */
+    explicit ConcurrentPlan(std::size_t concurrency);
+
+    /**
+     * @param concurrency  Most operations to run at once.
+     * @param planner      Called on its own thread when the plan executes
+     *                     to add operations after any added beforehand.
+     * @param lookahead    Most operations the planner may get ahead of the
+     *                     workers by before it is made to wait.
+     */
+    ConcurrentPlan(
+        std::size_t concurrency,
+        boost::function<void (OperationSink&)> planner,
+        std::size_t lookahead);
+
+public: // Plan
+
+    virtual void execute_plan(
+        DropActionCallback& callback,
+        boost::shared_ptr<swish::provider::sftp_provider> provider) const;
+
+public:
+
+    void add_stage(const Operation& entry);
+
+private:
+
+    std::size_t m_concurrency;
+    boost::ptr_vector<Operation> m_copy_list;
+    boost::function<void (OperationSink&)> m_planner;
+    std::size_t m_lookahead;
+};
+
+}}
+
+#endif
@@ -26,8 +26,11 @@
 
 #include "CopyFileOperation.hpp"
 
+#include "swish/block_transfer.hpp" // transfer_engine
+#include "swish/coalescing.hpp" // update_coalescer
 #include "swish/remote_folder/remote_pidl.hpp" // create_remote_itemid
 #include "swish/shell_folder/SftpDirectory.h" // CSftpDirectory
+#include "swish/shell_folder/shell.hpp" // size_of_stream
 
 #include <winapi/shell/shell.hpp> // stream_from_pidl
 #include <winapi/trace.hpp> // trace
@@ -35,18 +38,31 @@
 #include <comet/datetime.h> // datetime_t
 #include <comet/error.h> // com_error
 
-#include <boost/cstdint.hpp> // int64_t
+#include <boost/cstdint.hpp> // uintmax_t
 #include <boost/locale/message.hpp> // translate
 #include <boost/locale/format.hpp> // wformat
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/numeric/conversion/cast.hpp> // numeric_cast
 #include <boost/shared_ptr.hpp>  // shared_ptr
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp> // thread_specific_ptr
+#include <boost/weak_ptr.hpp>
 #include <boost/throw_exception.hpp>  // BOOST_THROW_EXCEPTION
 
 #include <cassert> // assert
+#include <cstddef> // size_t
 #include <exception>
 #include <iosfwd> // wstringstream
+#include <string>
 
+using swish::block_transfer::byte_sink;
+using swish::block_transfer::byte_source;
+using swish::block_transfer::transfer_engine;
+using swish::coalescing::update_coalescer;
 using swish::provider::sftp_provider;
 using swish::remote_folder::create_remote_itemid;
+using swish::shell_folder::size_of_stream;
 
 using winapi::shell::pidl::apidl_t;
 using winapi::shell::pidl::cpidl_t;
@@ -54,18 +70,25 @@ using winapi::shell::pidl::pidl_t;
 using winapi::shell::stream_from_pidl;
 using winapi::trace;
 
-using boost::int64_t;
+using boost::numeric_cast;
+using boost::uintmax_t;
 using boost::filesystem::wpath;
 using boost::function;
 using boost::locale::translate;
 using boost::locale::wformat;
+using boost::make_shared;
+using boost::mutex;
 using boost::shared_ptr;
+using boost::thread_specific_ptr;
+using boost::weak_ptr;
 
 using comet::com_error;
 using comet::com_ptr;
 using comet::datetime_t;
 
 using std::exception;
+using std::size_t;
+using std::wstring;
 using std::wstringstream;
 
 namespace swish {
@@ -73,21 +96,251 @@ namespace drop_target {
 
 namespace {
 
-    const size_t COPY_CHUNK_SIZE = 1024 * 32;
+    /**
+     * Bytes read from a local stream.
+     */
+    class StreamSource : public byte_source
+    {
+    public:
+        explicit StreamSource(com_ptr<IStream> stream) : m_stream(stream) {}
+
+        virtual size_t read(char* buffer, size_t size)
+        {
+            ULONG count = 0;
+            HRESULT hr = m_stream->Read(
+                buffer, numeric_cast<ULONG>(size), &count);
+            if (FAILED(hr))
+                BOOST_THROW_EXCEPTION(com_error_from_interface(m_stream, hr));
+
+            return count;
+        }
+
+    private:
+        com_ptr<IStream> m_stream;
+    };
 
     /**
-     * Return size of the streamed object in bytes.
+     * Bytes written to a remote stream.
+     *
+     * Written on the transfer engine's writer thread.  This is only safe
+     * because the stream is the provider's own, which is not tied to an
+     * apartment, rather than an arbitrary shell stream.
      */
-    int64_t size_of_stream(const com_ptr<IStream>& stream)
+    class StreamSink : public byte_sink
     {
-        STATSTG statstg;
-        HRESULT hr = stream->Stat(&statstg, STATFLAG_NONAME);
-        if (FAILED(hr))
-            BOOST_THROW_EXCEPTION(com_error_from_interface(stream, hr));
+    public:
+        explicit StreamSink(com_ptr<IStream> stream) : m_stream(stream) {}
+
+        virtual void write(const char* data, size_t size)
+        {
+            while (size > 0)
+            {
+                ULONG count = 0;
+                HRESULT hr = m_stream->Write(
+                    data, numeric_cast<ULONG>(size), &count);
+                if (FAILED(hr))
+                    BOOST_THROW_EXCEPTION(
+                        com_error_from_interface(m_stream, hr));
+
+                if (count == 0)
+                    BOOST_THROW_EXCEPTION(com_error(STG_E_MEDIUMFULL));
+
+                data += count;
+                size -= count;
+            }
+        }
+
+    private:
+        com_ptr<IStream> m_stream;
+    };
+
+    /**
+     * What the shell is told about a file being uploaded.
+     */
+    struct UploadedItem
+    {
+        UploadedItem(
+            const apidl_t& directory, const wstring& filename, uintmax_t size)
+            : directory(directory), filename(filename), size(size) {}
+
+        apidl_t directory;
+        wstring filename;
+        uintmax_t size;
+    };
+
+    /**
+     * Tell the shell how much of a file has been uploaded.
+     *
+     * Called on the notifier's delivery thread.
+     */
+    void notify_shell_of_update(
+        const wstring& /*path*/, const UploadedItem& item)
+    {
+        try
+        {
+            // We create a different version of the PIDL here whose
+            // filesize is the amount copied so far. Otherwise Explorer
+            // shows a 0-byte file when the copying is done.
+            cpidl_t file = create_remote_itemid(
+                item.filename, false, false, L"", L"", 0, 0, 0, item.size,
+                datetime_t::now(), datetime_t::now());
+
+            ::SHChangeNotify(
+                SHCNE_UPDATEITEM, SHCNF_IDLIST | SHCNF_FLUSHNOWAIT,
+                (item.directory + file).get(), NULL);
+        }
+        catch(const exception& e)
+        {
+            // Ignoring error; failing to update the shell doesn't
+            // warrant aborting the transfer
+            trace("Failed to notify shell of file update %s") % e.what();
+        }
+    }
+
+    /**
+     * Coalesces the shell notifications of uploads, keyed by remote path.
+     */
+    typedef update_coalescer<wstring, UploadedItem> ShellNotifier;
+
+    mutex shell_notifier_guard;
+    weak_ptr<ShellNotifier> current_shell_notifier;
+
+    /**
+     * Notifier shared by all the uploads happening at once.
+     *
+     * It, and its thread, only last as long as something holds it, so
+     * nothing is left running once a drop has finished.
+     */
+    shared_ptr<ShellNotifier> shell_notifier()
+    {
+        mutex::scoped_lock lock(shell_notifier_guard);
+
+        shared_ptr<ShellNotifier> notifier = current_shell_notifier.lock();
+        if (!notifier)
+        {
+            notifier = make_shared<ShellNotifier>(
+                ShellNotifier::deliverer(&notify_shell_of_update));
+            current_shell_notifier = notifier;
+        }
 
-        return statstg.cbSize.QuadPart;
+        return notifier;
     }
 
+    thread_specific_ptr<transfer_engine> current_thread_engine;
+
+    /**
+     * Engine for uploads made on the calling thread.
+     *
+     * A plan's workers each copy file after file, so this keeps the buffers
+     * and the block size learnt by one upload for the next rather than
+     * starting afresh for every file.  It goes when the thread ends.
+     */
+    transfer_engine& thread_transfer_engine()
+    {
+        if (!current_thread_engine.get())
+            current_thread_engine.reset(new transfer_engine());
+
+        return *current_thread_engine;
+    }
+
+    /**
+     * Tells the shell, through the notifier, how much of a file has been
+     * uploaded.
+     *
+     * The last size goes as the file's final state when this does,
+     * whether or not the upload finished, so the notifier lets go of the
+     * file.  The final size must replace any intermediate size still
+     * waiting to be delivered rather than go straight to the shell, or a
+     * stale update could arrive after it.
+     */
+    class ShellUpdates : private boost::noncopyable
+    {
+    public:
+
+        ShellUpdates(
+            shared_ptr<ShellNotifier> notifier,
+            const resolved_destination& target)
+            :
+            m_notifier(notifier), m_target(target),
+            m_path(target.as_absolute_path().string()), m_done(0) {}
+
+        ~ShellUpdates()
+        {
+            try
+            {
+                post(true);
+            }
+            catch (const exception& e)
+            {
+                trace("Failed to post final shell update: %s") % e.what();
+            }
+        }
+
+        void operator()(uintmax_t done)
+        {
+            m_done = done;
+            post(false);
+        }
+
+    private:
+
+        void post(bool final_state)
+        {
+            m_notifier->post(
+                m_path,
+                UploadedItem(
+                    m_target.directory(), m_target.filename(), m_done),
+                m_done, final_state);
+        }
+
+        shared_ptr<ShellNotifier> m_notifier;
+        const resolved_destination& m_target;
+        wstring m_path;
+        uintmax_t m_done;
+    };
+
+    /**
+     * Keeps the user and the shell up to date as the transfer progresses.
+     *
+     * Called on the operation's own thread, never the writer thread, and
+     * throws to stop the transfer if the user cancels.
+     */
+    class TransferProgress
+    {
+    public:
+
+        TransferProgress(
+            OperationCallback& callback, uintmax_t total,
+            ShellUpdates& shell)
+            :
+            m_callback(callback), m_total(total), m_shell(shell) {}
+
+        void operator()(uintmax_t done)
+        {
+            m_callback.check_if_user_cancelled();
+
+            // Only the latest size reaches the shell, at a bounded rate
+            m_shell(done);
+
+            // A failure to update the progress isn't a good enough reason
+            // to abort the copy so we swallow the exception.
+            try
+            {
+                m_callback.update_progress(done, m_total);
+            }
+            catch (const exception& e)
+            {
+                trace("Progress update threw exception: %s") % e.what();
+                assert(false);
+            }
+        }
+
+    private:
+        OperationCallback& m_callback;
+        uintmax_t m_total;
+        ShellUpdates& m_shell;
+    };
+
     /**
      * Write a stream to the provider at the given path.
      *
@@ -163,67 +416,28 @@ namespace {
         if (FAILED(hr))
             BOOST_THROW_EXCEPTION(com_error_from_interface(remote_stream, hr));
 
-        // Do the copy in chunks allowing us to cancel the operation
-        // and display progress
-        ULARGE_INTEGER cb;
-        cb.QuadPart = COPY_CHUNK_SIZE;
-        int64_t done = 0;
-        int64_t total = size_of_stream(local_stream);
+        // Reading the local file overlaps writing to the server.  The
+        // progress callback lets us cancel the operation and display
+        // progress between blocks.
+        StreamSource source(local_stream);
+        StreamSink sink(remote_stream);
 
-        while (true)
-        {
-            callback.check_if_user_cancelled();
-
-            ULARGE_INTEGER cbRead = {0};
-            ULARGE_INTEGER cbWritten = {0};
-            // TODO: make our own CopyTo that propagates errors
-            hr = local_stream->CopyTo(
-                remote_stream.get(), cb, &cbRead, &cbWritten);
-            assert(FAILED(hr) || cbRead.QuadPart == cbWritten.QuadPart);
-            if (FAILED(hr))
-                BOOST_THROW_EXCEPTION(
-                    com_error_from_interface(local_stream, hr));
-
-            try
-            {
-                // We create a different version of the PIDL here whose filesize
-                // is the amount copied so far. Otherwise Explorer shows a
-                // 0-byte file when the copying is done.
-                file = create_remote_itemid(
-                    target.filename(), false, false, L"", L"", 0, 0, 0,
-                    done, datetime_t::now(), datetime_t::now());
-
-                ::SHChangeNotify(
-                    SHCNE_UPDATEITEM, SHCNF_IDLIST | SHCNF_FLUSHNOWAIT,
-                    (target.directory() + file).get(), NULL);
-            }
-            catch(const exception& e)
-            {
-                // Ignoring error; failing to update the shell doesn't
-                // warrant aborting the transfer
-                trace("Failed to notify shell of file update %s") % e.what();
-            }
+        ShellUpdates shell(shell_notifier(), target);
 
-            // A failure to update the progress isn't a good enough reason
-            // to abort the copy so we swallow the exception.
-            try
-            {
-                done += cbWritten.QuadPart;
-                callback.update_progress(done, total);
-            }
-            catch (const exception& e)
-            {
-                trace("Progress update threw exception: %s") % e.what();
-                assert(false);
-            }
+        uintmax_t copied = thread_transfer_engine().transfer(
+            source, sink,
+            TransferProgress(callback, size_of_stream(local_stream), shell));
 
-            if (cbRead.QuadPart == 0)
-                break; // finished
-        }
+        shell(copied);
     }
 
 }
 
+shared_ptr<void> CopyFileOperation::hold_shell_notifier()
+{
+    return shell_notifier();
+}
+
 CopyFileOperation::CopyFileOperation(
     const RootedSource& source, const SftpDestination& destination) :
 m_source(source), m_destination(destination) {}
@@ -47,6 +47,17 @@ public:
     CopyFileOperation(
         const RootedSource& source, const SftpDestination& destination);
 
+    /**
+     * Keep the notifier that tells the shell about uploads for as long as
+     * the result is held.
+     *
+     * Uploads share whichever notifier is running, but one that nothing
+     * holds stops, with its thread, as soon as its upload finishes.  Held
+     * for a whole plan, it serves every file rather than being restarted
+     * for each.
+     */
+    static boost::shared_ptr<void> hold_shell_notifier();
+
 public: // Operation
 
     virtual std::wstring title() const;
@@ -0,0 +1,104 @@
+/**
+    @file
+
+    Deciding how each file of a drop gets copied.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "CopyStrategy.hpp"
+
+#include "swish/drop_target/CopyFileOperation.hpp"
+#include "swish/drop_target/TarUploadOperation.hpp"
+
+#include <boost/foreach.hpp> // BOOST_FOREACH
+
+using winapi::shell::pidl::apidl_t;
+
+using boost::uintmax_t;
+
+using std::size_t;
+
+namespace swish {
+namespace drop_target {
+
+const uintmax_t CopyStrategy::SMALL_FILE_SIZE;
+const size_t CopyStrategy::MIN_BATCH_FILES;
+const size_t CopyStrategy::MAX_BATCH_FILES;
+const uintmax_t CopyStrategy::MAX_BATCH_BYTES;
+
+CopyStrategy::CopyStrategy(
+    OperationSink& sink, const apidl_t& destination_root)
+    :
+    m_sink(sink), m_destination_root(destination_root), m_batch_bytes(0) {}
+
+void CopyStrategy::add_directory(const CreateDirectoryOperation& operation)
+{
+    m_sink.add_stage(operation);
+}
+
+void CopyStrategy::add_file(
+    const RootedSource& source, const SftpDestination& destination,
+    uintmax_t size)
+{
+    if (size > SMALL_FILE_SIZE)
+    {
+        m_sink.add_stage(CopyFileOperation(source, destination));
+        return;
+    }
+
+    m_batch.push_back(new SmallFile(source, destination, size));
+    m_batch_bytes += size;
+
+    if (m_batch.size() >= MAX_BATCH_FILES ||
+        m_batch_bytes >= MAX_BATCH_BYTES)
+    {
+        flush();
+    }
+}
+
+void CopyStrategy::flush()
+{
+    if (m_batch.size() >= MIN_BATCH_FILES)
+    {
+        TarUploadOperation operation(m_destination_root);
+        BOOST_FOREACH(const SmallFile& file, m_batch)
+        {
+            operation.add_file(
+                file.source, file.destination.relative_path(), file.size);
+        }
+
+        m_sink.add_stage(operation);
+    }
+    else
+    {
+        BOOST_FOREACH(const SmallFile& file, m_batch)
+        {
+            m_sink.add_stage(
+                CopyFileOperation(file.source, file.destination));
+        }
+    }
+
+    m_batch.clear();
+    m_batch_bytes = 0;
+}
+
+}}
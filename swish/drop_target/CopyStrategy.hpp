@@ -0,0 +1,122 @@
+/**
+    @file
+
+    Deciding how each file of a drop gets copied.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#ifndef SWISH_DROP_TARGET_COPYSTRATEGY_HPP
+#define SWISH_DROP_TARGET_COPYSTRATEGY_HPP
+#pragma once
+
+#include "swish/drop_target/ConcurrentPlan.hpp" // OperationSink
+#include "swish/drop_target/CreateDirectoryOperation.hpp"
+#include "swish/drop_target/RootedSource.hpp"
+#include "swish/drop_target/SftpDestination.hpp"
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+
+#include <winapi/shell/pidl.hpp> // apidl_t
+
+#include <cstddef> // size_t
+
+namespace swish {
+namespace drop_target {
+
+/**
+ * Decides how each file of the plan gets copied.
+ *
+ * Large files are copied individually as soon as they are found.
+ * Small files are held back to see how many there are: enough
+ * together go as a single tar stream, while a few scattered among
+ * large files aren't worth it and are copied individually too.
+ */
+class CopyStrategy : private boost::noncopyable
+{
+public:
+
+    /**
+     * Largest file worth sending to the server in a tar batch.
+     *
+     * Below this, the SFTP round trips to open and close a file cost more
+     * than sending its contents; above it, the contents dominate and
+     * concurrent SFTP copies keep the connection busier.
+     */
+    static const boost::uintmax_t SMALL_FILE_SIZE = 64 * 1024;
+
+    /**
+     * Fewest small files worth a tar batch.
+     *
+     * Starting tar on the server costs a few round trips of its own, and
+     * a batch is copied by one thread rather than several.
+     */
+    static const std::size_t MIN_BATCH_FILES = 16;
+
+    /**
+     * Batch limits.
+     *
+     * Small enough that cancelling or a failure loses little and that a
+     * large tree still spreads over the concurrent copies.
+     */
+    static const std::size_t MAX_BATCH_FILES = 500;
+    static const boost::uintmax_t MAX_BATCH_BYTES = 8 * 1024 * 1024;
+
+    CopyStrategy(
+        OperationSink& sink,
+        const winapi::shell::pidl::apidl_t& destination_root);
+
+    void add_directory(const CreateDirectoryOperation& operation);
+
+    void add_file(
+        const RootedSource& source, const SftpDestination& destination,
+        boost::uintmax_t size);
+
+    /**
+     * Pass on the small files held back.
+     */
+    void flush();
+
+private:
+
+    struct SmallFile
+    {
+        SmallFile(
+            const RootedSource& source,
+            const SftpDestination& destination, boost::uintmax_t size)
+            : source(source), destination(destination), size(size) {}
+
+        RootedSource source;
+        SftpDestination destination;
+        boost::uintmax_t size;
+    };
+
+    OperationSink& m_sink;
+    winapi::shell::pidl::apidl_t m_destination_root;
+    boost::ptr_vector<SmallFile> m_batch;
+    boost::uintmax_t m_batch_bytes;
+};
+
+}}
+
+#endif
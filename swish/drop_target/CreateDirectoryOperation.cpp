@@ -90,6 +90,11 @@ void CreateDirectoryOperation::operator()(
     callback.update_progress(1, 1);
 }
 
+bool CreateDirectoryOperation::is_dependency_barrier() const
+{
+    return true;
+}
+
 Operation* CreateDirectoryOperation::do_clone() const
 {
     return new CreateDirectoryOperation(*this);
@@ -53,6 +53,11 @@ public:
         OperationCallback& callback,
         boost::shared_ptr<swish::provider::sftp_provider> provider) const;
 
+    /**
+     * Everything copied into the directory needs it to exist first.
+     */
+    virtual bool is_dependency_barrier() const;
+
 private:
 
     virtual Operation* do_clone() const;
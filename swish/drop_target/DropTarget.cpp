@@ -28,14 +28,20 @@
 #include "DropTarget.hpp"
 
 #include "swish/drop_target/PidlCopyPlan.hpp"
+#include "swish/drop_target/Progress.hpp"
+#include "swish/drop_target/TransferManager.hpp"
+#include "swish/host_folder/host_pidl.hpp" // find_host_itemid
 #include "swish/provider/sftp_provider.hpp" // sftp_provider, ISftpConsumer
+#include "swish/remote_folder/swish_pidl.hpp" // absolute_path_from_swish_pidl
 #include "swish/shell_folder/data_object/ShellDataObject.hpp"
                                                   // PidlFormat, ShellDataObject
 
 #include <winapi/com/catch.hpp> // WINAPI_COM_CATCH_AUTO_INTERFACE
 
+#include <boost/bind.hpp> // bind
+#include <boost/format.hpp> // wformat
 #include <boost/shared_ptr.hpp>  // shared_ptr
-#include <boost/thread.hpp>
+#include <boost/thread/once.hpp> // call_once
 #include <boost/throw_exception.hpp>  // BOOST_THROW_EXCEPTION
 
 #include <comet/error.h> // com_error
@@ -43,15 +49,25 @@
 #include <comet/ptr.h>  // com_ptr
 #include <comet/util.h> // auto_coinit
 
+#include <cstddef> // size_t
+#include <memory> // auto_ptr
+#include <string>
+
 using swish::shell_folder::data_object::ShellDataObject;
 using swish::shell_folder::data_object::PidlFormat;
+using swish::host_folder::find_host_itemid;
+using swish::host_folder::host_itemid_view;
 using swish::provider::sftp_provider;
+using swish::remote_folder::absolute_path_from_swish_pidl;
 
 using winapi::shell::pidl::pidl_t;
 using winapi::shell::pidl::apidl_t;
 
+using boost::bind;
+using boost::call_once;
+using boost::once_flag;
 using boost::shared_ptr;
-using boost::thread;
+using boost::wformat;
 
 using comet::auto_coinit;
 using comet::com_error;
@@ -59,6 +75,9 @@ using comet::com_ptr;
 using comet::GIT;
 using comet::GIT_cookie;
 
+using std::auto_ptr;
+using std::wstring;
+
 template<> struct comet::comtype<IAsyncOperation>
 {
     static const IID& uuid() throw() { return IID_IAsyncOperation; }
@@ -119,10 +138,142 @@ void copy_format_to_provider(
 
 namespace {
 
+/// Most drops copying at once, across all servers
+const std::size_t TRANSFER_WORKERS = 4;
+
+/**
+ * Most drops copying to any one server at once.
+ *
+ * No fewer than the workers: a drop that is queued has no progress window
+ * to say so, so no drop should wait just because another is going to the
+ * same server.  Their copy plans share the server's channels between them
+ * and make do with as many as it will open.
+ */
+const std::size_t TRANSFERS_PER_HOST = TRANSFER_WORKERS;
+
+once_flag transfer_manager_once;
+TransferManager* the_transfer_manager;
+
+void create_transfer_manager()
+{
+    the_transfer_manager = new TransferManager(
+        TRANSFER_WORKERS, TRANSFERS_PER_HOST);
+}
+
+/**
+ * The queue every asynchronous drop in this process joins.
+ *
+ * Never destroyed: destroying it waits for running transfers, which mustn't
+ * happen while the DLL is unloading.  Its workers stop by themselves once
+ * the queue has been idle for a while, and until then they keep COM from
+ * unloading the DLL.
+ */
+TransferManager& transfer_manager()
+{
+    call_once(transfer_manager_once, create_transfer_manager);
+    return *the_transfer_manager;
+}
+
+/**
+ * Server the transfer queue uses to limit concurrent drops.
+ */
+wstring host_key(const apidl_t& remote_directory)
+{
+    host_itemid_view host_itemid(*find_host_itemid(remote_directory));
+
+    return str(
+        wformat(L"%1%@%2%:%3%")
+        % host_itemid.user() % host_itemid.host() % host_itemid.port());
+}
+
+/**
+ * Progress that also reports the transfer queue pausing or cancelling the
+ * job.
+ */
+class QueuedJobProgress : public Progress
+{
+public:
+
+    QueuedJobProgress(auto_ptr<Progress> inner, JobControl& control)
+        : m_inner(inner), m_control(control) {}
+
+    virtual bool user_cancelled()
+    {
+        return m_control.cancelled() || m_inner->user_cancelled();
+    }
+
+    virtual bool user_paused()
+    {
+        return m_control.paused() || m_inner->user_paused();
+    }
+
+    virtual void line(DWORD index, const wstring& text)
+    {
+        m_inner->line(index, text);
+    }
+
+    virtual void line_path(DWORD index, const wstring& text)
+    {
+        m_inner->line_path(index, text);
+    }
+
+    virtual void update(ULONGLONG so_far, ULONGLONG out_of)
+    {
+        m_inner->update(so_far, out_of);
+    }
+
+    virtual void hide()
+    {
+        m_inner->hide();
+    }
+
+    virtual void show()
+    {
+        m_inner->show();
+    }
+
+private:
+    auto_ptr<Progress> m_inner;
+    JobControl& m_control;
+};
+
+/**
+ * Callback handing out progress that answers to the transfer queue.
+ */
+class QueuedJobCallback : public DropActionCallback
+{
+public:
+
+    QueuedJobCallback(
+        shared_ptr<DropActionCallback> inner, JobControl& control)
+        : m_inner(inner), m_control(control) {}
+
+    virtual bool can_overwrite(const boost::filesystem::wpath& target)
+    {
+        return m_inner->can_overwrite(target);
+    }
+
+    virtual auto_ptr<Progress> progress()
+    {
+        return auto_ptr<Progress>(
+            new QueuedJobProgress(m_inner->progress(), m_control));
+    }
+
+    virtual void handle_last_exception()
+    {
+        m_inner->handle_last_exception();
+    }
+
+private:
+    shared_ptr<DropActionCallback> m_inner;
+    JobControl& m_control;
+};
+
 void async_copy_format_to_provider(
     GIT_cookie<IDataObject> marshalling_cookie,
     shared_ptr<sftp_provider> provider,
-    apidl_t destination_root, shared_ptr<DropActionCallback> callback)
+    apidl_t destination_root, shared_ptr<DropActionCallback> callback,
+    JobControl& control)
 {
     auto_coinit com;
     GIT git;
@@ -136,9 +287,14 @@ void async_copy_format_to_provider(
     {
         try
         {
+            // Cancelled while still queued: we only run to tidy up
+            if (!control.checkpoint())
+                BOOST_THROW_EXCEPTION(com_error(E_ABORT));
+
             copy_format_to_provider(
                 PidlFormat(data_object), provider, destination_root,
-                callback);
+                shared_ptr<DropActionCallback>(
+                    new QueuedJobCallback(callback, control)));
         }
         catch (...)
         {
@@ -189,9 +345,13 @@ void copy_data_to_provider(
             GIT_cookie<IDataObject> marshalling_cookie =
                 git.register_interface(data_object);
 
-            thread(
-                &async_copy_format_to_provider, marshalling_cookie,
-                provider, remote_directory, callback).detach();
+            // Queued behind other drops, sharing the workers with them
+            transfer_manager().submit(
+                host_key(remote_directory),
+                absolute_path_from_swish_pidl(remote_directory).string(),
+                bind(
+                    &async_copy_format_to_provider, marshalling_cookie,
+                    provider, remote_directory, callback, _1));
         }
         else
         {
@@ -125,6 +125,14 @@ namespace {
             return m_inner.user_cancelled();
         }
 
+        /**
+         * The progress dialogue has no way to pause.
+         */
+        bool user_paused()
+        {
+            return false;
+        }
+
         // Because we are no longer doing the transfer in a different COM 
         // apartment, which would pump messages during the call, the UI blocks
         // on the drop.  That includes not showing the progress dialog.
@@ -302,6 +310,11 @@ public:
         return false;
     };
 
+    virtual bool user_paused()
+    {
+        return false;
+    };
+
     virtual void line(DWORD, const std::wstring&) {}
     virtual void line_path(DWORD, const std::wstring&) {}
     virtual void update(ULONGLONG, ULONGLONG) {}
@@ -89,6 +89,17 @@ public:
         boost::shared_ptr<swish::provider::sftp_provider> provider)
         const = 0;
 
+    /**
+     * Whether later operations may depend on this one having finished.
+     *
+     * Plans that run operations concurrently must not start anything after
+     * this operation until it has finished.
+     */
+    virtual bool is_dependency_barrier() const
+    {
+        return false;
+    }
+
     Operation* clone() const
     {
         Operation* item = do_clone();
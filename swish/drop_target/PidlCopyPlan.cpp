@@ -27,13 +27,15 @@
 #include "PidlCopyPlan.hpp"
 
 #include "swish/drop_target/CopyFileOperation.hpp"
+#include "swish/drop_target/CopyStrategy.hpp"
 #include "swish/drop_target/CreateDirectoryOperation.hpp"
 #include "swish/drop_target/RootedSource.hpp"
 #include "swish/provider/sftp_provider.hpp" // sftp_provider, ISftpConsumer
+#include "swish/shell_folder/shell.hpp" // size_of_stream
 
 #include <boost/bind.hpp> // bind
+#include <boost/cstdint.hpp> // uintmax_t
 #include <boost/filesystem/path.hpp> // wpath
-#include <boost/function_output_iterator.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/throw_exception.hpp>  // BOOST_THROW_EXCEPTION
 
@@ -42,10 +44,13 @@
 
 #include <comet/error.h> // com_error
 
+#include <cstddef> // size_t
 #include <string>
+#include <vector>
 
 using swish::provider::sftp_provider;
 using swish::shell_folder::data_object::PidlFormat;
+using swish::shell_folder::size_of_stream;
 
 using winapi::shell::bind_to_handler_object;
 using winapi::shell::pidl::apidl_t;
@@ -59,10 +64,11 @@ using comet::com_ptr;
 
 using boost::bind;
 using boost::filesystem::wpath;
-using boost::make_function_output_iterator;
 using boost::shared_ptr;
-using boost::ref;
+using boost::uintmax_t;
 
+using std::size_t;
+using std::vector;
 using std::wstring;
 
 namespace swish {
@@ -70,6 +76,24 @@ namespace drop_target {
 
 namespace {
 
+    /**
+     * Most files to copy at once, each on a channel of its own.
+     *
+     * Servers limit the channels per connection (OpenSSH allows 10 by
+     * default) and browsing and other operations need some of them too, so
+     * we may get fewer.
+     */
+    const size_t COPY_CONCURRENCY = 4;
+
+    /**
+     * Most operations planning may get ahead of copying by.
+     *
+     * Enough that the workers don't run dry while the planner enumerates a
+     * slow folder but not so many that a huge tree fills memory with
+     * operations before they are needed.
+     */
+    const size_t PLANNING_LOOKAHEAD = 256;
+
     /**
      * Return the name the copy should have at the target location.
      */
@@ -79,30 +103,31 @@ namespace {
             pidl_shell_item::friendly_name_type::relative);
     }
 
-    template<typename OutIt>
+    void output_operations_for_pidl(
+        const RootedSource& source, const SftpDestination& destination,
+        CopyStrategy& strategy);
+
     void output_operations_for_stream_pidl(
         const RootedSource& source, const SftpDestination& destination,
-        OutIt output_iterator)
+        uintmax_t size, CopyStrategy& strategy)
     {
         wpath new_name = target_name_from_source(source);
 
         SftpDestination new_destination = destination / new_name;
 
-        CopyFileOperation operation(source, new_destination);
-
-        *output_iterator++ = operation;
+        strategy.add_file(source, new_destination, size);
     }
 
-    template<typename OutIt>
     void output_operations_for_folder_pidl(
         com_ptr<IShellFolder> folder, const RootedSource& source,
-        const SftpDestination& destination, OutIt output_iterator)
+        const SftpDestination& destination, CopyStrategy& strategy)
     {
         wpath new_name = target_name_from_source(source);
 
         SftpDestination new_destination = destination / new_name;
 
-        *output_iterator++ = CreateDirectoryOperation(source, new_destination);
+        strategy.add_directory(
+            CreateDirectoryOperation(source, new_destination));
 
         com_ptr<IEnumIDList> e;
         HRESULT hr = folder->EnumObjects(
@@ -116,15 +141,15 @@ namespace {
         while (hr == S_OK && e->Next(1, item.out(), NULL) == S_OK)
         {
             output_operations_for_pidl(
-                source / item, new_destination, output_iterator);
+                source / item, new_destination, strategy);
         }
     }
 
-    template<typename OutIt>
     void output_operations_for_pidl(
         const RootedSource& source, const SftpDestination& destination,
-        OutIt output_iterator)
+        CopyStrategy& strategy)
     {
+        uintmax_t size;
         try
         {
             /*
@@ -132,12 +157,10 @@ namespace {
             We don't use this stream to perform the operation as that would
             mean large transfers keeping open a large number of file handles
             while building the copy plan - a bad idea, especially if the files
-            are on another remote server
+            are on another remote server.  We do take its size, though, to
+            decide how to copy it.
             */
-            stream_from_pidl(source.pidl());
-
-            output_operations_for_stream_pidl(
-                source, destination, output_iterator);
+            size = size_of_stream(stream_from_pidl(source.pidl()));
         }
         catch (const com_error&)
         {
@@ -149,8 +172,45 @@ namespace {
                 bind_to_handler_object<IShellFolder>(source.pidl());
 
             output_operations_for_folder_pidl(
-                folder, source, destination, output_iterator);
+                folder, source, destination, strategy);
+            return;
         }
+
+        output_operations_for_stream_pidl(source, destination, size, strategy);
+    }
+
+    /**
+     * Expand the top-level PIDLs into operations for all items in the
+     * hierarchy.
+     *
+     * Runs while the plan executes so the items found first are copied
+     * while the rest of the hierarchy is still being enumerated.
+     */
+    void plan_copy(
+        const apidl_t& parent_folder, const vector<pidl_t>& files,
+        const apidl_t& destination_root, OperationSink& sink)
+    {
+        CopyStrategy strategy(sink, destination_root);
+
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            output_operations_for_pidl(
+                RootedSource(parent_folder, files[i]),
+                SftpDestination(destination_root, wpath()), strategy);
+        }
+
+        strategy.flush();
+    }
+
+    vector<pidl_t> relative_files(const PidlFormat& source_format)
+    {
+        vector<pidl_t> files;
+        for (unsigned int i = 0; i < source_format.pidl_count(); ++i)
+        {
+            files.push_back(source_format.relative_file(i));
+        }
+
+        return files;
     }
 
 }
@@ -158,27 +218,26 @@ namespace {
 /**
  * Create plan to copy items represented by clipboard PIDL format.
  *
- * Expands the top-level PIDLs into a list of all items in the hierarchy.
+ * The hierarchy below the top-level PIDLs is not expanded here but while
+ * the plan executes, alongside the copying.
  */
 PidlCopyPlan::PidlCopyPlan(
     const PidlFormat& source_format, const apidl_t& destination_root)
-{
-    for (unsigned int i = 0; i < source_format.pidl_count(); ++i)
-    {
-        apidl_t pidl = source_format.file(i);
-
-        output_operations_for_pidl(
-            RootedSource(
-                source_format.parent_folder(), source_format.relative_file(i)),
-            SftpDestination(destination_root, wpath()),
-            make_function_output_iterator(
-                bind(&SequentialPlan::add_stage, ref(m_plan), _1)));
-    }
-}
+    :
+    m_plan(
+        COPY_CONCURRENCY,
+        bind(
+            &plan_copy, source_format.parent_folder(),
+            relative_files(source_format), destination_root, _1),
+        PLANNING_LOOKAHEAD)
+{}
 
 void PidlCopyPlan::execute_plan(
     DropActionCallback& callback, shared_ptr<sftp_provider> provider) const
 {
+    // One notifier for all the plan's uploads
+    shared_ptr<void> notifier = CopyFileOperation::hold_shell_notifier();
+
     m_plan.execute_plan(callback, provider);
 }
 
@@ -28,9 +28,9 @@
 #define SWISH_DROP_TARGET_PIDLCOPYPLAN_HPP
 #pragma once
 
+#include "swish/drop_target/ConcurrentPlan.hpp"
 #include "swish/drop_target/Operation.hpp"
 #include "swish/drop_target/Plan.hpp"
-#include "swish/drop_target/SequentialPlan.hpp"
 #include "swish/provider/sftp_provider.hpp"
 #include "swish/shell_folder/data_object/ShellDataObject.hpp"  // PidlFormat
 
@@ -62,7 +62,7 @@ public:
 
 private:
 
-    SequentialPlan m_plan;
+    ConcurrentPlan m_plan;
 };
 
 }}
@@ -38,6 +38,7 @@ class Progress
 public:
     virtual ~Progress() {}
     virtual bool user_cancelled() = 0;
+    virtual bool user_paused() = 0;
     virtual void line(DWORD index, const std::wstring& text) = 0;
     virtual void line_path(DWORD index, const std::wstring& text) = 0;
     virtual void update(ULONGLONG so_far, ULONGLONG out_of) = 0;
@@ -31,9 +31,11 @@
 #include "swish/drop_target/Operation.hpp"
 
 #include <boost/cstdint.hpp> // uintmax_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // milliseconds
 #include <boost/filesystem/path.hpp> // wpath
 #include <boost/numeric/conversion/cast.hpp> // numeric_cast
 #include <boost/shared_array.hpp>
+#include <boost/thread/thread.hpp> // this_thread
 #include <boost/throw_exception.hpp>  // BOOST_THROW_EXCEPTION
 
 #include <comet/error.h> // com_error
@@ -48,6 +50,7 @@ using comet::com_ptr;
 
 using boost::filesystem::wpath;
 using boost::numeric_cast;
+using boost::posix_time::milliseconds;
 using boost::shared_ptr;
 using boost::uintmax_t;
 
@@ -59,6 +62,11 @@ namespace drop_target {
 
 namespace {
 
+    /**
+     * How often a paused sequence checks whether it may carry on.
+     */
+    const long PAUSE_POLL_MILLISECONDS = 100;
+
     /**
      * Calculate percentage.
      *
@@ -174,6 +182,13 @@ namespace {
         {
             if (m_progress.get())
             {
+                while (m_progress->user_paused() &&
+                    !m_progress->user_cancelled())
+                {
+                    boost::this_thread::sleep(
+                        milliseconds(PAUSE_POLL_MILLISECONDS));
+                }
+
                 if (m_progress->user_cancelled())
                     BOOST_THROW_EXCEPTION(com_error(E_ABORT));
             }
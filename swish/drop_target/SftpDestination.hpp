@@ -126,6 +126,14 @@ public:
         return SftpDestination(m_remote_root, m_relative_path / path);
     }
 
+    /**
+     * Path of the destination below the root.
+     */
+    const boost::filesystem::wpath& relative_path() const
+    {
+        return m_relative_path;
+    }
+
     std::wstring root_name() const
     {
         using winapi::shell::pidl_shell_item;
@@ -0,0 +1,446 @@
+/**
+    @file
+
+    Operation uploading a batch of small files as one tar stream.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "TarUploadOperation.hpp"
+
+#include "swish/block_transfer.hpp" // byte_source, byte_sink
+#include "swish/drop_target/CopyFileOperation.hpp"
+#include "swish/drop_target/SftpDestination.hpp"
+#include "swish/remote_folder/swish_pidl.hpp" // absolute_path_from_swish_pidl
+#include "swish/shell_folder/shell.hpp" // size_of_stream
+#include "swish/tar.hpp" // tar_writer
+#include "swish/utils.hpp" // WideStringToUtf8String
+
+#include <winapi/shell/shell.hpp> // stream_from_pidl
+#include <winapi/trace.hpp> // trace
+
+#include <comet/error.h> // com_error
+#include <comet/ptr.h> // com_ptr
+
+#include <boost/bind.hpp> // bind
+#include <boost/foreach.hpp> // BOOST_FOREACH
+#include <boost/locale/message.hpp> // translate
+#include <boost/locale/format.hpp> // wformat
+#include <boost/numeric/conversion/cast.hpp> // numeric_cast
+#include <boost/throw_exception.hpp>  // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // max, replace
+#include <ctime> // time
+#include <exception>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using swish::block_transfer::byte_sink;
+using swish::block_transfer::byte_source;
+using swish::provider::directory_listing;
+using swish::provider::sftp_filesystem_item;
+using swish::provider::sftp_provider;
+using swish::remote_folder::absolute_path_from_swish_pidl;
+using swish::shell_folder::size_of_stream;
+using swish::tar::tar_writer;
+using swish::utils::WideStringToUtf8String;
+
+using winapi::shell::pidl::apidl_t;
+using winapi::shell::stream_from_pidl;
+using winapi::trace;
+
+using comet::com_error;
+using comet::com_ptr;
+
+using boost::bind;
+using boost::filesystem::wpath;
+using boost::locale::translate;
+using boost::locale::wformat;
+using boost::numeric_cast;
+using boost::ptr_vector;
+using boost::ref;
+using boost::shared_ptr;
+using boost::uintmax_t;
+
+using std::exception;
+using std::map;
+using std::set;
+using std::size_t;
+using std::string;
+using std::vector;
+using std::wstring;
+
+namespace swish {
+namespace drop_target {
+
+namespace {
+
+    /**
+     * Name a file has in the archive: its path below the directory the
+     * archive is unpacked in, '/'-separated and UTF-8.
+     */
+    string archive_name(const wpath& relative_path)
+    {
+        wstring name = relative_path.string();
+        std::replace(name.begin(), name.end(), L'\\', L'/');
+
+        return WideStringToUtf8String(name);
+    }
+
+    /**
+     * Shows the progress of the batch as a whole to the user.
+     *
+     * Whatever is copying the batch reports the progress of each file in
+     * turn, as though it were the only one.
+     */
+    class BatchProgress : public OperationCallback
+    {
+    public:
+
+        BatchProgress(OperationCallback& callback, uintmax_t total)
+            : m_callback(callback), m_total(total), m_finished(0) {}
+
+        virtual void check_if_user_cancelled() const
+        {
+            m_callback.check_if_user_cancelled();
+        }
+
+        virtual bool request_overwrite_permission(const wpath& target) const
+        {
+            return m_callback.request_overwrite_permission(target);
+        }
+
+        virtual void update_progress(uintmax_t so_far, uintmax_t /*out_of*/)
+        {
+            // Files may have grown since the batch was planned
+            uintmax_t done = m_finished + so_far;
+            m_callback.update_progress(done, (std::max)(done, m_total));
+        }
+
+        void file_finished(uintmax_t size)
+        {
+            m_finished += size;
+        }
+
+    private:
+        OperationCallback& m_callback;
+        uintmax_t m_total;
+        uintmax_t m_finished;
+    };
+
+    /**
+     * Contents of a local file going into the archive.
+     *
+     * Reading is where the time goes, so this is where cancellation is
+     * checked and progress reported.
+     */
+    class ArchivedFileSource : public byte_source
+    {
+    public:
+
+        ArchivedFileSource(com_ptr<IStream> stream, BatchProgress& progress)
+            : m_stream(stream), m_progress(progress), m_read(0) {}
+
+        virtual size_t read(char* buffer, size_t size)
+        {
+            m_progress.check_if_user_cancelled();
+
+            ULONG count = 0;
+            HRESULT hr = m_stream->Read(
+                buffer, numeric_cast<ULONG>(size), &count);
+            if (FAILED(hr))
+                BOOST_THROW_EXCEPTION(com_error_from_interface(m_stream, hr));
+
+            m_read += count;
+
+            // A failure to update the progress isn't a good enough reason
+            // to abort the copy so we swallow the exception.
+            try
+            {
+                m_progress.update_progress(m_read, 0);
+            }
+            catch (const exception& e)
+            {
+                trace("Progress update threw exception: %s") % e.what();
+            }
+
+            return count;
+        }
+
+    private:
+        com_ptr<IStream> m_stream;
+        BatchProgress& m_progress;
+        uintmax_t m_read;
+    };
+
+    /**
+     * Names of everything in a remote directory.
+     *
+     * @returns  false if the directory can't be listed.
+     */
+    bool existing_names(
+        sftp_provider& provider, const wpath& directory, set<wstring>& names)
+    {
+        try
+        {
+            directory_listing listing = provider.listing(directory);
+            BOOST_FOREACH(const sftp_filesystem_item& item, listing)
+            {
+                names.insert(item.filename().string());
+            }
+        }
+        catch (const exception& e)
+        {
+            trace("Unable to list directory to check for overwrites: %s")
+                % e.what();
+            return false;
+        }
+
+        return true;
+    }
+
+}
+
+TarUploadOperation::TarUploadOperation(const apidl_t& remote_root)
+    : m_remote_root(remote_root) {}
+
+void TarUploadOperation::add_file(
+    const RootedSource& source, const wpath& relative_path, uintmax_t size)
+{
+    m_files.push_back(new BatchedFile(source, relative_path, size));
+}
+
+size_t TarUploadOperation::file_count() const
+{
+    return m_files.size();
+}
+
+std::wstring TarUploadOperation::title() const
+{
+    return (wformat(
+        translate(
+            L"Top line of a transfer progress window saying how many "
+            L"files are being copied together. {1} is replaced with the "
+            L"number of files and must be included in your translation.",
+            L"Copying {1} files"))
+        % m_files.size()).str();
+}
+
+std::wstring TarUploadOperation::description() const
+{
+    return (wformat(
+        translate(
+            L"Second line of a transfer progress window giving the destination "
+            L"directory. {1} is replaced with the directory path and must be "
+            L"included in your translation.",
+            L"To '{1}'"))
+        % SftpDestination(m_remote_root, wpath()).root_name()).str();
+}
+
+namespace {
+
+    /**
+     * Split the batch into the files that are new to the server and those
+     * that might already be there.
+     *
+     * tar replaces an existing file with a new one, losing its permissions,
+     * ownership and links, where an SFTP copy writes into it.  So only new
+     * files may go into the archive.  A directory we can't list might have
+     * anything in it, so all its files are treated as already there.
+     *
+     * Each destination directory is listed once for the whole batch rather
+     * than probing for every file.
+     */
+    template<typename File>
+    void split_new_from_existing(
+        const ptr_vector<File>& files, const wpath& root,
+        sftp_provider& provider, vector<const File*>& new_files,
+        vector<const File*>& existing_files)
+    {
+        typedef map< wpath, set<wstring> > listing_cache;
+        listing_cache directories;
+        set<wpath> unlistable;
+
+        for (typename ptr_vector<File>::const_iterator it = files.begin();
+            it != files.end(); ++it)
+        {
+            wpath target = root / it->relative_path;
+            wpath directory = target.parent_path();
+
+            if (directories.find(directory) == directories.end() &&
+                unlistable.find(directory) == unlistable.end())
+            {
+                if (!existing_names(
+                    provider, directory, directories[directory]))
+                {
+                    directories.erase(directory);
+                    unlistable.insert(directory);
+                }
+            }
+
+            listing_cache::const_iterator names = directories.find(directory);
+            if (names == directories.end() ||
+                names->second.find(target.filename()) != names->second.end())
+            {
+                existing_files.push_back(&*it);
+            }
+            else
+            {
+                new_files.push_back(&*it);
+            }
+        }
+    }
+
+    /**
+     * Write the archive of the files to the server's tar.
+     *
+     * Called on the operation's thread, so local streams are only ever
+     * used on the thread that opened them.  Nothing here waits on the
+     * user, as the server's tar is already running.
+     */
+    template<typename File>
+    void write_archive(
+        const vector<const File*>& files, const wpath& root,
+        BatchProgress& progress, set<wpath>& updated_directories,
+        byte_sink& sink)
+    {
+        typedef vector<const File*> file_list;
+
+        // Unpacked files get the time they arrive, like files copied over
+        // SFTP, so this is only here to keep the archive well-formed
+        std::time_t now = std::time(NULL);
+
+        tar_writer archive(sink);
+        for (typename file_list::const_iterator it = files.begin();
+            it != files.end(); ++it)
+        {
+            com_ptr<IStream> stream = stream_from_pidl((*it)->source.pidl());
+            uintmax_t size = size_of_stream(stream);
+
+            ArchivedFileSource source(stream, progress);
+            archive.add_file(
+                archive_name((*it)->relative_path), size, now, source);
+
+            progress.file_finished(size);
+            updated_directories.insert(
+                (root / (*it)->relative_path).parent_path());
+        }
+
+        archive.finish();
+    }
+
+    /**
+     * Copy files over SFTP, one at a time, as if they had never been
+     * batched.
+     *
+     * The copy asks the user itself before overwriting anything.
+     */
+    template<typename File>
+    void copy_individually(
+        const vector<const File*>& files, const apidl_t& remote_root,
+        BatchProgress& progress, shared_ptr<sftp_provider> provider)
+    {
+        typedef vector<const File*> file_list;
+
+        for (typename file_list::const_iterator it = files.begin();
+            it != files.end(); ++it)
+        {
+            CopyFileOperation copy(
+                (*it)->source,
+                SftpDestination(remote_root, (*it)->relative_path));
+            copy(progress, provider);
+
+            progress.file_finished((*it)->size);
+        }
+    }
+
+}
+
+void TarUploadOperation::operator()(
+    OperationCallback& callback, shared_ptr<sftp_provider> provider) const
+{
+    typedef vector<const BatchedFile*> file_list;
+
+    BatchProgress progress(callback, total_size());
+
+    wpath root = absolute_path_from_swish_pidl(m_remote_root);
+
+    file_list new_files;
+    file_list existing_files;
+    split_new_from_existing(
+        m_files, root, *provider, new_files, existing_files);
+
+    // Before starting tar, so that it isn't left waiting while the user
+    // answers any questions about overwriting
+    copy_individually(existing_files, m_remote_root, progress, provider);
+
+    if (new_files.empty())
+        return;
+
+    set<wpath> updated_directories;
+    bool extracted = provider->extract_archive(
+        root,
+        bind(
+            &write_archive<BatchedFile>,
+            ref(new_files), root, ref(progress), ref(updated_directories),
+            _1));
+
+    if (!extracted)
+    {
+        copy_individually(new_files, m_remote_root, progress, provider);
+        return;
+    }
+
+    BOOST_FOREACH(const BatchedFile* file, new_files)
+    {
+        resolved_destination target =
+            SftpDestination(m_remote_root, file->relative_path)
+            .resolve_destination();
+
+        // Only once per directory
+        if (updated_directories.erase(target.as_absolute_path().parent_path()))
+        {
+            ::SHChangeNotify(
+                SHCNE_UPDATEDIR, SHCNF_IDLIST | SHCNF_FLUSHNOWAIT,
+                target.directory().get(), NULL);
+        }
+    }
+}
+
+uintmax_t TarUploadOperation::total_size() const
+{
+    uintmax_t total = 0;
+    BOOST_FOREACH(const BatchedFile& file, m_files)
+    {
+        total += file.size;
+    }
+
+    return total;
+}
+
+Operation* TarUploadOperation::do_clone() const
+{
+    return new TarUploadOperation(*this);
+}
+
+}}
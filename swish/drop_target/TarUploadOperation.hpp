@@ -0,0 +1,115 @@
+/**
+    @file
+
+    Operation uploading a batch of small files as one tar stream.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#ifndef SWISH_DROP_TARGET_TARUPLOADOPERATION_HPP
+#define SWISH_DROP_TARGET_TARUPLOADOPERATION_HPP
+#pragma once
+
+#include "swish/drop_target/Operation.hpp"
+#include "swish/drop_target/RootedSource.hpp"
+#include "swish/provider/sftp_provider.hpp"
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/filesystem/path.hpp> // wpath
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <winapi/shell/pidl.hpp> // apidl_t
+
+#include <cstddef> // size_t
+
+namespace swish {
+namespace drop_target {
+
+/**
+ * Copy many small files by unpacking a tar archive of them on the server.
+ *
+ * Per-file SFTP costs several round trips for every file, which dominates
+ * when the files are small.  Streaming them instead to the server's tar
+ * costs one round trip for the lot.  Servers that won't run tar for us get
+ * the files copied one at a time, as if they had never been batched.
+ *
+ * Only files new to the server go into the archive.  Those already there
+ * are copied individually, which asks before overwriting them and writes
+ * into the existing file rather than replacing it.
+ */
+class TarUploadOperation : public Operation
+{
+public:
+
+    explicit TarUploadOperation(
+        const winapi::shell::pidl::apidl_t& remote_root);
+
+    /**
+     * Include a file in the batch.
+     *
+     * @param relative_path  Destination below the remote root.  Directories
+     *                       on the path must exist before the operation runs.
+     * @param size           Expected size, used only to show progress.
+     */
+    void add_file(
+        const RootedSource& source,
+        const boost::filesystem::wpath& relative_path,
+        boost::uintmax_t size);
+
+    std::size_t file_count() const;
+
+public: // Operation
+
+    virtual std::wstring title() const;
+
+    virtual std::wstring description() const;
+
+    virtual void operator()(
+        OperationCallback& callback,
+        boost::shared_ptr<swish::provider::sftp_provider> provider) const;
+
+private:
+
+    struct BatchedFile
+    {
+        BatchedFile(
+            const RootedSource& source,
+            const boost::filesystem::wpath& relative_path,
+            boost::uintmax_t size)
+            : source(source), relative_path(relative_path), size(size) {}
+
+        RootedSource source;
+        boost::filesystem::wpath relative_path;
+        boost::uintmax_t size;
+    };
+
+    virtual Operation* do_clone() const;
+
+    boost::uintmax_t total_size() const;
+
+    winapi::shell::pidl::apidl_t m_remote_root;
+    boost::ptr_vector<BatchedFile> m_files;
+};
+
+}}
+
+#endif
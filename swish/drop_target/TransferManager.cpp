@@ -0,0 +1,467 @@
+/**
+    @file
+
+    Queue of transfers shared by every drop in the process.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+
+#include "TransferManager.hpp"
+
+#include "swish/module_lock.hpp"
+
+#include <boost/bind.hpp> // bind
+#include <boost/make_shared.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/throw_exception.hpp>  // BOOST_THROW_EXCEPTION
+
+#include <stdexcept> // invalid_argument
+
+using swish::module_lock;
+
+using boost::adopt_lock;
+using boost::bind;
+using boost::mutex;
+using boost::posix_time::time_duration;
+using boost::shared_ptr;
+using boost::thread;
+
+using std::invalid_argument;
+using std::map;
+using std::size_t;
+using std::vector;
+using std::wstring;
+
+namespace swish {
+namespace drop_target {
+
+class TransferManager::JobRecord
+{
+public:
+    JobRecord(
+        JobId id, const wstring& host, const wstring& description,
+        const Job& job)
+        :
+        id(id), host(host), description(description), job(job),
+        paused(false), cancelled(false) {}
+
+    const JobId id;
+    const wstring host;
+    const wstring description;
+    const Job job;
+
+    bool paused;
+    bool cancelled;
+};
+
+class TransferManager::Control : public JobControl
+{
+public:
+    Control(TransferManager& manager, shared_ptr<JobRecord> job)
+        : m_manager(manager), m_job(job) {}
+
+    virtual bool checkpoint()
+    {
+        mutex::scoped_lock lock(m_manager.m_mutex);
+
+        while (m_job->paused && !stopped())
+        {
+            m_manager.m_changed.wait(lock);
+        }
+
+        return !stopped();
+    }
+
+    virtual bool paused()
+    {
+        mutex::scoped_lock lock(m_manager.m_mutex);
+
+        return m_job->paused && !stopped();
+    }
+
+    virtual bool cancelled()
+    {
+        mutex::scoped_lock lock(m_manager.m_mutex);
+
+        return stopped();
+    }
+
+private:
+
+    bool stopped() const
+    {
+        return m_job->cancelled || m_manager.m_stopping;
+    }
+
+    TransferManager& m_manager;
+    shared_ptr<JobRecord> m_job;
+};
+
+TransferManager::TransferManager(
+    size_t worker_limit, size_t host_limit, time_duration idle_timeout)
+    :
+    m_worker_limit(worker_limit), m_default_host_limit(host_limit),
+    m_idle_timeout(idle_timeout), m_next_id(0), m_workers(0),
+    m_idle_workers(0), m_stopping(false)
+{
+    if (worker_limit < 1 || host_limit < 1)
+        BOOST_THROW_EXCEPTION(
+            invalid_argument("Transfers need at least one worker"));
+}
+
+TransferManager::~TransferManager()
+{
+    mutex::scoped_lock lock(m_mutex);
+
+    m_stopping = true;
+    m_changed.notify_all();
+
+    // Queued jobs still have to run to tidy up
+    start_workers();
+
+    while (m_workers > 0)
+    {
+        m_changed.wait(lock);
+    }
+}
+
+TransferManager::JobId TransferManager::submit(
+    const wstring& host, const wstring& description, const Job& job)
+{
+    mutex::scoped_lock lock(m_mutex);
+
+    JobId id = ++m_next_id;
+    m_queue.push_back(
+        boost::make_shared<JobRecord>(id, host, description, job));
+
+    start_workers();
+
+    return id;
+}
+
+void TransferManager::pause(JobId job)
+{
+    mutex::scoped_lock lock(m_mutex);
+
+    shared_ptr<JobRecord> record = find(job);
+    if (record)
+        record->paused = true;
+}
+
+void TransferManager::resume(JobId job)
+{
+    mutex::scoped_lock lock(m_mutex);
+
+    shared_ptr<JobRecord> record = find(job);
+    if (record)
+    {
+        record->paused = false;
+        m_changed.notify_all();
+        start_workers();
+    }
+}
+
+void TransferManager::cancel(JobId job)
+{
+    mutex::scoped_lock lock(m_mutex);
+
+    shared_ptr<JobRecord> record = find(job);
+    if (record)
+    {
+        record->cancelled = true;
+        m_changed.notify_all();
+        start_workers();
+    }
+}
+
+void TransferManager::move_to_front(JobId job)
+{
+    mutex::scoped_lock lock(m_mutex);
+
+    JobList::iterator pos = find_queued(job);
+    if (pos != m_queue.end())
+        m_queue.splice(m_queue.begin(), m_queue, pos);
+}
+
+void TransferManager::move_to_back(JobId job)
+{
+    mutex::scoped_lock lock(m_mutex);
+
+    JobList::iterator pos = find_queued(job);
+    if (pos != m_queue.end())
+        m_queue.splice(m_queue.end(), m_queue, pos);
+}
+
+void TransferManager::set_host_limit(const wstring& host, size_t limit)
+{
+    if (limit < 1)
+        BOOST_THROW_EXCEPTION(
+            invalid_argument("Host must be allowed at least one job"));
+
+    mutex::scoped_lock lock(m_mutex);
+
+    m_host_limits[host] = limit;
+
+    m_changed.notify_all();
+    start_workers();
+}
+
+vector<TransferManager::JobStatus> TransferManager::jobs() const
+{
+    mutex::scoped_lock lock(m_mutex);
+
+    vector<JobStatus> statuses;
+
+    for (JobList::const_iterator it = m_running.begin();
+        it != m_running.end(); ++it)
+    {
+        JobStatus status;
+        status.id = (*it)->id;
+        status.host = (*it)->host;
+        status.description = (*it)->description;
+        status.state = ((*it)->paused) ? JOB_PAUSED : JOB_RUNNING;
+        statuses.push_back(status);
+    }
+
+    for (JobList::const_iterator it = m_queue.begin();
+        it != m_queue.end(); ++it)
+    {
+        JobStatus status;
+        status.id = (*it)->id;
+        status.host = (*it)->host;
+        status.description = (*it)->description;
+        status.state = ((*it)->paused) ? JOB_PAUSED : JOB_QUEUED;
+        statuses.push_back(status);
+    }
+
+    return statuses;
+}
+
+void TransferManager::wait(JobId job) const
+{
+    mutex::scoped_lock lock(m_mutex);
+
+    while (find(job))
+    {
+        m_changed.wait(lock);
+    }
+}
+
+/**
+ * Run jobs until there are none left to run or the worker has waited too
+ * long for one.
+ */
+void TransferManager::worker()
+{
+    // Taken by start_workers.  Declared before the lock so that it is the
+    // last thing we let go of.
+    module_lock module(adopt_lock);
+
+    mutex::scoped_lock lock(m_mutex);
+
+    --m_idle_workers; // counted as idle since it was started
+
+    bool timed_out = false;
+    for (;;)
+    {
+        shared_ptr<JobRecord> job = take_next_job();
+        if (!job)
+        {
+            if (m_stopping || timed_out)
+                break;
+
+            ++m_idle_workers;
+            timed_out = !m_changed.timed_wait(lock, m_idle_timeout);
+            --m_idle_workers;
+            continue;
+        }
+
+        timed_out = false;
+
+        m_running.push_back(job);
+        ++m_host_running[job->host];
+
+        lock.unlock();
+        run(job);
+        lock.lock();
+
+        m_running.remove(job);
+        if (--m_host_running[job->host] == 0)
+            m_host_running.erase(job->host);
+
+        m_changed.notify_all();
+    }
+
+    --m_workers;
+    m_changed.notify_all();
+}
+
+void TransferManager::run(shared_ptr<JobRecord> job)
+{
+    Control control(*this, job);
+
+    try
+    {
+        job->job(control);
+    }
+    catch (...)
+    {
+        // Jobs report their own errors.  This just keeps the worker alive.
+    }
+}
+
+/**
+ * Take the first job in the queue that can run now.
+ *
+ * Cancelled jobs come first, whatever the limits, as they only have to
+ * tidy up.
+ */
+shared_ptr<TransferManager::JobRecord> TransferManager::take_next_job()
+{
+    for (JobList::iterator it = m_queue.begin(); it != m_queue.end(); ++it)
+    {
+        if (is_cancelled(**it))
+        {
+            shared_ptr<JobRecord> job = *it;
+            m_queue.erase(it);
+            return job;
+        }
+    }
+
+    if (m_running.size() >= m_worker_limit)
+        return shared_ptr<JobRecord>();
+
+    for (JobList::iterator it = m_queue.begin(); it != m_queue.end(); ++it)
+    {
+        if (is_runnable(**it))
+        {
+            shared_ptr<JobRecord> job = *it;
+            m_queue.erase(it);
+            return job;
+        }
+    }
+
+    return shared_ptr<JobRecord>();
+}
+
+/**
+ * Start enough workers for the jobs that can run now, if allowed.
+ */
+void TransferManager::start_workers()
+{
+    // Count as if starting the jobs one by one so that jobs for a host at
+    // its limit don't count
+    map<wstring, size_t> host_running = m_host_running;
+    size_t runnable = 0;
+    size_t cancelled = 0;
+    for (JobList::const_iterator it = m_queue.begin(); it != m_queue.end();
+        ++it)
+    {
+        const JobRecord& job = **it;
+        if (is_cancelled(job))
+        {
+            ++cancelled;
+        }
+        else if (!job.paused &&
+            host_running[job.host] < host_limit(job.host))
+        {
+            ++runnable;
+            ++host_running[job.host];
+        }
+    }
+
+    // Cancelled jobs get workers beyond the limit so that tidying up
+    // doesn't wait behind running jobs
+    while (runnable + cancelled > m_idle_workers &&
+        m_workers < m_worker_limit + cancelled)
+    {
+        ++m_workers;
+        ++m_idle_workers;
+
+        // Each worker keeps the DLL loaded until it finishes, as nothing
+        // waits for it
+        module_lock module;
+        thread(bind(&TransferManager::worker, this)).detach();
+        module.release();
+    }
+
+    m_changed.notify_all();
+}
+
+size_t TransferManager::host_limit(const wstring& host) const
+{
+    map<wstring, size_t>::const_iterator limit = m_host_limits.find(host);
+    return (limit != m_host_limits.end()) ?
+        limit->second : m_default_host_limit;
+}
+
+bool TransferManager::is_cancelled(const JobRecord& job) const
+{
+    return job.cancelled || m_stopping;
+}
+
+bool TransferManager::is_runnable(const JobRecord& job) const
+{
+    if (is_cancelled(job))
+        return true;
+
+    if (job.paused)
+        return false;
+
+    map<wstring, size_t>::const_iterator running =
+        m_host_running.find(job.host);
+    size_t count = (running != m_host_running.end()) ? running->second : 0;
+
+    return count < host_limit(job.host);
+}
+
+TransferManager::JobList::iterator TransferManager::find_queued(JobId job)
+{
+    for (JobList::iterator it = m_queue.begin(); it != m_queue.end(); ++it)
+    {
+        if ((*it)->id == job)
+            return it;
+    }
+
+    return m_queue.end();
+}
+
+shared_ptr<TransferManager::JobRecord> TransferManager::find(JobId job) const
+{
+    for (JobList::const_iterator it = m_running.begin();
+        it != m_running.end(); ++it)
+    {
+        if ((*it)->id == job)
+            return *it;
+    }
+
+    for (JobList::const_iterator it = m_queue.begin();
+        it != m_queue.end(); ++it)
+    {
+        if ((*it)->id == job)
+            return *it;
+    }
+
+    return shared_ptr<JobRecord>();
+}
+
+}} // namespace swish::drop_target
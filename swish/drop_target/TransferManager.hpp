@@ -0,0 +1,213 @@
+/**
+    @file
+
+    Queue of transfers shared by every drop in the process.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+
+#ifndef SWISH_DROP_TARGET_TRANSFERMANAGER_HPP
+#define SWISH_DROP_TARGET_TRANSFERMANAGER_HPP
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // time_duration
+#include <boost/function.hpp> // function
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cstddef> // size_t
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace swish {
+namespace drop_target {
+
+/**
+ * A running job's line back to the manager.
+ */
+class JobControl
+{
+public:
+
+    /**
+     * Somewhere the job can safely stop for a while.
+     *
+     * Blocks while the job is paused.
+     *
+     * @returns  false if the job has been cancelled and should stop.
+     */
+    virtual bool checkpoint() = 0;
+
+    /**
+     * Whether the job has been asked to pause, without waiting.
+     *
+     * For jobs whose own threads must be told to hold before the job can
+     * stop at a checkpoint.
+     */
+    virtual bool paused() = 0;
+
+    /**
+     * Whether the job has been cancelled, without waiting.
+     */
+    virtual bool cancelled() = 0;
+
+protected:
+    ~JobControl() {}
+};
+
+/**
+ * Runs transfer jobs from a single queue on a shared pool of threads.
+ *
+ * Jobs start in the order they are queued, as long as there is a free
+ * worker and their host isn't already running as many jobs as it is
+ * allowed.  Queued jobs can be reordered, and any job can be paused,
+ * resumed or cancelled.  A running job pauses, or notices that it has been
+ * cancelled, at its next checkpoint.
+ *
+ * Every job runs exactly once, even if cancelled before it starts, so that
+ * it can always tidy up.  Jobs should check in at a checkpoint before
+ * doing anything.  They report their own errors: anything that escapes a
+ * job is dropped.
+ *
+ * Workers are started as jobs need them and stop once they have been idle
+ * for a while, so an idle manager holds no threads.
+ */
+class TransferManager : private boost::noncopyable
+{
+public:
+
+    typedef unsigned long JobId;
+
+    typedef boost::function<void (JobControl&)> Job;
+
+    enum JobState
+    {
+        JOB_QUEUED,
+        JOB_RUNNING,
+        JOB_PAUSED
+    };
+
+    struct JobStatus
+    {
+        JobId id;
+        std::wstring host;
+        std::wstring description;
+        JobState state;
+    };
+
+    /**
+     * @param worker_limit  Most jobs to run at once, across all hosts.
+     * @param host_limit    Most jobs to run at once against any one host,
+     *                      unless set otherwise for that host.
+     * @param idle_timeout  How long a worker waits for a job before it
+     *                      stops.
+     */
+    TransferManager(
+        std::size_t worker_limit, std::size_t host_limit,
+        boost::posix_time::time_duration idle_timeout=
+            boost::posix_time::seconds(30));
+
+    /**
+     * Cancels every job and waits for them to finish.
+     */
+    ~TransferManager();
+
+    /**
+     * Add a job to the back of the queue.
+     *
+     * @param host  Jobs with the same host share its limit.
+     */
+    JobId submit(
+        const std::wstring& host, const std::wstring& description,
+        const Job& job);
+
+    /// @name Queue control
+    /// Nothing calls these yet but the tests: they await a window listing
+    /// the queue.
+    // @{
+    void pause(JobId job);
+    void resume(JobId job);
+    void cancel(JobId job);
+
+    /**
+     * Move a queued job ahead of every other queued job.
+     */
+    void move_to_front(JobId job);
+
+    /**
+     * Move a queued job behind every other queued job.
+     */
+    void move_to_back(JobId job);
+    // @}
+
+    void set_host_limit(const std::wstring& host, std::size_t limit);
+
+    /**
+     * Jobs not yet finished: running ones first, then the queue in order.
+     */
+    std::vector<JobStatus> jobs() const;
+
+    /**
+     * Wait until a job has finished, or been cancelled and tidied up.
+     */
+    void wait(JobId job) const;
+
+private:
+
+    class JobRecord;
+    class Control;
+
+    typedef std::list< boost::shared_ptr<JobRecord> > JobList;
+
+    void worker();
+    void run(boost::shared_ptr<JobRecord> job);
+    boost::shared_ptr<JobRecord> take_next_job();
+    void start_workers();
+    std::size_t host_limit(const std::wstring& host) const;
+    bool is_cancelled(const JobRecord& job) const;
+    bool is_runnable(const JobRecord& job) const;
+    JobList::iterator find_queued(JobId job);
+    boost::shared_ptr<JobRecord> find(JobId job) const;
+
+    const std::size_t m_worker_limit;
+    const std::size_t m_default_host_limit;
+    const boost::posix_time::time_duration m_idle_timeout;
+
+    mutable boost::mutex m_mutex;
+    mutable boost::condition_variable m_changed;
+    JobList m_queue;
+    JobList m_running;
+    std::map<std::wstring, std::size_t> m_host_limits;
+    std::map<std::wstring, std::size_t> m_host_running;
+    JobId m_next_id;
+    std::size_t m_workers;
+    std::size_t m_idle_workers;
+    bool m_stopping;
+};
+
+}}
+
+#endif
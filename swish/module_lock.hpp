@@ -0,0 +1,109 @@
+/**
+    @file
+
+    Keeping the DLL loaded while threads it started are still running.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SWISH_MODULE_LOCK_HPP
+#define SWISH_MODULE_LOCK_HPP
+#pragma once
+
+#include "swish/atl.hpp" // _pAtlModule
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/locks.hpp> // adopt_lock_t
+
+namespace swish {
+
+/**
+ * Stops COM unloading the DLL while this object exists.
+ *
+ * A background thread that can outlive the objects that started it must
+ * hold one for as long as it runs.  Otherwise DllCanUnloadNow will report
+ * the DLL idle once the last COM object is released, and the thread wakes
+ * up to find its code unmapped.
+ *
+ * The thread can't take the lock itself, as COM might ask before the thread
+ * gets round to it, so the starting thread takes it and hands it over:
+ *
+ * @code
+ *     module_lock lock;
+ *     thread worker(run);
+ *     lock.release();
+ *
+ *     void run()
+ *     {
+ *         module_lock lock(boost::adopt_lock);
+ *         ...
+ *     }
+ * @endcode
+ *
+ * Does nothing in a process that has no ATL module, such as the tests of
+ * the static libraries.
+ */
+class module_lock : private boost::noncopyable
+{
+public:
+
+    module_lock() : m_owns(true)
+    {
+        if (ATL::_pAtlModule)
+            ATL::_pAtlModule->Lock();
+    }
+
+    /**
+     * Take over a lock taken by another module_lock that was released.
+     */
+    explicit module_lock(boost::adopt_lock_t) : m_owns(true) {}
+
+    ~module_lock()
+    {
+        if (m_owns && ATL::_pAtlModule)
+            ATL::_pAtlModule->Unlock();
+    }
+
+    /**
+     * Keep the module locked but leave unlocking it to whoever adopts it.
+     */
+    void release()
+    {
+        m_owns = false;
+    }
+
+private:
+    bool m_owns;
+};
+
+} // namespace swish
+
+#endif
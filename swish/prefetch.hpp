@@ -0,0 +1,721 @@
+/**
+    @file
+
+    Fetching files ahead of the consumer that will ask for them.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SWISH_PREFETCH_HPP
+#define SWISH_PREFETCH_HPP
+#pragma once
+
+#include "swish/block_transfer.hpp" // byte_source
+
+#include <boost/bind.hpp> // bind
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/exception_ptr.hpp> // current_exception, rethrow_exception
+#include <boost/function.hpp> // function
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // copy, max, min
+#include <iterator> // distance
+#include <cstddef> // size_t
+#include <exception>
+#include <iostream> // iostream
+#include <map>
+#include <stdexcept> // runtime_error
+#include <string>
+#include <vector>
+
+/**
+ * @namespace swish::prefetch
+ *
+ * Fetching a list of files in the background, ahead of a consumer that
+ * reads them one after another.
+ *
+ * A consumer that opens each file only once it has finished with the
+ * previous one leaves the link idle while it opens the file and waits for
+ * the first bytes.  Here the files after the one being read are fetched
+ * into a spool while it is read, so the link stays busy.
+ */
+
+namespace swish {
+namespace prefetch {
+
+/**
+ * How far ahead, and into how much space, files are fetched.
+ */
+struct prefetch_options
+{
+    prefetch_options()
+        :
+        memory_limit(16 * 1024 * 1024), disk_limit(256 * 1024 * 1024),
+        max_depth(32), block_size(64 * 1024) {}
+
+    /**
+     * Bytes of fetched files held in memory at once.
+     *
+     * This also sets how many files ahead are fetched: as many as would
+     * fit, on average, up to max_depth.  So small files are fetched far
+     * ahead and large ones only one at a time.
+     */
+    std::size_t memory_limit;
+
+    /**
+     * Bytes of fetched files held on disk at once.
+     *
+     * Files too big for what is left of the memory go to disk.
+     */
+    boost::uintmax_t disk_limit;
+
+    std::size_t max_depth;
+
+    /**
+     * Bytes read from a file at a time.
+     */
+    std::size_t block_size;
+
+    /**
+     * Makes an empty, readable and writable stream on disk to spool a file
+     * to.  The stream should delete the file when it is destroyed.
+     *
+     * Without it, files that don't fit in memory aren't fetched ahead.
+     */
+    boost::function<boost::shared_ptr<std::iostream> ()> spool_file;
+};
+
+namespace detail {
+
+    /**
+     * A file fetched, or being fetched, ahead of the consumer.
+     *
+     * Guarded by the prefetcher's mutex.
+     */
+    struct spooled_file : private boost::noncopyable
+    {
+        spooled_file(
+            boost::uintmax_t reserved, boost::shared_ptr<std::iostream> disk)
+            :
+            disk(disk), reserved(reserved), written(0), complete(false),
+            released(false) {}
+
+        void append(const char* data, std::size_t size)
+        {
+            if (disk)
+            {
+                disk->seekp(0, std::ios::end);
+                disk->write(data, size);
+                if (!*disk)
+                    BOOST_THROW_EXCEPTION(
+                        std::runtime_error("Unable to write to spool file"));
+            }
+            else
+            {
+                memory.append(data, size);
+            }
+
+            written += size;
+        }
+
+        std::size_t read(
+            boost::uintmax_t position, char* buffer, std::size_t size)
+        {
+            std::size_t count = static_cast<std::size_t>(
+                (std::min)(boost::uintmax_t(size), written - position));
+
+            if (disk)
+            {
+                disk->seekg(position);
+                disk->read(buffer, count);
+                if (!*disk)
+                    BOOST_THROW_EXCEPTION(
+                        std::runtime_error("Unable to read spool file"));
+            }
+            else
+            {
+                std::size_t offset = static_cast<std::size_t>(position);
+                std::copy(
+                    memory.begin() + offset,
+                    memory.begin() + offset + count, buffer);
+            }
+
+            return count;
+        }
+
+        /**
+         * Give up the space held by the contents.
+         */
+        void clear()
+        {
+            disk.reset();
+            std::string().swap(memory);
+        }
+
+        std::string memory;
+        boost::shared_ptr<std::iostream> disk;
+
+        /**
+         * Space accounted to the file: the size it was expected to be, or
+         * more if it turned out bigger.
+         */
+        boost::uintmax_t reserved;
+
+        boost::uintmax_t written;
+        bool complete;
+        boost::exception_ptr error;
+
+        /**
+         * The consumer has finished with it.
+         */
+        bool released;
+    };
+
+    /**
+     * Shared by the prefetcher, its thread and the sources it hands out, so
+     * the sources may outlive the prefetcher.
+     */
+    class prefetch_state :
+        public boost::enable_shared_from_this<prefetch_state>,
+        private boost::noncopyable
+    {
+    public:
+
+        typedef boost::function<
+            boost::shared_ptr<swish::block_transfer::byte_source> (
+                std::size_t)> opener;
+
+        prefetch_state(
+            const opener& open, const std::vector<boost::uintmax_t>& sizes,
+            std::size_t start, const prefetch_options& options)
+            :
+            m_open(open), m_sizes(sizes), m_options(options),
+            m_next(start), m_consumer(start), m_memory_used(0),
+            m_disk_used(0), m_fetched_files(0), m_fetched_bytes(0),
+            m_unconsumed(0), m_cancelled(false), m_listed_average(0)
+        {
+            if (!sizes.empty())
+            {
+                boost::uintmax_t total = 0;
+                for (std::size_t i = 0; i < sizes.size(); ++i)
+                {
+                    total += sizes[i];
+                }
+
+                m_listed_average = total / sizes.size();
+            }
+        }
+
+        /**
+         * Fetch files until cancelled or past the end of the list.
+         *
+         * Fetching ahead is only ever an optimisation so, if it fails in a
+         * way not tied to one file, it just stops.
+         */
+        void run()
+        {
+            try
+            {
+                std::vector<char> buffer(m_options.block_size);
+
+                for (;;)
+                {
+                    std::size_t index;
+                    boost::shared_ptr<spooled_file> file = next_file(index);
+                    if (!file)
+                        return;
+
+                    fetch(index, file, buffer);
+                }
+            }
+            catch (const std::exception&)
+            {}
+        }
+
+        boost::shared_ptr<swish::block_transfer::byte_source> take(
+            std::size_t index);
+
+        std::size_t read(
+            const boost::shared_ptr<spooled_file>& file,
+            boost::uintmax_t position, char* buffer, std::size_t size)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            while (position >= file->written && !file->complete &&
+                !file->error && !m_cancelled)
+            {
+                m_changed.wait(lock);
+            }
+
+            if (position < file->written)
+                return file->read(position, buffer, size);
+            else if (file->error)
+                boost::rethrow_exception(file->error);
+            else if (file->complete)
+                return 0;
+            else
+                BOOST_THROW_EXCEPTION(
+                    std::runtime_error("Fetching the file was cancelled"));
+        }
+
+        /**
+         * The consumer has finished with a file, having read `position`
+         * bytes of it.
+         */
+        void release(
+            const boost::shared_ptr<spooled_file>& file,
+            boost::uintmax_t position)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            if (file->written > position)
+                m_unconsumed += file->written - position;
+
+            discard(file);
+        }
+
+        /**
+         * Stop fetching, and give up files that were never taken.
+         */
+        void cancel()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            m_cancelled = true;
+
+            for (files::iterator it = m_files.begin(); it != m_files.end();
+                ++it)
+            {
+                m_unconsumed += it->second->written;
+                discard(it->second);
+            }
+            m_files.clear();
+
+            m_changed.notify_all();
+        }
+
+        std::size_t depth() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return current_depth();
+        }
+
+        boost::uintmax_t unconsumed_bytes() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_unconsumed;
+        }
+
+    private:
+
+        typedef std::map< std::size_t, boost::shared_ptr<spooled_file> >
+            files;
+
+        std::size_t current_depth() const
+        {
+            boost::uintmax_t average = (m_fetched_files > 0) ?
+                m_fetched_bytes / m_fetched_files : m_listed_average;
+
+            boost::uintmax_t depth = m_options.memory_limit /
+                (std::max)(average, boost::uintmax_t(1));
+
+            return static_cast<std::size_t>(
+                (std::max)(
+                    boost::uintmax_t(1),
+                    (std::min)(
+                        depth, boost::uintmax_t(m_options.max_depth))));
+        }
+
+        /**
+         * Files fetched, or being fetched, that the consumer hasn't got to.
+         *
+         * Files it has gone past don't count as it is unlikely to go back
+         * for them.
+         */
+        std::size_t files_ahead() const
+        {
+            return std::distance(
+                m_files.lower_bound(m_consumer), m_files.end());
+        }
+
+        /**
+         * Wait for the next file that there is room for, unless enough
+         * files are already waiting for the consumer.
+         *
+         * @returns  null when there is nothing more to fetch.
+         */
+        boost::shared_ptr<spooled_file> next_file(std::size_t& index_out)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            for (;;)
+            {
+                if (m_cancelled)
+                    return boost::shared_ptr<spooled_file>();
+
+                m_next = (std::max)(m_next, m_consumer);
+                if (m_next >= m_sizes.size())
+                    return boost::shared_ptr<spooled_file>();
+
+                boost::uintmax_t size = m_sizes[m_next];
+
+                if (fits_in_memory(size) || fits_on_disk(size))
+                {
+                    if (files_ahead() < current_depth())
+                        break;
+                }
+                else if (size > m_options.memory_limit &&
+                    (!m_options.spool_file || size > m_options.disk_limit))
+                {
+                    // Never going to fit so leave it to the consumer
+                    ++m_next;
+                    continue;
+                }
+
+                m_changed.wait(lock);
+            }
+
+            index_out = m_next++;
+            boost::uintmax_t size = m_sizes[index_out];
+
+            boost::shared_ptr<std::iostream> disk;
+            if (fits_in_memory(size))
+            {
+                m_memory_used += size;
+            }
+            else
+            {
+                disk = m_options.spool_file();
+                if (!disk)
+                    BOOST_THROW_EXCEPTION(
+                        std::runtime_error("Unable to create spool file"));
+
+                m_disk_used += size;
+            }
+
+            boost::shared_ptr<spooled_file> file =
+                boost::make_shared<spooled_file>(size, disk);
+            if (!disk)
+                file->memory.reserve(static_cast<std::size_t>(size));
+
+            m_files[index_out] = file;
+
+            return file;
+        }
+
+        void fetch(
+            std::size_t index, const boost::shared_ptr<spooled_file>& file,
+            std::vector<char>& buffer)
+        {
+            try
+            {
+                boost::shared_ptr<swish::block_transfer::byte_source> source =
+                    m_open(index);
+                if (!source)
+                    BOOST_THROW_EXCEPTION(
+                        std::runtime_error("File can't be fetched"));
+
+                for (;;)
+                {
+                    std::size_t count = source->read(&buffer[0], buffer.size());
+
+                    boost::mutex::scoped_lock lock(m_mutex);
+
+                    if (file->released || m_cancelled)
+                    {
+                        m_unconsumed += count;
+                        return;
+                    }
+
+                    if (count == 0)
+                    {
+                        file->complete = true;
+                        ++m_fetched_files;
+                        m_fetched_bytes += file->written;
+                        m_changed.notify_all();
+                        return;
+                    }
+
+                    file->append(&buffer[0], count);
+                    grow_reservation(file);
+                    m_changed.notify_all();
+                }
+            }
+            catch (...)
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+
+                file->error = boost::current_exception();
+
+                // Not taken yet so let the consumer fetch it itself
+                files::iterator it = m_files.find(index);
+                if (it != m_files.end() && it->second == file)
+                {
+                    m_files.erase(it);
+                    m_unconsumed += file->written;
+                    discard(file);
+                }
+
+                m_changed.notify_all();
+            }
+        }
+
+        bool fits_in_memory(boost::uintmax_t size) const
+        {
+            return size <= m_options.memory_limit - m_memory_used;
+        }
+
+        bool fits_on_disk(boost::uintmax_t size) const
+        {
+            return m_options.spool_file &&
+                size <= m_options.disk_limit - m_disk_used;
+        }
+
+        /**
+         * Account for a file that turned out bigger than expected.
+         */
+        void grow_reservation(const boost::shared_ptr<spooled_file>& file)
+        {
+            if (file->written <= file->reserved)
+                return;
+
+            boost::uintmax_t extra = file->written - file->reserved;
+            if (file->disk)
+                m_disk_used += extra;
+            else
+                m_memory_used += static_cast<std::size_t>(extra);
+
+            file->reserved = file->written;
+        }
+
+        void discard(const boost::shared_ptr<spooled_file>& file)
+        {
+            if (file->released)
+                return;
+
+            if (file->disk)
+                m_disk_used -= file->reserved;
+            else
+                m_memory_used -= static_cast<std::size_t>(file->reserved);
+
+            file->released = true;
+            file->clear();
+
+            m_changed.notify_all();
+        }
+
+        const opener m_open;
+        const std::vector<boost::uintmax_t> m_sizes;
+        const prefetch_options m_options;
+
+        mutable boost::mutex m_mutex;
+        boost::condition_variable m_changed;
+        files m_files;         ///< Fetched but not yet taken
+        std::size_t m_next;    ///< Index of the next file to fetch
+        std::size_t m_consumer;///< Index after the last one taken
+        std::size_t m_memory_used;
+        boost::uintmax_t m_disk_used;
+        std::size_t m_fetched_files;
+        boost::uintmax_t m_fetched_bytes;
+        boost::uintmax_t m_unconsumed;
+        bool m_cancelled;
+        boost::uintmax_t m_listed_average;
+    };
+
+    /**
+     * Contents of a file as it arrives in the spool.
+     */
+    class spooled_source : public swish::block_transfer::byte_source
+    {
+    public:
+        spooled_source(
+            boost::shared_ptr<prefetch_state> state,
+            boost::shared_ptr<spooled_file> file)
+            : m_state(state), m_file(file), m_position(0) {}
+
+        ~spooled_source()
+        {
+            m_state->release(m_file, m_position);
+        }
+
+        virtual std::size_t read(char* buffer, std::size_t size)
+        {
+            std::size_t count = m_state->read(
+                m_file, m_position, buffer, size);
+            m_position += count;
+            return count;
+        }
+
+    private:
+        boost::shared_ptr<prefetch_state> m_state;
+        boost::shared_ptr<spooled_file> m_file;
+        boost::uintmax_t m_position;
+    };
+
+    inline boost::shared_ptr<swish::block_transfer::byte_source>
+    prefetch_state::take(std::size_t index)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+
+        m_consumer = (std::max)(m_consumer, index + 1);
+        m_changed.notify_all();
+
+        files::iterator it = m_files.find(index);
+        if (it == m_files.end())
+            return boost::shared_ptr<swish::block_transfer::byte_source>();
+
+        boost::shared_ptr<spooled_file> file = it->second;
+        m_files.erase(it);
+
+        return boost::make_shared<spooled_source>(shared_from_this(), file);
+    }
+}
+
+/**
+ * Fetches a list of files in the background, in order, ahead of the
+ * consumer.
+ *
+ * The consumer takes each file from the prefetcher as it gets to it.  If
+ * the file was fetched, or is being fetched, the consumer reads it from
+ * the spool, waiting for it to arrive if need be.  Otherwise, it gets
+ * nothing and has to fetch the file itself.
+ *
+ * Fetched files are held in memory or, if they don't fit, on disk, until
+ * the consumer has finished with them.  Files that are fetched but never
+ * read, because the consumer skipped them or gave up, are counted so that
+ * the cost of fetching ahead can be seen.
+ */
+class prefetcher : private boost::noncopyable
+{
+public:
+
+    /**
+     * Opens the file at an index of the list.  Called on the prefetcher's
+     * own thread.  Returning null, or throwing, leaves the file to the
+     * consumer.
+     */
+    typedef detail::prefetch_state::opener opener;
+
+    /**
+     * Start fetching.
+     *
+     * @param open   Opens the files.
+     * @param sizes  Expected size of each file in the list, used to decide
+     *               where to spool it and how far ahead to fetch.
+     * @param start  Index of the first file worth fetching.  Those before
+     *               it the consumer is already dealing with.
+     */
+    prefetcher(
+        const opener& open, const std::vector<boost::uintmax_t>& sizes,
+        std::size_t start, const prefetch_options& options=prefetch_options())
+        :
+        m_state(
+            boost::make_shared<detail::prefetch_state>(
+                open, sizes, start, options)),
+        m_thread(boost::bind(&detail::prefetch_state::run, m_state))
+    {}
+
+    ~prefetcher()
+    {
+        cancel();
+    }
+
+    /**
+     * Stop fetching and give up the files not yet taken.
+     *
+     * Files already taken can still be read to the end, if they were
+     * fetched that far.
+     */
+    void cancel()
+    {
+        m_state->cancel();
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+    /**
+     * Stop fetching, like cancel(), but without waiting for the thread.
+     *
+     * The thread may be part way through reading a file, which on a slow
+     * link can take a while.  It finishes that read in the background and
+     * then ends, keeping the shared state, and so the opener, alive until
+     * it does.
+     */
+    void abandon()
+    {
+        m_state->cancel();
+        if (m_thread.joinable())
+            m_thread.detach();
+    }
+
+    /**
+     * The consumer has got to the file at `index`.
+     *
+     * @returns  the file's contents, or null if it wasn't fetched.
+     */
+    boost::shared_ptr<swish::block_transfer::byte_source> take(
+        std::size_t index)
+    {
+        return m_state->take(index);
+    }
+
+    /**
+     * How many files ahead of the consumer are fetched, given the average
+     * size of those fetched so far.
+     */
+    std::size_t depth() const
+    {
+        return m_state->depth();
+    }
+
+    /**
+     * Bytes fetched that the consumer never read.
+     */
+    boost::uintmax_t unconsumed_bytes() const
+    {
+        return m_state->unconsumed_bytes();
+    }
+
+private:
+    boost::shared_ptr<detail::prefetch_state> m_state;
+    boost::thread m_thread;
+};
+
+}} // namespace swish::prefetch
+
+#endif
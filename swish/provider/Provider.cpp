@@ -37,9 +37,11 @@
 
 #include "Provider.hpp"
 
+#include "swish/block_transfer.hpp" // byte_sink
 #include "swish/connection/authenticated_session.hpp"
 #include "swish/connection/session_manager.hpp" // session_reservation
 #include "swish/provider/libssh2_sftp_filesystem_item.hpp"
+#include "swish/provider/long_entry.hpp" // account_name_cache
 #include "swish/provider/sftp_filesystem_item.hpp"
 #include "swish/remotelimits.h"
 #include "swish/utils.hpp" // WideStringToUtf8String
@@ -53,22 +55,29 @@
 #include <comet/server.h> // simple_object for STL holder with AddRef lifetime
 #include <comet/stream.h> // adapt_stream_pointer
 
+#include <ssh/exec_channel.hpp>
 #include <ssh/filesystem.hpp> // directory_iterator
 #include <ssh/stream.hpp> // ofstream, ifstream
 
+#include <boost/algorithm/string/predicate.hpp> // equals
 #include <boost/filesystem/path.hpp> // wpath
-#include <boost/iterator/filter_iterator.hpp> // make_filter_iterator
 #include <boost/make_shared.hpp> // make_shared
 #include <boost/move/move.hpp> // BOOST_RV_REF
+#include <boost/optional/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
 #include <boost/system/system_error.hpp> // system_error, system_category
 
 #include <cassert> // assert
+#include <cstddef> // size_t
 #include <exception>
 #include <stdexcept> // invalid_argument
 #include <string>
-#include <vector> // to hold listing
+#include <vector>
 
+using swish::block_transfer::byte_sink;
+using swish::block_transfer::byte_source;
 using swish::connection::authenticated_session;
 using swish::connection::session_reservation;
 using swish::utils::WideStringToUtf8String;
@@ -82,14 +91,20 @@ using comet::com_ptr;
 using comet::datetime_t;
 using comet::stl_enumeration;
 
+using boost::algorithm::equals;
 using boost::filesystem::path;
 using boost::filesystem::wpath;
-using boost::make_filter_iterator;
+using boost::function;
 using boost::make_shared;
+using boost::mutex;
+using boost::optional;
+using boost::shared_ptr;
 namespace errc = boost::system::errc;
 using boost::system::system_category;
 using boost::system::system_error;
 
+using ssh::exec_channel;
+using ssh::filesystem::borrowed_channel;
 using ssh::filesystem::directory_iterator;
 using ssh::filesystem::file_attributes;
 using ssh::filesystem::fstream;
@@ -100,10 +115,11 @@ using ssh::filesystem::sftp_filesystem;
 using ssh::filesystem::sftp_file;
 
 using std::exception;
+using std::size_t;
 using std::invalid_argument;
 using std::string;
-using std::wstring;
 using std::vector;
+using std::wstring;
 
 namespace swish {
 namespace provider {
@@ -117,7 +133,8 @@ public:
     directory_listing listing(const sftp_provider_path& directory);
 
     comet::com_ptr<IStream> get_file(
-        std::wstring file_path, std::ios_base::openmode open_mode);
+        std::wstring file_path, std::ios_base::openmode open_mode,
+        shared_ptr<borrowed_channel> borrowed);
 
     VARIANT_BOOL rename(
         com_ptr<ISftpConsumer> consumer, const wpath& from_path,
@@ -132,9 +149,25 @@ public:
     sftp_filesystem_item stat(
         const sftp_provider_path& path, bool follow_links);
 
+    bool extract_archive(
+        const sftp_provider_path& directory,
+        function<void (byte_sink&)> write_archive);
+
+    shared_ptr<byte_source> create_archive(
+        const sftp_provider_path& directory,
+        const vector<sftp_provider_path>& items);
+
+    vector<shared_ptr<borrowed_channel>> borrow_channels(size_t count);
+
 private:
 
+    bool server_has_tar();
+
     session_reservation m_ticket;
+    account_name_cache m_account_names;
+
+    mutex m_tar_probe_guard;
+    optional<bool> m_server_has_tar;
 };
 
 CProvider::CProvider(BOOST_RV_REF(session_reservation) session_ticket)
@@ -142,6 +175,10 @@ CProvider::CProvider(BOOST_RV_REF(session_reservation) session_ticket)
     m_provider = make_shared<provider>(boost::ref(session_ticket));
 }
 
+CProvider::CProvider(
+    shared_ptr<provider> provider, shared_ptr<borrowed_channel> channel)
+: m_provider(provider), m_channel(channel) {}
+
 
 directory_listing CProvider::listing(const sftp_provider_path& directory)
 {
@@ -150,7 +187,7 @@ directory_listing CProvider::listing(const sftp_provider_path& directory)
 
 comet::com_ptr<IStream> CProvider::get_file(
     std::wstring file_path, std::ios_base::openmode open_mode)
-{ return m_provider->get_file(file_path, open_mode); }
+{ return m_provider->get_file(file_path, open_mode, m_channel); }
 
 VARIANT_BOOL CProvider::rename(
     ISftpConsumer* consumer, BSTR from_path, BSTR to_path)
@@ -171,6 +208,36 @@ sftp_filesystem_item CProvider::stat(
     return m_provider->stat(path, follow_links);
 }
 
+bool CProvider::extract_archive(
+    const sftp_provider_path& directory,
+    function<void (byte_sink&)> write_archive)
+{
+    return m_provider->extract_archive(directory, write_archive);
+}
+
+shared_ptr<byte_source> CProvider::create_archive(
+    const sftp_provider_path& directory,
+    const vector<sftp_provider_path>& items)
+{
+    return m_provider->create_archive(directory, items);
+}
+
+vector<shared_ptr<sftp_provider>> CProvider::borrow_channels(size_t count)
+{
+    vector<shared_ptr<borrowed_channel>> channels =
+        m_provider->borrow_channels(count);
+
+    vector<shared_ptr<sftp_provider>> providers;
+    for (size_t i = 0; i < channels.size(); ++i)
+    {
+        providers.push_back(
+            shared_ptr<sftp_provider>(
+                new CProvider(m_provider, channels[i])));
+    }
+
+    return providers;
+}
+
 /**
  * Create libssh2-based data provider.
  */
@@ -183,7 +250,8 @@ namespace {
 
     bool not_special_file(const sftp_file& file)
     {
-        return file.name() != "." && file.name() != "..";
+        return !equals(file.name_view(), ".") &&
+            !equals(file.name_view(), "..");
     }
 
 }
@@ -202,20 +270,70 @@ directory_listing provider::listing(const sftp_provider_path& directory)
 
     string path = WideStringToUtf8String(directory.string());
 
-    vector<sftp_filesystem_item> files;
-    transform(
-        make_filter_iterator(
-            not_special_file, channel.directory_iterator(path)),
-        make_filter_iterator(
-            not_special_file, channel.directory_iterator()),
-        back_inserter(files),
-        libssh2_sftp_filesystem_item::create_from_libssh2_file);
+    directory_listing files;
+    wstring name_buffer;
+
+    for (directory_iterator it = channel.directory_iterator(path);
+        it != channel.directory_iterator(); ++it)
+    {
+        if (not_special_file(*it))
+        {
+            libssh2_sftp_filesystem_item::append_to_listing(
+                files, *it, m_account_names, name_buffer);
+        }
+    }
 
     return files;
 }
 
+namespace {
+
+    /**
+     * Stream on a borrowed channel, kept with the channel.
+     *
+     * The stream is destroyed first, so its file is closed before the channel
+     * goes back.
+     */
+    template<typename Stream>
+    struct stream_on_channel
+    {
+        stream_on_channel(
+            shared_ptr<borrowed_channel> channel, const string& path,
+            std::ios_base::openmode mode)
+            : channel(channel), stream(*channel, path, mode) {}
+
+        shared_ptr<borrowed_channel> channel;
+        Stream stream;
+    };
+
+    template<typename Stream>
+    shared_ptr<Stream> open_stream(
+        sftp_filesystem& filesystem, shared_ptr<borrowed_channel> borrowed,
+        const string& path, std::ios_base::openmode mode)
+    {
+        if (borrowed)
+        {
+            shared_ptr<stream_on_channel<Stream>> holder =
+                make_shared<stream_on_channel<Stream>>(borrowed, path, mode);
+            return shared_ptr<Stream>(holder, &holder->stream);
+        }
+        else
+        {
+            return make_shared<Stream>(boost::ref(filesystem), path, mode);
+        }
+    }
+
+}
+
+/**
+ * Open a file as a stream.
+ *
+ * @param borrowed  Channel to open the stream on instead of the session's
+ *                  own, if not null.
+ */
 com_ptr<IStream> provider::get_file(
-    wstring file_path, std::ios_base::openmode mode)
+    wstring file_path, std::ios_base::openmode mode,
+    shared_ptr<borrowed_channel> borrowed)
 {
     if (file_path.empty())
         BOOST_THROW_EXCEPTION(invalid_argument("File cannot be empty"));
@@ -227,19 +345,19 @@ com_ptr<IStream> provider::get_file(
     if (mode & std::ios_base::out && mode & std::ios_base::in)
     {
         return adapt_stream_pointer(
-            make_shared<fstream>(boost::ref(channel), path, mode),
+            open_stream<fstream>(channel, borrowed, path, mode),
             wpath(file_path).filename());
     }
     else if (mode & std::ios_base::out)
     {
         return adapt_stream_pointer(
-            make_shared<ofstream>(boost::ref(channel), path, mode),
+            open_stream<ofstream>(channel, borrowed, path, mode),
             wpath(file_path).filename());
     }
     else if (mode & std::ios_base::in)
     {
         return adapt_stream_pointer(
-            make_shared<ifstream>(boost::ref(channel), path, mode),
+            open_stream<ifstream>(channel, borrowed, path, mode),
             wpath(file_path).filename());
     }
     else
@@ -495,6 +613,18 @@ VARIANT_BOOL provider::rename(
     }
 }
 
+namespace {
+
+    /**
+     * Removal requests to keep in flight when deleting a tree.
+     *
+     * Each one needs its own SFTP channel and OpenSSH allows ten sessions per
+     * connection by default, so this leaves room for the other users.
+     */
+    const std::size_t REMOVE_ALL_PIPELINE_DEPTH = 8;
+
+}
+
 void provider::remove_all(const wpath& target)
 {
     if (target.empty())
@@ -502,7 +632,9 @@ void provider::remove_all(const wpath& target)
 
     path utf8_path = WideStringToUtf8String(target.string());
 
-    m_ticket.session().get_sftp_filesystem().remove_all(utf8_path);
+    // Deleting a big tree one request at a time is dominated by round trips
+    m_ticket.session().get_sftp_filesystem().remove_all(
+        utf8_path, REMOVE_ALL_PIPELINE_DEPTH);
 }
 
 void provider::create_new_directory(const wpath& path)
@@ -549,4 +681,195 @@ sftp_filesystem_item provider::stat(
         utf8_path, stat_result);
 }
 
+namespace {
+
+    /**
+     * Quote text so a POSIX shell passes it to a command unchanged.
+     *
+     * Everything goes in single quotes, which leaves only single quotes
+     * themselves to deal with: each closes the quoting, adds an escaped
+     * quote and reopens it.
+     */
+    string shell_quote(const string& text)
+    {
+        string quoted = "'";
+        for (string::const_iterator it = text.begin(); it != text.end(); ++it)
+        {
+            if (*it == '\'')
+                quoted += "'\\''";
+            else
+                quoted += *it;
+        }
+        quoted += "'";
+
+        return quoted;
+    }
+
+    /**
+     * Sink feeding the standard input of a command on the server.
+     */
+    class command_input_sink : public byte_sink
+    {
+    public:
+        explicit command_input_sink(exec_channel& command)
+            : m_command(command) {}
+
+        virtual void write(const char* data, std::size_t size)
+        {
+            m_command.write(data, size);
+        }
+
+    private:
+        exec_channel& m_command;
+    };
+
+    /**
+     * Source reading the standard output of a command on the server.
+     *
+     * Only failures to read are errors.  tar exits with an error if some
+     * file couldn't be archived, but the rest of the archive is still good;
+     * the file that's missing from it will be fetched some other way.
+     */
+    class command_output_source : public byte_source
+    {
+    public:
+        explicit command_output_source(exec_channel command)
+            : m_command(command)
+        {
+            m_command.close_input();
+        }
+
+        virtual std::size_t read(char* buffer, std::size_t size)
+        {
+            std::size_t count = m_command.read(buffer, size);
+            if (count == 0 && m_command.wait_for_exit() != 0)
+            {
+                trace("Command on server failed: %s")
+                    % m_command.error_output();
+            }
+
+            return count;
+        }
+
+    private:
+        exec_channel m_command;
+    };
+
+    const char TAR_PROBE_MARKER[] = "swish-tar-available";
+}
+
+/**
+ * Whether we can run tar on the server, asking it only the first time.
+ *
+ * Servers restricted to SFTP either refuse to run commands at all or,
+ * when forcing every command to be the SFTP server, run something other
+ * than what we asked for.  Only trusting a marker echoed back by a real
+ * shell catches both.
+ */
+bool provider::server_has_tar()
+{
+    mutex::scoped_lock lock(m_tar_probe_guard);
+
+    if (!m_server_has_tar)
+    {
+        try
+        {
+            exec_channel probe = m_ticket.session().get_session().execute(
+                string("command -v tar >/dev/null 2>&1 && echo ") +
+                TAR_PROBE_MARKER);
+
+            m_server_has_tar = probe.wait_for_exit() == 0 &&
+                probe.output().find(TAR_PROBE_MARKER) != string::npos;
+        }
+        catch (const exception& e)
+        {
+            trace("Unable to run commands on server: %s") % e.what();
+            m_server_has_tar = false;
+        }
+    }
+
+    return *m_server_has_tar;
+}
+
+/**
+ * Unpack an archive into a directory by streaming it to tar on the server.
+ *
+ * Files get the time they are unpacked as their modification time, as
+ * files uploaded over SFTP do.
+ */
+bool provider::extract_archive(
+    const sftp_provider_path& directory,
+    function<void (byte_sink&)> write_archive)
+{
+    if (directory.empty())
+        BOOST_THROW_EXCEPTION(com_error(E_INVALIDARG));
+
+    if (!server_has_tar())
+        return false;
+
+    string command =
+        "cd -- " + shell_quote(WideStringToUtf8String(directory.string())) +
+        " && tar -xmf -";
+
+    exec_channel tar = m_ticket.session().get_session().execute(command);
+
+    command_input_sink sink(tar);
+    write_archive(sink);
+
+    if (tar.wait_for_exit() != 0)
+    {
+        BOOST_THROW_EXCEPTION(
+            com_error(
+                "Unable to unpack files on the server: " +
+                tar.error_output(), E_FAIL));
+    }
+
+    return true;
+}
+
+/**
+ * Stream an archive of items made by tar on the server.
+ */
+shared_ptr<byte_source> provider::create_archive(
+    const sftp_provider_path& directory,
+    const vector<sftp_provider_path>& items)
+{
+    if (directory.empty() || items.empty())
+        BOOST_THROW_EXCEPTION(com_error(E_INVALIDARG));
+
+    if (!server_has_tar())
+        return shared_ptr<byte_source>();
+
+    string command =
+        "cd -- " + shell_quote(WideStringToUtf8String(directory.string())) +
+        " && tar -cf - --";
+    for (vector<sftp_provider_path>::const_iterator it = items.begin();
+        it != items.end(); ++it)
+    {
+        command += " " + shell_quote(WideStringToUtf8String(it->string()));
+    }
+
+    return make_shared<command_output_source>(
+        m_ticket.session().get_session().execute(command));
+}
+
+/**
+ * Borrow up to `count` spare SFTP channels from the session.
+ *
+ * @returns  None, rather than failing, if the server won't open any.
+ */
+vector<shared_ptr<borrowed_channel>> provider::borrow_channels(size_t count)
+{
+    try
+    {
+        return m_ticket.session().get_sftp_filesystem().borrow_channels(
+            count);
+    }
+    catch (const system_error& e)
+    {
+        trace("Couldn't borrow SFTP channels: %s") % e.what();
+        return vector<shared_ptr<borrowed_channel>>();
+    }
+}
+
 }} // namespace swish::provider
@@ -45,6 +45,13 @@
 #include <boost/move/move.hpp> // BOOST_RV_REF
 #include <boost/shared_ptr.hpp> // shared_ptr
 
+namespace ssh {
+namespace filesystem {
+
+class borrowed_channel;
+
+}}
+
 namespace swish {
 namespace provider {
 
@@ -74,8 +81,31 @@ public:
     virtual sftp_filesystem_item stat(
         const sftp_provider_path& path, bool follow_links);
 
+    virtual bool extract_archive(
+        const sftp_provider_path& directory,
+        boost::function<void (swish::block_transfer::byte_sink&)>
+            write_archive);
+
+    virtual boost::shared_ptr<swish::block_transfer::byte_source>
+    create_archive(
+        const sftp_provider_path& directory,
+        const std::vector<sftp_provider_path>& items);
+
+    virtual std::vector<boost::shared_ptr<sftp_provider>> borrow_channels(
+        std::size_t count);
+
 private:
+
+    CProvider(
+        boost::shared_ptr<provider> provider,
+        boost::shared_ptr<ssh::filesystem::borrowed_channel> channel);
+
     boost::shared_ptr<provider> m_provider;
+
+    /**
+     * Channel that our file streams have to themselves, if we were borrowed.
+     */
+    boost::shared_ptr<ssh::filesystem::borrowed_channel> m_channel;
 };
 
 }} // namespace swish::provider
@@ -0,0 +1,495 @@
+/**
+    @file
+
+    Compact directory listing.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef SWISH_PROVIDER_DIRECTORY_LISTING_HPP
+#define SWISH_PROVIDER_DIRECTORY_LISTING_HPP
+
+#include "swish/provider/sftp_filesystem_item.hpp"
+#include "swish/provider/sftp_provider_path.hpp"
+
+#include <boost/cstdint.hpp> // uint32_t, uint64_t
+#include <boost/iterator/iterator_facade.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/optional/optional.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <comet/datetime.h> // datetime_t
+
+#include <algorithm> // equal
+#include <cstddef> // size_t, ptrdiff_t
+#include <string>
+#include <vector>
+
+namespace swish {
+namespace provider {
+
+/**
+ * Properties of an entry to add to a `directory_listing`.
+ *
+ * The strings are copied into the listing so only need to stay valid
+ * while the entry is being added.
+ */
+struct listing_entry
+{
+    typedef boost::iterator_range<const wchar_t*> string_view;
+
+    listing_entry()
+        :
+        type(sftp_filesystem_item_interface::type::unknown), permissions(0),
+        uid(0), gid(0), size_in_bytes(0) {}
+
+    BOOST_SCOPED_ENUM(sftp_filesystem_item_interface::type) type;
+    string_view filename;
+    unsigned long permissions;
+    boost::optional<string_view> owner;
+    unsigned long uid;
+    boost::optional<string_view> group;
+    unsigned long gid;
+    boost::uint64_t size_in_bytes;
+    comet::datetime_t last_accessed;
+    comet::datetime_t last_modified;
+};
+
+namespace detail {
+
+    /**
+     * Column-wise storage of a listing's entries.
+     *
+     * Each property is kept in an array of its own and every string in a
+     * single pool, so a listing of any size costs a handful of allocations
+     * and scanning one property touches only that property's memory.
+     */
+    class listing_storage : public sftp_filesystem_item_collection
+    {
+    public:
+
+        typedef listing_entry::string_view string_view;
+
+        std::size_t size() const
+        {
+            return m_types.size();
+        }
+
+        BOOST_SCOPED_ENUM(sftp_filesystem_item_interface::type) type(
+            std::size_t index) const
+        {
+            return static_cast<
+                BOOST_SCOPED_ENUM(sftp_filesystem_item_interface::type)>(
+                    m_types[index]);
+        }
+
+        string_view filename_view(std::size_t index) const
+        {
+            return view(m_filenames[index]);
+        }
+
+        sftp_provider_path filename(std::size_t index) const
+        {
+            string_view name = filename_view(index);
+            return std::wstring(name.begin(), name.end());
+        }
+
+        unsigned long permissions(std::size_t index) const
+        {
+            return m_permissions[index];
+        }
+
+        boost::optional<std::wstring> owner(std::size_t index) const
+        {
+            return optional_string(m_owners[index]);
+        }
+
+        unsigned long uid(std::size_t index) const
+        {
+            return m_uids[index];
+        }
+
+        boost::optional<std::wstring> group(std::size_t index) const
+        {
+            return optional_string(m_groups[index]);
+        }
+
+        unsigned long gid(std::size_t index) const
+        {
+            return m_gids[index];
+        }
+
+        boost::uint64_t size_in_bytes(std::size_t index) const
+        {
+            return m_sizes[index];
+        }
+
+        comet::datetime_t last_accessed(std::size_t index) const
+        {
+            return m_accessed[index];
+        }
+
+        comet::datetime_t last_modified(std::size_t index) const
+        {
+            return m_modified[index];
+        }
+
+        void reserve(std::size_t entries)
+        {
+            m_types.reserve(entries);
+            m_filenames.reserve(entries);
+            m_permissions.reserve(entries);
+            m_owners.reserve(entries);
+            m_uids.reserve(entries);
+            m_groups.reserve(entries);
+            m_gids.reserve(entries);
+            m_sizes.reserve(entries);
+            m_accessed.reserve(entries);
+            m_modified.reserve(entries);
+        }
+
+        void push_back(const listing_entry& entry)
+        {
+            m_types.push_back(static_cast<unsigned char>(entry.type));
+            m_filenames.push_back(pool(entry.filename));
+            m_permissions.push_back(entry.permissions);
+            m_owners.push_back(
+                (entry.owner) ? intern(*entry.owner) : no_string());
+            m_uids.push_back(entry.uid);
+            m_groups.push_back(
+                (entry.group) ? intern(*entry.group) : no_string());
+            m_gids.push_back(entry.gid);
+            m_sizes.push_back(entry.size_in_bytes);
+            m_accessed.push_back(entry.last_accessed);
+            m_modified.push_back(entry.last_modified);
+        }
+
+        /**
+         * Bytes of memory held.
+         */
+        std::size_t memory_used() const
+        {
+            return sizeof(*this) +
+                bytes(m_strings) + bytes(m_types) + bytes(m_filenames) +
+                bytes(m_permissions) + bytes(m_owners) + bytes(m_uids) +
+                bytes(m_groups) + bytes(m_gids) + bytes(m_sizes) +
+                bytes(m_accessed) + bytes(m_modified) + bytes(m_interned);
+        }
+
+    private:
+
+        struct pooled_string
+        {
+            boost::uint32_t offset;
+            boost::uint32_t size;
+        };
+
+        /// Owners and groups are shared by this many distinct names at most
+        static const std::size_t MAX_INTERNED = 16;
+
+        static pooled_string no_string()
+        {
+            pooled_string none = { 0xFFFFFFFF, 0 };
+            return none;
+        }
+
+        template<typename T>
+        static std::size_t bytes(const std::vector<T>& v)
+        {
+            return v.capacity() * sizeof(T);
+        }
+
+        string_view view(const pooled_string& pooled) const
+        {
+            const wchar_t* start = (m_strings.empty()) ?
+                NULL : &m_strings[0] + pooled.offset;
+            return string_view(start, start + pooled.size);
+        }
+
+        boost::optional<std::wstring> optional_string(
+            const pooled_string& pooled) const
+        {
+            if (pooled.offset == no_string().offset)
+            {
+                return boost::optional<std::wstring>();
+            }
+            else
+            {
+                string_view text = view(pooled);
+                return std::wstring(text.begin(), text.end());
+            }
+        }
+
+        pooled_string pool(string_view text)
+        {
+            pooled_string pooled;
+            pooled.offset = static_cast<boost::uint32_t>(m_strings.size());
+            pooled.size = static_cast<boost::uint32_t>(text.size());
+
+            m_strings.insert(m_strings.end(), text.begin(), text.end());
+
+            return pooled;
+        }
+
+        /**
+         * Pool a name, sharing the copy of it already pooled if there is one.
+         *
+         * A listing's files are mostly owned by a handful of accounts so only
+         * the first few distinct names are shared, which keeps the search
+         * short for listings where every file has a different owner.
+         */
+        pooled_string intern(string_view text)
+        {
+            for (std::size_t i = 0; i < m_interned.size(); ++i)
+            {
+                string_view candidate = view(m_interned[i]);
+                if (candidate.size() == text.size() &&
+                    std::equal(text.begin(), text.end(), candidate.begin()))
+                {
+                    return m_interned[i];
+                }
+            }
+
+            pooled_string pooled = pool(text);
+            if (m_interned.size() < MAX_INTERNED)
+            {
+                m_interned.push_back(pooled);
+            }
+
+            return pooled;
+        }
+
+        std::vector<wchar_t> m_strings;
+        std::vector<unsigned char> m_types;
+        std::vector<pooled_string> m_filenames;
+        std::vector<unsigned long> m_permissions;
+        std::vector<pooled_string> m_owners;
+        std::vector<unsigned long> m_uids;
+        std::vector<pooled_string> m_groups;
+        std::vector<unsigned long> m_gids;
+        std::vector<boost::uint64_t> m_sizes;
+        std::vector<comet::datetime_t> m_accessed;
+        std::vector<comet::datetime_t> m_modified;
+        std::vector<pooled_string> m_interned;
+    };
+
+}
+
+/**
+ * The entries of a directory.
+ *
+ * Entries are stored compactly, property by property, rather than as an
+ * object each.  Iterating or indexing the listing produces
+ * `sftp_filesystem_item`s that are views of the entries; creating one
+ * doesn't allocate and it remains valid after the listing is gone.
+ *
+ * Copies of a listing share their entries until one of them is modified.
+ */
+class directory_listing
+{
+public:
+
+    typedef sftp_filesystem_item value_type;
+    typedef std::size_t size_type;
+    typedef listing_entry::string_view string_view;
+
+    class const_iterator : public boost::iterator_facade<
+        const_iterator, const sftp_filesystem_item,
+        boost::random_access_traversal_tag, sftp_filesystem_item>
+    {
+    public:
+        const_iterator() : m_listing(NULL), m_index(0) {}
+
+    private:
+        friend class directory_listing;
+        friend class boost::iterator_core_access;
+
+        const_iterator(const directory_listing* listing, size_type index)
+            : m_listing(listing), m_index(index) {}
+
+        sftp_filesystem_item dereference() const
+        {
+            return (*m_listing)[m_index];
+        }
+
+        bool equal(const const_iterator& other) const
+        {
+            return m_listing == other.m_listing && m_index == other.m_index;
+        }
+
+        void increment() { ++m_index; }
+        void decrement() { --m_index; }
+        void advance(std::ptrdiff_t n) { m_index += n; }
+
+        std::ptrdiff_t distance_to(const const_iterator& other) const
+        {
+            return static_cast<std::ptrdiff_t>(other.m_index) -
+                static_cast<std::ptrdiff_t>(m_index);
+        }
+
+        const directory_listing* m_listing;
+        size_type m_index;
+    };
+
+    typedef const_iterator iterator;
+
+    directory_listing() {}
+
+    /**
+     * Listing of the items in a range of `sftp_filesystem_item`s.
+     */
+    template<typename InputIterator>
+    directory_listing(InputIterator begin, InputIterator end)
+    {
+        for (InputIterator it = begin; it != end; ++it)
+        {
+            push_back(*it);
+        }
+    }
+
+    size_type size() const
+    {
+        return (m_storage) ? m_storage->size() : 0;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, size());
+    }
+
+    sftp_filesystem_item operator[](size_type index) const
+    {
+        return sftp_filesystem_item(m_storage, index);
+    }
+
+    /// @name Linear scans
+    ///
+    /// Filters can test these without creating items for each entry.
+    // @{
+
+    BOOST_SCOPED_ENUM(sftp_filesystem_item_interface::type) type(
+        size_type index) const
+    {
+        return m_storage->type(index);
+    }
+
+    /**
+     * The entry's filename.
+     *
+     * Only valid until the listing is next modified.
+     */
+    string_view filename_view(size_type index) const
+    {
+        return m_storage->filename_view(index);
+    }
+
+    // @}
+
+    void reserve(size_type entries)
+    {
+        modifiable_storage().reserve(entries);
+    }
+
+    void push_back(const listing_entry& entry)
+    {
+        modifiable_storage().push_back(entry);
+    }
+
+    void push_back(const sftp_filesystem_item_interface& item)
+    {
+        std::wstring filename = item.filename().string();
+        boost::optional<std::wstring> owner = item.owner();
+        boost::optional<std::wstring> group = item.group();
+
+        listing_entry entry;
+        entry.type = item.type();
+        entry.filename = view(filename);
+        entry.permissions = item.permissions();
+        if (owner)
+            entry.owner = view(*owner);
+        entry.uid = item.uid();
+        if (group)
+            entry.group = view(*group);
+        entry.gid = item.gid();
+        entry.size_in_bytes = item.size_in_bytes();
+        entry.last_accessed = item.last_accessed();
+        entry.last_modified = item.last_modified();
+
+        push_back(entry);
+    }
+
+    /**
+     * Bytes of memory held by the listing's entries.
+     */
+    std::size_t memory_used() const
+    {
+        return (m_storage) ? m_storage->memory_used() : 0;
+    }
+
+private:
+
+    static string_view view(const std::wstring& text)
+    {
+        const wchar_t* start = text.data();
+        return string_view(start, start + text.size());
+    }
+
+    /**
+     * Storage that can be modified without affecting copies of this listing
+     * or items viewing it.
+     */
+    detail::listing_storage& modifiable_storage()
+    {
+        if (!m_storage)
+        {
+            m_storage = boost::make_shared<detail::listing_storage>();
+        }
+        else if (!m_storage.unique())
+        {
+            m_storage = boost::make_shared<detail::listing_storage>(
+                *m_storage);
+        }
+
+        return *m_storage;
+    }
+
+    boost::shared_ptr<detail::listing_storage> m_storage;
+};
+
+}} // namespace swish::provider
+
+#endif
@@ -31,20 +31,22 @@
 
 #include "libssh2_sftp_filesystem_item.hpp"
 
-#include "swish/utils.hpp" // Utf8StringToWideString
+#include "swish/provider/directory_listing.hpp"
+#include "swish/provider/long_entry.hpp" // parse_long_entry
+#include "swish/utf8.hpp" // utf8_to_wide
 
 #include <ssh/filesystem.hpp> // file_attributes, sftp_file
 
-#include <boost/regex.hpp> // Regular expressions
 #include <boost/shared_ptr.hpp>
 
-using swish::utils::Utf8StringToWideString;
+using swish::utf8::utf8_to_wide;
 
 using comet::datetime_t;
 
 using ssh::filesystem::file_attributes;
 using ssh::filesystem::sftp_file;
 
+using boost::iterator_range;
 using boost::optional;
 using boost::shared_ptr;
 using boost::uint64_t;
@@ -52,65 +54,84 @@ using boost::uint64_t;
 using std::string;
 using std::wstring;
 
+namespace swish {
+namespace provider {
+
 namespace {
 
-    const boost::regex regex("\\S{10,}\\s+\\d+\\s+(\\S+)\\s+(\\S+)\\s+.+");
-    const unsigned int USER_MATCH = 1;
-    const unsigned int GROUP_MATCH = 2;
-        
-    /**
-     * Get the username part of an SFTP 'ls -l'-style long entry.
-     *
-     * According to the specification
-     * (http://www.openssh.org/txt/draft-ietf-secsh-filexfer-02.txt):
-     *
-     * The recommended format for the longname field is as follows:
-     *
-     *     -rwxr-xr-x   1 mjos     staff      348911 Mar 25 14:29 t-filexfer
-     *     1234567890 123 12345678 12345678 12345678 123456789012
-     *
-     * where the second line shows the *minimum* number of characters.
-     *
-     * @warning
-     * The spec specifically forbids parsing this long entry by it is the
-     * only way to get the user @b name rather than the user @b ID.
-     */
-    optional<wstring> parse_user_from_long_entry(const string& long_entry)
+    BOOST_SCOPED_ENUM(sftp_filesystem_item_interface::type) item_type(
+        const file_attributes& attributes)
     {
-        boost::smatch match;
-        if (regex_match(long_entry, match, regex) && match[USER_MATCH].matched)
-        {
-            return Utf8StringToWideString(match[USER_MATCH].str());
-        }
-        else
+        switch (attributes.type())
         {
-            return optional<wstring>();
+        case file_attributes::normal_file:
+            return sftp_filesystem_item_interface::type::file;
+
+        case file_attributes::directory:
+            return sftp_filesystem_item_interface::type::directory;
+
+        case file_attributes::symbolic_link:
+            return sftp_filesystem_item_interface::type::link;
+
+        default:
+            return sftp_filesystem_item_interface::type::unknown;
         }
     }
 
+    datetime_t from_unix_time(uint64_t unix_time)
+    {
+        datetime_t time;
+        time.from_unixtime(
+            static_cast<time_t>(unix_time),
+            datetime_t::utc_convert_mode::none);
+        return time;
+    }
+
+    iterator_range<const wchar_t*> view(const wstring& text)
+    {
+        return iterator_range<const wchar_t*>(
+            text.data(), text.data() + text.size());
+    }
+
     /**
-     * Get the group name part of an SFTP 'ls -l'-style long entry.
+     * Owner and group names, if the file's long entry has them.
      *
-     * @see parse_user_from_long_entry() for more information.
+     * Naughtily, we parse the long (ls -l) form of the file's attributes
+     * for the username and group.  The standard says we shouldn't but
+     * there's no other way to get them as text.  Although it contains a copy
+     * the filename, which may not be in UTF-8 encoding, we treat this
+     * long form as a UTF-8 string as the other info /should/ be UTF-8 and we
+     * don't use the filename.
      */
-    optional<wstring> parse_group_from_long_entry(const string& long_entry)
+    void account_names(
+        const sftp_file& file, const file_attributes& attributes,
+        account_name_cache& names, shared_ptr<const wstring>& owner,
+        shared_ptr<const wstring>& group)
     {
-        boost::smatch match;
-        if (regex_match(long_entry, match, regex) && match[GROUP_MATCH].matched)
+        // To be on the safe side assume that the long entry doesn't hold
+        // valid owner and group info if the UID and GID aren't valid
+
+        if (!attributes.uid() && !attributes.gid())
+            return;
+
+        optional<long_entry_fields> fields =
+            parse_long_entry(file.long_entry_view());
+        if (!fields)
+            return;
+
+        if (attributes.uid())
         {
-            return Utf8StringToWideString(match[GROUP_MATCH].str());
+            owner = names.user_name(*attributes.uid(), fields->owner);
         }
-        else
+
+        if (attributes.gid())
         {
-            return optional<wstring>();
+            group = names.group_name(*attributes.gid(), fields->group);
         }
     }
 
 }
 
-namespace swish {
-namespace provider {
-
 sftp_filesystem_item
 libssh2_sftp_filesystem_item::create_from_libssh2_attributes(
     const string& char_blob_file_name, const file_attributes& attributes)
@@ -121,38 +142,73 @@ libssh2_sftp_filesystem_item::create_from_libssh2_attributes(
 }
 
 sftp_filesystem_item
-libssh2_sftp_filesystem_item::create_from_libssh2_file(const sftp_file& file)
+libssh2_sftp_filesystem_item::create_from_libssh2_file(
+    const sftp_file& file, account_name_cache& names)
 {
     return sftp_filesystem_item(
         shared_ptr<sftp_filesystem_item_interface>(
-            new libssh2_sftp_filesystem_item(file)));
+            new libssh2_sftp_filesystem_item(file, names)));
 }
 
-
-void libssh2_sftp_filesystem_item::common_init(
-    const string& char_blob_file_name, const file_attributes& attributes)
+void libssh2_sftp_filesystem_item::append_to_listing(
+    directory_listing& listing, const sftp_file& file,
+    account_name_cache& names, wstring& name_buffer)
 {
+    file_attributes attributes = file.attributes();
+
     // FIXME: this filename may not be UTF-8 but we're blindly treating
     // it as though it were - should autodetect if possible
-    m_path = Utf8StringToWideString(char_blob_file_name);
+    iterator_range<const char*> name = file.name_view();
+    utf8_to_wide(name.begin(), name.size(), name_buffer);
 
-    switch (attributes.type())
-    {
-    case file_attributes::normal_file:
-        m_type = type::file;
-        break;
+    listing_entry entry;
+    entry.type = item_type(attributes);
+    entry.filename = view(name_buffer);
 
-    case file_attributes::directory:
-        m_type = type::directory;
-        break;
+    if (attributes.permissions())
+        entry.permissions = *attributes.permissions();
 
-    case file_attributes::symbolic_link:
-        m_type = type::link;
-        break;
+    if (attributes.size())
+        entry.size_in_bytes = *attributes.size();
 
-    default:
-        m_type = type::unknown;
-    }
+    if (attributes.uid())
+        entry.uid = *attributes.uid();
+
+    if (attributes.gid())
+        entry.gid = *attributes.gid();
+
+    if (attributes.last_accessed())
+        entry.last_accessed = from_unix_time(*attributes.last_accessed());
+
+    if (attributes.last_modified())
+        entry.last_modified = from_unix_time(*attributes.last_modified());
+
+    shared_ptr<const wstring> owner;
+    shared_ptr<const wstring> group;
+    account_names(file, attributes, names, owner, group);
+
+    if (owner)
+        entry.owner = view(*owner);
+
+    if (group)
+        entry.group = view(*group);
+
+    listing.push_back(entry);
+}
+
+
+void libssh2_sftp_filesystem_item::common_init(
+    iterator_range<const char*> char_blob_file_name,
+    const file_attributes& attributes)
+{
+    // FIXME: this filename may not be UTF-8 but we're blindly treating
+    // it as though it were - should autodetect if possible
+    wstring file_name;
+    utf8_to_wide(
+        char_blob_file_name.begin(), char_blob_file_name.size(), file_name);
+    m_path = file_name;
+
+    m_type = item_type(attributes);
 
     if (attributes.permissions())
     {
@@ -176,49 +232,25 @@ void libssh2_sftp_filesystem_item::common_init(
 
     if (attributes.last_accessed())
     {
-        m_accessed.from_unixtime(
-            static_cast<time_t>(*attributes.last_accessed()),
-            datetime_t::utc_convert_mode::none);
+        m_accessed = from_unix_time(*attributes.last_accessed());
     }
 
     if (attributes.last_modified())
     {
-        m_modified.from_unixtime(
-            static_cast<time_t>(*attributes.last_modified()),
-            datetime_t::utc_convert_mode::none);
+        m_modified = from_unix_time(*attributes.last_modified());
     }
 }
 
 libssh2_sftp_filesystem_item::libssh2_sftp_filesystem_item(
-    const sftp_file& file)
+    const sftp_file& file, account_name_cache& names)
     :
 m_type(type::unknown), m_permissions(0U), m_uid(0U), m_gid(0U), m_size(0U)
 {
     file_attributes attributes = file.attributes();
 
-    common_init(file.name(), attributes);
-
-    // Naughtily, we parse the long (ls -l) form of the file's attributes
-    // for the username and group.  The standard says we shouldn't but
-    // there's no other way to get them as text.  Although it contains a copy
-    // the filename, which may not be in UTF-8 encoding, we treat this
-    // long form as a UTF-8 string as the other info /should/ be UTF-8 and we
-    // don't use the filename.
-
-    // To be on the safe side assume that the long entry doesn't hold
-    // valid owner and group info if the UID and GID aren't valid
+    common_init(file.name_view(), attributes);
 
-    string utf8_long_entry = file.long_entry();
-
-    if (attributes.uid())
-    {
-        m_owner = parse_user_from_long_entry(utf8_long_entry);
-    }
-
-    if (attributes.gid())
-    {
-        m_group = parse_group_from_long_entry(utf8_long_entry);
-    }
+    account_names(file, attributes, names, m_owner, m_group);
 }
 
 libssh2_sftp_filesystem_item::libssh2_sftp_filesystem_item(
@@ -226,7 +258,11 @@ libssh2_sftp_filesystem_item::libssh2_sftp_filesystem_item(
     :
 m_type(type::unknown), m_permissions(0U), m_uid(0U), m_gid(0U), m_size(0U)
 {
-    common_init(char_blob_file_name, attributes);
+    common_init(
+        iterator_range<const char*>(
+            char_blob_file_name.data(),
+            char_blob_file_name.data() + char_blob_file_name.size()),
+        attributes);
 }
 
 BOOST_SCOPED_ENUM(sftp_filesystem_item_interface::type)
@@ -247,7 +283,7 @@ unsigned long libssh2_sftp_filesystem_item::permissions() const
 
 optional<wstring> libssh2_sftp_filesystem_item::owner() const
 {
-    return m_owner;
+    return (m_owner) ? optional<wstring>(*m_owner) : optional<wstring>();
 }
 
 unsigned long libssh2_sftp_filesystem_item::uid() const
@@ -257,7 +293,7 @@ unsigned long libssh2_sftp_filesystem_item::uid() const
 
 optional<wstring> libssh2_sftp_filesystem_item::group() const
 {
-    return m_group;
+    return (m_group) ? optional<wstring>(*m_group) : optional<wstring>();
 }
 
 unsigned long libssh2_sftp_filesystem_item::gid() const
@@ -37,6 +37,8 @@
 
 #include <boost/cstdint.hpp> // uint64_t
 #include <boost/optional.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include <comet/datetime.h> // datetime_t
 
@@ -54,6 +56,9 @@ class sftp_file;
 namespace swish {
 namespace provider {
 
+class account_name_cache;
+class directory_listing;
+
 /**
  * An entry in an SFTP directory retrieved by the libssh2 backend.
  */
@@ -63,9 +68,25 @@ public:
 
     /**
      * Create filesystem entry from libssh2 filesystem item representation.
+     *
+     * @param names
+     *        Owner and group names of the connection the file was listed
+     *        from.  Items with the same owner share the cached name.
      */
     static sftp_filesystem_item create_from_libssh2_file(
-        const ssh::filesystem::sftp_file& file);
+        const ssh::filesystem::sftp_file& file, account_name_cache& names);
+
+    /**
+     * Add libssh2 filesystem item to a listing without creating an object
+     * for it.
+     *
+     * @param name_buffer
+     *        Scratch space for the converted filename.  Passing the same
+     *        buffer for each file of a listing saves reallocating it.
+     */
+    static void append_to_listing(
+        directory_listing& listing, const ssh::filesystem::sftp_file& file,
+        account_name_cache& names, std::wstring& name_buffer);
 
     /**
      * Create filesystem entry from libssh2 filesystem item representation using
@@ -103,21 +124,21 @@ public:
 private:
 
     libssh2_sftp_filesystem_item(
-        const ssh::filesystem::sftp_file& file);
+        const ssh::filesystem::sftp_file& file, account_name_cache& names);
 
     libssh2_sftp_filesystem_item(
         const std::string& char_blob_file_name,
         const ssh::filesystem::file_attributes& attributes);
 
     void common_init(
-        const std::string& char_blob_file_name,
+        boost::iterator_range<const char*> char_blob_file_name,
         const ssh::filesystem::file_attributes& attributes);
 
     BOOST_SCOPED_ENUM(type) m_type;
     sftp_provider_path m_path;
     unsigned long m_permissions;
-    boost::optional<std::wstring> m_owner;
-    boost::optional<std::wstring> m_group;
+    boost::shared_ptr<const std::wstring> m_owner; ///< Shared; may be NULL
+    boost::shared_ptr<const std::wstring> m_group; ///< Shared; may be NULL
     unsigned long m_uid;
     unsigned long m_gid;
     boost::uint64_t m_size;
@@ -0,0 +1,184 @@
+/**
+    @file
+
+    Owner and group names from SFTP long entries.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "long_entry.hpp"
+
+#include "swish/utf8.hpp" // utf8_to_wide
+
+#include <boost/algorithm/string/predicate.hpp> // equals
+#include <boost/make_shared.hpp>
+
+using swish::utf8::utf8_to_wide;
+
+using boost::algorithm::equals;
+using boost::iterator_range;
+using boost::make_shared;
+using boost::mutex;
+using boost::optional;
+using boost::shared_ptr;
+
+using std::string;
+using std::wstring;
+
+namespace swish {
+namespace provider {
+
+namespace {
+
+    // Hand-rolled rather than <cctype> as those are locale-sensitive and
+    // slow; these match what \s and \d matched in the regex this replaced
+
+    inline bool is_space(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'
+            || c == '\v';
+    }
+
+    inline bool is_digit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    /**
+     * End of the field starting at `pos`.
+     */
+    const char* field_end(const char* pos, const char* end)
+    {
+        while (pos != end && !is_space(*pos))
+        {
+            ++pos;
+        }
+
+        return pos;
+    }
+
+    /**
+     * Start of the field following the field ending at `pos`.
+     *
+     * @returns
+     *     Start of the next field or NULL if there isn't any whitespace to
+     *     separate it from the last one.
+     */
+    const char* next_field(const char* pos, const char* end)
+    {
+        const char* field = pos;
+        while (field != end && is_space(*field))
+        {
+            ++field;
+        }
+
+        return (field == pos) ? NULL : field;
+    }
+
+}
+
+optional<long_entry_fields> parse_long_entry(
+    iterator_range<const char*> long_entry)
+{
+    const char* end = long_entry.end();
+
+    // Permissions: at least 10 characters
+    const char* pos = field_end(long_entry.begin(), end);
+    if (pos - long_entry.begin() < 10)
+        return optional<long_entry_fields>();
+
+    // Link count: digits only
+    const char* field = next_field(pos, end);
+    if (!field)
+        return optional<long_entry_fields>();
+
+    pos = field;
+    while (pos != end && is_digit(*pos))
+    {
+        ++pos;
+    }
+
+    if (pos == field)
+        return optional<long_entry_fields>();
+
+    long_entry_fields fields;
+
+    field = next_field(pos, end);
+    if (!field || field == end)
+        return optional<long_entry_fields>();
+
+    pos = field_end(field, end);
+    fields.owner = iterator_range<const char*>(field, pos);
+
+    field = next_field(pos, end);
+    if (!field || field == end)
+        return optional<long_entry_fields>();
+
+    pos = field_end(field, end);
+    fields.group = iterator_range<const char*>(field, pos);
+
+    // The group must be followed by whitespace and *something*
+    if (end - pos < 2)
+        return optional<long_entry_fields>();
+
+    return fields;
+}
+
+shared_ptr<const wstring> account_name_cache::user_name(
+    unsigned long uid, iterator_range<const char*> utf8_name)
+{
+    return lookup(m_users, uid, utf8_name);
+}
+
+shared_ptr<const wstring> account_name_cache::group_name(
+    unsigned long gid, iterator_range<const char*> utf8_name)
+{
+    return lookup(m_groups, gid, utf8_name);
+}
+
+shared_ptr<const wstring> account_name_cache::lookup(
+    name_mapping& names, unsigned long id,
+    iterator_range<const char*> utf8_name)
+{
+    mutex::scoped_lock lock(m_guard);
+
+    cached_name& cached = names[id];
+
+    // Checking the name still matches, rather than trusting the ID alone,
+    // keeps us right if an account is renamed while we're connected
+    if (!cached.name || !equals(cached.utf8_name, utf8_name))
+    {
+        cached.utf8_name.assign(utf8_name.begin(), utf8_name.end());
+
+        wstring name;
+        utf8_to_wide(utf8_name.begin(), utf8_name.size(), name);
+        cached.name = make_shared<wstring>(name);
+    }
+
+    return cached.name;
+}
+
+}} // namespace swish::provider
@@ -0,0 +1,138 @@
+/**
+    @file
+
+    Owner and group names from SFTP long entries.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#ifndef SWISH_PROVIDER_LONG_ENTRY_HPP
+#define SWISH_PROVIDER_LONG_ENTRY_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/optional/optional.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+#include <string>
+
+namespace swish {
+namespace provider {
+
+/**
+ * Owner and group fields of an SFTP 'ls -l'-style long entry.
+ *
+ * The fields point into the parsed entry; they are not copies.
+ */
+struct long_entry_fields
+{
+    boost::iterator_range<const char*> owner;
+    boost::iterator_range<const char*> group;
+};
+
+/**
+ * Pull the owner and group names out of an SFTP 'ls -l'-style long entry.
+ *
+ * According to the specification
+ * (http://www.openssh.org/txt/draft-ietf-secsh-filexfer-02.txt):
+ *
+ * The recommended format for the longname field is as follows:
+ *
+ *     -rwxr-xr-x   1 mjos     staff      348911 Mar 25 14:29 t-filexfer
+ *     1234567890 123 12345678 12345678 12345678 123456789012
+ *
+ * where the second line shows the *minimum* number of characters.
+ *
+ * Both fields are found in a single pass over the start of the entry.
+ *
+ * @returns
+ *     The fields or nothing if the entry isn't in the recommended format.
+ *
+ * @warning
+ * The spec specifically forbids parsing this long entry by it is the
+ * only way to get the user @b name rather than the user @b ID.
+ */
+boost::optional<long_entry_fields> parse_long_entry(
+    boost::iterator_range<const char*> long_entry);
+
+/**
+ * Cache of user and group names by ID.
+ *
+ * A directory's files are mostly owned by a handful of users so, rather
+ * than convert the same owner name for every file in a listing, the
+ * converted name is kept and shared by every item with that owner.
+ *
+ * The cache belongs to one connection as IDs are only meaningful on the
+ * server they came from.
+ *
+ * Instances are thread-safe.
+ */
+class account_name_cache : private boost::noncopyable
+{
+public:
+
+    /**
+     * Wide form of a user name listed for a UID.
+     *
+     * @param utf8_name
+     *     The name as listed by the server.  If this no longer matches the
+     *     name cached for the UID, the cache is updated.
+     */
+    boost::shared_ptr<const std::wstring> user_name(
+        unsigned long uid, boost::iterator_range<const char*> utf8_name);
+
+    /**
+     * Wide form of a group name listed for a GID.
+     *
+     * @see user_name
+     */
+    boost::shared_ptr<const std::wstring> group_name(
+        unsigned long gid, boost::iterator_range<const char*> utf8_name);
+
+private:
+
+    struct cached_name
+    {
+        std::string utf8_name;
+        boost::shared_ptr<const std::wstring> name;
+    };
+
+    typedef std::map<unsigned long, cached_name> name_mapping;
+
+    boost::shared_ptr<const std::wstring> lookup(
+        name_mapping& names, unsigned long id,
+        boost::iterator_range<const char*> utf8_name);
+
+    boost::mutex m_guard;
+    name_mapping m_users;
+    name_mapping m_groups;
+};
+
+}}
+
+#endif
@@ -41,6 +41,7 @@
 
 #include <comet/datetime.h> // datetime_t
 
+#include <cstddef> // size_t
 #include <string>
 
 
@@ -115,49 +116,107 @@ public:
     virtual comet::datetime_t last_modified() const = 0;
 };
 
+/**
+ * Interface to many SFTP files' properties, addressed by position.
+ *
+ * Lets `sftp_filesystem_item` stand for one entry of a collection, such as
+ * a compact `directory_listing`, without each entry having to be an object
+ * of its own.
+ *
+ * @see sftp_filesystem_item_interface for the meaning of each property.
+ */
+class sftp_filesystem_item_collection
+{
+public:
+
+    virtual ~sftp_filesystem_item_collection() {}
+
+    virtual BOOST_SCOPED_ENUM(sftp_filesystem_item_interface::type) type(
+        std::size_t index) const = 0;
+    virtual sftp_provider_path filename(std::size_t index) const = 0;
+    virtual unsigned long permissions(std::size_t index) const = 0;
+    virtual boost::optional<std::wstring> owner(std::size_t index) const = 0;
+    virtual unsigned long uid(std::size_t index) const = 0;
+    virtual boost::optional<std::wstring> group(std::size_t index) const = 0;
+    virtual unsigned long gid(std::size_t index) const = 0;
+    virtual boost::uint64_t size_in_bytes(std::size_t index) const = 0;
+    virtual comet::datetime_t last_accessed(std::size_t index) const = 0;
+    virtual comet::datetime_t last_modified(std::size_t index) const = 0;
+};
+
 /**
  * Type erasure interface to SFTP representation implementations.
+ *
+ * Either owns an implementation of its own or is a cheap view of one entry
+ * in a collection.
  */
 class sftp_filesystem_item : public sftp_filesystem_item_interface
 {
 public:
 
     BOOST_SCOPED_ENUM(type) type() const
-    { return m_inner->type(); }
+    { return (m_inner) ? m_inner->type() : m_collection->type(m_index); }
 
     sftp_provider_path filename() const
-    { return m_inner ->filename(); }
+    {
+        return (m_inner) ?
+            m_inner->filename() : m_collection->filename(m_index);
+    }
 
     unsigned long permissions() const
-    { return m_inner->permissions(); }
+    {
+        return (m_inner) ?
+            m_inner->permissions() : m_collection->permissions(m_index);
+    }
 
     boost::optional<std::wstring> owner() const
-    { return m_inner->owner(); }
+    { return (m_inner) ? m_inner->owner() : m_collection->owner(m_index); }
 
     unsigned long uid() const
-    { return m_inner->uid(); }
+    { return (m_inner) ? m_inner->uid() : m_collection->uid(m_index); }
 
     boost::optional<std::wstring> group() const
-    { return m_inner->group(); }
+    { return (m_inner) ? m_inner->group() : m_collection->group(m_index); }
 
     unsigned long gid() const
-    { return m_inner->gid(); }
+    { return (m_inner) ? m_inner->gid() : m_collection->gid(m_index); }
 
     boost::uint64_t size_in_bytes() const
-    { return m_inner->size_in_bytes(); }
+    {
+        return (m_inner) ?
+            m_inner->size_in_bytes() : m_collection->size_in_bytes(m_index);
+    }
 
     comet::datetime_t last_accessed() const
-    { return m_inner->last_accessed(); }
+    {
+        return (m_inner) ?
+            m_inner->last_accessed() : m_collection->last_accessed(m_index);
+    }
 
     comet::datetime_t last_modified() const
-    { return m_inner->last_modified(); }
+    {
+        return (m_inner) ?
+            m_inner->last_modified() : m_collection->last_modified(m_index);
+    }
 
     explicit sftp_filesystem_item(
         boost::shared_ptr<sftp_filesystem_item_interface> inner)
-        : m_inner(inner) {}
+        : m_inner(inner), m_index(0) {}
+
+    /**
+     * View of an entry in a collection.
+     *
+     * The view keeps the collection alive.
+     */
+    sftp_filesystem_item(
+        boost::shared_ptr<const sftp_filesystem_item_collection> collection,
+        std::size_t index)
+        : m_collection(collection), m_index(index) {}
 
 private:
     boost::shared_ptr<sftp_filesystem_item_interface> m_inner;
+    boost::shared_ptr<const sftp_filesystem_item_collection> m_collection;
+    std::size_t m_index;
 };
 
 }}
@@ -29,16 +29,19 @@
 #define SWISH_PROVIDER_SFTP_PROVIDER_H
 #pragma once
 
+#include "swish/provider/directory_listing.hpp"
 #include "swish/provider/sftp_filesystem_item.hpp"
 #include "swish/provider/sftp_provider_path.hpp"
 
 #include <boost/filesystem/path.hpp> // wpath
+#include <boost/function.hpp>
 #include <boost/optional/optional.hpp>
-//#include <boost/range/any_range.hpp> USE ONCE WE UPGRADE BOOST
+#include <boost/shared_ptr.hpp>
 
 #include <comet/interface.h> // comtype
 #include <comet/ptr.h> // com_ptr
 
+#include <cstddef> // size_t
 #include <string> // wstring
 #include <utility> // pair
 #include <vector>
@@ -97,13 +100,15 @@ public:
 };
 
 namespace swish {
-namespace provider {
+namespace block_transfer {
+
+class byte_sink;
+class byte_source;
+
+}}
 
-//typedef boost::any_range<
-//    sftp_filesystem_item, boost::forward_traversal_tag,
-//    sftp_filesystem_item&, std::ptrdiff_t>
-//    directory_listing;
-typedef std::vector<sftp_filesystem_item> directory_listing;
+namespace swish {
+namespace provider {
 
 class sftp_provider
 {
@@ -133,6 +138,59 @@ public:
 
     virtual sftp_filesystem_item stat(
         const sftp_provider_path& path, bool follow_links) = 0;
+
+    /**
+     * Unpack a tar archive into a directory using the server's own tar.
+     *
+     * Lets a batch of small files travel as one stream rather than as
+     * several SFTP round trips each.
+     *
+     * @param directory      Existing directory to unpack into.
+     * @param write_archive  Writes the whole archive to the sink it is given.
+     *
+     * @returns
+     *     false, without calling `write_archive`, if the server can't run
+     *     tar for us; the caller must then copy the files some other way.
+     */
+    virtual bool extract_archive(
+        const sftp_provider_path& directory,
+        boost::function<void (swish::block_transfer::byte_sink&)>
+            write_archive) = 0;
+
+    /**
+     * Tar archive, made by the server's own tar, of items in a directory
+     * and everything below them.
+     *
+     * Lets a tree of small files travel as one stream rather than as
+     * several SFTP round trips each.  The archive is made as it is read.
+     *
+     * @param directory  Directory holding the items.
+     * @param items      Names of the items, relative to `directory`.
+     *
+     * @returns
+     *     null if the server can't run tar for us; the caller must then
+     *     fetch the files some other way.
+     */
+    virtual boost::shared_ptr<swish::block_transfer::byte_source>
+    create_archive(
+        const sftp_provider_path& directory,
+        const std::vector<sftp_provider_path>& items) = 0;
+
+    /**
+     * Providers whose file streams each have an SFTP channel to themselves.
+     *
+     * Streams from different providers in the batch overlap their round
+     * trips rather than taking turns on this provider's channel.  Anything
+     * other than a file stream is passed on to this provider.
+     *
+     * @param count  The most providers wanted.
+     *
+     * @returns
+     *     Up to `count` providers; none if the server won't open another
+     *     channel, in which case the caller must make do with this one.
+     */
+    virtual std::vector<boost::shared_ptr<sftp_provider>> borrow_channels(
+        std::size_t count) = 0;
 };
 
 }}
@@ -166,7 +166,7 @@ variant_t property_from_pidl(const cpidl_t& pidl, const property_key& key)
     if (pos == remote_property_getters.end())
         BOOST_THROW_EXCEPTION(unknown_property_error());
 
-    return (pos->second)(pidl.get());
+    return (pos->second)(pidl);
 }
 
 /**
@@ -183,12 +183,15 @@ variant_t property_from_pidl(const cpidl_t& pidl, const property_key& key)
 int compare_pidls_by_property(
     const cpidl_t& left, const cpidl_t& right, const property_key& key)
 {
-    if (property_from_pidl(left, key) == property_from_pidl(right, key))
+    variant_t left_property = property_from_pidl(left, key);
+    variant_t right_property = property_from_pidl(right, key);
+
+    if (left_property == right_property)
         return 0;
-    else if (property_from_pidl(left, key) < property_from_pidl(right, key))
+    else if (left_property < right_property)
         return -1;
 
-    assert(property_from_pidl(left, key) > property_from_pidl(right, key));
+    assert(left_property > right_property);
     return 1;
 }
 
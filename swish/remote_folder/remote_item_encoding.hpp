@@ -0,0 +1,474 @@
+/**
+    @file
+
+    Platform-neutral encoding of remote folder item IDs.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#ifndef SWISH_REMOTE_FOLDER_REMOTE_ITEM_ENCODING_HPP
+#define SWISH_REMOTE_FOLDER_REMOTE_ITEM_ENCODING_HPP
+#pragma once
+
+#include "swish/remotelimits.h"  // Text field limits
+
+#include <boost/cstdint.hpp> // uint8_t, uint16_t, uint32_t, uint64_t
+#include <boost/range/iterator_range.hpp>
+
+#include <algorithm> // min
+#include <cstddef> // size_t
+#include <cstring> // memcpy
+
+namespace swish {
+namespace remote_folder {
+
+/**
+ * UTF-16 text held in an encoded remote item.
+ */
+typedef boost::iterator_range<const boost::uint16_t*> encoded_text;
+
+/**
+ * Properties to encode in a remote item ID.
+ *
+ * Text longer than the limits in remotelimits.h is truncated.
+ */
+struct remote_item_properties
+{
+    remote_item_properties()
+        :
+        is_folder(false), is_link(false), owner_id(0), group_id(0),
+        permissions(0), size(0), date_modified(0), date_accessed(0) {}
+
+    encoded_text filename;
+    bool is_folder;
+    bool is_link;
+    encoded_text owner;
+    encoded_text group;
+    boost::uint32_t owner_id;
+    boost::uint32_t group_id;
+    boost::uint32_t permissions;
+    boost::uint64_t size;
+    double date_modified; ///< OLE automation DATE
+    double date_accessed; ///< OLE automation DATE
+};
+
+namespace detail {
+
+    /**
+     * Layout of remote item IDs.
+     *
+     * Every version starts with the SHITEMID size and the fingerprint that
+     * marks the item as one of ours.
+     *
+     * Version 1 items were a fixed-size packed structure with
+     * NUL-terminated text in buffers big enough for the longest value
+     * allowed.  The byte after the fingerprint was the item's folder flag
+     * so held 0 or 1.
+     *
+     * Later versions put their version number in that byte instead, and it
+     * is always greater than 1.  Version 2 follows it with the fixed-size
+     * fields, the lengths of the filename, owner and group and then the
+     * text of each, without terminators.  The item is padded to a multiple
+     * of four bytes so that items following it in a PIDL stay aligned.
+     */
+    namespace remote_item_layout {
+
+        const boost::uint32_t FINGERPRINT = 0x533aaf69;
+
+        const std::size_t SIZE_OFFSET = 0;
+        const std::size_t FINGERPRINT_OFFSET = 2;
+        const std::size_t VERSION_OFFSET = 6;
+
+        const boost::uint8_t CURRENT_VERSION = 2;
+
+        namespace v1 {
+
+            const std::size_t IS_FOLDER_OFFSET = 6;
+            const std::size_t IS_LINK_OFFSET = 7;
+            const std::size_t FILENAME_OFFSET = 8;
+            const std::size_t OWNER_OFFSET =
+                FILENAME_OFFSET + MAX_FILENAME_LENZ * 2;
+            const std::size_t GROUP_OFFSET =
+                OWNER_OFFSET + MAX_USERNAME_LENZ * 2;
+            const std::size_t UID_OFFSET = GROUP_OFFSET + MAX_USERNAME_LENZ * 2;
+            const std::size_t GID_OFFSET = UID_OFFSET + 4;
+            const std::size_t PERMISSIONS_OFFSET = GID_OFFSET + 4;
+            const std::size_t SIZE_IN_BYTES_OFFSET = PERMISSIONS_OFFSET + 4;
+            const std::size_t MODIFIED_OFFSET = SIZE_IN_BYTES_OFFSET + 8;
+            const std::size_t ACCESSED_OFFSET = MODIFIED_OFFSET + 8;
+            const std::size_t ITEM_SIZE = ACCESSED_OFFSET + 8;
+        }
+
+        namespace v2 {
+
+            const std::size_t FLAGS_OFFSET = 7;
+            const std::size_t UID_OFFSET = 8;
+            const std::size_t GID_OFFSET = 12;
+            const std::size_t PERMISSIONS_OFFSET = 16;
+            const std::size_t SIZE_IN_BYTES_OFFSET = 20;
+            const std::size_t MODIFIED_OFFSET = 28;
+            const std::size_t ACCESSED_OFFSET = 36;
+            const std::size_t FILENAME_LENGTH_OFFSET = 44;
+            const std::size_t OWNER_LENGTH_OFFSET = 46;
+            const std::size_t GROUP_LENGTH_OFFSET = 48;
+            const std::size_t TEXT_OFFSET = 50;
+
+            const boost::uint8_t IS_FOLDER_FLAG = 0x1;
+            const boost::uint8_t IS_LINK_FLAG = 0x2;
+        }
+    }
+
+    template<typename T>
+    inline T read_field(const unsigned char* item, std::size_t offset)
+    {
+        T value;
+        std::memcpy(&value, item + offset, sizeof(value));
+        return value;
+    }
+
+    template<typename T>
+    inline void write_field(unsigned char* item, std::size_t offset, T value)
+    {
+        std::memcpy(item + offset, &value, sizeof(value));
+    }
+
+    inline std::size_t padded_item_size(std::size_t size)
+    {
+        return (size + 3) & ~std::size_t(3);
+    }
+
+    inline std::size_t clamped_length(encoded_text text, std::size_t limit)
+    {
+        return (std::min)(static_cast<std::size_t>(text.size()), limit);
+    }
+
+}
+
+/**
+ * Largest item `encode_remote_item` produces.
+ */
+const std::size_t MAX_ENCODED_REMOTE_ITEM_SIZE =
+    ((detail::remote_item_layout::v2::TEXT_OFFSET +
+      (MAX_FILENAME_LEN + 2 * MAX_USERNAME_LEN) * 2) + 3) & ~std::size_t(3);
+
+/**
+ * Size of the item `encode_remote_item` produces for the given properties.
+ */
+inline std::size_t encoded_remote_item_size(
+    const remote_item_properties& properties)
+{
+    std::size_t text_length =
+        detail::clamped_length(properties.filename, MAX_FILENAME_LEN) +
+        detail::clamped_length(properties.owner, MAX_USERNAME_LEN) +
+        detail::clamped_length(properties.group, MAX_USERNAME_LEN);
+
+    return detail::padded_item_size(
+        detail::remote_item_layout::v2::TEXT_OFFSET + text_length * 2);
+}
+
+/**
+ * Encode properties as a remote item ID in the current format.
+ *
+ * This writes the item only, not the terminator that ends a PIDL.
+ *
+ * @param buffer
+ *     Destination of at least `encoded_remote_item_size(properties)` bytes.
+ *
+ * @returns  Number of bytes written; the item's `cb`.
+ */
+inline std::size_t encode_remote_item(
+    const remote_item_properties& properties, unsigned char* buffer)
+{
+    namespace layout = detail::remote_item_layout;
+    using detail::clamped_length;
+    using detail::write_field;
+
+    std::size_t filename_length =
+        clamped_length(properties.filename, MAX_FILENAME_LEN);
+    std::size_t owner_length =
+        clamped_length(properties.owner, MAX_USERNAME_LEN);
+    std::size_t group_length =
+        clamped_length(properties.group, MAX_USERNAME_LEN);
+
+    std::size_t text_end = layout::v2::TEXT_OFFSET +
+        (filename_length + owner_length + group_length) * 2;
+    std::size_t item_size = detail::padded_item_size(text_end);
+
+    boost::uint8_t flags = 0;
+    if (properties.is_folder)
+        flags |= layout::v2::IS_FOLDER_FLAG;
+    if (properties.is_link)
+        flags |= layout::v2::IS_LINK_FLAG;
+
+    write_field(
+        buffer, layout::SIZE_OFFSET, static_cast<boost::uint16_t>(item_size));
+    write_field(buffer, layout::FINGERPRINT_OFFSET, layout::FINGERPRINT);
+    write_field(buffer, layout::VERSION_OFFSET, layout::CURRENT_VERSION);
+    write_field(buffer, layout::v2::FLAGS_OFFSET, flags);
+    write_field(buffer, layout::v2::UID_OFFSET, properties.owner_id);
+    write_field(buffer, layout::v2::GID_OFFSET, properties.group_id);
+    write_field(buffer, layout::v2::PERMISSIONS_OFFSET, properties.permissions);
+    write_field(buffer, layout::v2::SIZE_IN_BYTES_OFFSET, properties.size);
+    write_field(buffer, layout::v2::MODIFIED_OFFSET, properties.date_modified);
+    write_field(buffer, layout::v2::ACCESSED_OFFSET, properties.date_accessed);
+    write_field(
+        buffer, layout::v2::FILENAME_LENGTH_OFFSET,
+        static_cast<boost::uint16_t>(filename_length));
+    write_field(
+        buffer, layout::v2::OWNER_LENGTH_OFFSET,
+        static_cast<boost::uint16_t>(owner_length));
+    write_field(
+        buffer, layout::v2::GROUP_LENGTH_OFFSET,
+        static_cast<boost::uint16_t>(group_length));
+
+    unsigned char* text = buffer + layout::v2::TEXT_OFFSET;
+    std::memcpy(text, properties.filename.begin(), filename_length * 2);
+    text += filename_length * 2;
+    std::memcpy(text, properties.owner.begin(), owner_length * 2);
+    text += owner_length * 2;
+    std::memcpy(text, properties.group.begin(), group_length * 2);
+
+    std::memset(buffer + text_end, 0, item_size - text_end);
+
+    return item_size;
+}
+
+/**
+ * Read the fields of an encoded remote item ID in place.
+ *
+ * Understands every version of the encoding.  Nothing is copied: the text
+ * accessors return ranges inside the item so the item must outlive them.
+ * The item must be at least two-byte aligned, which holds for items in
+ * PIDLs as the shell allocates them aligned and our items, like the
+ * shell's own, occupy a multiple of four bytes.
+ *
+ * The accessors other than `valid` may only be used on valid items.
+ */
+class encoded_remote_item
+{
+public:
+
+    explicit encoded_remote_item(const void* item)
+        : m_item(static_cast<const unsigned char*>(item)) {}
+
+    bool valid() const
+    {
+        namespace layout = detail::remote_item_layout;
+
+        if (m_item == NULL)
+            return false;
+
+        std::size_t item_size = this->item_size();
+        if (item_size < layout::VERSION_OFFSET + 1)
+            return false;
+
+        if (detail::read_field<boost::uint32_t>(
+            m_item, layout::FINGERPRINT_OFFSET) != layout::FINGERPRINT)
+            return false;
+
+        if (is_version_1())
+        {
+            return item_size == layout::v1::ITEM_SIZE;
+        }
+        else
+        {
+            if (version() != layout::CURRENT_VERSION ||
+                item_size < layout::v2::TEXT_OFFSET)
+                return false;
+
+            std::size_t text_length =
+                length_field(layout::v2::FILENAME_LENGTH_OFFSET) +
+                length_field(layout::v2::OWNER_LENGTH_OFFSET) +
+                length_field(layout::v2::GROUP_LENGTH_OFFSET);
+
+            return layout::v2::TEXT_OFFSET + text_length * 2 <= item_size;
+        }
+    }
+
+    /**
+     * Version of the encoding used by the item.
+     */
+    unsigned int version() const
+    {
+        return (is_version_1()) ?
+            1 : m_item[detail::remote_item_layout::VERSION_OFFSET];
+    }
+
+    encoded_text filename() const
+    {
+        namespace layout = detail::remote_item_layout;
+
+        if (is_version_1())
+            return v1_text(layout::v1::FILENAME_OFFSET, MAX_FILENAME_LENZ);
+        else
+            return v2_text(0);
+    }
+
+    encoded_text owner() const
+    {
+        namespace layout = detail::remote_item_layout;
+
+        if (is_version_1())
+            return v1_text(layout::v1::OWNER_OFFSET, MAX_USERNAME_LENZ);
+        else
+            return v2_text(1);
+    }
+
+    encoded_text group() const
+    {
+        namespace layout = detail::remote_item_layout;
+
+        if (is_version_1())
+            return v1_text(layout::v1::GROUP_OFFSET, MAX_USERNAME_LENZ);
+        else
+            return v2_text(2);
+    }
+
+    bool is_folder() const
+    {
+        namespace layout = detail::remote_item_layout;
+
+        if (is_version_1())
+            return m_item[layout::v1::IS_FOLDER_OFFSET] != 0;
+        else
+            return (m_item[layout::v2::FLAGS_OFFSET] &
+                layout::v2::IS_FOLDER_FLAG) != 0;
+    }
+
+    bool is_link() const
+    {
+        namespace layout = detail::remote_item_layout;
+
+        if (is_version_1())
+            return m_item[layout::v1::IS_LINK_OFFSET] != 0;
+        else
+            return (m_item[layout::v2::FLAGS_OFFSET] &
+                layout::v2::IS_LINK_FLAG) != 0;
+    }
+
+    boost::uint32_t owner_id() const
+    {
+        namespace layout = detail::remote_item_layout;
+        return field<boost::uint32_t>(
+            layout::v1::UID_OFFSET, layout::v2::UID_OFFSET);
+    }
+
+    boost::uint32_t group_id() const
+    {
+        namespace layout = detail::remote_item_layout;
+        return field<boost::uint32_t>(
+            layout::v1::GID_OFFSET, layout::v2::GID_OFFSET);
+    }
+
+    boost::uint32_t permissions() const
+    {
+        namespace layout = detail::remote_item_layout;
+        return field<boost::uint32_t>(
+            layout::v1::PERMISSIONS_OFFSET, layout::v2::PERMISSIONS_OFFSET);
+    }
+
+    boost::uint64_t size() const
+    {
+        namespace layout = detail::remote_item_layout;
+        return field<boost::uint64_t>(
+            layout::v1::SIZE_IN_BYTES_OFFSET,
+            layout::v2::SIZE_IN_BYTES_OFFSET);
+    }
+
+    double date_modified() const
+    {
+        namespace layout = detail::remote_item_layout;
+        return field<double>(
+            layout::v1::MODIFIED_OFFSET, layout::v2::MODIFIED_OFFSET);
+    }
+
+    double date_accessed() const
+    {
+        namespace layout = detail::remote_item_layout;
+        return field<double>(
+            layout::v1::ACCESSED_OFFSET, layout::v2::ACCESSED_OFFSET);
+    }
+
+private:
+
+    std::size_t item_size() const
+    {
+        return detail::read_field<boost::uint16_t>(
+            m_item, detail::remote_item_layout::SIZE_OFFSET);
+    }
+
+    bool is_version_1() const
+    {
+        return m_item[detail::remote_item_layout::VERSION_OFFSET] <= 1;
+    }
+
+    std::size_t length_field(std::size_t offset) const
+    {
+        return detail::read_field<boost::uint16_t>(m_item, offset);
+    }
+
+    template<typename T>
+    T field(std::size_t v1_offset, std::size_t v2_offset) const
+    {
+        return detail::read_field<T>(
+            m_item, (is_version_1()) ? v1_offset : v2_offset);
+    }
+
+    encoded_text v1_text(std::size_t offset, std::size_t buffer_length) const
+    {
+        const boost::uint16_t* start =
+            reinterpret_cast<const boost::uint16_t*>(m_item + offset);
+        const boost::uint16_t* end = start;
+        while (end != start + buffer_length - 1 && *end != 0)
+        {
+            ++end;
+        }
+
+        return encoded_text(start, end);
+    }
+
+    /**
+     * Text of the nth text field.
+     */
+    encoded_text v2_text(std::size_t field) const
+    {
+        namespace layout = detail::remote_item_layout;
+
+        const boost::uint16_t* start =
+            reinterpret_cast<const boost::uint16_t*>(
+                m_item + layout::v2::TEXT_OFFSET);
+        for (std::size_t i = 0; i < field; ++i)
+        {
+            start += length_field(layout::v2::FILENAME_LENGTH_OFFSET + i * 2);
+        }
+
+        return encoded_text(
+            start,
+            start + length_field(
+                layout::v2::FILENAME_LENGTH_OFFSET + field * 2));
+    }
+
+    const unsigned char* m_item;
+};
+
+}} // namespace swish::remote_folder
+
+#endif
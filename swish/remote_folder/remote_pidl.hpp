@@ -28,14 +28,16 @@
 #define SWISH_REMOTE_FOLDER_REMOTE_PIDL_HPP
 #pragma once
 
-#include "swish/remotelimits.h"  // Text field limits
+#include "swish/remote_folder/remote_item_encoding.hpp"
 
 #include <comet/datetime.h> // datetime_t
 
 #include <winapi/shell/pidl.hpp> // pidl_t
 #include <winapi/shell/pidl_iterator.hpp> // raw_pidl_iterator
 
+#include <boost/cstdint.hpp> // uint16_t
 #include <boost/filesystem/path.hpp> // wpath
+#include <boost/range/iterator_range.hpp>
 #include <boost/static_assert.hpp> // BOOST_STATIC_ASSERT
 #include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
 
@@ -43,51 +45,35 @@
 #error Currently, swish requires strict PIDL types: define STRICT_TYPED_ITEMIDS
 #endif
 #include <ShTypes.h> // Raw PIDL types
-#include <StrAlign.h> // ua_wcslen, ua_wcscpy_s
 
-#include <cstring> // memset
+#include <cstddef> // size_t
+#include <cstring> // memcpy
 #include <exception>
 #include <string>
-#include <vector>
 
 namespace swish {
 namespace remote_folder {
 
 namespace detail {
 
-#include <pshpack1.h>
-/** 
- * Internal structure of the PIDLs representing items on the remote filesystem.
- */
-struct remote_item_id
-{
-    USHORT cb;
-    DWORD dwFingerprint;
-    bool fIsFolder;
-    bool fIsLink;
-    WCHAR wszFilename[MAX_FILENAME_LENZ];
-    WCHAR wszOwner[MAX_USERNAME_LENZ];
-    WCHAR wszGroup[MAX_USERNAME_LENZ];
-    ULONG uUid;
-    ULONG uGid;
-    DWORD dwPermissions;
-    //WORD wPadding;
-    ULONGLONG uSize;
-    DATE dateModified;
-    DATE dateAccessed;
-
-    static const DWORD FINGERPRINT = 0x533aaf69;
-};
-#include <poppack.h>
+    inline boost::iterator_range<const wchar_t*> as_wide_text(
+        encoded_text text)
+    {
+        BOOST_STATIC_ASSERT(sizeof(wchar_t) == sizeof(boost::uint16_t));
 
-BOOST_STATIC_ASSERT((sizeof(remote_item_id) % sizeof(DWORD)) == 0);
+        return boost::iterator_range<const wchar_t*>(
+            reinterpret_cast<const wchar_t*>(text.begin()),
+            reinterpret_cast<const wchar_t*>(text.end()));
+    }
 
-inline std::wstring copy_unaligned_string(const wchar_t __unaligned* source)
-{
-    std::vector<wchar_t> buffer(::ua_wcslen(source) + 1);
-    ::ua_wcscpy_s(&buffer[0], buffer.size(), source);
-    return std::wstring(&buffer[0]);
-}
+    inline encoded_text as_encoded_text(const std::wstring& text)
+    {
+        BOOST_STATIC_ASSERT(sizeof(wchar_t) == sizeof(boost::uint16_t));
+
+        const boost::uint16_t* start =
+            reinterpret_cast<const boost::uint16_t*>(text.data());
+        return encoded_text(start, start + text.size());
+    }
 
 }
 
@@ -108,116 +94,110 @@ public:
     template<typename T, typename Alloc>
     explicit remote_itemid_view(
         const winapi::shell::pidl::basic_pidl<T, Alloc>& pidl)
-        : m_itemid(reinterpret_cast<const detail::remote_item_id*>(pidl.get()))
+        : m_item(pidl.get())
     {}
 
-    explicit remote_itemid_view(PCUIDLIST_RELATIVE pidl)
-        : m_itemid(reinterpret_cast<const detail::remote_item_id*>(pidl)) {}
+    explicit remote_itemid_view(PCUIDLIST_RELATIVE pidl) : m_item(pidl) {}
 
     bool valid() const
     {
-        if (m_itemid == NULL)
-            return false;
-
-        return ((m_itemid->cb == sizeof(detail::remote_item_id)) &&
-            (m_itemid->dwFingerprint == detail::remote_item_id::FINGERPRINT));
+        return m_item.valid();
     }
 
     std::wstring filename() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return detail::copy_unaligned_string(m_itemid->wszFilename);
+        boost::iterator_range<const wchar_t*> text = filename_view();
+        return std::wstring(text.begin(), text.end());
     }
 
     std::wstring owner() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return detail::copy_unaligned_string(m_itemid->wszOwner);
+        boost::iterator_range<const wchar_t*> text = owner_view();
+        return std::wstring(text.begin(), text.end());
     }
 
     std::wstring group() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return detail::copy_unaligned_string(m_itemid->wszGroup);
+        boost::iterator_range<const wchar_t*> text = group_view();
+        return std::wstring(text.begin(), text.end());
+    }
+
+    /// @name Text without copying
+    ///
+    /// The text is inside the PIDL so is only valid as long as the PIDL is.
+    // @{
+
+    boost::iterator_range<const wchar_t*> filename_view() const
+    {
+        return detail::as_wide_text(checked_item().filename());
     }
 
+    boost::iterator_range<const wchar_t*> owner_view() const
+    {
+        return detail::as_wide_text(checked_item().owner());
+    }
+
+    boost::iterator_range<const wchar_t*> group_view() const
+    {
+        return detail::as_wide_text(checked_item().group());
+    }
+
+    // @}
+
     ULONG owner_id() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return m_itemid->uUid;
+        return checked_item().owner_id();
     }
 
     ULONG group_id() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return m_itemid->uGid;
+        return checked_item().group_id();
     }
 
     bool is_folder() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return m_itemid->fIsFolder;
+        return checked_item().is_folder();
     }
 
     bool is_link() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return m_itemid->fIsLink;
+        return checked_item().is_link();
     }
 
     DWORD permissions() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return m_itemid->dwPermissions;
+        return checked_item().permissions();
     }
 
     ULONGLONG size() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return m_itemid->uSize;
+        return checked_item().size();
     }
 
     comet::datetime_t date_modified() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return comet::datetime_t(m_itemid->dateModified);
+        return comet::datetime_t(checked_item().date_modified());
     }
 
     comet::datetime_t date_accessed() const
     {
-        if (!valid())
-            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
-        return comet::datetime_t(m_itemid->dateAccessed);
+        return comet::datetime_t(checked_item().date_accessed());
     }
 
 private:
-    const detail::remote_item_id __unaligned* m_itemid;
-};
 
-namespace detail {
-
-#include <pshpack1.h>
-    struct remote_item_template
+    const encoded_remote_item& checked_item() const
     {
-        remote_item_id id;
-        SHITEMID terminator;
-    };
-#include <poppack.h>
+        if (!valid())
+            BOOST_THROW_EXCEPTION(std::exception("PIDL is not a remote item"));
+        return m_item;
+    }
 
-}
+    encoded_remote_item m_item;
+};
 
 /**
- * Create a new wrapped PIDL holding a remote_item_id with given parameters.
+ * Create a new wrapped PIDL holding a remote item ID with given parameters.
  * 
  * @param filename       Name of file or directory on the remote filesystem.
  * @param is_folder      Is file a folder?
@@ -238,41 +218,34 @@ inline winapi::shell::pidl::cpidl_t create_remote_itemid(
     const comet::datetime_t date_modified,
     const comet::datetime_t date_accessed)
 {
-    // We create the item on the stack and then clone it into 
-    // a CoTaskMemAllocated pidl when we return it as a cpidl_t
-    detail::remote_item_template item;
-    std::memset(&item, 0, sizeof(item));
-
-    item.id.cb = sizeof(item.id);
-    item.id.dwFingerprint = detail::remote_item_id::FINGERPRINT;
-
-#pragma warning(push)
-#pragma warning(disable:4996)
-    filename.copy(item.id.wszFilename, MAX_FILENAME_LENZ);
-    item.id.wszFilename[MAX_HOSTNAME_LENZ - 1] = wchar_t();
-
-    owner.copy(item.id.wszOwner, MAX_USERNAME_LENZ);
-    item.id.wszOwner[MAX_USERNAME_LENZ - 1] = wchar_t();
-
-    group.copy(item.id.wszGroup, MAX_USERNAME_LENZ);
-    item.id.wszGroup[MAX_USERNAME_LENZ - 1] = wchar_t();
-#pragma warning(pop)
-
-    item.id.fIsFolder = is_folder;
-    item.id.fIsLink = is_link;
-
-    item.id.uUid = owner_id;
-    item.id.uGid = group_id;
-    item.id.dwPermissions = permissions;
-    item.id.uSize = size;
-
-    item.id.dateModified = date_modified.get();
-    item.id.dateAccessed = date_accessed.get();
-
-    assert(item.terminator.cb == 0);
+    remote_item_properties properties;
+    properties.filename = detail::as_encoded_text(filename);
+    properties.is_folder = is_folder;
+    properties.is_link = is_link;
+    properties.owner = detail::as_encoded_text(owner);
+    properties.group = detail::as_encoded_text(group);
+    properties.owner_id = owner_id;
+    properties.group_id = group_id;
+    properties.permissions = permissions;
+    properties.size = size;
+    properties.date_modified = date_modified.get();
+    properties.date_accessed = date_accessed.get();
+
+    // We encode the item on the stack, followed by the terminator, and then
+    // clone it into a CoTaskMemAllocated pidl when we return it as a cpidl_t.
+    // DWORDs keep the buffer aligned for the item's fields.
+    DWORD buffer[
+        (MAX_ENCODED_REMOTE_ITEM_SIZE + sizeof(USHORT) + sizeof(DWORD) - 1) /
+        sizeof(DWORD)];
+    unsigned char* item = reinterpret_cast<unsigned char*>(buffer);
+
+    std::size_t item_size = encode_remote_item(properties, item);
+
+    const USHORT terminator = 0;
+    std::memcpy(item + item_size, &terminator, sizeof(terminator));
 
     return winapi::shell::pidl::cpidl_t(
-        reinterpret_cast<PCITEMID_CHILD>(&item));
+        reinterpret_cast<PCITEMID_CHILD>(item));
 }
 
 /**
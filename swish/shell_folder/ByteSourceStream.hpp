@@ -0,0 +1,198 @@
+/**
+    @file
+
+    IStream over a file read from a byte source.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#ifndef SWISH_SHELL_FOLDER_BYTESOURCESTREAM_HPP
+#define SWISH_SHELL_FOLDER_BYTESOURCESTREAM_HPP
+#pragma once
+
+#include "swish/block_transfer.hpp" // byte_source
+#include "swish/provider/sftp_provider.hpp" // sftp_provider
+
+#include <winapi/com/catch.hpp> // WINAPI_COM_CATCH_INTERFACE
+
+#include <comet/server.h> // simple_object
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+
+namespace swish {
+namespace shell_folder {
+
+/**
+ * Read-only, forward-only IStream over the contents of one file, as split
+ * out of an archive or fetched ahead.
+ *
+ * Explorer only ever reads the FILECONTENTS streams it is given from start
+ * to end, and neither an archive nor a spool can go backwards anyway.
+ *
+ * The stream keeps the provider alive because the contents may still be
+ * arriving through its session, and Explorer may hold on to the stream
+ * after releasing the data object it came from.
+ */
+class ByteSourceStream : public comet::simple_object<IStream>
+{
+public:
+
+    ByteSourceStream(
+        boost::shared_ptr<swish::block_transfer::byte_source> contents,
+        const std::wstring& name, boost::uintmax_t size,
+        boost::shared_ptr<swish::provider::sftp_provider> provider)
+        :
+        m_contents(contents), m_name(name), m_size(size), m_position(0),
+        m_provider(provider) {}
+
+    virtual HRESULT STDMETHODCALLTYPE Read(
+        void* buffer, ULONG buffer_size, ULONG* read_count_out)
+    {
+        try
+        {
+            char* data = static_cast<char*>(buffer);
+
+            // Fill the buffer as some callers take a short read to mean the
+            // end of the stream
+            ULONG total = 0;
+            while (total < buffer_size)
+            {
+                std::size_t count = m_contents->read(
+                    data + total, buffer_size - total);
+                if (count == 0)
+                    break;
+
+                total += static_cast<ULONG>(count);
+            }
+
+            m_position += total;
+
+            if (read_count_out)
+                *read_count_out = total;
+
+            return S_OK;
+        }
+        WINAPI_COM_CATCH_INTERFACE(IStream);
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE Write(
+        const void* /*data*/, ULONG /*data_size*/,
+        ULONG* /*written_count_out*/)
+    {
+        return STG_E_ACCESSDENIED;
+    }
+
+    /**
+     * Only finding out the current position is possible.
+     */
+    virtual HRESULT STDMETHODCALLTYPE Seek(
+        LARGE_INTEGER offset, DWORD origin, ULARGE_INTEGER* new_position_out)
+    {
+        if (offset.QuadPart != 0 || origin != STREAM_SEEK_CUR)
+            return STG_E_INVALIDFUNCTION;
+
+        if (new_position_out)
+            new_position_out->QuadPart = m_position;
+
+        return S_OK;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE SetSize(ULARGE_INTEGER /*new_size*/)
+    {
+        return STG_E_ACCESSDENIED;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE CopyTo(
+        IStream* /*destination*/, ULARGE_INTEGER /*amount*/,
+        ULARGE_INTEGER* /*bytes_read_out*/,
+        ULARGE_INTEGER* /*bytes_written_out*/)
+    {
+        return E_NOTIMPL;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE Commit(DWORD /*commit_flags*/)
+    {
+        return S_OK;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE Revert()
+    {
+        return S_OK;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE LockRegion(
+        ULARGE_INTEGER /*offset*/, ULARGE_INTEGER /*extent*/,
+        DWORD /*lock_type*/)
+    {
+        return STG_E_INVALIDFUNCTION;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE UnlockRegion(
+        ULARGE_INTEGER /*offset*/, ULARGE_INTEGER /*extent*/,
+        DWORD /*lock_type*/)
+    {
+        return STG_E_INVALIDFUNCTION;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE Stat(
+        STATSTG* attributes_out, DWORD stat_flag)
+    {
+        if (!attributes_out)
+            return STG_E_INVALIDPOINTER;
+
+        ::ZeroMemory(attributes_out, sizeof(STATSTG));
+        attributes_out->type = STGTY_STREAM;
+        attributes_out->cbSize.QuadPart = m_size;
+        attributes_out->grfMode = STGM_READ;
+
+        if (!(stat_flag & STATFLAG_NONAME))
+        {
+            std::size_t bytes = (m_name.size() + 1) * sizeof(wchar_t);
+            attributes_out->pwcsName =
+                static_cast<LPOLESTR>(::CoTaskMemAlloc(bytes));
+            if (!attributes_out->pwcsName)
+                return E_OUTOFMEMORY;
+
+            ::CopyMemory(attributes_out->pwcsName, m_name.c_str(), bytes);
+        }
+
+        return S_OK;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE Clone(IStream** /*stream_out*/)
+    {
+        return E_NOTIMPL;
+    }
+
+private:
+    boost::shared_ptr<swish::block_transfer::byte_source> m_contents;
+    std::wstring m_name;
+    boost::uintmax_t m_size;
+    boost::uintmax_t m_position;
+    boost::shared_ptr<swish::provider::sftp_provider> m_provider;
+};
+
+}} // namespace swish::shell_folder
+
+#endif
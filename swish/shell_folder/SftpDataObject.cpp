@@ -19,14 +19,21 @@
 
 #include "SftpDataObject.h"
 
+#include "ByteSourceStream.hpp"
 #include "SftpDirectory.h"
 #include "data_object/StorageMedium.hpp"  // StorageMedium
 
+#include "swish/module_lock.hpp"
 #include "swish/provider/sftp_provider.hpp"
 #include "swish/remote_folder/remote_pidl.hpp" // remote_itemid_view
                                                // path_from_remote_pidl
+#include "swish/remote_folder/swish_pidl.hpp"
+                                      // absolute_path_from_swish_pidl
+#include "swish/trace.hpp" // trace
+#include "swish/utils.hpp" // WideStringToUtf8String
 
 #include <winapi/com/catch.hpp> // WINAPI_COM_CATCH_AUTO_INTERFACE
+#include <winapi/error.hpp> // last_error
 #include <winapi/shell/pidl.hpp> // cpidl_t, pidl_t
 #include <winapi/shell/pidl_iterator.hpp> // raw_pidl_iterator
 
@@ -34,36 +41,67 @@
 #pragma warning(disable:4244) // conversion from uint64_t to uint32_t
 #include <boost/date_time/posix_time/conversion.hpp> // from_ftime
 #pragma warning(pop)
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/filesystem/fstream.hpp> // fstream
+#include <boost/filesystem/path.hpp> // wpath
 #include <boost/iterator/transform_iterator.hpp> // transform_iterator
+#include <boost/make_shared.hpp>
 #include <boost/mem_fn.hpp> // mem_fn
+#include <boost/numeric/conversion/cast.hpp> // numeric_cast
 #include <boost/shared_ptr.hpp>
 
 #include <boost/utility.hpp> // next
 
+#include <algorithm> // replace
+#include <cstddef> // size_t
+#include <exception>
+#include <ios> // ios_base
+#include <iostream> // iostream
 #include <stdexcept> // runtime_error
+#include <string>
+#include <vector>
 
+using swish::block_transfer::byte_source;
+using swish::module_lock;
+using swish::prefetch::prefetch_options;
+using swish::prefetch::prefetcher;
 using swish::provider::sftp_provider;
+using swish::remote_folder::absolute_path_from_swish_pidl;
 using swish::remote_folder::path_from_remote_pidl;
 using swish::remote_folder::remote_itemid_view;
 using swish::shell_folder::data_object::FileGroupDescriptor;
 using swish::shell_folder::data_object::Descriptor;
 using swish::shell_folder::data_object::StorageMedium;
 using swish::shell_folder::data_object::group_descriptor_from_range;
+using swish::shell_folder::ByteSourceStream;
+using swish::tar::tar_demultiplexer;
+using swish::tracing::trace;
+using swish::utils::WideStringToUtf8String;
 
+using winapi::last_error;
 using winapi::shell::pidl::basic_pidl;
 using winapi::shell::pidl::cpidl_t;
 using winapi::shell::pidl::pidl_t;
 using winapi::shell::pidl::raw_pidl_iterator;
 
 using comet::com_error;
+using comet::com_error_from_interface;
 using comet::com_ptr;
 
+using boost::filesystem::wpath;
+using boost::make_shared;
 using boost::make_transform_iterator;
 using boost::mem_fn;
 using boost::next;
+using boost::numeric_cast;
 using boost::shared_ptr;
+using boost::uintmax_t;
 
+using std::exception;
 using std::runtime_error;
+using std::size_t;
+using std::vector;
+using std::wstring;
 
 namespace comet {
 
@@ -97,6 +135,7 @@ CSftpDataObject::CSftpDataObject(
     m_provider(provider),
     m_fExpandedPidlList(false),
     m_fRenderedDescriptor(false),
+    m_fRequestedArchive(false),
     m_cfPreferredDropEffect(static_cast<CLIPFORMAT>(
         ::RegisterClipboardFormat(CFSTR_PREFERREDDROPEFFECT))),
     m_cfFileDescriptor(static_cast<CLIPFORMAT>(
@@ -125,6 +164,20 @@ CSftpDataObject::CSftpDataObject(
     _RenderCfPreferredDropEffect();
 }
 
+CSftpDataObject::~CSftpDataObject()
+{
+    if (m_prefetcher)
+    {
+        // Not cancel(), which would hold up Explorer's thread until the
+        // read in progress comes back from the server
+        m_prefetcher->abandon();
+
+        uintmax_t unconsumed = m_prefetcher->unconsumed_bytes();
+        if (unconsumed > 0)
+            trace("Fetched %d bytes ahead that were never used") % unconsumed;
+    }
+}
+
 /*----------------------------------------------------------------------------*
  * IDataObject methods
  *----------------------------------------------------------------------------*/
@@ -311,11 +364,268 @@ throw(...)
     ATLENSURE_SUCCEEDED(hr);
     FileGroupDescriptor fgd(medium.get().hGlobal);
 
+    com_ptr<IStream> stream = _CreateArchivedFileStream(fgd[lindex]);
+    if (stream)
+        return stream;
+
+    stream = _CreatePrefetchedFileStream(fgd, lindex);
+    if (stream)
+        return stream;
+
     // Get stream from relative path stored in the lindexth FILEDESCRIPTOR
     CSftpDirectory dir(m_pidlCommonParent, m_provider);
     return dir.GetFileByPath(fgd[lindex].path().string().c_str(), false);
 }
 
+/**
+ * Stream for a file split off from the archive of the selection.
+ *
+ * The archive is started the first time any file is asked for.
+ *
+ * @returns  null if the file has to be fetched some other way.
+ */
+com_ptr<IStream> CSftpDataObject::_CreateArchivedFileStream(
+    const ExpandedItem& descriptor)
+{
+    if (!m_fRequestedArchive)
+    {
+        m_fRequestedArchive = true;
+        _StartArchive();
+    }
+
+    if (!m_archive)
+        return NULL;
+
+    wstring name = descriptor.path().string();
+    std::replace(name.begin(), name.end(), L'\\', L'/');
+
+    shared_ptr<byte_source> contents;
+    try
+    {
+        contents = m_archive->open(WideStringToUtf8String(name));
+    }
+    catch (const exception& e)
+    {
+        // Don't trust the rest of the archive either
+        trace("Reading archive failed, fetching files by SFTP: %s")
+            % e.what();
+        m_archive.reset();
+    }
+
+    if (!contents)
+        return NULL;
+
+    return new ByteSourceStream(
+        contents, descriptor.path().filename(), descriptor.file_size(),
+        m_provider);
+}
+
+/**
+ * Have the server archive the selection, if that's worth it and possible.
+ *
+ * Only directories are worth it: a selection of files, however many, is
+ * unlikely to be so large that the round trips matter.
+ */
+void CSftpDataObject::_StartArchive()
+{
+    bool has_directory = false;
+    vector<wpath> items;
+    for (UINT i = 0; i < m_pidls.size(); ++i)
+    {
+        remote_itemid_view itemid(m_pidls[i]);
+        has_directory = has_directory || itemid.is_folder();
+        items.push_back(itemid.filename());
+    }
+
+    if (!has_directory)
+        return;
+
+    try
+    {
+        shared_ptr<byte_source> archive = m_provider->create_archive(
+            absolute_path_from_swish_pidl(m_pidlCommonParent), items);
+
+        if (archive)
+            m_archive = make_shared<tar_demultiplexer>(archive);
+    }
+    catch (const exception& e)
+    {
+        trace("Unable to archive selection, fetching files by SFTP: %s")
+            % e.what();
+    }
+}
+
+namespace {
+
+    /**
+     * Bytes read from a remote file.
+     *
+     * Read on the prefetcher's thread.  This is only safe because the
+     * stream is the provider's own, which is not tied to an apartment.
+     */
+    class RemoteFileSource : public byte_source
+    {
+    public:
+        explicit RemoteFileSource(com_ptr<IStream> stream) : m_stream(stream)
+        {}
+
+        virtual size_t read(char* buffer, size_t size)
+        {
+            ULONG count = 0;
+            HRESULT hr = m_stream->Read(
+                buffer, numeric_cast<ULONG>(size), &count);
+            if (FAILED(hr))
+                BOOST_THROW_EXCEPTION(com_error_from_interface(m_stream, hr));
+
+            return count;
+        }
+
+    private:
+        com_ptr<IStream> m_stream;
+    };
+
+    /**
+     * Opens the remote files for the prefetcher, on its thread.
+     *
+     * The prefetcher keeps this for as long as its thread runs, which can
+     * be after the data object has gone, so this keeps the DLL loaded
+     * until then.
+     */
+    class RemoteFileOpener
+    {
+    public:
+        RemoteFileOpener(
+            shared_ptr<sftp_provider> provider, const wpath& directory,
+            const vector<wpath>& files)
+            :
+            m_provider(provider), m_directory(directory), m_files(files),
+            m_module(make_shared<module_lock>()) {}
+
+        shared_ptr<byte_source> operator()(size_t index) const
+        {
+            if (m_files[index].empty())
+                return shared_ptr<byte_source>(); // a directory
+
+            return make_shared<RemoteFileSource>(
+                m_provider->get_file(
+                    (m_directory / m_files[index]).string(),
+                    std::ios_base::in));
+        }
+
+    private:
+        shared_ptr<sftp_provider> m_provider;
+        wpath m_directory;
+        vector<wpath> m_files;
+        shared_ptr<module_lock> m_module;
+    };
+
+    /**
+     * File in the temporary directory that is deleted when closed.
+     */
+    class TemporaryFile : public boost::filesystem::fstream
+    {
+    public:
+        explicit TemporaryFile(const wpath& file)
+            :
+            boost::filesystem::fstream(
+                file, std::ios::in | std::ios::out | std::ios::binary |
+                std::ios::trunc),
+            m_file(file) {}
+
+        ~TemporaryFile()
+        {
+            close();
+            ::DeleteFileW(m_file.file_string().c_str());
+        }
+
+    private:
+        wpath m_file;
+    };
+
+    shared_ptr<std::iostream> create_spool_file()
+    {
+        vector<wchar_t> directory(MAX_PATH + 1, L'\0');
+        DWORD rc = ::GetTempPathW(
+            numeric_cast<DWORD>(directory.size()), &directory[0]);
+        if (rc < 1)
+            BOOST_THROW_EXCEPTION(last_error());
+
+        vector<wchar_t> file(MAX_PATH + 1, L'\0');
+        if (!::GetTempFileNameW(&directory[0], L"swi", 0, &file[0]))
+            BOOST_THROW_EXCEPTION(last_error());
+
+        shared_ptr<TemporaryFile> stream =
+            make_shared<TemporaryFile>(wpath(&file[0]));
+        if (!*stream)
+            BOOST_THROW_EXCEPTION(runtime_error("Unable to open spool file"));
+
+        return stream;
+    }
+}
+
+/**
+ * Stream for a file fetched ahead of Explorer asking for it.
+ *
+ * Fetching ahead starts the first time any file is asked for, with the
+ * files after it.
+ *
+ * @returns  null if the file has to be fetched some other way.
+ */
+com_ptr<IStream> CSftpDataObject::_CreatePrefetchedFileStream(
+    const FileGroupDescriptor& fgd, long lindex)
+{
+    // The archive is already ahead of Explorer
+    if (m_archive)
+        return NULL;
+
+    if (!m_prefetcher)
+    {
+        _StartPrefetching(fgd, lindex);
+        return NULL;
+    }
+
+    shared_ptr<byte_source> contents = m_prefetcher->take(lindex);
+    if (!contents)
+        return NULL;
+
+    return new ByteSourceStream(
+        contents, fgd[lindex].path().filename(), fgd[lindex].file_size(),
+        m_provider);
+}
+
+void CSftpDataObject::_StartPrefetching(
+    const FileGroupDescriptor& fgd, long lindex)
+{
+    if (static_cast<size_t>(lindex) + 1 >= fgd.size())
+        return;
+
+    // Directories get no path so the prefetcher skips them
+    vector<wpath> files;
+    vector<uintmax_t> sizes;
+    for (size_t i = 0; i < fgd.size(); ++i)
+    {
+        if (fgd[i].attributes() & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            files.push_back(wpath());
+            sizes.push_back(0);
+        }
+        else
+        {
+            files.push_back(fgd[i].path());
+            sizes.push_back(fgd[i].file_size());
+        }
+    }
+
+    prefetch_options options;
+    options.spool_file = create_spool_file;
+
+    m_prefetcher = make_shared<prefetcher>(
+        RemoteFileOpener(
+            m_provider, absolute_path_from_swish_pidl(m_pidlCommonParent),
+            files),
+        sizes, lindex + 1, options);
+}
+
 /**
  * Expand all top-level PIDLs into a list of Descriptors with relative paths.
  *
@@ -31,6 +31,8 @@
 
 #include "swish/provider/sftp_provider.hpp" // sftp_provider
 #include "swish/shell_folder/Pidl.h"
+#include "swish/prefetch.hpp" // prefetcher
+#include "swish/tar_demultiplexer.hpp" // tar_demultiplexer
 
 #include <winapi/shell/pidl.hpp> // cpidl_t
 
@@ -67,6 +69,17 @@
  * anywhere with those directory trees.  Unfortunately, this is a @b very
  * expensive operation but the shell design doesn't give any way to provide
  * a partial file group descriptor.
+ *
+ * Fetching every file of a tree by SFTP costs several round trips each.
+ * So, if the selection includes directories and the server can run tar for
+ * us, the whole selection is fetched as one tar stream and each
+ * CFSTR_FILECONTENTS stream is split off from it as it is requested.  Any
+ * file the archive can't supply is fetched by SFTP as before.
+ *
+ * Otherwise, once the first CFSTR_FILECONTENTS stream is requested, the
+ * files after it are fetched in the background, in descriptor order, while
+ * Explorer reads the one it asked for.  This keeps the link busy in the
+ * gaps between Explorer finishing one file and asking for the next.
  */
 class CSftpDataObject : public CDataObject
 {
@@ -77,6 +90,8 @@ public:
         __in PCIDLIST_ABSOLUTE pidlCommonParent,
         boost::shared_ptr<swish::provider::sftp_provider> provider);
 
+    ~CSftpDataObject();
+
 public: // IDataObject methods
 
     IFACEMETHODIMP GetData( 
@@ -132,6 +147,11 @@ private:
 
     HGLOBAL _CreateFileGroupDescriptor();
     comet::com_ptr<IStream> _CreateFileContentsStream(long lindex) throw(...);
+    comet::com_ptr<IStream> _CreateArchivedFileStream(
+        const ExpandedItem& descriptor);
+    comet::com_ptr<IStream> _CreatePrefetchedFileStream(
+        const swish::shell_folder::data_object::FileGroupDescriptor& fgd,
+        long lindex);
 
     void _ExpandPidlsInto(__inout ExpandedList& descriptors) const throw(...);
     void _ExpandTopLevelPidlInto(
@@ -144,4 +164,23 @@ private:
         const throw(...);
     inline bool _WantProgressDialogue() const throw();
     // @}
+
+    /** @name Fetching as an archive */
+    //@{
+    bool m_fRequestedArchive;         ///< Have we tried to start the archive?
+    boost::shared_ptr<swish::tar::tar_demultiplexer> m_archive;
+                                      ///< Selection as sent by server's tar
+
+    void _StartArchive();
+    //@}
+
+    /** @name Fetching ahead */
+    //@{
+    boost::shared_ptr<swish::prefetch::prefetcher> m_prefetcher;
+                                      ///< Fetches files after the current one
+
+    void _StartPrefetching(
+        const swish::shell_folder::data_object::FileGroupDescriptor& fgd,
+        long lindex);
+    //@}
 };
@@ -34,13 +34,7 @@
 #include <comet/smart_enum.h> // make_smart_enumeration
 
 #include <boost/foreach.hpp> // BOOST_FOREACH
-#include <boost/function.hpp>
-#include <boost/lambda/bind.hpp>
-#include <boost/lambda/lambda.hpp> // _1
 #include <boost/make_shared.hpp> // make_shared
-#include <boost/range/adaptor/filtered.hpp>
-#include <boost/range/adaptor/transformed.hpp>
-#include <boost/range/algorithm/copy.hpp>
 #include <boost/shared_ptr.hpp> // shared_ptr
 #include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
 
@@ -48,6 +42,7 @@
 #include <exception> // exception
 #include <vector>
 
+using swish::provider::directory_listing;
 using swish::provider::sftp_provider;
 using swish::remote_folder::absolute_path_from_swish_pidl;
 using swish::remote_folder::create_remote_itemid;
@@ -73,13 +68,8 @@ using comet::datetime_t;
 using comet::enum_iterator;
 using comet::make_smart_enumeration;
 
-using boost::adaptors::filtered;
-using boost::adaptors::transformed;
 using boost::filesystem::wpath;
-using boost::function;
-using namespace boost::lambda;
 using boost::make_shared;
-using boost::ref;
 using boost::shared_ptr;
 
 using std::exception;
@@ -168,19 +158,17 @@ namespace {
         }
     }
 
-    bool is_dotted(const sftp_filesystem_item& file)
+    bool is_dotted(directory_listing::string_view filename)
     {
-        wstring filename = file.filename().string();
-        return filename[0] == L'.';
+        return !filename.empty() && filename.front() == L'.';
     }
 
     cpidl_t convert_directory_entry_to_pidl(
-        const sftp_filesystem_item& file, const wpath& directory,
-        sftp_provider& provider)
+        const sftp_filesystem_item& file, bool is_folder)
     {
         return create_remote_itemid(
             file.filename().string(),
-            is_directory(file, directory, provider),
+            is_folder,
             is_link(file), 
             (file.owner()) ? *file.owner() : wstring(),
             (file.group()) ? *file.group() : wstring(),
@@ -249,39 +237,30 @@ com_ptr<IEnumIDList> CSftpDirectory::GetEnum(SHCONTF flags)
     bool include_non_folders = (flags & SHCONTF_NONFOLDERS) != 0;
     bool include_hidden = (flags & SHCONTF_INCLUDEHIDDEN) != 0;
 
-    vector<sftp_filesystem_item> directory_enum = m_provider->listing(
-        m_directory);
+    directory_listing directory_enum = m_provider->listing(m_directory);
 
-    // XXX: PERFORMANCE:
-    // For a link, we look its target details up 3 times!  Once to see if it is
-    // a directory, once to see if it isn't a directory and once to see if its
-    // a directory whilst converting to PIDL.  This info should be cached in
-    // the sftp_filesystem_item
+    shared_ptr< vector<cpidl_t> > pidls = make_shared< vector<cpidl_t> >();
+    pidls->reserve(directory_enum.size());
 
-    function<bool(const sftp_filesystem_item&)> hidden_filter =
-        include_hidden || !bind(is_dotted, _1);
+    for (directory_listing::size_type i = 0; i < directory_enum.size(); ++i)
+    {
+        // Checked against the listing directly so hidden files are skipped
+        // without copying anything out of it
+        if (!include_hidden && is_dotted(directory_enum.filename_view(i)))
+            continue;
 
-    function<bool(const sftp_filesystem_item&)> directory_filter =
-        include_folders ||
-        !bind(is_directory, _1, m_directory, ref(*m_provider));
+        sftp_filesystem_item file = directory_enum[i];
 
-    function<bool(const sftp_filesystem_item&)> non_directory_filter =
-        include_non_folders ||
-        bind(is_directory, _1, m_directory, ref(*m_provider));
+        // Decided once per file as, for links, this asks the server about
+        // the link's target
+        bool is_folder = is_directory(file, m_directory, *m_provider);
 
-    function<cpidl_t(const sftp_filesystem_item&)> pidl_converter =
-        bind(
-            convert_directory_entry_to_pidl, _1, m_directory, ref(*m_provider));
+        if ((is_folder) ? !include_folders : !include_non_folders)
+            continue;
+
+        pidls->push_back(convert_directory_entry_to_pidl(file, is_folder));
+    }
 
-    shared_ptr< vector<cpidl_t> > pidls = make_shared< vector<cpidl_t> >();
-    boost::copy(
-        directory_enum |
-        filtered(hidden_filter) |
-        filtered(directory_filter) |
-        filtered(non_directory_filter) |
-        transformed(pidl_converter),
-        back_inserter(*pidls));
-    
     return make_smart_enumeration<IEnumIDList>(pidls);
 }
 
@@ -41,6 +41,7 @@ using comet::com_ptr;
 using boost::filesystem::wpath;
 using boost::filesystem::wdirectory_iterator;
 using boost::shared_ptr;
+using boost::uintmax_t;
 
 using std::invalid_argument;
 
@@ -64,6 +65,16 @@ shared_ptr<ITEMIDLIST_ABSOLUTE> pidl_from_path(
     return shared_ptr<ITEMIDLIST_ABSOLUTE>(pidl, ::ILFree);
 }
 
+uintmax_t size_of_stream(const com_ptr<IStream>& stream)
+{
+    STATSTG statstg;
+    HRESULT hr = stream->Stat(&statstg, STATFLAG_NONAME);
+    if (FAILED(hr))
+        BOOST_THROW_EXCEPTION(com_error_from_interface(stream, hr));
+
+    return statstg.cbSize.QuadPart;
+}
+
 com_ptr<IDataObject> data_object_for_file(const wpath& file)
 {
     return data_object_for_files(&file, &file + 1);
@@ -30,6 +30,7 @@
 #include <comet/interface.h>  // uuidof, comtype
 #include <comet/ptr.h>  // com_ptr
 
+#include <boost/cstdint.hpp>  // uintmax_t
 #include <boost/filesystem.hpp>  // wpath
 #include <boost/numeric/conversion/cast.hpp>  // numeric_cast
 #include <boost/shared_ptr.hpp>
@@ -37,7 +38,7 @@
 #include <boost/iterator/indirect_iterator.hpp>
 
 #include <shobjidl.h>  // IShellFolder
-#include <ObjIdl.h>  // IDataObject
+#include <ObjIdl.h>  // IDataObject, IStream
 
 #include <vector>
 #include <algorithm>  // transform
@@ -87,6 +88,13 @@ boost::filesystem::wpath path_from_pidl(PIDLIST_ABSOLUTE pidl);
 boost::shared_ptr<ITEMIDLIST_ABSOLUTE> pidl_from_path(
     const boost::filesystem::wpath& filesystem_path);
 
+/**
+ * Return the size, in bytes, of the item the stream reads.
+ *
+ * Typically used with a stream from winapi::shell::stream_from_pidl.
+ */
+boost::uintmax_t size_of_stream(const comet::com_ptr<IStream>& stream);
+
 /**
  * Return an IDataObject representing several files in the same folder.
  *
@@ -0,0 +1,682 @@
+/**
+    @file
+
+    Writing tar archives to a byte sink and reading them from a source.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SWISH_TAR_HPP
+#define SWISH_TAR_HPP
+#pragma once
+
+#include "swish/block_transfer.hpp" // byte_sink, byte_source
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/noncopyable.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // copy, count, fill, find, min
+#include <cstddef> // size_t, ptrdiff_t
+#include <ctime> // time_t
+#include <stdexcept> // invalid_argument, runtime_error
+#include <string>
+#include <vector>
+
+/**
+ * @namespace swish::tar
+ *
+ * Writing and reading POSIX ustar archives.
+ *
+ * Sending many small files to or from a server as one archive, packed or
+ * unpacked there, avoids a round trip or more per file.  Names too long for
+ * a ustar header use the GNU long-name extension, which every tar likely to
+ * be found on a server understands.  Reading also understands the pax
+ * extended headers that some tars prefer.
+ */
+
+namespace swish {
+namespace tar {
+
+const std::size_t TAR_BLOCK_SIZE = 512;
+
+namespace detail {
+
+    /**
+     * Write `value` in octal, zero-padded to fill all but the last byte of
+     * the field, which is left as a terminating NUL.
+     */
+    inline void write_octal(
+        char* field, std::size_t width, boost::uintmax_t value)
+    {
+        field[width - 1] = '\0';
+        for (std::size_t i = width - 1; i > 0; --i)
+        {
+            field[i - 1] = static_cast<char>('0' + (value & 7));
+            value >>= 3;
+        }
+
+        if (value != 0)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Value too large for tar header"));
+    }
+
+    inline void write_text(
+        char* field, std::size_t width, const std::string& text)
+    {
+        std::copy(
+            text.begin(),
+            text.begin() + (std::min)(width, text.size()), field);
+    }
+
+    /**
+     * Split a name into a ustar prefix and name, if possible.
+     *
+     * @returns  Position of the separating slash, or `std::string::npos` if
+     *           the name can't be split to fit.
+     */
+    inline std::size_t ustar_split(const std::string& name)
+    {
+        if (name.size() <= 100)
+            return std::string::npos;
+
+        // The longest prefix that fits leaves the shortest name.  A trailing
+        // slash, as directories have, stays with the name so that it isn't
+        // empty.
+        std::size_t slash = name.rfind(
+            '/', (std::min)(std::size_t(155), name.size() - 2));
+
+        if (slash == std::string::npos || slash == 0 ||
+            name.size() - slash - 1 > 100)
+            return std::string::npos;
+
+        return slash;
+    }
+
+    /**
+     * Value of a numeric header field.
+     *
+     * Usually octal text, ended by a NUL or space, but GNU tar writes sizes
+     * too large for that in base-256 with the top bit of the first byte
+     * set.
+     */
+    inline boost::uintmax_t read_number(const char* field, std::size_t width)
+    {
+        boost::uintmax_t value = 0;
+
+        if (static_cast<unsigned char>(field[0]) & 0x80)
+        {
+            value = static_cast<unsigned char>(field[0]) & 0x7f;
+            for (std::size_t i = 1; i < width; ++i)
+            {
+                if (value >> (sizeof(value) * 8 - 8))
+                    BOOST_THROW_EXCEPTION(
+                        std::runtime_error("Tar header value too large"));
+
+                value = (value << 8) | static_cast<unsigned char>(field[i]);
+            }
+
+            return value;
+        }
+
+        std::size_t i = 0;
+        while (i < width && field[i] == ' ')
+        {
+            ++i;
+        }
+
+        for (; i < width && field[i] != '\0' && field[i] != ' '; ++i)
+        {
+            if (field[i] < '0' || field[i] > '7')
+                BOOST_THROW_EXCEPTION(
+                    std::runtime_error("Corrupt tar header"));
+
+            value = (value << 3) | (field[i] - '0');
+        }
+
+        return value;
+    }
+
+    inline std::string read_text(const char* field, std::size_t width)
+    {
+        return std::string(field, std::find(field, field + width, '\0'));
+    }
+
+    /**
+     * Value of the `key` record of a pax extended header, if it has one.
+     *
+     * Records are "<length> <key>=<value>\n" where the length counts the
+     * whole record.
+     */
+    inline bool pax_record(
+        const std::string& header, const std::string& key,
+        std::string& value_out)
+    {
+        std::size_t position = 0;
+        while (position < header.size())
+        {
+            std::size_t space = header.find(' ', position);
+            if (space == std::string::npos)
+                break;
+
+            std::size_t length = 0;
+            for (std::size_t i = position; i < space; ++i)
+            {
+                if (header[i] < '0' || header[i] > '9')
+                    BOOST_THROW_EXCEPTION(
+                        std::runtime_error("Corrupt pax header"));
+                length = length * 10 + (header[i] - '0');
+            }
+
+            if (length <= space - position + 1 ||
+                position + length > header.size())
+                BOOST_THROW_EXCEPTION(std::runtime_error("Corrupt pax header"));
+
+            std::string record = header.substr(
+                space + 1, position + length - space - 2);
+            std::size_t equals = record.find('=');
+            if (equals != std::string::npos && record.substr(0, equals) == key)
+            {
+                value_out = record.substr(equals + 1);
+                return true;
+            }
+
+            position += length;
+        }
+
+        return false;
+    }
+}
+
+/**
+ * Writes a tar archive to a byte sink.
+ *
+ * Output is collected into large writes so the sink isn't troubled with
+ * one small write per header.  Nothing is complete until `finish` is
+ * called.
+ *
+ * Names are relative, separated by '/' and, to make sense to a server,
+ * UTF-8.
+ */
+class tar_writer : private boost::noncopyable
+{
+public:
+
+    explicit tar_writer(
+        swish::block_transfer::byte_sink& sink,
+        std::size_t buffer_size=64 * 1024)
+        :
+        m_sink(sink), m_buffer(buffer_size), m_used(0), m_written(0),
+        m_finished(false)
+    {
+        if (buffer_size < TAR_BLOCK_SIZE || buffer_size % TAR_BLOCK_SIZE != 0)
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument(
+                    "Buffer must be a whole number of tar blocks"));
+    }
+
+    void add_directory(const std::string& name, std::time_t modified)
+    {
+        std::string directory_name = name;
+        if (directory_name.empty() ||
+            directory_name[directory_name.size() - 1] != '/')
+        {
+            directory_name += '/';
+        }
+
+        write_header(directory_name, '5', 0, modified, 0755);
+    }
+
+    /**
+     * Add a file whose contents come from `content`.
+     *
+     * @param size  Size of the file.  Exactly this much is read from the
+     *              source; it is an error for the source to end sooner.
+     */
+    void add_file(
+        const std::string& name, boost::uintmax_t size, std::time_t modified,
+        swish::block_transfer::byte_source& content)
+    {
+        write_header(name, '0', size, modified, 0644);
+
+        boost::uintmax_t remaining = size;
+        while (remaining > 0)
+        {
+            if (m_used == m_buffer.size())
+                flush();
+
+            std::size_t space = m_buffer.size() - m_used;
+            std::size_t wanted = static_cast<std::size_t>(
+                (std::min)(remaining, boost::uintmax_t(space)));
+
+            std::size_t count = content.read(&m_buffer[m_used], wanted);
+            if (count == 0)
+                BOOST_THROW_EXCEPTION(
+                    std::runtime_error(
+                        "File ended before its size while archiving: " +
+                        name));
+
+            m_used += count;
+            remaining -= count;
+        }
+
+        pad_to_block(size);
+    }
+
+    /**
+     * End the archive and write out everything still buffered.
+     */
+    void finish()
+    {
+        if (m_finished)
+            return;
+
+        // End-of-archive marker is two empty blocks
+        write_zeros(2 * TAR_BLOCK_SIZE);
+        flush();
+
+        m_finished = true;
+    }
+
+    /**
+     * Bytes passed to the sink so far.
+     */
+    boost::uintmax_t bytes_written() const
+    {
+        return m_written;
+    }
+
+private:
+
+    void write_header(
+        const std::string& name, char type, boost::uintmax_t size,
+        std::time_t modified, unsigned int mode)
+    {
+        if (name.empty())
+            BOOST_THROW_EXCEPTION(
+                std::invalid_argument("Archive entries need a name"));
+
+        std::size_t split = detail::ustar_split(name);
+
+        if (name.size() > 100 && split == std::string::npos)
+        {
+            // GNU extension: the full name is the content of a preceding
+            // pseudo-entry
+            write_raw_header("././@LongLink", "", 'L', name.size() + 1, 0, 0);
+            write_bytes(name.c_str(), name.size() + 1);
+            pad_to_block(name.size() + 1);
+
+            write_raw_header(
+                name.substr(0, 100), "", type, size, modified, mode);
+        }
+        else if (split != std::string::npos)
+        {
+            write_raw_header(
+                name.substr(split + 1), name.substr(0, split), type, size,
+                modified, mode);
+        }
+        else
+        {
+            write_raw_header(name, "", type, size, modified, mode);
+        }
+    }
+
+    void write_raw_header(
+        const std::string& name, const std::string& prefix, char type,
+        boost::uintmax_t size, std::time_t modified, unsigned int mode)
+    {
+        char header[TAR_BLOCK_SIZE];
+        std::fill(header, header + sizeof(header), '\0');
+
+        detail::write_text(header, 100, name);
+        detail::write_octal(header + 100, 8, mode);
+        detail::write_octal(header + 108, 8, 0); // uid
+        detail::write_octal(header + 116, 8, 0); // gid
+        detail::write_octal(header + 124, 12, size);
+        detail::write_octal(
+            header + 136, 12,
+            (modified > 0) ? static_cast<boost::uintmax_t>(modified) : 0);
+        header[156] = type;
+        detail::write_text(header + 257, 6, std::string("ustar\0", 6));
+        detail::write_text(header + 263, 2, "00");
+        detail::write_text(header + 345, 155, prefix);
+
+        // Checksum is calculated with its own field as spaces
+        std::fill(header + 148, header + 156, ' ');
+        unsigned long checksum = 0;
+        for (std::size_t i = 0; i < sizeof(header); ++i)
+        {
+            checksum += static_cast<unsigned char>(header[i]);
+        }
+        detail::write_octal(header + 148, 7, checksum);
+
+        write_bytes(header, sizeof(header));
+    }
+
+    void pad_to_block(boost::uintmax_t size)
+    {
+        std::size_t partial = static_cast<std::size_t>(size % TAR_BLOCK_SIZE);
+        if (partial != 0)
+            write_zeros(TAR_BLOCK_SIZE - partial);
+    }
+
+    void write_bytes(const char* data, std::size_t size)
+    {
+        while (size > 0)
+        {
+            if (m_used == m_buffer.size())
+                flush();
+
+            std::size_t count = (std::min)(size, m_buffer.size() - m_used);
+            std::copy(data, data + count, &m_buffer[m_used]);
+
+            m_used += count;
+            data += count;
+            size -= count;
+        }
+    }
+
+    void write_zeros(std::size_t size)
+    {
+        while (size > 0)
+        {
+            if (m_used == m_buffer.size())
+                flush();
+
+            std::size_t count = (std::min)(size, m_buffer.size() - m_used);
+            std::fill(&m_buffer[m_used], &m_buffer[m_used] + count, '\0');
+
+            m_used += count;
+            size -= count;
+        }
+    }
+
+    void flush()
+    {
+        if (m_used == 0)
+            return;
+
+        m_sink.write(&m_buffer[0], m_used);
+        m_written += m_used;
+        m_used = 0;
+    }
+
+    swish::block_transfer::byte_sink& m_sink;
+    std::vector<char> m_buffer;
+    std::size_t m_used;
+    boost::uintmax_t m_written;
+    bool m_finished;
+};
+
+/**
+ * Entry in an archive being read.
+ */
+struct tar_entry
+{
+    tar_entry() : type('0'), size(0) {}
+
+    bool is_file() const
+    {
+        return type == '0' || type == '\0' || type == '7';
+    }
+
+    bool is_directory() const
+    {
+        return type == '5';
+    }
+
+    /**
+     * Full name, however the archive stored it.
+     */
+    std::string name;
+
+    /**
+     * Header type flag: '0' for files, '5' for directories, and so on.
+     */
+    char type;
+
+    boost::uintmax_t size;
+};
+
+/**
+ * Reads the entries of a tar archive from a byte source, in order.
+ *
+ * Only the content of the current entry can be read.  Moving to the next
+ * entry skips whatever of the current one wasn't read.
+ */
+class tar_reader : private boost::noncopyable
+{
+public:
+
+    explicit tar_reader(swish::block_transfer::byte_source& archive)
+        : m_archive(archive), m_remaining(0), m_padding(0), m_ended(false)
+    {}
+
+    /**
+     * Move to the next entry.
+     *
+     * @returns  false at the end of the archive.
+     */
+    bool next(tar_entry& entry_out)
+    {
+        skip(m_remaining + m_padding);
+        m_remaining = 0;
+        m_padding = 0;
+
+        if (m_ended)
+            return false;
+
+        std::string long_name;
+        std::string pax_name;
+
+        for (;;)
+        {
+            char header[TAR_BLOCK_SIZE];
+            if (!read_header(header))
+            {
+                m_ended = true;
+                return false;
+            }
+
+            tar_entry entry;
+            entry.type = header[156];
+            entry.size = detail::read_number(header + 124, 12);
+
+            if (entry.type == 'L' || entry.type == 'x')
+            {
+                // Metadata for the entry that follows
+                std::string content = read_content(entry.size);
+                if (entry.type == 'L')
+                    long_name = detail::read_text(
+                        content.data(), content.size());
+                else
+                    detail::pax_record(content, "path", pax_name);
+
+                continue;
+            }
+            else if (entry.type == 'g' || entry.type == 'K')
+            {
+                // Global pax headers and long link targets don't affect
+                // where the content ends up
+                skip(padded(entry.size));
+                continue;
+            }
+
+            if (!pax_name.empty())
+                entry.name = pax_name;
+            else if (!long_name.empty())
+                entry.name = long_name;
+            else
+                entry.name = name_from_header(header);
+
+            // Only files and the like have content, whatever the size says
+            if (!entry.is_file())
+            {
+                skip(padded(entry.size));
+                entry.size = 0;
+            }
+
+            m_remaining = entry.size;
+            m_padding = padded(entry.size) - entry.size;
+
+            entry_out = entry;
+            return true;
+        }
+    }
+
+    /**
+     * Read the content of the current entry.
+     *
+     * @returns  Bytes read; 0 once all of the entry has been read.
+     */
+    std::size_t read(char* buffer, std::size_t size)
+    {
+        std::size_t wanted = static_cast<std::size_t>(
+            (std::min)(m_remaining, boost::uintmax_t(size)));
+        if (wanted == 0)
+            return 0;
+
+        std::size_t count = m_archive.read(buffer, wanted);
+        if (count == 0)
+            BOOST_THROW_EXCEPTION(
+                std::runtime_error("Archive ended in the middle of a file"));
+
+        m_remaining -= count;
+        return count;
+    }
+
+    /**
+     * Content of the current entry not yet read.
+     */
+    boost::uintmax_t remaining() const
+    {
+        return m_remaining;
+    }
+
+private:
+
+    static boost::uintmax_t padded(boost::uintmax_t size)
+    {
+        return (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    }
+
+    static std::string name_from_header(const char* header)
+    {
+        std::string name = detail::read_text(header, 100);
+
+        // Only POSIX ustar has a prefix.  GNU tar's older format, marked
+        // "ustar  ", uses the same space for other things.
+        if (std::string(header + 257, 6) == std::string("ustar\0", 6))
+        {
+            std::string prefix = detail::read_text(header + 345, 155);
+            if (!prefix.empty())
+                name = prefix + "/" + name;
+        }
+
+        return name;
+    }
+
+    /**
+     * Read the next header.
+     *
+     * @returns  false if the header is the empty block marking the end.
+     */
+    bool read_header(char* header)
+    {
+        read_exactly(header, TAR_BLOCK_SIZE);
+
+        if (std::count(header, header + TAR_BLOCK_SIZE, '\0') ==
+            static_cast<std::ptrdiff_t>(TAR_BLOCK_SIZE))
+            return false;
+
+        unsigned long checksum = 0;
+        for (std::size_t i = 0; i < TAR_BLOCK_SIZE; ++i)
+        {
+            checksum += (i >= 148 && i < 156) ?
+                ' ' : static_cast<unsigned char>(header[i]);
+        }
+
+        if (checksum != detail::read_number(header + 148, 8))
+            BOOST_THROW_EXCEPTION(
+                std::runtime_error("Tar header checksum is wrong"));
+
+        return true;
+    }
+
+    std::string read_content(boost::uintmax_t size)
+    {
+        if (size > 1024 * 1024)
+            BOOST_THROW_EXCEPTION(
+                std::runtime_error("Tar extended header too large"));
+
+        std::string content(static_cast<std::size_t>(padded(size)), '\0');
+        if (!content.empty())
+            read_exactly(&content[0], content.size());
+        content.resize(static_cast<std::size_t>(size));
+
+        return content;
+    }
+
+    void read_exactly(char* buffer, std::size_t size)
+    {
+        while (size > 0)
+        {
+            std::size_t count = m_archive.read(buffer, size);
+            if (count == 0)
+                BOOST_THROW_EXCEPTION(
+                    std::runtime_error("Archive ended unexpectedly"));
+
+            buffer += count;
+            size -= count;
+        }
+    }
+
+    void skip(boost::uintmax_t size)
+    {
+        char buffer[4096];
+        while (size > 0)
+        {
+            std::size_t count = static_cast<std::size_t>(
+                (std::min)(size, boost::uintmax_t(sizeof(buffer))));
+            read_exactly(buffer, count);
+            size -= count;
+        }
+    }
+
+    swish::block_transfer::byte_source& m_archive;
+    boost::uintmax_t m_remaining;
+    boost::uintmax_t m_padding;
+    bool m_ended;
+};
+
+}} // namespace swish::tar
+
+#endif
@@ -0,0 +1,435 @@
+/**
+    @file
+
+    Splitting a tar stream into the files it contains, as they are asked for.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SWISH_TAR_DEMULTIPLEXER_HPP
+#define SWISH_TAR_DEMULTIPLEXER_HPP
+#pragma once
+
+#include "swish/block_transfer.hpp" // byte_source
+#include "swish/tar.hpp" // tar_reader
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp> // lock_guard
+#include <boost/thread/mutex.hpp>
+#include <boost/throw_exception.hpp> // BOOST_THROW_EXCEPTION
+
+#include <algorithm> // copy, min
+#include <cstddef> // size_t
+#include <map>
+#include <set>
+#include <stdexcept> // runtime_error
+#include <string>
+
+namespace swish {
+namespace tar {
+
+namespace detail {
+
+    /**
+     * Name as a consumer would ask for it: no leading "./" or '/' and no
+     * trailing '/'.
+     */
+    inline std::string normalise_entry_name(const std::string& name)
+    {
+        std::size_t begin = 0;
+        for (;;)
+        {
+            if (name.compare(begin, 2, "./") == 0)
+                begin += 2;
+            else if (name.compare(begin, 1, "/") == 0)
+                begin += 1;
+            else
+                break;
+        }
+
+        std::size_t end = name.size();
+        while (end > begin && name[end - 1] == '/')
+        {
+            --end;
+        }
+
+        return name.substr(begin, end - begin);
+    }
+
+    /**
+     * Contents held in memory.
+     */
+    class memory_source : public swish::block_transfer::byte_source
+    {
+    public:
+        explicit memory_source(boost::shared_ptr<const std::string> data)
+            : m_data(data), m_position(0) {}
+
+        virtual std::size_t read(char* buffer, std::size_t size)
+        {
+            std::size_t count = (std::min)(size, m_data->size() - m_position);
+            std::copy(
+                m_data->begin() + m_position,
+                m_data->begin() + m_position + count, buffer);
+            m_position += count;
+
+            return count;
+        }
+
+    private:
+        boost::shared_ptr<const std::string> m_data;
+        std::size_t m_position;
+    };
+
+    /**
+     * What becomes of the entry being read straight from the archive once
+     * something after it is asked for.
+     */
+    struct live_entry
+    {
+        live_entry() : abandoned(false), position(0) {}
+
+        bool abandoned;
+        std::string rest;
+        std::size_t position;
+    };
+
+    /**
+     * Shared by the demultiplexer and the sources it hands out, so either
+     * may outlive the other.
+     */
+    class demultiplexer_state :
+        public boost::enable_shared_from_this<demultiplexer_state>,
+        private boost::noncopyable
+    {
+    public:
+
+        demultiplexer_state(
+            boost::shared_ptr<swish::block_transfer::byte_source> archive,
+            std::size_t spool_limit)
+            :
+            m_archive(archive), m_reader(new tar_reader(*archive)),
+            m_spool_limit(spool_limit), m_spooled(0), m_finished(false),
+            m_discarded(0)
+        {}
+
+        boost::shared_ptr<swish::block_transfer::byte_source> open(
+            const std::string& name);
+
+        std::size_t read(
+            const boost::shared_ptr<live_entry>& entry, char* buffer,
+            std::size_t size)
+        {
+            boost::lock_guard<boost::mutex> lock(m_guard);
+
+            if (entry == m_live)
+                return m_reader->read(buffer, size);
+
+            if (entry->abandoned)
+                BOOST_THROW_EXCEPTION(
+                    std::runtime_error(
+                        "File no longer available from archive: a later "
+                        "file was opened while it was being read"));
+
+            std::size_t count =
+                (std::min)(size, entry->rest.size() - entry->position);
+            std::copy(
+                entry->rest.begin() + entry->position,
+                entry->rest.begin() + entry->position + count, buffer);
+            entry->position += count;
+
+            return count;
+        }
+
+        /**
+         * Free the rest of an entry kept in memory once its source goes.
+         */
+        void close(const boost::shared_ptr<live_entry>& entry)
+        {
+            boost::lock_guard<boost::mutex> lock(m_guard);
+
+            if (entry == m_live)
+                return;
+
+            m_spooled -= entry->rest.size();
+            std::string().swap(entry->rest);
+        }
+
+        std::size_t spooled_bytes() const
+        {
+            boost::lock_guard<boost::mutex> lock(m_guard);
+            return m_spooled;
+        }
+
+        boost::uintmax_t discarded_bytes() const
+        {
+            boost::lock_guard<boost::mutex> lock(m_guard);
+            return m_discarded;
+        }
+
+    private:
+
+        /**
+         * Whether the rest of the current entry fits in what is left of the
+         * spool.
+         */
+        bool rest_fits(boost::uintmax_t size) const
+        {
+            return size <= m_spool_limit - m_spooled;
+        }
+
+        /**
+         * Take the rest of the live entry out of the archive, if it fits,
+         * so that the archive can move on.
+         */
+        void detach_live_entry()
+        {
+            if (!m_live)
+                return;
+
+            if (m_live.unique())
+            {
+                // Nobody is reading it any more
+                m_discarded += m_reader->remaining();
+            }
+            else if (rest_fits(m_reader->remaining()))
+            {
+                m_live->rest = read_rest();
+                m_spooled += m_live->rest.size();
+            }
+            else
+            {
+                m_live->abandoned = true;
+                close_archive();
+            }
+
+            m_live.reset();
+        }
+
+        /**
+         * Stop reading the archive.
+         *
+         * Closing it stops the server sending the rest, rather than us
+         * reading through files we'd have to throw away and fetch again
+         * some other way.
+         */
+        void close_archive()
+        {
+            m_finished = true;
+            m_live.reset();
+            m_reader.reset();
+            m_archive.reset();
+        }
+
+        std::string read_rest()
+        {
+            std::string data(
+                static_cast<std::size_t>(m_reader->remaining()), '\0');
+            std::size_t position = 0;
+            while (position < data.size())
+            {
+                position += m_reader->read(
+                    &data[position], data.size() - position);
+            }
+
+            return data;
+        }
+
+        boost::shared_ptr<swish::block_transfer::byte_source> m_archive;
+        boost::scoped_ptr<tar_reader> m_reader;
+        std::size_t m_spool_limit;
+
+        mutable boost::mutex m_guard;
+        std::map< std::string, boost::shared_ptr<const std::string> > m_spool;
+        std::set<std::string> m_opened;
+        std::size_t m_spooled;
+        boost::shared_ptr<live_entry> m_live;
+        bool m_finished;
+        boost::uintmax_t m_discarded;
+    };
+
+    /**
+     * Contents of the entry being read straight from the archive.
+     */
+    class live_entry_source : public swish::block_transfer::byte_source
+    {
+    public:
+        live_entry_source(
+            boost::shared_ptr<demultiplexer_state> state,
+            boost::shared_ptr<live_entry> entry)
+            : m_state(state), m_entry(entry) {}
+
+        ~live_entry_source()
+        {
+            m_state->close(m_entry);
+        }
+
+        virtual std::size_t read(char* buffer, std::size_t size)
+        {
+            return m_state->read(m_entry, buffer, size);
+        }
+
+    private:
+        boost::shared_ptr<demultiplexer_state> m_state;
+        boost::shared_ptr<live_entry> m_entry;
+    };
+
+    inline boost::shared_ptr<swish::block_transfer::byte_source>
+    demultiplexer_state::open(const std::string& name)
+    {
+        boost::lock_guard<boost::mutex> lock(m_guard);
+
+        std::string wanted = normalise_entry_name(name);
+
+        // Asking again mustn't send us through the rest of the archive
+        // looking for something already passed
+        if (!m_opened.insert(wanted).second)
+            return boost::shared_ptr<swish::block_transfer::byte_source>();
+
+        std::map< std::string, boost::shared_ptr<const std::string> >::
+            iterator spooled = m_spool.find(wanted);
+        if (spooled != m_spool.end())
+        {
+            boost::shared_ptr<const std::string> data = spooled->second;
+            m_spool.erase(spooled);
+            m_spooled -= data->size();
+
+            return boost::make_shared<memory_source>(data);
+        }
+
+        detach_live_entry();
+
+        tar_entry entry;
+        while (!m_finished && m_reader->next(entry))
+        {
+            if (!entry.is_file())
+                continue;
+
+            std::string entry_name = normalise_entry_name(entry.name);
+            if (entry_name == wanted)
+            {
+                m_live = boost::make_shared<live_entry>();
+                return boost::make_shared<live_entry_source>(
+                    shared_from_this(), m_live);
+            }
+
+            // Keep files passed over for when they are asked for, as long
+            // as there's room.  Once one doesn't fit, it and everything
+            // after it will have to be fetched some other way.
+            if (!rest_fits(entry.size))
+            {
+                close_archive();
+                break;
+            }
+
+            boost::shared_ptr<const std::string> data =
+                boost::make_shared<std::string>(read_rest());
+            m_spool[entry_name] = data;
+            m_spooled += data->size();
+        }
+
+        m_finished = true;
+
+        return boost::shared_ptr<swish::block_transfer::byte_source>();
+    }
+}
+
+/**
+ * Hands out the files in a tar stream individually, as they are asked for.
+ *
+ * The archive is read once, from start to end.  Files are best asked for in
+ * the order they appear in it; each is then read straight from the archive.
+ * Files passed over on the way to the one asked for are kept in memory,
+ * up to a limit, in case they are asked for later.  So is the rest of a
+ * file still being read when a later one is opened.  Once something
+ * doesn't fit, the archive is closed, so the server stops sending it, and
+ * the files not yet reached are no longer available.  Asking for those
+ * gets nothing, as does asking for one the archive doesn't contain, so the
+ * caller must be ready to fetch files some other way.
+ *
+ * Safe to use from several threads, though the archive is only ever read
+ * by one of them at a time.
+ */
+class tar_demultiplexer
+{
+public:
+
+    explicit tar_demultiplexer(
+        boost::shared_ptr<swish::block_transfer::byte_source> archive,
+        std::size_t spool_limit=8 * 1024 * 1024)
+        :
+        m_state(
+            boost::make_shared<detail::demultiplexer_state>(
+                archive, spool_limit))
+    {}
+
+    /**
+     * Contents of the named file.
+     *
+     * @param name  Name in the archive, '/'-separated.
+     *
+     * @returns  null if the archive can't supply the file.
+     */
+    boost::shared_ptr<swish::block_transfer::byte_source> open(
+        const std::string& name)
+    {
+        return m_state->open(name);
+    }
+
+    /**
+     * Bytes held in memory for files that haven't been asked for yet and
+     * for the rest of files being read when later ones were opened.
+     */
+    std::size_t spooled_bytes() const
+    {
+        return m_state->spooled_bytes();
+    }
+
+    /**
+     * Bytes of opened files, skipped because nobody read them.
+     */
+    boost::uintmax_t discarded_bytes() const
+    {
+        return m_state->discarded_bytes();
+    }
+
+private:
+    boost::shared_ptr<detail::demultiplexer_state> m_state;
+};
+
+}} // namespace swish::tar
+
+#endif
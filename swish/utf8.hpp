@@ -0,0 +1,590 @@
+/**
+    @file
+
+    UTF-8 to and from UTF-16 (or UTF-32) conversion.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#ifndef SWISH_UTF8_HPP
+#define SWISH_UTF8_HPP
+#pragma once
+
+#include <boost/cstdint.hpp> // uint16_t, uint32_t
+
+#include <cstddef> // size_t
+#include <string>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || \
+    defined(__SSE2__)
+#define SWISH_UTF8_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+/**
+ * @namespace swish::utf8
+ *
+ * Conversion between UTF-8 and wide strings.
+ *
+ * Wide strings are UTF-16 if their element is 16 bits wide, as `wchar_t` is
+ * on Windows, and UTF-32 if 32 bits wide.
+ *
+ * Nearly every filename and account name that comes from a server is plain
+ * ASCII so runs of ASCII are converted 16 bytes at a time, where SSE2 is
+ * available, and only the remainder is decoded character by character.
+ *
+ * Conversions write into buffers supplied by the caller, so repeated
+ * conversions can reuse the same buffer.  Servers whose filenames are not
+ * UTF-8 are common.  Bytes that are not valid UTF-8 are each converted to
+ * U+FFFD and the number of replacements is reported so callers can decide
+ * what to do about it.
+ */
+
+namespace swish {
+namespace utf8 {
+
+const boost::uint32_t replacement_character = 0xFFFD;
+
+/**
+ * Outcome of a conversion.
+ */
+struct conversion_result
+{
+    conversion_result() : size(0), invalid(0) {}
+
+    std::size_t size; ///< Units written to the output
+    std::size_t invalid; ///< Invalid sequences replaced with U+FFFD
+};
+
+/**
+ * Largest number of wide units the UTF-8 string of the given size can need.
+ */
+inline std::size_t max_wide_size(std::size_t utf8_size)
+{
+    return utf8_size;
+}
+
+/**
+ * Largest number of bytes the wide string of the given size can need
+ * in UTF-8.
+ */
+template<typename Char>
+inline std::size_t max_utf8_size(std::size_t wide_size)
+{
+    // Unpaired surrogates become the three-byte U+FFFD
+    return wide_size * ((sizeof(Char) == 2) ? 3 : 4);
+}
+
+namespace detail {
+
+    template<std::size_t Width>
+    struct unit_width {};
+
+    inline bool is_ascii(unsigned char c)
+    {
+        return c < 0x80;
+    }
+
+    template<typename Char>
+    inline std::size_t widen_ascii_tail(
+        const char* in, std::size_t size, Char* out)
+    {
+        std::size_t i = 0;
+        while (i < size && is_ascii(in[i]))
+        {
+            out[i] = static_cast<Char>(in[i]);
+            ++i;
+        }
+
+        return i;
+    }
+
+    /**
+     * Copy the ASCII run at the start of UTF-8 input into UTF-16 output.
+     *
+     * @returns  Length of the run.
+     */
+    template<typename Char>
+    inline std::size_t widen_ascii(
+        const char* in, std::size_t size, Char* out, unit_width<2>)
+    {
+        std::size_t i = 0;
+
+#ifdef SWISH_UTF8_USE_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= size; i += 16)
+        {
+            __m128i bytes =
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            if (_mm_movemask_epi8(bytes) != 0)
+                break;
+
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i*>(out + i),
+                _mm_unpacklo_epi8(bytes, zero));
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i*>(out + i + 8),
+                _mm_unpackhi_epi8(bytes, zero));
+        }
+#endif
+
+        return i + widen_ascii_tail(in + i, size - i, out + i);
+    }
+
+    /**
+     * Copy the ASCII run at the start of UTF-8 input into UTF-32 output.
+     *
+     * @returns  Length of the run.
+     */
+    template<typename Char>
+    inline std::size_t widen_ascii(
+        const char* in, std::size_t size, Char* out, unit_width<4>)
+    {
+        std::size_t i = 0;
+
+#ifdef SWISH_UTF8_USE_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= size; i += 16)
+        {
+            __m128i bytes =
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            if (_mm_movemask_epi8(bytes) != 0)
+                break;
+
+            __m128i low = _mm_unpacklo_epi8(bytes, zero);
+            __m128i high = _mm_unpackhi_epi8(bytes, zero);
+
+            __m128i* destination = reinterpret_cast<__m128i*>(out + i);
+            _mm_storeu_si128(destination, _mm_unpacklo_epi16(low, zero));
+            _mm_storeu_si128(destination + 1, _mm_unpackhi_epi16(low, zero));
+            _mm_storeu_si128(destination + 2, _mm_unpacklo_epi16(high, zero));
+            _mm_storeu_si128(destination + 3, _mm_unpackhi_epi16(high, zero));
+        }
+#endif
+
+        return i + widen_ascii_tail(in + i, size - i, out + i);
+    }
+
+    template<typename Char>
+    inline std::size_t narrow_ascii_tail(
+        const Char* in, std::size_t size, char* out)
+    {
+        std::size_t i = 0;
+        while (i < size && static_cast<boost::uint32_t>(in[i]) < 0x80)
+        {
+            out[i] = static_cast<char>(in[i]);
+            ++i;
+        }
+
+        return i;
+    }
+
+    /**
+     * Copy the ASCII run at the start of UTF-16 input into UTF-8 output.
+     *
+     * @returns  Length of the run.
+     */
+    template<typename Char>
+    inline std::size_t narrow_ascii(
+        const Char* in, std::size_t size, char* out, unit_width<2>)
+    {
+        std::size_t i = 0;
+
+#ifdef SWISH_UTF8_USE_SSE2
+        const __m128i non_ascii = _mm_set1_epi16(static_cast<short>(0xFF80));
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= size; i += 16)
+        {
+            const __m128i* source = reinterpret_cast<const __m128i*>(in + i);
+            __m128i low = _mm_loadu_si128(source);
+            __m128i high = _mm_loadu_si128(source + 1);
+
+            __m128i either = _mm_or_si128(low, high);
+            if (_mm_movemask_epi8(
+                _mm_cmpeq_epi16(_mm_and_si128(either, non_ascii), zero))
+                != 0xFFFF)
+                break;
+
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i*>(out + i),
+                _mm_packus_epi16(low, high));
+        }
+#endif
+
+        return i + narrow_ascii_tail(in + i, size - i, out + i);
+    }
+
+    /**
+     * Copy the ASCII run at the start of UTF-32 input into UTF-8 output.
+     *
+     * @returns  Length of the run.
+     */
+    template<typename Char>
+    inline std::size_t narrow_ascii(
+        const Char* in, std::size_t size, char* out, unit_width<4>)
+    {
+        std::size_t i = 0;
+
+#ifdef SWISH_UTF8_USE_SSE2
+        const __m128i non_ascii =
+            _mm_set1_epi32(static_cast<int>(0xFFFFFF80));
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= size; i += 16)
+        {
+            const __m128i* source = reinterpret_cast<const __m128i*>(in + i);
+            __m128i a = _mm_loadu_si128(source);
+            __m128i b = _mm_loadu_si128(source + 1);
+            __m128i c = _mm_loadu_si128(source + 2);
+            __m128i d = _mm_loadu_si128(source + 3);
+
+            __m128i all = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+            if (_mm_movemask_epi8(
+                _mm_cmpeq_epi32(_mm_and_si128(all, non_ascii), zero))
+                != 0xFFFF)
+                break;
+
+            // Values are all below 0x80 so signed saturation is harmless
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i*>(out + i),
+                _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+        }
+#endif
+
+        return i + narrow_ascii_tail(in + i, size - i, out + i);
+    }
+
+    inline bool is_continuation(unsigned char c)
+    {
+        return (c & 0xC0) == 0x80;
+    }
+
+    /**
+     * Decode one non-ASCII UTF-8 sequence.
+     *
+     * @param[out] code_point
+     *     Decoded character or U+FFFD if the sequence was invalid.
+     *
+     * @returns
+     *     Bytes consumed.  An invalid sequence consumes the lead byte and
+     *     whatever continuation bytes were valid so far, so decoding
+     *     resynchronises at the next possible start of a character.
+     */
+    inline std::size_t decode(
+        const unsigned char* in, std::size_t size, boost::uint32_t& code_point,
+        bool& valid)
+    {
+        unsigned char lead = in[0];
+
+        std::size_t length;
+        unsigned char second_min = 0x80;
+        unsigned char second_max = 0xBF;
+
+        if (lead >= 0xC2 && lead <= 0xDF)
+        {
+            length = 2;
+            code_point = lead & 0x1F;
+        }
+        else if (lead >= 0xE0 && lead <= 0xEF)
+        {
+            length = 3;
+            code_point = lead & 0x0F;
+            if (lead == 0xE0)
+                second_min = 0xA0; // overlong
+            else if (lead == 0xED)
+                second_max = 0x9F; // surrogates
+        }
+        else if (lead >= 0xF0 && lead <= 0xF4)
+        {
+            length = 4;
+            code_point = lead & 0x07;
+            if (lead == 0xF0)
+                second_min = 0x90; // overlong
+            else if (lead == 0xF4)
+                second_max = 0x8F; // beyond U+10FFFF
+        }
+        else
+        {
+            code_point = replacement_character;
+            valid = false;
+            return 1;
+        }
+
+        for (std::size_t i = 1; i < length; ++i)
+        {
+            bool ok = (i < size) && ((i == 1) ?
+                (in[i] >= second_min && in[i] <= second_max) :
+                is_continuation(in[i]));
+            if (!ok)
+            {
+                code_point = replacement_character;
+                valid = false;
+                return i;
+            }
+
+            code_point = (code_point << 6) | (in[i] & 0x3F);
+        }
+
+        valid = true;
+        return length;
+    }
+
+    template<typename Char>
+    inline std::size_t put_wide(
+        boost::uint32_t code_point, Char* out, unit_width<2>)
+    {
+        if (code_point < 0x10000)
+        {
+            out[0] = static_cast<Char>(code_point);
+            return 1;
+        }
+        else
+        {
+            code_point -= 0x10000;
+            out[0] = static_cast<Char>(0xD800 + (code_point >> 10));
+            out[1] = static_cast<Char>(0xDC00 + (code_point & 0x3FF));
+            return 2;
+        }
+    }
+
+    template<typename Char>
+    inline std::size_t put_wide(
+        boost::uint32_t code_point, Char* out, unit_width<4>)
+    {
+        out[0] = static_cast<Char>(code_point);
+        return 1;
+    }
+
+    /**
+     * Decode one non-ASCII UTF-16 character.
+     *
+     * Unpaired surrogates decode to U+FFFD.
+     */
+    template<typename Char>
+    inline std::size_t get_wide(
+        const Char* in, std::size_t size, boost::uint32_t& code_point,
+        bool& valid, unit_width<2>)
+    {
+        boost::uint32_t unit = static_cast<boost::uint16_t>(in[0]);
+
+        valid = true;
+
+        if (unit < 0xD800 || unit > 0xDFFF)
+        {
+            code_point = unit;
+            return 1;
+        }
+
+        if (unit <= 0xDBFF && size > 1)
+        {
+            boost::uint32_t trail = static_cast<boost::uint16_t>(in[1]);
+            if (trail >= 0xDC00 && trail <= 0xDFFF)
+            {
+                code_point =
+                    0x10000 + ((unit - 0xD800) << 10) + (trail - 0xDC00);
+                return 2;
+            }
+        }
+
+        code_point = replacement_character;
+        valid = false;
+        return 1;
+    }
+
+    /**
+     * Decode one non-ASCII UTF-32 character.
+     *
+     * Surrogates and values beyond U+10FFFF decode to U+FFFD.
+     */
+    template<typename Char>
+    inline std::size_t get_wide(
+        const Char* in, std::size_t /*size*/, boost::uint32_t& code_point,
+        bool& valid, unit_width<4>)
+    {
+        code_point = static_cast<boost::uint32_t>(in[0]);
+
+        valid =
+            code_point <= 0x10FFFF &&
+            (code_point < 0xD800 || code_point > 0xDFFF);
+        if (!valid)
+        {
+            code_point = replacement_character;
+        }
+
+        return 1;
+    }
+
+    inline std::size_t put_utf8(boost::uint32_t code_point, char* out)
+    {
+        if (code_point < 0x800)
+        {
+            out[0] = static_cast<char>(0xC0 | (code_point >> 6));
+            out[1] = static_cast<char>(0x80 | (code_point & 0x3F));
+            return 2;
+        }
+        else if (code_point < 0x10000)
+        {
+            out[0] = static_cast<char>(0xE0 | (code_point >> 12));
+            out[1] = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+            out[2] = static_cast<char>(0x80 | (code_point & 0x3F));
+            return 3;
+        }
+        else
+        {
+            out[0] = static_cast<char>(0xF0 | (code_point >> 18));
+            out[1] = static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+            out[2] = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+            out[3] = static_cast<char>(0x80 | (code_point & 0x3F));
+            return 4;
+        }
+    }
+}
+
+/**
+ * Convert UTF-8 to a wide string.
+ *
+ * @param out
+ *     Buffer with room for at least `max_wide_size(size)` units.
+ */
+template<typename Char>
+inline conversion_result utf8_to_wide(
+    const char* utf8, std::size_t size, Char* out)
+{
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(utf8);
+
+    conversion_result result;
+    std::size_t i = 0;
+    while (i < size)
+    {
+        if (detail::is_ascii(in[i]))
+        {
+            std::size_t run = detail::widen_ascii(
+                utf8 + i, size - i, out + result.size,
+                detail::unit_width<sizeof(Char)>());
+            i += run;
+            result.size += run;
+        }
+        else
+        {
+            boost::uint32_t code_point;
+            bool valid;
+            i += detail::decode(in + i, size - i, code_point, valid);
+            if (!valid)
+                ++result.invalid;
+
+            result.size += detail::put_wide(
+                code_point, out + result.size,
+                detail::unit_width<sizeof(Char)>());
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Convert a wide string to UTF-8.
+ *
+ * @param out
+ *     Buffer with room for at least `max_utf8_size<Char>(size)` bytes.
+ */
+template<typename Char>
+inline conversion_result wide_to_utf8(
+    const Char* wide, std::size_t size, char* out)
+{
+    conversion_result result;
+    std::size_t i = 0;
+    while (i < size)
+    {
+        if (static_cast<boost::uint32_t>(wide[i]) < 0x80)
+        {
+            std::size_t run = detail::narrow_ascii(
+                wide + i, size - i, out + result.size,
+                detail::unit_width<sizeof(Char)>());
+            i += run;
+            result.size += run;
+        }
+        else
+        {
+            boost::uint32_t code_point;
+            bool valid;
+            i += detail::get_wide(
+                wide + i, size - i, code_point, valid,
+                detail::unit_width<sizeof(Char)>());
+            if (!valid)
+                ++result.invalid;
+
+            result.size += detail::put_utf8(code_point, out + result.size);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Convert UTF-8 to a wide string, replacing the contents of `out`.
+ *
+ * The string's existing capacity is reused so converting many strings
+ * into the same one needn't allocate each time.
+ */
+template<typename Char>
+inline conversion_result utf8_to_wide(
+    const char* utf8, std::size_t size, std::basic_string<Char>& out)
+{
+    out.resize(max_wide_size(size));
+    if (out.empty())
+        return conversion_result();
+
+    conversion_result result = utf8_to_wide(utf8, size, &out[0]);
+    out.resize(result.size);
+    return result;
+}
+
+/**
+ * Convert a wide string to UTF-8, replacing the contents of `out`.
+ *
+ * The string's existing capacity is reused so converting many strings
+ * into the same one needn't allocate each time.
+ */
+template<typename Char>
+inline conversion_result wide_to_utf8(
+    const Char* wide, std::size_t size, std::string& out)
+{
+    out.resize(max_utf8_size<Char>(size));
+    if (out.empty())
+        return conversion_result();
+
+    conversion_result result = wide_to_utf8(wide, size, &out[0]);
+    out.resize(result.size);
+    return result;
+}
+
+}} // namespace swish::utf8
+
+#endif
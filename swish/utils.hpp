@@ -36,6 +36,8 @@
 
 #pragma once
 
+#include "swish/utf8.hpp" // utf8_to_wide, wide_to_utf8
+
 #include <winapi/shell/shell.hpp> // known_folder_path
 
 #include <comet/error.h> // com_error
@@ -127,18 +129,28 @@ inline typename T::ToType ConvertString(const typename T::FromType& from)
 
 /**
  * Convert a Windows wide string to a UTF-8 (multi-byte) string.
+ *
+ * Unpaired surrogates are converted to U+FFFD.  Use swish::utf8 directly
+ * to convert into an existing buffer or to find out if that happened.
  */
 inline std::string WideStringToUtf8String(const std::wstring& wide)
 {
-    return swish::utils::ConvertString<Narrow>(wide);
+    std::string narrow;
+    swish::utf8::wide_to_utf8(wide.data(), wide.size(), narrow);
+    return narrow;
 }
 
 /**
  * Convert a UTF-8 (multi-byte) string to a Windows wide string.
+ *
+ * Invalid UTF-8 is converted to U+FFFD.  Use swish::utf8 directly
+ * to convert into an existing buffer or to find out if that happened.
  */
 inline std::wstring Utf8StringToWideString(const std::string& narrow)
 {
-    return swish::utils::ConvertString<Widen>(narrow);
+    std::wstring wide;
+    swish::utf8::utf8_to_wide(narrow.data(), narrow.size(), wide);
+    return wide;
 }
 
 }} // namespace swish::utils
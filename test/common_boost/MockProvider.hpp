@@ -528,7 +528,7 @@ public:
                 "Unreachable: Unrecognised mock behaviour", E_UNEXPECTED));
         }
 
-        return files;
+        return swish::provider::directory_listing(files.begin(), files.end());
     }
 
     virtual comet::com_ptr<IStream> get_file(
@@ -624,6 +624,40 @@ public:
         return *dir;
     }
 
+    /**
+     * The mock server has no tar so callers must fall back to copying files
+     * individually.
+     */
+    virtual bool extract_archive(
+        const swish::provider::sftp_provider_path& /*directory*/,
+        boost::function<void (swish::block_transfer::byte_sink&)>
+            /*write_archive*/)
+    {
+        return false;
+    }
+
+    /**
+     * Nor can it make archives.
+     */
+    virtual boost::shared_ptr<swish::block_transfer::byte_source>
+    create_archive(
+        const swish::provider::sftp_provider_path& /*directory*/,
+        const std::vector<swish::provider::sftp_provider_path>& /*items*/)
+    {
+        return boost::shared_ptr<swish::block_transfer::byte_source>();
+    }
+
+    /**
+     * Like a server that won't open more than one channel, so callers make
+     * do with this provider.
+     */
+    virtual std::vector<boost::shared_ptr<swish::provider::sftp_provider>>
+    borrow_channels(std::size_t /*count*/)
+    {
+        return std::vector<
+            boost::shared_ptr<swish::provider::sftp_provider>>();
+    }
+
 private:
 
     detail::Filesystem m_filesystem;
@@ -0,0 +1,57 @@
+/**
+    @file
+
+    Switch for the benchmarks.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#pragma once
+
+#ifdef _WIN32
+#include <Windows.h> // GetEnvironmentVariableA
+#else
+#include <cstdlib> // getenv
+#endif
+
+namespace test {
+
+/**
+ * Whether to run the benchmarks.
+ *
+ * Each test module keeps its benchmarks in a `benchmarks` suite.  They take
+ * too long to run after every build and their timings depend on the machine,
+ * so every case returns straight away unless the SWISH_BENCHMARKS
+ * environment variable is set.
+ *
+ * Benchmarks report what they measure, which shows with
+ * `--log_level=message`, but never fail on a timing.
+ */
+inline bool benchmarks_enabled()
+{
+#ifdef _WIN32
+    return ::GetEnvironmentVariableA("SWISH_BENCHMARKS", NULL, 0) != 0;
+#else
+    return std::getenv("SWISH_BENCHMARKS") != NULL;
+#endif
+}
+
+}
@@ -0,0 +1,180 @@
+/**
+    @file
+
+    Tests for the per-host authentication memo.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "swish/connection/authentication_memo.hpp" // Test subject
+
+#include "test/common_boost/fixtures.hpp" // SandboxFixture
+
+#include <boost/filesystem.hpp> // wpath
+#include <boost/filesystem/fstream.hpp> // ofstream
+#include <boost/optional/optional.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+
+using swish::connection::authentication_memo;
+using swish::connection::remembered_authentication;
+
+using test::SandboxFixture;
+
+using boost::filesystem::ofstream;
+using boost::filesystem::wpath;
+using boost::optional;
+
+using std::string;
+
+namespace {
+
+    class memo_fixture : public SandboxFixture
+    {
+    public:
+        wpath memo_file()
+        {
+            return Sandbox() / L"memo";
+        }
+    };
+
+    // Binary on purpose: agent identities are raw public-key blobs
+    const string identity("\x00\x01\xfe\xff key blob", 13);
+}
+
+BOOST_FIXTURE_TEST_SUITE(authentication_memo_tests, memo_fixture)
+
+BOOST_AUTO_TEST_CASE( nothing_remembered )
+{
+    authentication_memo memo(memo_file());
+
+    BOOST_CHECK(!memo.recall(L"host", 22, L"user"));
+}
+
+BOOST_AUTO_TEST_CASE( remember_method )
+{
+    authentication_memo memo(memo_file());
+
+    memo.remember(L"host", 22, L"user", remembered_authentication("password"));
+
+    optional<remembered_authentication> remembered =
+        memo.recall(L"host", 22, L"user");
+    BOOST_REQUIRE(remembered);
+    BOOST_CHECK_EQUAL(remembered->method(), "password");
+    BOOST_CHECK(remembered->identity().empty());
+}
+
+BOOST_AUTO_TEST_CASE( remember_identity )
+{
+    authentication_memo memo(memo_file());
+
+    memo.remember(
+        L"host", 22, L"user",
+        remembered_authentication("publickey-agent", identity));
+
+    optional<remembered_authentication> remembered =
+        memo.recall(L"host", 22, L"user");
+    BOOST_REQUIRE(remembered);
+    BOOST_CHECK_EQUAL(remembered->method(), "publickey-agent");
+    BOOST_CHECK(remembered->identity() == identity);
+}
+
+/**
+ * The memo must survive across instances, that's the whole point.
+ */
+BOOST_AUTO_TEST_CASE( persistent )
+{
+    authentication_memo(memo_file()).remember(
+        L"host", 22, L"user",
+        remembered_authentication("publickey-agent", identity));
+
+    optional<remembered_authentication> remembered =
+        authentication_memo(memo_file()).recall(L"host", 22, L"user");
+    BOOST_REQUIRE(remembered);
+    BOOST_CHECK(
+        *remembered == remembered_authentication("publickey-agent", identity));
+}
+
+BOOST_AUTO_TEST_CASE( later_success_replaces_earlier )
+{
+    authentication_memo memo(memo_file());
+
+    memo.remember(L"host", 22, L"user", remembered_authentication("password"));
+    memo.remember(
+        L"host", 22, L"user",
+        remembered_authentication("publickey-agent", identity));
+
+    BOOST_CHECK(
+        *memo.recall(L"host", 22, L"user") ==
+        remembered_authentication("publickey-agent", identity));
+}
+
+BOOST_AUTO_TEST_CASE( hosts_remembered_separately )
+{
+    authentication_memo memo(memo_file());
+
+    memo.remember(L"host", 22, L"user", remembered_authentication("password"));
+    memo.remember(
+        L"host", 2222, L"user", remembered_authentication("publickey-file"));
+    memo.remember(
+        L"host", 22, L"other", remembered_authentication("keyboard-interactive"));
+
+    BOOST_CHECK_EQUAL(memo.recall(L"host", 22, L"user")->method(), "password");
+    BOOST_CHECK_EQUAL(
+        memo.recall(L"host", 2222, L"user")->method(), "publickey-file");
+    BOOST_CHECK_EQUAL(
+        memo.recall(L"host", 22, L"other")->method(), "keyboard-interactive");
+    BOOST_CHECK(!memo.recall(L"otherhost", 22, L"user"));
+}
+
+BOOST_AUTO_TEST_CASE( forget )
+{
+    authentication_memo memo(memo_file());
+
+    memo.remember(L"host", 22, L"user", remembered_authentication("password"));
+    memo.remember(
+        L"host", 22, L"other", remembered_authentication("password"));
+
+    memo.forget(L"host", 22, L"user");
+
+    BOOST_CHECK(!memo.recall(L"host", 22, L"user"));
+    BOOST_CHECK(memo.recall(L"host", 22, L"other"));
+}
+
+/**
+ * A damaged memo file is only a lost hint, not an error.
+ */
+BOOST_AUTO_TEST_CASE( corrupt_memo_ignored )
+{
+    {
+        ofstream file(memo_file());
+        file << "garbage\n" << "user@host:22\tpassword\tnot-hex\n";
+    }
+
+    authentication_memo memo(memo_file());
+    BOOST_CHECK(!memo.recall(L"host", 22, L"user"));
+
+    memo.remember(L"host", 22, L"user", remembered_authentication("password"));
+    BOOST_CHECK_EQUAL(memo.recall(L"host", 22, L"user")->method(), "password");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
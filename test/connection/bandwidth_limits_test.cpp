@@ -0,0 +1,79 @@
+/**
+    @file
+
+    Tests for per-process bandwidth limits.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "swish/connection/bandwidth_limits.hpp" // Test subject
+#include "swish/connection/connection_spec.hpp"
+
+#include <ssh/bandwidth.hpp> // bandwidth_limiter, bandwidth_schedule
+
+#include <boost/shared_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+using swish::connection::bandwidth_limits;
+using swish::connection::connection_spec;
+
+using ssh::bandwidth_limiter;
+using ssh::bandwidth_schedule;
+
+using boost::shared_ptr;
+
+// The limits belong to the process so each test uses its own hosts
+
+BOOST_AUTO_TEST_SUITE(bandwidth_limits_tests)
+
+BOOST_AUTO_TEST_CASE( unlimited_by_default )
+{
+    shared_ptr<bandwidth_limiter> limiter =
+        bandwidth_limits().limiter_for(connection_spec(L"default", L"u", 22));
+
+    BOOST_CHECK_EQUAL(limiter->current_rate(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE( shared_by_specification )
+{
+    shared_ptr<bandwidth_limiter> first =
+        bandwidth_limits().limiter_for(connection_spec(L"shared", L"u", 22));
+    shared_ptr<bandwidth_limiter> second =
+        bandwidth_limits().limiter_for(connection_spec(L"shared", L"u", 22));
+    shared_ptr<bandwidth_limiter> other_port =
+        bandwidth_limits().limiter_for(connection_spec(L"shared", L"u", 23));
+
+    BOOST_CHECK(first == second);
+    BOOST_CHECK(first != other_port);
+}
+
+BOOST_AUTO_TEST_CASE( limit_applies_to_existing_limiter )
+{
+    connection_spec spec(L"limited", L"u", 22);
+    shared_ptr<bandwidth_limiter> limiter =
+        bandwidth_limits().limiter_for(spec);
+
+    bandwidth_limits().limit_connection(spec, bandwidth_schedule(1000));
+
+    BOOST_CHECK_EQUAL(limiter->current_rate(), 1000U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
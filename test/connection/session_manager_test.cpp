@@ -30,6 +30,7 @@
 #include "swish/connection/connection_spec.hpp"
 #include "swish/utils.hpp"
 
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
 #include "test/common_boost/helpers.hpp"
 #include "test/common_boost/fixtures.hpp"
 #include "test/common_boost/ConsumerStub.hpp"
@@ -37,18 +38,22 @@
 #include <comet/ptr.h> // com_ptr
 
 #include <boost/container/vector.hpp> // move-aware vector
+#include <boost/date_time/posix_time/posix_time.hpp> // microsec_clock
 #include <boost/move/move.hpp>
 #include <boost/test/unit_test.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/thread.hpp>
 
+#include <algorithm> // max
 #include <exception>
 #include <string>
 #include <vector>
 
 using swish::connection::authenticated_session;
 using swish::connection::connection_spec;
+using swish::connection::session_limits;
 using swish::connection::session_manager;
+using swish::connection::session_pool_metrics;
 using swish::connection::session_reservation;
 using swish::utils::Utf8StringToWideString;
 
@@ -60,6 +65,12 @@ using comet::com_ptr;
 using boost::container::vector;
 using boost::move;
 using boost::mutex;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::milliseconds;
+using boost::posix_time::minutes;
+using boost::posix_time::ptime;
+using boost::posix_time::seconds;
+using boost::posix_time::time_duration;
 using boost::shared_ptr;
 using boost::ref;
 using boost::test_tools::predicate_result;
@@ -325,5 +336,219 @@ BOOST_AUTO_TEST_CASE( removing_session_with_colliding_task_names )
     BOOST_CHECK_EQUAL(progress.notifications()[2].size(), 0U);
 }
 
+namespace {
+
+    /**
+     * Changes the session limits for the duration of a test.
+     */
+    class limits_override : boost::noncopyable
+    {
+    public:
+        explicit limits_override(const session_limits& limits)
+            : m_old_limits(session_manager().limits())
+        {
+            session_manager().limits(limits);
+        }
+
+        ~limits_override()
+        {
+            session_manager().limits(m_old_limits);
+        }
+
+    private:
+        session_limits m_old_limits;
+    };
+}
+
+BOOST_AUTO_TEST_CASE( idle_session_reaped )
+{
+    connection_spec spec(get_connection());
+
+    session_limits limits;
+    limits.idle_timeout = minutes(15);
+    limits_override override_limits(limits);
+
+    session_manager().reserve_session(spec, consumer(), "Testing");
+    BOOST_REQUIRE(session_manager().has_session(spec));
+
+    session_manager().reap_idle_sessions(
+        microsec_clock::universal_time() + minutes(16));
+
+    BOOST_CHECK(!session_manager().has_session(spec));
+}
+
+BOOST_AUTO_TEST_CASE( recently_used_session_not_reaped )
+{
+    connection_spec spec(get_connection());
+
+    session_limits limits;
+    limits.idle_timeout = minutes(15);
+    limits_override override_limits(limits);
+
+    session_manager().reserve_session(spec, consumer(), "Testing");
+
+    session_manager().reap_idle_sessions(
+        microsec_clock::universal_time() + minutes(14));
+
+    BOOST_CHECK(session_manager().has_session(spec));
+}
+
+/**
+ * The reaper runs in the background without being asked.
+ */
+BOOST_AUTO_TEST_CASE( idle_session_reaped_in_background )
+{
+    connection_spec spec(get_connection());
+
+    session_limits limits;
+    limits.idle_timeout = milliseconds(100);
+    limits_override override_limits(limits);
+
+    session_manager().reserve_session(spec, consumer(), "Testing");
+
+    // The reaper never waits less than a second
+    ptime give_up = microsec_clock::universal_time() + seconds(10);
+    while (session_manager().has_session(spec) &&
+        microsec_clock::universal_time() < give_up)
+    {
+        boost::this_thread::sleep(milliseconds(100));
+    }
+
+    BOOST_CHECK(!session_manager().has_session(spec));
+}
+
+BOOST_AUTO_TEST_CASE( reserved_session_not_reaped )
+{
+    connection_spec spec(get_connection());
+
+    session_limits limits;
+    limits.idle_timeout = minutes(15);
+    limits_override override_limits(limits);
+
+    session_reservation ticket =
+        session_manager().reserve_session(spec, consumer(), "Testing");
+
+    session_manager().reap_idle_sessions(
+        microsec_clock::universal_time() + minutes(16));
+
+    BOOST_CHECK(session_manager().has_session(spec));
+    BOOST_CHECK(alive(ticket.session()));
+}
+
+BOOST_AUTO_TEST_CASE( idle_session_evicted_over_limit )
+{
+    connection_spec spec(get_connection());
+
+    session_manager().reserve_session(spec, consumer(), "Testing");
+    BOOST_REQUIRE(session_manager().has_session(spec));
+
+    session_pool_metrics before = session_manager().metrics();
+
+    session_limits limits;
+    limits.max_sessions = 0;
+    limits_override override_limits(limits);
+
+    BOOST_CHECK(!session_manager().has_session(spec));
+    BOOST_CHECK_EQUAL(session_manager().metrics().evicted, before.evicted + 1);
+}
+
+BOOST_AUTO_TEST_CASE( reserved_session_not_evicted_over_limit )
+{
+    connection_spec spec(get_connection());
+
+    session_reservation ticket =
+        session_manager().reserve_session(spec, consumer(), "Testing");
+
+    session_limits limits;
+    limits.max_sessions = 0;
+    limits.max_sessions_per_host = 0;
+    limits_override override_limits(limits);
+
+    BOOST_CHECK(session_manager().has_session(spec));
+    BOOST_CHECK(alive(ticket.session()));
+}
+
+BOOST_AUTO_TEST_CASE( metrics )
+{
+    connection_spec spec(get_connection());
+
+    // Earlier tests may have left the session in the pool
+    progress_callback progress;
+    session_manager().disconnect_session(spec, ref(progress));
+
+    session_pool_metrics before = session_manager().metrics();
+
+    {
+        session_reservation ticket1 =
+            session_manager().reserve_session(spec, consumer(), "Testing1");
+        session_reservation ticket2 =
+            session_manager().reserve_session(spec, consumer(), "Testing2");
+
+        session_pool_metrics reserved = session_manager().metrics();
+        BOOST_CHECK_EQUAL(reserved.sessions, before.sessions + 1);
+        BOOST_CHECK_EQUAL(
+            reserved.reserved_sessions, before.reserved_sessions + 1);
+        BOOST_CHECK_EQUAL(reserved.reservations, before.reservations + 2);
+    }
+
+    session_pool_metrics released = session_manager().metrics();
+    BOOST_CHECK_EQUAL(released.sessions, before.sessions + 1);
+    BOOST_CHECK_EQUAL(released.reserved_sessions, before.reserved_sessions);
+    BOOST_CHECK_EQUAL(released.reservations, before.reservations);
+}
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+/**
+ * Reservations are taken and released very often (every thumbnail, every
+ * property request) so they must be cheap.
+ *
+ * Reports the rate so that regressions show up in the test log.
+ */
+BOOST_AUTO_TEST_CASE( reservation_throughput )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    connection_spec spec(get_connection());
+    com_ptr<ISftpConsumer> the_consumer = consumer();
+
+    // Connect outside the timed part
+    session_reservation first =
+        session_manager().reserve_session(spec, the_consumer, "Testing");
+
+    const int reservation_count = 100000;
+
+    ptime start = microsec_clock::universal_time();
+
+    for (int i = 0; i < reservation_count; ++i)
+    {
+        session_reservation ticket = session_manager().reserve_session(
+            spec, the_consumer, "Testing");
+        BOOST_REQUIRE(&(ticket.session()) == &(first.session()));
+    }
+
+    time_duration elapsed = microsec_clock::universal_time() - start;
+
+    double seconds = (std::max)(elapsed.total_microseconds() / 1e6, 1e-6);
+    BOOST_TEST_MESSAGE(
+        reservation_count << " reservations in " << elapsed << " ("
+        << reservation_count / seconds << " reservations per second)");
+
+    // Only the first reservation should still be pending
+    vector<session_reservation> tasks;
+    tasks.push_back(move(first));
+
+    progress_callback progress(move(tasks));
+    session_manager().disconnect_session(spec, ref(progress));
+
+    BOOST_CHECK(!session_manager().has_session(spec));
+    BOOST_REQUIRE_EQUAL(progress.notifications().size(), 2U);
+    BOOST_CHECK_EQUAL(progress.notifications()[0].size(), 1U);
+    BOOST_CHECK_EQUAL(progress.notifications()[1].size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
 BOOST_AUTO_TEST_SUITE_END()
 
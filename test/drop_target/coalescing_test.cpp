@@ -0,0 +1,395 @@
+/**
+    @file
+
+    Tests for coalescing transfer updates.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "swish/coalescing.hpp" // Test subject
+
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
+#include <boost/bind.hpp>
+#include <boost/chrono/process_cpu_clocks.hpp> // process_cpu_clock
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/date_time/posix_time/posix_time.hpp> // microsec_clock
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp> // this_thread
+
+#include <cstddef> // size_t
+#include <map>
+#include <sstream> // wostringstream
+#include <string>
+
+#ifdef _WIN32
+#include <shlobj.h> // SHChangeNotify
+#endif
+
+using swish::coalescing::coalescing_options;
+using swish::coalescing::update_coalescer;
+
+using boost::bind;
+using boost::chrono::process_cpu_clock;
+using boost::mutex;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::milliseconds;
+using boost::posix_time::ptime;
+using boost::posix_time::seconds;
+using boost::posix_time::time_duration;
+using boost::uintmax_t;
+
+using std::map;
+using std::size_t;
+using std::wostringstream;
+using std::wstring;
+
+namespace {
+
+    typedef update_coalescer<wstring, uintmax_t> coalescer;
+
+    /**
+     * Records what was delivered, optionally taking its time about it.
+     */
+    class DeliveryRecord
+    {
+    public:
+
+        explicit DeliveryRecord(time_duration delay=milliseconds(0))
+            : m_delay(delay), m_count(0) {}
+
+        void deliver(const wstring& key, uintmax_t state)
+        {
+            boost::this_thread::sleep(m_delay);
+
+            mutex::scoped_lock lock(m_mutex);
+
+            ++m_count;
+            m_latest[key] = state;
+        }
+
+        size_t count() const
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            return m_count;
+        }
+
+        uintmax_t latest(const wstring& key) const
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            map<wstring, uintmax_t>::const_iterator it = m_latest.find(key);
+            return (it == m_latest.end()) ? 0 : it->second;
+        }
+
+        coalescer::deliverer deliverer()
+        {
+            return bind(&DeliveryRecord::deliver, this, _1, _2);
+        }
+
+    private:
+        mutable mutex m_mutex;
+        time_duration m_delay;
+        size_t m_count;
+        map<wstring, uintmax_t> m_latest;
+    };
+
+    /**
+     * Deliverer that holds up deliveries until released.
+     */
+    class HeldDelivery
+    {
+    public:
+
+        HeldDelivery() : m_held(true), m_delivering(false) {}
+
+        void deliver(const wstring&, uintmax_t)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            m_delivering = true;
+            m_changed.notify_all();
+
+            // Only bounded so that a test that never releases the delivery
+            // fails instead of hanging
+            boost::system_time give_up = patience();
+            while (m_held)
+            {
+                if (!m_changed.timed_wait(lock, give_up))
+                    break;
+            }
+
+            m_delivering = false;
+        }
+
+        /**
+         * Wait for a delivery to start, or a good while if none does.
+         */
+        void wait_for_delivery()
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            boost::system_time give_up = patience();
+            while (!m_delivering)
+            {
+                if (!m_changed.timed_wait(lock, give_up))
+                    break;
+            }
+        }
+
+        bool delivering() const
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            return m_delivering;
+        }
+
+        void release()
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            m_held = false;
+            m_changed.notify_all();
+        }
+
+        coalescer::deliverer deliverer()
+        {
+            return bind(&HeldDelivery::deliver, this, _1, _2);
+        }
+
+    private:
+
+        static boost::system_time patience()
+        {
+            return boost::get_system_time() + seconds(10);
+        }
+
+        mutable mutex m_mutex;
+        boost::condition_variable m_changed;
+        bool m_held;
+        bool m_delivering;
+    };
+
+    coalescing_options fast_options()
+    {
+        coalescing_options options;
+        options.interval = milliseconds(20);
+        options.min_bytes = 1000;
+        options.max_delay = milliseconds(200);
+        return options;
+    }
+
+    /**
+     * The work of telling the shell about an upload's progress, minus
+     * building the item ID.
+     */
+    void notify_shell(const wstring& path, uintmax_t size)
+    {
+        wostringstream message;
+        message << path << L": " << size;
+
+#ifdef _WIN32
+        ::SHChangeNotify(
+            SHCNE_UPDATEITEM, SHCNF_PATHW | SHCNF_FLUSHNOWAIT, path.c_str(),
+            NULL);
+#endif
+    }
+
+    /**
+     * Process CPU time, on all threads, in nanoseconds.
+     */
+    boost::int_least64_t cpu_time()
+    {
+        process_cpu_clock::times t =
+            process_cpu_clock::now().time_since_epoch().count();
+        return t.user + t.system;
+    }
+
+}
+
+BOOST_AUTO_TEST_SUITE(coalescing_tests)
+
+BOOST_AUTO_TEST_CASE( latest_state_delivered )
+{
+    DeliveryRecord record;
+    {
+        coalescer updates(record.deliverer(), fast_options());
+
+        for (uintmax_t i = 1; i <= 10000; ++i)
+        {
+            updates.post(L"/a", i, i);
+        }
+
+        updates.flush();
+
+        BOOST_CHECK_EQUAL(record.latest(L"/a"), 10000U);
+        BOOST_CHECK_EQUAL(updates.posted(), 10000U);
+        BOOST_CHECK_LT(updates.delivered(), 100U);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( items_kept_apart )
+{
+    DeliveryRecord record;
+    {
+        coalescer updates(record.deliverer(), fast_options());
+
+        updates.post(L"/a", 1, 5000);
+        updates.post(L"/b", 2, 5000);
+        updates.post(L"/a", 3, 10000);
+
+        updates.flush();
+    }
+
+    BOOST_CHECK_EQUAL(record.latest(L"/a"), 3U);
+    BOOST_CHECK_EQUAL(record.latest(L"/b"), 2U);
+}
+
+/**
+ * Small amounts of progress wait for more, but not for ever.
+ */
+BOOST_AUTO_TEST_CASE( small_progress_delayed )
+{
+    DeliveryRecord record;
+    coalescer updates(record.deliverer(), fast_options());
+
+    updates.post(L"/a", 1, 10);
+    boost::this_thread::sleep(milliseconds(100));
+    BOOST_CHECK_EQUAL(record.count(), 0U);
+
+    boost::this_thread::sleep(milliseconds(300));
+    BOOST_CHECK_EQUAL(record.latest(L"/a"), 1U);
+}
+
+BOOST_AUTO_TEST_CASE( final_state_delivered_promptly )
+{
+    DeliveryRecord record;
+    coalescer updates(record.deliverer(), fast_options());
+
+    updates.post(L"/a", 7, 10, true);
+    boost::this_thread::sleep(milliseconds(100));
+
+    BOOST_CHECK_EQUAL(record.latest(L"/a"), 7U);
+}
+
+BOOST_AUTO_TEST_CASE( pending_delivered_on_destruction )
+{
+    DeliveryRecord record;
+    {
+        coalescing_options options = fast_options();
+        options.interval = seconds(10);
+        coalescer updates(record.deliverer(), options);
+
+        updates.post(L"/a", 9, 10);
+    }
+
+    BOOST_CHECK_EQUAL(record.latest(L"/a"), 9U);
+}
+
+BOOST_AUTO_TEST_CASE( deliveries_rate_limited )
+{
+    DeliveryRecord record;
+    coalescer updates(record.deliverer(), fast_options());
+
+    ptime start = microsec_clock::universal_time();
+    uintmax_t bytes = 0;
+    while (microsec_clock::universal_time() - start < milliseconds(500))
+    {
+        bytes += 32 * 1024;
+        updates.post(L"/a", bytes, bytes);
+    }
+
+    // One every 20ms, with some slack for the scheduler
+    BOOST_CHECK_LE(record.count(), 500U / 20U + 5U);
+}
+
+/**
+ * However slow the user interface, posting doesn't wait for it.
+ */
+BOOST_AUTO_TEST_CASE( post_never_waits_for_delivery )
+{
+    HeldDelivery record;
+    coalescer updates(record.deliverer(), fast_options());
+
+    // Get a delivery under way
+    updates.post(L"/a", 0, 1024 * 1024);
+    record.wait_for_delivery();
+    BOOST_REQUIRE(record.delivering());
+
+    for (uintmax_t i = 1; i <= 1000; ++i)
+    {
+        updates.post(L"/a", i, (i + 32) * 1024 * 1024);
+    }
+
+    // Still delivering, so none of the posts waited for it
+    BOOST_CHECK(record.delivering());
+
+    record.release();
+}
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+/**
+ * CPU used telling the shell about a gigabyte uploaded in 32 KiB blocks,
+ * every block, against coalescing the notifications.
+ */
+BOOST_AUTO_TEST_CASE( cpu_per_gigabyte )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    const uintmax_t gigabyte = 1024 * 1024 * 1024;
+    const uintmax_t block = 32 * 1024;
+    const wstring path = L"/home/user/upload.bin";
+
+    boost::int_least64_t start = cpu_time();
+    for (uintmax_t done = block; done <= gigabyte; done += block)
+    {
+        notify_shell(path, done);
+    }
+    boost::int_least64_t direct = cpu_time() - start;
+
+    unsigned long delivered = 0;
+    start = cpu_time();
+    {
+        coalescer updates(&notify_shell);
+        for (uintmax_t done = block; done <= gigabyte; done += block)
+        {
+            updates.post(path, done, done, done == gigabyte);
+        }
+
+        updates.flush();
+        delivered = updates.delivered();
+    }
+    boost::int_least64_t coalesced = cpu_time() - start;
+
+    BOOST_TEST_MESSAGE(
+        "CPU per GB notifying every block: " << direct / 1000000.0
+        << "ms, coalesced: " << coalesced / 1000000.0 << "ms ("
+        << delivered << " notifications)");
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,699 @@
+/**
+    @file
+
+    Tests for plan running drop operations concurrently.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "swish/drop_target/ConcurrentPlan.hpp"  // Test subject
+
+#include "swish/drop_target/DropActionCallback.hpp"
+#include "swish/drop_target/Operation.hpp"
+#include "swish/drop_target/Progress.hpp"
+
+#include "test/common_boost/MockProvider.hpp"
+
+#include <comet/error.h> // com_error
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // milliseconds
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp> // this_thread
+
+#include <algorithm> // find, includes, max, min
+#include <cstddef> // size_t
+#include <memory> // auto_ptr
+#include <set>
+#include <stdexcept> // invalid_argument
+#include <string>
+#include <vector>
+
+using swish::drop_target::ConcurrentPlan;
+using swish::drop_target::DropActionCallback;
+using swish::drop_target::Operation;
+using swish::drop_target::OperationCallback;
+using swish::drop_target::OperationSink;
+using swish::drop_target::Progress;
+using swish::provider::sftp_provider;
+
+using test::MockProvider;
+
+using comet::com_error;
+
+using boost::filesystem::wpath;
+using boost::make_shared;
+using boost::mutex;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::milliseconds;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
+using boost::shared_ptr;
+using boost::thread;
+
+using std::auto_ptr;
+using std::max;
+using std::min;
+using std::set;
+using std::size_t;
+using std::vector;
+using std::wstring;
+
+namespace {
+
+    /**
+     * What happened while the plan ran.
+     */
+    class Record
+    {
+    public:
+        Record()
+            : running(0), most_running(0), overwrite_answered(false) {}
+
+        void started(size_t operation, sftp_provider* provider)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            starts.push_back(operation);
+            providers.insert(provider);
+            ++running;
+            most_running = (max)(most_running, running);
+        }
+
+        void finished(size_t operation)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            ends.push_back(operation);
+            --running;
+        }
+
+        size_t started_count()
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            return starts.size();
+        }
+
+        /// Position in which the operation started, or ended
+        static size_t position(const vector<size_t>& events, size_t operation)
+        {
+            return std::find(events.begin(), events.end(), operation) -
+                events.begin();
+        }
+
+        vector<size_t> starts;
+        vector<size_t> ends;
+        set<sftp_provider*> providers;
+        size_t running;
+        size_t most_running;
+        bool overwrite_answered;
+
+    private:
+        mutex m_mutex;
+    };
+
+    /**
+     * Operation that just records that it ran.
+     */
+    class FakeOperation : public Operation
+    {
+    public:
+
+        FakeOperation(
+            shared_ptr<Record> record, size_t index, bool barrier=false)
+            :
+            m_record(record), m_index(index), m_barrier(barrier),
+            m_fails(false), m_asks(false), m_duration(milliseconds(20)) {}
+
+        FakeOperation& fails()
+        {
+            m_fails = true;
+            return *this;
+        }
+
+        FakeOperation& asks_to_overwrite()
+        {
+            m_asks = true;
+            return *this;
+        }
+
+        FakeOperation& takes(milliseconds duration)
+        {
+            m_duration = duration;
+            return *this;
+        }
+
+        virtual wstring title() const { return L"title"; }
+
+        virtual wstring description() const { return L"description"; }
+
+        virtual void operator()(
+            OperationCallback& callback,
+            shared_ptr<sftp_provider> provider) const
+        {
+            m_record->started(m_index, provider.get());
+
+            try
+            {
+                if (m_fails)
+                    BOOST_THROW_EXCEPTION(com_error(E_FAIL));
+
+                if (m_asks)
+                {
+                    m_record->overwrite_answered =
+                        callback.request_overwrite_permission(L"/tmp/file");
+                }
+
+                // Checking for cancellation as it goes, as a copy would
+                for (int i = 0; i < 10; ++i)
+                {
+                    callback.check_if_user_cancelled();
+                    callback.update_progress(i, 10);
+                    boost::this_thread::sleep(m_duration / 10);
+                }
+            }
+            catch (...)
+            {
+                m_record->finished(m_index);
+                throw;
+            }
+
+            m_record->finished(m_index);
+        }
+
+        virtual bool is_dependency_barrier() const
+        {
+            return m_barrier;
+        }
+
+    private:
+
+        virtual Operation* do_clone() const
+        {
+            return new FakeOperation(*this);
+        }
+
+        shared_ptr<Record> m_record;
+        size_t m_index;
+        bool m_barrier;
+        bool m_fails;
+        bool m_asks;
+        milliseconds m_duration;
+    };
+
+    /**
+     * Planner adding operations one by one.
+     */
+    class FakePlanner
+    {
+    public:
+
+        FakePlanner(shared_ptr<Record> record, size_t count)
+            :
+            m_record(record), m_count(count), m_fail_after(count),
+            m_most_unstarted(make_shared<size_t>(0)),
+            m_overlapped(make_shared<bool>(false)) {}
+
+        /**
+         * Throw once this many operations have been added.
+         */
+        FakePlanner& fails_after(size_t count)
+        {
+            m_fail_after = count;
+            return *this;
+        }
+
+        void operator()(OperationSink& sink) const
+        {
+            for (size_t i = 0; i < m_count; ++i)
+            {
+                if (i == m_fail_after)
+                    BOOST_THROW_EXCEPTION(com_error(E_UNEXPECTED));
+
+                sink.add_stage(FakeOperation(m_record, i));
+
+                size_t unstarted = i + 1 - m_record->started_count();
+                *m_most_unstarted =
+                    (max)(*m_most_unstarted, unstarted);
+
+                // Slow source: the first operation should start while
+                // planning carries on
+                if (i == 0)
+                {
+                    for (int wait = 0; wait < 50; ++wait)
+                    {
+                        if (m_record->started_count() > 0)
+                        {
+                            *m_overlapped = true;
+                            break;
+                        }
+
+                        boost::this_thread::sleep(milliseconds(20));
+                    }
+                }
+            }
+        }
+
+        /// Most operations added that had not started
+        size_t most_unstarted() const { return *m_most_unstarted; }
+
+        bool overlapped() const { return *m_overlapped; }
+
+    private:
+        shared_ptr<Record> m_record;
+        size_t m_count;
+        size_t m_fail_after;
+
+        // Shared because the plan runs a copy of the planner
+        shared_ptr<size_t> m_most_unstarted;
+        shared_ptr<bool> m_overlapped;
+    };
+
+    /**
+     * Mock server that will only open so many more channels.
+     */
+    class ChannelLimitedProvider : public MockProvider
+    {
+    public:
+
+        explicit ChannelLimitedProvider(size_t channels)
+            : asked_for(0), m_channels(channels) {}
+
+        virtual vector<shared_ptr<sftp_provider>> borrow_channels(
+            size_t count)
+        {
+            asked_for = count;
+
+            vector<shared_ptr<sftp_provider>> providers;
+            for (size_t i = 0; i < (min)(count, m_channels); ++i)
+            {
+                providers.push_back(make_shared<MockProvider>());
+                borrowed.insert(providers.back().get());
+            }
+
+            return providers;
+        }
+
+        size_t asked_for;
+        set<sftp_provider*> borrowed;
+
+    private:
+        size_t m_channels;
+    };
+
+    class ProgressStub : public Progress
+    {
+    public:
+        ProgressStub(bool cancel, time_duration pause)
+            :
+            m_cancel(cancel),
+            m_pause_until(microsec_clock::universal_time() + pause) {}
+        bool user_cancelled() { return m_cancel; }
+        bool user_paused()
+        { return microsec_clock::universal_time() < m_pause_until; }
+        void line(DWORD, const wstring&) {}
+        void line_path(DWORD, const wstring&) {}
+        void update(ULONGLONG, ULONGLONG) {}
+        void hide() {}
+        void show() {}
+
+    private:
+        bool m_cancel;
+        ptime m_pause_until;
+    };
+
+    class CallbackStub : public DropActionCallback
+    {
+    public:
+        CallbackStub(bool cancel=false)
+            : m_cancel(cancel), asked_on_thread(false) {}
+
+        /**
+         * Pause for this long after the progress display appears.
+         */
+        CallbackStub& pauses_for(time_duration pause)
+        {
+            m_pause = pause;
+            return *this;
+        }
+
+        auto_ptr<Progress> progress()
+        { return auto_ptr<Progress>(new ProgressStub(m_cancel, m_pause)); }
+
+        bool can_overwrite(const wpath&)
+        {
+            asked_on_thread =
+                boost::this_thread::get_id() == m_executing_thread;
+            return true;
+        }
+
+        void handle_last_exception() {}
+
+        void executing_on_this_thread()
+        {
+            m_executing_thread = boost::this_thread::get_id();
+        }
+
+        bool asked_on_thread;
+
+    private:
+        bool m_cancel;
+        time_duration m_pause;
+        thread::id m_executing_thread;
+    };
+
+}
+
+BOOST_AUTO_TEST_SUITE(concurrent_plan_tests)
+
+BOOST_AUTO_TEST_CASE( empty )
+{
+    ConcurrentPlan plan(4);
+    CallbackStub callback;
+
+    plan.execute_plan(callback, shared_ptr<sftp_provider>());
+}
+
+BOOST_AUTO_TEST_CASE( zero_concurrency )
+{
+    BOOST_CHECK_THROW(ConcurrentPlan(0), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE( runs_every_operation )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(4);
+    for (size_t i = 0; i < 20; ++i)
+    {
+        plan.add_stage(FakeOperation(record, i));
+    }
+
+    CallbackStub callback;
+    plan.execute_plan(callback, shared_ptr<sftp_provider>());
+
+    BOOST_CHECK_EQUAL(record->starts.size(), 20U);
+    BOOST_CHECK_EQUAL(record->ends.size(), 20U);
+    for (size_t i = 0; i < 20; ++i)
+    {
+        BOOST_CHECK_LT(Record::position(record->ends, i), 20U);
+    }
+}
+
+/**
+ * Each worker copies on a channel of its own so there can be no more
+ * workers than channels.
+ */
+BOOST_AUTO_TEST_CASE( worker_per_borrowed_channel )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(4);
+    for (size_t i = 0; i < 8; ++i)
+    {
+        plan.add_stage(FakeOperation(record, i));
+    }
+
+    shared_ptr<ChannelLimitedProvider> provider =
+        make_shared<ChannelLimitedProvider>(2);
+
+    CallbackStub callback;
+    plan.execute_plan(callback, provider);
+
+    BOOST_CHECK_EQUAL(provider->asked_for, 4U);
+    BOOST_CHECK_EQUAL(record->ends.size(), 8U);
+    BOOST_CHECK_LE(record->most_running, 2U);
+    BOOST_CHECK(
+        std::includes(
+            provider->borrowed.begin(), provider->borrowed.end(),
+            record->providers.begin(), record->providers.end()));
+}
+
+/**
+ * Without spare channels, a single worker uses the provider's own.
+ */
+BOOST_AUTO_TEST_CASE( one_worker_without_borrowed_channels )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(4);
+    for (size_t i = 0; i < 4; ++i)
+    {
+        plan.add_stage(FakeOperation(record, i));
+    }
+
+    shared_ptr<ChannelLimitedProvider> provider =
+        make_shared<ChannelLimitedProvider>(0);
+
+    CallbackStub callback;
+    plan.execute_plan(callback, provider);
+
+    BOOST_CHECK_EQUAL(record->ends.size(), 4U);
+    BOOST_CHECK_EQUAL(record->most_running, 1U);
+    BOOST_REQUIRE_EQUAL(record->providers.size(), 1U);
+    BOOST_CHECK(*record->providers.begin() == provider.get());
+}
+
+BOOST_AUTO_TEST_CASE( runs_concurrently )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(4);
+    for (size_t i = 0; i < 8; ++i)
+    {
+        plan.add_stage(FakeOperation(record, i).takes(milliseconds(200)));
+    }
+
+    CallbackStub callback;
+    plan.execute_plan(callback, shared_ptr<sftp_provider>());
+
+    BOOST_CHECK_GT(record->most_running, 1U);
+    BOOST_CHECK_LE(record->most_running, 4U);
+}
+
+/**
+ * Nothing after a barrier starts before it ends, as it might need what the
+ * barrier creates.  Anything before it needn't wait for it.
+ */
+BOOST_AUTO_TEST_CASE( barrier_holds_back_later_operations )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(4);
+    plan.add_stage(FakeOperation(record, 0));
+    plan.add_stage(FakeOperation(record, 1));
+    plan.add_stage(FakeOperation(record, 2, true).takes(milliseconds(100)));
+    plan.add_stage(FakeOperation(record, 3));
+    plan.add_stage(FakeOperation(record, 4, true));
+    plan.add_stage(FakeOperation(record, 5));
+
+    CallbackStub callback;
+    plan.execute_plan(callback, shared_ptr<sftp_provider>());
+
+    BOOST_REQUIRE_EQUAL(record->ends.size(), 6U);
+
+    BOOST_CHECK_LT(
+        Record::position(record->ends, 2), Record::position(record->ends, 3));
+    BOOST_CHECK_LT(
+        Record::position(record->ends, 2), Record::position(record->ends, 5));
+    BOOST_CHECK_LT(
+        Record::position(record->ends, 4), Record::position(record->ends, 5));
+}
+
+BOOST_AUTO_TEST_CASE( error_stops_plan )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(1);
+    plan.add_stage(FakeOperation(record, 0));
+    plan.add_stage(FakeOperation(record, 1).fails());
+    plan.add_stage(FakeOperation(record, 2));
+
+    CallbackStub callback;
+    try
+    {
+        plan.execute_plan(callback, shared_ptr<sftp_provider>());
+        BOOST_FAIL("Plan should have failed");
+    }
+    catch (const com_error& e)
+    {
+        BOOST_CHECK_EQUAL(e.hr(), E_FAIL);
+    }
+
+    BOOST_CHECK_EQUAL(record->starts.size(), 2U);
+}
+
+/**
+ * Workers can't use the user interface themselves so the question must
+ * be asked on the thread executing the plan.
+ */
+BOOST_AUTO_TEST_CASE( overwrite_asked_on_executing_thread )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(4);
+    plan.add_stage(FakeOperation(record, 0).asks_to_overwrite());
+    plan.add_stage(FakeOperation(record, 1));
+
+    CallbackStub callback;
+    callback.executing_on_this_thread();
+    plan.execute_plan(callback, shared_ptr<sftp_provider>());
+
+    BOOST_CHECK(record->overwrite_answered);
+    BOOST_CHECK(callback.asked_on_thread);
+}
+
+BOOST_AUTO_TEST_CASE( cancel )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(2);
+    for (size_t i = 0; i < 20; ++i)
+    {
+        plan.add_stage(FakeOperation(record, i).takes(milliseconds(500)));
+    }
+
+    CallbackStub callback(true);
+    try
+    {
+        plan.execute_plan(callback, shared_ptr<sftp_provider>());
+        BOOST_FAIL("Plan should have been cancelled");
+    }
+    catch (const com_error& e)
+    {
+        BOOST_CHECK_EQUAL(e.hr(), E_ABORT);
+    }
+
+    BOOST_CHECK_LT(record->starts.size(), 20U);
+}
+
+BOOST_AUTO_TEST_CASE( pause_holds_workers )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    // Unpaused, this takes about half a second
+    ConcurrentPlan plan(4);
+    for (size_t i = 0; i < 20; ++i)
+    {
+        plan.add_stage(FakeOperation(record, i).takes(milliseconds(100)));
+    }
+
+    CallbackStub callback;
+    callback.pauses_for(milliseconds(1500));
+
+    ptime start = microsec_clock::universal_time();
+    plan.execute_plan(callback, shared_ptr<sftp_provider>());
+    time_duration elapsed = microsec_clock::universal_time() - start;
+
+    BOOST_CHECK_EQUAL(record->ends.size(), 20U);
+    BOOST_CHECK_GE(elapsed, milliseconds(1500));
+}
+
+BOOST_AUTO_TEST_CASE( zero_lookahead )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    BOOST_CHECK_THROW(
+        ConcurrentPlan(4, FakePlanner(record, 1), 0), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE( planner_operations_run )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(4, FakePlanner(record, 20), 8);
+
+    CallbackStub callback;
+    plan.execute_plan(callback, shared_ptr<sftp_provider>());
+
+    BOOST_CHECK_EQUAL(record->ends.size(), 20U);
+}
+
+BOOST_AUTO_TEST_CASE( planner_finds_nothing )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(4, FakePlanner(record, 0), 8);
+
+    CallbackStub callback;
+    plan.execute_plan(callback, shared_ptr<sftp_provider>());
+
+    BOOST_CHECK(record->starts.empty());
+}
+
+/**
+ * Operations must start while the planner is still running, not after.
+ */
+BOOST_AUTO_TEST_CASE( planning_overlaps_execution )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+    FakePlanner planner(record, 5);
+
+    ConcurrentPlan plan(4, planner, 8);
+
+    CallbackStub callback;
+    plan.execute_plan(callback, shared_ptr<sftp_provider>());
+
+    BOOST_CHECK(planner.overlapped());
+    BOOST_CHECK_EQUAL(record->ends.size(), 5U);
+}
+
+BOOST_AUTO_TEST_CASE( planner_held_back_by_lookahead )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+    FakePlanner planner(record, 40);
+
+    ConcurrentPlan plan(2, planner, 3);
+
+    CallbackStub callback;
+    plan.execute_plan(callback, shared_ptr<sftp_provider>());
+
+    BOOST_CHECK_EQUAL(record->ends.size(), 40U);
+
+    // Workers record starting just after claiming an operation so may lag
+    // the plan's own count by one each
+    BOOST_CHECK_LE(planner.most_unstarted(), 3U + 2U);
+}
+
+BOOST_AUTO_TEST_CASE( planner_error_stops_plan )
+{
+    shared_ptr<Record> record = make_shared<Record>();
+
+    ConcurrentPlan plan(2, FakePlanner(record, 20).fails_after(3), 8);
+
+    CallbackStub callback;
+    try
+    {
+        plan.execute_plan(callback, shared_ptr<sftp_provider>());
+        BOOST_FAIL("Plan should have failed");
+    }
+    catch (const com_error& e)
+    {
+        BOOST_CHECK_EQUAL(e.hr(), E_UNEXPECTED);
+    }
+
+    BOOST_CHECK_LE(record->starts.size(), 3U);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
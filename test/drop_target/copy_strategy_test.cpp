@@ -0,0 +1,303 @@
+/**
+    @file
+
+    Tests for deciding how each file of a drop gets copied.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "swish/drop_target/CopyStrategy.hpp"  // Test subject
+
+#include "swish/drop_target/ConcurrentPlan.hpp" // OperationSink
+#include "swish/drop_target/CopyFileOperation.hpp"
+#include "swish/drop_target/CreateDirectoryOperation.hpp"
+#include "swish/drop_target/Operation.hpp"
+#include "swish/drop_target/RootedSource.hpp"
+#include "swish/drop_target/SftpDestination.hpp"
+#include "swish/drop_target/TarUploadOperation.hpp"
+
+#include "test/common_boost/SwishPidlFixture.hpp"
+
+#include <winapi/shell/pidl.hpp> // apidl_t
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/format.hpp> // wformat
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef> // size_t
+#include <string>
+
+using swish::drop_target::CopyFileOperation;
+using swish::drop_target::CopyStrategy;
+using swish::drop_target::CreateDirectoryOperation;
+using swish::drop_target::Operation;
+using swish::drop_target::OperationSink;
+using swish::drop_target::RootedSource;
+using swish::drop_target::SftpDestination;
+using swish::drop_target::TarUploadOperation;
+
+using test::SwishPidlFixture;
+
+using winapi::shell::pidl::apidl_t;
+
+using boost::ptr_vector;
+using boost::uintmax_t;
+using boost::wformat;
+
+using std::size_t;
+using std::wstring;
+
+namespace {
+
+    /**
+     * Keeps the operations the strategy passes on, in order.
+     */
+    class RecordingSink : public OperationSink
+    {
+    public:
+
+        virtual void add_stage(const Operation& entry)
+        {
+            stages.push_back(entry.clone());
+        }
+
+        bool is_batch(size_t stage) const
+        {
+            return dynamic_cast<const TarUploadOperation*>(
+                &stages.at(stage)) != NULL;
+        }
+
+        bool is_single_copy(size_t stage) const
+        {
+            return dynamic_cast<const CopyFileOperation*>(
+                &stages.at(stage)) != NULL;
+        }
+
+        size_t batch_size(size_t stage) const
+        {
+            return dynamic_cast<const TarUploadOperation&>(
+                stages.at(stage)).file_count();
+        }
+
+        ptr_vector<Operation> stages;
+    };
+
+    /**
+     * The strategy never looks at the files themselves, so dummy remote
+     * items stand in for the local sources.
+     */
+    class CopyStrategyFixture : public SwishPidlFixture
+    {
+    public:
+
+        CopyStrategyFixture() : m_root(create_dummy_root_pidl()), m_count(0)
+        {}
+
+        apidl_t root()
+        {
+            return m_root;
+        }
+
+        void add_file(CopyStrategy& strategy, uintmax_t size)
+        {
+            wstring name = str(wformat(L"file%d") % m_count++);
+
+            strategy.add_file(
+                RootedSource(m_root, create_dummy_remote_itemid(name, false)),
+                SftpDestination(m_root, name), size);
+        }
+
+        void add_files(CopyStrategy& strategy, size_t count, uintmax_t size)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                add_file(strategy, size);
+            }
+        }
+
+    private:
+        apidl_t m_root;
+        size_t m_count;
+    };
+
+    const uintmax_t SMALL = CopyStrategy::SMALL_FILE_SIZE;
+    const uintmax_t LARGE = CopyStrategy::SMALL_FILE_SIZE + 1;
+}
+
+BOOST_FIXTURE_TEST_SUITE(copy_strategy_tests, CopyStrategyFixture)
+
+/**
+ * Enough small files go to the server as one batch.
+ */
+BOOST_AUTO_TEST_CASE( small_files_batched )
+{
+    RecordingSink sink;
+    CopyStrategy strategy(sink, root());
+
+    add_files(strategy, CopyStrategy::MIN_BATCH_FILES, 1);
+    BOOST_CHECK(sink.stages.empty());
+
+    strategy.flush();
+
+    BOOST_REQUIRE_EQUAL(sink.stages.size(), 1U);
+    BOOST_CHECK(sink.is_batch(0));
+    BOOST_CHECK_EQUAL(sink.batch_size(0), CopyStrategy::MIN_BATCH_FILES);
+}
+
+/**
+ * A file exactly the small-file size still counts as small.
+ */
+BOOST_AUTO_TEST_CASE( small_file_threshold_inclusive )
+{
+    RecordingSink sink;
+    CopyStrategy strategy(sink, root());
+
+    add_files(strategy, CopyStrategy::MIN_BATCH_FILES, SMALL);
+    strategy.flush();
+
+    BOOST_REQUIRE_EQUAL(sink.stages.size(), 1U);
+    BOOST_CHECK(sink.is_batch(0));
+}
+
+/**
+ * Too few small files aren't worth starting tar for.
+ */
+BOOST_AUTO_TEST_CASE( too_few_small_files_copied_individually )
+{
+    RecordingSink sink;
+    CopyStrategy strategy(sink, root());
+
+    add_files(strategy, CopyStrategy::MIN_BATCH_FILES - 1, 1);
+    strategy.flush();
+
+    BOOST_REQUIRE_EQUAL(
+        sink.stages.size(), CopyStrategy::MIN_BATCH_FILES - 1);
+    for (size_t i = 0; i < sink.stages.size(); ++i)
+    {
+        BOOST_CHECK(sink.is_single_copy(i));
+    }
+}
+
+/**
+ * Large files are copied as soon as they are found, without disturbing
+ * the small files held back.
+ */
+BOOST_AUTO_TEST_CASE( large_file_copied_immediately )
+{
+    RecordingSink sink;
+    CopyStrategy strategy(sink, root());
+
+    add_files(strategy, CopyStrategy::MIN_BATCH_FILES / 2, 1);
+    add_file(strategy, LARGE);
+
+    BOOST_REQUIRE_EQUAL(sink.stages.size(), 1U);
+    BOOST_CHECK(sink.is_single_copy(0));
+
+    add_files(strategy, CopyStrategy::MIN_BATCH_FILES / 2, 1);
+    strategy.flush();
+
+    BOOST_REQUIRE_EQUAL(sink.stages.size(), 2U);
+    BOOST_CHECK(sink.is_batch(1));
+    BOOST_CHECK_EQUAL(sink.batch_size(1), CopyStrategy::MIN_BATCH_FILES);
+}
+
+/**
+ * A batch is passed on as soon as it holds as many files as allowed.
+ */
+BOOST_AUTO_TEST_CASE( batch_split_at_file_limit )
+{
+    RecordingSink sink;
+    CopyStrategy strategy(sink, root());
+
+    add_files(strategy, CopyStrategy::MAX_BATCH_FILES, 1);
+
+    BOOST_REQUIRE_EQUAL(sink.stages.size(), 1U);
+    BOOST_CHECK(sink.is_batch(0));
+    BOOST_CHECK_EQUAL(sink.batch_size(0), CopyStrategy::MAX_BATCH_FILES);
+
+    add_files(strategy, CopyStrategy::MIN_BATCH_FILES, 1);
+    strategy.flush();
+
+    BOOST_REQUIRE_EQUAL(sink.stages.size(), 2U);
+    BOOST_CHECK(sink.is_batch(1));
+    BOOST_CHECK_EQUAL(sink.batch_size(1), CopyStrategy::MIN_BATCH_FILES);
+}
+
+/**
+ * A batch is passed on as soon as it holds as many bytes as allowed.
+ */
+BOOST_AUTO_TEST_CASE( batch_split_at_byte_limit )
+{
+    size_t files_to_fill = static_cast<size_t>(
+        CopyStrategy::MAX_BATCH_BYTES / SMALL);
+    BOOST_REQUIRE_GE(files_to_fill, CopyStrategy::MIN_BATCH_FILES);
+    BOOST_REQUIRE_LT(files_to_fill, CopyStrategy::MAX_BATCH_FILES);
+
+    RecordingSink sink;
+    CopyStrategy strategy(sink, root());
+
+    add_files(strategy, files_to_fill - 1, SMALL);
+    BOOST_CHECK(sink.stages.empty());
+
+    add_file(strategy, SMALL);
+
+    BOOST_REQUIRE_EQUAL(sink.stages.size(), 1U);
+    BOOST_CHECK(sink.is_batch(0));
+    BOOST_CHECK_EQUAL(sink.batch_size(0), files_to_fill);
+}
+
+/**
+ * Flushing with nothing held back passes nothing on.
+ */
+BOOST_AUTO_TEST_CASE( flush_empty )
+{
+    RecordingSink sink;
+    CopyStrategy strategy(sink, root());
+
+    strategy.flush();
+    BOOST_CHECK(sink.stages.empty());
+}
+
+/**
+ * Directories are passed on at once so files in them have somewhere to go.
+ */
+BOOST_AUTO_TEST_CASE( directory_passed_on_before_held_files )
+{
+    RecordingSink sink;
+    CopyStrategy strategy(sink, root());
+
+    add_files(strategy, CopyStrategy::MIN_BATCH_FILES, 1);
+    strategy.add_directory(
+        CreateDirectoryOperation(
+            RootedSource(root(), create_dummy_remote_itemid(L"dir", true)),
+            SftpDestination(root(), L"dir")));
+
+    BOOST_REQUIRE_EQUAL(sink.stages.size(), 1U);
+    BOOST_CHECK(!sink.is_batch(0) && !sink.is_single_copy(0));
+
+    strategy.flush();
+
+    BOOST_REQUIRE_EQUAL(sink.stages.size(), 2U);
+    BOOST_CHECK(sink.is_batch(1));
+}
+
+BOOST_AUTO_TEST_SUITE_END();
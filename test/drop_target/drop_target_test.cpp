@@ -28,10 +28,12 @@
 #include "swish/drop_target/DropTarget.hpp"  // Test subject
 #include "swish/shell_folder/shell.hpp"  // shell helper functions
 
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
 #include "test/common_boost/data_object_utils.hpp"  // DataObjects on zip
 #include "test/common_boost/helpers.hpp" // BOOST_REQUIRE_OK
 #include "test/common_boost/PidlFixture.hpp"  // PidlFixture
 
+#include <boost/date_time/posix_time/posix_time.hpp> // microsec_clock
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/make_shared.hpp>
@@ -61,9 +63,13 @@ using boost::filesystem::wpath;
 using boost::filesystem::ofstream;
 using boost::filesystem::ifstream;
 using boost::make_shared;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
 using boost::shared_ptr;
 using boost::test_tools::predicate_result;
 
+using std::size_t;
 using std::string;
 using std::wstring;
 using std::vector;
@@ -157,6 +163,7 @@ namespace { // private
     {
     public:
         bool user_cancelled() { return false; }
+        bool user_paused() { return false; }
         void line(DWORD, const wstring&) {}
         void line_path(DWORD, const wstring&) {}
         void update(ULONGLONG, ULONGLONG) {}
@@ -532,6 +539,60 @@ BOOST_AUTO_TEST_CASE( copy_overwrite_larger )
     BOOST_REQUIRE(file_contents_correct(obstruction));
 }
 
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+/**
+ * Copy a large number of small files, reporting how many are copied a second.
+ *
+ * Small files are dominated by per-file overhead rather than data transfer
+ * so this is what the concurrent plan is meant to speed up.
+ */
+BOOST_AUTO_TEST_CASE( copy_many_small_files_rate )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    const size_t file_count = 100;
+
+    vector<wpath> locals;
+    for (size_t i = 0; i < file_count; ++i)
+    {
+        locals.push_back(NewFileInSandbox());
+    }
+
+    com_ptr<IDataObject> spdo = create_multifile_data_object(
+        locals.begin(), locals.end());
+
+    wpath destination = Sandbox() / L"copy-destination";
+    create_directory(destination);
+
+    shared_ptr<CopyCallbackStub> cb(new CopyCallbackStub);
+
+    ptime start = microsec_clock::universal_time();
+
+    copy_data_to_provider(
+        spdo, Provider(),
+        absolute_directory_pidl(destination), cb);
+
+    time_duration elapsed = microsec_clock::universal_time() - start;
+
+    BOOST_TEST_MESSAGE(
+        "Copied " << file_count << " files in " << elapsed << " ("
+        << (file_count * 1000.0) / (std::max)(
+            elapsed.total_milliseconds(), time_duration::tick_type(1))
+        << " files/sec)");
+
+    vector<wpath>::const_iterator it;
+    for (it = locals.begin(); it != locals.end(); ++it)
+    {
+        wpath expected = destination / (*it).filename();
+        BOOST_REQUIRE(exists(expected));
+        BOOST_REQUIRE(file_contents_correct(expected));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
 BOOST_AUTO_TEST_SUITE_END()
 #pragma endregion
 
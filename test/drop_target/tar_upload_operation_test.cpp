@@ -0,0 +1,361 @@
+/**
+    @file
+
+    Tests for uploading batches of small files as a tar stream.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include "swish/drop_target/TarUploadOperation.hpp"  // Test subject
+
+#include "swish/block_transfer.hpp" // byte_sink, istream_source, ostream_sink
+#include "swish/drop_target/Operation.hpp" // OperationCallback
+#include "swish/drop_target/RootedSource.hpp"
+#include "swish/tar.hpp" // tar_reader
+
+#include "test/common_boost/fixtures.hpp" // ComFixture, SandboxFixture
+#include "test/common_boost/helpers.hpp" // wchar_t ostream
+#include "test/common_boost/MockProvider.hpp"
+#include "test/common_boost/SwishPidlFixture.hpp"
+
+#include <winapi/shell/pidl.hpp> // apidl_t
+#include <winapi/shell/shell.hpp> // pidl_from_parsing_name
+
+#include <boost/filesystem/fstream.hpp> // ofstream
+#include <boost/filesystem/operations.hpp> // file_size
+#include <boost/filesystem/path.hpp> // wpath
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm> // find
+#include <ios> // openmode
+#include <set>
+#include <sstream> // istringstream, ostringstream
+#include <string>
+#include <vector>
+
+#include <Shlwapi.h> // SHCreateMemStream
+
+using swish::block_transfer::byte_sink;
+using swish::block_transfer::istream_source;
+using swish::block_transfer::ostream_sink;
+using swish::drop_target::OperationCallback;
+using swish::drop_target::RootedSource;
+using swish::drop_target::TarUploadOperation;
+using swish::provider::sftp_provider;
+using swish::provider::sftp_provider_path;
+using swish::tar::tar_entry;
+using swish::tar::tar_reader;
+
+using test::ComFixture;
+using test::MockProvider;
+using test::SandboxFixture;
+using test::SwishPidlFixture;
+
+using winapi::shell::pidl::apidl_t;
+using winapi::shell::pidl_from_parsing_name;
+
+using comet::com_ptr;
+
+using boost::filesystem::file_size;
+using boost::filesystem::ofstream;
+using boost::filesystem::wpath;
+using boost::function;
+using boost::make_shared;
+using boost::shared_ptr;
+using boost::uintmax_t;
+
+using std::istringstream;
+using std::ostringstream;
+using std::set;
+using std::string;
+using std::vector;
+using std::wstring;
+
+namespace {
+
+    /**
+     * Mock server that records what is uploaded to it.
+     *
+     * Unlike the plain mock, it can create files and, optionally, run tar.
+     */
+    class UploadRecordingProvider : public MockProvider
+    {
+    public:
+
+        explicit UploadRecordingProvider(bool has_tar)
+            : m_has_tar(has_tar), m_extract_count(0) {}
+
+        virtual com_ptr<IStream> get_file(
+            wstring file_path, std::ios_base::openmode mode)
+        {
+            if (!(mode & std::ios_base::out))
+                return MockProvider::get_file(file_path, mode);
+
+            written.push_back(file_path);
+            return ::SHCreateMemStream(NULL, 0);
+        }
+
+        virtual bool extract_archive(
+            const sftp_provider_path& directory,
+            function<void (byte_sink&)> write_archive)
+        {
+            ++m_extract_count;
+            if (!m_has_tar)
+                return false;
+
+            extracted_into = directory;
+
+            ostringstream stream;
+            ostream_sink sink(stream);
+            write_archive(sink);
+            archive = stream.str();
+
+            return true;
+        }
+
+        /**
+         * Names of the files in the last archive, in order.
+         */
+        vector<string> archived_names() const
+        {
+            istringstream stream(archive);
+            istream_source source(stream);
+            tar_reader reader(source);
+
+            vector<string> names;
+            tar_entry entry;
+            while (reader.next(entry))
+            {
+                names.push_back(entry.name);
+            }
+
+            return names;
+        }
+
+        int extract_count() const
+        {
+            return m_extract_count;
+        }
+
+        /// Remote paths of the files opened for writing over SFTP
+        vector<wstring> written;
+
+        sftp_provider_path extracted_into;
+        string archive;
+
+    private:
+        bool m_has_tar;
+        int m_extract_count;
+    };
+
+    /**
+     * Answers every overwrite question with yes, remembering the question.
+     */
+    class CallbackStub : public OperationCallback
+    {
+    public:
+
+        virtual void check_if_user_cancelled() const {}
+
+        virtual bool request_overwrite_permission(const wpath& target) const
+        {
+            overwrite_requests.insert(target);
+            return true;
+        }
+
+        virtual void update_progress(uintmax_t, uintmax_t) {}
+
+        mutable set<wpath> overwrite_requests;
+    };
+
+    /**
+     * Local files uploaded to the mock server's /tmp/swish.
+     */
+    class TarUploadFixture :
+        public ComFixture, public SandboxFixture, public SwishPidlFixture
+    {
+    public:
+
+        TarUploadFixture() : m_remote_root(create_dummy_root_pidl()) {}
+
+        /**
+         * Add a new local file, to be uploaded under the given name.
+         */
+        void add_file(TarUploadOperation& operation, const wstring& name)
+        {
+            wpath local = NewFileInSandbox(name);
+            {
+                ofstream stream(local);
+                stream << "Lorem ipsum dolor sit amet.";
+            }
+
+            apidl_t pidl = pidl_from_parsing_name(local.file_string());
+            operation.add_file(
+                RootedSource(pidl.parent(), pidl.last_item()), name,
+                file_size(local));
+        }
+
+        TarUploadOperation new_operation()
+        {
+            return TarUploadOperation(m_remote_root);
+        }
+
+    private:
+        apidl_t m_remote_root;
+    };
+
+    bool contains(const vector<wstring>& paths, const wstring& path)
+    {
+        return std::find(paths.begin(), paths.end(), path) != paths.end();
+    }
+
+    bool contains(const vector<string>& names, const string& name)
+    {
+        return std::find(names.begin(), names.end(), name) != names.end();
+    }
+}
+
+BOOST_FIXTURE_TEST_SUITE(tar_upload_tests, TarUploadFixture)
+
+/**
+ * New files travel to the server in one archive, not over SFTP.
+ */
+BOOST_AUTO_TEST_CASE( new_files_archived )
+{
+    TarUploadOperation operation = new_operation();
+    add_file(operation, L"one.txt");
+    add_file(operation, L"two.txt");
+    add_file(operation, L"three.txt");
+
+    shared_ptr<UploadRecordingProvider> provider =
+        make_shared<UploadRecordingProvider>(true);
+    CallbackStub callback;
+    operation(callback, provider);
+
+    BOOST_CHECK_EQUAL(provider->extract_count(), 1);
+    BOOST_CHECK_EQUAL(provider->extracted_into.string(), L"/tmp/swish");
+
+    vector<string> names = provider->archived_names();
+    BOOST_REQUIRE_EQUAL(names.size(), 3U);
+    BOOST_CHECK(contains(names, "one.txt"));
+    BOOST_CHECK(contains(names, "two.txt"));
+    BOOST_CHECK(contains(names, "three.txt"));
+
+    BOOST_CHECK(provider->written.empty());
+    BOOST_CHECK(callback.overwrite_requests.empty());
+}
+
+/**
+ * A server without tar gets every file copied over SFTP instead.
+ */
+BOOST_AUTO_TEST_CASE( falls_back_without_tar )
+{
+    TarUploadOperation operation = new_operation();
+    add_file(operation, L"one.txt");
+    add_file(operation, L"two.txt");
+    add_file(operation, L"three.txt");
+
+    shared_ptr<UploadRecordingProvider> provider =
+        make_shared<UploadRecordingProvider>(false);
+    CallbackStub callback;
+    operation(callback, provider);
+
+    BOOST_CHECK_EQUAL(provider->extract_count(), 1);
+    BOOST_CHECK(provider->archive.empty());
+
+    BOOST_REQUIRE_EQUAL(provider->written.size(), 3U);
+    BOOST_CHECK(contains(provider->written, L"/tmp/swish/one.txt"));
+    BOOST_CHECK(contains(provider->written, L"/tmp/swish/two.txt"));
+    BOOST_CHECK(contains(provider->written, L"/tmp/swish/three.txt"));
+}
+
+/**
+ * Files already on the server stay out of the archive, so tar can't
+ * replace them, and are copied over SFTP after asking the user.
+ */
+BOOST_AUTO_TEST_CASE( existing_files_copied_individually )
+{
+    TarUploadOperation operation = new_operation();
+    add_file(operation, L"one.txt");
+    add_file(operation, L"testswishfile"); // In the mock listing
+    add_file(operation, L"two.txt");
+
+    shared_ptr<UploadRecordingProvider> provider =
+        make_shared<UploadRecordingProvider>(true);
+    CallbackStub callback;
+    operation(callback, provider);
+
+    vector<string> names = provider->archived_names();
+    BOOST_REQUIRE_EQUAL(names.size(), 2U);
+    BOOST_CHECK(contains(names, "one.txt"));
+    BOOST_CHECK(contains(names, "two.txt"));
+
+    BOOST_REQUIRE_EQUAL(provider->written.size(), 1U);
+    BOOST_CHECK_EQUAL(provider->written[0], L"/tmp/swish/testswishfile");
+
+    BOOST_REQUIRE_EQUAL(callback.overwrite_requests.size(), 1U);
+    BOOST_CHECK_EQUAL(
+        *callback.overwrite_requests.begin(),
+        wpath(L"/tmp/swish/testswishfile"));
+}
+
+/**
+ * If every file is already there, tar isn't started at all, rather than
+ * being sent an empty archive.
+ */
+BOOST_AUTO_TEST_CASE( only_existing_files_skips_tar )
+{
+    TarUploadOperation operation = new_operation();
+    add_file(operation, L"testswishfile");
+    add_file(operation, L"testswishfile.txt");
+
+    shared_ptr<UploadRecordingProvider> provider =
+        make_shared<UploadRecordingProvider>(true);
+    CallbackStub callback;
+    operation(callback, provider);
+
+    BOOST_CHECK_EQUAL(provider->extract_count(), 0);
+    BOOST_CHECK_EQUAL(provider->written.size(), 2U);
+}
+
+/**
+ * Files in a directory that can't be listed might be overwriting
+ * something, so none of them go into the archive.
+ */
+BOOST_AUTO_TEST_CASE( unlistable_directory_treated_as_existing )
+{
+    TarUploadOperation operation = new_operation();
+    add_file(operation, L"one.txt");
+    add_file(operation, L"two.txt");
+
+    shared_ptr<UploadRecordingProvider> provider =
+        make_shared<UploadRecordingProvider>(true);
+    provider->set_listing_behaviour(MockProvider::FailListing);
+    CallbackStub callback;
+    operation(callback, provider);
+
+    BOOST_CHECK_EQUAL(provider->extract_count(), 0);
+    BOOST_CHECK_EQUAL(provider->written.size(), 2U);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
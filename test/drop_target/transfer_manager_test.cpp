@@ -0,0 +1,561 @@
+/**
+    @file
+
+    Tests for the queue of transfers shared by every drop.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+
+#include "swish/drop_target/TransferManager.hpp"  // Test subject
+
+#include <boost/bind.hpp> // bind
+#include <boost/date_time/posix_time/posix_time_types.hpp> // milliseconds
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp> // this_thread
+
+#include <algorithm> // max
+#include <cstddef> // size_t
+#include <map>
+#include <stdexcept> // runtime_error
+#include <string>
+#include <vector>
+
+using swish::drop_target::JobControl;
+using swish::drop_target::TransferManager;
+
+using boost::bind;
+using boost::condition_variable;
+using boost::make_shared;
+using boost::mutex;
+using boost::posix_time::milliseconds;
+using boost::shared_ptr;
+
+using std::map;
+using std::max;
+using std::size_t;
+using std::vector;
+using std::wstring;
+
+namespace {
+
+    /**
+     * Stands in for the servers, recording which transfers ran against
+     * which host and how many at once.
+     */
+    class FakeHosts
+    {
+    public:
+        FakeHosts() : m_running(0), m_most_running(0) {}
+
+        void started(const wstring& host, size_t job)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            m_starts.push_back(job);
+            ++m_running;
+            m_most_running = (max)(m_most_running, m_running);
+            size_t& on_host = m_host_running[host];
+            ++on_host;
+            m_most_on_host[host] = (max)(m_most_on_host[host], on_host);
+        }
+
+        void finished(const wstring& host)
+        {
+            mutex::scoped_lock lock(m_mutex);
+
+            --m_running;
+            --m_host_running[host];
+        }
+
+        vector<size_t> starts() const
+        {
+            mutex::scoped_lock lock(m_mutex);
+            return m_starts;
+        }
+
+        size_t most_running() const
+        {
+            mutex::scoped_lock lock(m_mutex);
+            return m_most_running;
+        }
+
+        size_t most_on_host(const wstring& host) const
+        {
+            mutex::scoped_lock lock(m_mutex);
+            map<wstring, size_t>::const_iterator most =
+                m_most_on_host.find(host);
+            return (most != m_most_on_host.end()) ? most->second : 0;
+        }
+
+    private:
+        mutable mutex m_mutex;
+        vector<size_t> m_starts;
+        size_t m_running;
+        size_t m_most_running;
+        map<wstring, size_t> m_host_running;
+        map<wstring, size_t> m_most_on_host;
+    };
+
+    /**
+     * Holds jobs back until the test lets them go.
+     */
+    class Gate
+    {
+    public:
+        Gate() : m_open(false) {}
+
+        void open()
+        {
+            mutex::scoped_lock lock(m_mutex);
+            m_open = true;
+            m_changed.notify_all();
+        }
+
+        void pass()
+        {
+            mutex::scoped_lock lock(m_mutex);
+            while (!m_open)
+            {
+                m_changed.wait(lock);
+            }
+        }
+
+    private:
+        mutex m_mutex;
+        condition_variable m_changed;
+        bool m_open;
+    };
+
+    /**
+     * What a fake transfer did.
+     */
+    struct Outcome
+    {
+        Outcome() : ran(false), blocks(0), stopped(false), saw_pause(false),
+            saw_cancel(false) {}
+
+        bool ran;
+        size_t blocks;
+        bool stopped;
+        bool saw_pause;
+        bool saw_cancel;
+    };
+
+    /**
+     * Transfer of a number of blocks, checking in between each.
+     */
+    class FakeTransfer
+    {
+    public:
+        FakeTransfer(
+            shared_ptr<FakeHosts> hosts, const wstring& host, size_t index,
+            size_t blocks=5)
+            :
+            m_hosts(hosts), m_host(host), m_index(index), m_blocks(blocks),
+            m_outcome(make_shared<Outcome>()) {}
+
+        FakeTransfer& held_by(shared_ptr<Gate> gate)
+        {
+            m_gate = gate;
+            return *this;
+        }
+
+        shared_ptr<Outcome> outcome() const
+        {
+            return m_outcome;
+        }
+
+        void operator()(JobControl& control) const
+        {
+            m_outcome->ran = true;
+
+            if (!control.checkpoint())
+            {
+                m_outcome->stopped = true;
+                return;
+            }
+
+            m_hosts->started(m_host, m_index);
+
+            if (m_gate)
+                m_gate->pass();
+
+            for (size_t i = 0; i < m_blocks; ++i)
+            {
+                boost::this_thread::sleep(milliseconds(5));
+                ++m_outcome->blocks;
+
+                if (control.paused())
+                    m_outcome->saw_pause = true;
+
+                if (!control.checkpoint())
+                {
+                    m_outcome->saw_cancel = control.cancelled();
+                    m_outcome->stopped = true;
+                    break;
+                }
+            }
+
+            m_hosts->finished(m_host);
+        }
+
+    private:
+        shared_ptr<FakeHosts> m_hosts;
+        wstring m_host;
+        size_t m_index;
+        size_t m_blocks;
+        shared_ptr<Gate> m_gate;
+        shared_ptr<Outcome> m_outcome;
+    };
+
+    void throw_error(JobControl&)
+    {
+        throw std::runtime_error("Transfer failed");
+    }
+
+    /**
+     * Wait, but not forever, for the workers to catch up.
+     */
+    template<typename Predicate>
+    bool eventually(Predicate done)
+    {
+        for (int i = 0; i < 500; ++i)
+        {
+            if (done())
+                return true;
+
+            boost::this_thread::sleep(milliseconds(10));
+        }
+
+        return done();
+    }
+
+    size_t started_count(shared_ptr<FakeHosts> hosts)
+    {
+        return hosts->starts().size();
+    }
+
+    size_t blocks_of(shared_ptr<Outcome> outcome)
+    {
+        return outcome->blocks;
+    }
+
+    TransferManager::JobState state_of(
+        const TransferManager& manager, TransferManager::JobId job)
+    {
+        vector<TransferManager::JobStatus> jobs = manager.jobs();
+        for (size_t i = 0; i < jobs.size(); ++i)
+        {
+            if (jobs[i].id == job)
+                return jobs[i].state;
+        }
+
+        BOOST_FAIL("Job not found");
+        return TransferManager::JOB_QUEUED;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(transfer_manager_tests)
+
+BOOST_AUTO_TEST_CASE( every_job_runs )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    TransferManager manager(3, 2);
+
+    vector<TransferManager::JobId> ids;
+    vector< shared_ptr<Outcome> > outcomes;
+    for (size_t i = 0; i < 10; ++i)
+    {
+        wstring host = (i % 2) ? L"a" : L"b";
+        FakeTransfer transfer(hosts, host, i);
+        outcomes.push_back(transfer.outcome());
+        ids.push_back(manager.submit(host, L"copy", transfer));
+    }
+
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        manager.wait(ids[i]);
+        BOOST_CHECK_EQUAL(outcomes[i]->blocks, 5U);
+        BOOST_CHECK(!outcomes[i]->stopped);
+    }
+
+    BOOST_CHECK(manager.jobs().empty());
+}
+
+BOOST_AUTO_TEST_CASE( limits )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    TransferManager manager(3, 1);
+    manager.set_host_limit(L"b", 2);
+
+    vector<TransferManager::JobId> ids;
+    for (size_t i = 0; i < 12; ++i)
+    {
+        wstring host = (i % 3 == 0) ? L"a" : (i % 3 == 1) ? L"b" : L"c";
+        ids.push_back(
+            manager.submit(host, L"copy", FakeTransfer(hosts, host, i)));
+    }
+
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        manager.wait(ids[i]);
+    }
+
+    BOOST_CHECK_EQUAL(hosts->most_on_host(L"a"), 1U);
+    BOOST_CHECK_LE(hosts->most_on_host(L"b"), 2U);
+    BOOST_CHECK_EQUAL(hosts->most_on_host(L"c"), 1U);
+    BOOST_CHECK_LE(hosts->most_running(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE( other_hosts_not_held_up )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    shared_ptr<Gate> gate = make_shared<Gate>();
+    TransferManager manager(2, 1);
+
+    TransferManager::JobId blocked = manager.submit(
+        L"a", L"copy", FakeTransfer(hosts, L"a", 0).held_by(gate));
+    TransferManager::JobId waiting = manager.submit(
+        L"a", L"copy", FakeTransfer(hosts, L"a", 1));
+    TransferManager::JobId other = manager.submit(
+        L"b", L"copy", FakeTransfer(hosts, L"b", 2));
+
+    // The second job for "a" waits for the first, but "b" goes ahead
+    manager.wait(other);
+    BOOST_CHECK_EQUAL(state_of(manager, waiting), TransferManager::JOB_QUEUED);
+
+    gate->open();
+    manager.wait(blocked);
+    manager.wait(waiting);
+
+    vector<size_t> starts = hosts->starts();
+    BOOST_REQUIRE_EQUAL(starts.size(), 3U);
+    BOOST_CHECK_EQUAL(starts[2], 1U);
+}
+
+BOOST_AUTO_TEST_CASE( queue_order )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    shared_ptr<Gate> gate = make_shared<Gate>();
+    TransferManager manager(1, 1);
+
+    vector<TransferManager::JobId> ids;
+    ids.push_back(
+        manager.submit(
+            L"a", L"copy", FakeTransfer(hosts, L"a", 0).held_by(gate)));
+    for (size_t i = 1; i < 5; ++i)
+    {
+        ids.push_back(
+            manager.submit(L"a", L"copy", FakeTransfer(hosts, L"a", i)));
+    }
+
+    BOOST_REQUIRE(eventually(bind(started_count, hosts) == 1U));
+
+    manager.move_to_front(ids[3]);
+    manager.move_to_back(ids[1]);
+
+    vector<TransferManager::JobStatus> jobs = manager.jobs();
+    BOOST_REQUIRE_EQUAL(jobs.size(), 5U);
+    BOOST_CHECK_EQUAL(jobs[0].id, ids[0]);
+    BOOST_CHECK_EQUAL(jobs[0].state, TransferManager::JOB_RUNNING);
+    BOOST_CHECK_EQUAL(jobs[1].id, ids[3]);
+    BOOST_CHECK_EQUAL(jobs[2].id, ids[2]);
+    BOOST_CHECK_EQUAL(jobs[3].id, ids[4]);
+    BOOST_CHECK_EQUAL(jobs[4].id, ids[1]);
+    BOOST_CHECK_EQUAL(jobs[4].state, TransferManager::JOB_QUEUED);
+
+    gate->open();
+    manager.wait(ids[1]);
+
+    vector<size_t> starts = hosts->starts();
+    BOOST_REQUIRE_EQUAL(starts.size(), 5U);
+    BOOST_CHECK_EQUAL(starts[0], 0U);
+    BOOST_CHECK_EQUAL(starts[1], 3U);
+    BOOST_CHECK_EQUAL(starts[2], 2U);
+    BOOST_CHECK_EQUAL(starts[3], 4U);
+    BOOST_CHECK_EQUAL(starts[4], 1U);
+}
+
+BOOST_AUTO_TEST_CASE( paused_while_queued )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    shared_ptr<Gate> gate = make_shared<Gate>();
+    TransferManager manager(1, 1);
+
+    TransferManager::JobId first = manager.submit(
+        L"a", L"copy", FakeTransfer(hosts, L"a", 0).held_by(gate));
+    TransferManager::JobId paused = manager.submit(
+        L"a", L"copy", FakeTransfer(hosts, L"a", 1));
+    TransferManager::JobId last = manager.submit(
+        L"a", L"copy", FakeTransfer(hosts, L"a", 2));
+
+    manager.pause(paused);
+    BOOST_CHECK_EQUAL(state_of(manager, paused), TransferManager::JOB_PAUSED);
+
+    // Skipped over while paused
+    gate->open();
+    manager.wait(first);
+    manager.wait(last);
+    BOOST_CHECK_EQUAL(started_count(hosts), 2U);
+    BOOST_CHECK_EQUAL(state_of(manager, paused), TransferManager::JOB_PAUSED);
+
+    manager.resume(paused);
+    manager.wait(paused);
+
+    vector<size_t> starts = hosts->starts();
+    BOOST_REQUIRE_EQUAL(starts.size(), 3U);
+    BOOST_CHECK_EQUAL(starts[2], 1U);
+}
+
+BOOST_AUTO_TEST_CASE( paused_while_running )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    TransferManager manager(1, 1);
+
+    FakeTransfer transfer(hosts, L"a", 0, 1000);
+    TransferManager::JobId job = manager.submit(L"a", L"copy", transfer);
+
+    BOOST_REQUIRE(eventually(bind(blocks_of, transfer.outcome()) > 2U));
+    manager.pause(job);
+    BOOST_CHECK_EQUAL(state_of(manager, job), TransferManager::JOB_PAUSED);
+
+    // Stops at the next checkpoint
+    boost::this_thread::sleep(milliseconds(50));
+    size_t blocks = transfer.outcome()->blocks;
+    boost::this_thread::sleep(milliseconds(50));
+    BOOST_CHECK_EQUAL(transfer.outcome()->blocks, blocks);
+    BOOST_CHECK(transfer.outcome()->saw_pause);
+
+    manager.resume(job);
+    BOOST_CHECK(
+        eventually(bind(blocks_of, transfer.outcome()) > blocks + 2));
+
+    manager.cancel(job);
+    manager.wait(job);
+    BOOST_CHECK(transfer.outcome()->stopped);
+}
+
+BOOST_AUTO_TEST_CASE( cancelled_while_queued )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    shared_ptr<Gate> gate = make_shared<Gate>();
+    TransferManager manager(1, 1);
+
+    TransferManager::JobId first = manager.submit(
+        L"a", L"copy", FakeTransfer(hosts, L"a", 0).held_by(gate));
+    FakeTransfer transfer(hosts, L"a", 1);
+    TransferManager::JobId cancelled = manager.submit(
+        L"a", L"copy", transfer);
+
+    manager.cancel(cancelled);
+
+    // It gets to tidy up even though the host is busy
+    manager.wait(cancelled);
+    BOOST_CHECK(transfer.outcome()->ran);
+    BOOST_CHECK(transfer.outcome()->stopped);
+    BOOST_CHECK_EQUAL(transfer.outcome()->blocks, 0U);
+
+    gate->open();
+    manager.wait(first);
+    BOOST_CHECK_EQUAL(started_count(hosts), 1U);
+}
+
+BOOST_AUTO_TEST_CASE( cancelled_while_paused )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    TransferManager manager(1, 1);
+
+    FakeTransfer transfer(hosts, L"a", 0, 1000);
+    TransferManager::JobId job = manager.submit(L"a", L"copy", transfer);
+
+    BOOST_REQUIRE(eventually(bind(blocks_of, transfer.outcome()) > 0U));
+    manager.pause(job);
+    manager.cancel(job);
+
+    manager.wait(job);
+    BOOST_CHECK(transfer.outcome()->saw_cancel);
+    BOOST_CHECK(transfer.outcome()->stopped);
+}
+
+BOOST_AUTO_TEST_CASE( failed_job_doesnt_stop_others )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    TransferManager manager(1, 1);
+
+    manager.submit(L"a", L"copy", throw_error);
+    FakeTransfer transfer(hosts, L"a", 1);
+    TransferManager::JobId job = manager.submit(L"a", L"copy", transfer);
+
+    manager.wait(job);
+    BOOST_CHECK_EQUAL(transfer.outcome()->blocks, 5U);
+}
+
+BOOST_AUTO_TEST_CASE( destruction_cancels_jobs )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    FakeTransfer running(hosts, L"a", 0, 1000);
+    FakeTransfer queued(hosts, L"a", 1);
+
+    {
+        TransferManager manager(1, 1);
+        manager.submit(L"a", L"copy", running);
+        manager.submit(L"a", L"copy", queued);
+
+        BOOST_REQUIRE(eventually(bind(started_count, hosts) == 1U));
+    }
+
+    BOOST_CHECK(running.outcome()->stopped);
+    BOOST_CHECK(queued.outcome()->ran);
+    BOOST_CHECK(queued.outcome()->stopped);
+}
+
+BOOST_AUTO_TEST_CASE( idle_workers_come_back )
+{
+    shared_ptr<FakeHosts> hosts = make_shared<FakeHosts>();
+    TransferManager manager(1, 1, milliseconds(10));
+
+    manager.wait(
+        manager.submit(L"a", L"copy", FakeTransfer(hosts, L"a", 0)));
+
+    // Long enough for the worker to have stopped
+    boost::this_thread::sleep(milliseconds(100));
+
+    FakeTransfer transfer(hosts, L"a", 1);
+    manager.wait(manager.submit(L"a", L"copy", transfer));
+    BOOST_CHECK_EQUAL(transfer.outcome()->blocks, 5U);
+}
+
+BOOST_AUTO_TEST_CASE( bad_limits )
+{
+    BOOST_CHECK_THROW(TransferManager(0, 1), std::invalid_argument);
+    BOOST_CHECK_THROW(TransferManager(1, 0), std::invalid_argument);
+
+    TransferManager manager(1, 1);
+    BOOST_CHECK_THROW(
+        manager.set_host_limit(L"a", 0), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,312 @@
+/**
+    @file
+
+    Tests for the compact directory listing.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "swish/provider/directory_listing.hpp" // Test subject
+
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/lexical_cast.hpp>
+#include <boost/optional/optional.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm> // max, sort
+#include <cstddef> // size_t
+#include <string>
+#include <vector>
+
+using swish::provider::directory_listing;
+using swish::provider::listing_entry;
+using swish::provider::sftp_filesystem_item;
+using swish::provider::sftp_filesystem_item_interface;
+
+using boost::iterator_range;
+using boost::lexical_cast;
+using boost::optional;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
+
+using std::size_t;
+using std::vector;
+using std::wstring;
+
+namespace {
+
+    typedef BOOST_SCOPED_ENUM(sftp_filesystem_item_interface::type) item_type;
+
+    const item_type file_type = sftp_filesystem_item_interface::type::file;
+    const item_type folder_type =
+        sftp_filesystem_item_interface::type::directory;
+    const item_type link_type = sftp_filesystem_item_interface::type::link;
+
+    iterator_range<const wchar_t*> view(const wstring& text)
+    {
+        return iterator_range<const wchar_t*>(
+            text.data(), text.data() + text.size());
+    }
+
+    listing_entry entry(
+        const wstring& filename, item_type type,
+        const wstring* owner=NULL, const wstring* group=NULL)
+    {
+        listing_entry e;
+        e.type = type;
+        e.filename = view(filename);
+        e.permissions = 0755;
+        e.uid = 1000;
+        e.gid = 100;
+        e.size_in_bytes = filename.size();
+        if (owner)
+            e.owner = view(*owner);
+        if (group)
+            e.group = view(*group);
+        return e;
+    }
+
+    double elapsed_seconds(ptime start)
+    {
+        time_duration elapsed = microsec_clock::universal_time() - start;
+        return (std::max)(elapsed.total_microseconds() / 1e6, 1e-6);
+    }
+
+    class name_order
+    {
+    public:
+        explicit name_order(const directory_listing& listing)
+            : m_listing(listing) {}
+
+        bool operator()(size_t left, size_t right) const
+        {
+            directory_listing::string_view l = m_listing.filename_view(left);
+            directory_listing::string_view r = m_listing.filename_view(right);
+            return std::lexicographical_compare(
+                l.begin(), l.end(), r.begin(), r.end());
+        }
+
+    private:
+        const directory_listing& m_listing;
+    };
+}
+
+BOOST_AUTO_TEST_SUITE(directory_listing_tests)
+
+BOOST_AUTO_TEST_CASE( empty_listing )
+{
+    directory_listing listing;
+
+    BOOST_CHECK(listing.empty());
+    BOOST_CHECK_EQUAL(listing.size(), 0U);
+    BOOST_CHECK(listing.begin() == listing.end());
+}
+
+BOOST_AUTO_TEST_CASE( entries )
+{
+    wstring owner = L"swish";
+    wstring group = L"users";
+
+    directory_listing listing;
+    listing.push_back(entry(L"file.txt", file_type, &owner, &group));
+    listing.push_back(entry(L"folder", folder_type, &owner));
+    listing.push_back(entry(L".hidden", link_type));
+
+    BOOST_REQUIRE_EQUAL(listing.size(), 3U);
+
+    BOOST_CHECK(listing[0].filename() == L"file.txt");
+    BOOST_CHECK(listing[0].type() == file_type);
+    BOOST_CHECK_EQUAL(listing[0].permissions(), 0755U);
+    BOOST_CHECK_EQUAL(listing[0].uid(), 1000U);
+    BOOST_CHECK_EQUAL(listing[0].gid(), 100U);
+    BOOST_CHECK_EQUAL(listing[0].size_in_bytes(), 8U);
+    BOOST_CHECK(listing[0].owner() == owner);
+    BOOST_CHECK(listing[0].group() == group);
+
+    BOOST_CHECK(listing[1].type() == folder_type);
+    BOOST_CHECK(listing[1].owner() == owner);
+    BOOST_CHECK(!listing[1].group());
+
+    BOOST_CHECK(listing.type(2) == link_type);
+    BOOST_CHECK(!listing[2].owner());
+    BOOST_CHECK(!listing[2].group());
+
+    directory_listing::string_view name = listing.filename_view(2);
+    BOOST_CHECK(wstring(name.begin(), name.end()) == L".hidden");
+
+    vector<wstring> names;
+    for (directory_listing::const_iterator it = listing.begin();
+        it != listing.end(); ++it)
+    {
+        names.push_back(it->filename().string());
+    }
+
+    BOOST_REQUIRE_EQUAL(names.size(), 3U);
+    BOOST_CHECK(names[0] == L"file.txt");
+    BOOST_CHECK(names[1] == L"folder");
+    BOOST_CHECK(names[2] == L".hidden");
+
+    BOOST_CHECK_EQUAL(listing.end() - listing.begin(), 3);
+    BOOST_CHECK((listing.begin() + 1)->filename() == L"folder");
+}
+
+/**
+ * Listings can be built from ordinary items too.
+ */
+BOOST_AUTO_TEST_CASE( from_items )
+{
+    directory_listing source;
+    source.push_back(entry(L"a", file_type));
+    source.push_back(entry(L"b", folder_type));
+
+    directory_listing copy(source.begin(), source.end());
+
+    BOOST_REQUIRE_EQUAL(copy.size(), 2U);
+    BOOST_CHECK(copy[0].filename() == L"a");
+    BOOST_CHECK(copy[1].type() == folder_type);
+}
+
+BOOST_AUTO_TEST_CASE( item_outlives_listing )
+{
+    optional<sftp_filesystem_item> item;
+
+    {
+        directory_listing listing;
+        listing.push_back(entry(L"survivor", file_type));
+        item = listing[0];
+    }
+
+    BOOST_CHECK(item->filename() == L"survivor");
+}
+
+BOOST_AUTO_TEST_CASE( item_unaffected_by_later_entries )
+{
+    directory_listing listing;
+    listing.push_back(entry(L"first", file_type));
+
+    sftp_filesystem_item first = listing[0];
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        listing.push_back(entry(L"more", file_type));
+    }
+
+    BOOST_CHECK(first.filename() == L"first");
+    BOOST_CHECK_EQUAL(listing.size(), 1001U);
+}
+
+BOOST_AUTO_TEST_CASE( copies_are_independent )
+{
+    directory_listing original;
+    original.push_back(entry(L"shared", file_type));
+
+    directory_listing copy = original;
+    copy.push_back(entry(L"copy only", file_type));
+
+    BOOST_CHECK_EQUAL(original.size(), 1U);
+    BOOST_CHECK_EQUAL(copy.size(), 2U);
+    BOOST_CHECK(copy[0].filename() == L"shared");
+}
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+/**
+ * Build a large listing and time the scans a folder view makes over it.
+ */
+BOOST_AUTO_TEST_CASE( large_listing )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    const size_t entry_count = 100000;
+
+    wstring owners[] = { L"root", L"swish", L"www-data" };
+    wstring group = L"users";
+
+    ptime start = microsec_clock::universal_time();
+
+    directory_listing listing;
+    listing.reserve(entry_count);
+    for (size_t i = 0; i < entry_count; ++i)
+    {
+        wstring name = ((i % 10 == 0) ? L"." : L"") +
+            lexical_cast<wstring>((i * 7919) % entry_count) + L".dat";
+        listing.push_back(
+            entry(
+                name, (i % 4 == 0) ? folder_type : file_type,
+                &owners[i % 3], &group));
+    }
+
+    double build_seconds = elapsed_seconds(start);
+
+    BOOST_REQUIRE_EQUAL(listing.size(), entry_count);
+
+    start = microsec_clock::universal_time();
+
+    size_t visible_folders = 0;
+    for (size_t i = 0; i < listing.size(); ++i)
+    {
+        directory_listing::string_view name = listing.filename_view(i);
+        if (name.front() != L'.' && listing.type(i) == folder_type)
+        {
+            ++visible_folders;
+        }
+    }
+
+    double filter_seconds = elapsed_seconds(start);
+
+    start = microsec_clock::universal_time();
+
+    vector<size_t> order(listing.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), name_order(listing));
+
+    double sort_seconds = elapsed_seconds(start);
+
+    BOOST_CHECK_EQUAL(visible_folders, 20000U);
+    BOOST_CHECK(listing[order.front()].filename() == L".0.dat");
+
+    BOOST_TEST_MESSAGE(
+        "Listing of " << entry_count << " entries uses " <<
+        listing.memory_used() / entry_count << " bytes per entry");
+    BOOST_TEST_MESSAGE(
+        "Built at " << static_cast<unsigned long>(entry_count / build_seconds)
+        << " entries/s, filtered at " <<
+        static_cast<unsigned long>(entry_count / filter_seconds) <<
+        " entries/s, sorted by name at " <<
+        static_cast<unsigned long>(entry_count / sort_seconds) <<
+        " entries/s");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,246 @@
+/**
+    @file
+
+    Tests for long entry parsing and the account name cache.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    If you modify this Program, or any covered work, by linking or
+    combining it with the OpenSSL project's OpenSSL library (or a
+    modified version of that library), containing parts covered by the
+    terms of the OpenSSL or SSLeay licenses, the licensors of this
+    Program grant you additional permission to convey the resulting work.
+
+    @endif
+*/
+
+#include "swish/provider/long_entry.hpp" // Test subject
+
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/optional/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm> // max
+#include <cstring> // strlen
+#include <string>
+
+using swish::provider::account_name_cache;
+using swish::provider::long_entry_fields;
+using swish::provider::parse_long_entry;
+
+using boost::iterator_range;
+using boost::optional;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
+using boost::shared_ptr;
+
+using std::string;
+using std::wstring;
+
+namespace {
+
+    iterator_range<const char*> range(const char* text)
+    {
+        return iterator_range<const char*>(text, text + std::strlen(text));
+    }
+
+    string owner_of(const char* long_entry)
+    {
+        optional<long_entry_fields> fields = parse_long_entry(range(long_entry));
+        BOOST_REQUIRE(fields);
+        return string(fields->owner.begin(), fields->owner.end());
+    }
+
+    string group_of(const char* long_entry)
+    {
+        optional<long_entry_fields> fields = parse_long_entry(range(long_entry));
+        BOOST_REQUIRE(fields);
+        return string(fields->group.begin(), fields->group.end());
+    }
+
+    bool parses(const char* long_entry)
+    {
+        return parse_long_entry(range(long_entry));
+    }
+
+    // Long entries as sent by real servers
+    const char* captured_entries[] = {
+        "-rw-r--r--    1 awl03    users        1234 Mar 25 14:29 file.txt",
+        "drwxr-xr-x    2 root     root         4096 Jan  1  2013 bin",
+        "-rwxr-xr-x   1 mjos     staff      348911 Mar 25 14:29 t-filexfer",
+        "lrwxrwxrwx    1 www-data www-data       11 Feb 14 09:00 link -> target",
+        "-rw-------    1 a.very.long.user.name a.very.long.group.name 0 Jul  4 "
+            "12:00 .secret",
+        "drwxrwsr-x+  12 1001     1001         4096 Oct 18 23:59 shared dir"
+    };
+
+    const size_t captured_entry_count =
+        sizeof(captured_entries) / sizeof(captured_entries[0]);
+}
+
+BOOST_AUTO_TEST_SUITE(long_entry_tests)
+
+BOOST_AUTO_TEST_CASE( recommended_format )
+{
+    const char* entry =
+        "-rwxr-xr-x   1 mjos     staff      348911 Mar 25 14:29 t-filexfer";
+    BOOST_CHECK_EQUAL(owner_of(entry), "mjos");
+    BOOST_CHECK_EQUAL(group_of(entry), "staff");
+}
+
+BOOST_AUTO_TEST_CASE( captured_entries_parse )
+{
+    for (size_t i = 0; i < captured_entry_count; ++i)
+    {
+        BOOST_CHECK_MESSAGE(
+            parses(captured_entries[i]), "Failed: " << captured_entries[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( long_names )
+{
+    const char* entry = captured_entries[4];
+    BOOST_CHECK_EQUAL(owner_of(entry), "a.very.long.user.name");
+    BOOST_CHECK_EQUAL(group_of(entry), "a.very.long.group.name");
+}
+
+BOOST_AUTO_TEST_CASE( utf8_names )
+{
+    const char* entry =
+        "-rw-r--r--    1 \xe5\xbc\xa0\xe4\xb8\x89  \xc3\xa9quipe  1 Mar 25 14:29 f";
+    BOOST_CHECK_EQUAL(owner_of(entry), "\xe5\xbc\xa0\xe4\xb8\x89");
+    BOOST_CHECK_EQUAL(group_of(entry), "\xc3\xa9quipe");
+}
+
+BOOST_AUTO_TEST_CASE( numeric_names )
+{
+    BOOST_CHECK_EQUAL(owner_of(captured_entries[5]), "1001");
+    BOOST_CHECK_EQUAL(group_of(captured_entries[5]), "1001");
+}
+
+BOOST_AUTO_TEST_CASE( tabs_separate_fields )
+{
+    BOOST_CHECK_EQUAL(group_of("-rw-r--r--\t1\tbob\tstaff\t0 f"), "staff");
+}
+
+BOOST_AUTO_TEST_CASE( unrecognised_formats )
+{
+    BOOST_CHECK(!parses(""));
+    BOOST_CHECK(!parses(" -rw-r--r-- 1 bob staff 0 f"));
+    BOOST_CHECK(!parses("-rw-r--r 1 bob staff 0 f"));
+    BOOST_CHECK(!parses("-rw-r--r-- x bob staff 0 f"));
+    BOOST_CHECK(!parses("-rw-r--r-- 1x bob staff 0 f"));
+    BOOST_CHECK(!parses("-rw-r--r-- 1 bob"));
+    BOOST_CHECK(!parses("-rw-r--r-- 1 bob staff"));
+    BOOST_CHECK(!parses("-rw-r--r-- 1 bob staff "));
+    BOOST_CHECK(!parses("file.txt"));
+}
+
+BOOST_AUTO_TEST_CASE( trailing_whitespace_enough )
+{
+    BOOST_CHECK(parses("-rw-r--r-- 1 bob staff  "));
+}
+
+BOOST_AUTO_TEST_CASE( names_interned )
+{
+    account_name_cache names;
+
+    shared_ptr<const wstring> first = names.user_name(1000, range("bob"));
+    shared_ptr<const wstring> second = names.user_name(1000, range("bob"));
+
+    BOOST_CHECK(*first == L"bob");
+    BOOST_CHECK(first == second);
+}
+
+BOOST_AUTO_TEST_CASE( users_and_groups_separate )
+{
+    account_name_cache names;
+
+    shared_ptr<const wstring> user = names.user_name(100, range("bob"));
+    shared_ptr<const wstring> group = names.group_name(100, range("staff"));
+
+    BOOST_CHECK(*user == L"bob");
+    BOOST_CHECK(*group == L"staff");
+}
+
+BOOST_AUTO_TEST_CASE( renamed_account )
+{
+    account_name_cache names;
+
+    shared_ptr<const wstring> before = names.user_name(1000, range("bob"));
+    shared_ptr<const wstring> after = names.user_name(1000, range("robert"));
+
+    BOOST_CHECK(*before == L"bob");
+    BOOST_CHECK(*after == L"robert");
+}
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+/**
+ * Parse a million captured long entries and resolve their names.
+ */
+BOOST_AUTO_TEST_CASE( million_entries )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    const size_t entry_count = 1000000;
+
+    iterator_range<const char*> entries[captured_entry_count];
+    for (size_t i = 0; i < captured_entry_count; ++i)
+    {
+        entries[i] = range(captured_entries[i]);
+    }
+
+    account_name_cache names;
+
+    size_t parsed_count = 0;
+    ptime start = microsec_clock::universal_time();
+
+    for (size_t i = 0; i < entry_count; ++i)
+    {
+        optional<long_entry_fields> fields =
+            parse_long_entry(entries[i % captured_entry_count]);
+        if (fields)
+        {
+            unsigned long id = static_cast<unsigned long>(
+                i % captured_entry_count);
+            names.user_name(id, fields->owner);
+            names.group_name(id, fields->group);
+            ++parsed_count;
+        }
+    }
+
+    time_duration elapsed = microsec_clock::universal_time() - start;
+    double seconds = (std::max)(elapsed.total_microseconds() / 1e6, 1e-6);
+
+    BOOST_TEST_MESSAGE(
+        "Parsed " << parsed_count << " long entries in " <<
+        elapsed.total_milliseconds() << "ms (" <<
+        static_cast<unsigned long>(parsed_count / seconds) << " entries/s)");
+
+    BOOST_CHECK_EQUAL(parsed_count, entry_count);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE_END()
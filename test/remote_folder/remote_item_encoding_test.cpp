@@ -0,0 +1,395 @@
+/**
+    @file
+
+    Exercise remote item ID encoding.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    @endif
+*/
+
+#include <swish/remote_folder/remote_item_encoding.hpp> // test subject
+
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
+#include <boost/cstdint.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm> // max
+#include <cstddef> // size_t
+#include <cstring> // memcpy, strlen
+#include <string>
+#include <vector>
+
+using swish::remote_folder::encode_remote_item;
+using swish::remote_folder::encoded_remote_item;
+using swish::remote_folder::encoded_remote_item_size;
+using swish::remote_folder::encoded_text;
+using swish::remote_folder::MAX_ENCODED_REMOTE_ITEM_SIZE;
+using swish::remote_folder::remote_item_properties;
+
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
+using boost::uint16_t;
+using boost::uint32_t;
+using boost::uint64_t;
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace {
+
+    typedef vector<uint16_t> utf16_text;
+
+    utf16_text utf16(const string& ascii)
+    {
+        return utf16_text(ascii.begin(), ascii.end());
+    }
+
+    encoded_text view(const utf16_text& text)
+    {
+        return (text.empty()) ?
+            encoded_text() :
+            encoded_text(&text[0], &text[0] + text.size());
+    }
+
+    string ascii(encoded_text text)
+    {
+        return string(text.begin(), text.end());
+    }
+
+    /**
+     * Buffer for an item, aligned as the shell would align it.
+     */
+    class item_buffer
+    {
+    public:
+        item_buffer() : m_buffer(MAX_ENCODED_REMOTE_ITEM_SIZE / 4 + 1) {}
+
+        unsigned char* get()
+        {
+            return reinterpret_cast<unsigned char*>(&m_buffer[0]);
+        }
+
+    private:
+        vector<uint32_t> m_buffer;
+    };
+
+    struct test_item
+    {
+        test_item()
+            :
+            filename(utf16("testfile.txt")), owner(utf16("bobuser")),
+            group(utf16("bob's group"))
+        {
+            properties.filename = view(filename);
+            properties.is_folder = false;
+            properties.is_link = true;
+            properties.owner = view(owner);
+            properties.group = view(group);
+            properties.owner_id = 1001;
+            properties.group_id = 65535;
+            properties.permissions = 040666;
+            properties.size = 18446744073709551615U;
+            properties.date_modified = 25873.385902;
+            properties.date_accessed = 0;
+        }
+
+        utf16_text filename;
+        utf16_text owner;
+        utf16_text group;
+        remote_item_properties properties;
+    };
+
+    /**
+     * Write a version 1 item as earlier releases of Swish did.
+     *
+     * Offsets are written out rather than shared with the code under test
+     * so the test catches changes to how old items are read.
+     */
+    void write_version_1_item(unsigned char* item)
+    {
+        std::memset(item, 0, 688);
+
+        uint16_t cb = 688;
+        uint32_t fingerprint = 0x533aaf69;
+        std::memcpy(item, &cb, 2);
+        std::memcpy(item + 2, &fingerprint, 4);
+        item[6] = 1; // folder
+        item[7] = 0; // not link
+
+        utf16_text filename = utf16("old folder");
+        utf16_text owner = utf16("alice");
+        utf16_text group = utf16("staff");
+        std::memcpy(item + 8, &filename[0], filename.size() * 2);
+        std::memcpy(item + 520, &owner[0], owner.size() * 2);
+        std::memcpy(item + 586, &group[0], group.size() * 2);
+
+        uint32_t uid = 501;
+        uint32_t gid = 20;
+        uint32_t permissions = 040755;
+        uint64_t size = 4096;
+        double modified = 41000.5;
+        double accessed = 41001.25;
+        std::memcpy(item + 652, &uid, 4);
+        std::memcpy(item + 656, &gid, 4);
+        std::memcpy(item + 660, &permissions, 4);
+        std::memcpy(item + 664, &size, 8);
+        std::memcpy(item + 672, &modified, 8);
+        std::memcpy(item + 680, &accessed, 8);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE( remote_item_encoding_tests )
+
+BOOST_AUTO_TEST_CASE( round_trip )
+{
+    test_item source;
+    item_buffer buffer;
+
+    size_t item_size = encode_remote_item(source.properties, buffer.get());
+
+    BOOST_CHECK_EQUAL(item_size, encoded_remote_item_size(source.properties));
+    BOOST_CHECK_EQUAL(item_size % 4, 0U);
+
+    encoded_remote_item item(buffer.get());
+
+    BOOST_REQUIRE(item.valid());
+    BOOST_CHECK_EQUAL(item.version(), 2U);
+    BOOST_CHECK_EQUAL(ascii(item.filename()), "testfile.txt");
+    BOOST_CHECK(!item.is_folder());
+    BOOST_CHECK(item.is_link());
+    BOOST_CHECK_EQUAL(ascii(item.owner()), "bobuser");
+    BOOST_CHECK_EQUAL(ascii(item.group()), "bob's group");
+    BOOST_CHECK_EQUAL(item.owner_id(), 1001U);
+    BOOST_CHECK_EQUAL(item.group_id(), 65535U);
+    BOOST_CHECK_EQUAL(item.permissions(), 040666U);
+    BOOST_CHECK_EQUAL(item.size(), 18446744073709551615U);
+    BOOST_CHECK_EQUAL(item.date_modified(), 25873.385902);
+    BOOST_CHECK_EQUAL(item.date_accessed(), 0.0);
+}
+
+/**
+ * The text accessors must point into the item rather than copy.
+ */
+BOOST_AUTO_TEST_CASE( text_is_viewed_in_place )
+{
+    test_item source;
+    item_buffer buffer;
+    size_t item_size = encode_remote_item(source.properties, buffer.get());
+
+    encoded_remote_item item(buffer.get());
+
+    const unsigned char* start = buffer.get();
+    const unsigned char* end = start + item_size;
+    const unsigned char* text =
+        reinterpret_cast<const unsigned char*>(item.filename().begin());
+    BOOST_CHECK(text > start && text < end);
+    BOOST_CHECK_EQUAL(reinterpret_cast<size_t>(text) % 2, 0U);
+}
+
+BOOST_AUTO_TEST_CASE( empty_text )
+{
+    remote_item_properties properties;
+    properties.is_folder = true;
+
+    item_buffer buffer;
+    encode_remote_item(properties, buffer.get());
+
+    encoded_remote_item item(buffer.get());
+
+    BOOST_REQUIRE(item.valid());
+    BOOST_CHECK(item.is_folder());
+    BOOST_CHECK(!item.is_link());
+    BOOST_CHECK(item.filename().empty());
+    BOOST_CHECK(item.owner().empty());
+    BOOST_CHECK(item.group().empty());
+}
+
+BOOST_AUTO_TEST_CASE( long_text_truncated )
+{
+    utf16_text filename(1000, 'f');
+    utf16_text owner(100, 'o');
+
+    remote_item_properties properties;
+    properties.filename = view(filename);
+    properties.owner = view(owner);
+
+    BOOST_CHECK_LE(
+        encoded_remote_item_size(properties), MAX_ENCODED_REMOTE_ITEM_SIZE);
+
+    item_buffer buffer;
+    encode_remote_item(properties, buffer.get());
+
+    encoded_remote_item item(buffer.get());
+
+    BOOST_REQUIRE(item.valid());
+    BOOST_CHECK_EQUAL(item.filename().size(), MAX_FILENAME_LEN);
+    BOOST_CHECK_EQUAL(item.owner().size(), MAX_USERNAME_LEN);
+    BOOST_CHECK(item.group().empty());
+}
+
+/**
+ * Items are much smaller than the fixed-size version 1 items.
+ */
+BOOST_AUTO_TEST_CASE( compact )
+{
+    test_item source;
+
+    BOOST_CHECK_LT(encoded_remote_item_size(source.properties), 128U);
+}
+
+BOOST_AUTO_TEST_CASE( read_version_1 )
+{
+    item_buffer buffer;
+    write_version_1_item(buffer.get());
+
+    encoded_remote_item item(buffer.get());
+
+    BOOST_REQUIRE(item.valid());
+    BOOST_CHECK_EQUAL(item.version(), 1U);
+    BOOST_CHECK_EQUAL(ascii(item.filename()), "old folder");
+    BOOST_CHECK(item.is_folder());
+    BOOST_CHECK(!item.is_link());
+    BOOST_CHECK_EQUAL(ascii(item.owner()), "alice");
+    BOOST_CHECK_EQUAL(ascii(item.group()), "staff");
+    BOOST_CHECK_EQUAL(item.owner_id(), 501U);
+    BOOST_CHECK_EQUAL(item.group_id(), 20U);
+    BOOST_CHECK_EQUAL(item.permissions(), 040755U);
+    BOOST_CHECK_EQUAL(item.size(), 4096U);
+    BOOST_CHECK_EQUAL(item.date_modified(), 41000.5);
+    BOOST_CHECK_EQUAL(item.date_accessed(), 41001.25);
+}
+
+BOOST_AUTO_TEST_CASE( invalid_items )
+{
+    BOOST_CHECK(!encoded_remote_item(NULL).valid());
+
+    test_item source;
+
+    {
+        item_buffer buffer;
+        encode_remote_item(source.properties, buffer.get());
+        buffer.get()[3] ^= 0xFF; // Fingerprint
+        BOOST_CHECK(!encoded_remote_item(buffer.get()).valid());
+    }
+
+    {
+        item_buffer buffer;
+        encode_remote_item(source.properties, buffer.get());
+        buffer.get()[6] = 3; // Unknown version
+        BOOST_CHECK(!encoded_remote_item(buffer.get()).valid());
+    }
+
+    {
+        // Text longer than the item
+        item_buffer buffer;
+        encode_remote_item(source.properties, buffer.get());
+        uint16_t huge_length = 1000;
+        std::memcpy(buffer.get() + 44, &huge_length, 2);
+        BOOST_CHECK(!encoded_remote_item(buffer.get()).valid());
+    }
+
+    {
+        // Version 1 items are only valid at their fixed size
+        item_buffer buffer;
+        write_version_1_item(buffer.get());
+        uint16_t cb = 600;
+        std::memcpy(buffer.get(), &cb, 2);
+        BOOST_CHECK(!encoded_remote_item(buffer.get()).valid());
+    }
+
+    {
+        uint16_t too_small[2] = { 4, 0 };
+        BOOST_CHECK(!encoded_remote_item(too_small).valid());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE( benchmarks )
+
+/**
+ * Encode and read back a million items the way a large folder would.
+ */
+BOOST_AUTO_TEST_CASE( million_items )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    const size_t item_count = 1000000;
+
+    test_item source;
+    vector<unsigned char> items;
+    items.reserve(item_count * 64);
+
+    ptime start = microsec_clock::universal_time();
+
+    item_buffer buffer;
+    for (size_t i = 0; i < item_count; ++i)
+    {
+        source.properties.size = i;
+        size_t item_size = encode_remote_item(source.properties, buffer.get());
+        items.insert(items.end(), buffer.get(), buffer.get() + item_size);
+    }
+
+    time_duration encode_time = microsec_clock::universal_time() - start;
+
+    start = microsec_clock::universal_time();
+
+    uint64_t checksum = 0;
+    size_t offset = 0;
+    for (size_t i = 0; i < item_count; ++i)
+    {
+        encoded_remote_item item(&items[offset]);
+        BOOST_REQUIRE(item.valid());
+
+        checksum += item.size() + item.filename().size() +
+            item.owner().size() + item.group().size() + item.is_folder();
+
+        uint16_t cb;
+        std::memcpy(&cb, &items[offset], sizeof(cb));
+        offset += cb;
+    }
+
+    time_duration decode_time = microsec_clock::universal_time() - start;
+
+    BOOST_CHECK_EQUAL(
+        checksum, uint64_t(item_count) * (item_count - 1) / 2 +
+        uint64_t(item_count) * (12 + 7 + 11));
+
+    double encode_seconds =
+        (std::max)(encode_time.total_microseconds() / 1e6, 1e-6);
+    double decode_seconds =
+        (std::max)(decode_time.total_microseconds() / 1e6, 1e-6);
+
+    BOOST_TEST_MESSAGE(
+        "Remote items take " << items.size() / item_count <<
+        " bytes each (version 1: 688 bytes)");
+    BOOST_TEST_MESSAGE(
+        "Encoded " << static_cast<unsigned long>(item_count / encode_seconds)
+        << " items/s, read " <<
+        static_cast<unsigned long>(item_count / decode_seconds) <<
+        " items/s");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE_END()
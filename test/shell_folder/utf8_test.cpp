@@ -0,0 +1,382 @@
+/**
+    @file
+
+    Tests for UTF-8 conversion.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#include "swish/utf8.hpp" // Test subject
+
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
+#ifdef _WIN32
+#include "swish/utils.hpp" // ConvertString
+#endif
+
+#include <boost/cstdint.hpp> // uint16_t, uint32_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm> // max
+#include <string>
+#include <vector>
+
+using swish::utf8::conversion_result;
+using swish::utf8::max_utf8_size;
+using swish::utf8::max_wide_size;
+using swish::utf8::utf8_to_wide;
+using swish::utf8::wide_to_utf8;
+
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
+using boost::uint16_t;
+using boost::uint32_t;
+
+using std::basic_string;
+using std::string;
+using std::vector;
+using std::wstring;
+
+namespace {
+
+    typedef basic_string<uint16_t> utf16_string;
+    typedef basic_string<uint32_t> utf32_string;
+
+    template<typename Char>
+    basic_string<Char> widen(const string& utf8, size_t expected_invalid=0)
+    {
+        vector<Char> buffer(max_wide_size(utf8.size()) + 1);
+        conversion_result result =
+            utf8_to_wide(utf8.data(), utf8.size(), &buffer[0]);
+        BOOST_CHECK_EQUAL(result.invalid, expected_invalid);
+        return basic_string<Char>(&buffer[0], result.size);
+    }
+
+    template<typename Char>
+    string narrow(const basic_string<Char>& wide, size_t expected_invalid=0)
+    {
+        vector<char> buffer(max_utf8_size<Char>(wide.size()) + 1);
+        conversion_result result =
+            wide_to_utf8(wide.data(), wide.size(), &buffer[0]);
+        BOOST_CHECK_EQUAL(result.invalid, expected_invalid);
+        return string(&buffer[0], result.size);
+    }
+
+    template<typename Char>
+    basic_string<Char> units(const uint32_t* values, size_t count)
+    {
+        basic_string<Char> s;
+        for (size_t i = 0; i < count; ++i)
+        {
+            s.push_back(static_cast<Char>(values[i]));
+        }
+        return s;
+    }
+
+    template<typename Char>
+    basic_string<Char> ascii(const string& text)
+    {
+        return basic_string<Char>(text.begin(), text.end());
+    }
+
+    /**
+     * Filenames like those found on real servers.
+     *
+     * Mostly ASCII, some of it long enough for the 16-byte fast path, with
+     * accented, CJK and astral-plane names mixed in.
+     */
+    const char* corpus[] = {
+        "IMG_2034.JPG",
+        "report-final (2).docx",
+        "node_modules",
+        "libboost_filesystem-vc90-mt-gd-1_55.lib",
+        ".bash_history",
+        "R\xc3\xa9sum\xc3\xa9.pdf",
+        "\xc3\x9c""bersicht der Gesch\xc3\xa4""ftsberichte 2013.xlsx",
+        "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe3\x83\x95\xe3\x82"
+            "\xa1\xe3\x82\xa4\xe3\x83\xab.txt",
+        "\xd0\x94\xd0\xbe\xd0\xba\xd1\x83\xd0\xbc\xd0\xb5\xd0\xbd\xd1\x82\xd1"
+            "\x8b",
+        "\xf0\x9f\x98\x80 party photos",
+        "a-rather-long-directory-name-that-goes-on-and-on-for-a-while"
+    };
+
+    const size_t corpus_size = sizeof(corpus) / sizeof(corpus[0]);
+
+    double megabytes_per_second(size_t bytes, time_duration elapsed)
+    {
+        double seconds = (std::max)(elapsed.total_microseconds() / 1e6, 1e-6);
+        return bytes / seconds / (1024 * 1024);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(utf8_tests)
+
+BOOST_AUTO_TEST_CASE( widen_empty )
+{
+    BOOST_CHECK(widen<wchar_t>("").empty());
+}
+
+BOOST_AUTO_TEST_CASE( widen_ascii )
+{
+    // Long enough to take the fast path and leave a tail
+    BOOST_CHECK(
+        widen<wchar_t>("This was a narrow-char string, honest") ==
+        L"This was a narrow-char string, honest");
+    BOOST_CHECK(widen<uint16_t>("short") == ascii<uint16_t>("short"));
+    BOOST_CHECK(widen<uint32_t>("short") == ascii<uint32_t>("short"));
+}
+
+BOOST_AUTO_TEST_CASE( widen_multibyte )
+{
+    const uint32_t expected[] = { 'R', 0xE9, 0x65E5, 0x1F600, '!' };
+    const string utf8 = "R\xc3\xa9\xe6\x97\xa5\xf0\x9f\x98\x80!";
+
+    BOOST_CHECK(widen<uint32_t>(utf8) == units<uint32_t>(expected, 5));
+
+    const uint32_t expected_utf16[] = { 'R', 0xE9, 0x65E5, 0xD83D, 0xDE00, '!' };
+    BOOST_CHECK(widen<uint16_t>(utf8) == units<uint16_t>(expected_utf16, 6));
+}
+
+/**
+ * Non-ASCII in the middle of a long ASCII run must drop out of the fast path.
+ */
+BOOST_AUTO_TEST_CASE( widen_non_ascii_inside_fast_path )
+{
+    string utf8 = "0123456789abcdefghij\xc3\xa9klmnopqrstuvwxyz0123456789";
+
+    utf16_string wide = widen<uint16_t>(utf8);
+
+    BOOST_REQUIRE_EQUAL(wide.size(), utf8.size() - 1);
+    BOOST_CHECK_EQUAL(wide[19], uint16_t('j'));
+    BOOST_CHECK_EQUAL(wide[20], uint16_t(0xE9));
+    BOOST_CHECK_EQUAL(wide[21], uint16_t('k'));
+    BOOST_CHECK(narrow(wide) == utf8);
+}
+
+/**
+ * Filenames from servers that don't use UTF-8, Latin-1 here.
+ */
+BOOST_AUTO_TEST_CASE( widen_latin1 )
+{
+    const uint32_t expected[] = { 'c', 'a', 'f', 0xFFFD, '.', 't', 'x', 't' };
+    BOOST_CHECK(
+        widen<uint32_t>("caf\xe9.txt", 1) == units<uint32_t>(expected, 8));
+}
+
+BOOST_AUTO_TEST_CASE( widen_invalid_sequences )
+{
+    const uint32_t replacement[] = { 0xFFFD, 0xFFFD, 0xFFFD, 0xFFFD };
+
+    // Lone continuation byte
+    BOOST_CHECK(widen<uint32_t>("\x80", 1) == units<uint32_t>(replacement, 1));
+
+    // Truncated sequence
+    BOOST_CHECK(
+        widen<uint32_t>("\xe6\x97", 1) == units<uint32_t>(replacement, 1));
+
+    // Overlong encoding of NUL
+    BOOST_CHECK(
+        widen<uint32_t>("\xc0\x80", 2) == units<uint32_t>(replacement, 2));
+
+    // Encoded surrogate
+    BOOST_CHECK(
+        widen<uint32_t>("\xed\xa0\x80", 3) == units<uint32_t>(replacement, 3));
+
+    // Beyond U+10FFFF
+    BOOST_CHECK(
+        widen<uint32_t>("\xf4\x90\x80\x80", 4) ==
+        units<uint32_t>(replacement, 4));
+}
+
+BOOST_AUTO_TEST_CASE( narrow_empty )
+{
+    BOOST_CHECK(narrow(wstring()).empty());
+}
+
+BOOST_AUTO_TEST_CASE( narrow_ascii )
+{
+    BOOST_CHECK_EQUAL(
+        narrow(wstring(L"This was a wide-char string, honestly")),
+        "This was a wide-char string, honestly");
+}
+
+BOOST_AUTO_TEST_CASE( narrow_multibyte )
+{
+    const uint32_t utf16[] = { 'R', 0xE9, 0x65E5, 0xD83D, 0xDE00, '!' };
+    const uint32_t utf32[] = { 'R', 0xE9, 0x65E5, 0x1F600, '!' };
+    const string expected = "R\xc3\xa9\xe6\x97\xa5\xf0\x9f\x98\x80!";
+
+    BOOST_CHECK_EQUAL(narrow(units<uint16_t>(utf16, 6)), expected);
+    BOOST_CHECK_EQUAL(narrow(units<uint32_t>(utf32, 5)), expected);
+}
+
+BOOST_AUTO_TEST_CASE( narrow_unpaired_surrogates )
+{
+    const uint32_t utf16[] = { 'a', 0xD83D, 'b', 0xDE00 };
+
+    BOOST_CHECK_EQUAL(
+        narrow(units<uint16_t>(utf16, 4), 2),
+        "a\xef\xbf\xbd" "b\xef\xbf\xbd");
+}
+
+/**
+ * Converting into an existing string replaces its contents.
+ */
+BOOST_AUTO_TEST_CASE( convert_into_string )
+{
+    wstring wide = L"something much longer than what will replace it";
+    utf8_to_wide("short", 5, wide);
+    BOOST_CHECK(wide == L"short");
+
+    string utf8 = "something much longer than what will replace it";
+    wide_to_utf8(L"short", 5, utf8);
+    BOOST_CHECK_EQUAL(utf8, "short");
+}
+
+BOOST_AUTO_TEST_CASE( corpus_round_trip )
+{
+    for (size_t i = 0; i < corpus_size; ++i)
+    {
+        BOOST_CHECK_EQUAL(narrow(widen<uint16_t>(corpus[i])), corpus[i]);
+        BOOST_CHECK_EQUAL(narrow(widen<uint32_t>(corpus[i])), corpus[i]);
+        BOOST_CHECK_EQUAL(narrow(widen<wchar_t>(corpus[i])), corpus[i]);
+    }
+}
+
+#ifdef _WIN32
+
+/**
+ * Must agree with the Windows API conversion it replaced.
+ */
+BOOST_AUTO_TEST_CASE( corpus_matches_windows )
+{
+    for (size_t i = 0; i < corpus_size; ++i)
+    {
+        wstring wide = swish::utils::ConvertString<Widen>(corpus[i]);
+        BOOST_CHECK(widen<wchar_t>(corpus[i]) == wide);
+        BOOST_CHECK_EQUAL(
+            narrow(wide), swish::utils::ConvertString<Narrow>(wide));
+    }
+}
+
+#endif
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+/**
+ * Convert the corpus many times over and report the rate.
+ *
+ * On Windows also reports the rate of the Windows API conversion for
+ * comparison.
+ */
+BOOST_AUTO_TEST_CASE( corpus_throughput )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    const size_t repetitions = 100000;
+
+    vector<string> names(corpus, corpus + corpus_size);
+    vector<wstring> wide_names;
+    size_t bytes = 0;
+    for (size_t i = 0; i < corpus_size; ++i)
+    {
+        wide_names.push_back(widen<wchar_t>(names[i]));
+        bytes += names[i].size();
+    }
+    bytes *= repetitions;
+
+    wstring wide;
+    string utf8;
+
+    ptime start = microsec_clock::universal_time();
+    for (size_t n = 0; n < repetitions; ++n)
+    {
+        for (size_t i = 0; i < corpus_size; ++i)
+        {
+            utf8_to_wide(names[i].data(), names[i].size(), wide);
+        }
+    }
+    time_duration widening = microsec_clock::universal_time() - start;
+
+    start = microsec_clock::universal_time();
+    for (size_t n = 0; n < repetitions; ++n)
+    {
+        for (size_t i = 0; i < corpus_size; ++i)
+        {
+            wide_to_utf8(wide_names[i].data(), wide_names[i].size(), utf8);
+        }
+    }
+    time_duration narrowing = microsec_clock::universal_time() - start;
+
+    BOOST_TEST_MESSAGE(
+        "Widening: " << megabytes_per_second(bytes, widening) << " MB/s");
+    BOOST_TEST_MESSAGE(
+        "Narrowing: " << megabytes_per_second(bytes, narrowing) << " MB/s");
+
+#ifdef _WIN32
+    start = microsec_clock::universal_time();
+    for (size_t n = 0; n < repetitions; ++n)
+    {
+        for (size_t i = 0; i < corpus_size; ++i)
+        {
+            wide = swish::utils::ConvertString<Widen>(names[i]);
+        }
+    }
+    widening = microsec_clock::universal_time() - start;
+
+    start = microsec_clock::universal_time();
+    for (size_t n = 0; n < repetitions; ++n)
+    {
+        for (size_t i = 0; i < corpus_size; ++i)
+        {
+            utf8 = swish::utils::ConvertString<Narrow>(wide_names[i]);
+        }
+    }
+    narrowing = microsec_clock::universal_time() - start;
+
+    BOOST_TEST_MESSAGE(
+        "Windows API widening: " <<
+        megabytes_per_second(bytes, widening) << " MB/s");
+    BOOST_TEST_MESSAGE(
+        "Windows API narrowing: " <<
+        megabytes_per_second(bytes, narrowing) << " MB/s");
+#endif
+
+    BOOST_CHECK_EQUAL(utf8, names[corpus_size - 1]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE_END()
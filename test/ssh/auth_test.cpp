@@ -34,23 +34,30 @@
     @endif
 */
 
+#include "sandbox_fixture.hpp" // sandbox_fixture
 #include "session_fixture.hpp" // session_fixture
 
 #include <ssh/session.hpp> // test subject
 
 #include <boost/concept_check.hpp> // BOOST_CONCEPT_ASSERT
+#include <boost/date_time/posix_time/posix_time_duration.hpp> // seconds
+#include <boost/filesystem.hpp> // copy_file, remove, last_write_time
 #include <boost/move/move.hpp>
 #include <boost/range/concepts.hpp> // RandomAccessRangeConcept
 #include <boost/range/size.hpp>
 #include <boost/system/system_error.hpp>
 #include <boost/test/unit_test.hpp>
 
+#include <ctime> // time_t
 #include <exception>
 #include <memory>
 #include <string>
 #include <vector>
 
 using boost::RandomAccessRangeConcept;
+using boost::filesystem::copy_file;
+using boost::filesystem::last_write_time;
+using boost::filesystem::path;
 using boost::move;
 using boost::size;
 using boost::system::system_error;
@@ -58,7 +65,9 @@ using boost::system::system_error;
 using ssh::session;
 using ssh::agent_identities;
 using ssh::identity;
+using ssh::private_key_cache;
 
+using test::ssh::sandbox_fixture;
 using test::ssh::session_fixture;
 
 using std::auto_ptr;
@@ -328,6 +337,119 @@ BOOST_AUTO_TEST_CASE( pubkey )
     BOOST_CHECK(s.authenticated());
 }
 
+/**
+ * Pubkey authentication through a key cache loads the key once and reuses
+ * it for later sessions.
+ */
+BOOST_AUTO_TEST_CASE( pubkey_cached )
+{
+    private_key_cache cache;
+
+    session& s = test_session();
+    s.authenticate_by_key_files(
+        user(), public_key_path(), private_key_path(), "", cache);
+    BOOST_CHECK(s.authenticated());
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+
+    auto_ptr<boost::asio::ip::tcp::socket> socket(connect_additional_socket());
+    session t(socket->native());
+
+    t.authenticate_by_key_files(
+        user(), public_key_path(), private_key_path(), "", cache);
+    BOOST_CHECK(t.authenticated());
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE( pubkey_cache_purge )
+{
+    private_key_cache cache;
+
+    test_session().authenticate_by_key_files(
+        user(), public_key_path(), private_key_path(), "", cache);
+    BOOST_REQUIRE_EQUAL(cache.size(), 1U);
+
+    cache.purge(wrong_private_key_path());
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+
+    cache.purge(private_key_path());
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE( pubkey_cache_expiry )
+{
+    private_key_cache cache(boost::posix_time::seconds(0));
+
+    test_session().authenticate_by_key_files(
+        user(), public_key_path(), private_key_path(), "", cache);
+    BOOST_CHECK(test_session().authenticated());
+
+    // Already expired so the next use of the cache wipes it
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+}
+
+namespace {
+
+    /**
+     * Overwrite a key file, making sure its modification time moves on even
+     * if the filesystem only records whole seconds.
+     */
+    void replace_key_file(const path& source, const path& target)
+    {
+        std::time_t old_modified = last_write_time(target);
+        boost::filesystem::remove(target);
+        copy_file(source, target);
+        last_write_time(target, old_modified + 60);
+    }
+}
+
+/**
+ * Replacing the files of a cached key loads the new key rather than reusing
+ * the old one.
+ */
+BOOST_AUTO_TEST_CASE( pubkey_cache_notices_replaced_key )
+{
+    sandbox_fixture sandbox;
+    path private_key = sandbox.sandbox() / "id_test";
+    path public_key = sandbox.sandbox() / "id_test.pub";
+    copy_file(private_key_path(), private_key);
+    copy_file(public_key_path(), public_key);
+
+    private_key_cache cache;
+
+    test_session().authenticate_by_key_files(
+        user(), public_key, private_key, "", cache);
+    BOOST_REQUIRE(test_session().authenticated());
+
+    replace_key_file(wrong_private_key_path(), private_key);
+    replace_key_file(wrong_public_key_path(), public_key);
+
+    auto_ptr<boost::asio::ip::tcp::socket> socket(connect_additional_socket());
+    session t(socket->native());
+
+    BOOST_CHECK_THROW(
+        t.authenticate_by_key_files(
+            user(), public_key, private_key, "", cache),
+        system_error);
+    BOOST_CHECK(!t.authenticated());
+}
+
+/**
+ * A key the cache can't decode fails the same way as without the cache and
+ * isn't cached.
+ */
+BOOST_AUTO_TEST_CASE( pubkey_cached_invalid_private )
+{
+    private_key_cache cache;
+    session& s = test_session();
+
+    BOOST_CHECK_THROW(
+        s.authenticate_by_key_files(
+            user(), public_key_path(), public_key_path(), "", cache),
+        system_error);
+    BOOST_CHECK(!s.authenticated());
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+}
+
 /**
  * Authentication carries across to move-constructed session.
  */
@@ -0,0 +1,337 @@
+/**
+    @file
+
+    Tests for limiting how fast transfers use the network.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#include <ssh/bandwidth.hpp> // test subject
+
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <stdexcept> // invalid_argument
+
+using ssh::bandwidth_limiter;
+using ssh::bandwidth_schedule;
+using ssh::detail::token_bucket;
+
+using boost::make_shared;
+using boost::posix_time::hours;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::minutes;
+using boost::posix_time::ptime;
+using boost::posix_time::seconds;
+using boost::posix_time::time_duration;
+using boost::shared_ptr;
+using boost::uintmax_t;
+
+namespace {
+
+    /**
+     * Seconds the limiter takes to let `total` bytes through in blocks.
+     */
+    double seconds_to_send(
+        bandwidth_limiter& limiter, uintmax_t total, uintmax_t block=32768)
+    {
+        ptime start = microsec_clock::universal_time();
+
+        for (uintmax_t sent = 0; sent < total; sent += block)
+        {
+            limiter.consume(block);
+        }
+
+        return (microsec_clock::universal_time() - start).total_milliseconds()
+            / 1000.0;
+    }
+
+    /**
+     * Seconds a bucket holds `total` bytes, sent in blocks, to the rate if
+     * the sender waits exactly as long as it is told to.
+     *
+     * Advances `now` by that much.
+     */
+    double simulated_seconds_to_send(
+        token_bucket& bucket, ptime& now, uintmax_t rate, uintmax_t total,
+        uintmax_t block=32768)
+    {
+        ptime start = now;
+
+        for (uintmax_t sent = 0; sent < total; sent += block)
+        {
+            now += bucket.consume(block, rate, now);
+        }
+
+        return (now - start).total_microseconds() / 1e6;
+    }
+
+    const uintmax_t MiB = 1024 * 1024;
+
+}
+
+BOOST_AUTO_TEST_SUITE(bandwidth_schedule_tests)
+
+BOOST_AUTO_TEST_CASE( unlimited_by_default )
+{
+    BOOST_CHECK_EQUAL(bandwidth_schedule().rate_at(hours(12)), 0U);
+}
+
+BOOST_AUTO_TEST_CASE( same_all_day )
+{
+    bandwidth_schedule schedule(1000);
+
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(0)), 1000U);
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(23)), 1000U);
+}
+
+BOOST_AUTO_TEST_CASE( office_hours )
+{
+    bandwidth_schedule schedule;
+    schedule.between(hours(9), hours(17), 1000);
+
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(8) + minutes(59)), 0U);
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(9)), 1000U);
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(16) + minutes(59)), 1000U);
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(17)), 0U);
+}
+
+BOOST_AUTO_TEST_CASE( over_midnight )
+{
+    bandwidth_schedule schedule(1000);
+    schedule.between(hours(22), hours(6), 0);
+
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(23)), 0U);
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(1)), 0U);
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(12)), 1000U);
+}
+
+BOOST_AUTO_TEST_CASE( later_period_wins )
+{
+    bandwidth_schedule schedule;
+    schedule.between(hours(9), hours(17), 1000)
+        .between(hours(12), hours(13), 5000);
+
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(10)), 1000U);
+    BOOST_CHECK_EQUAL(schedule.rate_at(hours(12)), 5000U);
+}
+
+BOOST_AUTO_TEST_CASE( bad_periods )
+{
+    bandwidth_schedule schedule;
+
+    BOOST_CHECK_THROW(
+        schedule.between(hours(9), hours(9), 1000), std::invalid_argument);
+    BOOST_CHECK_THROW(
+        schedule.between(hours(9), hours(24), 1000), std::invalid_argument);
+    BOOST_CHECK_THROW(
+        schedule.between(-hours(1), hours(9), 1000), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(token_bucket_tests)
+
+BOOST_AUTO_TEST_CASE( unlimited_never_waits )
+{
+    ptime now = microsec_clock::universal_time();
+    token_bucket bucket(now);
+
+    BOOST_CHECK_EQUAL(
+        simulated_seconds_to_send(bucket, now, 0, 100 * MiB), 0.0);
+}
+
+BOOST_AUTO_TEST_CASE( held_to_rate )
+{
+    ptime now = microsec_clock::universal_time();
+    token_bucket bucket(now);
+
+    BOOST_CHECK_CLOSE(
+        simulated_seconds_to_send(bucket, now, 2 * MiB, 3 * MiB), 1.5, 0.01);
+}
+
+BOOST_AUTO_TEST_CASE( burst_after_quiet_spell )
+{
+    ptime now = microsec_clock::universal_time();
+    token_bucket bucket(now);
+    now += seconds(10);
+
+    // A quarter of a second's worth goes straight through ...
+    BOOST_CHECK_EQUAL(
+        bucket.consume(MiB / 2, 2 * MiB, now).total_microseconds(), 0);
+
+    // ... but no more
+    BOOST_CHECK_EQUAL(
+        bucket.consume(32768, 2 * MiB, now).total_microseconds(), 15625);
+}
+
+BOOST_AUTO_TEST_CASE( later_transfers_wait_behind_debt )
+{
+    ptime now = microsec_clock::universal_time();
+    token_bucket bucket(now);
+
+    BOOST_CHECK_EQUAL(
+        bucket.consume(MiB, 2 * MiB, now).total_microseconds(), 500000);
+    BOOST_CHECK_EQUAL(
+        bucket.consume(32768, 2 * MiB, now).total_microseconds(), 515625);
+}
+
+BOOST_AUTO_TEST_CASE( rate_changed_while_sending )
+{
+    ptime now = microsec_clock::universal_time();
+    token_bucket bucket(now);
+
+    BOOST_CHECK_CLOSE(
+        simulated_seconds_to_send(bucket, now, 1 * MiB, MiB / 2), 0.5, 0.01);
+
+    // Slightly under as the wait after the last block at the old rate
+    // refills at the new one
+    BOOST_CHECK_CLOSE(
+        simulated_seconds_to_send(bucket, now, 4 * MiB, 2 * MiB), 0.5, 5.0);
+}
+
+BOOST_AUTO_TEST_CASE( limit_comes_back_empty )
+{
+    ptime now = microsec_clock::universal_time();
+    token_bucket bucket(now);
+    now += seconds(10);
+
+    BOOST_CHECK_EQUAL(
+        bucket.consume(32768, 2 * MiB, now).total_microseconds(), 0);
+    BOOST_CHECK_EQUAL(
+        bucket.consume(32768, 0, now).total_microseconds(), 0);
+    BOOST_CHECK_EQUAL(
+        bucket.consume(32768, 2 * MiB, now).total_microseconds(), 15625);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(bandwidth_limiter_tests)
+
+BOOST_AUTO_TEST_CASE( rate_changed )
+{
+    bandwidth_limiter limiter(bandwidth_schedule(1 * MiB));
+
+    limiter.set_rate(4 * MiB);
+
+    BOOST_CHECK_EQUAL(limiter.current_rate(), 4 * MiB);
+}
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+BOOST_AUTO_TEST_CASE( unlimited )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    bandwidth_limiter limiter;
+
+    BOOST_TEST_MESSAGE(
+        "100 MiB unlimited took " << seconds_to_send(limiter, 100 * MiB) <<
+        "s");
+}
+
+BOOST_AUTO_TEST_CASE( held_to_rate )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    bandwidth_limiter limiter(bandwidth_schedule(2 * MiB));
+
+    BOOST_TEST_MESSAGE(
+        "3 MiB at 2 MiB/s took " << seconds_to_send(limiter, 3 * MiB) <<
+        "s (expected 1.5s)");
+}
+
+BOOST_AUTO_TEST_CASE( held_to_parent_rate )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    shared_ptr<bandwidth_limiter> global =
+        make_shared<bandwidth_limiter>(bandwidth_schedule(2 * MiB));
+    bandwidth_limiter host(bandwidth_schedule(8 * MiB), global);
+
+    BOOST_TEST_MESSAGE(
+        "3 MiB at 8 MiB/s under a parent at 2 MiB/s took " <<
+        seconds_to_send(host, 3 * MiB) << "s (expected 1.5s)");
+}
+
+BOOST_AUTO_TEST_CASE( held_to_own_rate_below_parent )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    shared_ptr<bandwidth_limiter> global =
+        make_shared<bandwidth_limiter>(bandwidth_schedule(8 * MiB));
+    bandwidth_limiter host(bandwidth_schedule(2 * MiB), global);
+
+    BOOST_TEST_MESSAGE(
+        "3 MiB at 2 MiB/s under a parent at 8 MiB/s took " <<
+        seconds_to_send(host, 3 * MiB) << "s (expected 1.5s)");
+}
+
+BOOST_AUTO_TEST_CASE( rate_changed_while_sending )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    bandwidth_limiter limiter(bandwidth_schedule(1 * MiB));
+
+    seconds_to_send(limiter, MiB / 2);
+    limiter.set_rate(4 * MiB);
+
+    BOOST_TEST_MESSAGE(
+        "2 MiB after the rate went up to 4 MiB/s took " <<
+        seconds_to_send(limiter, 2 * MiB) << "s (expected 0.5s)");
+}
+
+BOOST_AUTO_TEST_CASE( limit_lifted )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    bandwidth_limiter limiter(bandwidth_schedule(1 * MiB));
+
+    limiter.set_rate(0);
+
+    BOOST_TEST_MESSAGE(
+        "100 MiB after the limit was lifted took " <<
+        seconds_to_send(limiter, 100 * MiB) << "s");
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,692 @@
+/**
+    @file
+
+    Tests for the double-buffered block transfer engine.
+
+    @if license
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+    Copyright (C) 2013  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#include "sandbox_fixture.hpp" // sandbox_fixture
+#include "session_fixture.hpp" // session_fixture
+
+#include "swish/block_transfer.hpp" // test subject
+
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
+#include <ssh/stream.hpp> // ofstream
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/date_time/posix_time/posix_time.hpp> // microsec_clock
+#include <boost/filesystem/fstream.hpp> // ifstream, ofstream
+#include <boost/filesystem/operations.hpp> // file_size
+#include <boost/noncopyable.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp> // this_thread
+
+#include <algorithm> // min
+#include <cstddef> // size_t
+#include <iterator> // istreambuf_iterator
+#include <sstream> // istringstream, ostringstream
+#include <stdexcept> // runtime_error, invalid_argument
+#include <string>
+#include <vector>
+
+using swish::block_transfer::byte_sink;
+using swish::block_transfer::byte_source;
+using swish::block_transfer::istream_source;
+using swish::block_transfer::ostream_sink;
+using swish::block_transfer::transfer_engine;
+using swish::block_transfer::transfer_options;
+
+using ssh::session;
+using ssh::filesystem::sftp_filesystem;
+
+using test::ssh::sandbox_fixture;
+using test::ssh::session_fixture;
+
+using boost::filesystem::path;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::milliseconds;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
+using boost::uintmax_t;
+
+using std::istringstream;
+using std::ostringstream;
+using std::runtime_error;
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace {
+
+    /**
+     * Data that isn't the same from one block to the next so that blocks
+     * written out of order or twice would be noticed.
+     */
+    string test_data(size_t size)
+    {
+        string data;
+        data.reserve(size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            data.push_back(static_cast<char>((i * 7) ^ (i >> 11)));
+        }
+
+        return data;
+    }
+
+    /**
+     * Source that gives back very little at a time, as pipes and some shell
+     * streams do.
+     */
+    class trickling_source : public byte_source
+    {
+    public:
+        explicit trickling_source(const string& data)
+            : m_data(data), m_position(0) {}
+
+        virtual size_t read(char* buffer, size_t size)
+        {
+            size_t count = (std::min)(
+                (std::min)(size, size_t(1000)), m_data.size() - m_position);
+            m_data.copy(buffer, count, m_position);
+            m_position += count;
+            return count;
+        }
+
+    private:
+        string m_data;
+        size_t m_position;
+    };
+
+    /**
+     * Sink noting which thread wrote each block.
+     */
+    class thread_recording_sink : public byte_sink
+    {
+    public:
+        virtual void write(const char*, size_t)
+        {
+            writers.push_back(boost::this_thread::get_id());
+        }
+
+        vector<boost::thread::id> writers;
+    };
+
+    /**
+     * Source and sink that show whether reading and writing overlap.
+     *
+     * The sink holds up writing the first block until the source has been
+     * asked for data beyond it, which only happens if the next block is
+     * read while the first is still being written.
+     */
+    class overlap_probe : private boost::noncopyable
+    {
+    public:
+
+        class source : public byte_source
+        {
+        public:
+            source(overlap_probe& probe, const string& data)
+                : m_probe(probe), m_data(data), m_position(0) {}
+
+            virtual size_t read(char* buffer, size_t size)
+            {
+                size_t count = (std::min)(size, m_data.size() - m_position);
+                m_data.copy(buffer, count, m_position);
+                m_position += count;
+                m_probe.bytes_read(m_position);
+                return count;
+            }
+
+        private:
+            overlap_probe& m_probe;
+            string m_data;
+            size_t m_position;
+        };
+
+        class sink : public byte_sink
+        {
+        public:
+            explicit sink(overlap_probe& probe) : m_probe(probe) {}
+
+            virtual void write(const char* data, size_t size)
+            {
+                if (written.empty())
+                    m_probe.wait_for_read_beyond(size);
+
+                written.append(data, size);
+            }
+
+            string written;
+
+        private:
+            overlap_probe& m_probe;
+        };
+
+        overlap_probe() : m_bytes_read(0), m_overlapped(false) {}
+
+        bool overlapped() const
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            return m_overlapped;
+        }
+
+    private:
+
+        void bytes_read(size_t total)
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_bytes_read = total;
+            m_changed.notify_all();
+        }
+
+        void wait_for_read_beyond(size_t size)
+        {
+            // Only bounded so that a transfer that doesn't overlap fails
+            // instead of hanging
+            boost::system_time give_up =
+                boost::get_system_time() + boost::posix_time::seconds(10);
+
+            boost::mutex::scoped_lock lock(m_mutex);
+            while (m_bytes_read <= size)
+            {
+                if (!m_changed.timed_wait(lock, give_up))
+                    return;
+            }
+
+            m_overlapped = true;
+        }
+
+        mutable boost::mutex m_mutex;
+        boost::condition_variable m_changed;
+        size_t m_bytes_read;
+        bool m_overlapped;
+    };
+
+    class failing_source : public byte_source
+    {
+    public:
+        virtual size_t read(char*, size_t)
+        {
+            BOOST_THROW_EXCEPTION(runtime_error("source failed"));
+        }
+    };
+
+    /**
+     * Sink recording the size of every block and taking its time over
+     * each.
+     */
+    class slow_sink : public byte_sink
+    {
+    public:
+        explicit slow_sink(time_duration delay, size_t fail_after=0)
+            : m_delay(delay), m_fail_after(fail_after) {}
+
+        virtual void write(const char* data, size_t size)
+        {
+            if (m_fail_after != 0 && blocks.size() == m_fail_after)
+                BOOST_THROW_EXCEPTION(runtime_error("sink failed"));
+
+            boost::this_thread::sleep(m_delay);
+
+            blocks.push_back(size);
+            written.append(data, size);
+        }
+
+        vector<size_t> blocks;
+        string written;
+
+    private:
+        time_duration m_delay;
+        size_t m_fail_after;
+    };
+
+    /**
+     * Options that adapt quickly enough to see in a test.
+     */
+    transfer_options small_blocks()
+    {
+        transfer_options options;
+        options.initial_block_size = 4096;
+        options.min_block_size = 1024;
+        options.max_block_size = 64 * 1024;
+        options.target_block_time = milliseconds(20);
+        return options;
+    }
+
+    class progress_recorder
+    {
+    public:
+        explicit progress_recorder(vector<uintmax_t>& reports)
+            : m_reports(reports) {}
+
+        void operator()(uintmax_t done)
+        {
+            m_reports.push_back(done);
+        }
+
+    private:
+        vector<uintmax_t>& m_reports;
+    };
+
+    struct cancelled {};
+
+    class cancel_after
+    {
+    public:
+        explicit cancel_after(uintmax_t bytes) : m_bytes(bytes) {}
+
+        void operator()(uintmax_t done)
+        {
+            if (done >= m_bytes)
+                throw cancelled();
+        }
+
+    private:
+        uintmax_t m_bytes;
+    };
+
+    /**
+     * Copy the old way: read a block, write it, repeat.
+     */
+    uintmax_t alternating_copy(
+        byte_source& source, byte_sink& sink, size_t block_size)
+    {
+        vector<char> buffer(block_size);
+        uintmax_t total = 0;
+        for (;;)
+        {
+            size_t count = source.read(&buffer[0], buffer.size());
+            if (count == 0)
+                break;
+
+            sink.write(&buffer[0], count);
+            total += count;
+        }
+
+        return total;
+    }
+
+    double megabytes_per_second(uintmax_t bytes, time_duration duration)
+    {
+        double seconds = (std::max)(
+            duration.total_microseconds(), time_duration::tick_type(1)) /
+            1000000.0;
+        return (bytes / (1024.0 * 1024.0)) / seconds;
+    }
+
+    class remote_fixture : public session_fixture, public sandbox_fixture
+    {
+    public:
+
+        remote_fixture() : m_filesystem(auth_and_open_sftp())
+        {}
+
+        sftp_filesystem& filesystem()
+        {
+            return m_filesystem;
+        }
+
+    private:
+
+        sftp_filesystem auth_and_open_sftp()
+        {
+            session& s = test_session();
+            s.authenticate_by_key_files(
+                user(), public_key_path(), private_key_path(), "");
+
+            return s.connect_to_filesystem();
+        }
+
+        sftp_filesystem m_filesystem;
+    };
+}
+
+BOOST_AUTO_TEST_SUITE(block_transfer_tests)
+
+BOOST_AUTO_TEST_CASE( empty_source )
+{
+    istringstream in("");
+    ostringstream out;
+    istream_source source(in);
+    ostream_sink sink(out);
+
+    transfer_engine engine;
+    BOOST_CHECK_EQUAL(engine.transfer(source, sink), 0U);
+    BOOST_CHECK(out.str().empty());
+}
+
+BOOST_AUTO_TEST_CASE( copies_exactly )
+{
+    // Sizes either side of block boundaries, and many blocks
+    size_t sizes[] = { 1, 4095, 4096, 4097, 3 * 4096, 1000 * 1000 };
+
+    transfer_engine engine(small_blocks());
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        string data = test_data(sizes[i]);
+
+        istringstream in(data);
+        ostringstream out;
+        istream_source source(in);
+        ostream_sink sink(out);
+
+        // Same engine every time to check buffers are reused cleanly
+        BOOST_CHECK_EQUAL(engine.transfer(source, sink), sizes[i]);
+        BOOST_CHECK(out.str() == data);
+    }
+}
+
+/**
+ * Data that fits in one block is written without starting a writer thread.
+ */
+BOOST_AUTO_TEST_CASE( single_block_written_on_calling_thread )
+{
+    string data = test_data(small_blocks().initial_block_size - 1);
+    istringstream in(data);
+    istream_source source(in);
+    thread_recording_sink sink;
+
+    vector<uintmax_t> reports;
+    transfer_engine engine(small_blocks());
+    BOOST_CHECK_EQUAL(
+        engine.transfer(source, sink, progress_recorder(reports)),
+        data.size());
+
+    BOOST_REQUIRE_EQUAL(sink.writers.size(), 1U);
+    BOOST_CHECK(sink.writers[0] == boost::this_thread::get_id());
+
+    BOOST_REQUIRE(!reports.empty());
+    BOOST_CHECK_EQUAL(reports.back(), data.size());
+}
+
+/**
+ * Data filling more than one block is written on another thread.
+ */
+BOOST_AUTO_TEST_CASE( several_blocks_written_on_writer_thread )
+{
+    string data = test_data(small_blocks().initial_block_size * 3);
+    istringstream in(data);
+    istream_source source(in);
+    thread_recording_sink sink;
+
+    transfer_engine engine(small_blocks());
+    engine.transfer(source, sink);
+
+    BOOST_REQUIRE(!sink.writers.empty());
+    BOOST_CHECK(sink.writers[0] != boost::this_thread::get_id());
+}
+
+/**
+ * The next block is read while the last one is still being written.
+ */
+BOOST_AUTO_TEST_CASE( reads_while_writing )
+{
+    transfer_options options = small_blocks();
+    options.min_block_size = options.initial_block_size;
+    options.max_block_size = options.initial_block_size;
+
+    string data = test_data(options.initial_block_size * 3);
+    overlap_probe probe;
+    overlap_probe::source source(probe, data);
+    overlap_probe::sink sink(probe);
+
+    transfer_engine engine(options);
+    engine.transfer(source, sink);
+
+    BOOST_CHECK(probe.overlapped());
+    BOOST_CHECK(sink.written == data);
+}
+
+BOOST_AUTO_TEST_CASE( short_reads_fill_blocks )
+{
+    string data = test_data(100 * 1000);
+    trickling_source source(data);
+    slow_sink sink(milliseconds(0));
+
+    transfer_options options = small_blocks();
+    options.max_block_size = options.initial_block_size;
+    transfer_engine engine(options);
+    engine.transfer(source, sink);
+
+    BOOST_CHECK(sink.written == data);
+
+    // All but the last block are full, despite the source's short reads
+    for (size_t i = 0; i + 1 < sink.blocks.size(); ++i)
+    {
+        BOOST_CHECK_EQUAL(sink.blocks[i], options.initial_block_size);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( fast_sink_grows_blocks )
+{
+    string data = test_data(2 * 1000 * 1000);
+    istringstream in(data);
+    istream_source source(in);
+    slow_sink sink(milliseconds(0));
+
+    transfer_engine engine(small_blocks());
+    engine.transfer(source, sink);
+
+    BOOST_CHECK(sink.written == data);
+    BOOST_CHECK_EQUAL(engine.block_size(), small_blocks().max_block_size);
+    BOOST_CHECK_GT(sink.blocks.back(), sink.blocks.front());
+}
+
+BOOST_AUTO_TEST_CASE( slow_sink_shrinks_blocks )
+{
+    string data = test_data(50 * 1000);
+    istringstream in(data);
+    istream_source source(in);
+    slow_sink sink(milliseconds(100));
+
+    transfer_engine engine(small_blocks());
+    engine.transfer(source, sink);
+
+    BOOST_CHECK(sink.written == data);
+    BOOST_CHECK_EQUAL(engine.block_size(), small_blocks().min_block_size);
+}
+
+BOOST_AUTO_TEST_CASE( progress_reported )
+{
+    string data = test_data(500 * 1000);
+    istringstream in(data);
+    istream_source source(in);
+    slow_sink sink(milliseconds(5));
+
+    vector<uintmax_t> reports;
+    transfer_engine engine(small_blocks());
+    engine.transfer(source, sink, progress_recorder(reports));
+
+    BOOST_REQUIRE(!reports.empty());
+    BOOST_CHECK_EQUAL(reports.back(), data.size());
+    for (size_t i = 1; i < reports.size(); ++i)
+    {
+        BOOST_CHECK_LE(reports[i - 1], reports[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( progress_can_cancel )
+{
+    string data = test_data(1000 * 1000);
+    istringstream in(data);
+    istream_source source(in);
+    slow_sink sink(milliseconds(5));
+
+    transfer_engine engine(small_blocks());
+    BOOST_CHECK_THROW(
+        engine.transfer(source, sink, cancel_after(10000)), cancelled);
+    BOOST_CHECK_LT(sink.written.size(), data.size());
+}
+
+BOOST_AUTO_TEST_CASE( source_error )
+{
+    failing_source source;
+    slow_sink sink(milliseconds(0));
+
+    transfer_engine engine;
+    BOOST_CHECK_THROW(engine.transfer(source, sink), runtime_error);
+    BOOST_CHECK(sink.blocks.empty());
+}
+
+BOOST_AUTO_TEST_CASE( sink_error )
+{
+    string data = test_data(1000 * 1000);
+    istringstream in(data);
+    istream_source source(in);
+    slow_sink sink(milliseconds(0), 2);
+
+    transfer_engine engine(small_blocks());
+    BOOST_CHECK_THROW(engine.transfer(source, sink), runtime_error);
+    BOOST_CHECK_EQUAL(sink.blocks.size(), 2U);
+
+    // The engine is still usable afterwards
+    istringstream in2(data);
+    istream_source source2(in2);
+    slow_sink sink2(milliseconds(0));
+    engine.transfer(source2, sink2);
+    BOOST_CHECK(sink2.written == data);
+}
+
+BOOST_AUTO_TEST_CASE( bad_options )
+{
+    transfer_options one_buffer;
+    one_buffer.buffer_count = 1;
+    BOOST_CHECK_THROW(
+        transfer_engine engine(one_buffer), std::invalid_argument);
+
+    transfer_options inverted;
+    inverted.min_block_size = inverted.max_block_size + 1;
+    BOOST_CHECK_THROW(
+        transfer_engine engine(inverted), std::invalid_argument);
+}
+
+BOOST_FIXTURE_TEST_SUITE(remote_tests, remote_fixture)
+
+/**
+ * Local file to SFTP file.
+ */
+BOOST_AUTO_TEST_CASE( local_file_to_sftp_ofstream )
+{
+    string data = test_data(16 * 1024 * 1024);
+
+    path local = new_file_in_sandbox();
+    {
+        boost::filesystem::ofstream out(local, std::ios::binary);
+        out.write(data.data(), data.size());
+    }
+
+    path remote = new_file_in_sandbox();
+
+    {
+        boost::filesystem::ifstream in(local, std::ios::binary);
+        ssh::filesystem::ofstream out(filesystem(), to_remote_path(remote));
+
+        istream_source source(in);
+        ostream_sink sink(out);
+
+        transfer_engine engine;
+        engine.transfer(source, sink);
+    }
+
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(remote), data.size());
+
+    boost::filesystem::ifstream check(remote, std::ios::binary);
+    string copied(
+        (std::istreambuf_iterator<char>(check)),
+        std::istreambuf_iterator<char>());
+    BOOST_CHECK(copied == data);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+/**
+ * Overlapped transfer against the old alternating copy, with a sink about
+ * as fast as the source so both matter.
+ */
+BOOST_AUTO_TEST_CASE( overlap_timing )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    string data = test_data(8 * 1024 * 1024);
+
+    transfer_options options;
+    options.initial_block_size = 256 * 1024;
+    options.min_block_size = options.initial_block_size;
+    options.max_block_size = options.initial_block_size;
+
+    // Both sides take ~5ms a block
+    class slow_source : public istream_source
+    {
+    public:
+        explicit slow_source(std::istream& in) : istream_source(in) {}
+
+        virtual size_t read(char* buffer, size_t size)
+        {
+            boost::this_thread::sleep(milliseconds(5));
+            return istream_source::read(buffer, size);
+        }
+    };
+
+    istringstream in1(data);
+    slow_source source1(in1);
+    slow_sink sink1(milliseconds(5));
+    ptime start = microsec_clock::universal_time();
+    alternating_copy(source1, sink1, options.initial_block_size);
+    time_duration alternating = microsec_clock::universal_time() - start;
+
+    istringstream in2(data);
+    slow_source source2(in2);
+    slow_sink sink2(milliseconds(5));
+    transfer_engine engine(options);
+    start = microsec_clock::universal_time();
+    engine.transfer(source2, sink2);
+    time_duration overlapped = microsec_clock::universal_time() - start;
+
+    BOOST_CHECK(sink2.written == data);
+
+    BOOST_TEST_MESSAGE(
+        "Alternating: " << megabytes_per_second(data.size(), alternating)
+        << " MB/s, overlapped: "
+        << megabytes_per_second(data.size(), overlapped) << " MB/s");
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE_END();
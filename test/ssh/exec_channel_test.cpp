@@ -0,0 +1,142 @@
+/**
+    @file
+
+    Tests for running commands on the server.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#include "session_fixture.hpp" // session_fixture
+
+#include <ssh/exec_channel.hpp> // test subject
+#include <ssh/session.hpp>
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef> // size_t
+#include <string>
+
+using ssh::exec_channel;
+using ssh::session;
+
+using test::ssh::session_fixture;
+
+using std::string;
+
+namespace {
+
+    class exec_fixture : public session_fixture
+    {
+    public:
+
+        session& authenticated_session()
+        {
+            session& s = test_session();
+            s.authenticate_by_key_files(
+                user(), public_key_path(), private_key_path(), "");
+            return s;
+        }
+    };
+}
+
+BOOST_FIXTURE_TEST_SUITE(exec_channel_tests, exec_fixture)
+
+BOOST_AUTO_TEST_CASE( output )
+{
+    exec_channel command = authenticated_session().execute("echo hello");
+
+    BOOST_CHECK_EQUAL(command.wait_for_exit(), 0);
+    BOOST_CHECK_EQUAL(command.output(), "hello\n");
+    BOOST_CHECK(command.error_output().empty());
+}
+
+BOOST_AUTO_TEST_CASE( error_output_kept_apart )
+{
+    exec_channel command =
+        authenticated_session().execute("echo out; echo err >&2");
+
+    BOOST_CHECK_EQUAL(command.wait_for_exit(), 0);
+    BOOST_CHECK_EQUAL(command.output(), "out\n");
+    BOOST_CHECK_EQUAL(command.error_output(), "err\n");
+}
+
+BOOST_AUTO_TEST_CASE( exit_status )
+{
+    exec_channel command = authenticated_session().execute("exit 3");
+
+    BOOST_CHECK_EQUAL(command.wait_for_exit(), 3);
+
+    // Asking again doesn't wait again
+    BOOST_CHECK_EQUAL(command.wait_for_exit(), 3);
+}
+
+BOOST_AUTO_TEST_CASE( input )
+{
+    exec_channel command = authenticated_session().execute("cat");
+
+    // More than fits in one packet
+    string data(100000, 'x');
+    data += "end";
+
+    command.write(data.data(), data.size());
+
+    BOOST_CHECK_EQUAL(command.wait_for_exit(), 0);
+    BOOST_CHECK(command.output() == data);
+}
+
+BOOST_AUTO_TEST_CASE( streamed_output )
+{
+    exec_channel command = authenticated_session().execute(
+        "head -c 100000 /dev/zero");
+
+    string data;
+    char buffer[4096];
+    while (std::size_t count = command.read(buffer, sizeof(buffer)))
+    {
+        data.append(buffer, count);
+    }
+
+    BOOST_CHECK_EQUAL(data.size(), 100000U);
+    BOOST_CHECK_EQUAL(command.wait_for_exit(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( one_after_another )
+{
+    session& s = authenticated_session();
+
+    for (int i = 0; i < 5; ++i)
+    {
+        exec_channel command = s.execute("true");
+        BOOST_CHECK_EQUAL(command.wait_for_exit(), 0);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
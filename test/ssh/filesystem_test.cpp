@@ -39,10 +39,15 @@
 
 #include <ssh/filesystem.hpp> // test subject
 
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
+#include <boost/algorithm/string/predicate.hpp> // equals
 #include <boost/bind.hpp> // bind
 #include <boost/cstdint.hpp> // uintmax_t
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
 #include <boost/filesystem/fstream.hpp> // ofstream
 #include <boost/foreach.hpp> // BOOST_FOREACH
+#include <boost/lexical_cast.hpp>
 #include <boost/move/move.hpp>
 #include <boost/system/system_error.hpp>
 #include <boost/test/predicate_result.hpp>
@@ -50,32 +55,49 @@
 #include <boost/thread/future.hpp>
 #include <boost/thread/thread.hpp>
 
-#include <algorithm> // find
+#include <algorithm> // copy, find
+#include <iterator> // back_inserter
+#include <stdexcept> // invalid_argument
 #include <string>
+#include <vector>
 
 using ssh::session;
+using ssh::filesystem::attribute_cache_options;
+using ssh::filesystem::attribute_cache_statistics;
+using ssh::filesystem::attributes_result;
 using ssh::filesystem::file_attributes;
 using ssh::filesystem::sftp_filesystem;
 using ssh::filesystem::sftp_file;
 using ssh::filesystem::directory_iterator;
 using ssh::filesystem::overwrite_behaviour;
 
+using boost::algorithm::equals;
 using boost::bind;
 using boost::filesystem::ofstream;
 using boost::filesystem::path;
+using boost::lexical_cast;
 using boost::move;
 using boost::packaged_task;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::milliseconds;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
 using boost::system::system_error;
 using boost::test_tools::predicate_result;
 using boost::thread;
+using boost::this_thread::sleep;
 using boost::uintmax_t;
 
 using test::ssh::sandbox_fixture;
 using test::ssh::session_fixture;
 
 using std::auto_ptr;
+using std::back_inserter;
+using std::copy;
 using std::find;
+using std::size_t;
 using std::string;
+using std::vector;
 
 namespace {
 
@@ -382,6 +404,59 @@ BOOST_AUTO_TEST_CASE( dir_with_multiple_files )
     BOOST_CHECK(it == filesystem().directory_iterator());
 }
 
+/**
+ * Listing a directory must not allocate memory for each entry.
+ */
+BOOST_AUTO_TEST_CASE( large_dir_listing_allocations )
+{
+    const size_t file_count = 2000;
+    for (size_t i = 0; i < file_count; ++i)
+    {
+        new_file_in_sandbox();
+    }
+
+    directory_iterator it =
+        filesystem().directory_iterator(to_remote_path(sandbox()));
+    directory_iterator end = filesystem().directory_iterator();
+
+    size_t entry_count = 0;
+    while (it != end)
+    {
+        if (!equals(it->name_view(), ".") && !equals(it->name_view(), ".."))
+        {
+            ++entry_count;
+        }
+
+        ++it;
+    }
+
+    BOOST_CHECK_EQUAL(entry_count, file_count);
+    BOOST_CHECK_LT(it.storage_allocations(), file_count / 100);
+}
+
+/**
+ * Views of entries must stay valid after the iterator moves on.
+ */
+BOOST_AUTO_TEST_CASE( entry_outlives_iteration )
+{
+    path test_file = new_file_in_sandbox();
+
+    vector<sftp_file> files;
+    {
+        directory_iterator it =
+            filesystem().directory_iterator(to_remote_path(sandbox()));
+        copy(it, filesystem().directory_iterator(), back_inserter(files));
+    }
+
+    BOOST_REQUIRE_EQUAL(files.size(), 3U);
+    BOOST_CHECK_EQUAL(files[0].name(), ".");
+    BOOST_CHECK_EQUAL(files[1].name(), "..");
+    BOOST_CHECK_EQUAL(files[2].name(), test_file.filename());
+    BOOST_CHECK(
+        files[2].path() == to_remote_path(sandbox()) / test_file.filename());
+    BOOST_CHECK_GT(files[2].long_entry().size(), 0U);
+}
+
 BOOST_AUTO_TEST_CASE( move_construct_iterator )
 {
     path test_file1 = new_file_in_sandbox();
@@ -574,6 +649,220 @@ BOOST_AUTO_TEST_CASE( attributes_broken_link )
         filesystem().attributes(to_remote_path(link), true), system_error);
 }
 
+/**
+ * Missing files get an error without stopping the files around them.
+ */
+BOOST_AUTO_TEST_CASE( attributes_batch )
+{
+    path file = new_file_in_sandbox();
+    path directory = new_directory_in_sandbox();
+
+    vector<path> files;
+    files.push_back(to_remote_path(file));
+    files.push_back(to_remote_path(sandbox() / "missing"));
+    files.push_back(to_remote_path(directory));
+
+    vector<attributes_result> results = filesystem().attributes(files, false);
+
+    BOOST_REQUIRE_EQUAL(results.size(), 3U);
+
+    BOOST_REQUIRE(results[0].attributes);
+    BOOST_CHECK(!results[0].error);
+    BOOST_CHECK_EQUAL(
+        results[0].attributes->type(), file_attributes::normal_file);
+
+    BOOST_CHECK(!results[1].attributes);
+    BOOST_CHECK(results[1].error);
+
+    BOOST_REQUIRE(results[2].attributes);
+    BOOST_CHECK_EQUAL(
+        results[2].attributes->type(), file_attributes::directory);
+}
+
+BOOST_AUTO_TEST_CASE( attributes_batch_link )
+{
+    path target = new_file_in_sandbox();
+    path link = sandbox() / "link";
+    create_symlink(link, target);
+
+    vector<path> files(1, to_remote_path(link));
+
+    vector<attributes_result> results = filesystem().attributes(files, false);
+
+    BOOST_REQUIRE(results[0].attributes);
+    BOOST_CHECK_EQUAL(
+        results[0].attributes->type(), file_attributes::symbolic_link);
+
+    results = filesystem().attributes(files, true);
+
+    BOOST_REQUIRE(results[0].attributes);
+    BOOST_CHECK_EQUAL(
+        results[0].attributes->type(), file_attributes::normal_file);
+}
+
+BOOST_AUTO_TEST_CASE( attributes_batch_nothing )
+{
+    BOOST_CHECK(filesystem().attributes(vector<path>(), false).empty());
+}
+
+BOOST_AUTO_TEST_CASE( attributes_batch_zero_window )
+{
+    vector<path> files(1, to_remote_path(sandbox()));
+
+    BOOST_CHECK_THROW(
+        filesystem().attributes(files, false, 0), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE( attribute_cache_off_by_default )
+{
+    path file = to_remote_path(new_file_in_sandbox());
+
+    filesystem().attributes(file, false);
+    filesystem().attributes(file, false);
+
+    attribute_cache_statistics statistics = filesystem().cache_statistics();
+    BOOST_CHECK_EQUAL(statistics.hits, 0U);
+    BOOST_CHECK_EQUAL(statistics.misses, 0U);
+}
+
+BOOST_AUTO_TEST_CASE( attribute_cache_hit )
+{
+    filesystem().cache_attributes();
+
+    path file = to_remote_path(new_file_in_sandbox());
+
+    filesystem().attributes(file, false);
+    file_attributes attrs = filesystem().attributes(file, false);
+
+    BOOST_CHECK_EQUAL(attrs.type(), file_attributes::normal_file);
+    BOOST_CHECK_EQUAL(filesystem().cache_statistics().hits, 1U);
+    BOOST_CHECK_EQUAL(filesystem().cache_statistics().misses, 1U);
+}
+
+BOOST_AUTO_TEST_CASE( attribute_cache_filled_by_listing )
+{
+    filesystem().cache_attributes();
+
+    vector<path> files;
+    files.push_back(to_remote_path(new_file_in_sandbox()));
+    files.push_back(to_remote_path(new_file_in_sandbox()));
+    files.push_back(to_remote_path(new_directory_in_sandbox()));
+
+    for (directory_iterator it =
+            filesystem().directory_iterator(to_remote_path(sandbox()));
+        it != filesystem().directory_iterator(); ++it)
+    {}
+
+    BOOST_FOREACH(const path& file, files)
+    {
+        BOOST_CHECK(ssh::filesystem::exists(filesystem(), file));
+    }
+
+    BOOST_CHECK_EQUAL(filesystem().cache_statistics().hits, files.size());
+    BOOST_CHECK_EQUAL(filesystem().cache_statistics().misses, 0U);
+}
+
+/**
+ * A link's own attributes don't say what it leads to.
+ */
+BOOST_AUTO_TEST_CASE( attribute_cache_follows_links )
+{
+    filesystem().cache_attributes();
+
+    path target = new_file_in_sandbox();
+    path link = sandbox() / "link";
+    create_symlink(link, target);
+
+    file_attributes attrs =
+        filesystem().attributes(to_remote_path(link), false);
+    BOOST_CHECK_EQUAL(attrs.type(), file_attributes::symbolic_link);
+
+    attrs = filesystem().attributes(to_remote_path(link), true);
+    BOOST_CHECK_EQUAL(attrs.type(), file_attributes::normal_file);
+}
+
+BOOST_AUTO_TEST_CASE( attribute_cache_remembers_missing )
+{
+    attribute_cache_options options;
+    options.negative_lifetime = milliseconds(500);
+    filesystem().cache_attributes(options);
+
+    path file = sandbox() / "not_there_yet";
+
+    BOOST_CHECK(!ssh::filesystem::exists(filesystem(), to_remote_path(file)));
+
+    // Created behind the filesystem's back so it can't know
+    ofstream(file).close();
+
+    BOOST_CHECK(!ssh::filesystem::exists(filesystem(), to_remote_path(file)));
+    BOOST_CHECK_EQUAL(filesystem().cache_statistics().hits, 1U);
+
+    sleep(milliseconds(600));
+
+    BOOST_CHECK(ssh::filesystem::exists(filesystem(), to_remote_path(file)));
+}
+
+BOOST_AUTO_TEST_CASE( attribute_cache_max_staleness )
+{
+    attribute_cache_options options;
+    options.max_staleness = milliseconds(500);
+    filesystem().cache_attributes(options);
+
+    path file = new_file_in_sandbox();
+    filesystem().attributes(to_remote_path(file), false);
+
+    // Removed behind the filesystem's back so it can't know
+    remove(file);
+
+    BOOST_CHECK(ssh::filesystem::exists(filesystem(), to_remote_path(file)));
+
+    sleep(milliseconds(600));
+
+    BOOST_CHECK(!ssh::filesystem::exists(filesystem(), to_remote_path(file)));
+}
+
+BOOST_AUTO_TEST_CASE( attribute_cache_invalidated_by_changes )
+{
+    filesystem().cache_attributes();
+
+    path file = to_remote_path(new_file_in_sandbox());
+    path directory = to_remote_path(sandbox() / "new" / "directory");
+
+    BOOST_CHECK(ssh::filesystem::exists(filesystem(), file));
+    BOOST_CHECK(!ssh::filesystem::exists(filesystem(), directory));
+    BOOST_CHECK(
+        !ssh::filesystem::exists(filesystem(), directory.parent_path()));
+
+    filesystem().remove(file);
+    filesystem().create_directories(directory);
+
+    BOOST_CHECK(!ssh::filesystem::exists(filesystem(), file));
+    BOOST_CHECK(ssh::filesystem::exists(filesystem(), directory));
+    BOOST_CHECK(
+        ssh::filesystem::exists(filesystem(), directory.parent_path()));
+}
+
+/**
+ * Only what the cache can't answer goes to the server.
+ */
+BOOST_AUTO_TEST_CASE( attribute_cache_batch )
+{
+    filesystem().cache_attributes();
+
+    vector<path> files;
+    files.push_back(to_remote_path(new_file_in_sandbox()));
+    files.push_back(to_remote_path(new_file_in_sandbox()));
+
+    filesystem().attributes(files[0], false);
+
+    vector<attributes_result> results = filesystem().attributes(files, false);
+
+    BOOST_CHECK(results[0].attributes);
+    BOOST_CHECK(results[1].attributes);
+    BOOST_CHECK_EQUAL(filesystem().cache_statistics().hits, 1U);
+    BOOST_CHECK_EQUAL(filesystem().cache_statistics().misses, 2U);
+}
+
 BOOST_AUTO_TEST_CASE( default_directory )
 {
     path resolved_target = filesystem().canonical_path("");
@@ -690,6 +979,198 @@ BOOST_AUTO_TEST_CASE( remove_link_recursive )
     BOOST_CHECK_EQUAL(count, 1U);
 }
 
+namespace {
+
+    /**
+     * Removal progress callback that records what it's told and cancels
+     * after a given number of items.
+     */
+    class recording_progress
+    {
+    public:
+
+        recording_progress(
+            vector<path>& removed, size_t cancel_after=size_t(-1))
+            : m_removed(removed), m_cancel_after(cancel_after) {}
+
+        bool operator()(const path& item)
+        {
+            m_removed.push_back(item);
+            return m_removed.size() < m_cancel_after;
+        }
+
+    private:
+        vector<path>& m_removed;
+        size_t m_cancel_after;
+    };
+
+}
+
+BOOST_AUTO_TEST_CASE( remove_nothing_pipelined )
+{
+    path target = "gibberish";
+
+    uintmax_t count = filesystem().remove_all(to_remote_path(target), 4);
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 0U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_file_pipelined )
+{
+    path target = new_file_in_sandbox();
+
+    uintmax_t count = filesystem().remove_all(to_remote_path(target), 4);
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 1U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_empty_dir_pipelined )
+{
+    path target = new_directory_in_sandbox();
+
+    uintmax_t count = filesystem().remove_all(to_remote_path(target), 4);
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 1U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_non_empty_dir_pipelined )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "bob");
+    ofstream(target / "bob" / "sally");
+    ofstream(target / "alice"); // Either side of bob alphabetically
+    ofstream(target / "jim");
+
+    vector<path> removed;
+    uintmax_t count = filesystem().remove_all(
+        to_remote_path(target), 4, recording_progress(removed));
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 5U);
+    BOOST_REQUIRE_EQUAL(removed.size(), 5U);
+
+    // Directories must go after everything in them
+    BOOST_CHECK(removed.back() == to_remote_path(target));
+    BOOST_CHECK(
+        find(removed.begin(), removed.end(),
+            to_remote_path(target / "bob" / "sally")) <
+        find(removed.begin(), removed.end(),
+            to_remote_path(target / "bob")));
+}
+
+BOOST_AUTO_TEST_CASE( remove_link_pipelined )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "bob");
+    path link = sandbox() / "link";
+    create_symlink(link, target);
+
+    uintmax_t count = filesystem().remove_all(to_remote_path(link), 4);
+
+    BOOST_CHECK(!exists(link));
+    BOOST_CHECK(exists(target)); // should only delete the link
+    BOOST_CHECK(exists(target / "bob")); // should only delete the link
+    BOOST_CHECK_EQUAL(count, 1U);
+}
+
+/**
+ * Links inside the tree are removed, not followed.
+ */
+BOOST_AUTO_TEST_CASE( remove_dir_containing_link_pipelined )
+{
+    path outside = new_directory_in_sandbox();
+    ofstream(outside / "keep");
+
+    path target = new_directory_in_sandbox();
+    create_symlink(target / "link", outside);
+
+    uintmax_t count = filesystem().remove_all(to_remote_path(target), 4);
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK(exists(outside / "keep"));
+    BOOST_CHECK_EQUAL(count, 2U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_deep_tree_pipelined )
+{
+    path target = new_directory_in_sandbox();
+
+    path directory = target;
+    size_t expected = 1U;
+    for (int depth = 0; depth < 10; ++depth)
+    {
+        for (int i = 0; i < 20; ++i)
+        {
+            ofstream(directory / ("file" + lexical_cast<string>(i)));
+            ++expected;
+        }
+
+        create_directory(directory / "a");
+        create_directory(directory / "b");
+        ofstream(directory / "b" / "leaf");
+        expected += 3;
+
+        directory /= "a";
+    }
+
+    vector<path> removed;
+    uintmax_t count = filesystem().remove_all(
+        to_remote_path(target), 8, recording_progress(removed));
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, expected);
+    BOOST_CHECK_EQUAL(removed.size(), expected);
+}
+
+BOOST_AUTO_TEST_CASE( remove_pipelined_cancel )
+{
+    path target = new_directory_in_sandbox();
+    for (int i = 0; i < 50; ++i)
+    {
+        ofstream(target / ("file" + lexical_cast<string>(i)));
+    }
+
+    vector<path> removed;
+    BOOST_CHECK_THROW(
+        filesystem().remove_all(
+            to_remote_path(target), 4, recording_progress(removed, 3)),
+        system_error);
+
+    // Told about nothing after it said stop
+    BOOST_CHECK_EQUAL(removed.size(), 3U);
+    BOOST_CHECK(exists(target));
+    BOOST_CHECK(!directory_is_empty(filesystem(), to_remote_path(target)));
+}
+
+/**
+ * A depth of one is the old one-at-a-time behaviour, just via the pipeline.
+ */
+BOOST_AUTO_TEST_CASE( remove_pipelined_single_channel )
+{
+    path target = new_directory_in_sandbox();
+    create_directory(target / "bob");
+    ofstream(target / "bob" / "sally");
+    ofstream(target / "alice");
+
+    uintmax_t count = filesystem().remove_all(to_remote_path(target), 1);
+
+    BOOST_CHECK(!exists(target));
+    BOOST_CHECK_EQUAL(count, 4U);
+}
+
+BOOST_AUTO_TEST_CASE( remove_pipelined_zero_depth )
+{
+    path target = new_directory_in_sandbox();
+
+    BOOST_CHECK_THROW(
+        filesystem().remove_all(to_remote_path(target), 0),
+        std::invalid_argument);
+    BOOST_CHECK(exists(target));
+}
+
 BOOST_AUTO_TEST_CASE( rename_file )
 {
     path test_file = new_file_in_sandbox();
@@ -792,6 +1273,218 @@ BOOST_AUTO_TEST_CASE( new_directory_already_there_wrong_type )
     BOOST_CHECK(!is_directory(target));
 }
 
+BOOST_AUTO_TEST_CASE( new_directories_one_level )
+{
+    path target = sandbox() / "new";
+
+    BOOST_CHECK(filesystem().create_directories(to_remote_path(target)));
+    BOOST_CHECK(is_directory(target));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_many_levels )
+{
+    path target = sandbox() / "a" / "b" / "c" / "d";
+
+    BOOST_CHECK(filesystem().create_directories(to_remote_path(target)));
+    BOOST_CHECK(is_directory(target));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_already_there )
+{
+    path target = new_directory_in_sandbox();
+
+    BOOST_CHECK(!filesystem().create_directories(to_remote_path(target)));
+    BOOST_CHECK(is_directory(target));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_through_file )
+{
+    path file = new_file_in_sandbox();
+
+    BOOST_CHECK_THROW(
+        filesystem().create_directories(to_remote_path(file / "a" / "b")),
+        system_error);
+    BOOST_CHECK(exists(file));
+    BOOST_CHECK(!is_directory(file));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_already_there_wrong_type )
+{
+    path target = new_file_in_sandbox();
+
+    BOOST_CHECK_THROW(
+        filesystem().create_directories(to_remote_path(target)),
+        system_error);
+    BOOST_CHECK(!is_directory(target));
+}
+
+/**
+ * A tree, given in no particular order, with some branches whose parents
+ * aren't in the list.
+ */
+BOOST_AUTO_TEST_CASE( new_directories_pipelined )
+{
+    vector<path> targets;
+    targets.push_back(to_remote_path(sandbox() / "a" / "b" / "c"));
+    targets.push_back(to_remote_path(sandbox() / "a"));
+    targets.push_back(to_remote_path(sandbox() / "x" / "y"));
+    targets.push_back(to_remote_path(sandbox() / "a" / "b"));
+    targets.push_back(to_remote_path(sandbox() / "a" / "d"));
+    targets.push_back(to_remote_path(sandbox() / "p" / "q" / "r" / "s"));
+    targets.push_back(to_remote_path(sandbox() / "p" / "q" / "t"));
+
+    uintmax_t count = filesystem().create_directories(targets, 4);
+
+    // Including the parents that weren't asked for: x, p, p/q and p/q/r
+    BOOST_CHECK_EQUAL(count, 11U);
+    BOOST_CHECK(is_directory(sandbox() / "a" / "b" / "c"));
+    BOOST_CHECK(is_directory(sandbox() / "a" / "d"));
+    BOOST_CHECK(is_directory(sandbox() / "x" / "y"));
+    BOOST_CHECK(is_directory(sandbox() / "p" / "q" / "r" / "s"));
+    BOOST_CHECK(is_directory(sandbox() / "p" / "q" / "t"));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_pipelined_some_already_there )
+{
+    path existing = new_directory_in_sandbox();
+
+    vector<path> targets;
+    targets.push_back(to_remote_path(existing));
+    targets.push_back(to_remote_path(existing / "new"));
+    targets.push_back(to_remote_path(existing / "new"));
+
+    uintmax_t count = filesystem().create_directories(targets, 4);
+
+    BOOST_CHECK_EQUAL(count, 1U);
+    BOOST_CHECK(is_directory(existing / "new"));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_pipelined_single_channel )
+{
+    vector<path> targets;
+    for (int i = 0; i < 10; ++i)
+    {
+        targets.push_back(
+            to_remote_path(
+                sandbox() / "deep" / ("branch" + lexical_cast<string>(i)) /
+                "leaf"));
+    }
+
+    uintmax_t count = filesystem().create_directories(targets, 1);
+
+    BOOST_CHECK_EQUAL(count, 21U);
+    for (int i = 0; i < 10; ++i)
+    {
+        BOOST_CHECK(
+            is_directory(
+                sandbox() / "deep" / ("branch" + lexical_cast<string>(i)) /
+                "leaf"));
+    }
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_pipelined_through_file )
+{
+    path file = new_file_in_sandbox();
+
+    vector<path> targets;
+    targets.push_back(to_remote_path(sandbox() / "fine"));
+    targets.push_back(to_remote_path(file / "impossible"));
+
+    BOOST_CHECK_THROW(
+        filesystem().create_directories(targets, 4), system_error);
+    BOOST_CHECK(!is_directory(file));
+}
+
+BOOST_AUTO_TEST_CASE( new_directories_pipelined_nothing )
+{
+    BOOST_CHECK_EQUAL(
+        filesystem().create_directories(vector<path>(), 4), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+/**
+ * Reports how fast a large directory lists.
+ */
+BOOST_AUTO_TEST_CASE( large_dir_listing_rate )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    const size_t file_count = 2000;
+    for (size_t i = 0; i < file_count; ++i)
+    {
+        new_file_in_sandbox();
+    }
+
+    ptime start = microsec_clock::universal_time();
+
+    directory_iterator it =
+        filesystem().directory_iterator(to_remote_path(sandbox()));
+    directory_iterator end = filesystem().directory_iterator();
+
+    size_t entry_count = 0;
+    while (it != end)
+    {
+        ++entry_count;
+        ++it;
+    }
+
+    time_duration elapsed = microsec_clock::universal_time() - start;
+
+    BOOST_TEST_MESSAGE(
+        "Listed " << entry_count << " entries in " <<
+        elapsed.total_milliseconds() << "ms");
+}
+
+/**
+ * Compare the batch against asking about each file in turn.
+ *
+ * Reports the timings rather than checking them as they depend too much on
+ * the link to the server.
+ */
+BOOST_AUTO_TEST_CASE( attributes_batch_timing )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    const size_t file_count = 1000;
+
+    vector<path> files;
+    for (size_t i = 0; i < file_count; ++i)
+    {
+        files.push_back(to_remote_path(new_file_in_sandbox()));
+    }
+
+    ptime start = microsec_clock::universal_time();
+
+    BOOST_FOREACH(const path& file, files)
+    {
+        filesystem().attributes(file, false);
+    }
+
+    time_duration one_at_a_time = microsec_clock::universal_time() - start;
+
+    start = microsec_clock::universal_time();
+
+    vector<attributes_result> results = filesystem().attributes(files, false);
+
+    time_duration batched = microsec_clock::universal_time() - start;
+
+    BOOST_TEST_MESSAGE(
+        "Stat of " << file_count << " files took " <<
+        one_at_a_time.total_milliseconds() << "ms one at a time and " <<
+        batched.total_milliseconds() << "ms batched");
+
+    BOOST_REQUIRE_EQUAL(results.size(), file_count);
+    BOOST_FOREACH(const attributes_result& result, results)
+    {
+        BOOST_CHECK(result.attributes);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
 BOOST_AUTO_TEST_SUITE_END();
 
 BOOST_AUTO_TEST_SUITE_END();
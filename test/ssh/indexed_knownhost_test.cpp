@@ -0,0 +1,439 @@
+/**
+    @file
+
+    Tests for the indexed known-hosts store.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#include "sandbox_fixture.hpp" // sandbox_fixture
+
+#include <ssh/indexed_knownhost.hpp> // Test subject
+
+#include <boost/assign/list_of.hpp> // list_of()
+#include <boost/filesystem.hpp> // copy_file, file_size
+#include <boost/filesystem/fstream.hpp> // ifstream
+#include <boost/test/unit_test.hpp>
+
+#include <iterator> // istreambuf_iterator
+#include <string>
+#include <vector>
+
+using test::ssh::sandbox_fixture;
+
+using ssh::indexed_knownhost_cache;
+using ssh::indexed_knownhost_collection;
+using ssh::indexed_knownhost_search_result;
+
+using boost::assign::list_of;
+using boost::filesystem::copy_file;
+using boost::filesystem::ifstream;
+using boost::filesystem::path;
+
+using std::string;
+using std::vector;
+
+namespace {
+
+const string KEY_A =
+    "AAAAB3NzaC1yc2EAAAABIwAAAQEA9QcrMH117S7SNIzhExJJmbKlCqxcIt2QQ5B4gZni"
+    "x8RJci8U/z2P1noALl+oJ59gD9IuJZBXxjDQhxCRHWuvwNPax4BvtZwew0VnXlrs75nC"
+    "qtFVwcWPUlSU5ycp958YJ3uKQs9yQffgu+LDU29QJ+r7yQSx/YJPgD+DpVeWG1YNqRbo"
+    "dUYQKWktto3OFJi4cO8t7fAteK+u+x26JQdMtplj/xrR8FNNghMyT7Rckh54/KrEdbEl"
+    "dwXTbp1bm9zDny9OSK6cwVjAk8zdNHCLx9/uurlSNcDRZXCDx3yRJiv8Q4ne0kmbMm4Q"
+    "FeigFf3QY7rGUgBEm/wMgxggdvLUCQ==";
+
+const string KEY_B =
+    "AAAAB3NzaC1yc2EAAAABIwAAAQEAvKS1ply6S6xcb/pxnJQQEB+y123axJUKsYEk2ezs"
+    "HRNZP920FNM1KXGMmm+i7KugMk7dz46pkE/p4qJ4qVfoeDKojR4GiP1WleKQniTIdgEY"
+    "ho7OmopOUszST1Qo5PK9e2gvVQcsyE6xEJkBdMlBWqfm/2vfyr92IPW1wtR3j3YYCcaM"
+    "VMdpo0tHiK4qmVJIGcs4BRYRSeWzSFaFdmkhEM7iRxCgQDLykjQEZcKmF5KUEf+SxfNS"
+    "51B0O4D2aoamsYaAC849HBJgMS/I5CxLAah2uMQXnZwJrCIUZcZDUQrC7LnSgd86P+yD"
+    "FZYbAkXz8QjhGL/qTywA7Afglyt5/w==";
+
+const string KEY_UNKNOWN_FORMAT =
+    "AAAAE2VjZHNhLXNoYTItbmlzdHAyNTYAAAAIbmlzdHAyNTYAAABBBOnHj5Uw9UIVhG/q"
+    "Jfqz4MXX0AqaIvsX/cO3Y2rR6qRo6HUDS4mD3QPLQxw2tDTs12Iji5v/mWUerKPwnRx1"
+    "E7E=";
+
+const string FAIL_HOST = "i-dontexist-in-the-host-file.example.com";
+
+string file_contents(const path& file)
+{
+    ifstream stream(file, std::ios::binary);
+    return string(
+        (std::istreambuf_iterator<char>(stream)),
+        std::istreambuf_iterator<char>());
+}
+
+class indexed_knownhost_fixture : public sandbox_fixture
+{
+public:
+
+    /**
+     * Copy of a test known_hosts file that the test can modify.
+     */
+    path known_hosts_copy(const path& original)
+    {
+        path copy = new_file_in_sandbox();
+        boost::filesystem::remove(copy);
+        copy_file(original, copy);
+        return copy;
+    }
+};
+
+}
+
+BOOST_FIXTURE_TEST_SUITE(indexed_knownhost_tests, indexed_knownhost_fixture)
+
+BOOST_AUTO_TEST_CASE( init_from_file )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts"));
+    BOOST_CHECK_EQUAL(kh.size(), 4U);
+}
+
+/**
+ * Comments count as lines so they are kept when saving.
+ */
+BOOST_AUTO_TEST_CASE( init_from_hashed_file )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts_hashed"));
+    BOOST_CHECK_EQUAL(kh.size(), 13U);
+}
+
+BOOST_AUTO_TEST_CASE( init_fail )
+{
+    path bad_path = "i-dont-exist";
+    BOOST_REQUIRE(!exists(bad_path));
+    BOOST_CHECK_THROW(
+        (indexed_knownhost_collection(bad_path)), std::runtime_error);
+    BOOST_CHECK(!exists(bad_path));
+}
+
+BOOST_AUTO_TEST_CASE( find_match )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts"));
+
+    BOOST_CHECK(kh.find("host1.example.com", KEY_A, true).match());
+    BOOST_CHECK(kh.find("192.168.0.1", KEY_A, true).match());
+    BOOST_CHECK(kh.find("host2.example.com", KEY_B, true).match());
+    BOOST_CHECK(kh.find("10.0.0.1", KEY_B, true).match());
+}
+
+BOOST_AUTO_TEST_CASE( find_match_hashed )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts_hashed"));
+
+    BOOST_CHECK(kh.find("host1.example.com", KEY_A, true).match());
+    BOOST_CHECK(kh.find("192.168.0.1", KEY_A, true).match());
+    BOOST_CHECK(kh.find("host2.example.com", KEY_B, true).match());
+    BOOST_CHECK(kh.find("10.0.0.1", KEY_B, true).match());
+}
+
+/**
+ * Keys libssh2 doesn't understand are just as searchable.
+ */
+BOOST_AUTO_TEST_CASE( find_match_unrecognised_key )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts"));
+
+    BOOST_CHECK(
+        kh.find(
+            "unrecognisedkey.example.com", KEY_UNKNOWN_FORMAT, true).match());
+}
+
+/**
+ * Host names are case-insensitive.
+ */
+BOOST_AUTO_TEST_CASE( find_match_case )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts"));
+    BOOST_CHECK(kh.find("HOST1.Example.com", KEY_A, true).match());
+
+    indexed_knownhost_collection hashed(path("test_known_hosts_hashed"));
+    BOOST_CHECK(hashed.find("HOST1.Example.com", KEY_A, true).match());
+}
+
+BOOST_AUTO_TEST_CASE( find_match_raw_key )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts"));
+
+    string raw_key = *ssh::detail::base64_decode(KEY_A);
+    BOOST_CHECK(kh.find("host1.example.com", raw_key, false).match());
+}
+
+BOOST_AUTO_TEST_CASE( find_mismatch )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts"));
+
+    indexed_knownhost_search_result result =
+        kh.find("host1.example.com", KEY_B, true);
+    BOOST_CHECK(result.mismatch());
+    BOOST_CHECK(!result.match());
+    BOOST_CHECK(!result.not_found());
+    BOOST_REQUIRE_EQUAL(result.hosts().size(), 1U);
+    BOOST_CHECK_EQUAL(kh.at(result.hosts()[0]).key(), KEY_A);
+}
+
+BOOST_AUTO_TEST_CASE( find_mismatch_hashed )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts_hashed"));
+
+    BOOST_CHECK(kh.find("host1.example.com", KEY_B, true).mismatch());
+    BOOST_CHECK(kh.find("192.168.0.1", KEY_B, true).mismatch());
+}
+
+/**
+ * A host known only by a key of a different algorithm is not a mismatch.
+ *
+ * host3 only has a DSS key and KEY_A is RSA.
+ */
+BOOST_AUTO_TEST_CASE( find_other_algorithm )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts"));
+
+    BOOST_CHECK(kh.find("host3.example.com", KEY_A, true).not_found());
+}
+
+BOOST_AUTO_TEST_CASE( find_fail )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts"));
+
+    indexed_knownhost_search_result result = kh.find(FAIL_HOST, KEY_A, true);
+    BOOST_CHECK(result.not_found());
+    BOOST_CHECK(!result.match());
+    BOOST_CHECK(!result.mismatch());
+}
+
+BOOST_AUTO_TEST_CASE( find_fail_hashed )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts_hashed"));
+
+    BOOST_CHECK(kh.find(FAIL_HOST, KEY_A, true).not_found());
+}
+
+BOOST_AUTO_TEST_CASE( find_wildcard )
+{
+    vector<string> lines = list_of
+        ("*.example.com,!bad.example.com ssh-rsa " + KEY_A)
+        ("host?.example.org ssh-rsa " + KEY_A);
+    indexed_knownhost_collection kh(lines.begin(), lines.end());
+
+    BOOST_CHECK(kh.find("host1.example.com", KEY_A, true).match());
+    BOOST_CHECK(kh.find("a.b.example.com", KEY_A, true).match());
+    BOOST_CHECK(kh.find("bad.example.com", KEY_A, true).not_found());
+    BOOST_CHECK(kh.find("hostA.example.org", KEY_A, true).match());
+    BOOST_CHECK(kh.find("host10.example.org", KEY_A, true).not_found());
+    BOOST_CHECK(kh.find("example.com", KEY_A, true).not_found());
+}
+
+/**
+ * Entries sharing a salt are all found by the single hash of their group.
+ */
+BOOST_AUTO_TEST_CASE( find_shared_salt )
+{
+    vector<string> lines;
+    indexed_knownhost_collection kh(lines.begin(), lines.end());
+
+    kh.add_hashed("host1.example.com", "shared salt", KEY_A, true);
+    kh.add_hashed("host2.example.com", "shared salt", KEY_B, true);
+    kh.add_hashed("host1.example.com", "shared salt", KEY_B, true);
+
+    BOOST_CHECK(kh.find("host1.example.com", KEY_A, true).match());
+    BOOST_CHECK(kh.find("host1.example.com", KEY_B, true).match());
+    BOOST_CHECK(kh.find("host2.example.com", KEY_B, true).match());
+    BOOST_CHECK(kh.find("host2.example.com", KEY_A, true).mismatch());
+    BOOST_CHECK(kh.find(FAIL_HOST, KEY_A, true).not_found());
+}
+
+/**
+ * Hashed entries we add must be readable by anything that reads OpenSSH
+ * known_hosts, including us after a reload.
+ */
+BOOST_AUTO_TEST_CASE( add_hashed_roundtrip )
+{
+    path file = known_hosts_copy("test_known_hosts");
+
+    {
+        indexed_knownhost_collection kh(file);
+        kh.add_hashed("newhost.example.com", "0123456789abcdefghij", KEY_B, true);
+        kh.save(file);
+    }
+
+    indexed_knownhost_collection kh(file);
+    BOOST_CHECK(kh.find("newhost.example.com", KEY_B, true).match());
+}
+
+/**
+ * Adding entries leaves the existing file contents untouched.
+ */
+BOOST_AUTO_TEST_CASE( add_appends )
+{
+    path file = known_hosts_copy("test_known_hosts");
+    string original = file_contents(file);
+
+    indexed_knownhost_collection kh(file);
+    kh.add("newhost.example.com", KEY_B, true);
+    kh.save(file);
+
+    string saved = file_contents(file);
+    BOOST_CHECK_EQUAL(saved.substr(0, original.size()), original);
+    BOOST_CHECK_EQUAL(
+        saved.substr(original.size()),
+        "newhost.example.com ssh-rsa " + KEY_B + "\n");
+
+    // Saving again mustn't append the same entry twice
+    kh.save(file);
+    BOOST_CHECK_EQUAL(file_contents(file), saved);
+
+    BOOST_CHECK(
+        indexed_knownhost_collection(file).find(
+            "newhost.example.com", KEY_B, true).match());
+}
+
+/**
+ * If the file changed under us, appending could corrupt it, so we rewrite it.
+ */
+BOOST_AUTO_TEST_CASE( add_after_external_change )
+{
+    path file = known_hosts_copy("test_known_hosts");
+
+    indexed_knownhost_collection kh(file);
+    kh.add("newhost.example.com", KEY_B, true);
+
+    {
+        boost::filesystem::ofstream stream(file, std::ios::app);
+        stream << "somebody else was here\n";
+    }
+
+    kh.save(file);
+
+    indexed_knownhost_collection reloaded(file);
+    BOOST_CHECK_EQUAL(reloaded.size(), 5U);
+    BOOST_CHECK(reloaded.find("newhost.example.com", KEY_B, true).match());
+    BOOST_CHECK(reloaded.find("host1.example.com", KEY_A, true).match());
+}
+
+BOOST_AUTO_TEST_CASE( update_mismatch )
+{
+    path file = known_hosts_copy("test_known_hosts_hashed");
+
+    {
+        indexed_knownhost_collection kh(file);
+
+        indexed_knownhost_search_result result =
+            kh.find("host1.example.com", KEY_B, true);
+        BOOST_REQUIRE(result.mismatch());
+
+        kh.erase(result);
+        kh.add("host1.example.com", KEY_B, true);
+        kh.save(file);
+    }
+
+    indexed_knownhost_collection kh(file);
+    BOOST_CHECK(kh.find("host1.example.com", KEY_B, true).match());
+
+    // The hashed IP entry is separate so survives
+    BOOST_CHECK(kh.find("192.168.0.1", KEY_A, true).match());
+    BOOST_CHECK(kh.find("host2.example.com", KEY_B, true).match());
+
+    // Comments too
+    BOOST_CHECK_EQUAL(file_contents(file).substr(0, 1), "#");
+}
+
+/**
+ * Finding the same host twice must give the same answer the second time,
+ * when its hashes are remembered.
+ */
+BOOST_AUTO_TEST_CASE( find_hashed_twice )
+{
+    indexed_knownhost_collection kh(path("test_known_hosts_hashed"));
+
+    BOOST_CHECK(kh.find("host1.example.com", KEY_A, true).match());
+    BOOST_CHECK(kh.find("host1.example.com", KEY_A, true).match());
+    BOOST_CHECK(kh.find("host1.example.com", KEY_B, true).mismatch());
+    BOOST_CHECK(kh.find(FAIL_HOST, KEY_A, true).not_found());
+    BOOST_CHECK(kh.find(FAIL_HOST, KEY_A, true).not_found());
+}
+
+BOOST_AUTO_TEST_CASE( cache_find )
+{
+    indexed_knownhost_cache<> cache;
+    path file = known_hosts_copy("test_known_hosts_hashed");
+
+    BOOST_CHECK(cache.find(file, "host1.example.com", KEY_A, true).match());
+    BOOST_CHECK(cache.find(file, "host1.example.com", KEY_A, true).match());
+    BOOST_CHECK(
+        cache.find(file, "host1.example.com", KEY_B, true).mismatch());
+}
+
+/**
+ * Changes made through the cache are saved to the file.
+ */
+BOOST_AUTO_TEST_CASE( cache_saves_changes )
+{
+    indexed_knownhost_cache<> cache;
+    path file = known_hosts_copy("test_known_hosts_hashed");
+
+    cache.add(file, "newhost.example.com", KEY_B, true);
+    cache.update(file, "host1.example.com", KEY_B, true);
+
+    BOOST_CHECK(
+        cache.find(file, "newhost.example.com", KEY_B, true).match());
+    BOOST_CHECK(cache.find(file, "host1.example.com", KEY_B, true).match());
+
+    indexed_knownhost_collection kh(file);
+    BOOST_CHECK(kh.find("newhost.example.com", KEY_B, true).match());
+    BOOST_CHECK(kh.find("host1.example.com", KEY_B, true).match());
+    BOOST_CHECK(kh.find("192.168.0.1", KEY_A, true).match());
+}
+
+/**
+ * The cache reads the file again if something else changes it.
+ */
+BOOST_AUTO_TEST_CASE( cache_notices_changed_file )
+{
+    indexed_knownhost_cache<> cache;
+    path file = known_hosts_copy("test_known_hosts");
+
+    BOOST_REQUIRE(
+        cache.find(file, "newhost.example.com", KEY_B, true).not_found());
+
+    {
+        boost::filesystem::ofstream stream(file, std::ios::app);
+        stream << "newhost.example.com ssh-rsa " << KEY_B << "\n";
+    }
+
+    BOOST_CHECK(
+        cache.find(file, "newhost.example.com", KEY_B, true).match());
+}
+
+BOOST_AUTO_TEST_SUITE_END();
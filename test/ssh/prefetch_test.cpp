@@ -0,0 +1,581 @@
+/**
+    @file
+
+    Tests for fetching files ahead of the consumer.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#include "swish/prefetch.hpp" // test subject
+
+#include "swish/block_transfer.hpp" // byte_source
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
+#include <boost/bind.hpp> // bind
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp> // milliseconds
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp> // lock_guard
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp> // sleep
+
+#include <cstddef> // size_t
+#include <iostream> // iostream
+#include <sstream> // stringstream
+#include <stdexcept> // runtime_error
+#include <string>
+#include <vector>
+
+using swish::block_transfer::byte_source;
+using swish::prefetch::prefetch_options;
+using swish::prefetch::prefetcher;
+
+using boost::bind;
+using boost::lexical_cast;
+using boost::posix_time::milliseconds;
+using boost::shared_ptr;
+using boost::uintmax_t;
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace {
+
+    /**
+     * Contents of file `index`: its size in bytes of its index letter.
+     */
+    string contents_of(size_t index, uintmax_t size)
+    {
+        return string(static_cast<size_t>(size), char('a' + index % 26));
+    }
+
+    /**
+     * Source that can be slowed down to look like a remote file.
+     */
+    class test_source : public byte_source
+    {
+    public:
+        test_source(const string& data, milliseconds delay)
+            : m_data(data), m_position(0), m_delay(delay) {}
+
+        virtual size_t read(char* buffer, size_t size)
+        {
+            if (m_delay.total_milliseconds() > 0)
+                boost::this_thread::sleep(m_delay);
+
+            size_t count = (std::min)(size, m_data.size() - m_position);
+            m_data.copy(buffer, count, m_position);
+            m_position += count;
+
+            return count;
+        }
+
+    private:
+        string m_data;
+        size_t m_position;
+        milliseconds m_delay;
+    };
+
+    /**
+     * Stands in for the server, counting what is opened.
+     */
+    class test_files
+    {
+    public:
+        explicit test_files(
+            const vector<uintmax_t>& sizes,
+            milliseconds delay=milliseconds(0))
+            : m_sizes(sizes), m_delay(delay), m_opened(0) {}
+
+        shared_ptr<byte_source> open(size_t index)
+        {
+            {
+                boost::lock_guard<boost::mutex> lock(m_mutex);
+                ++m_opened;
+            }
+
+            return boost::make_shared<test_source>(
+                contents_of(index, m_sizes[index]), m_delay);
+        }
+
+        size_t opened() const
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            return m_opened;
+        }
+
+        prefetcher::opener opener()
+        {
+            return bind(&test_files::open, this, _1);
+        }
+
+    private:
+        vector<uintmax_t> m_sizes;
+        milliseconds m_delay;
+        mutable boost::mutex m_mutex;
+        size_t m_opened;
+    };
+
+    /**
+     * Disk spool kept in memory, counting how many are made.
+     */
+    class test_spool
+    {
+    public:
+        test_spool() : m_created(0) {}
+
+        shared_ptr<std::iostream> create()
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            ++m_created;
+            return boost::make_shared<std::stringstream>();
+        }
+
+        size_t created() const
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            return m_created;
+        }
+
+    private:
+        mutable boost::mutex m_mutex;
+        size_t m_created;
+    };
+
+    string read_all(shared_ptr<byte_source> source)
+    {
+        BOOST_REQUIRE(source);
+
+        string data;
+        char buffer[100];
+        while (size_t count = source->read(buffer, sizeof(buffer)))
+        {
+            data.append(buffer, count);
+        }
+
+        return data;
+    }
+
+    /**
+     * Wait, but not forever, for the prefetcher's thread to catch up.
+     */
+    template<typename Predicate>
+    bool eventually(Predicate done)
+    {
+        for (int i = 0; i < 500; ++i)
+        {
+            if (done())
+                return true;
+
+            boost::this_thread::sleep(milliseconds(10));
+        }
+
+        return done();
+    }
+
+    /**
+     * Wait until the prefetcher has opened `count` files, and so has
+     * taken on at least those.
+     */
+    void wait_for_opens(test_files& files, size_t count)
+    {
+        BOOST_REQUIRE(
+            eventually(bind(&test_files::opened, &files) >= count));
+    }
+
+    /**
+     * Read a file the way a real consumer would: from the prefetcher if
+     * it has the file, otherwise by fetching it itself.
+     */
+    string consume(prefetcher& ahead, test_files& files, size_t index)
+    {
+        shared_ptr<byte_source> source = ahead.take(index);
+        if (!source)
+            source = files.open(index);
+
+        return read_all(source);
+    }
+
+    vector<uintmax_t> same_sizes(size_t count, uintmax_t size)
+    {
+        return vector<uintmax_t>(count, size);
+    }
+
+    /**
+     * Files whose reads don't return until the test lets them.
+     *
+     * Shared with the prefetcher's thread, which may outlive the test.
+     */
+    class gated_files : public boost::enable_shared_from_this<gated_files>
+    {
+        class gated_source : public byte_source
+        {
+        public:
+            explicit gated_source(shared_ptr<gated_files> files)
+                : m_files(files) {}
+
+            virtual size_t read(char*, size_t)
+            {
+                m_files->wait_for_gate();
+                return 0;
+            }
+
+        private:
+            shared_ptr<gated_files> m_files;
+        };
+
+    public:
+        gated_files() : m_open(false), m_reading(false) {}
+
+        shared_ptr<byte_source> open(size_t)
+        {
+            return boost::make_shared<gated_source>(shared_from_this());
+        }
+
+        void wait_for_gate()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            m_reading = true;
+            m_changed.notify_all();
+
+            while (!m_open)
+            {
+                m_changed.wait(lock);
+            }
+        }
+
+        bool reading() const
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            return m_reading;
+        }
+
+        void open_gate()
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            m_open = true;
+            m_changed.notify_all();
+        }
+
+    private:
+        mutable boost::mutex m_mutex;
+        boost::condition_variable m_changed;
+        bool m_open;
+        bool m_reading;
+    };
+}
+
+BOOST_AUTO_TEST_SUITE(prefetch_tests)
+
+BOOST_AUTO_TEST_CASE( files_in_order )
+{
+    vector<uintmax_t> sizes;
+    sizes.push_back(10);
+    sizes.push_back(1000);
+    sizes.push_back(0);
+    sizes.push_back(300);
+    test_files files(sizes);
+
+    prefetcher ahead(files.opener(), sizes, 1);
+    wait_for_opens(files, 3);
+
+    for (size_t i = 1; i < sizes.size(); ++i)
+    {
+        BOOST_CHECK(read_all(ahead.take(i)) == contents_of(i, sizes[i]));
+    }
+
+    BOOST_CHECK_EQUAL(files.opened(), 3U);
+    BOOST_CHECK_EQUAL(ahead.unconsumed_bytes(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE( consumer_waits_for_file_to_arrive )
+{
+    vector<uintmax_t> sizes = same_sizes(3, 1000);
+    prefetch_options options;
+    options.block_size = 100;
+    test_files files(sizes, milliseconds(5));
+
+    prefetcher ahead(files.opener(), sizes, 0, options);
+
+    // Each is taken while still arriving
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        wait_for_opens(files, i + 1);
+        BOOST_CHECK(read_all(ahead.take(i)) == contents_of(i, 1000));
+    }
+}
+
+BOOST_AUTO_TEST_CASE( files_before_start_left_to_consumer )
+{
+    vector<uintmax_t> sizes = same_sizes(4, 10);
+    test_files files(sizes);
+
+    prefetcher ahead(files.opener(), sizes, 2);
+    wait_for_opens(files, 2);
+
+    BOOST_CHECK(!ahead.take(0));
+    BOOST_CHECK(!ahead.take(1));
+    BOOST_CHECK(read_all(ahead.take(2)) == contents_of(2, 10));
+}
+
+BOOST_AUTO_TEST_CASE( depth_follows_average_size )
+{
+    prefetch_options options;
+    options.memory_limit = 1000;
+    options.max_depth = 4;
+
+    test_files small_files(same_sizes(10, 100));
+    prefetcher small_ahead(
+        small_files.opener(), same_sizes(10, 100), 0, options);
+    BOOST_CHECK_EQUAL(small_ahead.depth(), 4U);
+
+    test_files medium_files(same_sizes(10, 400));
+    prefetcher medium_ahead(
+        medium_files.opener(), same_sizes(10, 400), 0, options);
+    BOOST_CHECK_EQUAL(medium_ahead.depth(), 2U);
+
+    test_files large_files(same_sizes(10, 5000));
+    prefetcher large_ahead(
+        large_files.opener(), same_sizes(10, 5000), 0, options);
+    BOOST_CHECK_EQUAL(large_ahead.depth(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE( no_further_ahead_than_depth )
+{
+    prefetch_options options;
+    options.memory_limit = 1000;
+    options.max_depth = 3;
+    vector<uintmax_t> sizes = same_sizes(10, 100);
+    test_files files(sizes);
+
+    prefetcher ahead(files.opener(), sizes, 0, options);
+
+    wait_for_opens(files, 3);
+    boost::this_thread::sleep(milliseconds(50));
+    BOOST_CHECK_EQUAL(files.opened(), 3U);
+
+    // Moving on lets it fetch one more
+    BOOST_CHECK(read_all(ahead.take(0)) == contents_of(0, 100));
+    BOOST_CHECK(eventually(bind(&test_files::opened, &files) == 4U));
+}
+
+BOOST_AUTO_TEST_CASE( large_files_spooled_to_disk )
+{
+    test_spool spool;
+    prefetch_options options;
+    options.memory_limit = 1000;
+    options.spool_file = bind(&test_spool::create, &spool);
+
+    vector<uintmax_t> sizes;
+    sizes.push_back(500);
+    sizes.push_back(5000);
+    sizes.push_back(500);
+    test_files files(sizes);
+
+    prefetcher ahead(files.opener(), sizes, 0, options);
+
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        wait_for_opens(files, i + 1);
+        BOOST_CHECK(read_all(ahead.take(i)) == contents_of(i, sizes[i]));
+    }
+    BOOST_CHECK_EQUAL(spool.created(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE( files_too_large_to_spool_skipped )
+{
+    prefetch_options options;
+    options.memory_limit = 1000;
+    options.disk_limit = 2000;
+
+    vector<uintmax_t> sizes;
+    sizes.push_back(5000);
+    sizes.push_back(10);
+    test_files files(sizes);
+
+    prefetcher ahead(files.opener(), sizes, 0, options);
+
+    wait_for_opens(files, 1);
+    BOOST_CHECK(!ahead.take(0));
+    BOOST_CHECK(read_all(ahead.take(1)) == contents_of(1, 10));
+}
+
+BOOST_AUTO_TEST_CASE( failed_file_left_to_consumer )
+{
+    vector<uintmax_t> sizes = same_sizes(3, 10);
+    test_files files(sizes);
+
+    struct failing
+    {
+        static shared_ptr<byte_source> open(
+            test_files* files, size_t index)
+        {
+            if (index == 1)
+                throw std::runtime_error("No such file");
+            return files->open(index);
+        }
+    };
+
+    prefetcher ahead(bind(&failing::open, &files, _1), sizes, 0);
+    wait_for_opens(files, 2);
+
+    BOOST_CHECK(read_all(ahead.take(0)) == contents_of(0, 10));
+    BOOST_CHECK(!ahead.take(1));
+    BOOST_CHECK(read_all(ahead.take(2)) == contents_of(2, 10));
+}
+
+BOOST_AUTO_TEST_CASE( unconsumed_bytes_counted )
+{
+    vector<uintmax_t> sizes = same_sizes(4, 100);
+    test_files files(sizes);
+
+    prefetcher ahead(files.opener(), sizes, 0);
+    wait_for_opens(files, 1);
+
+    // Read only part of the first
+    {
+        shared_ptr<byte_source> first = ahead.take(0);
+        BOOST_REQUIRE(first);
+        char buffer[30];
+        BOOST_REQUIRE_EQUAL(first->read(buffer, sizeof(buffer)), 30U);
+
+        // Make sure all of it arrived
+        wait_for_opens(files, 4);
+        BOOST_CHECK(read_all(ahead.take(1)) == contents_of(1, 100));
+    }
+    BOOST_CHECK_EQUAL(ahead.unconsumed_bytes(), 70U);
+
+    // Skip the third and give up on the last
+    BOOST_CHECK(read_all(ahead.take(3)) == contents_of(3, 100));
+    ahead.cancel();
+
+    BOOST_CHECK_EQUAL(ahead.unconsumed_bytes(), 170U);
+}
+
+/**
+ * Abandoning the prefetcher doesn't wait for a read that is stuck.
+ */
+BOOST_AUTO_TEST_CASE( abandon_doesnt_wait_for_read )
+{
+    vector<uintmax_t> sizes = same_sizes(2, 100);
+    shared_ptr<gated_files> files = boost::make_shared<gated_files>();
+
+    {
+        prefetcher ahead(bind(&gated_files::open, files, _1), sizes, 0);
+        BOOST_REQUIRE(eventually(bind(&gated_files::reading, files)));
+
+        // Joining here would never return as the read is still waiting
+        ahead.abandon();
+        BOOST_CHECK(!ahead.take(0));
+    }
+
+    files->open_gate();
+}
+
+BOOST_AUTO_TEST_CASE( taken_file_outlives_prefetcher )
+{
+    vector<uintmax_t> sizes = same_sizes(2, 100);
+    test_files files(sizes);
+
+    shared_ptr<byte_source> first;
+    {
+        prefetcher ahead(files.opener(), sizes, 0);
+        wait_for_opens(files, 2);
+        first = ahead.take(0);
+        BOOST_REQUIRE(first);
+    }
+
+    // Whether it arrived before the cancellation or not, it mustn't hang
+    try
+    {
+        string data = read_all(first);
+        BOOST_CHECK(data == contents_of(0, 100));
+    }
+    catch (const std::runtime_error&)
+    {}
+}
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+/**
+ * Many small slow files read one after another, with and without fetching
+ * ahead.
+ */
+BOOST_AUTO_TEST_CASE( small_file_latency_hidden )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    const size_t file_count = 50;
+    vector<uintmax_t> sizes = same_sizes(file_count, 1000);
+
+    boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::universal_time();
+    {
+        test_files files(sizes, milliseconds(5));
+        for (size_t i = 0; i < file_count; ++i)
+        {
+            read_all(files.open(i));
+            boost::this_thread::sleep(milliseconds(2)); // consumer's share
+        }
+    }
+    boost::posix_time::time_duration unaided =
+        boost::posix_time::microsec_clock::universal_time() - start;
+
+    start = boost::posix_time::microsec_clock::universal_time();
+    {
+        test_files files(sizes, milliseconds(5));
+        prefetcher ahead(files.opener(), sizes, 0);
+        for (size_t i = 0; i < file_count; ++i)
+        {
+            consume(ahead, files, i);
+            boost::this_thread::sleep(milliseconds(2));
+        }
+    }
+    boost::posix_time::time_duration prefetched =
+        boost::posix_time::microsec_clock::universal_time() - start;
+
+    BOOST_TEST_MESSAGE(
+        "Reading " << file_count << " files took " <<
+        unaided.total_milliseconds() << "ms unaided and " <<
+        prefetched.total_milliseconds() << "ms fetching ahead");
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE_END();
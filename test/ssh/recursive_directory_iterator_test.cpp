@@ -0,0 +1,402 @@
+/**
+    @file
+
+    Tests for recursive SFTP directory iteration.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#include "sandbox_fixture.hpp" // sandbox_fixture
+#include "session_fixture.hpp" // session_fixture
+
+#include <ssh/recursive_directory_iterator.hpp> // test subject
+
+#include <boost/filesystem/fstream.hpp> // ofstream
+#include <boost/lexical_cast.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <map>
+#include <stdexcept> // invalid_argument
+#include <string>
+#include <vector>
+
+using ssh::session;
+using ssh::filesystem::recursion_options;
+using ssh::filesystem::recursive_directory_iterator;
+using ssh::filesystem::sftp_filesystem;
+
+using boost::filesystem::ofstream;
+using boost::filesystem::path;
+using boost::lexical_cast;
+using boost::system::system_error;
+
+using test::ssh::sandbox_fixture;
+using test::ssh::session_fixture;
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace {
+
+class walk_fixture : public session_fixture, public sandbox_fixture
+{
+public:
+
+    walk_fixture() : m_filesystem(auth_and_open_sftp()) {}
+
+    sftp_filesystem& filesystem()
+    {
+        return m_filesystem;
+    }
+
+    void create_symlink(path link, path target)
+    {
+        // Passing arguments in the wrong order to work around OpenSSH bug
+        filesystem().create_symlink(
+            to_remote_path(target), to_remote_path(link));
+    }
+
+    /**
+     * Walk the directory, recording the depth of everything found by name.
+     */
+    map<string, int> walk(
+        const path& directory,
+        const recursion_options& options=recursion_options())
+    {
+        map<string, int> found;
+
+        recursive_directory_iterator it(
+            filesystem(), to_remote_path(directory), options);
+        for (; it != recursive_directory_iterator(); ++it)
+        {
+            BOOST_CHECK(found.find(it->name()) == found.end());
+            found[it->name()] = it.depth();
+        }
+
+        return found;
+    }
+
+    /**
+     * Sandbox directory holding a small tree:
+     *
+     *     alice
+     *     bob/
+     *         sally
+     *         jim/
+     *             fred
+     *     zed
+     */
+    path new_tree_in_sandbox()
+    {
+        path root = new_directory_in_sandbox();
+        ofstream(root / "alice");
+        create_directory(root / "bob");
+        ofstream(root / "bob" / "sally");
+        create_directory(root / "bob" / "jim");
+        ofstream(root / "bob" / "jim" / "fred");
+        ofstream(root / "zed");
+
+        return root;
+    }
+
+private:
+
+    sftp_filesystem auth_and_open_sftp()
+    {
+        session& s = test_session();
+        s.authenticate_by_key_files(
+            user(), public_key_path(), private_key_path(), "");
+
+        return s.connect_to_filesystem();
+    }
+
+    sftp_filesystem m_filesystem;
+};
+
+}
+
+BOOST_FIXTURE_TEST_SUITE(recursive_directory_iterator_tests, walk_fixture)
+
+BOOST_AUTO_TEST_CASE( empty_root )
+{
+    recursive_directory_iterator it(
+        filesystem(), to_remote_path(new_directory_in_sandbox()));
+
+    BOOST_CHECK(it == recursive_directory_iterator());
+}
+
+BOOST_AUTO_TEST_CASE( missing_root )
+{
+    BOOST_CHECK_THROW(
+        recursive_directory_iterator(
+            filesystem(), to_remote_path(sandbox() / "gibberish")),
+        system_error);
+}
+
+BOOST_AUTO_TEST_CASE( whole_tree )
+{
+    map<string, int> found = walk(new_tree_in_sandbox());
+
+    BOOST_REQUIRE_EQUAL(found.size(), 6U);
+    BOOST_CHECK_EQUAL(found["alice"], 0);
+    BOOST_CHECK_EQUAL(found["bob"], 0);
+    BOOST_CHECK_EQUAL(found["sally"], 1);
+    BOOST_CHECK_EQUAL(found["jim"], 1);
+    BOOST_CHECK_EQUAL(found["fred"], 2);
+    BOOST_CHECK_EQUAL(found["zed"], 0);
+}
+
+/**
+ * Directories come before their contents and their contents come before
+ * anything after the directory.
+ */
+BOOST_AUTO_TEST_CASE( depth_first_order )
+{
+    path root = new_tree_in_sandbox();
+
+    vector<path> order;
+    recursive_directory_iterator it(filesystem(), to_remote_path(root));
+    for (; it != recursive_directory_iterator(); ++it)
+    {
+        order.push_back(it->path());
+    }
+
+    BOOST_REQUIRE_EQUAL(order.size(), 6U);
+
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        for (size_t j = i + 1; j < order.size(); ++j)
+        {
+            // A child never comes before its parent
+            BOOST_CHECK(order[i].parent_path() != order[j]);
+        }
+    }
+
+    // Whatever order the server lists bob in, jim's contents follow jim
+    // directly
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        if (order[i].filename() == "jim")
+        {
+            BOOST_REQUIRE(i + 1 < order.size());
+            BOOST_CHECK_EQUAL(order[i + 1].filename(), "fred");
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( no_push )
+{
+    path root = new_tree_in_sandbox();
+
+    map<string, int> found;
+
+    recursive_directory_iterator it(filesystem(), to_remote_path(root));
+    for (; it != recursive_directory_iterator(); ++it)
+    {
+        BOOST_CHECK(it.recursion_pending());
+
+        found[it->name()] = it.depth();
+        if (it->name() == "bob")
+        {
+            it.no_push();
+            BOOST_CHECK(!it.recursion_pending());
+        }
+    }
+
+    BOOST_CHECK_EQUAL(found.size(), 3U);
+    BOOST_CHECK(found.find("sally") == found.end());
+    BOOST_CHECK(found.find("fred") == found.end());
+}
+
+BOOST_AUTO_TEST_CASE( pop )
+{
+    path root = new_tree_in_sandbox();
+
+    map<string, int> found;
+
+    recursive_directory_iterator it(filesystem(), to_remote_path(root));
+    while (it != recursive_directory_iterator())
+    {
+        found[it->name()] = it.depth();
+
+        // Leave bob as soon as we're in it, without going into jim
+        if (it.depth() == 1)
+        {
+            it.pop();
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    BOOST_CHECK_EQUAL(found.size(), 4U);
+    BOOST_CHECK_EQUAL(found["alice"], 0);
+    BOOST_CHECK_EQUAL(found["bob"], 0);
+    BOOST_CHECK_EQUAL(found["zed"], 0);
+    BOOST_CHECK(found.find("fred") == found.end());
+}
+
+BOOST_AUTO_TEST_CASE( pop_root_ends_walk )
+{
+    path root = new_tree_in_sandbox();
+
+    recursive_directory_iterator it(filesystem(), to_remote_path(root));
+    it.pop();
+
+    BOOST_CHECK(it == recursive_directory_iterator());
+}
+
+BOOST_AUTO_TEST_CASE( copies_linked )
+{
+    path root = new_tree_in_sandbox();
+
+    recursive_directory_iterator it(filesystem(), to_remote_path(root));
+    recursive_directory_iterator copy = it;
+
+    string first = it->name();
+    ++it;
+
+    BOOST_CHECK(copy == it);
+    BOOST_CHECK(copy->name() != first);
+}
+
+BOOST_AUTO_TEST_CASE( links_not_followed_by_default )
+{
+    path target = new_tree_in_sandbox();
+
+    path root = new_directory_in_sandbox();
+    create_symlink(root / "link", target);
+
+    map<string, int> found = walk(root);
+
+    BOOST_CHECK_EQUAL(found.size(), 1U);
+    BOOST_CHECK(found.find("link") != found.end());
+}
+
+BOOST_AUTO_TEST_CASE( links_followed )
+{
+    path target = new_tree_in_sandbox();
+
+    path root = new_directory_in_sandbox();
+    create_symlink(root / "link", target);
+
+    recursion_options options;
+    options.follow_symlinks = true;
+
+    map<string, int> found = walk(root, options);
+
+    BOOST_CHECK_EQUAL(found.size(), 7U);
+    BOOST_CHECK_EQUAL(found["link"], 0);
+    BOOST_CHECK_EQUAL(found["alice"], 1);
+    BOOST_CHECK_EQUAL(found["fred"], 3);
+}
+
+BOOST_AUTO_TEST_CASE( link_cycle_not_followed )
+{
+    path root = new_tree_in_sandbox();
+    create_symlink(root / "bob" / "jim" / "loop", root);
+
+    recursion_options options;
+    options.follow_symlinks = true;
+
+    map<string, int> found = walk(root, options);
+
+    BOOST_CHECK_EQUAL(found.size(), 7U);
+    BOOST_CHECK_EQUAL(found["loop"], 2);
+}
+
+BOOST_AUTO_TEST_CASE( broken_link_followed )
+{
+    path root = new_directory_in_sandbox();
+    create_symlink(root / "broken", root / "gibberish");
+
+    recursion_options options;
+    options.follow_symlinks = true;
+
+    map<string, int> found = walk(root, options);
+
+    BOOST_CHECK_EQUAL(found.size(), 1U);
+}
+
+/**
+ * Many subdirectories, so most listings are fetched ahead.
+ */
+BOOST_AUTO_TEST_CASE( wide_tree )
+{
+    path root = new_directory_in_sandbox();
+    for (int i = 0; i < 30; ++i)
+    {
+        path directory = root / ("dir" + lexical_cast<string>(i));
+        create_directory(directory);
+
+        for (int j = 0; j < 5; ++j)
+        {
+            ofstream(
+                directory /
+                ("file" + lexical_cast<string>(i) + "_" +
+                 lexical_cast<string>(j)));
+        }
+    }
+
+    map<string, int> found = walk(root);
+
+    BOOST_CHECK_EQUAL(found.size(), 30U * 6U);
+}
+
+/**
+ * With no budget, nothing is fetched ahead but the walk still completes.
+ */
+BOOST_AUTO_TEST_CASE( no_budget_one_channel )
+{
+    recursion_options options;
+    options.concurrency = 1;
+    options.memory_budget = 0;
+
+    map<string, int> found = walk(new_tree_in_sandbox(), options);
+
+    BOOST_CHECK_EQUAL(found.size(), 6U);
+}
+
+BOOST_AUTO_TEST_CASE( zero_concurrency )
+{
+    recursion_options options;
+    options.concurrency = 0;
+
+    BOOST_CHECK_THROW(
+        recursive_directory_iterator(
+            filesystem(), to_remote_path(new_tree_in_sandbox()), options),
+        std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
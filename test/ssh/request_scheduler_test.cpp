@@ -0,0 +1,357 @@
+/**
+    @file
+
+    Tests for ordering requests that share a session.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the 
+    OpenSSL project's "OpenSSL" library (or with modified versions of it, 
+    with unchanged license). You may copy and distribute such a system 
+    following the terms of the GNU GPL for this program and the licenses 
+    of the other code concerned. The GNU General Public License gives 
+    permission to release a modified version without this exception; this 
+    exception also makes it possible to release a modified version which 
+    carries forward this exception.
+
+    @endif
+*/
+
+#include <ssh/detail/request_scheduler.hpp> // test subject
+
+#include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp> // milliseconds
+#include <boost/noncopyable.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/ref.hpp> // ref
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp> // unique_lock
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <cstddef> // size_t
+#include <stdexcept> // invalid_argument
+#include <string>
+#include <vector>
+
+using ssh::detail::request_priority;
+using ssh::detail::request_scheduler;
+
+using boost::bind;
+using boost::posix_time::milliseconds;
+using boost::ptr_vector;
+using boost::ref;
+using boost::thread;
+using boost::unique_lock;
+
+using std::size_t;
+using std::string;
+using std::vector;
+
+namespace {
+
+    /**
+     * Requests queued behind one that holds the session, then let go.
+     */
+    class queue_fixture : private boost::noncopyable
+    {
+    public:
+
+        queue_fixture() : m_scheduler(3), m_released(false)
+        {
+            m_scheduler.lock(request_priority::bulk);
+        }
+
+        ~queue_fixture()
+        {
+            release();
+        }
+
+        /**
+         * Queue a request, named for the order it is granted in.
+         *
+         * Waits long enough for it to be queued before returning.
+         */
+        void queue(request_priority::value priority, const string& name)
+        {
+            m_threads.push_back(
+                new thread(
+                    bind(
+                        &queue_fixture::request, this, priority, name)));
+
+            boost::this_thread::sleep(milliseconds(50));
+        }
+
+        /**
+         * Let the queued requests have the session and wait for them all.
+         */
+        void release()
+        {
+            if (m_released)
+                return;
+
+            m_released = true;
+            m_scheduler.unlock();
+
+            for (size_t i = 0; i < m_threads.size(); ++i)
+            {
+                m_threads[i].join();
+            }
+        }
+
+        /**
+         * Names of the requests in the order they had the session.
+         */
+        string order()
+        {
+            release();
+
+            string order;
+            for (size_t i = 0; i < m_granted.size(); ++i)
+            {
+                order += m_granted[i];
+            }
+
+            return order;
+        }
+
+    private:
+
+        void request(request_priority::value priority, const string& name)
+        {
+            m_scheduler.lock(priority);
+            unique_lock<request_scheduler> lock(
+                m_scheduler, boost::adopt_lock);
+
+            // Safe as the scheduler lets only one of us in at a time
+            m_granted.push_back(name);
+            boost::this_thread::sleep(milliseconds(1));
+        }
+
+        request_scheduler m_scheduler;
+        bool m_released;
+        ptr_vector<thread> m_threads;
+        vector<string> m_granted;
+    };
+
+    /**
+     * Something to watch while waiting for a release, that blocks until
+     * stopped.
+     */
+    class blocking_watch : private boost::noncopyable
+    {
+    public:
+
+        blocking_watch() : m_calls(0), m_watching(false), m_stopped(false) {}
+
+        void watch()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            ++m_calls;
+            m_watching = true;
+            m_changed.notify_all();
+
+            while (!m_stopped)
+            {
+                m_changed.wait(lock);
+            }
+
+            m_watching = false;
+        }
+
+        void wait_until_watched()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            while (!m_watching)
+            {
+                m_changed.wait(lock);
+            }
+        }
+
+        void stop()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            m_stopped = true;
+            m_changed.notify_all();
+        }
+
+        int calls()
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+
+            return m_calls;
+        }
+
+    private:
+        boost::mutex m_mutex;
+        boost::condition_variable m_changed;
+        int m_calls;
+        bool m_watching;
+        bool m_stopped;
+    };
+
+    void wait_for_release(
+        request_scheduler& scheduler, unsigned long releases,
+        blocking_watch& watch)
+    {
+        scheduler.wait_for_release(
+            releases, bind(&blocking_watch::watch, &watch));
+    }
+
+}
+
+BOOST_AUTO_TEST_SUITE(request_scheduler_tests)
+
+BOOST_AUTO_TEST_CASE( uncontended )
+{
+    request_scheduler scheduler;
+
+    {
+        unique_lock<request_scheduler> lock(scheduler);
+        BOOST_CHECK(!scheduler.try_lock());
+    }
+
+    scheduler.lock(request_priority::bulk);
+    BOOST_CHECK(!scheduler.try_lock());
+    scheduler.unlock();
+
+    BOOST_CHECK(scheduler.try_lock());
+    scheduler.unlock();
+}
+
+BOOST_AUTO_TEST_CASE( same_priority_in_order )
+{
+    queue_fixture requests;
+
+    requests.queue(request_priority::bulk, "a");
+    requests.queue(request_priority::bulk, "b");
+    requests.queue(request_priority::bulk, "c");
+
+    BOOST_CHECK_EQUAL(requests.order(), "abc");
+}
+
+BOOST_AUTO_TEST_CASE( interactive_overtakes_bulk )
+{
+    queue_fixture requests;
+
+    requests.queue(request_priority::bulk, "c");
+    requests.queue(request_priority::bulk, "d");
+    requests.queue(request_priority::interactive, "a");
+    requests.queue(request_priority::interactive, "b");
+
+    BOOST_CHECK_EQUAL(requests.order(), "abcd");
+}
+
+BOOST_AUTO_TEST_CASE( bulk_not_starved )
+{
+    queue_fixture requests;
+
+    // Only three interactive requests may overtake a bulk one in a row
+    requests.queue(request_priority::bulk, "d");
+    requests.queue(request_priority::bulk, "h");
+    for (int i = 0; i < 6; ++i)
+    {
+        requests.queue(request_priority::interactive, string(1, "abcefg"[i]));
+    }
+
+    BOOST_CHECK_EQUAL(requests.order(), "abcdefgh");
+}
+
+BOOST_AUTO_TEST_CASE( no_burst )
+{
+    BOOST_CHECK_THROW(request_scheduler(0), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE( releases_counted )
+{
+    request_scheduler scheduler;
+    BOOST_CHECK_EQUAL(scheduler.releases(), 0U);
+
+    scheduler.lock(request_priority::bulk);
+    scheduler.unlock();
+    {
+        unique_lock<request_scheduler> lock(scheduler);
+    }
+
+    BOOST_CHECK_EQUAL(scheduler.releases(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE( wait_for_past_release )
+{
+    request_scheduler scheduler;
+    scheduler.lock(request_priority::bulk);
+    scheduler.unlock();
+
+    // Would never return if it watched
+    blocking_watch watch;
+    wait_for_release(scheduler, 0, watch);
+
+    BOOST_CHECK_EQUAL(watch.calls(), 0);
+}
+
+/**
+ * Only one waiter watches; a release lets the others go while it does.
+ */
+BOOST_AUTO_TEST_CASE( one_watcher )
+{
+    request_scheduler scheduler;
+    blocking_watch watch;
+
+    thread watcher(bind(&wait_for_release, ref(scheduler), 0, ref(watch)));
+    watch.wait_until_watched();
+
+    thread waiter(bind(&wait_for_release, ref(scheduler), 0, ref(watch)));
+
+    scheduler.lock(request_priority::bulk);
+    scheduler.unlock();
+    waiter.join();
+
+    BOOST_CHECK_EQUAL(watch.calls(), 1);
+
+    watch.stop();
+    watcher.join();
+}
+
+/**
+ * When the watcher is done, the others stop waiting so one of them can
+ * take over.
+ */
+BOOST_AUTO_TEST_CASE( watcher_finishing_ends_wait )
+{
+    request_scheduler scheduler;
+    blocking_watch watch;
+
+    thread watcher(bind(&wait_for_release, ref(scheduler), 0, ref(watch)));
+    watch.wait_until_watched();
+
+    thread waiter(bind(&wait_for_release, ref(scheduler), 0, ref(watch)));
+
+    watch.stop();
+    watcher.join();
+    waiter.join();
+
+    BOOST_CHECK_EQUAL(scheduler.releases(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
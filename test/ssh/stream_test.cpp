@@ -39,26 +39,44 @@
 
 #include <ssh/stream.hpp> // test subject
 
+#include <ssh/bandwidth.hpp> // bandwidth_limiter
+
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
 #include <boost/bind/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp> // microsec_clock
 #include <boost/filesystem/fstream.hpp> // ofstream
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/system/system_error.hpp>
 #include <boost/test/unit_test.hpp>
 #include <boost/thread/future.hpp> // packaged_task
 #include <boost/thread/thread.hpp>
 
+#include <algorithm> // max
+#include <cstddef> // size_t
+#include <iterator> // istreambuf_iterator
 #include <string>
 #include <vector>
 
 #include <sys/stat.h>
 #include <io.h> // chmod
 
+using ssh::bandwidth_limiter;
+using ssh::bandwidth_schedule;
 using ssh::session;
+using ssh::filesystem::borrowed_channel;
 using ssh::filesystem::openmode;
 using ssh::filesystem::sftp_filesystem;
 
 using boost::bind;
 using boost::filesystem::path;
+using boost::make_shared;
 using boost::packaged_task;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
+using boost::shared_ptr;
 using boost::system::system_error;
 using boost::thread;
 
@@ -66,6 +84,7 @@ using test::ssh::sandbox_fixture;
 using test::ssh::session_fixture;
 
 using std::runtime_error;
+using std::size_t;
 using std::string;
 using std::vector;
 
@@ -1705,6 +1724,36 @@ namespace {
         return r;
     }
 
+    template<typename Channel>
+    void upload(Channel& channel, const path& target, size_t size)
+    {
+        ssh::filesystem::ofstream stream(channel, target);
+
+        string block(32768, 'x');
+        for (size_t written = 0; written < size; written += block.size())
+        {
+            stream.write(block.data(), block.size());
+        }
+
+        stream.close();
+    }
+
+    size_t count_entries(sftp_filesystem& filesystem, const path& directory)
+    {
+        size_t count = 0;
+        for (ssh::filesystem::directory_iterator it =
+                filesystem.directory_iterator(directory);
+            it != filesystem.directory_iterator(); ++it)
+        {
+            if (it->name() != "." && it->name() != "..")
+            {
+                ++count;
+            }
+        }
+
+        return count;
+    }
+
 }
 
 BOOST_AUTO_TEST_CASE( stream_read_on_different_threads )
@@ -1754,6 +1803,138 @@ BOOST_AUTO_TEST_CASE( parallel_file_closing )
     BOOST_CHECK_EQUAL(ps.get_future().get(), data);
 }
 
+BOOST_AUTO_TEST_CASE( streams_on_borrowed_channels )
+{
+    string data = large_data();
+
+    path source = new_file_in_sandbox(data);
+    path target = new_file_in_sandbox();
+
+    vector<shared_ptr<borrowed_channel> > channels =
+        filesystem().borrow_channels(2);
+    BOOST_REQUIRE_EQUAL(channels.size(), 2U);
+
+    ssh::filesystem::ifstream reader(*channels[0], to_remote_path(source));
+    packaged_task<string> read(bind(get_first_token, boost::ref(reader)));
+    thread(boost::ref(read)).detach();
+
+    thread uploader(
+        bind(
+            upload<borrowed_channel>, boost::ref(*channels[1]),
+            to_remote_path(target), 1024 * 1024));
+
+    // The filesystem's own channel carries on alongside them
+    BOOST_CHECK_EQUAL(
+        count_entries(filesystem(), to_remote_path(sandbox())), 2U);
+
+    BOOST_CHECK_EQUAL(read.get_future().get(), data);
+
+    uploader.join();
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(target), 1024U * 1024);
+}
+
+namespace {
+
+    double seconds_since(ptime start)
+    {
+        return (microsec_clock::universal_time() - start).total_milliseconds()
+            / 1000.0;
+    }
+
+}
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+// Listings shouldn't queue behind every block of an upload on the same
+// session, only behind the one being written, so report how long they take
+BOOST_AUTO_TEST_CASE( listing_during_upload )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    for (int i = 0; i < 10; ++i)
+    {
+        new_file_in_sandbox();
+    }
+
+    path target = new_file_in_sandbox();
+
+    thread uploader(
+        bind(
+            upload<sftp_filesystem>, boost::ref(filesystem()),
+            to_remote_path(target),
+            64 * 1024 * 1024));
+
+    // Let the upload get going
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+
+    time_duration slowest;
+    time_duration total;
+    const int listings = 20;
+    for (int i = 0; i < listings; ++i)
+    {
+        ptime start = microsec_clock::universal_time();
+        BOOST_CHECK_EQUAL(
+            count_entries(filesystem(), to_remote_path(sandbox())), 11U);
+        time_duration latency = microsec_clock::universal_time() - start;
+
+        slowest = (std::max)(slowest, latency);
+        total += latency;
+    }
+
+    uploader.join();
+
+    BOOST_TEST_MESSAGE(
+        "Listing during upload: mean " <<
+        (total / listings).total_milliseconds() << "ms, slowest " <<
+        slowest.total_milliseconds() << "ms");
+
+    BOOST_CHECK_EQUAL(
+        boost::filesystem::file_size(target), 64U * 1024 * 1024);
+}
+
+BOOST_AUTO_TEST_CASE( upload_held_to_bandwidth_limit )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    test_session().limit_bandwidth(
+        make_shared<bandwidth_limiter>(bandwidth_schedule(512 * 1024)));
+
+    path target = new_file_in_sandbox();
+
+    ptime start = microsec_clock::universal_time();
+    upload(filesystem(), to_remote_path(target), 1024 * 1024);
+    double seconds = seconds_since(start);
+
+    BOOST_TEST_MESSAGE(
+        "1 MiB upload at 512 KiB/s took " << seconds << "s (expected 2s)");
+}
+
+BOOST_AUTO_TEST_CASE( download_held_to_bandwidth_limit )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    path source = new_file_in_sandbox(string(1024 * 1024, 'x'));
+
+    test_session().limit_bandwidth(
+        make_shared<bandwidth_limiter>(bandwidth_schedule(512 * 1024)));
+
+    ptime start = microsec_clock::universal_time();
+    ssh::filesystem::ifstream stream(filesystem(), to_remote_path(source));
+    string data(
+        (std::istreambuf_iterator<char>(stream)),
+        std::istreambuf_iterator<char>());
+    double seconds = seconds_since(start);
+
+    BOOST_TEST_MESSAGE(
+        "1 MiB download at 512 KiB/s took " << seconds << "s (expected 2s)");
+    BOOST_CHECK_EQUAL(data.size(), 1024U * 1024);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
 BOOST_AUTO_TEST_SUITE_END();
 
 BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,282 @@
+/**
+    @file
+
+    Tests for splitting a tar stream into the files it contains.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#include "swish/tar_demultiplexer.hpp" // test subject
+
+#include "swish/block_transfer.hpp" // byte_source, istream_source
+#include "swish/tar.hpp" // tar_writer
+
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef> // size_t
+#include <sstream> // istringstream, ostringstream
+#include <stdexcept> // runtime_error
+#include <string>
+
+using swish::block_transfer::byte_source;
+using swish::block_transfer::istream_source;
+using swish::block_transfer::ostream_sink;
+using swish::tar::tar_demultiplexer;
+using swish::tar::tar_writer;
+
+using boost::shared_ptr;
+
+using std::istringstream;
+using std::ostringstream;
+using std::size_t;
+using std::string;
+
+namespace {
+
+    /**
+     * Byte source owning the stream it reads.
+     */
+    class string_source : public byte_source
+    {
+    public:
+        explicit string_source(const string& data, bool* closed=NULL)
+            : m_stream(data), m_source(m_stream), m_closed(closed) {}
+
+        ~string_source()
+        {
+            if (m_closed)
+                *m_closed = true;
+        }
+
+        virtual size_t read(char* buffer, size_t size)
+        {
+            return m_source.read(buffer, size);
+        }
+
+    private:
+        istringstream m_stream;
+        istream_source m_source;
+        bool* m_closed;
+    };
+
+    void add_file(tar_writer& archive, const string& name, const string& data)
+    {
+        istringstream in(data);
+        istream_source source(in);
+        archive.add_file(name, data.size(), 1400000000, source);
+    }
+
+    /**
+     * Archive as `tar -cf - .` would write it: entries prefixed with "./".
+     */
+    shared_ptr<byte_source> archive_of_tree(bool* closed=NULL)
+    {
+        ostringstream out;
+        ostream_sink sink(out);
+        tar_writer archive(sink);
+        archive.add_directory("./", 1400000000);
+        add_file(archive, "./a", "first");
+        archive.add_directory("./dir", 1400000000);
+        add_file(archive, "./dir/b", string(2000, 'b'));
+        add_file(archive, "./c", "third");
+        archive.finish();
+
+        return boost::make_shared<string_source>(out.str(), closed);
+    }
+
+    string read_all(shared_ptr<byte_source> source)
+    {
+        BOOST_REQUIRE(source);
+
+        string data;
+        char buffer[100];
+        while (size_t count = source->read(buffer, sizeof(buffer)))
+        {
+            data.append(buffer, count);
+        }
+
+        return data;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(tar_demultiplexer_tests)
+
+BOOST_AUTO_TEST_CASE( in_order )
+{
+    tar_demultiplexer files(archive_of_tree());
+
+    BOOST_CHECK_EQUAL(read_all(files.open("a")), "first");
+    BOOST_CHECK(read_all(files.open("dir/b")) == string(2000, 'b'));
+    BOOST_CHECK_EQUAL(read_all(files.open("c")), "third");
+
+    BOOST_CHECK_EQUAL(files.spooled_bytes(), 0U);
+    BOOST_CHECK_EQUAL(files.discarded_bytes(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE( out_of_order_spooled )
+{
+    tar_demultiplexer files(archive_of_tree());
+
+    BOOST_CHECK_EQUAL(read_all(files.open("c")), "third");
+    BOOST_CHECK_EQUAL(files.spooled_bytes(), 2005U);
+
+    BOOST_CHECK(read_all(files.open("dir/b")) == string(2000, 'b'));
+    BOOST_CHECK_EQUAL(read_all(files.open("a")), "first");
+    BOOST_CHECK_EQUAL(files.spooled_bytes(), 0U);
+}
+
+/**
+ * A file that doesn't fit in the spool ends the archive rather than being
+ * read and thrown away.
+ */
+BOOST_AUTO_TEST_CASE( spool_limit )
+{
+    bool closed = false;
+    tar_demultiplexer files(archive_of_tree(&closed), 1000);
+
+    BOOST_CHECK(!files.open("c"));
+    BOOST_CHECK(closed);
+    BOOST_CHECK_EQUAL(files.spooled_bytes(), 5U);
+    BOOST_CHECK_EQUAL(files.discarded_bytes(), 0U);
+
+    BOOST_CHECK(!files.open("dir/b"));
+    BOOST_CHECK_EQUAL(read_all(files.open("a")), "first");
+}
+
+BOOST_AUTO_TEST_CASE( names_normalised )
+{
+    tar_demultiplexer files(archive_of_tree());
+
+    BOOST_CHECK_EQUAL(read_all(files.open("./a")), "first");
+    BOOST_CHECK(read_all(files.open("/dir/b")) == string(2000, 'b'));
+}
+
+BOOST_AUTO_TEST_CASE( missing_file )
+{
+    tar_demultiplexer files(archive_of_tree());
+
+    BOOST_CHECK(!files.open("nonexistent"));
+    BOOST_CHECK(!files.open("dir"));
+
+    // Everything was spooled on the way
+    BOOST_CHECK_EQUAL(read_all(files.open("c")), "third");
+}
+
+BOOST_AUTO_TEST_CASE( opened_once )
+{
+    tar_demultiplexer files(archive_of_tree());
+
+    BOOST_CHECK_EQUAL(read_all(files.open("a")), "first");
+    BOOST_CHECK(!files.open("a"));
+
+    // Asking again didn't consume the rest of the archive
+    BOOST_CHECK_EQUAL(files.spooled_bytes(), 0U);
+    BOOST_CHECK(read_all(files.open("dir/b")) == string(2000, 'b'));
+}
+
+BOOST_AUTO_TEST_CASE( live_file_detached )
+{
+    tar_demultiplexer files(archive_of_tree());
+
+    shared_ptr<byte_source> b = files.open("dir/b");
+    char buffer[10];
+    BOOST_REQUIRE_EQUAL(b->read(buffer, sizeof(buffer)), sizeof(buffer));
+
+    BOOST_CHECK_EQUAL(read_all(files.open("c")), "third");
+
+    // With "a", passed over on the way to b
+    BOOST_CHECK_EQUAL(files.spooled_bytes(), 1995U);
+
+    BOOST_CHECK(read_all(b) == string(1990, 'b'));
+    b.reset();
+    BOOST_CHECK_EQUAL(files.spooled_bytes(), 5U);
+}
+
+/**
+ * The rest of a file being read takes up the spool like any other.
+ */
+BOOST_AUTO_TEST_CASE( live_file_counts_against_spool )
+{
+    bool closed = false;
+    tar_demultiplexer files(archive_of_tree(&closed), 2000);
+
+    shared_ptr<byte_source> a = files.open("a");
+    shared_ptr<byte_source> b = files.open("dir/b");
+    BOOST_CHECK_EQUAL(files.spooled_bytes(), 5U);
+
+    // The rest of b would take the spool past its limit
+    BOOST_CHECK(!files.open("c"));
+    BOOST_CHECK(closed);
+    BOOST_CHECK_EQUAL(read_all(a), "first");
+}
+
+BOOST_AUTO_TEST_CASE( live_file_too_large_to_detach )
+{
+    bool closed = false;
+    tar_demultiplexer files(archive_of_tree(&closed), 1000);
+
+    shared_ptr<byte_source> b = files.open("dir/b");
+
+    BOOST_CHECK(!files.open("c"));
+    BOOST_CHECK(closed);
+    BOOST_CHECK_EQUAL(files.discarded_bytes(), 0U);
+
+    char buffer[10];
+    BOOST_CHECK_THROW(b->read(buffer, sizeof(buffer)), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( released_file_discarded )
+{
+    tar_demultiplexer files(archive_of_tree());
+
+    files.open("dir/b");
+
+    BOOST_CHECK_EQUAL(read_all(files.open("c")), "third");
+
+    // Only the file passed over on the way to the released one is kept
+    BOOST_CHECK_EQUAL(files.spooled_bytes(), 5U);
+    BOOST_CHECK_EQUAL(files.discarded_bytes(), 2000U);
+}
+
+BOOST_AUTO_TEST_CASE( outlives_demultiplexer )
+{
+    shared_ptr<byte_source> a;
+    {
+        tar_demultiplexer files(archive_of_tree());
+        a = files.open("a");
+    }
+
+    BOOST_CHECK_EQUAL(read_all(a), "first");
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -0,0 +1,643 @@
+/**
+    @file
+
+    Tests for writing tar archives and unpacking them on the server.
+
+    @if license
+
+    Copyright (C) 2014  Alexander Lamaison <awl03@doc.ic.ac.uk>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+    In addition, as a special exception, the the copyright holders give you
+    permission to combine this program with free software programs or the
+    OpenSSL project's "OpenSSL" library (or with modified versions of it,
+    with unchanged license). You may copy and distribute such a system
+    following the terms of the GNU GPL for this program and the licenses
+    of the other code concerned. The GNU General Public License gives
+    permission to release a modified version without this exception; this
+    exception also makes it possible to release a modified version which
+    carries forward this exception.
+
+    @endif
+*/
+
+#include "sandbox_fixture.hpp" // sandbox_fixture
+#include "session_fixture.hpp" // session_fixture
+
+#include "swish/tar.hpp" // test subject
+
+#include "test/common_boost/benchmark.hpp" // benchmarks_enabled
+
+#include <ssh/exec_channel.hpp>
+#include <ssh/session.hpp>
+#include <ssh/stream.hpp> // ofstream
+
+#include <boost/cstdint.hpp> // uintmax_t
+#include <boost/date_time/posix_time/posix_time.hpp> // microsec_clock
+#include <boost/filesystem/fstream.hpp> // ifstream
+#include <boost/filesystem/operations.hpp> // exists, create_directory
+#include <boost/lexical_cast.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <cstddef> // size_t
+#include <cstdlib> // strtoul
+#include <iomanip> // setfill, setw
+#include <iterator> // istreambuf_iterator
+#include <map>
+#include <sstream> // istringstream, ostringstream
+#include <stdexcept> // runtime_error, invalid_argument
+#include <string>
+
+using swish::block_transfer::byte_sink;
+using swish::block_transfer::byte_source;
+using swish::block_transfer::istream_source;
+using swish::block_transfer::ostream_sink;
+using swish::tar::tar_entry;
+using swish::tar::tar_reader;
+using swish::tar::tar_writer;
+using swish::tar::TAR_BLOCK_SIZE;
+
+using ssh::exec_channel;
+using ssh::session;
+using ssh::filesystem::sftp_filesystem;
+
+using test::ssh::sandbox_fixture;
+using test::ssh::session_fixture;
+
+using boost::filesystem::path;
+using boost::lexical_cast;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
+using boost::posix_time::time_duration;
+using boost::uintmax_t;
+
+using std::istringstream;
+using std::ostringstream;
+using std::size_t;
+using std::string;
+
+namespace {
+
+    void add_file(tar_writer& archive, const string& name, const string& data)
+    {
+        istringstream in(data);
+        istream_source source(in);
+        archive.add_file(name, data.size(), 1400000000, source);
+    }
+
+    string field(const string& header, size_t offset, size_t width)
+    {
+        string text = header.substr(offset, width);
+        return text.substr(0, text.find('\0'));
+    }
+
+    unsigned long octal_field(
+        const string& header, size_t offset, size_t width)
+    {
+        return std::strtoul(field(header, offset, width).c_str(), NULL, 8);
+    }
+
+    unsigned long checksum_of(string header)
+    {
+        std::fill(header.begin() + 148, header.begin() + 156, ' ');
+
+        unsigned long sum = 0;
+        for (size_t i = 0; i < header.size(); ++i)
+        {
+            sum += static_cast<unsigned char>(header[i]);
+        }
+
+        return sum;
+    }
+
+    double files_per_second(size_t files, time_duration duration)
+    {
+        double seconds = (std::max)(
+            duration.total_microseconds(), time_duration::tick_type(1)) /
+            1000000.0;
+        return files / seconds;
+    }
+
+    /**
+     * Change the type of the first entry, keeping the checksum right.
+     */
+    void retype_first_header(string& archive, char type)
+    {
+        archive[156] = type;
+
+        ostringstream checksum;
+        checksum << std::oct << std::setw(6) << std::setfill('0')
+            << checksum_of(archive.substr(0, TAR_BLOCK_SIZE));
+        archive.replace(148, 7, checksum.str() + '\0');
+    }
+
+    /**
+     * Everything left in the current entry.
+     */
+    string read_entry(tar_reader& reader)
+    {
+        string data;
+        char buffer[100];
+        while (size_t count = reader.read(buffer, sizeof(buffer)))
+        {
+            data.append(buffer, count);
+        }
+
+        return data;
+    }
+
+    string read_file(const path& file)
+    {
+        boost::filesystem::ifstream in(file, std::ios::binary);
+        return string(
+            (std::istreambuf_iterator<char>(in)),
+            std::istreambuf_iterator<char>());
+    }
+
+    /**
+     * Feeds an archive to a command on the server.
+     */
+    class command_sink : public byte_sink
+    {
+    public:
+        explicit command_sink(exec_channel& command) : m_command(command) {}
+
+        virtual void write(const char* data, size_t size)
+        {
+            m_command.write(data, size);
+        }
+
+    private:
+        exec_channel& m_command;
+    };
+
+    /**
+     * Archive written by a command on the server.
+     */
+    class command_source : public byte_source
+    {
+    public:
+        explicit command_source(exec_channel& command) : m_command(command)
+        {}
+
+        virtual size_t read(char* buffer, size_t size)
+        {
+            return m_command.read(buffer, size);
+        }
+
+    private:
+        exec_channel& m_command;
+    };
+
+    class remote_fixture : public session_fixture, public sandbox_fixture
+    {
+    public:
+
+        remote_fixture()
+        {
+            test_session().authenticate_by_key_files(
+                user(), public_key_path(), private_key_path(), "");
+        }
+
+        /**
+         * Unpack whatever `fill` archives into `directory` on the server.
+         */
+        template<typename Filler>
+        void unpack_remotely(const path& directory, Filler fill)
+        {
+            exec_channel tar = test_session().execute(
+                "cd '" + to_remote_path(directory).string() +
+                "' && tar -xf -");
+
+            command_sink sink(tar);
+            tar_writer archive(sink);
+            fill(archive);
+            archive.finish();
+
+            int status = tar.wait_for_exit();
+            BOOST_REQUIRE_MESSAGE(status == 0, tar.error_output());
+        }
+    };
+
+    struct small_tree
+    {
+        void operator()(tar_writer& archive) const
+        {
+            archive.add_directory("sub", 1400000000);
+            add_file(archive, "top.txt", "top");
+            add_file(archive, "sub/inner.txt", "inner");
+            add_file(archive, "empty", "");
+            add_file(archive, string(60, 'd') + "/" + string(80, 'f'), "split");
+            add_file(
+                archive, string(150, 'l') + "/" + string(150, 'n'), "long");
+        }
+    };
+
+    struct many_files
+    {
+        explicit many_files(size_t count) : count(count) {}
+
+        void operator()(tar_writer& archive) const
+        {
+            string data(2048, 'x');
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (i % 1000 == 0)
+                    archive.add_directory(
+                        "d" + lexical_cast<string>(i / 1000), 1400000000);
+
+                add_file(
+                    archive,
+                    "d" + lexical_cast<string>(i / 1000) + "/f" +
+                    lexical_cast<string>(i), data);
+            }
+        }
+
+        size_t count;
+    };
+}
+
+BOOST_AUTO_TEST_SUITE(tar_tests)
+
+BOOST_AUTO_TEST_CASE( empty_archive )
+{
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+    archive.finish();
+
+    BOOST_CHECK(out.str() == string(2 * TAR_BLOCK_SIZE, '\0'));
+    BOOST_CHECK_EQUAL(archive.bytes_written(), 2 * TAR_BLOCK_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE( file_header )
+{
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+    add_file(archive, "dir/file.txt", "hello");
+    archive.finish();
+
+    string data = out.str();
+    BOOST_REQUIRE_EQUAL(data.size(), 4 * TAR_BLOCK_SIZE);
+
+    string header = data.substr(0, TAR_BLOCK_SIZE);
+    BOOST_CHECK_EQUAL(field(header, 0, 100), "dir/file.txt");
+    BOOST_CHECK_EQUAL(octal_field(header, 100, 8), 0644U);
+    BOOST_CHECK_EQUAL(octal_field(header, 124, 12), 5U);
+    BOOST_CHECK_EQUAL(octal_field(header, 136, 12), 1400000000U);
+    BOOST_CHECK_EQUAL(header[156], '0');
+    BOOST_CHECK_EQUAL(field(header, 257, 6), "ustar");
+    BOOST_CHECK_EQUAL(octal_field(header, 148, 8), checksum_of(header));
+
+    // Content padded to a whole block
+    BOOST_CHECK_EQUAL(data.substr(TAR_BLOCK_SIZE, 5), "hello");
+    BOOST_CHECK(
+        data.substr(TAR_BLOCK_SIZE + 5, TAR_BLOCK_SIZE - 5) ==
+        string(TAR_BLOCK_SIZE - 5, '\0'));
+}
+
+BOOST_AUTO_TEST_CASE( directory_header )
+{
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+    archive.add_directory("dir", 0);
+    archive.finish();
+
+    string header = out.str().substr(0, TAR_BLOCK_SIZE);
+    BOOST_CHECK_EQUAL(field(header, 0, 100), "dir/");
+    BOOST_CHECK_EQUAL(header[156], '5');
+    BOOST_CHECK_EQUAL(octal_field(header, 124, 12), 0U);
+}
+
+BOOST_AUTO_TEST_CASE( name_split_into_prefix )
+{
+    string directory(120, 'd');
+    string name(50, 'n');
+
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+    add_file(archive, directory + "/" + name, "x");
+    archive.finish();
+
+    string header = out.str().substr(0, TAR_BLOCK_SIZE);
+    BOOST_CHECK_EQUAL(field(header, 0, 100), name);
+    BOOST_CHECK_EQUAL(field(header, 345, 155), directory);
+    BOOST_CHECK_EQUAL(octal_field(header, 148, 8), checksum_of(header));
+}
+
+BOOST_AUTO_TEST_CASE( long_name )
+{
+    string name = string(150, 'l') + "/" + string(150, 'n');
+
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+    add_file(archive, name, "x");
+    archive.finish();
+
+    string data = out.str();
+
+    // The name comes first, as the content of a pseudo-entry
+    string long_link = data.substr(0, TAR_BLOCK_SIZE);
+    BOOST_CHECK_EQUAL(field(long_link, 0, 100), "././@LongLink");
+    BOOST_CHECK_EQUAL(long_link[156], 'L');
+    BOOST_CHECK_EQUAL(octal_field(long_link, 124, 12), name.size() + 1);
+    BOOST_CHECK_EQUAL(field(data, TAR_BLOCK_SIZE, name.size() + 1), name);
+
+    string header = data.substr(2 * TAR_BLOCK_SIZE, TAR_BLOCK_SIZE);
+    BOOST_CHECK_EQUAL(header[156], '0');
+    BOOST_CHECK_EQUAL(octal_field(header, 124, 12), 1U);
+}
+
+BOOST_AUTO_TEST_CASE( output_buffered )
+{
+    struct counting_sink : public byte_sink
+    {
+        counting_sink() : writes(0) {}
+
+        virtual void write(const char*, size_t) { ++writes; }
+
+        size_t writes;
+    } sink;
+
+    tar_writer archive(sink, 64 * 1024);
+    for (int i = 0; i < 20; ++i)
+    {
+        add_file(archive, "file" + lexical_cast<string>(i), "tiny");
+    }
+    archive.finish();
+
+    // 42 blocks all fit in one write
+    BOOST_CHECK_EQUAL(sink.writes, 1U);
+}
+
+BOOST_AUTO_TEST_CASE( short_source )
+{
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+
+    istringstream in("abc");
+    istream_source source(in);
+    BOOST_CHECK_THROW(
+        archive.add_file("file", 10, 0, source), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( bad_buffer_size )
+{
+    ostringstream out;
+    ostream_sink sink(out);
+
+    BOOST_CHECK_THROW(tar_writer archive(sink, 1000), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE( read_back )
+{
+    string long_name = string(150, 'l') + "/" + string(150, 'n');
+    string split_name = string(120, 'd') + "/" + string(50, 'n');
+    string large(3000, 'x');
+
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+    add_file(archive, "small", "abc");
+    archive.add_directory("dir", 0);
+    add_file(archive, long_name, "long");
+    add_file(archive, split_name, "split");
+    add_file(archive, "large", large);
+    archive.finish();
+
+    istringstream in(out.str());
+    istream_source source(in);
+    tar_reader reader(source);
+    tar_entry entry;
+
+    BOOST_REQUIRE(reader.next(entry));
+    BOOST_CHECK_EQUAL(entry.name, "small");
+    BOOST_CHECK(entry.is_file());
+    BOOST_CHECK_EQUAL(entry.size, 3U);
+    BOOST_CHECK_EQUAL(read_entry(reader), "abc");
+
+    BOOST_REQUIRE(reader.next(entry));
+    BOOST_CHECK_EQUAL(entry.name, "dir/");
+    BOOST_CHECK(entry.is_directory());
+
+    BOOST_REQUIRE(reader.next(entry));
+    BOOST_CHECK_EQUAL(entry.name, long_name);
+    BOOST_CHECK_EQUAL(read_entry(reader), "long");
+
+    BOOST_REQUIRE(reader.next(entry));
+    BOOST_CHECK_EQUAL(entry.name, split_name);
+    BOOST_CHECK_EQUAL(read_entry(reader), "split");
+
+    BOOST_REQUIRE(reader.next(entry));
+    BOOST_CHECK_EQUAL(entry.name, "large");
+    BOOST_CHECK(read_entry(reader) == large);
+
+    BOOST_CHECK(!reader.next(entry));
+    BOOST_CHECK(!reader.next(entry));
+}
+
+BOOST_AUTO_TEST_CASE( unread_content_skipped )
+{
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+    add_file(archive, "first", string(1000, 'x'));
+    add_file(archive, "second", "abc");
+    archive.finish();
+
+    istringstream in(out.str());
+    istream_source source(in);
+    tar_reader reader(source);
+    tar_entry entry;
+
+    BOOST_REQUIRE(reader.next(entry));
+    char buffer[10];
+    BOOST_CHECK_EQUAL(reader.read(buffer, sizeof(buffer)), sizeof(buffer));
+    BOOST_CHECK_EQUAL(reader.remaining(), 990U);
+
+    BOOST_REQUIRE(reader.next(entry));
+    BOOST_CHECK_EQUAL(entry.name, "second");
+    BOOST_CHECK_EQUAL(read_entry(reader), "abc");
+}
+
+BOOST_AUTO_TEST_CASE( pax_path )
+{
+    // What GNU tar writes for names it can't fit in the header
+    string name(200, 'p');
+    string record = " path=" + name + "\n";
+    record = lexical_cast<string>(record.size() + 3) + record;
+
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+    add_file(archive, "PaxHeaders/x", record);
+    add_file(archive, "truncated", "pax");
+    archive.finish();
+
+    string data = out.str();
+    retype_first_header(data, 'x');
+
+    istringstream in(data);
+    istream_source source(in);
+    tar_reader reader(source);
+    tar_entry entry;
+
+    BOOST_REQUIRE(reader.next(entry));
+    BOOST_CHECK_EQUAL(entry.name, name);
+    BOOST_CHECK_EQUAL(read_entry(reader), "pax");
+}
+
+BOOST_AUTO_TEST_CASE( bad_checksum )
+{
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+    add_file(archive, "file", "abc");
+    archive.finish();
+
+    string data = out.str();
+    data[0] = 'g';
+
+    istringstream in(data);
+    istream_source source(in);
+    tar_reader reader(source);
+    tar_entry entry;
+
+    BOOST_CHECK_THROW(reader.next(entry), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( truncated_archive )
+{
+    ostringstream out;
+    ostream_sink sink(out);
+    tar_writer archive(sink);
+    add_file(archive, "file", string(1000, 'x'));
+    archive.finish();
+
+    istringstream in(out.str().substr(0, TAR_BLOCK_SIZE + 100));
+    istream_source source(in);
+    tar_reader reader(source);
+    tar_entry entry;
+
+    BOOST_REQUIRE(reader.next(entry));
+    BOOST_CHECK_THROW(read_entry(reader), std::runtime_error);
+}
+
+BOOST_FIXTURE_TEST_SUITE(remote_tests, remote_fixture)
+
+BOOST_AUTO_TEST_CASE( unpacked_by_server )
+{
+    path directory = new_directory_in_sandbox();
+
+    unpack_remotely(directory, small_tree());
+
+    BOOST_CHECK_EQUAL(read_file(directory / "top.txt"), "top");
+    BOOST_CHECK_EQUAL(read_file(directory / "sub" / "inner.txt"), "inner");
+    BOOST_CHECK(boost::filesystem::exists(directory / "empty"));
+    BOOST_CHECK_EQUAL(
+        read_file(directory / string(60, 'd') / string(80, 'f')), "split");
+    BOOST_CHECK_EQUAL(
+        read_file(directory / string(150, 'l') / string(150, 'n')), "long");
+}
+
+BOOST_AUTO_TEST_CASE( packed_by_server )
+{
+    path directory = new_directory_in_sandbox();
+    unpack_remotely(directory, small_tree());
+
+    exec_channel tar = test_session().execute(
+        "cd '" + to_remote_path(directory).string() + "' && tar -cf - .");
+
+    command_source source(tar);
+    tar_reader reader(source);
+    std::map<string, string> files;
+    tar_entry entry;
+    while (reader.next(entry))
+    {
+        if (entry.is_file())
+            files[entry.name] = read_entry(reader);
+    }
+
+    BOOST_CHECK_EQUAL(tar.wait_for_exit(), 0);
+    BOOST_CHECK_EQUAL(files.size(), 5U);
+    BOOST_CHECK_EQUAL(files["./top.txt"], "top");
+    BOOST_CHECK_EQUAL(files["./sub/inner.txt"], "inner");
+    BOOST_CHECK_EQUAL(files["./empty"], "");
+    BOOST_CHECK_EQUAL(
+        files["./" + string(60, 'd') + "/" + string(80, 'f')], "split");
+    BOOST_CHECK_EQUAL(
+        files["./" + string(150, 'l') + "/" + string(150, 'n')], "long");
+}
+
+BOOST_AUTO_TEST_SUITE(benchmarks)
+
+/**
+ * Small files as one tar stream against one SFTP file each.
+ *
+ * SFTP only gets a sample of the files as, being the slow way, the whole
+ * tree would take too long.
+ */
+BOOST_AUTO_TEST_CASE( small_file_rate )
+{
+    if (!test::benchmarks_enabled())
+        return;
+
+    const size_t tree_size = 50000;
+    const size_t sftp_sample = 1000;
+
+    path tar_directory = new_directory_in_sandbox();
+
+    ptime start = microsec_clock::universal_time();
+    unpack_remotely(tar_directory, many_files(tree_size));
+    time_duration tar_duration = microsec_clock::universal_time() - start;
+
+    BOOST_CHECK(
+        boost::filesystem::exists(
+            tar_directory / "d49" / ("f" + lexical_cast<string>(
+                tree_size - 1))));
+
+    path sftp_directory = new_directory_in_sandbox();
+    sftp_filesystem filesystem = test_session().connect_to_filesystem();
+    string data(2048, 'x');
+
+    start = microsec_clock::universal_time();
+    for (size_t i = 0; i < sftp_sample; ++i)
+    {
+        ssh::filesystem::ofstream out(
+            filesystem,
+            to_remote_path(sftp_directory / ("f" + lexical_cast<string>(i))));
+        out.write(data.data(), data.size());
+    }
+    time_duration sftp_duration = microsec_clock::universal_time() - start;
+
+    double tar_rate = files_per_second(tree_size, tar_duration);
+    double sftp_rate = files_per_second(sftp_sample, sftp_duration);
+
+    BOOST_TEST_MESSAGE(
+        "2 KiB files: tar over exec " << tar_rate << " files/s, SFTP "
+        << sftp_rate << " files/s");
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE_END();
+
+BOOST_AUTO_TEST_SUITE_END();